@@ -0,0 +1,335 @@
+#! /usr/bin/env python3
+# -*- coding=utf-8 -*-
+
+# Compiles a Rufus localization file (usually embedded.loc) into the binary table
+# that Rufus uses at startup instead of parsing the text file. The parsing below
+# mirrors get_supported_locales() and get_loc_data_file() from src/loc_parser.c, so
+# any change to the syntax of loc files must be applied to both.
+# The output may be the same file as the input, in which case the text file is
+# replaced by its table (Rufus detects which one was embedded).
+#
+# Table layout (little endian), see loc_table_* in src/localization.h:
+#   header:  "RUFUSLCB", version, nb_locales, nb_cmds, pool_size
+#   locales: name, desc, lcids, first_cmd, nb_cmds, nb_lcids, line_nr,
+#            version[2], version_line_nr, attributes
+#   cmds:    command, reserved, line_nr, txt[2]
+#   pool:    NUL terminated UTF-8 strings and 4-byte aligned LCID arrays
+#
+# Usage: loc_compile.py <input.loc> <output>
+
+import os
+import re
+import struct
+import sys
+
+LOC_TABLE_MAGIC     = b"RUFUSLCB"
+LOC_TABLE_VERSION   = 1
+LOC_TABLE_NO_STRING = 0xFFFFFFFF
+
+# Must match enum loc_command_type
+LC_GROUP, LC_TEXT, LC_VERSION, LC_LOCALE, LC_BASE, LC_FONT, LC_ATTRIBUTES = range(7)
+
+# Must match parse_cmd[] from src/loc_parser.c
+parse_cmd = {
+    ord('l'): (LC_LOCALE, "ssu"),
+    ord('b'): (LC_BASE, "s"),
+    ord('v'): (LC_VERSION, "u"),
+    ord('t'): (LC_TEXT, "cs"),
+    ord('g'): (LC_GROUP, "c"),
+    ord('f'): (LC_FONT, "si"),
+    ord('a'): (LC_ATTRIBUTES, "s"),
+}
+
+# Must match attr_parse[] from src/loc_parser.c
+attr_parse = { ord('r'): 0x00000001 }
+
+SPACE = (0x20, 0x09)
+strtol_re = re.compile(rb"^[ \t\r\n\v\f]*([+-]?)(0[xX][0-9a-fA-F]+|0[0-7]*|[1-9][0-9]*)")
+
+filename = "?"
+line_nr = 0
+
+def warn(msg):
+    print("{}({}): {}".format(filename, line_nr, msg), file=sys.stderr)
+
+def strtol(s):
+    """Returns the value and whether the whole string was consumed, like strtol(s, &end, 0)"""
+    m = strtol_re.match(bytes(s))
+    if m is None:
+        return 0, len(s) == 0
+    digits = m.group(2)
+    if digits[:2] in (b"0x", b"0X"):
+        v = int(digits, 16)
+    elif digits.startswith(b"0"):
+        v = int(digits, 8)
+    else:
+        v = int(digits)
+    if m.group(1) == b"-":
+        v = -v
+    return v, m.end() == len(s)
+
+def get_loc_cmd(c, line):
+    """Port of get_loc_cmd(): returns (command, [txt], [num], [unum]) or None"""
+    if c not in parse_cmd:
+        warn("unknown command")
+        return None
+    command, arg_types = parse_cmd[c]
+    line = bytearray(line) + b"\0"
+    txt, num, unum = [], [], []
+    i = 0
+    for arg_type in arg_types:
+        while line[i] in SPACE:
+            i += 1
+        r = i
+        if line[i] == 0:
+            warn("missing parameter for command '{}'".format(chr(c)))
+            return None
+        if arg_type == 's':
+            if line[i] != ord('"'):
+                warn("no start quote")
+                return None
+            i += 1
+            r = i
+            while line[i] != 0 and (line[i] != ord('"') or line[i - 1] == ord('\\')):
+                if line[i] == ord('"') and line[i - 1] == ord('\\'):
+                    del line[i - 1]
+                else:
+                    i += 1
+            if line[i] == 0:
+                warn("no end quote")
+                return None
+            txt.append(bytes(line[r:i]))
+            i += 1
+        elif arg_type == 'c':
+            while line[i] != 0 and line[i] not in SPACE:
+                i += 1
+            txt.append(bytes(line[r:i]))
+            if line[i] != 0:
+                i += 1
+        elif arg_type == 'i':
+            if line[i] in (ord(','), ord('.')):
+                while line[i + 1] in SPACE:
+                    i += 1
+                r = i
+            while line[i] != 0 and line[i] not in SPACE and line[i] not in (ord(','), ord('.')):
+                i += 1
+            v, ok = strtol(line[r:i])
+            if not ok:
+                warn("invalid integer")
+                return None
+            num.append(v)
+            if line[i] != 0:
+                i += 1
+        elif arg_type == 'u':
+            tokens = [t for t in re.split(rb"[.,]", bytes(line[i:line.index(0, i)])) if len(t) != 0]
+            if len(tokens) != bytes(line[i:line.index(0, i)]).count(b".") + \
+                bytes(line[i:line.index(0, i)]).count(b",") + 1:
+                warn("internal error (unexpected number of numeric values)")
+                return None
+            unum = [strtol(t)[0] & 0xFFFFFFFF for t in tokens]
+            i = line.index(0, i)
+    return command, txt, num, unum
+
+def get_supported_locales(data):
+    """Port of get_supported_locales(): returns the list of locales"""
+    global line_nr
+    locales = []
+    last = None
+    pos = 0
+    line_nr = 0
+    while pos < len(data):
+        end_of_block = pos
+        # fgets() with a 1024 bytes buffer
+        eol = data.find(b"\n", pos, pos + 1023)
+        nxt = (eol + 1) if eol >= 0 else min(pos + 1023, len(data))
+        line = data[pos:nxt]
+        pos = nxt
+        line_nr += 1
+        i = 0
+        while i < len(line) and line[i] in SPACE:
+            i += 1
+        if i >= len(line) or line[i] not in (ord('l'), ord('v'), ord('a')):
+            continue
+        lcmd = get_loc_cmd(line[i], line[i + 1:])
+        if lcmd is None:
+            continue
+        command, txt, num, unum = lcmd
+        if command == LC_LOCALE:
+            if last is not None:
+                last["end"] = end_of_block
+            last = { "name": txt[0], "desc": txt[1], "lcids": unum, "line_nr": line_nr,
+                     "start": pos, "end": 0, "attributes": 0, "version": (0, 0), "version_line_nr": 0 }
+            locales.append(last)
+        elif command == LC_ATTRIBUTES:
+            if last is None:
+                warn("[a]ttributes cannot precede [l]ocale")
+                continue
+            for a in txt[0]:
+                if a in attr_parse:
+                    last["attributes"] |= attr_parse[a]
+                else:
+                    warn("unknown attribute '{}' - ignored".format(chr(a)))
+        elif command == LC_VERSION:
+            if last is None:
+                warn("[v]ersion cannot precede [l]ocale")
+            elif last["version_line_nr"] != 0:
+                warn("[v]ersion was already provided at line {}".format(last["version_line_nr"]))
+            elif len(unum) != 2:
+                warn("[v]ersion format is invalid")
+            else:
+                last["version"] = (unum[0], unum[1])
+                last["version_line_nr"] = line_nr
+    if last is not None:
+        last["end"] = len(data)
+    return locales
+
+def get_loc_data_line(line, cmds):
+    """Port of get_loc_data_line(), that records the commands instead of dispatching them"""
+    if len(line) == 0:
+        return
+    i = 0
+    while i < len(line) and line[i] in SPACE:
+        i += 1
+    t = line[i] if i < len(line) else 0
+    i += 1
+    if t == ord('#'):
+        return
+    if t == 0 or i >= len(line) or line[i] not in SPACE:
+        warn("syntax error: '{}'".format(bytes(line).decode("utf-8", "replace")))
+        return
+    lcmd = get_loc_cmd(t, line[i:])
+    # Only these commands have an effect when a locale is loaded
+    if lcmd is not None and lcmd[0] in (LC_GROUP, LC_TEXT, LC_BASE):
+        cmds.append((lcmd[0], line_nr, lcmd[1]))
+
+def get_loc_data(data, locale):
+    """Port of the readline loop of get_loc_data_file()"""
+    global line_nr
+    cmds = []
+    buf = bytearray()
+    eol, escape_sequence = False, False
+    eol_char, r, line_nr_incr = 0, 0, 1
+    line_nr = locale["line_nr"]
+    pos = locale["start"]
+    end_offset = locale["end"]
+    while True:
+        if pos < len(data):
+            c = data[pos]
+            pos += 1
+        else:
+            c = -1
+        if c == -1:
+            if not eol:
+                line_nr += line_nr_incr
+            get_loc_data_line(buf, cmds)
+        elif c in (0x0D, 0x0A):
+            if escape_sequence:
+                escape_sequence = False
+            else:
+                if eol_char == 0:
+                    eol_char = c
+                if c == eol_char:
+                    if eol:
+                        line_nr_incr += 1
+                    else:
+                        line_nr += line_nr_incr
+                        line_nr_incr = 1
+                if not eol:
+                    r = len(buf) - 1
+                    while r > 0 and buf[r] in SPACE:
+                        r -= 1
+                    if r < 0:
+                        r = 0
+                    eol = True
+        elif c in SPACE:
+            if escape_sequence:
+                escape_sequence = False
+            elif not eol:
+                buf.append(c)
+        elif c == ord('\\') and not escape_sequence:
+            escape_sequence = True
+        elif escape_sequence:
+            if c == ord('n'):
+                buf += b"\r\n"
+            elif c == ord('"'):
+                buf += b"\\\""
+            elif c == ord('\\'):
+                buf += b"\\"
+            escape_sequence = False
+        else:
+            if eol and c == ord('"') and len(buf) > r and buf[r] == ord('"'):
+                # Collate multiline strings
+                del buf[r:]
+                eol = False
+            else:
+                if eol:
+                    get_loc_data_line(buf, cmds)
+                    eol = False
+                    buf = bytearray()
+                    r = 0
+                buf.append(c)
+        if c == -1 or pos > end_offset:
+            break
+    return cmds
+
+class Pool:
+    def __init__(self):
+        self.data = bytearray()
+        self.strings = {}
+
+    def add_str(self, s):
+        if s is None:
+            return LOC_TABLE_NO_STRING
+        if s not in self.strings:
+            self.strings[s] = len(self.data)
+            self.data += s + b"\0"
+        return self.strings[s]
+
+    def add_u32_array(self, values):
+        while len(self.data) % 4 != 0:
+            self.data.append(0)
+        offset = len(self.data)
+        for v in values:
+            self.data += struct.pack("<I", v)
+        return offset
+
+def compile_table(data):
+    global line_nr
+    locales = get_supported_locales(data)
+    pool = Pool()
+    loc_entries = bytearray()
+    cmd_entries = bytearray()
+    nb_cmds = 0
+    for locale in locales:
+        cmds = get_loc_data(data, locale)
+        line_nr = locale["line_nr"]
+        loc_entries += struct.pack("<IIIIIHHHHHH",
+            pool.add_str(locale["name"]), pool.add_str(locale["desc"]),
+            pool.add_u32_array(locale["lcids"]), nb_cmds, len(cmds),
+            len(locale["lcids"]), min(locale["line_nr"], 0xFFFF),
+            locale["version"][0] & 0xFFFF, locale["version"][1] & 0xFFFF,
+            min(locale["version_line_nr"], 0xFFFF), locale["attributes"])
+        for command, cmd_line_nr, txt in cmds:
+            cmd_entries += struct.pack("<BBHII", command, 0, min(cmd_line_nr, 0xFFFF),
+                pool.add_str(txt[0] if len(txt) > 0 else None),
+                pool.add_str(txt[1] if len(txt) > 1 else None))
+            nb_cmds += 1
+    header = LOC_TABLE_MAGIC + struct.pack("<IIII", LOC_TABLE_VERSION, len(locales), nb_cmds, len(pool.data))
+    return header + loc_entries + cmd_entries + pool.data, len(locales), nb_cmds
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        print("Usage: {} <input.loc> <output>".format(sys.argv[0]), file=sys.stderr)
+        sys.exit(1)
+    filename = os.path.basename(sys.argv[1])
+    with open(sys.argv[1], "rb") as f:
+        data = f.read()
+    if data.startswith(LOC_TABLE_MAGIC):
+        print("{} is already compiled".format(filename))
+        sys.exit(0)
+    table, nb_locales, nb_cmds = compile_table(data)
+    # Write to a temporary file first, so that a failure doesn't leave a truncated table
+    with open(sys.argv[2] + ".tmp", "wb") as f:
+        f.write(table)
+    os.replace(sys.argv[2] + ".tmp", sys.argv[2])
+    print("{}: {} locales, {} commands, {} bytes".format(os.path.basename(sys.argv[2]), nb_locales, nb_cmds, len(table)))
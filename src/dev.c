@@ -44,6 +44,7 @@
 
 #include "drive.h"
 #include "dev.h"
+#include "devcache.h"
 
 extern RUFUS_DRIVE rufus_drive[MAX_DRIVES];
 extern BOOL enable_HDDs, enable_VHDs, use_fake_units, enable_vmdk, usb_debug;
@@ -425,6 +426,83 @@ BOOL GetOpticalMedia(IMG_SAVE* img_save)
 #define FORCED_NAME " USB  SanDisk 3.2Gen1 UAS Device"
 #endif
 
+/* Maximum number of devices that are probed at the same time */
+#define DEVICE_PROBE_THREADS        8
+/* How long we wait for devices to be probed, before listing the ones that are ready */
+#define DEVICE_PROBE_TIMEOUT        2000
+
+// List of USB storage drivers we know - list may be incomplete!
+static const char* usbstor_name[] = {
+	// Standard MS USB storage driver
+	"USBSTOR",
+	// USB card readers, with proprietary drivers (Realtek,etc...)
+	// Mostly "guessed" from http://www.carrona.org/dvrref.php
+	"RTSUER", "CMIUCR", "EUCR",
+	// UASP Drivers *MUST* be listed after this, starting with "UASPSTOR"
+	// (which is Microsoft's native UASP driver for Windows 8 and later)
+	// as we use "UASPSTOR" as a delimiter
+	"UASPSTOR", "VUSBSTOR", "ETRONSTOR", "ASUSSTPT"
+};
+// These are the generic (non USB) storage enumerators we also test
+static const char* genstor_name[] = {
+	// Generic storage drivers (Careful now!)
+	"SCSI", // "STORAGE",	// "STORAGE" is used by 'Storage Spaces" and stuff => DANGEROUS!
+	// Non-USB card reader drivers - This list *MUST* start with "SD" (delimiter)
+	// See http://itdoc.hitachi.co.jp/manuals/3021/30213B5200e/DMDS0094.HTM
+	// Also  http://www.carrona.org/dvrref.php. NB: All members from this list should have
+	// been reported as enumerators by Rufus, when Enum Debug is enabled.
+	"SD", "PCISTOR", "RTSOR", "JMCR", "JMCF", "RIMMPTSK", "RIMSPTSK", "RISD", "RIXDPTSK",
+	"TI21SONY", "ESD7SK", "ESM7SK", "O2MD", "O2SD", "VIACR", "GLREADER"
+};
+
+typedef struct {
+	BOOL has_media;
+	uint64_t size;
+	int hdd_score;
+} dev_media;
+
+/*
+ * What we know about a disk device, which is kept in the device cache between refreshes.
+ * The enumeration properties are populated when a device first appears, the drive number
+ * and media properties by the probing threads, and the label on the UI thread, as it uses
+ * non reentrant calls (GetDriveLabel() returns a static buffer and may call into ext2fs).
+ * The probing threads only write to 'probed', which the UI thread copies to 'media' once
+ * the probe is over, so that a device that is probed again can still be listed meanwhile.
+ */
+typedef struct {
+	usb_device_props props;
+	char* name;
+	char* device_path;		// Device Interface Path of the disk, NULL if it doesn't have one
+	char* hub_path;			// Device Interface Path of the parent hub, NULL if unknown
+	const char* method_str;
+	int drive_number;
+	dev_media probed;		// Media properties, as populated by the probing threads
+	dev_media media;		// Media properties from the last completed probe (UI thread only)
+	BOOL has_media_data;	// Whether 'media' was populated
+	BOOL update_media;		// Whether 'probed' needs to be copied to 'media'
+	BOOL label_probed;
+	BOOL has_label;
+	char letters[27];
+	char listed_letters[27];	// Same as above, minus the UEFI:TOGO partitions
+	char* label;
+} dev_probe;
+
+typedef struct {
+	dev_cache_entry** entries;
+	LONG nb_entries;
+	volatile LONG next;
+	volatile LONG running;
+	volatile LONG refs;
+	volatile LONG detached;
+	HANDLE done;
+} probe_pool;
+
+static dev_cache device_cache = { 0 };
+static BOOL refreshing_devices = FALSE, refresh_requested = FALSE;
+// Drive letters from the last refresh, the disk they belong to and the ones that were notified
+static DWORD logical_drives = 0, notified_drives = 0;
+static int letter_drive_number[26];
+
 void ClearDrives(void)
 {
 	int i;
@@ -438,83 +516,274 @@ void ClearDrives(void)
 	memset(rufus_drive, 0, sizeof(rufus_drive));
 }
 
+static void FreeDeviceProbe(void* data)
+{
+	dev_probe* dp = (dev_probe*)data;
+
+	if (dp == NULL)
+		return;
+	free(dp->name);
+	free(dp->device_path);
+	free(dp->hub_path);
+	free(dp->label);
+	free(dp);
+}
+
 /*
- * Refresh the list of USB devices
+ * Flag the media of all the devices as requiring a new probe on the next refresh.
+ * This must be called whenever the media or partitions of a device may have changed,
+ * as this is something that the device enumeration properties don't tell us.
  */
-BOOL GetDevices(DWORD devnum)
+void InvalidateDevices(void)
+{
+	DevCacheInvalidate(&device_cache, NULL);
+}
+
+/*
+ * Flag the devices that hold one of the drive letters from 'drive_mask' (bit 0 for
+ * 'A:', as with GetLogicalDrives()) as requiring a new probe on the next refresh.
+ * This is meant for the volume and media notifications, that tell us which drive
+ * letters they apply to, whereas other device notifications don't tell us anything.
+ */
+void InvalidateDrives(DWORD drive_mask)
+{
+	notified_drives |= drive_mask;
+}
+
+/*
+ * Return the disk number of the volume mounted as 'letter', or -1 on error.
+ */
+static int GetLetterDriveNumber(char letter)
+{
+	char drive_name[] = "?:\", logical_drive[] = "\\.\?:";
+	HANDLE hDrive;
+	UINT drive_type;
+	int r;
+
+	drive_name[0] = letter;
+	drive_type = GetDriveTypeA(drive_name);
+	if ((drive_type != DRIVE_REMOVABLE) && (drive_type != DRIVE_FIXED))
+		return -1;
+	logical_drive[4] = letter;
+	hDrive = CreateFileWithTimeout(logical_drive, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL, 3000);
+	if (hDrive == INVALID_HANDLE_VALUE)
+		return -1;
+	r = GetDriveNumber(hDrive, logical_drive);
+	CloseHandle(hDrive);
+	return r;
+}
+
+/*
+ * Flag the devices whose volumes appeared, went away or were notified since the last
+ * refresh, as requiring a new probe. Devices without media are always probed again,
+ * as we get no notification when a blank media is inserted into a card reader.
+ */
+static void InvalidateChangedDrives(void)
+{
+	DWORD drives = GetLogicalDrives(), changed;
+	BOOL first_run = (logical_drives == 0);
+	int i, drive_number[2 * ARRAYSIZE(letter_drive_number)], nb_drive_numbers = 0;
+	uint32_t u;
+	dev_probe* dp;
+
+	changed = (drives ^ logical_drives) | notified_drives;
+	logical_drives = drives;
+	notified_drives = 0;
+	for (i = 0; i < ARRAYSIZE(letter_drive_number); i++) {
+		if (!(changed & (1 << i)))
+			continue;
+		// The disk that held the letter, as well as the one that now holds it
+		if ((!first_run) && (letter_drive_number[i] >= 0))
+			drive_number[nb_drive_numbers++] = letter_drive_number[i];
+		letter_drive_number[i] = (drives & (1 << i)) ? GetLetterDriveNumber('A' + i) : -1;
+		if ((!first_run) && (letter_drive_number[i] >= 0))
+			drive_number[nb_drive_numbers++] = letter_drive_number[i];
+	}
+	if (first_run)
+		return;
+
+	for (u = 0; u < device_cache.nb_entries; u++) {
+		dp = (dev_probe*)device_cache.entries[u]->data;
+		if ((dp == NULL) || (!DevCacheIsProbed(device_cache.entries[u])))
+			continue;
+		if (dp->drive_number < 0)
+			continue;
+		for (i = 0; (i < nb_drive_numbers) && (drive_number[i] != dp->drive_number); i++);
+		if ((i < nb_drive_numbers) || (!(dp->update_media ? dp->probed.has_media : dp->media.has_media)))
+			DevCacheInvalidate(&device_cache, device_cache.entries[u]->id);
+	}
+}
+
+void FreeDeviceCache(void)
+{
+	DevCacheFree(&device_cache);
+}
+
+/*
+ * Probe the drive number and media of a device. This is called from the probing
+ * threads, so it must only use calls that are reentrant.
+ */
+static void ProbeDevice(dev_probe* dp)
+{
+	HANDLE hDrive;
+	DWORD drive_index;
+
+	memset(&dp->probed, 0, sizeof(dp->probed));
+
+	// The drive number doesn't change while the device is present
+	if (dp->drive_number < 0) {
+		hDrive = CreateFileWithTimeout(dp->device_path, GENERIC_READ|GENERIC_WRITE,
+			FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL, 3000);
+		if (hDrive == INVALID_HANDLE_VALUE) {
+			uprintf("Could not open '%s': %s", dp->device_path, WindowsErrorString());
+			return;
+		}
+		dp->drive_number = GetDriveNumber(hDrive, dp->device_path);
+		CloseHandle(hDrive);
+		if (dp->drive_number < 0)
+			return;
+	}
+
+	drive_index = dp->drive_number + DRIVE_INDEX_MIN;
+	dp->probed.has_media = IsMediaPresent(drive_index);
+	if (!dp->probed.has_media)
+		return;
+	dp->probed.size = GetDriveSize(drive_index);
+	if ((dp->probed.size >= MIN_DRIVE_SIZE) && (!dp->props.is_VHD) && (!dp->props.is_CARD))
+		dp->probed.hdd_score = IsHDD(drive_index, (uint16_t)dp->props.vid, (uint16_t)dp->props.pid, dp->name);
+}
+
+static void ReleaseProbePool(probe_pool* pool)
+{
+	if (InterlockedDecrement(&pool->refs) != 0)
+		return;
+	CloseHandle(pool->done);
+	free(pool->entries);
+	free(pool);
+}
+
+static DWORD WINAPI ProbeDeviceThread(LPVOID param)
+{
+	probe_pool* pool = (probe_pool*)param;
+	LONG i;
+
+	while ((i = InterlockedIncrement(&pool->next) - 1) < pool->nb_entries) {
+		ProbeDevice((dev_probe*)pool->entries[i]->data);
+		DevCacheEndProbe(pool->entries[i]);
+	}
+	if (InterlockedDecrement(&pool->running) == 0) {
+		SetEvent(pool->done);
+		// If the refresh stopped waiting for us, have the devices we probed listed
+		if (InterlockedCompareExchange(&pool->detached, 0, 0))
+			PostMessage(hMainDialog, UM_DEVICES_PROBED, 0, 0);
+	}
+	ReleaseProbePool(pool);
+	ExitThread(0);
+}
+
+/*
+ * Wait for the probing threads, while still processing the messages that are sent
+ * to us (such as the ones from uprintf() to the log window, that would otherwise
+ * deadlock), but not the posted ones, so that user input is not processed.
+ */
+static DWORD WaitForProbes(HANDLE hEvent, DWORD dwMilliseconds)
+{
+	uint64_t end_time = GetTickCount64() + dwMilliseconds, cur_time;
+	DWORD res;
+	MSG msg;
+
+	while ((res = MsgWaitForMultipleObjects(1, &hEvent, FALSE, dwMilliseconds, QS_SENDMESSAGE)) == WAIT_OBJECT_0 + 1) {
+		PeekMessage(&msg, NULL, 0, 0, PM_NOREMOVE | PM_QS_SENDMESSAGE);
+		cur_time = GetTickCount64();
+		if (cur_time >= end_time)
+			return WAIT_TIMEOUT;
+		dwMilliseconds = (DWORD)(end_time - cur_time);
+	}
+	return res;
+}
+
+/*
+ * Probe the devices from 'entries' using up to DEVICE_PROBE_THREADS threads, and wait
+ * for up to DEVICE_PROBE_TIMEOUT for them to complete. Devices that take longer keep
+ * being probed in the background, and get listed through UM_DEVICES_PROBED once ready.
+ * Takes ownership of 'entries'.
+ */
+static void ProbeDevices(dev_cache_entry** entries, LONG nb_entries)
+{
+	probe_pool* pool;
+	HANDLE hThread[DEVICE_PROBE_THREADS];
+	LONG i, nb_threads = 0;
+
+	if (nb_entries == 0) {
+		free(entries);
+		return;
+	}
+	pool = (probe_pool*)calloc(1, sizeof(probe_pool));
+	if (pool != NULL)
+		pool->done = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if ((pool != NULL) && (pool->done != NULL)) {
+		pool->entries = entries;
+		pool->nb_entries = nb_entries;
+		for (i = 0; (i < DEVICE_PROBE_THREADS) && (i < nb_entries); i++) {
+			hThread[nb_threads] = CreateThread(NULL, 0, ProbeDeviceThread, pool, CREATE_SUSPENDED, NULL);
+			if (hThread[nb_threads] != NULL)
+				nb_threads++;
+		}
+	}
+	if (nb_threads == 0) {
+		// Probe the devices ourselves
+		uprintf("Could not create device probing threads - probing devices sequentially");
+		for (i = 0; i < nb_entries; i++) {
+			ProbeDevice((dev_probe*)entries[i]->data);
+			DevCacheEndProbe(entries[i]);
+		}
+		if (pool != NULL)
+			safe_closehandle(pool->done);
+		free(pool);
+		free(entries);
+		return;
+	}
+
+	pool->running = nb_threads;
+	pool->refs = nb_threads + 1;
+	for (i = 0; i < nb_threads; i++) {
+		ResumeThread(hThread[i]);
+		CloseHandle(hThread[i]);
+	}
+	if (WaitForProbes(pool->done, DEVICE_PROBE_TIMEOUT) != WAIT_OBJECT_0)
+		InterlockedExchange(&pool->detached, TRUE);
+	ReleaseProbePool(pool);
+}
+
+/*
+ * Build the data we need to match a disk device with its USB parent
+ */
+static BOOL GetUSBDeviceLists(htab_table* htab_devid, StrArray* dev_if_path, char** devid_list, ULONG* list_start)
 {
-	// List of USB storage drivers we know - list may be incomplete!
-	const char* usbstor_name[] = {
-		// Standard MS USB storage driver
-		"USBSTOR",
-		// USB card readers, with proprietary drivers (Realtek,etc...)
-		// Mostly "guessed" from http://www.carrona.org/dvrref.php
-		"RTSUER", "CMIUCR", "EUCR",
-		// UASP Drivers *MUST* be listed after this, starting with "UASPSTOR"
-		// (which is Microsoft's native UASP driver for Windows 8 and later)
-		// as we use "UASPSTOR" as a delimiter
-		"UASPSTOR", "VUSBSTOR", "ETRONSTOR", "ASUSSTPT"
-	};
-	// These are the generic (non USB) storage enumerators we also test
-	const char* genstor_name[] = {
-		// Generic storage drivers (Careful now!)
-		"SCSI", // "STORAGE",	// "STORAGE" is used by 'Storage Spaces" and stuff => DANGEROUS!
-		// Non-USB card reader drivers - This list *MUST* start with "SD" (delimiter)
-		// See http://itdoc.hitachi.co.jp/manuals/3021/30213B5200e/DMDS0094.HTM
-		// Also  http://www.carrona.org/dvrref.php. NB: All members from this list should have
-		// been reported as enumerators by Rufus, when Enum Debug is enabled.
-		"SD", "PCISTOR", "RTSOR", "JMCR", "JMCF", "RIMMPTSK", "RIMSPTSK", "RISD", "RIXDPTSK",
-		"TI21SONY", "ESD7SK", "ESM7SK", "O2MD", "O2SD", "VIACR", "GLREADER"
-	};
-	// Oh, and we also have card devices (e.g. 'SCSI\DiskO2Micro_SD_...') under the SCSI enumerator...
-	const char* scsi_disk_prefix = "SCSI\\Disk";
-	const char* scsi_card_name[] = {
-		"_SD_", "_SDHC_", "_SDXC_", "_MMC_", "_MS_", "_MSPro_", "_xDPicture_", "_O2Media_"
-	};
-	const char* usb_speed_name[USB_SPEED_MAX] = { "USB", "USB 1.0", "USB 1.1", "USB 2.0", "USB 3.0", "USB 3.1" };
-	const char* windows_sandbox_vhd_label = "PortableBaseLayer";
-	const char* bitdefender_label = "Bitdefender Partition";
-	// Hash table and String Array used to match a Device ID with the parent hub's Device Interface Path
-	htab_table htab_devid = HTAB_EMPTY;
-	StrArray dev_if_path = STRARRAY_EMPTY;
-	char letter_name[] = " (?:)";
-	char drive_name[] = "?:\\";
-	char setting_name[32];
-	char uefi_togo_check[] = "?:\\EFI\\Rufus\\ntfs_x64.efi";
-	char scsi_card_name_copy[16];
-	BOOL r = FALSE, found = FALSE, post_backslash;
 	HDEVINFO dev_info = NULL;
 	SP_DEVINFO_DATA dev_info_data;
 	SP_DEVICE_INTERFACE_DATA devint_data;
 	PSP_DEVICE_INTERFACE_DETAIL_DATA_A devint_detail_data;
-	DEVINST parent_inst, grandparent_inst, device_inst;
-	DWORD size, i, j, k, l, data_type, drive_index;
-	DWORD uasp_start = ARRAYSIZE(usbstor_name), card_start = ARRAYSIZE(genstor_name);
-	ULONG list_size[ARRAYSIZE(usbstor_name)] = { 0 }, list_start[ARRAYSIZE(usbstor_name)] = { 0 }, full_list_size, ulFlags;
-	HANDLE hDrive;
-	LONG maxwidth = 0;
-	int s, u, v, score, drive_number, remove_drive, num_drives = 0;
-	char drive_letters[27], *device_id, *devid_list = NULL, display_msg[128];
-	char *p, *label, *display_name, buffer[4 * KB], str[MAX_PATH], device_instance_id[MAX_PATH], *method_str, *hub_path;
-	uint32_t ignore_vid_pid[MAX_IGNORE_USB];
-	uint64_t drive_size = 0;
-	usb_device_props props;
+	DEVINST device_inst;
+	DWORD size, i, k;
+	ULONG list_size[ARRAYSIZE(usbstor_name)] = { 0 }, full_list_size, ulFlags;
+	int s;
+	char* device_id;
 
-	IGNORE_RETVAL(ComboBox_ResetContent(hDeviceList));
-	ClearDrives();
-	StrArrayCreate(&dev_if_path, 128);
+	StrArrayCreate(dev_if_path, 128);
 	// Add a dummy for string index zero, as this is what non matching hashes will point to
-	StrArrayAdd(&dev_if_path, "", TRUE);
+	StrArrayAdd(dev_if_path, "", TRUE);
 
 	device_id = (char*)malloc(MAX_PATH);
 	if (device_id == NULL)
-		goto out;
+		return FALSE;
 
 	// Build a hash table associating a CM Device ID of a USB device with the SetupDI Device Interface Path
 	// of its parent hub - this is needed to retrieve the device speed
 	dev_info = SetupDiGetClassDevsA(&GUID_DEVINTERFACE_USB_HUB, NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
 	if (dev_info != INVALID_HANDLE_VALUE) {
-		if (htab_create(DEVID_HTAB_SIZE, &htab_devid)) {
+		if (htab_create(DEVID_HTAB_SIZE, htab_devid)) {
 			dev_info_data.cbSize = sizeof(dev_info_data);
 			for (i=0; SetupDiEnumDeviceInfo(dev_info, i, &dev_info_data); i++) {
 				uuprintf("Processing Hub %d:", i + 1);
@@ -531,20 +800,20 @@ BOOL GetDevices(DWORD devnum)
 						// Find the Device IDs for all the children of this hub
 						if (CM_Get_Child(&device_inst, dev_info_data.DevInst, 0) == CR_SUCCESS) {
 							device_id[0] = 0;
-							s = StrArrayAdd(&dev_if_path, devint_detail_data->DevicePath, TRUE);
+							s = StrArrayAdd(dev_if_path, devint_detail_data->DevicePath, TRUE);
 							uuprintf("  Hub[%d] = '%s'", s, devint_detail_data->DevicePath);
 							if ((s>= 0) && (CM_Get_Device_IDA(device_inst, device_id, MAX_PATH, 0) == CR_SUCCESS)) {
 								ToUpper(device_id);
-								if ((k = htab_hash(device_id, &htab_devid)) != 0) {
-									htab_devid.table[k].data = (void*)(uintptr_t)s;
+								if ((k = htab_hash(device_id, htab_devid)) != 0) {
+									htab_devid->table[k].data = (void*)(uintptr_t)s;
 								}
 								uuprintf("  Found ID[%03d]: %s", k, device_id);
 								while (CM_Get_Sibling(&device_inst, device_inst, 0) == CR_SUCCESS) {
 									device_id[0] = 0;
 									if (CM_Get_Device_IDA(device_inst, device_id, MAX_PATH, 0) == CR_SUCCESS) {
 										ToUpper(device_id);
-										if ((k = htab_hash(device_id, &htab_devid)) != 0) {
-											htab_devid.table[k].data = (void*)(uintptr_t)s;
+										if ((k = htab_hash(device_id, htab_devid)) != 0) {
+											htab_devid->table[k].data = (void*)(uintptr_t)s;
 										}
 										uuprintf("  Found ID[%03d]: %s", k, device_id);
 									}
@@ -566,59 +835,184 @@ BOOL GetDevices(DWORD devnum)
 	for (s = 0; s < ARRAYSIZE(usbstor_name); s++) {
 		// Get a list of device IDs for all USB storage devices
 		// This will be used to find if a device is UASP
-		// Also compute the uasp_start index
-		if (strcmp(usbstor_name[s], "UASPSTOR") == 0)
-			uasp_start = s;
 		if (CM_Get_Device_ID_List_SizeA(&list_size[s], usbstor_name[s], ulFlags) != CR_SUCCESS)
 			list_size[s] = 0;
 		if (list_size[s] != 0)
 			full_list_size += list_size[s]-1;	// remove extra NUL terminator
 	}
-	// Compute the card_start index
-	for (s = 0; s < ARRAYSIZE(genstor_name); s++) {
-		if (strcmp(genstor_name[s], "SD") == 0)
-			card_start = s;
-	}
-
-	// Build the list of USB devices we may want to ignore
-	for (s = 0; s < ARRAYSIZE(ignore_vid_pid); s++) {
-		static_sprintf(setting_name, "IgnoreUsb%02d", s + 1);
-		ignore_vid_pid[s] = ReadSetting32(setting_name);
-	}
 
-	// Better safe than sorry. And yeah, we could have used arrays of
-	// arrays to avoid this, but it's more readable this way.
-	if_assert_fails((uasp_start > 0) && (uasp_start < ARRAYSIZE(usbstor_name)))
-		goto out;
-	if_assert_fails((card_start > 0) && (card_start < ARRAYSIZE(genstor_name)))
-		goto out;
-
-	devid_list = NULL;
+	*devid_list = NULL;
 	if (full_list_size != 0) {
 		full_list_size += 1;	// add extra NUL terminator
-		devid_list = (char*)malloc(full_list_size);
-		if (devid_list == NULL) {
+		*devid_list = (char*)malloc(full_list_size);
+		if (*devid_list == NULL) {
 			uprintf("Could not allocate Device ID list");
-			goto out;
+			return FALSE;
 		}
 		for (s = 0, i = 0; s < ARRAYSIZE(usbstor_name); s++) {
 			list_start[s] = i;
 			if (list_size[s] > 1) {
-				if (CM_Get_Device_ID_ListA(usbstor_name[s], &devid_list[i], list_size[s], ulFlags) != CR_SUCCESS)
+				if (CM_Get_Device_ID_ListA(usbstor_name[s], &(*devid_list)[i], list_size[s], ulFlags) != CR_SUCCESS)
 					continue;
 				if (usb_debug) {
 					uprintf("Processing IDs belonging to '%s':", usbstor_name[s]);
-					for (device_id = &devid_list[i]; *device_id != 0; device_id += strlen(device_id) + 1)
+					for (device_id = &(*devid_list)[i]; *device_id != 0; device_id += strlen(device_id) + 1)
 						uprintf("  %s", device_id);
 				}
 				// The list_size is sometimes larger than required thus we need to find the real end
 				for (i += list_size[s]; i > 2; i--) {
-					if ((devid_list[i-2] != '\0') && (devid_list[i-1] == '\0') && (devid_list[i] == '\0'))
+					if (((*devid_list)[i-2] != '\0') && ((*devid_list)[i-1] == '\0') && ((*devid_list)[i] == '\0'))
 						break;
 				}
 			}
 		}
 	}
+	return TRUE;
+}
+
+/*
+ * Find if a device should be listed, according to its enumeration properties and our current
+ * settings. This is called before probing, to avoid opening devices that we don't list (such
+ * as system drives), as well as when listing the devices, to report why a device isn't listed.
+ */
+static BOOL IsListableDevice(dev_probe* dp, uint32_t* ignore_vid_pid, BOOL bSilent)
+{
+	const char* usb_speed_name[USB_SPEED_MAX] = { "USB", "USB 1.0", "USB 1.1", "USB 2.0", "USB 3.0", "USB 3.1" };
+	usb_device_props* props = &dp->props;
+	char str[16];
+	int s;
+
+	if (props->is_VHD) {
+		suprintf("Found VHD device '%s'", dp->name);
+	} else if ((props->is_CARD) && ((!props->is_USB) || ((props->vid == 0) && (props->pid == 0)))) {
+		suprintf("Found card reader device '%s'", dp->name);
+	} else if ((!props->is_USB) && (!props->is_UASP) && (props->is_Removable)) {
+		if (!list_non_usb_removable_drives) {
+			suprintf("Found non-USB removable device '%s' => Eliminated", dp->name);
+			if (!bSilent)
+				uuprintf("If you *REALLY* need, you can enable listing of this device with <Ctrl><Alt><F>");
+			return FALSE;
+		}
+		suprintf("Found non-USB removable device '%s'", dp->name);
+	} else {
+		if (props->vid == -1 || props->pid == -1) {
+			if (!props->is_USB) {
+				// If we have a non removable SCSI drive and couldn't get a VID:PID,
+				// we are most likely dealing with a system drive => eliminate it!
+				if (!bSilent)
+					uuprintf("Found non-USB non-removable device '%s' => Eliminated", dp->name);
+				return FALSE;
+			}
+			static_strcpy(str, "????:????");	// Couldn't figure VID:PID
+		} else {
+			static_sprintf(str, "%04X:%04X", props->vid, props->pid);
+			// I *REALLY* don't want to erase the devices below by accident.
+			if (its_a_me_mario) {
+				if ((props->vid == 0x0525) && (props->pid == 0x622b))
+					return FALSE;
+				if ((props->vid == 0x0781) && (props->pid == 0x75a0))
+					return FALSE;
+				if ((props->vid == 0x10d6) && (props->pid == 0x1101))
+					return FALSE;
+			}
+			// Also ignore USB devices that have been specifically flagged by the user
+			for (s = 0; s < MAX_IGNORE_USB; s++) {
+				if (ignore_vid_pid[s] != 0 && (props->vid == (ignore_vid_pid[s] >> 16)) &&
+					(props->pid == (ignore_vid_pid[s] & 0xffff))) {
+					suprintf("Ignoring '%s' (%s), per user settings", dp->name, str);
+					return FALSE;
+				}
+			}
+		}
+		if (props->speed >= USB_SPEED_MAX)
+			props->speed = 0;
+		suprintf("Found %s%s%s device '%s' (%s) %s", props->is_UASP ? "UAS (" : "",
+			usb_speed_name[props->speed], props->is_UASP ? ")" : "", dp->name, str, dp->method_str);
+		if (props->lower_speed)
+			suprintf("NOTE: This device is a USB 3.%c device operating at lower speed...", '0' + props->lower_speed - 1);
+	}
+	return TRUE;
+}
+
+/*
+ * Refresh the list of USB devices
+ *
+ * Devices are kept in a cache between refreshes, so that the properties of the devices
+ * we already know about don't have to be queried again. Only the devices that appeared
+ * or changed, or whose media may have changed (see InvalidateDevices()) are probed, in
+ * parallel, after which the list is populated from the cache, using the current settings.
+ */
+BOOL GetDevices(DWORD devnum)
+{
+	// Oh, and we also have card devices (e.g. 'SCSI\DiskO2Micro_SD_...') under the SCSI enumerator...
+	const char* scsi_disk_prefix = "SCSI\\Disk";
+	const char* scsi_card_name[] = {
+		"_SD_", "_SDHC_", "_SDXC_", "_MMC_", "_MS_", "_MSPro_", "_xDPicture_", "_O2Media_"
+	};
+	const char* windows_sandbox_vhd_label = "PortableBaseLayer";
+	const char* bitdefender_label = "Bitdefender Partition";
+	// Hash table and String Array used to match a Device ID with the parent hub's Device Interface Path
+	htab_table htab_devid = HTAB_EMPTY;
+	StrArray dev_if_path = STRARRAY_EMPTY;
+	char letter_name[] = " (?:)";
+	char drive_name[] = "?:\\";
+	char setting_name[32];
+	char uefi_togo_check[] = "?:\\EFI\\Rufus\\ntfs_x64.efi";
+	char scsi_card_name_copy[16];
+	BOOL r = FALSE, found = FALSE, post_backslash, has_friendly_name, has_usb_lists = FALSE;
+	HDEVINFO dev_info = NULL;
+	SP_DEVINFO_DATA dev_info_data;
+	SP_DEVICE_INTERFACE_DATA devint_data;
+	PSP_DEVICE_INTERFACE_DETAIL_DATA_A devint_detail_data;
+	DEVINST parent_inst, grandparent_inst, device_inst;
+	DWORD size, i, j, k, l, data_type, drive_index;
+	DWORD uasp_start = ARRAYSIZE(usbstor_name), card_start = ARRAYSIZE(genstor_name);
+	ULONG list_start[ARRAYSIZE(usbstor_name)] = { 0 };
+	LONG maxwidth = 0, nb_probes = 0;
+	int s, u, v, score, remove_drive, num_drives = 0;
+	char drive_letters[27], *device_id, *devid_list = NULL, display_msg[128];
+	char *p, *label, *display_name, buffer[4 * KB], str[MAX_PATH], device_instance_id[MAX_PATH], *method_str, *hub_path;
+	uint32_t ignore_vid_pid[MAX_IGNORE_USB], signature;
+	uint64_t drive_size;
+	usb_device_props props;
+	dev_cache_entry *entry, **probes = NULL;
+	dev_probe* dp;
+
+	// We may get called again, through the messages we process while waiting for the
+	// devices to be probed, in which case we just refresh again once we're done
+	if (refreshing_devices) {
+		refresh_requested = TRUE;
+		return FALSE;
+	}
+	refreshing_devices = TRUE;
+	refresh_requested = FALSE;
+	if (device_cache.free_data == NULL) {
+		DevCacheInit(&device_cache, FreeDeviceProbe);
+		memset(letter_drive_number, 0xff, sizeof(letter_drive_number));
+	}
+
+	// Compute the uasp_start and card_start indexes
+	for (s = 0; s < ARRAYSIZE(usbstor_name); s++) {
+		if (strcmp(usbstor_name[s], "UASPSTOR") == 0)
+			uasp_start = s;
+	}
+	for (s = 0; s < ARRAYSIZE(genstor_name); s++) {
+		if (strcmp(genstor_name[s], "SD") == 0)
+			card_start = s;
+	}
+
+	// Build the list of USB devices we may want to ignore
+	for (s = 0; s < ARRAYSIZE(ignore_vid_pid); s++) {
+		static_sprintf(setting_name, "IgnoreUsb%02d", s + 1);
+		ignore_vid_pid[s] = ReadSetting32(setting_name);
+	}
+
+	// Better safe than sorry. And yeah, we could have used arrays of
+	// arrays to avoid this, but it's more readable this way.
+	if_assert_fails((uasp_start > 0) && (uasp_start < ARRAYSIZE(usbstor_name)))
+		goto out;
+	if_assert_fails((card_start > 0) && (card_start < ARRAYSIZE(genstor_name)))
+		goto out;
 
 	// Now use SetupDi to enumerate all our disk storage devices
 	dev_info = SetupDiGetClassDevsA(&GUID_DEVINTERFACE_DISK, NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
@@ -626,8 +1020,9 @@ BOOL GetDevices(DWORD devnum)
 		uprintf("SetupDiGetClassDevs (Interface) failed: %s", WindowsErrorString());
 		goto out;
 	}
+	DevCacheBeginEnum(&device_cache);
 	dev_info_data.cbSize = sizeof(dev_info_data);
-	for (i = 0; num_drives < MAX_DRIVES && SetupDiEnumDeviceInfo(dev_info, i, &dev_info_data); i++) {
+	for (i = 0; SetupDiEnumDeviceInfo(dev_info, i, &dev_info_data); i++) {
 		memset(buffer, 0, sizeof(buffer));
 		memset(&props, 0, sizeof(props));
 		props.vid = -1; props.pid = -1;
@@ -663,6 +1058,9 @@ BOOL GetDevices(DWORD devnum)
 			uuprintf("  Unsupported or disabled by policy");
 			continue;
 		}
+		// The signature of a device is computed from all the enumeration properties we use
+		signature = DevCacheHash(DEV_CACHE_HASH_INIT, &dev_info_data.DevInst, sizeof(dev_info_data.DevInst));
+		signature = DevCacheHashStr(signature, buffer);
 
 		// We can't use the friendly name to find if a drive is a VHD, as friendly name string gets translated
 		// according to your locale, so we poke the Hardware ID
@@ -694,6 +1092,7 @@ BOOL GetDevices(DWORD devnum)
 			}
 		}
 		uuprintf("  Hardware ID: '%s'", buffer);
+		signature = DevCacheHashStr(signature, buffer);
 
 		// Keep track of the Device Instance ID, which we'll need to "reset" the device
 		if (!SetupDiGetDeviceInstanceIdA(dev_info, &dev_info_data, device_instance_id,
@@ -705,14 +1104,67 @@ BOOL GetDevices(DWORD devnum)
 		memset(buffer, 0, sizeof(buffer));
 		props.is_Removable = SetupDiGetDeviceRegistryPropertyA(dev_info, &dev_info_data, SPDRP_REMOVAL_POLICY,
 			&data_type, (LPBYTE)buffer, sizeof(buffer), &size) && IsRemovable(buffer);
+		signature = DevCacheHash(signature, &props.is_Removable, sizeof(props.is_Removable));
 
 		memset(buffer, 0, sizeof(buffer));
-		if (!SetupDiGetDeviceRegistryPropertyU(dev_info, &dev_info_data, SPDRP_FRIENDLYNAME,
-				&data_type, (LPBYTE)buffer, sizeof(buffer), &size)) {
+		has_friendly_name = SetupDiGetDeviceRegistryPropertyU(dev_info, &dev_info_data, SPDRP_FRIENDLYNAME,
+			&data_type, (LPBYTE)buffer, sizeof(buffer), &size);
+		if (!has_friendly_name) {
 			uprintf("SetupDiGetDeviceRegistryProperty (Friendly Name) failed: %s", WindowsErrorString());
 			// We can afford a failure on this call - just replace the name with "USB Storage Device (Generic)"
 			static_strcpy(buffer, lmprintf(MSG_045));
-		} else if ((!props.is_VHD) && (devid_list != NULL)) {
+		}
+		signature = DevCacheHashStr(signature, buffer);
+
+		// Get the Device Interface Path of the disk
+		devint_data.cbSize = sizeof(devint_data);
+		devint_detail_data = NULL;
+		for (j = 0; ; j++) {
+			safe_free(devint_detail_data);
+
+			if (!SetupDiEnumDeviceInterfaces(dev_info, &dev_info_data, &GUID_DEVINTERFACE_DISK, j, &devint_data)) {
+				if (GetLastError() != ERROR_NO_MORE_ITEMS)
+					uprintf("SetupDiEnumDeviceInterfaces failed: %s", WindowsErrorString());
+				break;
+			}
+
+			if (!SetupDiGetDeviceInterfaceDetailA(dev_info, &devint_data, NULL, 0, &size, NULL)) {
+				if (GetLastError() == ERROR_INSUFFICIENT_BUFFER) {
+					devint_detail_data = (PSP_DEVICE_INTERFACE_DETAIL_DATA_A)calloc(1, size);
+					if (devint_detail_data == NULL) {
+						uprintf("Unable to allocate data for SP_DEVICE_INTERFACE_DETAIL_DATA");
+						continue;
+					}
+					devint_detail_data->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_A);
+				} else {
+					uprintf("SetupDiGetDeviceInterfaceDetail (dummy) failed: %s", WindowsErrorString());
+					continue;
+				}
+			}
+			if (devint_detail_data == NULL) {
+				uprintf("SetupDiGetDeviceInterfaceDetail (dummy) - no data was allocated");
+				continue;
+			}
+			if (!SetupDiGetDeviceInterfaceDetailA(dev_info, &devint_data, devint_detail_data, size, &size, NULL)) {
+				uprintf("SetupDiGetDeviceInterfaceDetail (actual) failed: %s", WindowsErrorString());
+				continue;
+			}
+			break;
+		}
+		if (devint_detail_data != NULL)
+			signature = DevCacheHashStr(signature, devint_detail_data->DevicePath);
+
+		entry = DevCacheAdd(&device_cache, device_instance_id, signature);
+		if ((entry == NULL) || (entry->data != NULL)) {
+			safe_free(devint_detail_data);
+			continue;
+		}
+
+		// This is a device we haven't seen before, or that changed => get its properties
+		if ((has_friendly_name) && (!props.is_VHD) && (!has_usb_lists)) {
+			has_usb_lists = GetUSBDeviceLists(&htab_devid, &dev_if_path, &devid_list, list_start);
+		}
+		if ((has_friendly_name) && (!props.is_VHD) && (has_usb_lists) && (devid_list != NULL)) {
 			// Get the properties of the device. We could avoid doing this lookup every time by keeping
 			// a lookup table, but there shouldn't be that many USB storage devices connected...
 			// NB: Each of these Device IDs should have a child, from which we get the Device Instance match.
@@ -806,242 +1258,211 @@ BOOL GetDevices(DWORD devnum)
 			if (marker != NULL && marker[sizeof(scsi_disk_device_str)] == 0)
 				memcpy(marker, uas_device_str, sizeof(uas_device_str));
 		}
-		if (props.is_VHD) {
-			uprintf("Found VHD device '%s'", buffer);
-		} else if ((props.is_CARD) && ((!props.is_USB) || ((props.vid == 0) && (props.pid == 0)))) {
-			uprintf("Found card reader device '%s'", buffer);
-		} else if ((!props.is_USB) && (!props.is_UASP) && (props.is_Removable)) {
-			if (!list_non_usb_removable_drives) {
-				uprintf("Found non-USB removable device '%s' => Eliminated", buffer);
-				uuprintf("If you *REALLY* need, you can enable listing of this device with <Ctrl><Alt><F>");
+
+		dp = (dev_probe*)calloc(1, sizeof(dev_probe));
+		if (dp == NULL) {
+			safe_free(devint_detail_data);
+			continue;
+		}
+		memcpy(&dp->props, &props, sizeof(props));
+		dp->name = safe_strdup(buffer);
+		dp->device_path = (devint_detail_data == NULL) ? NULL : safe_strdup(devint_detail_data->DevicePath);
+		dp->hub_path = safe_strdup(hub_path);
+		dp->method_str = method_str;
+		dp->drive_number = -1;
+		r = (dp->name != NULL) && ((dp->device_path != NULL) || (devint_detail_data == NULL));
+		safe_free(devint_detail_data);
+		if (!r) {
+			FreeDeviceProbe(dp);
+			continue;
+		}
+		entry->data = dp;
+	}
+	SetupDiDestroyDeviceInfoList(dev_info);
+	DevCacheEndEnum(&device_cache);
+	InvalidateChangedDrives();
+
+	// Probe the devices that we would list and that are new or may have changed
+	probes = (dev_cache_entry**)calloc(max(device_cache.nb_entries, 1), sizeof(dev_cache_entry*));
+	if (probes == NULL)
+		goto out;
+	for (u = 0; u < (int)device_cache.nb_entries; u++) {
+		entry = device_cache.entries[u];
+		dp = (dev_probe*)entry->data;
+		if ((dp == NULL) || (dp->device_path == NULL) || (!DevCacheNeedsProbe(&device_cache, entry)) ||
+			(!IsListableDevice(dp, ignore_vid_pid, TRUE)))
+			continue;
+		DevCacheStartProbe(&device_cache, entry);
+		dp->update_media = TRUE;
+		probes[nb_probes++] = entry;
+	}
+	ProbeDevices(probes, nb_probes);
+	probes = NULL;
+
+	// Now list the devices, in enumeration order
+	IGNORE_RETVAL(ComboBox_ResetContent(hDeviceList));
+	ClearDrives();
+	for (u = 0; (u < (int)device_cache.nb_entries) && (num_drives < MAX_DRIVES); u++) {
+		entry = device_cache.entries[u];
+		dp = (dev_probe*)entry->data;
+		if ((dp == NULL) || (!IsListableDevice(dp, ignore_vid_pid, FALSE)))
+			continue;
+		if ((dp->device_path != NULL) && (!DevCacheIsProbed(entry))) {
+			// A device that is probed again is listed from its previous probe meanwhile
+			if (!dp->has_media_data) {
+				uprintf("Device '%s' is still being probed - it will be listed once ready", dp->name);
 				continue;
 			}
-			uprintf("Found non-USB removable device '%s'", buffer);
-		} else {
-			if (props.vid == -1 || props.pid == -1) {
-				if (!props.is_USB) {
-					// If we have a non removable SCSI drive and couldn't get a VID:PID,
-					// we are most likely dealing with a system drive => eliminate it!
-					uuprintf("Found non-USB non-removable device '%s' => Eliminated", buffer);
-					continue;
-				}
-				static_strcpy(str, "????:????");	// Couldn't figure VID:PID
-			} else {
-				static_sprintf(str, "%04X:%04X", props.vid, props.pid);
-				// I *REALLY* don't want to erase the devices below by accident.
-				if (its_a_me_mario) {
-					if ((props.vid == 0x0525) && (props.pid == 0x622b))
-						continue;
-					if ((props.vid == 0x0781) && (props.pid == 0x75a0))
-						continue;
-					if ((props.vid == 0x10d6) && (props.pid == 0x1101))
-						continue;
-				}
-				// Also ignore USB devices that have been specifically flagged by the user
-				for (s = 0; s < ARRAYSIZE(ignore_vid_pid); s++) {
-					if (ignore_vid_pid[s] != 0 && (props.vid == (ignore_vid_pid[s] >> 16)) &&
-						(props.pid == (ignore_vid_pid[s] & 0xffff))) {
-						uprintf("Ignoring '%s' (%s), per user settings", buffer, str);
-						break;
+		} else if (dp->update_media) {
+			memcpy(&dp->media, &dp->probed, sizeof(dp->media));
+			dp->has_media_data = TRUE;
+			dp->update_media = FALSE;
+			dp->label_probed = FALSE;
+		}
+		if ((dp->device_path == NULL) || (dp->drive_number < 0)) {
+			uprintf("A device was eliminated because it didn't report itself as a disk");
+			continue;
+		}
+		memcpy(&props, &dp->props, sizeof(props));
+		drive_index = dp->drive_number + DRIVE_INDEX_MIN;
+		drive_size = dp->media.size;
+		if (!dp->media.has_media) {
+			uprintf("Device eliminated because it appears to contain no media");
+			continue;
+		}
+		if (drive_size < MIN_DRIVE_SIZE) {
+			uprintf("Device eliminated because it is smaller than %s", SizeToHumanReadable(MIN_DRIVE_SIZE, FALSE, FALSE));
+			continue;
+		}
+
+		if (!dp->label_probed) {
+			dp->label_probed = TRUE;
+			safe_free(dp->label);
+			dp->has_label = GetDriveLabel(drive_index, dp->letters, &label, FALSE);
+			if (dp->has_label) {
+				dp->label = safe_strdup(label);
+				// Find the UEFI:TOGO partition(s) (and eliminate them form our listing)
+				static_strcpy(dp->listed_letters, dp->letters);
+				for (k = 0; dp->listed_letters[k]; k++) {
+					uefi_togo_check[0] = dp->listed_letters[k];
+					if (PathFileExistsA(uefi_togo_check)) {
+						for (l = k; dp->listed_letters[l]; l++)
+							dp->listed_letters[l] = dp->listed_letters[l + 1];
+						k--;
 					}
 				}
-				if (s < ARRAYSIZE(ignore_vid_pid))
-					continue;
 			}
-			if (props.speed >= USB_SPEED_MAX)
-				props.speed = 0;
-			uprintf("Found %s%s%s device '%s' (%s) %s", props.is_UASP ? "UAS (" : "",
-				usb_speed_name[props.speed], props.is_UASP ? ")" : "", buffer, str, method_str);
-			if (props.lower_speed)
-				uprintf("NOTE: This device is a USB 3.%c device operating at lower speed...", '0' + props.lower_speed - 1);
 		}
-		devint_data.cbSize = sizeof(devint_data);
-		devint_detail_data = NULL;
-		for (j = 0; ; j++) {
-			safe_free(devint_detail_data);
+		if ((!dp->has_label) || (dp->label == NULL)) {
+			uprintf("A device was eliminated because it didn't report itself as a disk");
+			continue;
+		}
+		label = dp->label;
+		static_strcpy(drive_letters, dp->letters);
 
-			if (!SetupDiEnumDeviceInterfaces(dev_info, &dev_info_data, &GUID_DEVINTERFACE_DISK, j, &devint_data)) {
-				if(GetLastError() != ERROR_NO_MORE_ITEMS) {
-					uprintf("SetupDiEnumDeviceInterfaces failed: %s", WindowsErrorString());
-				} else {
-					uprintf("A device was eliminated because it didn't report itself as a disk");
-				}
-				break;
+		if ((props.is_SCSI) && (!props.is_UASP) && (!props.is_VHD)) {
+			if (!props.is_Removable) {
+				// Non removables should have been eliminated above, but since we
+				// are potentially dealing with system drives, better safe than sorry
+				continue;
 			}
-
-			if (!SetupDiGetDeviceInterfaceDetailA(dev_info, &devint_data, NULL, 0, &size, NULL)) {
-				if(GetLastError() == ERROR_INSUFFICIENT_BUFFER) {
-					devint_detail_data = (PSP_DEVICE_INTERFACE_DETAIL_DATA_A)calloc(1, size);
-					if (devint_detail_data == NULL) {
-						uprintf("Unable to allocate data for SP_DEVICE_INTERFACE_DETAIL_DATA");
-						continue;
-					}
-					devint_detail_data->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_A);
-				} else {
-					uprintf("SetupDiGetDeviceInterfaceDetail (dummy) failed: %s", WindowsErrorString());
+			if (!list_non_usb_removable_drives) {
+				// Go over the mounted partitions and find if GetDriveType() says they are
+				// removable. If they are not removable, don't allow the drive to be listed
+				for (p = drive_letters; *p; p++) {
+					drive_name[0] = *p;
+					if (GetDriveTypeA(drive_name) != DRIVE_REMOVABLE)
+						break;
+				}
+				if (*p) {
+					uprintf("Device eliminated because it contains a mounted partition that is set as non-removable");
 					continue;
 				}
 			}
-			if (devint_detail_data == NULL) {
-				uprintf("SetupDiGetDeviceInterfaceDetail (dummy) - no data was allocated");
-				continue;
-			}
-			if(!SetupDiGetDeviceInterfaceDetailA(dev_info, &devint_data, devint_detail_data, size, &size, NULL)) {
-				uprintf("SetupDiGetDeviceInterfaceDetail (actual) failed: %s", WindowsErrorString());
-				continue;
-			}
+		}
+		if ((!enable_HDDs) && (!props.is_VHD) && (!props.is_CARD) && ((score = dp->media.hdd_score) > 0)) {
+			uprintf("Device eliminated because it was detected as a Hard Drive or SSD (score %d > 0)", score);
+			if (!list_non_usb_removable_drives)
+				uprintf("If this device is not a Hard Drive or SSD, please e-mail the author of this application");
+			uprintf("NOTE: You can enable the listing of Hard Drives under 'advanced drive properties'");
+			continue;
+		} else if ((!enable_HDDs) && (props.is_CARD) && (drive_size > MAX_DEFAULT_LIST_CARD_SIZE)) {
+			uprintf("Device eliminated because it was detected as a card larger than %s",
+				SizeToHumanReadable(MAX_DEFAULT_LIST_CARD_SIZE, FALSE, FALSE));
+			uprintf("To use such a card, check 'List USB Hard Drives' under 'advanced drive properties'");
+			continue;
+		} else if (props.is_VHD && IsMsDevDrive(drive_index)) {
+			uprintf("Device eliminated because it was detected as a Microsoft Dev Drive");
+			continue;
+		} else if (IsFilteredDrive(drive_index)) {
+			continue;
+		}
+		// Windows 10 19H1 mounts a 'PortableBaseLayer' for its Windows Sandbox feature => unlist those
+		if (safe_strcmp(label, windows_sandbox_vhd_label) == 0) {
+			uprintf("Device eliminated because it is a Windows Sandbox VHD");
+			continue;
+		}
+		// Bitdefender now uses a special 32 MB VHD
+		if (props.is_VHD && safe_strcmp(label, bitdefender_label) == 0 && drive_size <= 32 * MB) {
+			uprintf("Device eliminated because it is a Bitdefender VHD");
+			continue;
+		}
+		if (props.is_VHD && (!enable_VHDs)) {
+			uprintf("Device eliminated because listing of VHDs is disabled (Alt-G)");
+			continue;
+		}
 
-			hDrive = CreateFileWithTimeout(devint_detail_data->DevicePath, GENERIC_READ|GENERIC_WRITE,
-				FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL, 3000);
-			if(hDrive == INVALID_HANDLE_VALUE) {
-				uprintf("Could not open '%s': %s", devint_detail_data->DevicePath, WindowsErrorString());
-				continue;
+		// The empty string is returned for drives that don't have any volumes assigned
+		if (drive_letters[0] == 0) {
+			display_name = lmprintf(MSG_046, label, dp->drive_number,
+				SizeToHumanReadable(drive_size, FALSE, use_fake_units));
+		} else {
+			// The UEFI:TOGO partition(s) were eliminated when we got the label
+			static_strcpy(drive_letters, dp->listed_letters);
+			// We have multiple volumes assigned to the same device (multiple partitions)
+			// If that is the case, use "Multiple Volumes" instead of the label
+			static_strcpy(display_msg, (((drive_letters[0] != 0) && (drive_letters[1] != 0))?
+				lmprintf(MSG_047):label));
+			for (k=0, remove_drive=0; drive_letters[k] && (!remove_drive); k++) {
+				// Append all the drive letters we detected
+				letter_name[2] = drive_letters[k];
+				if (right_to_left_mode)
+					static_strcat(display_msg, RIGHT_TO_LEFT_MARK);
+				static_strcat(display_msg, letter_name);
+				if (drive_letters[k] == (PathGetDriveNumberU(app_dir) + 'A'))
+					remove_drive = 1;
+				if (drive_letters[k] == (PathGetDriveNumberU(system_dir) + 'A'))
+					remove_drive = 2;
 			}
-
-			drive_number = GetDriveNumber(hDrive, devint_detail_data->DevicePath);
-			CloseHandle(hDrive);
-			if (drive_number < 0)
+			// Make sure that we don't list any drive that should not be listed
+			if (remove_drive) {
+				uprintf("Removing %c: from the list: This is the %s!", toupper(drive_letters[--k]),
+					(remove_drive==1)?"disk from which " APPLICATION_NAME " is running":"system disk");
 				continue;
-
-			drive_index = drive_number + DRIVE_INDEX_MIN;
-			if (!IsMediaPresent(drive_index)) {
-				uprintf("Device eliminated because it appears to contain no media");
-				safe_free(devint_detail_data);
-				break;
-			}
-			drive_size = GetDriveSize(drive_index);
-			if (drive_size < MIN_DRIVE_SIZE) {
-				uprintf("Device eliminated because it is smaller than %s", SizeToHumanReadable(MIN_DRIVE_SIZE, FALSE, FALSE));
-				safe_free(devint_detail_data);
-				break;
 			}
+			safe_sprintf(&display_msg[strlen(display_msg)], sizeof(display_msg) - strlen(display_msg) - 1,
+				"%s [%s]", (right_to_left_mode) ? RIGHT_TO_LEFT_MARK : "",
+				SizeToHumanReadable(drive_size, FALSE, use_fake_units));
+			display_name = display_msg;
+		}
 
-			if (GetDriveLabel(drive_index, drive_letters, &label, FALSE)) {
-				if ((props.is_SCSI) && (!props.is_UASP) && (!props.is_VHD)) {
-					if (!props.is_Removable) {
-						// Non removables should have been eliminated above, but since we
-						// are potentially dealing with system drives, better safe than sorry
-						safe_free(devint_detail_data);
-						break;
-					}
-					if (!list_non_usb_removable_drives) {
-						// Go over the mounted partitions and find if GetDriveType() says they are
-						// removable. If they are not removable, don't allow the drive to be listed
-						for (p = drive_letters; *p; p++) {
-							drive_name[0] = *p;
-							if (GetDriveTypeA(drive_name) != DRIVE_REMOVABLE)
-								break;
-						}
-						if (*p) {
-							uprintf("Device eliminated because it contains a mounted partition that is set as non-removable");
-							safe_free(devint_detail_data);
-							break;
-						}
-					}
-				}
-				if ((!enable_HDDs) && (!props.is_VHD) && (!props.is_CARD) &&
-					((score = IsHDD(drive_index, (uint16_t)props.vid, (uint16_t)props.pid, buffer)) > 0)) {
-					uprintf("Device eliminated because it was detected as a Hard Drive or SSD (score %d > 0)", score);
-					if (!list_non_usb_removable_drives)
-						uprintf("If this device is not a Hard Drive or SSD, please e-mail the author of this application");
-					uprintf("NOTE: You can enable the listing of Hard Drives under 'advanced drive properties'");
-					safe_free(devint_detail_data);
-					break;
-				} else if ((!enable_HDDs) && (props.is_CARD) && (drive_size > MAX_DEFAULT_LIST_CARD_SIZE)) {
-					uprintf("Device eliminated because it was detected as a card larger than %s",
-						SizeToHumanReadable(MAX_DEFAULT_LIST_CARD_SIZE, FALSE, FALSE));
-					uprintf("To use such a card, check 'List USB Hard Drives' under 'advanced drive properties'");
-					safe_free(devint_detail_data);
-					break;
-				} else if (props.is_VHD && IsMsDevDrive(drive_index)) {
-					uprintf("Device eliminated because it was detected as a Microsoft Dev Drive");
-					safe_free(devint_detail_data);
-					break;
-				} else if (IsFilteredDrive(drive_index)) {
-					safe_free(devint_detail_data);
-					break;
-				}
-				// Windows 10 19H1 mounts a 'PortableBaseLayer' for its Windows Sandbox feature => unlist those
-				if (safe_strcmp(label, windows_sandbox_vhd_label) == 0) {
-					uprintf("Device eliminated because it is a Windows Sandbox VHD");
-					safe_free(devint_detail_data);
-					break;
-				}
-				// Bitdefender now uses a special 32 MB VHD
-				if (props.is_VHD && safe_strcmp(label, bitdefender_label) == 0 && GetDriveSize(drive_index) <= 32 * MB) {
-					uprintf("Device eliminated because it is a Bitdefender VHD");
-					safe_free(devint_detail_data);
-					break;
-				}
-				if (props.is_VHD && (!enable_VHDs)) {
-					uprintf("Device eliminated because listing of VHDs is disabled (Alt-G)");
-					safe_free(devint_detail_data);
-					break;
-				}
-
-				// The empty string is returned for drives that don't have any volumes assigned
-				if (drive_letters[0] == 0) {
-					display_name = lmprintf(MSG_046, label, drive_number,
-						SizeToHumanReadable(drive_size, FALSE, use_fake_units));
-				} else {
-					// Find the UEFI:TOGO partition(s) (and eliminate them form our listing)
-					for (k = 0; drive_letters[k]; k++) {
-						uefi_togo_check[0] = drive_letters[k];
-						if (PathFileExistsA(uefi_togo_check)) {
-							for (l=k; drive_letters[l]; l++)
-								drive_letters[l] = drive_letters[l+1];
-							k--;
-						}
-					}
-					// We have multiple volumes assigned to the same device (multiple partitions)
-					// If that is the case, use "Multiple Volumes" instead of the label
-					static_strcpy(display_msg, (((drive_letters[0] != 0) && (drive_letters[1] != 0))?
-						lmprintf(MSG_047):label));
-					for (k=0, remove_drive=0; drive_letters[k] && (!remove_drive); k++) {
-						// Append all the drive letters we detected
-						letter_name[2] = drive_letters[k];
-						if (right_to_left_mode)
-							static_strcat(display_msg, RIGHT_TO_LEFT_MARK);
-						static_strcat(display_msg, letter_name);
-						if (drive_letters[k] == (PathGetDriveNumberU(app_dir) + 'A'))
-							remove_drive = 1;
-						if (drive_letters[k] == (PathGetDriveNumberU(system_dir) + 'A'))
-							remove_drive = 2;
-					}
-					// Make sure that we don't list any drive that should not be listed
-					if (remove_drive) {
-						uprintf("Removing %c: from the list: This is the %s!", toupper(drive_letters[--k]),
-							(remove_drive==1)?"disk from which " APPLICATION_NAME " is running":"system disk");
-						safe_free(devint_detail_data);
-						break;
-					}
-					safe_sprintf(&display_msg[strlen(display_msg)], sizeof(display_msg) - strlen(display_msg) - 1,
-						"%s [%s]", (right_to_left_mode) ? RIGHT_TO_LEFT_MARK : "",
-						SizeToHumanReadable(drive_size, FALSE, use_fake_units));
-					display_name = display_msg;
-				}
-
-				rufus_drive[num_drives].index = drive_index;
-				rufus_drive[num_drives].id = safe_strdup(device_instance_id);
-				rufus_drive[num_drives].name = safe_strdup(buffer);
-				rufus_drive[num_drives].display_name = safe_strdup(display_name);
-				rufus_drive[num_drives].label = safe_strdup(label);
-				rufus_drive[num_drives].size = drive_size;
-				if_assert_fails(rufus_drive[num_drives].size != 0)
-					break;
-				if (hub_path != NULL) {
-					rufus_drive[num_drives].hub = safe_strdup(hub_path);
-					rufus_drive[num_drives].port = props.port;
-				}
-				num_drives++;
-				if (num_drives >= MAX_DRIVES)
-					uprintf("WARNING: Found more than %d drives - ignoring remaining ones...", MAX_DRIVES);
-				safe_free(devint_detail_data);
-				break;
-			}
+		rufus_drive[num_drives].index = drive_index;
+		rufus_drive[num_drives].id = safe_strdup(entry->id);
+		rufus_drive[num_drives].name = safe_strdup(dp->name);
+		rufus_drive[num_drives].display_name = safe_strdup(display_name);
+		rufus_drive[num_drives].label = safe_strdup(label);
+		rufus_drive[num_drives].size = drive_size;
+		rufus_drive[num_drives].is_hdd = (!props.is_VHD) && (!props.is_CARD) && (dp->media.hdd_score > 0);
+		if_assert_fails(rufus_drive[num_drives].size != 0)
+			break;
+		if (dp->hub_path != NULL) {
+			rufus_drive[num_drives].hub = safe_strdup(dp->hub_path);
+			rufus_drive[num_drives].port = props.port;
 		}
+		num_drives++;
+		if (num_drives >= MAX_DRIVES)
+			uprintf("WARNING: Found more than %d drives - ignoring remaining ones...", MAX_DRIVES);
 	}
-	SetupDiDestroyDeviceInfoList(dev_info);
 
 	// Reorder the drives by increasing size, using the "selection sort" algorithm
 	for (u = 0; u < num_drives - 1; u++) {
@@ -1090,5 +1511,8 @@ out:
 	safe_free(devid_list);
 	StrArrayDestroy(&dev_if_path);
 	htab_destroy(&htab_devid);
+	refreshing_devices = FALSE;
+	if (refresh_requested)
+		PostMessage(hMainDialog, UM_DEVICES_PROBED, 0, 0);
 	return r;
 }
@@ -0,0 +1,247 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Device cache, for incremental device enumeration
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "devcache.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#define AtomicRead(p)           InterlockedCompareExchange(p, 0, 0)
+#define AtomicWrite(p, v)       InterlockedExchange(p, v)
+#else
+#define AtomicRead(p)           __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define AtomicWrite(p, v)       __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define _strdup                 strdup
+#endif
+
+static __inline long GetState(dev_cache_entry* entry)
+{
+	return AtomicRead(&entry->state);
+}
+
+static void FreeEntry(dev_cache* cache, dev_cache_entry* entry)
+{
+	if ((entry->data != NULL) && (cache->free_data != NULL))
+		cache->free_data(entry->data);
+	free(entry->id);
+	free(entry);
+}
+
+/*
+ * Free an entry that is no longer part of the enumeration, or keep it
+ * around until its probe is over, if it is being probed.
+ */
+static void DropEntry(dev_cache* cache, dev_cache_entry* entry)
+{
+	dev_cache_entry** orphans;
+
+	if (GetState(entry) != DEV_PROBE_PENDING) {
+		FreeEntry(cache, entry);
+		return;
+	}
+	if (cache->nb_orphans >= cache->max_orphans) {
+		orphans = realloc(cache->orphans, (cache->max_orphans + 8) * sizeof(dev_cache_entry*));
+		// If we can't keep track of it, leaking the entry is better than freeing it under a prober
+		if (orphans == NULL)
+			return;
+		cache->orphans = orphans;
+		cache->max_orphans += 8;
+	}
+	cache->orphans[cache->nb_orphans++] = entry;
+}
+
+static void FreeOrphans(dev_cache* cache)
+{
+	uint32_t i, j;
+
+	for (i = 0, j = 0; i < cache->nb_orphans; i++) {
+		if (GetState(cache->orphans[i]) == DEV_PROBE_PENDING)
+			cache->orphans[j++] = cache->orphans[i];
+		else
+			FreeEntry(cache, cache->orphans[i]);
+	}
+	cache->nb_orphans = j;
+}
+
+void DevCacheInit(dev_cache* cache, void (*free_data)(void* data))
+{
+	memset(cache, 0, sizeof(dev_cache));
+	cache->free_data = free_data;
+}
+
+/*
+ * Entries that are still being probed are not freed, as they would be used
+ * after free by their prober, so this must only be called on exit.
+ */
+void DevCacheFree(dev_cache* cache)
+{
+	uint32_t i;
+
+	for (i = 0; i < cache->nb_entries; i++)
+		DropEntry(cache, cache->entries[i]);
+	FreeOrphans(cache);
+	free(cache->entries);
+	free(cache->orphans);
+	DevCacheInit(cache, cache->free_data);
+}
+
+void DevCacheBeginEnum(dev_cache* cache)
+{
+	FreeOrphans(cache);
+	cache->nb_seen = 0;
+}
+
+/*
+ * Add a device that is present to the enumeration and return its entry. The entry
+ * is a new one, with NULL data, if the device was not known or if its signature
+ * changed. Returns NULL on allocation error.
+ */
+dev_cache_entry* DevCacheAdd(dev_cache* cache, const char* id, uint32_t signature)
+{
+	dev_cache_entry *entry = NULL, **entries;
+	uint32_t i;
+
+	if (id == NULL)
+		return NULL;
+
+	// Entries that were already added during this enumeration are skipped, so that
+	// duplicate IDs end up in separate entries
+	for (i = cache->nb_seen; i < cache->nb_entries; i++) {
+		if (strcmp(cache->entries[i]->id, id) == 0)
+			break;
+	}
+
+	if ((i < cache->nb_entries) && (cache->entries[i]->signature != signature)) {
+		// The device changed => drop the entry and create a new one in its place
+		entry = (dev_cache_entry*)calloc(1, sizeof(dev_cache_entry));
+		if (entry == NULL)
+			return NULL;
+		entry->id = _strdup(id);
+		if (entry->id == NULL) {
+			free(entry);
+			return NULL;
+		}
+		DropEntry(cache, cache->entries[i]);
+		cache->entries[i] = entry;
+	} else if (i >= cache->nb_entries) {
+		// New device
+		if (cache->nb_entries >= cache->max_entries) {
+			entries = realloc(cache->entries, (cache->max_entries + 16) * sizeof(dev_cache_entry*));
+			if (entries == NULL)
+				return NULL;
+			cache->entries = entries;
+			cache->max_entries += 16;
+		}
+		entry = (dev_cache_entry*)calloc(1, sizeof(dev_cache_entry));
+		if (entry == NULL)
+			return NULL;
+		entry->id = _strdup(id);
+		if (entry->id == NULL) {
+			free(entry);
+			return NULL;
+		}
+		cache->entries[cache->nb_entries++] = entry;
+	}
+	entry = cache->entries[i];
+	entry->signature = signature;
+
+	// Move the entry to the end of the ones we saw during this enumeration
+	cache->entries[i] = cache->entries[cache->nb_seen];
+	cache->entries[cache->nb_seen++] = entry;
+	return entry;
+}
+
+/*
+ * Drop the entries of the devices that were not added since DevCacheBeginEnum().
+ */
+void DevCacheEndEnum(dev_cache* cache)
+{
+	uint32_t i;
+
+	for (i = cache->nb_seen; i < cache->nb_entries; i++)
+		DropEntry(cache, cache->entries[i]);
+	cache->nb_entries = cache->nb_seen;
+}
+
+/*
+ * Flag the device identified by 'id', or all the devices if 'id' is NULL,
+ * as requiring a new probe. This is meant to be used when the media of a
+ * device may have changed, without its enumeration properties changing.
+ */
+void DevCacheInvalidate(dev_cache* cache, const char* id)
+{
+	uint32_t i;
+
+	if (id == NULL) {
+		cache->generation++;
+		return;
+	}
+	for (i = 0; i < cache->nb_entries; i++) {
+		if (strcmp(cache->entries[i]->id, id) == 0)
+			cache->entries[i]->generation = cache->generation - 1;
+	}
+}
+
+/*
+ * Returns nonzero if the device was never probed or was invalidated since its last
+ * probe. A device that is being probed doesn't need a new probe until it's done.
+ */
+int DevCacheNeedsProbe(dev_cache* cache, dev_cache_entry* entry)
+{
+	switch (GetState(entry)) {
+	case DEV_PROBE_NONE:
+		return 1;
+	case DEV_PROBE_DONE:
+		return (entry->generation != cache->generation);
+	default:
+		return 0;
+	}
+}
+
+void DevCacheStartProbe(dev_cache* cache, dev_cache_entry* entry)
+{
+	entry->generation = cache->generation;
+	AtomicWrite(&entry->state, DEV_PROBE_PENDING);
+}
+
+/* May be called from any thread, once the entry's data has been populated */
+void DevCacheEndProbe(dev_cache_entry* entry)
+{
+	AtomicWrite(&entry->state, DEV_PROBE_DONE);
+}
+
+int DevCacheIsProbed(dev_cache_entry* entry)
+{
+	return (GetState(entry) == DEV_PROBE_DONE);
+}
+
+/* FNV-1a, to compute device signatures */
+uint32_t DevCacheHash(uint32_t hash, const void* data, size_t len)
+{
+	const uint8_t* p = (const uint8_t*)data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x01000193;
+	}
+	return hash;
+}
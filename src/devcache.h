@@ -0,0 +1,78 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Device cache, for incremental device enumeration
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#pragma once
+
+/*
+ * The device cache keeps the data that was probed for each device, keyed by Device
+ * Instance ID, so that a refresh only needs to probe the devices that appeared or
+ * changed. A refresh is performed by calling DevCacheBeginEnum(), then DevCacheAdd()
+ * for each of the devices that are present, in enumeration order, and finally
+ * DevCacheEndEnum(), which drops the devices that went away.
+ * The signature provided to DevCacheAdd() should be computed from the properties that
+ * enumeration provides, so that a device whose properties changed is probed again.
+ * Probing is left to the caller, who may perform it from other threads between the
+ * calls to DevCacheStartProbe() and DevCacheEndProbe(). An entry whose device goes
+ * away or changes while being probed is only freed once its probe is over.
+ * This code doesn't depend on the Windows API, besides the Interlocked calls that are
+ * used on Windows, so that it can be tested on other platforms (see tests/).
+ */
+
+enum dev_probe_state {
+	DEV_PROBE_NONE = 0,
+	DEV_PROBE_PENDING,
+	DEV_PROBE_DONE
+};
+
+typedef struct {
+	char*         id;			// Device Instance ID
+	uint32_t      signature;	// Hash of the enumeration properties of the device
+	uint32_t      generation;	// Cache generation for which the last probe was started
+	volatile long state;		// One of dev_probe_state
+	void*         data;			// Provider data, freed through the cache's free_data()
+} dev_cache_entry;
+
+typedef struct {
+	dev_cache_entry** entries;	// Entries from the last enumeration, in enumeration order
+	uint32_t          nb_entries;
+	uint32_t          max_entries;
+	uint32_t          nb_seen;	// Number of entries added since DevCacheBeginEnum()
+	dev_cache_entry** orphans;	// Entries that went away or changed while being probed
+	uint32_t          nb_orphans;
+	uint32_t          max_orphans;
+	uint32_t          generation;
+	void (*free_data)(void* data);
+} dev_cache;
+
+void DevCacheInit(dev_cache* cache, void (*free_data)(void* data));
+void DevCacheFree(dev_cache* cache);
+void DevCacheBeginEnum(dev_cache* cache);
+dev_cache_entry* DevCacheAdd(dev_cache* cache, const char* id, uint32_t signature);
+void DevCacheEndEnum(dev_cache* cache);
+void DevCacheInvalidate(dev_cache* cache, const char* id);
+int DevCacheNeedsProbe(dev_cache* cache, dev_cache_entry* entry);
+void DevCacheStartProbe(dev_cache* cache, dev_cache_entry* entry);
+void DevCacheEndProbe(dev_cache_entry* entry);
+int DevCacheIsProbed(dev_cache_entry* entry);
+uint32_t DevCacheHash(uint32_t hash, const void* data, size_t len);
+#define DevCacheHashStr(hash, str) DevCacheHash(hash, str, strlen(str))
+#define DEV_CACHE_HASH_INIT 0x811c9dc5
@@ -0,0 +1,320 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Segmented downloads - Platform independent state and scheduling
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "download_state.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#define AtomicIncrement(p)      InterlockedIncrement(p)
+#define AtomicRead(p)           InterlockedCompareExchange(p, 0, 0)
+#define AtomicWrite(p, v)       InterlockedExchange(p, v)
+#define AtomicAdd64(p, v)       InterlockedExchangeAdd64(p, v)
+#define AtomicRead64(p)         InterlockedCompareExchange64(p, 0, 0)
+#define AtomicReadByte(p)       (MemoryBarrier(), *(p))
+#define AtomicWriteByte(p, v)   do { MemoryBarrier(); *(p) = (v); MemoryBarrier(); } while (0)
+#define AtomicWrite64(p, v)     InterlockedExchange64(p, v)
+#define SleepMs(ms)             Sleep(ms)
+#else
+#include <unistd.h>
+#define AtomicIncrement(p)      __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST)
+#define AtomicRead(p)           __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define AtomicWrite(p, v)       __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define AtomicAdd64(p, v)       __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST)
+#define AtomicRead64(p)         __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define AtomicReadByte(p)       __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define AtomicWriteByte(p, v)   __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define AtomicWrite64(p, v)     __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define SleepMs(ms)             usleep((ms) * 1000)
+#endif
+
+/* Get the total size from a "bytes <start>-<end>/<total size>" Content-Range */
+int DownloadStateParseContentRange(const char* content_range, uint64_t* total_size)
+{
+	const char* p;
+	char* end;
+
+	if (content_range == NULL || total_size == NULL || strncmp(content_range, "bytes ", 6) != 0)
+		return 0;
+	p = strchr(content_range, '/');
+	if (p == NULL || p[1] < '0' || p[1] > '9')
+		return 0;
+	*total_size = strtoull(&p[1], &end, 10);
+	return (*end == 0 || *end == '\r' || *end == '\n') && (*total_size != 0);
+}
+
+/* Initialize the state of a download. Validators that are too long to be saved are dropped. */
+void DownloadStateInit(download_state_t* state, uint64_t total_size, uint32_t segment_size,
+	const char* etag, const char* last_modified)
+{
+	memset(state, 0, sizeof(*state));
+	memcpy(state->magic, DOWNLOAD_STATE_MAGIC, sizeof(state->magic));
+	state->total_size = total_size;
+	state->segment_size = segment_size;
+	state->nb_segments = (uint32_t)((total_size + segment_size - 1) / segment_size);
+	if (etag != NULL && strlen(etag) < sizeof(state->etag))
+		strcpy(state->etag, etag);
+	if (last_modified != NULL && strlen(last_modified) < sizeof(state->last_modified))
+		strcpy(state->last_modified, last_modified);
+}
+
+/* Whether we can tell if the remote file changed, which is required to resume */
+int DownloadStateHasValidator(const download_state_t* state)
+{
+	/* Weak ETags ("W/...") don't guarantee that the content is byte for byte identical */
+	return (state->etag[0] != 0 && strncmp(state->etag, "W/", 2) != 0) || (state->last_modified[0] != 0);
+}
+
+/*
+ * Check whether the 'saved_size' bytes of 'saved' state, of a partial download whose
+ * file has 'file_size' bytes, are for the same remote file as 'state'. If so, fill
+ * the completion flags of the 'state->nb_segments' segments in 'done' and return 1.
+ * Otherwise, the download must be restarted from scratch, and 0 is returned.
+ */
+int DownloadStateResume(const download_state_t* state, const uint8_t* saved, size_t saved_size,
+	int64_t file_size, uint8_t* done)
+{
+	uint32_t i;
+
+	if (saved == NULL || done == NULL || !DownloadStateHasValidator(state))
+		return 0;
+	if (saved_size != sizeof(*state) + state->nb_segments || memcmp(saved, state, sizeof(*state)) != 0 ||
+		file_size != (int64_t)state->total_size)
+		return 0;
+	for (i = 0; i < state->nb_segments; i++)
+		done[i] = (saved[sizeof(*state) + i] != 0);
+	return 1;
+}
+
+/* Set up the scheduling of the segments of 'state', with none of them done */
+int DownloadSegmentsInit(download_segments_t* dl, const download_state_t* state, uint32_t max_attempts,
+	int (*fetch)(void* worker, download_job_t* job), void (*commit)(void* worker, uint32_t segment))
+{
+	memset(dl, 0, sizeof(*dl));
+	dl->total_size = state->total_size;
+	dl->segment_size = state->segment_size;
+	dl->nb_segments = state->nb_segments;
+	dl->max_attempts = max_attempts;
+	dl->fetch = fetch;
+	dl->commit = commit;
+	dl->done = calloc(dl->nb_segments + 1, 1);
+	return (dl->done != NULL);
+}
+
+void DownloadSegmentsFree(download_segments_t* dl)
+{
+	free((void*)dl->done);
+	dl->done = NULL;
+}
+
+/*
+ * Mark the segments that a previous download of the same remote file completed as
+ * done, and account for their data, if the saved state allows it (see above).
+ */
+int DownloadSegmentsResume(download_segments_t* dl, const download_state_t* state, const uint8_t* saved,
+	size_t saved_size, int64_t file_size)
+{
+	uint32_t i;
+
+	if (!DownloadStateResume(state, saved, saved_size, file_size, (uint8_t*)dl->done))
+		return 0;
+	for (i = 0; i < dl->nb_segments; i++) {
+		if (dl->done[i])
+			dl->downloaded += DownloadSegmentSize(dl, i);
+	}
+	return 1;
+}
+
+uint64_t DownloadSegmentSize(const download_segments_t* dl, uint32_t segment)
+{
+	uint64_t start = (uint64_t)segment * dl->segment_size;
+
+	if (segment >= dl->nb_segments)
+		return 0;
+	return (dl->total_size - start < dl->segment_size) ? dl->total_size - start : dl->segment_size;
+}
+
+/* Download segments until none are left or the download is aborted. Called by each download thread. */
+void DownloadSegmentsRun(download_segments_t* dl, void* worker)
+{
+	download_job_t job = { 0 };
+	uint32_t segment;
+
+	job.dl = dl;
+	while (!DownloadSegmentsAborted(dl) && (segment = (uint32_t)AtomicIncrement(&dl->next_segment) - 1) < dl->nb_segments) {
+		if (AtomicReadByte(&dl->done[segment]))
+			continue;
+		job.segment = segment;
+		job.offset = (uint64_t)segment * dl->segment_size;
+		job.size = DownloadSegmentSize(dl, segment);
+		for (job.attempt = 0; job.attempt < dl->max_attempts && !DownloadSegmentsAborted(dl); job.attempt++) {
+			job.counted = 0;
+			if (dl->fetch(worker, &job))
+				break;
+			/* Don't report the data of a failed attempt as downloaded */
+			AtomicAdd64(&dl->downloaded, -job.counted);
+		}
+		if (job.attempt >= dl->max_attempts || DownloadSegmentsAborted(dl)) {
+			DownloadSegmentsAbort(dl);
+			break;
+		}
+		/* Record the completed segment, for resume, before it can be consumed */
+		if (dl->commit != NULL)
+			dl->commit(worker, segment);
+		AtomicWriteByte(&dl->done[segment], 1);
+	}
+}
+
+/* Report 'size' bytes of a segment as downloaded, for progress */
+void DownloadSegmentsReport(download_job_t* job, int64_t size)
+{
+	job->counted += size;
+	AtomicAdd64(&job->dl->downloaded, size);
+}
+
+void DownloadSegmentsAbort(download_segments_t* dl)
+{
+	AtomicWrite(&dl->abort, 1);
+}
+
+int DownloadSegmentsAborted(download_segments_t* dl)
+{
+	return (AtomicRead(&dl->abort) != 0);
+}
+
+uint64_t DownloadSegmentsDownloaded(download_segments_t* dl)
+{
+	return (uint64_t)AtomicRead64(&dl->downloaded);
+}
+
+/*
+ * Call consume() for each of the completed segments that follow the ones that were
+ * already consumed, in order, and stop at the first one that isn't done, or that
+ * consume() fails to process. Returns the number of segments consumed so far.
+ */
+uint32_t DownloadSegmentsConsume(download_segments_t* dl, int (*consume)(void* ctx, uint64_t offset, uint64_t size), void* ctx)
+{
+	for (; dl->consumed < dl->nb_segments && AtomicReadByte(&dl->done[dl->consumed]); dl->consumed++) {
+		if (!consume(ctx, (uint64_t)dl->consumed * dl->segment_size, DownloadSegmentSize(dl, dl->consumed)))
+			break;
+	}
+	return dl->consumed;
+}
+
+/* Size of the data that was consumed contiguously from the start of the file */
+uint64_t DownloadSegmentsAvailable(const download_segments_t* dl)
+{
+	uint64_t size = (uint64_t)dl->consumed * dl->segment_size;
+
+	return (size < dl->total_size) ? size : dl->total_size;
+}
+
+/* Start streaming an image, whose published SHA-256, if any, must already have been set */
+void DownloadStreamStart(download_stream_t* stream)
+{
+	stream->total_size = 0;
+	AtomicWrite64(&stream->available, 0);
+	AtomicWrite(&stream->state, STREAM_ACTIVE);
+}
+
+/* Publish the size of the data that was downloaded contiguously from the start of the image */
+void DownloadStreamUpdate(download_stream_t* stream, uint64_t available)
+{
+	AtomicWrite64(&stream->available, (int64_t)available);
+}
+
+/* End the download of the image, which failed if 'total_size' is zero */
+void DownloadStreamEnd(download_stream_t* stream, uint64_t total_size)
+{
+	stream->total_size = total_size;
+	if (total_size != 0) {
+		AtomicWrite64(&stream->available, (int64_t)total_size);
+		AtomicWrite(&stream->state, STREAM_COMPLETE);
+	} else {
+		AtomicWrite(&stream->state, STREAM_FAILED);
+	}
+}
+
+long DownloadStreamState(download_stream_t* stream)
+{
+	return AtomicRead(&stream->state);
+}
+
+/*
+ * Wait until the first 'size' bytes of the image have been downloaded, or until its
+ * download is over. Returns 0 if the download failed, or if cancelled() returns nonzero.
+ */
+int DownloadStreamWait(download_stream_t* stream, uint64_t size, int (*cancelled)(void))
+{
+	while (DownloadStreamState(stream) == STREAM_ACTIVE) {
+		if ((uint64_t)AtomicRead64(&stream->available) >= size)
+			return 1;
+		if (cancelled != NULL && cancelled())
+			return 0;
+		SleepMs(50);
+	}
+	return (DownloadStreamState(stream) != STREAM_FAILED);
+}
+
+/*
+ * Check the SHA-256 of the 'size' bytes of the image that the writer read, which must
+ * be the whole image, once its download has completed.
+ */
+int DownloadStreamVerify(download_stream_t* stream, uint64_t size, const uint8_t* sha256)
+{
+	if (DownloadStreamState(stream) != STREAM_COMPLETE || size != stream->total_size)
+		return 0;
+	return (memcmp(sha256, stream->has_published_sha256 ? stream->published_sha256 : stream->sha256,
+		DOWNLOAD_SHA256_SIZE) == 0);
+}
+
+static __inline int HexValue(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Get the SHA-256 from a published '.sha256' file, using either the sha256sum
+ * ("<digest>  <name>") or the BSD ("SHA256 (<name>) = <digest>") format, which
+ * is the first run of exactly 64 hex digits.
+ */
+int DownloadStreamParseSha256(const char* buf, size_t size, uint8_t* sha256)
+{
+	size_t i, j, len;
+
+	if (buf == NULL || sha256 == NULL)
+		return 0;
+	for (i = 0; i < size; i += (len == 0) ? 1 : len) {
+		for (len = 0; (i + len < size) && HexValue(buf[i + len]) >= 0; len++);
+		if (len == 2 * DOWNLOAD_SHA256_SIZE) {
+			for (j = 0; j < len / 2; j++)
+				sha256[j] = (uint8_t)((HexValue(buf[i + 2 * j]) << 4) | HexValue(buf[i + 2 * j + 1]));
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Segmented downloads - Platform independent state and scheduling
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#pragma once
+
+/*
+ * This is the part of the segmented downloads that doesn't depend on the Windows
+ * API, i.e. the state that is saved alongside a file being downloaded, the decision
+ * of whether an interrupted download can be resumed from it, the scheduling of the
+ * segments between the download threads, and the state of an image that is being
+ * written while it is being downloaded. The transfers themselves are left to
+ * the caller, through callbacks, so that this can be tested on other platforms,
+ * against a local server (see tests/).
+ */
+
+#define DOWNLOAD_STATE_MAGIC    "RUFUSDL2"
+#define DOWNLOAD_SHA256_SIZE    32
+
+/*
+ * State of a segmented download. The header and the completion flags of all the
+ * segments are saved alongside the file being downloaded, so that an interrupted
+ * download can be resumed, provided that the remote file did not change, which
+ * requires the server to provide an ETag or a Last-Modified validator.
+ */
+typedef struct {
+	char magic[8];
+	uint64_t total_size;
+	uint32_t segment_size;
+	uint32_t nb_segments;
+	char etag[128];
+	char last_modified[64];
+} download_state_t;
+
+int DownloadStateParseContentRange(const char* content_range, uint64_t* total_size);
+void DownloadStateInit(download_state_t* state, uint64_t total_size, uint32_t segment_size,
+	const char* etag, const char* last_modified);
+int DownloadStateHasValidator(const download_state_t* state);
+int DownloadStateResume(const download_state_t* state, const uint8_t* saved, size_t saved_size,
+	int64_t file_size, uint8_t* done);
+
+typedef struct download_segments download_segments_t;
+
+/* A download attempt of a single segment, as provided to the fetch() callback */
+typedef struct {
+	download_segments_t* dl;
+	uint32_t segment;
+	uint32_t attempt;		// 0 for the first attempt
+	uint64_t offset;
+	uint64_t size;
+	int64_t  counted;		// Bytes reported by this attempt, through DownloadSegmentsReport()
+} download_job_t;
+
+/*
+ * Segments are claimed, in order, by the threads that call DownloadSegmentsRun(),
+ * which skip the ones that were completed by a previous download. A segment that
+ * fetch() fails to download is attempted again, up to 'max_attempts' times, after
+ * which the whole download is aborted. Once a segment has been fetched, commit()
+ * is called, so that it can be recorded for resume, and the segment is marked done.
+ * The coordinating thread then uses DownloadSegmentsConsume() to process the
+ * completed segments in order, e.g. to hash them, as soon as all the ones that
+ * precede them are done.
+ */
+struct download_segments {
+	uint64_t total_size;
+	uint32_t segment_size;
+	uint32_t nb_segments;
+	uint32_t max_attempts;
+	uint32_t consumed;		// Number of segments processed by DownloadSegmentsConsume()
+	volatile uint8_t* done;
+	volatile long next_segment;
+	volatile long abort;
+	volatile int64_t downloaded;
+	// Called from the download threads, with the 'worker' they provided to DownloadSegmentsRun()
+	int (*fetch)(void* worker, download_job_t* job);
+	void (*commit)(void* worker, uint32_t segment);
+};
+
+int DownloadSegmentsInit(download_segments_t* dl, const download_state_t* state, uint32_t max_attempts,
+	int (*fetch)(void* worker, download_job_t* job), void (*commit)(void* worker, uint32_t segment));
+void DownloadSegmentsFree(download_segments_t* dl);
+int DownloadSegmentsResume(download_segments_t* dl, const download_state_t* state, const uint8_t* saved,
+	size_t saved_size, int64_t file_size);
+uint64_t DownloadSegmentSize(const download_segments_t* dl, uint32_t segment);
+void DownloadSegmentsRun(download_segments_t* dl, void* worker);
+void DownloadSegmentsReport(download_job_t* job, int64_t size);
+void DownloadSegmentsAbort(download_segments_t* dl);
+int DownloadSegmentsAborted(download_segments_t* dl);
+uint64_t DownloadSegmentsDownloaded(download_segments_t* dl);
+uint32_t DownloadSegmentsConsume(download_segments_t* dl, int (*consume)(void* ctx, uint64_t offset, uint64_t size), void* ctx);
+uint64_t DownloadSegmentsAvailable(const download_segments_t* dl);
+
+/*
+ * State of a disk image that is being streamed, i.e. written while it is being
+ * downloaded. The download publishes the size of the data it completed, from the
+ * start of the image, with DownloadStreamUpdate(), and the writer must call
+ * DownloadStreamWait() for the data it is about to read. Once the writer is done,
+ * DownloadStreamVerify() checks the SHA-256 of the data it read, against the one
+ * that the server published for the image, if any, or else against the SHA-256
+ * of the download.
+ */
+enum download_stream_state {
+	STREAM_NONE = 0,
+	STREAM_ACTIVE,
+	STREAM_COMPLETE,
+	STREAM_FAILED
+};
+
+typedef struct {
+	volatile long state;
+	volatile int64_t available;
+	uint64_t total_size;
+	int has_published_sha256;
+	uint8_t sha256[DOWNLOAD_SHA256_SIZE];
+	uint8_t published_sha256[DOWNLOAD_SHA256_SIZE];
+} download_stream_t;
+
+void DownloadStreamStart(download_stream_t* stream);
+void DownloadStreamUpdate(download_stream_t* stream, uint64_t available);
+void DownloadStreamEnd(download_stream_t* stream, uint64_t total_size);
+long DownloadStreamState(download_stream_t* stream);
+int DownloadStreamWait(download_stream_t* stream, uint64_t size, int (*cancelled)(void));
+int DownloadStreamVerify(download_stream_t* stream, uint64_t size, const uint8_t* sha256);
+int DownloadStreamParseSha256(const char* buf, size_t size, uint8_t* sha256);
@@ -401,8 +401,12 @@ BOOL RefreshDriveLayout(HANDLE hDrive);
 const char* GetMBRPartitionType(const uint8_t type);
 const char* GetGPTPartitionType(const GUID* guid);
 const char* GetExtFsLabel(DWORD DriveIndex, uint64_t PartitionOffset);
+BOOL GetExtFsUsedRanges(DWORD DriveIndex, uint64_t PartitionOffset, void (*MarkUsed)(uint64_t offset, uint64_t size));
 void ClearDrives(void);
 BOOL GetDevices(DWORD devnum);
+void InvalidateDevices(void);
+void InvalidateDrives(DWORD drive_mask);
+void FreeDeviceCache(void);
 BOOL CyclePort(int index);
 int CycleDevice(int index);
 BOOL RefreshLayout(DWORD DriveIndex);
@@ -0,0 +1,462 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Fan-out writer, for writing the same data stream to multiple targets
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fanout.h"
+#include "write_digest.h"
+
+typedef struct {
+	fanout_target* target;
+	fanout_t*      fo;
+	uint64_t       consumed;		// Number of blocks this target is done with
+	BOOL           active;			// FALSE once the target has failed or was cancelled
+} fanout_writer;
+
+struct fanout {
+	fanout_writer*      writers;
+	HANDLE*             threads;
+	uint32_t            nb_targets;
+	uint32_t            block_size;
+	uint32_t            nb_blocks;
+	uint32_t            alignment;
+	uint8_t*            ring;
+	uint32_t*           sizes;		// Data size of each block of the ring
+	write_digest_t      digest;		// Digests of the blocks of the stream, for verification
+	uint64_t            produced;	// Number of blocks submitted to the writers
+	uint64_t            total;		// Number of bytes submitted to the writers
+	uint32_t            fill;		// Data size of the block being filled
+	uint32_t            last_size;	// Data size of the last block of the stream
+	uint32_t            running;
+	BOOL                verify;
+	BOOL                ended;
+	BOOL                cancelled;
+	SRWLOCK             lock;
+	CONDITION_VARIABLE  data_ready;	// Signaled when a block was submitted, or on end/cancel
+	CONDITION_VARIABLE  slot_free;	// Signaled when a writer is done with a block, or exits
+};
+
+static __inline uint8_t* GetBlock(fanout_t* fo, uint64_t seq)
+{
+	return &fo->ring[(seq % fo->nb_blocks) * fo->block_size];
+}
+
+static __inline void SetStatus(fanout_target* target, LONG status)
+{
+	InterlockedExchange(&target->status, status);
+}
+
+/* Must be called with the lock held */
+static BOOL IsSlotFree(fanout_t* fo, BOOL* has_active)
+{
+	uint32_t i;
+
+	*has_active = FALSE;
+	for (i = 0; i < fo->nb_targets; i++) {
+		if (!fo->writers[i].active)
+			continue;
+		*has_active = TRUE;
+		if (fo->writers[i].consumed + fo->nb_blocks <= fo->produced)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Read the data back and compare it with the digests of the blocks we wrote */
+static void VerifyTarget(fanout_writer* w, uint8_t* buf)
+{
+	fanout_t* fo = w->fo;
+	fanout_target* target = w->target;
+	uint64_t seq, offset;
+	uint32_t size;
+
+	SetStatus(target, FANOUT_VERIFYING);
+	for (seq = 0; seq < fo->produced; seq++) {
+		if (fo->cancelled) {
+			SetStatus(target, FANOUT_CANCELLED);
+			return;
+		}
+		offset = seq * fo->block_size;
+		size = (seq == fo->produced - 1) ? fo->last_size : fo->block_size;
+		if (!target->read(target->ctx, offset, buf, size)) {
+			target->error_offset = offset;
+			SetStatus(target, FANOUT_READ_ERROR);
+			return;
+		}
+		if (WriteDigestCheck(&fo->digest, offset, buf, size) != WRITE_DIGEST_MATCH) {
+			target->error_offset = offset;
+			SetStatus(target, FANOUT_VERIFY_ERROR);
+			return;
+		}
+		InterlockedExchangeAdd64(&target->verified, size);
+	}
+	SetStatus(target, FANOUT_SUCCESS);
+}
+
+static DWORD WINAPI FanoutThread(LPVOID param)
+{
+	fanout_writer* w = (fanout_writer*)param;
+	fanout_t* fo = w->fo;
+	fanout_target* target = w->target;
+	uint8_t* buf;
+	uint64_t seq;
+	uint32_t size;
+	BOOL r;
+
+	while (1) {
+		AcquireSRWLockExclusive(&fo->lock);
+		while (!fo->cancelled && !fo->ended && (w->consumed == fo->produced))
+			SleepConditionVariableSRW(&fo->data_ready, &fo->lock, INFINITE, 0);
+		if (fo->cancelled || (w->consumed == fo->produced)) {
+			ReleaseSRWLockExclusive(&fo->lock);
+			break;
+		}
+		seq = w->consumed;
+		buf = GetBlock(fo, seq);
+		size = fo->sizes[seq % fo->nb_blocks];
+		ReleaseSRWLockExclusive(&fo->lock);
+
+		// The block can't be recycled until we've increased our consumed count
+		r = target->write(target->ctx, seq * fo->block_size, buf, size);
+
+		AcquireSRWLockExclusive(&fo->lock);
+		w->consumed++;
+		if (!r) {
+			w->active = FALSE;
+			target->error_offset = seq * fo->block_size;
+			// A write that was aborted because of a cancellation isn't an error
+			SetStatus(target, fo->cancelled ? FANOUT_CANCELLED : FANOUT_WRITE_ERROR);
+		}
+		WakeAllConditionVariable(&fo->slot_free);
+		ReleaseSRWLockExclusive(&fo->lock);
+		if (!r)
+			goto out;
+		InterlockedExchangeAdd64(&target->written, size);
+	}
+
+	if (fo->cancelled) {
+		SetStatus(target, FANOUT_CANCELLED);
+	} else if (!fo->verify || fo->produced == 0) {
+		SetStatus(target, FANOUT_SUCCESS);
+	} else {
+		buf = (uint8_t*)_mm_malloc(fo->block_size, fo->alignment);
+		if (buf == NULL) {
+			SetStatus(target, FANOUT_READ_ERROR);
+		} else {
+			VerifyTarget(w, buf);
+			_mm_free(buf);
+		}
+	}
+
+out:
+	AcquireSRWLockExclusive(&fo->lock);
+	w->active = FALSE;
+	fo->running--;
+	WakeAllConditionVariable(&fo->slot_free);
+	ReleaseSRWLockExclusive(&fo->lock);
+	ExitThread(0);
+}
+
+/*
+ * Create a fan-out writer for 'nb_targets' targets, using a ring of 'nb_blocks' blocks
+ * of 'block_size' bytes, aligned to 'alignment', which must be a power of two that
+ * divides 'block_size'. The last block of the stream is padded with zeroes to this
+ * alignment, so that all writes are a multiple of the sector size of the targets.
+ * The writer threads are started immediately.
+ */
+fanout_t* FanoutCreate(fanout_target* targets, uint32_t nb_targets, uint32_t block_size,
+	uint32_t nb_blocks, uint32_t alignment, BOOL verify)
+{
+	fanout_t* fo;
+	uint32_t i;
+
+	if ((targets == NULL) || (nb_targets == 0) || (nb_blocks == 0) || (alignment == 0) ||
+		(block_size == 0) || (block_size % alignment != 0))
+		return NULL;
+	for (i = 0; i < nb_targets; i++) {
+		if ((targets[i].write == NULL) || (verify && (targets[i].read == NULL)))
+			return NULL;
+	}
+
+	fo = (fanout_t*)calloc(1, sizeof(fanout_t));
+	if (fo == NULL)
+		return NULL;
+	fo->nb_targets = nb_targets;
+	fo->block_size = block_size;
+	fo->nb_blocks = nb_blocks;
+	fo->alignment = alignment;
+	fo->verify = verify;
+	InitializeSRWLock(&fo->lock);
+	InitializeConditionVariable(&fo->data_ready);
+	InitializeConditionVariable(&fo->slot_free);
+	fo->writers = (fanout_writer*)calloc(nb_targets, sizeof(fanout_writer));
+	fo->threads = (HANDLE*)calloc(nb_targets, sizeof(HANDLE));
+	fo->sizes = (uint32_t*)calloc(nb_blocks, sizeof(uint32_t));
+	fo->ring = (uint8_t*)_mm_malloc((size_t)block_size * nb_blocks, alignment);
+	if ((fo->writers == NULL) || (fo->threads == NULL) || (fo->sizes == NULL) || (fo->ring == NULL))
+		goto error;
+	if (verify && !WriteDigestInit(&fo->digest, block_size))
+		goto error;
+
+	for (i = 0; i < nb_targets; i++) {
+		targets[i].status = FANOUT_WRITING;
+		targets[i].written = 0;
+		targets[i].verified = 0;
+		targets[i].error_offset = 0;
+		fo->writers[i].target = &targets[i];
+		fo->writers[i].fo = fo;
+		fo->writers[i].active = TRUE;
+	}
+	for (i = 0; i < nb_targets; i++) {
+		fo->threads[i] = CreateThread(NULL, 0, FanoutThread, &fo->writers[i], 0, NULL);
+		if (fo->threads[i] == NULL)
+			break;
+		AcquireSRWLockExclusive(&fo->lock);
+		fo->running++;
+		ReleaseSRWLockExclusive(&fo->lock);
+	}
+	if (i < nb_targets) {
+		FanoutCancel(fo);
+		FanoutFree(fo);
+		return NULL;
+	}
+	return fo;
+
+error:
+	WriteDigestFree(&fo->digest);
+	free(fo->writers);
+	free(fo->threads);
+	free(fo->sizes);
+	if (fo->ring != NULL)
+		_mm_free(fo->ring);
+	free(fo);
+	return NULL;
+}
+
+/* Submit the block being filled to the writers */
+static BOOL SubmitBlock(fanout_t* fo)
+{
+	// As only the last block can be partial, the stream has one digest per block
+	if (fo->verify && !WriteDigestAdd(&fo->digest, GetBlock(fo, fo->produced), fo->fill))
+		return FALSE;
+	AcquireSRWLockExclusive(&fo->lock);
+	fo->sizes[fo->produced % fo->nb_blocks] = fo->fill;
+	fo->last_size = fo->fill;
+	fo->total += fo->fill;
+	fo->produced++;
+	fo->fill = 0;
+	WakeAllConditionVariable(&fo->data_ready);
+	ReleaseSRWLockExclusive(&fo->lock);
+	return TRUE;
+}
+
+/*
+ * Append data to the stream. This blocks while the ring is full.
+ * Returns FALSE if none of the targets is left, or on cancellation.
+ */
+BOOL FanoutWrite(fanout_t* fo, const void* buf, size_t size)
+{
+	const uint8_t* data = (const uint8_t*)buf;
+	BOOL has_active;
+	uint32_t len;
+
+	if (fo == NULL || fo->ended)
+		return FALSE;
+	while (size > 0) {
+		if (fo->fill == 0) {
+			// Wait for the block we are about to fill to be released by all the writers
+			AcquireSRWLockExclusive(&fo->lock);
+			while (!fo->cancelled && !IsSlotFree(fo, &has_active))
+				SleepConditionVariableSRW(&fo->slot_free, &fo->lock, INFINITE, 0);
+			ReleaseSRWLockExclusive(&fo->lock);
+			if (fo->cancelled || !has_active)
+				return FALSE;
+		}
+		len = (uint32_t)min(size, (size_t)(fo->block_size - fo->fill));
+		memcpy(&GetBlock(fo, fo->produced)[fo->fill], data, len);
+		fo->fill += len;
+		data += len;
+		size -= len;
+		if ((fo->fill == fo->block_size) && !SubmitBlock(fo))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Flag the end of the stream, after submitting the last block, padded to
+ * the alignment. The writers then verify their data, if requested.
+ */
+void FanoutEnd(fanout_t* fo)
+{
+	uint32_t padded_size;
+
+	if (fo == NULL || fo->ended)
+		return;
+	if (fo->fill != 0) {
+		padded_size = (fo->fill + fo->alignment - 1) / fo->alignment * fo->alignment;
+		memset(&GetBlock(fo, fo->produced)[fo->fill], 0, padded_size - fo->fill);
+		fo->fill = padded_size;
+		if (!SubmitBlock(fo))
+			FanoutCancel(fo);
+	}
+	if (fo->verify && !WriteDigestEnd(&fo->digest))
+		FanoutCancel(fo);
+	AcquireSRWLockExclusive(&fo->lock);
+	fo->ended = TRUE;
+	WakeAllConditionVariable(&fo->data_ready);
+	ReleaseSRWLockExclusive(&fo->lock);
+}
+
+/*
+ * Wait for up to dwMilliseconds for all the writers to be done.
+ * Returns TRUE if they are.
+ */
+BOOL FanoutWait(fanout_t* fo, DWORD dwMilliseconds)
+{
+	BOOL done;
+
+	if (fo == NULL)
+		return TRUE;
+	AcquireSRWLockExclusive(&fo->lock);
+	if (fo->running != 0)
+		SleepConditionVariableSRW(&fo->slot_free, &fo->lock, dwMilliseconds, 0);
+	done = (fo->running == 0);
+	ReleaseSRWLockExclusive(&fo->lock);
+	return done;
+}
+
+void FanoutCancel(fanout_t* fo)
+{
+	if (fo == NULL)
+		return;
+	AcquireSRWLockExclusive(&fo->lock);
+	fo->cancelled = TRUE;
+	WakeAllConditionVariable(&fo->data_ready);
+	WakeAllConditionVariable(&fo->slot_free);
+	ReleaseSRWLockExclusive(&fo->lock);
+}
+
+/*
+ * Return the number of bytes that the slowest of the active targets has written
+ * (or verified), or, if there are no active targets, the size of the stream.
+ */
+uint64_t FanoutGetProgress(fanout_t* fo, BOOL verification)
+{
+	uint64_t progress = UINT64_MAX, val;
+	uint32_t i;
+	LONG status;
+
+	if (fo == NULL)
+		return 0;
+	for (i = 0; i < fo->nb_targets; i++) {
+		status = InterlockedCompareExchange(&fo->writers[i].target->status, 0, 0);
+		if (status != (verification ? FANOUT_VERIFYING : FANOUT_WRITING))
+			continue;
+		val = (uint64_t)InterlockedCompareExchange64(verification ?
+			&fo->writers[i].target->verified : &fo->writers[i].target->written, 0, 0);
+		progress = min(progress, val);
+	}
+	if (progress == UINT64_MAX) {
+		AcquireSRWLockShared(&fo->lock);
+		progress = fo->total;
+		ReleaseSRWLockShared(&fo->lock);
+	}
+	return progress;
+}
+
+/* Return the number of bytes that were submitted to the writers so far, including padding */
+uint64_t FanoutGetSize(fanout_t* fo)
+{
+	uint64_t size;
+
+	if (fo == NULL)
+		return 0;
+	AcquireSRWLockShared(&fo->lock);
+	size = fo->total;
+	ReleaseSRWLockShared(&fo->lock);
+	return size;
+}
+
+uint32_t FanoutGetSuccessCount(fanout_t* fo)
+{
+	uint32_t i, count = 0;
+
+	if (fo == NULL)
+		return 0;
+	for (i = 0; i < fo->nb_targets; i++) {
+		if (InterlockedCompareExchange(&fo->writers[i].target->status, 0, 0) == FANOUT_SUCCESS)
+			count++;
+	}
+	return count;
+}
+
+/* Free the fan-out writer, after cancelling and waiting for any writers that are still running */
+void FanoutFree(fanout_t* fo)
+{
+	uint32_t i;
+
+	if (fo == NULL)
+		return;
+	AcquireSRWLockExclusive(&fo->lock);
+	if (fo->running != 0) {
+		fo->cancelled = TRUE;
+		WakeAllConditionVariable(&fo->data_ready);
+		while (fo->running != 0)
+			SleepConditionVariableSRW(&fo->slot_free, &fo->lock, INFINITE, 0);
+	}
+	ReleaseSRWLockExclusive(&fo->lock);
+	for (i = 0; i < fo->nb_targets; i++) {
+		if (fo->threads[i] != NULL) {
+			WaitForSingleObject(fo->threads[i], INFINITE);
+			CloseHandle(fo->threads[i]);
+		}
+	}
+	free(fo->writers);
+	free(fo->threads);
+	free(fo->sizes);
+	WriteDigestFree(&fo->digest);
+	_mm_free(fo->ring);
+	free(fo);
+}
+
+const char* FanoutStatusString(LONG status)
+{
+	switch (status) {
+	case FANOUT_WRITING:
+		return "Writing";
+	case FANOUT_VERIFYING:
+		return "Verifying";
+	case FANOUT_SUCCESS:
+		return "Success";
+	case FANOUT_WRITE_ERROR:
+		return "Write error";
+	case FANOUT_READ_ERROR:
+		return "Read error";
+	case FANOUT_VERIFY_ERROR:
+		return "Verification error";
+	case FANOUT_CANCELLED:
+		return "Cancelled";
+	default:
+		return "Unknown";
+	}
+}
@@ -0,0 +1,77 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Fan-out writer, for writing the same data stream to multiple targets
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include <stdint.h>
+
+#pragma once
+
+/*
+ * The fan-out writer takes a sequential stream of data, that it splits into blocks
+ * and hands over to one writer thread per target, through a ring of blocks that is
+ * shared by all the targets. A block is only recycled once all the targets that are
+ * still active have written it, so that the source is only ever read (or decompressed)
+ * once, and the stream runs at the speed of the slowest target.
+ * A target that fails is dropped from the set without affecting the other ones, and
+ * its status and error offset are recorded for the caller to report.
+ * When verification is requested, the digest of each block is computed as it goes
+ * through the ring, and each target reads its data back and compares it against the
+ * digests once it has written everything, so that the source doesn't need to be read
+ * again either.
+ * This code only uses the threading and synchronization API from Windows, so that it
+ * can be tested on other platforms, with file-backed targets.
+ */
+
+enum fanout_status {
+	FANOUT_WRITING = 0,
+	FANOUT_VERIFYING,
+	FANOUT_SUCCESS,
+	FANOUT_WRITE_ERROR,
+	FANOUT_READ_ERROR,
+	FANOUT_VERIFY_ERROR,
+	FANOUT_CANCELLED
+};
+
+typedef struct {
+	// Set by the caller
+	const char*     name;
+	void*           ctx;
+	// Write or read 'size' bytes at 'offset'. These are called from the target's thread.
+	BOOL (*write)(void* ctx, uint64_t offset, const uint8_t* buf, uint32_t size);
+	BOOL (*read)(void* ctx, uint64_t offset, uint8_t* buf, uint32_t size);
+	// Set by the fan-out writer
+	volatile LONG   status;			// One of fanout_status
+	volatile LONG64 written;		// Number of bytes written so far
+	volatile LONG64 verified;		// Number of bytes verified so far
+	uint64_t        error_offset;	// Offset of the failed block, if any
+} fanout_target;
+
+typedef struct fanout fanout_t;
+
+fanout_t* FanoutCreate(fanout_target* targets, uint32_t nb_targets, uint32_t block_size,
+	uint32_t nb_blocks, uint32_t alignment, BOOL verify);
+BOOL FanoutWrite(fanout_t* fo, const void* buf, size_t size);
+void FanoutEnd(fanout_t* fo);
+BOOL FanoutWait(fanout_t* fo, DWORD dwMilliseconds);
+void FanoutCancel(fanout_t* fo);
+uint64_t FanoutGetProgress(fanout_t* fo, BOOL verification);
+uint64_t FanoutGetSize(fanout_t* fo);
+uint32_t FanoutGetSuccessCount(fanout_t* fo);
+void FanoutFree(fanout_t* fo);
+const char* FanoutStatusString(LONG status);
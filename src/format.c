@@ -55,11 +55,24 @@
 #include "drive.h"
 #include "format.h"
 #include "badblocks.h"
+#include "fanout.h"
 #include "bled/bled.h"
+#include "write_digest.h"
 #include "../res/grub/grub_version.h"
 
 /* Numbers of buffer used for asynchronous DD reads */
 #define NUM_BUFFERS 2
+/* Number of blocks for which we don't check the target after finding a non zeroed one */
+#define SPARSE_WRITE_THROTTLE 16
+
+/* Sparse DD write context */
+typedef struct {
+	uint8_t* cmp_buf;
+	FILE_ALLOCATED_RANGE_BUFFER* ranges;
+	DWORD nb_ranges;
+	int throttle;
+	uint64_t skipped;
+} sparse_write_t;
 
 /*
  * Globals
@@ -70,12 +83,27 @@ badblocks_report report = { 0 };
 static float format_percent = 0.0f;
 static int task_number = 0, actual_fs_type;
 static unsigned int sec_buf_pos = 0;
+static uint32_t bmap_index = 0;
+static uint64_t dd_offset = 0;
+static BOOL bmap_hashing = FALSE;
+static bmap_t* bmap = NULL;
+static HASH_CONTEXT bmap_ctx;
+static uint64_t stream_pos = 0;
+static HASH_CONTEXT stream_ctx;
+static fanout_t* multi_fo = NULL;
+static fanout_target* multi_ft = NULL;
+static uint32_t multi_nb_targets = 0;
+static SRWLOCK multi_error_lock = SRWLOCK_INIT;
+static BOOL verify_drive = FALSE;
+static write_digest_t verify_digest = { 0 };
 extern const int nb_steps[FS_MAX];
 extern const char* md5sum_name[2];
 extern uint32_t dur_mins, dur_secs;
 extern BOOL force_large_fat32, enable_ntfs_compression, lock_drive, zero_drive, fast_zeroing, enable_file_indexing;
-extern BOOL write_as_image, use_vds, write_as_esp, is_vds_available, has_ffu_support, use_rufus_mbr;
+extern BOOL write_as_image, use_vds, write_as_esp, is_vds_available, has_ffu_support, use_rufus_mbr, verify_writes;
+extern BOOL multi_drive_hdds;
 extern char* archive_path;
+extern RUFUS_DRIVE rufus_drive[MAX_DRIVES];
 uint8_t *grub2_buf = NULL, *sec_buf = NULL;
 long grub2_len;
 
@@ -1078,6 +1106,154 @@ static void update_progress(const uint64_t processed_bytes)
 	uprint_progress(processed_bytes, img_report.image_size);
 }
 
+static void FreeWriteDigests(void)
+{
+	WriteDigestFree(&verify_digest);
+	verify_drive = FALSE;
+}
+
+/*
+ * Set up the recording of the digests of the data we write to the drive, so that it
+ * can be verified without having to read (or decompress, or download) the source again.
+ */
+static BOOL InitWriteDigests(void)
+{
+	FreeWriteDigests();
+	if (!WriteDigestInit(&verify_digest, VERIFY_DIGEST_SIZE)) {
+		uprintf("WARNING: Could not set up write verification");
+		return FALSE;
+	}
+	verify_drive = TRUE;
+	return TRUE;
+}
+
+/* Add data that was sequentially written to the drive to the digests */
+static void AddWriteDigests(const uint8_t* buf, size_t size)
+{
+	if (verify_drive && !WriteDigestAdd(&verify_digest, buf, size)) {
+		uprintf("\r\nWARNING: Could not record write digests - Verification will be skipped");
+		FreeWriteDigests();
+	}
+}
+
+/*
+ * Write a block of data at a specific offset of the target drive, with retries.
+ */
+static BOOL WriteDriveBlock(HANDLE hPhysicalDrive, uint64_t offset, const uint8_t* buf, DWORD size)
+{
+	BOOL s;
+	DWORD i, write_size;
+	LARGE_INTEGER li;
+
+	for (i = 1; i <= WRITE_RETRIES; i++) {
+		CHECK_FOR_USER_CANCEL;
+		li.QuadPart = offset;
+		if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
+			uprintf("\r\nWrite error: Could not set position - %s", WindowsErrorString());
+			break;
+		}
+		s = WriteFile(hPhysicalDrive, buf, size, &write_size, NULL);
+		if ((s) && (write_size == size))
+			return TRUE;
+		if (s)
+			uprintf("\r\nWrite error: Wrote %d bytes, expected %d bytes", write_size, size);
+		else
+			uprintf("\r\nWrite error at sector %lld: %s", offset / SelectedDrive.SectorSize, WindowsErrorString());
+		if (i < WRITE_RETRIES) {
+			uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
+			Sleep(WRITE_TIMEOUT);
+		}
+		Sleep(200);
+	}
+	ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+out:
+	return FALSE;
+}
+
+/*
+ * Write the parts of a DD buffer, located at offset in the image, that intersect
+ * with the ranges of a block map, either through a handle or a file descriptor.
+ * Since data is processed sequentially, we also compute the checksum of each range
+ * as we go, and validate it once the range has been fully processed.
+ */
+static BOOL BmapWrite(HANDLE hPhysicalDrive, int fd, uint64_t offset, const uint8_t* buf, DWORD size)
+{
+	uint64_t start, end, write_end;
+	uint8_t checksum[MAX_HASHSIZE];
+	bmap_range_t* range;
+
+	for (; bmap_index < bmap->nb_ranges; bmap_index++) {
+		range = &bmap->range[bmap_index];
+		if (range->start >= offset + size)
+			break;
+		start = MAX(range->start, offset);
+		end = MIN(range->end, offset + size);
+		if (start < end) {
+			if (!bmap_hashing) {
+				hash_init[bmap->checksum_type](&bmap_ctx);
+				bmap_hashing = TRUE;
+			}
+			hash_write[bmap->checksum_type](&bmap_ctx, &buf[start - offset], (size_t)(end - start));
+			// The last range may end on a partial block, but we must still write full sectors
+			write_end = (range->end >= bmap->image_size) ? offset + size : end;
+			if (fd >= 0) {
+				if ((_lseeki64(fd, start, SEEK_SET) != (int64_t)start) ||
+					(_write(fd, &buf[start - offset], (unsigned int)(write_end - start)) != (int)(write_end - start))) {
+					uprintf("\r\nWrite error at sector %lld", start / SelectedDrive.SectorSize);
+					return FALSE;
+				}
+			} else if (!WriteDriveBlock(hPhysicalDrive, start, &buf[start - offset], (DWORD)(write_end - start))) {
+				return FALSE;
+			}
+		}
+		// Range continues in the next buffer
+		if (range->end > offset + size)
+			break;
+		bmap_hashing = FALSE;
+		hash_final[bmap->checksum_type](&bmap_ctx);
+		memcpy(checksum, bmap_ctx.buf, hash_count[bmap->checksum_type]);
+		if (memcmp(checksum, range->checksum, hash_count[bmap->checksum_type]) != 0) {
+			uprintf("\r\nBlock map checksum mismatch for range 0x%llx-0x%llx - The image is corrupted!", range->start, range->end);
+			ErrorStatus = RUFUS_ERROR(ERROR_FILE_CORRUPT);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+// Sequential DD write of compressed data, that applies the block map if there is one
+static int dd_write(int fd, const void* buf, unsigned int count)
+{
+	int r = (int)count;
+
+	if (bmap == NULL) {
+		r = _write(fd, buf, count);
+		if (r == (int)count)
+			AddWriteDigests(buf, count);
+		return r;
+	}
+	if (!BmapWrite(INVALID_HANDLE_VALUE, fd, dd_offset, buf, count))
+		r = -1;
+	dd_offset += count;
+	return r;
+}
+
+// Read override for compressed images that are being streamed, which waits
+// for the data to have been downloaded, and hashes it for verification.
+static int stream_read(int fd, void* buf, unsigned int count)
+{
+	int r;
+
+	if (!WaitForImageData(stream_pos + count))
+		return -1;
+	r = _read(fd, buf, count);
+	if (r > 0) {
+		hash_write[HASH_SHA256](&stream_ctx, buf, r);
+		stream_pos += r;
+	}
+	return r;
+}
+
 // Some compressed images use streams that aren't multiple of the sector
 // size and cause write failures => Use a write override that alleviates
 // the problem. See GitHub issue #1422 for details.
@@ -1097,7 +1273,7 @@ static int sector_write(int fd, const void* _buf, unsigned int count)
 	// If we are on a sector boundary and count is multiple of the
 	// sector size, just issue a regular write
 	if ((sec_buf_pos == 0) && (count % sec_size == 0))
-		return _write(fd, buf, count);
+		return dd_write(fd, buf, count);
 
 	// If we have an existing partial sector, fill and write it
 	if (sec_buf_pos > 0) {
@@ -1110,14 +1286,14 @@ static int sector_write(int fd, const void* _buf, unsigned int count)
 		if (sec_buf_pos < sec_size)
 			return (int)count;
 		sec_buf_pos = 0;
-		written = _write(fd, sec_buf, sec_size);
+		written = dd_write(fd, sec_buf, sec_size);
 		if (written != sec_size)
 			return written;
 	}
 
 	// Now write as many full sectors as we can
 	uint32_t sec_num = (count - fill_size) / sec_size;
-	written = _write(fd, &buf[fill_size], sec_num * sec_size);
+	written = dd_write(fd, &buf[fill_size], sec_num * sec_size);
 	if (written < 0)
 		return written;
 	if (written != sec_num * sec_size) {
@@ -1139,6 +1315,293 @@ static int sector_write(int fd, const void* _buf, unsigned int count)
 	return (int)count;
 }
 
+/*
+ * Retrieve the allocated ranges of a sparse source image (the Windows
+ * equivalent of SEEK_DATA/SEEK_HOLE), so that we know which parts of
+ * the image are zeroed without having to look at the data.
+ */
+static void GetSparseRanges(HANDLE hFile, sparse_write_t* sw)
+{
+	BY_HANDLE_FILE_INFORMATION fi;
+	FILE_ALLOCATED_RANGE_BUFFER query, *ranges = NULL;
+	DWORD size = 64 * sizeof(FILE_ALLOCATED_RANGE_BUFFER), ret_size;
+
+	sw->ranges = NULL;
+	sw->nb_ranges = 0;
+	if (!GetFileInformationByHandle(hFile, &fi) || !(fi.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE))
+		return;
+	query.FileOffset.QuadPart = 0;
+	query.Length.QuadPart = ((uint64_t)fi.nFileSizeHigh << 32) | fi.nFileSizeLow;
+	while (1) {
+		ranges = (FILE_ALLOCATED_RANGE_BUFFER*)_reallocf(ranges, size);
+		if (ranges == NULL)
+			return;
+		if (DeviceIoControl(hFile, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), ranges, size, &ret_size, NULL))
+			break;
+		if (GetLastError() != ERROR_MORE_DATA) {
+			uprintf("Could not query sparse image ranges: %s", WindowsErrorString());
+			free(ranges);
+			return;
+		}
+		size *= 2;
+	}
+	sw->ranges = ranges;
+	sw->nb_ranges = ret_size / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+	uprintf("Image is sparse with %d allocated range(s)", sw->nb_ranges);
+}
+
+/*
+ * Return TRUE if the [offset, offset + size[ section of a sparse source
+ * image does not intersect with any of its allocated ranges.
+ */
+static BOOL IsSparseHole(sparse_write_t* sw, uint64_t offset, DWORD size)
+{
+	DWORD lo = 0, hi = sw->nb_ranges, mid;
+
+	if (sw->ranges == NULL)
+		return FALSE;
+	// Find the first range that ends after offset (ranges are sorted)
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if ((uint64_t)(sw->ranges[mid].FileOffset.QuadPart + sw->ranges[mid].Length.QuadPart) <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo >= sw->nb_ranges) || ((uint64_t)sw->ranges[lo].FileOffset.QuadPart >= offset + size);
+}
+
+static __inline BOOL IsSparseBlock(sparse_write_t* sw, uint64_t offset, const uint8_t* buf, DWORD size)
+{
+	return IsSparseHole(sw, offset, size) || is_zeroed(buf, size);
+}
+
+/*
+ * Write a DD buffer, looking for runs of zeroed blocks. Non-zeroed runs are
+ * written as a single write operation, whereas, for zeroed ones, we check
+ * if the target blocks are already zeroed, and skip writing them if so.
+ * Since reading flash media is usually much faster than writing it, this
+ * can considerably speed up the writing of images with a lot of free space.
+ * As with fast-zeroing, we back off from reading the target for a while
+ * whenever we find a block that still needs to be written.
+ */
+static BOOL WriteDriveSparse(HANDLE hPhysicalDrive, sparse_write_t* sw, uint64_t offset, const uint8_t* buf, DWORD size)
+{
+	BOOL zeroed;
+	DWORD pos, end, len, cmp_size;
+	LARGE_INTEGER li;
+
+	for (pos = 0; pos < size; pos = end) {
+		len = MIN(DD_SPARSE_BLOCK_SIZE, size - pos);
+		zeroed = IsSparseBlock(sw, offset + pos, &buf[pos], len);
+		// Coalesce with the following blocks of the same type
+		for (end = pos + len; end < size; end += len) {
+			len = MIN(DD_SPARSE_BLOCK_SIZE, size - end);
+			if (IsSparseBlock(sw, offset + end, &buf[end], len) != zeroed)
+				break;
+		}
+		if (!zeroed) {
+			if (!WriteDriveBlock(hPhysicalDrive, offset + pos, &buf[pos], end - pos))
+				return FALSE;
+			continue;
+		}
+		for (; pos < end; pos += len) {
+			len = MIN(DD_SPARSE_BLOCK_SIZE, end - pos);
+			if (sw->cmp_buf == NULL) {
+				// Target reads are disabled
+			} else if (sw->throttle > 0) {
+				sw->throttle--;
+			} else {
+				li.QuadPart = offset + pos;
+				if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN) ||
+					!ReadFile(hPhysicalDrive, sw->cmp_buf, len, &cmp_size, NULL) || (cmp_size != len)) {
+					uprintf("\r\nWARNING: Could not read target for sparse comparison - %s", WindowsErrorString());
+					safe_mm_free(sw->cmp_buf);
+				} else if (is_zeroed(sw->cmp_buf, len)) {
+					sw->skipped += len;
+					continue;
+				} else {
+					sw->throttle = SPARSE_WRITE_THROTTLE;
+				}
+			}
+			if (!WriteDriveBlock(hPhysicalDrive, offset + pos, &buf[pos], len))
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Write a VHD or VHDX image that we can access natively. Since the unallocated
+ * blocks of the virtual disk read as zeroes without any I/O, we only end up
+ * reading the blocks that are present in the image, and, if the target already
+ * is zeroed there, only writing these.
+ */
+static BOOL WriteVirtualDisk(HANDLE hPhysicalDrive, vdisk_t* vd)
+{
+	BOOL ret = FALSE;
+	DWORD size, buf_size;
+	uint64_t wb, target_size = MIN((uint64_t)SelectedDrive.DiskSize, vd->size);
+	uint8_t* buffer = NULL;
+	sparse_write_t sw = { 0 };
+
+	uprintf("Writing %s image natively, with %s of allocated data", vdisk_type_name(vd),
+		SizeToHumanReadable(vdisk_get_allocated_size(vd), FALSE, FALSE));
+	buf_size = CEILING_ALIGN(DD_BUFFER_SIZE, SelectedDrive.SectorSize);
+	buffer = (uint8_t*)_mm_malloc(buf_size, SelectedDrive.SectorSize);
+	if (buffer == NULL) {
+		ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+		uprintf("Could not allocate disk write buffer");
+		goto out;
+	}
+	sw.cmp_buf = (uint8_t*)_mm_malloc(DD_SPARSE_BLOCK_SIZE, SelectedDrive.SectorSize);
+
+	uprint_progress(0, 0);
+	for (wb = 0; wb < target_size; wb += size) {
+		UpdateProgressWithInfo(OP_FORMAT, MSG_261, wb, target_size);
+		uprint_progress(wb, target_size);
+		CHECK_FOR_USER_CANCEL;
+		size = (DWORD)MIN(buf_size, target_size - wb);
+		if (vdisk_read(vd, buffer, wb, size) != (int64_t)size) {
+			uprintf("\r\nRead error: %s", WindowsErrorString());
+			ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
+			goto out;
+		}
+		// WriteFile fails unless the size is a multiple of sector size
+		if (size % SelectedDrive.SectorSize != 0) {
+			memset(&buffer[size], 0, CEILING_ALIGN(size, SelectedDrive.SectorSize) - size);
+			size = CEILING_ALIGN(size, SelectedDrive.SectorSize);
+		}
+		if (!WriteDriveSparse(hPhysicalDrive, &sw, wb, buffer, size))
+			goto out;
+	}
+	uprintfs("\r\n");
+	if (sw.skipped != 0)
+		uprintf("Skipped writing %s of already zeroed blocks", SizeToHumanReadable(sw.skipped, FALSE, FALSE));
+	ret = TRUE;
+
+out:
+	safe_mm_free(buffer);
+	safe_mm_free(sw.cmp_buf);
+	return ret;
+}
+
+/*
+ * Read back the data we wrote, with multiple concurrent reads, and compare it with the
+ * digests that were recorded during the write. Because these are only recorded every
+ * VERIFY_DIGEST_SIZE bytes, we can only report the range of the first mismatching LBA.
+ */
+static BOOL VerifyDrive(HANDLE hPhysicalDrive)
+{
+	BOOL ret = FALSE, pending[VERIFY_QUEUE_DEPTH] = { 0 };
+	HANDLE hDrive = INVALID_HANDLE_VALUE;
+	OVERLAPPED overlapped[VERIFY_QUEUE_DEPTH] = { 0 };
+	DWORD i, len, read_size;
+	uint64_t seq, next, nb_blocks, offset, verify_size = verify_digest.size;
+	int64_t mismatch;
+	uint8_t* buffer = NULL;
+
+	if (!verify_drive)
+		return TRUE;
+	if (!WriteDigestEnd(&verify_digest)) {
+		uprintf("WARNING: Could not record write digests - Verification will be skipped");
+		FreeWriteDigests();
+		return TRUE;
+	}
+	// Everything we write is padded to the sector size, so this should never happen
+	if_assert_fails(verify_size % SelectedDrive.SectorSize == 0) {
+		ErrorStatus = RUFUS_ERROR(ERROR_INVALID_DATA);
+		goto out;
+	}
+
+	uprintf("Verifying written data:");
+	if (!FlushFileBuffers(hPhysicalDrive))
+		uprintf("WARNING: Could not flush drive - %s", WindowsErrorString());
+	// Use a separate unbuffered handle, so that we read the data from the drive and can queue reads
+	hDrive = ReOpenFile(hPhysicalDrive, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING);
+	if (hDrive == INVALID_HANDLE_VALUE) {
+		uprintf("Could not open drive for verification: %s", WindowsErrorString());
+		ErrorStatus = RUFUS_ERROR(ERROR_OPEN_FAILED);
+		goto out;
+	}
+	buffer = (uint8_t*)_mm_malloc(VERIFY_BLOCK_SIZE * VERIFY_QUEUE_DEPTH, SelectedDrive.SectorSize);
+	if (buffer == NULL) {
+		ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+		uprintf("Could not allocate verification buffer");
+		goto out;
+	}
+	for (i = 0; i < VERIFY_QUEUE_DEPTH; i++) {
+		overlapped[i].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (overlapped[i].hEvent == NULL) {
+			uprintf("Could not create verification event: %s", WindowsErrorString());
+			ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+			goto out;
+		}
+	}
+
+	UpdateProgressWithInfoInit(NULL, FALSE);
+	uprint_progress(0, 0);
+	nb_blocks = (verify_size + VERIFY_BLOCK_SIZE - 1) / VERIFY_BLOCK_SIZE;
+	for (seq = 0, next = 0; seq < nb_blocks; seq++) {
+		// Keep the read queue full
+		for (; (next < nb_blocks) && (next < seq + VERIFY_QUEUE_DEPTH); next++) {
+			i = (DWORD)(next % VERIFY_QUEUE_DEPTH);
+			offset = next * VERIFY_BLOCK_SIZE;
+			overlapped[i].Offset = (DWORD)offset;
+			overlapped[i].OffsetHigh = (DWORD)(offset >> 32);
+			if (!ReadFile(hDrive, &buffer[i * VERIFY_BLOCK_SIZE], (DWORD)MIN(VERIFY_BLOCK_SIZE, verify_size - offset),
+				NULL, &overlapped[i]) && (GetLastError() != ERROR_IO_PENDING)) {
+				uprintf("\r\nRead error at sector %lld: %s", offset / SelectedDrive.SectorSize, WindowsErrorString());
+				ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
+				goto out;
+			}
+			pending[i] = TRUE;
+		}
+
+		offset = seq * VERIFY_BLOCK_SIZE;
+		UpdateProgressWithInfo(OP_FORMAT, MSG_355, offset, verify_size);
+		uprint_progress(offset, verify_size);
+		i = (DWORD)(seq % VERIFY_QUEUE_DEPTH);
+		len = (DWORD)MIN(VERIFY_BLOCK_SIZE, verify_size - offset);
+		if (!GetOverlappedResultEx(hDrive, &overlapped[i], &read_size, DRIVE_ACCESS_TIMEOUT, FALSE) || (read_size != len)) {
+			uprintf("\r\nRead error at sector %lld: %s", offset / SelectedDrive.SectorSize, WindowsErrorString());
+			ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
+			goto out;
+		}
+		pending[i] = FALSE;
+		CHECK_FOR_USER_CANCEL;
+
+		mismatch = WriteDigestCheck(&verify_digest, offset, &buffer[i * VERIFY_BLOCK_SIZE], len);
+		if (mismatch != WRITE_DIGEST_MATCH) {
+			uprintf("\r\nVerification failed: First mismatch is in LBA %lld-%lld",
+				mismatch / SelectedDrive.SectorSize,
+				(mismatch + MIN(VERIFY_DIGEST_SIZE, verify_size - mismatch)) / SelectedDrive.SectorSize - 1);
+			ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+			goto out;
+		}
+	}
+	uprintfs("\r\n");
+	uprintf("Verified %s of written data", SizeToHumanReadable(verify_size, FALSE, FALSE));
+	ret = TRUE;
+
+out:
+	// Make sure that no read is still in flight before we release the buffer
+	if (hDrive != INVALID_HANDLE_VALUE) {
+		CancelIo(hDrive);
+		for (i = 0; i < VERIFY_QUEUE_DEPTH; i++) {
+			if (pending[i])
+				GetOverlappedResult(hDrive, &overlapped[i], &read_size, TRUE);
+		}
+		CloseHandle(hDrive);
+	}
+	for (i = 0; i < VERIFY_QUEUE_DEPTH; i++)
+		safe_closehandle(overlapped[i].hEvent);
+	safe_mm_free(buffer);
+	FreeWriteDigests();
+	return ret;
+}
+
 /* Write an image file or zero a drive */
 static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 {
@@ -1152,6 +1615,11 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 	uint32_t zero_data, *cmp_buffer = NULL;
 	char* vhd_path = NULL;
 	int throttle_fast_zeroing = 0, read_bufnum = 0, proc_bufnum = 1;
+	sparse_write_t sw = { 0 };
+	vdisk_t* vd = NULL;
+	// An image that is being downloaded is still open for writing
+	BOOL streaming = !bZeroDrive && IsImageStreaming(image_path);
+	DWORD share_mode = FILE_SHARE_READ | (streaming ? FILE_SHARE_WRITE : 0);
 
 	if (SelectedDrive.SectorSize < 512) {
 		uprintf("Unexpected sector size (%d) - Aborting", SelectedDrive.SectorSize);
@@ -1164,6 +1632,30 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 		uprintf("WARNING: Unable to rewind image position - wrong data might be copied!");
 	UpdateProgressWithInfoInit(NULL, FALSE);
 
+	// Look for a block map, that tells us which parts of the image we actually need to write
+	if (!bZeroDrive && (img_report.compression_type < BLED_COMPRESSION_MAX) &&
+		(img_report.compression_type != BLED_COMPRESSION_VTSI)) {
+		bmap = LoadBmap(image_path);
+		if ((bmap != NULL) && ((bmap->block_size % SelectedDrive.SectorSize != 0) ||
+			(bmap->image_size > (uint64_t)SelectedDrive.DiskSize) ||
+			((img_report.compression_type == BLED_COMPRESSION_NONE) && (bmap->image_size != img_report.image_size)))) {
+			uprintf("Block map does not match image or target - Ignoring");
+			FreeBmap(bmap);
+			bmap = NULL;
+		}
+		bmap_index = 0;
+		bmap_hashing = FALSE;
+		dd_offset = 0;
+	}
+
+	// Blocks that a block map excludes are not written, so they can't be verified
+	if (verify_writes && !bZeroDrive) {
+		if (bmap != NULL)
+			uprintf("Notice: Write verification is not available when using a block map");
+		else
+			InitWriteDigests();
+	}
+
 	if (bZeroDrive) {
 		uprintf(fast_zeroing ? "Fast-zeroing drive:" : "Zeroing drive:");
 		// Our buffer size must be a multiple of the sector size and *ALIGNED* to the sector size
@@ -1272,7 +1764,7 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 		uprintfs("\r\n");
 	} else if (img_report.compression_type != BLED_COMPRESSION_NONE && img_report.compression_type < BLED_COMPRESSION_MAX) {
 		uprintf("Writing compressed image:");
-		hSourceImage = CreateFileU(image_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		hSourceImage = CreateFileU(image_path, GENERIC_READ, share_mode, NULL,
 			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
 		if (hSourceImage == INVALID_HANDLE_VALUE) {
 			uprintf("Could not open image '%s': %s", image_path, WindowsErrorString());
@@ -1288,8 +1780,10 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 		if_assert_fails((uintptr_t)sec_buf% SelectedDrive.SectorSize == 0)
 			goto out;
 		sec_buf_pos = 0;
+		stream_pos = 0;
+		hash_init[HASH_SHA256](&stream_ctx);
 		update_progress(0);
-		bled_init(256 * KB, uprintf, NULL, sector_write, update_progress, NULL, &ErrorStatus);
+		bled_init(256 * KB, uprintf, streaming ? stream_read : NULL, sector_write, update_progress, NULL, &ErrorStatus);
 		bled_ret = bled_uncompress_with_handles(hSourceImage, hPhysicalDrive, img_report.compression_type);
 		bled_exit();
 		uprintfs("\r\n");
@@ -1299,19 +1793,30 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 			// just issue a notice about it in the log.
 			uprintf("Notice: Compressed image data didn't end on block boundary.");
 			// Gonna assert that WriteFile() and _write() share the same file offset
-			WriteFile(hPhysicalDrive, sec_buf, SelectedDrive.SectorSize, &write_size, NULL);
+			if (bmap != NULL)
+				BmapWrite(hPhysicalDrive, -1, dd_offset, sec_buf, SelectedDrive.SectorSize);
+			else if (WriteFile(hPhysicalDrive, sec_buf, SelectedDrive.SectorSize, &write_size, NULL))
+				AddWriteDigests(sec_buf, SelectedDrive.SectorSize);
 		}
 		safe_mm_free(sec_buf);
 		if ((bled_ret < 0) && (SCODE_CODE(ErrorStatus) != ERROR_CANCELLED)) {
 			// Unfortunately, different compression backends return different negative error codes
 			uprintf("Could not write compressed image: %lld", bled_ret);
-			ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+			if (!IS_ERROR(ErrorStatus))
+				ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
 			goto out;
 		}
+	} else if ((img_report.compression_type == IMG_COMPRESSION_VHD || img_report.compression_type == IMG_COMPRESSION_VHDX) &&
+		((vd = VhdOpenImage(image_path)) != NULL)) {
+		if (verify_drive)
+			uprintf("Notice: Write verification is not available for this image");
+		FreeWriteDigests();
+		if (!WriteVirtualDisk(hPhysicalDrive, vd))
+			goto out;
 	} else {
 		if_assert_fails(img_report.compression_type != IMG_COMPRESSION_FFU)
 			goto out;
-		// VHD/VHDX require mounting the image first
+		// VHD/VHDX that we can't access natively require mounting the image first
 		if (img_report.compression_type == IMG_COMPRESSION_VHD ||
 			img_report.compression_type == IMG_COMPRESSION_VHDX) {
 			// Since VHDX images are compressed, we need to obtain the actual size
@@ -1321,7 +1826,7 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 		}
 
 		hSourceImage = CreateFileAsync(vhd_path != NULL ? vhd_path : image_path, GENERIC_READ,
-			FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN);
+			share_mode, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN);
 		if (hSourceImage == NULL) {
 			uprintf("Could not open image '%s': %s", image_path, WindowsErrorString());
 			ErrorStatus = RUFUS_ERROR(ERROR_OPEN_FAILED);
@@ -1339,7 +1844,19 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 		if_assert_fails((uintptr_t)buffer% SelectedDrive.SectorSize == 0)
 			goto out;
 
+		// Set up the detection of zeroed blocks, which we may not need to write
+		sw.cmp_buf = (uint8_t*)_mm_malloc(DD_SPARSE_BLOCK_SIZE, SelectedDrive.SectorSize);
+		if (vhd_path == NULL)
+			GetSparseRanges(((ASYNC_FD*)hSourceImage)->hFile, &sw);
+
 		// Start the initial read
+		stream_pos = 0;
+		hash_init[HASH_SHA256](&stream_ctx);
+		if (streaming && !WaitForImageData(MIN(buf_size, target_size))) {
+			if (!IS_ERROR(ErrorStatus))
+				ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
+			goto out;
+		}
 		ReadFileAsync(hSourceImage, &buffer[read_bufnum * buf_size], (DWORD)MIN(buf_size, target_size));
 
 		read_size[proc_bufnum] = 1;	// To avoid early loop exit
@@ -1359,7 +1876,10 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 				ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
 				goto out;
 			}
-
+			if (streaming) {
+				hash_write[HASH_SHA256](&stream_ctx, &buffer[read_bufnum * buf_size], read_size[read_bufnum]);
+				stream_pos += read_size[read_bufnum];
+			}
 
 			// 2. WriteFile fails unless the size is a multiple of sector size
 			if (read_size[read_bufnum] % SelectedDrive.SectorSize != 0) {
@@ -1379,37 +1899,38 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 			// of the disk... So we make sure to adjust the size not to ever overflow.
 			// Also we need to make sure we add read_size[proc_bufnum] to wb since we
 			// have already read the data and are about to write it.
+			if (streaming && !WaitForImageData(MIN(wb + read_size[proc_bufnum] + buf_size, target_size))) {
+				if (!IS_ERROR(ErrorStatus))
+					ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
+				goto out;
+			}
 			ReadFileAsync(hSourceImage, &buffer[read_bufnum * buf_size], (DWORD)MIN(buf_size, target_size - (wb + read_size[proc_bufnum])));
 
-			// 4. Synchronously write the current data buffer
-			for (i = 1; i <= WRITE_RETRIES; i++) {
-				CHECK_FOR_USER_CANCEL;
-				s = WriteFile(hPhysicalDrive, &buffer[proc_bufnum * buf_size], read_size[proc_bufnum], &write_size, NULL);
-				if ((s) && (write_size == read_size[proc_bufnum]))
-					break;
-				if (s)
-					uprintf("\r\nWrite error: Wrote %d bytes, expected %d bytes", write_size, read_size[proc_bufnum]);
-				else
-					uprintf("\r\nWrite error at sector %lld: %s", wb / SelectedDrive.SectorSize, WindowsErrorString());
-				if (i < WRITE_RETRIES) {
-					li.QuadPart = wb;
-					uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
-					Sleep(WRITE_TIMEOUT);
-					if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
-						uprintf("Write error: Could not reset position - %s", WindowsErrorString());
-						goto out;
-					}
-				} else {
-					ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+			// 4. Synchronously write the current data buffer, minus the blocks we can skip
+			if (bmap != NULL) {
+				if (!BmapWrite(hPhysicalDrive, -1, wb, &buffer[proc_bufnum * buf_size], read_size[proc_bufnum]))
 					goto out;
-				}
-				Sleep(200);
-			}
-			if (i > WRITE_RETRIES)
+			} else if (!WriteDriveSparse(hPhysicalDrive, &sw, wb, &buffer[proc_bufnum * buf_size], read_size[proc_bufnum])) {
 				goto out;
+			}
+			AddWriteDigests(&buffer[proc_bufnum * buf_size], read_size[proc_bufnum]);
 		}
 		uprintfs("\r\n");
+		if (sw.skipped != 0)
+			uprintf("Skipped writing %s of already zeroed blocks", SizeToHumanReadable(sw.skipped, FALSE, FALSE));
 	}
+	if ((bmap != NULL) && (bmap_index < bmap->nb_ranges)) {
+		uprintf("Image data is shorter than what its block map describes!");
+		ErrorStatus = RUFUS_ERROR(ERROR_FILE_CORRUPT);
+		goto out;
+	}
+	if (streaming && !VerifyStreamedImage(&stream_ctx, stream_pos)) {
+		if (!IS_ERROR(ErrorStatus))
+			ErrorStatus = RUFUS_ERROR(ERROR_FILE_CORRUPT);
+		goto out;
+	}
+	if (!VerifyDrive(hPhysicalDrive))
+		goto out;
 	RefreshDriveLayout(hPhysicalDrive);
 	ret = TRUE;
 out:
@@ -1419,8 +1940,14 @@ out:
 		CloseFileAsync(hSourceImage);
 	if (vhd_path != NULL)
 		VhdUnmountImage();
+	VhdCloseImage(vd);
 	safe_mm_free(buffer);
 	safe_mm_free(cmp_buffer);
+	safe_mm_free(sw.cmp_buf);
+	safe_free(sw.ranges);
+	FreeBmap(bmap);
+	bmap = NULL;
+	FreeWriteDigests();
 	return ret;
 }
 
@@ -1977,6 +2504,8 @@ try_clear:
 							uprintf("Failed to setup Win7 EFI boot");
 							ErrorStatus = RUFUS_ERROR(APPERR(ERROR_CANT_PATCH));
 						}
+						// Don't keep the image open past this point
+						WimReleaseImage();
 					}
 				}
 				if ( (target_type == TT_BIOS) && HAS_WINPE(img_report) ) {
@@ -2057,3 +2586,387 @@ out:
 	PostMessage(hMainDialog, UM_FORMAT_COMPLETED, (WPARAM)TRUE, 0);
 	ExitThread(0);
 }
+
+/*
+ * Multi-drive image writing, where the image is only read (or decompressed) once,
+ * and fanned out to all the target drives, that are written in parallel.
+ */
+typedef struct {
+	DWORD DriveIndex;
+	DWORD SectorSize;
+	HANDLE hPhysicalDrive;
+	HANDLE hLogicalVolume;
+	char name[32];
+	// I/O errors are recorded by the writer thread of the drive, under multi_error_lock, and
+	// logged by MultiFormatThread(), as uprintf() and WindowsErrorString() aren't thread safe
+	uint32_t NbErrors;
+	uint32_t NbReported;
+	DWORD LastError;
+	uint64_t ErrorOffset;
+	BOOL ErrorOnRead;
+	BOOL Retrying;
+} multi_target_t;
+
+/* Return TRUE if the selected image can be written in multi-drive mode */
+BOOL CanWriteMultiDrive(void)
+{
+	// VTSI images need to seek on the target, VHD, VHDX and FFU images need to be mounted or
+	// applied through DISM, and images that are being downloaded can only be consumed once.
+	return (boot_type == BT_IMAGE) && write_as_image && !zero_drive && (image_path != NULL) &&
+		(img_report.compression_type < BLED_COMPRESSION_MAX) &&
+		(img_report.compression_type != BLED_COMPRESSION_VTSI) && !IsImageStreaming(image_path);
+}
+
+/*
+ * Return a zero terminated list of the indexes of all the listed drives that are large
+ * enough for the image, and that are not HDDs unless these were explicitly enabled.
+ * 'names' is set to an allocated string with the name of each drive on its own line,
+ * where the last lines are replaced with the count of the remaining drives if they
+ * would make the string longer than 'max_len'. Both the list and 'names' must be freed.
+ */
+DWORD* GetMultiDriveList(char** names, uint32_t* count, size_t max_len)
+{
+	int i, sel[MAX_DRIVES];
+	uint32_t j, n = 0;
+	size_t len = 0, size = 1;
+	char *str, *more;
+	DWORD* list;
+
+	*names = NULL;
+	*count = 0;
+	for (i = 0; (i < MAX_DRIVES) && (rufus_drive[i].size != 0); i++) {
+		if (rufus_drive[i].size < img_report.image_size)
+			continue;
+		if (rufus_drive[i].is_hdd && !multi_drive_hdds) {
+			uprintf("Not using '%s' for multi-drive writing since it is an HDD", rufus_drive[i].display_name);
+			continue;
+		}
+		sel[n++] = i;
+		size += strlen(rufus_drive[i].display_name) + 3;
+	}
+	if (n == 0)
+		return NULL;
+	list = (DWORD*)calloc(n + 1, sizeof(DWORD));
+	// Add room for the count of the drives we can't display
+	size += 64;
+	str = (char*)malloc(size);
+	if (list == NULL || str == NULL) {
+		free(list);
+		free(str);
+		return NULL;
+	}
+	str[0] = 0;
+	uprintf("Multi-drive writing targets:");
+	for (j = 0; j < n; j++) {
+		list[j] = rufus_drive[sel[j]].index;
+		uprintf("● %s", rufus_drive[sel[j]].display_name);
+	}
+	for (j = 0; j < n; j++) {
+		// Make sure there's always room left for the line that replaces the remaining drives
+		more = lmprintf(MSG_357, n - j);
+		if (len + strlen(rufus_drive[sel[j]].display_name) + 3 +
+			((j + 1 < n) ? strlen(more) + 3 : 0) > max_len) {
+			len += sprintf(&str[len], "%s\n", more);
+			break;
+		}
+		len += sprintf(&str[len], "- %s\n", rufus_drive[sel[j]].display_name);
+	}
+	*names = str;
+	*count = n;
+	return list;
+}
+
+/* Called from the writer thread of the drive, right after the failed I/O call */
+static void RecordMultiDriveError(multi_target_t* t, uint64_t offset, BOOL read, BOOL retrying)
+{
+	DWORD error_code = GetLastError();
+
+	AcquireSRWLockExclusive(&multi_error_lock);
+	t->LastError = error_code;
+	t->ErrorOffset = offset;
+	t->ErrorOnRead = read;
+	t->Retrying = retrying;
+	t->NbErrors++;
+	ReleaseSRWLockExclusive(&multi_error_lock);
+}
+
+/* Log the errors that were recorded since the last call. Only called from MultiFormatThread(). */
+static void ReportMultiDriveErrors(void)
+{
+	multi_target_t* t;
+	multi_target_t e;
+	uint32_t i;
+
+	for (i = 0; i < multi_nb_targets; i++) {
+		t = (multi_target_t*)multi_ft[i].ctx;
+		AcquireSRWLockShared(&multi_error_lock);
+		e = *t;
+		ReleaseSRWLockShared(&multi_error_lock);
+		if (e.NbErrors == t->NbReported)
+			continue;
+		SetLastError(e.LastError);
+		uprintf("\r\n%s: %s error at sector %lld: %s", e.name, e.ErrorOnRead ? "Read" : "Write",
+			e.ErrorOffset / e.SectorSize, WindowsErrorString());
+		if (e.NbErrors - t->NbReported > 1)
+			uprintf("%s: %d errors since the last report", e.name, e.NbErrors - t->NbReported);
+		if (e.Retrying)
+			uprintf("%s: Retrying in %d seconds...", e.name, WRITE_TIMEOUT / 1000);
+		t->NbReported = e.NbErrors;
+	}
+}
+
+static BOOL MultiDriveWrite(void* ctx, uint64_t offset, const uint8_t* buf, uint32_t size)
+{
+	multi_target_t* t = (multi_target_t*)ctx;
+	DWORD i, write_size;
+	LARGE_INTEGER li;
+
+	for (i = 1; i <= WRITE_RETRIES; i++) {
+		if (IS_ERROR(ErrorStatus) && (SCODE_CODE(ErrorStatus) == ERROR_CANCELLED)) {
+			FanoutCancel(multi_fo);
+			return FALSE;
+		}
+		li.QuadPart = offset;
+		if (SetFilePointerEx(t->hPhysicalDrive, li, NULL, FILE_BEGIN) &&
+			WriteFile(t->hPhysicalDrive, buf, size, &write_size, NULL) && (write_size == size))
+			return TRUE;
+		RecordMultiDriveError(t, offset, FALSE, i < WRITE_RETRIES);
+		if (i < WRITE_RETRIES)
+			Sleep(WRITE_TIMEOUT);
+	}
+	return FALSE;
+}
+
+static BOOL MultiDriveRead(void* ctx, uint64_t offset, uint8_t* buf, uint32_t size)
+{
+	multi_target_t* t = (multi_target_t*)ctx;
+	DWORD read_size;
+	LARGE_INTEGER li;
+
+	li.QuadPart = offset;
+	if (SetFilePointerEx(t->hPhysicalDrive, li, NULL, FILE_BEGIN) &&
+		ReadFile(t->hPhysicalDrive, buf, size, &read_size, NULL) && (read_size == size))
+		return TRUE;
+	RecordMultiDriveError(t, offset, TRUE, FALSE);
+	return FALSE;
+}
+
+// Write override for compressed images, that hands the data over to the fan-out writer
+static int multi_write(int fd, const void* buf, unsigned int count)
+{
+	return FanoutWrite(multi_fo, buf, count) ? (int)count : -1;
+}
+
+/* Log the progress of each of the drives, at most every MULTI_WRITE_REPORT_INTERVAL ms */
+static void PrintMultiDriveProgress(uint64_t size)
+{
+	static uint64_t last_report = 0;
+	char str[512] = "";
+	uint32_t i;
+	uint64_t done;
+
+	ReportMultiDriveErrors();
+	if ((size == 0) || (GetTickCount64() < last_report + MULTI_WRITE_REPORT_INTERVAL))
+		return;
+	last_report = GetTickCount64();
+	for (i = 0; i < multi_nb_targets; i++) {
+		done = (uint64_t)((multi_ft[i].status == FANOUT_VERIFYING) ? multi_ft[i].verified : multi_ft[i].written);
+		safe_sprintf(&str[strlen(str)], sizeof(str) - strlen(str), "%s%s: %s %0.1f%%", (i == 0) ? "" : ", ",
+			multi_ft[i].name, FanoutStatusString(multi_ft[i].status), (100.0f * (float)MIN(done, size)) / (float)size);
+	}
+	uprintf("\r\n%s", str);
+}
+
+static void multi_progress(const uint64_t processed_bytes)
+{
+	update_progress(processed_bytes);
+	PrintMultiDriveProgress(img_report.image_size);
+}
+
+/*
+ * Standalone thread for writing a DD image to multiple drives. 'param' is a zero
+ * terminated list of drive indexes, as returned by GetMultiDriveList(), that we free.
+ */
+DWORD WINAPI MultiFormatThread(void* param)
+{
+	DWORD* drive_list = (DWORD*)param;
+	DWORD i, n, size, read_size = 0, alignment = 512;
+	uint32_t nb_targets = 0, nb_success;
+	uint64_t rb, done;
+	int64_t bled_ret;
+	BYTE geometry[256];
+	PDISK_GEOMETRY_EX DiskGeometry = (PDISK_GEOMETRY_EX)(void*)geometry;
+	HANDLE hSourceImage = INVALID_HANDLE_VALUE;
+	uint8_t* buffer = NULL;
+	multi_target_t *mt = NULL, *t;
+	fanout_target* ft = NULL;
+
+	for (n = 0; drive_list[n] != 0; n++);
+	mt = (multi_target_t*)calloc(n, sizeof(multi_target_t));
+	ft = (fanout_target*)calloc(n, sizeof(fanout_target));
+	if ((mt == NULL) || (ft == NULL)) {
+		ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+		goto out;
+	}
+
+	// Get exclusive access to each of the drives. Drives that we can't use are dropped.
+	PrintInfoDebug(0, MSG_225);
+	for (i = 0; i < n; i++) {
+		CHECK_FOR_USER_CANCEL;
+		t = &mt[nb_targets];
+		t->DriveIndex = drive_list[i];
+		t->hLogicalVolume = INVALID_HANDLE_VALUE;
+		static_sprintf(t->name, "Disk %d", t->DriveIndex - DRIVE_INDEX_MIN);
+		RemoveDriveLetters(t->DriveIndex, FALSE, TRUE);
+		if (is_vds_available && !DeletePartition(t->DriveIndex, 0, TRUE))
+			uprintf("%s: Could not delete partition(s): %s", t->name, WindowsErrorString());
+		t->hPhysicalDrive = GetPhysicalHandle(t->DriveIndex, lock_drive, TRUE, !lock_drive);
+		if (t->hPhysicalDrive == INVALID_HANDLE_VALUE) {
+			uprintf("%s: Could not open drive - Skipping", t->name);
+			continue;
+		}
+		if (!DeviceIoControl(t->hPhysicalDrive, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX, NULL, 0, geometry,
+			sizeof(geometry), &size, NULL) || (size == 0) || (DiskGeometry->Geometry.BytesPerSector < 512) ||
+			(DiskGeometry->Geometry.BytesPerSector > MULTI_WRITE_BLOCK_SIZE) ||
+			!IS_POWER_OF_2(DiskGeometry->Geometry.BytesPerSector) ||
+			((uint64_t)DiskGeometry->DiskSize.QuadPart < img_report.image_size)) {
+			uprintf("%s: Unsupported geometry or drive too small - Skipping", t->name);
+			safe_unlockclose(t->hPhysicalDrive);
+			continue;
+		}
+		t->SectorSize = DiskGeometry->Geometry.BytesPerSector;
+		RefreshDriveLayout(t->hPhysicalDrive);
+		// Same as for single drive writes, we need to lock the logical drive, if any
+		t->hLogicalVolume = GetLogicalHandle(t->DriveIndex, 0, TRUE, FALSE, !lock_drive);
+		if (t->hLogicalVolume == INVALID_HANDLE_VALUE) {
+			uprintf("%s: Could not access logical volume - Skipping", t->name);
+			safe_unlockclose(t->hPhysicalDrive);
+			continue;
+		}
+		if ((t->hLogicalVolume != NULL) && !UnmountVolume(t->hLogicalVolume))
+			uprintf("%s: Trying to continue regardless...", t->name);
+		alignment = MAX(alignment, t->SectorSize);
+		ft[nb_targets].name = t->name;
+		ft[nb_targets].ctx = t;
+		ft[nb_targets].write = MultiDriveWrite;
+		ft[nb_targets].read = MultiDriveRead;
+		nb_targets++;
+	}
+	if (nb_targets == 0) {
+		uprintf("None of the drives can be written to");
+		ErrorStatus = RUFUS_ERROR(ERROR_OPEN_FAILED);
+		goto out;
+	}
+
+	multi_ft = ft;
+	multi_nb_targets = nb_targets;
+	multi_fo = FanoutCreate(ft, nb_targets, MULTI_WRITE_BLOCK_SIZE, MULTI_WRITE_QUEUE_DEPTH, alignment, verify_writes);
+	if (multi_fo == NULL) {
+		uprintf("Could not set up multi-drive writing");
+		ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+		goto out;
+	}
+	hSourceImage = CreateFileU(image_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hSourceImage == INVALID_HANDLE_VALUE) {
+		uprintf("Could not open image '%s': %s", image_path, WindowsErrorString());
+		ErrorStatus = RUFUS_ERROR(ERROR_OPEN_FAILED);
+		goto out;
+	}
+
+	UpdateProgressWithInfoInit(NULL, FALSE);
+	uprintf("Writing %simage to %d drives:", (img_report.compression_type != BLED_COMPRESSION_NONE) ?
+		"compressed " : "", nb_targets);
+	update_progress(0);
+	if (img_report.compression_type != BLED_COMPRESSION_NONE) {
+		bled_init(256 * KB, uprintf, NULL, multi_write, multi_progress, NULL, &ErrorStatus);
+		// The target handle is only used to provide a descriptor for our write override
+		bled_ret = bled_uncompress_with_handles(hSourceImage, mt[0].hPhysicalDrive, img_report.compression_type);
+		bled_exit();
+		// If some of the drives are still being written to, this is a source error or a cancellation
+		if ((bled_ret < 0) && (FanoutGetProgress(multi_fo, FALSE) < FanoutGetSize(multi_fo))) {
+			if (SCODE_CODE(ErrorStatus) != ERROR_CANCELLED) {
+				uprintf("\r\nCould not write compressed image: %lld", bled_ret);
+				if (!IS_ERROR(ErrorStatus))
+					ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
+			}
+			FanoutCancel(multi_fo);
+		}
+	} else {
+		buffer = (uint8_t*)malloc(MULTI_WRITE_BLOCK_SIZE);
+		if (buffer == NULL) {
+			ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+			goto out;
+		}
+		for (rb = 0; rb < img_report.image_size; rb += read_size) {
+			CHECK_FOR_USER_CANCEL;
+			multi_progress(rb);
+			if (!ReadFile(hSourceImage, buffer, (DWORD)MIN(MULTI_WRITE_BLOCK_SIZE, img_report.image_size - rb),
+				&read_size, NULL) || (read_size == 0)) {
+				uprintf("\r\nRead error: %s", WindowsErrorString());
+				ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
+				goto out;
+			}
+			// Only fails if none of the drives are left
+			if (!FanoutWrite(multi_fo, buffer, read_size))
+				break;
+		}
+	}
+	FanoutEnd(multi_fo);
+
+	// Wait for the slower drives to complete, as well as for verification
+	while (!FanoutWait(multi_fo, 500)) {
+		if (IS_ERROR(ErrorStatus) && (SCODE_CODE(ErrorStatus) == ERROR_CANCELLED))
+			FanoutCancel(multi_fo);
+		done = FanoutGetProgress(multi_fo, FALSE);
+		if (done < FanoutGetSize(multi_fo))
+			UpdateProgressWithInfo(OP_FORMAT, MSG_261, done, FanoutGetSize(multi_fo));
+		else
+			UpdateProgressWithInfo(OP_FORMAT, MSG_355, FanoutGetProgress(multi_fo, TRUE), FanoutGetSize(multi_fo));
+		PrintMultiDriveProgress(FanoutGetSize(multi_fo));
+	}
+	ReportMultiDriveErrors();
+	uprintfs("\r\n");
+
+	for (i = 0; i < nb_targets; i++) {
+		switch (ft[i].status) {
+		case FANOUT_WRITE_ERROR:
+		case FANOUT_READ_ERROR:
+		case FANOUT_VERIFY_ERROR:
+			uprintf("%s: %s at sector %lld", ft[i].name, FanoutStatusString(ft[i].status),
+				ft[i].error_offset / mt[i].SectorSize);
+			break;
+		default:
+			uprintf("%s: %s", ft[i].name, FanoutStatusString(ft[i].status));
+			if (ft[i].status == FANOUT_SUCCESS)
+				RefreshDriveLayout(mt[i].hPhysicalDrive);
+			break;
+		}
+	}
+	nb_success = FanoutGetSuccessCount(multi_fo);
+	uprintf("Successfully wrote %d of %d drives", nb_success, n);
+	if ((nb_success != n) && !IS_ERROR(ErrorStatus))
+		ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+
+out:
+	FanoutFree(multi_fo);
+	// In case we exited early, now that the writer threads are done
+	ReportMultiDriveErrors();
+	multi_fo = NULL;
+	multi_ft = NULL;
+	multi_nb_targets = 0;
+	safe_closehandle(hSourceImage);
+	safe_free(buffer);
+	for (i = 0; i < nb_targets; i++) {
+		safe_unlockclose(mt[i].hLogicalVolume);
+		safe_unlockclose(mt[i].hPhysicalDrive);
+	}
+	safe_free(mt);
+	safe_free(ft);
+	free(drive_list);
+	PrintInfo(0, MSG_320, lmprintf(MSG_307));
+	Sleep(200);
+	VdsRescan(VDS_RESCAN_REFRESH, 0, TRUE);
+	PostMessage(hMainDialog, UM_FORMAT_COMPLETED, (WPARAM)TRUE, 0);
+	ExitThread(0);
+}
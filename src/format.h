@@ -120,3 +120,6 @@ BOOL FormatLargeFAT32(DWORD DriveIndex, uint64_t PartitionOffset, DWORD ClusterS
 BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LPCSTR FSName, LPCSTR Label, DWORD Flags);
 BOOL FormatPartition(DWORD DriveIndex, uint64_t PartitionOffset, DWORD UnitAllocationSize, USHORT FSType, LPCSTR Label, DWORD Flags);
 DWORD WINAPI FormatThread(void* param);
+BOOL CanWriteMultiDrive(void);
+DWORD* GetMultiDriveList(char** names, uint32_t* count, size_t max_len);
+DWORD WINAPI MultiFormatThread(void* param);
@@ -213,6 +213,46 @@ const char* GetExtFsLabel(DWORD DriveIndex, uint64_t PartitionOffset)
 	return (r == 0) ? label : NULL;
 }
 
+/*
+ * Report the sections of an ext partition that hold data, according to its block bitmap.
+ */
+BOOL GetExtFsUsedRanges(DWORD DriveIndex, uint64_t PartitionOffset, void (*MarkUsed)(uint64_t offset, uint64_t size))
+{
+	errcode_t r;
+	ext2_filsys ext2fs = NULL;
+	io_manager manager = nt_io_manager;
+	blk64_t start, end, last;
+	char* volume_name = GetExtPartitionName(DriveIndex, PartitionOffset);
+
+	if (volume_name == NULL)
+		return FALSE;
+	r = ext2fs_open(volume_name, EXT2_FLAG_SKIP_MMP | EXT2_FLAG_64BITS, 0, 0, manager, &ext2fs);
+	free(volume_name);
+	if (r != 0)
+		goto out;
+	r = ext2fs_read_block_bitmap(ext2fs);
+	if (r != 0) {
+		uprintf("Could not read ext block bitmap: %s", error_message(r));
+		goto out;
+	}
+	// The boot block, that precedes the first data block with 1K blocks, is not part of the bitmap
+	start = ext2fs->super->s_first_data_block;
+	MarkUsed(PartitionOffset, (start + 1) * ext2fs->blocksize);
+	last = ext2fs_blocks_count(ext2fs->super) - 1;
+	for (; start <= last; start = end + 1) {
+		if (ext2fs_find_first_set_block_bitmap2(ext2fs->block_map, start, last, &start) != 0)
+			break;
+		if (ext2fs_find_first_zero_block_bitmap2(ext2fs->block_map, start, last, &end) != 0)
+			end = last + 1;
+		MarkUsed(PartitionOffset + start * ext2fs->blocksize, (end - start) * ext2fs->blocksize);
+	}
+
+out:
+	if (ext2fs != NULL)
+		ext2fs_close(ext2fs);
+	return (r == 0);
+}
+
 #define TEST_IMG_PATH               "\\??\\C:\\tmp\\disk.img"
 #define TEST_IMG_SIZE               4000		// Size in MB
 #define SET_EXT2_FORMAT_ERROR(x)    if (!IS_ERROR(ErrorStatus)) ErrorStatus = ext2_last_winerror(x)
@@ -0,0 +1,517 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Minimal gzip (deflate) compressor
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * bled only provides decompressors, so this is a small deflate (RFC 1951)
+ * encoder, producing gzip (RFC 1952) members, with hash chain LZ77 matching
+ * and one step lazy evaluation. For each block, the smallest of the dynamic
+ * Huffman, fixed Huffman or stored encodings is used. This doesn't match the
+ * ratio of zlib at its higher levels, but is close to its default level, for
+ * the type of data (file systems, with lots of unused space) we deal with.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gzip.h"
+
+#define WINDOW_SIZE         32768
+#define WINDOW_MASK         (WINDOW_SIZE - 1)
+#define HASH_BITS           15
+#define HASH_SIZE           (1 << HASH_BITS)
+#define MIN_MATCH           3
+#define MAX_MATCH           258
+#define MAX_CHAIN           64		// Maximum number of previous positions we check for a match
+#define NICE_MATCH          128		// Match length at which we stop looking for a longer one
+#define MAX_SYMBOLS         16384	// Maximum number of literals and matches in a block
+#define NB_LITLEN           286
+#define NB_FIXED_LITLEN     288
+#define NB_DIST             30
+#define NB_CLEN             19
+#define MAX_BITS            15
+#define MAX_CLEN_BITS       7
+#define MAX_STORED          65535
+
+static const uint16_t len_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t len_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t dist_base[NB_DIST] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t dist_extra[NB_DIST] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static const uint8_t clen_order[NB_CLEN] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+struct gzip_ctx {
+	int32_t head[HASH_SIZE];		// Last position + 1 with a given hash, or 0
+	int32_t prev[WINDOW_SIZE];		// Previous position + 1 with the same hash, or 0
+	uint16_t sym_len[MAX_SYMBOLS];	// Literal value, or match length
+	uint16_t sym_dist[MAX_SYMBOLS];	// 0 for a literal, or match distance
+	uint32_t nb_syms;
+	uint8_t len_code[MAX_MATCH + 1];
+	uint8_t fixed_litlen_len[NB_FIXED_LITLEN];
+	uint16_t fixed_litlen_code[NB_FIXED_LITLEN];
+	uint8_t fixed_dist_len[NB_DIST];
+	uint16_t fixed_dist_code[NB_DIST];
+	uint32_t crc_table[256];
+	uint8_t* out;
+	size_t out_pos, out_size;
+	uint64_t bitbuf;
+	int bitcount;
+	int overflow;
+};
+
+static __inline void PutByte(gzip_ctx* ctx, uint8_t b)
+{
+	if (ctx->out_pos < ctx->out_size)
+		ctx->out[ctx->out_pos++] = b;
+	else
+		ctx->overflow = 1;
+}
+
+static __inline void PutBits(gzip_ctx* ctx, uint32_t bits, int nb_bits)
+{
+	ctx->bitbuf |= (uint64_t)bits << ctx->bitcount;
+	ctx->bitcount += nb_bits;
+	while (ctx->bitcount >= 8) {
+		PutByte(ctx, (uint8_t)ctx->bitbuf);
+		ctx->bitbuf >>= 8;
+		ctx->bitcount -= 8;
+	}
+}
+
+static __inline void AlignBits(gzip_ctx* ctx)
+{
+	if (ctx->bitcount > 0)
+		PutBits(ctx, 0, 8 - ctx->bitcount);
+}
+
+static __inline int DistCode(uint32_t dist)
+{
+	uint32_t x = dist - 1;
+	int nb_bits = 0;
+
+	if (x < 4)
+		return (int)x;
+	while ((x >> (nb_bits + 1)) != 0)
+		nb_bits++;
+	return 2 * nb_bits + (int)((x >> (nb_bits - 1)) & 1);
+}
+
+/*
+ * Compute the Huffman code lengths for 'nb' symbols, limited to 'max_bits'.
+ * The frequencies are halved until the tree is shallow enough, which isn't
+ * optimal, but is simple and only ever needed for very skewed blocks.
+ */
+static void BuildLengths(const uint32_t* freq, int nb, int max_bits, uint8_t* lengths)
+{
+	uint32_t f[NB_FIXED_LITLEN], weight[2 * NB_FIXED_LITLEN];
+	uint16_t sym[NB_FIXED_LITLEN], tmp;
+	int parent[2 * NB_FIXED_LITLEN], depth[2 * NB_FIXED_LITLEN];
+	int i, j, m = 0, a, b, i1, i2, next, max_depth;
+
+	memset(lengths, 0, nb);
+	for (i = 0; i < nb; i++) {
+		f[i] = freq[i];
+		if (freq[i] != 0)
+			sym[m++] = (uint16_t)i;
+	}
+	if (m == 0)
+		return;
+	if (m == 1) {
+		lengths[sym[0]] = 1;
+		return;
+	}
+
+	for (;;) {
+		// Sort the symbols by increasing frequency
+		for (i = 1; i < m; i++) {
+			tmp = sym[i];
+			for (j = i; (j > 0) && (f[sym[j - 1]] > f[tmp]); j--)
+				sym[j] = sym[j - 1];
+			sym[j] = tmp;
+		}
+		// Two queues construction: sorted leaves, then internal nodes in creation order
+		for (i = 0; i < m; i++)
+			weight[i] = f[sym[i]];
+		i1 = 0;
+		i2 = m;
+		for (next = m; next < 2 * m - 1; next++) {
+			a = ((i1 < m) && ((i2 == next) || (weight[i1] <= weight[i2]))) ? i1++ : i2++;
+			b = ((i1 < m) && ((i2 == next) || (weight[i1] <= weight[i2]))) ? i1++ : i2++;
+			weight[next] = weight[a] + weight[b];
+			parent[a] = next;
+			parent[b] = next;
+		}
+		depth[2 * m - 2] = 0;
+		max_depth = 0;
+		for (i = 2 * m - 3; i >= 0; i--) {
+			depth[i] = depth[parent[i]] + 1;
+			if ((i < m) && (depth[i] > max_depth))
+				max_depth = depth[i];
+		}
+		if (max_depth <= max_bits)
+			break;
+		for (i = 0; i < m; i++)
+			f[sym[i]] = (f[sym[i]] >> 1) | 1;
+	}
+	for (i = 0; i < m; i++)
+		lengths[sym[i]] = (uint8_t)depth[i];
+}
+
+/* Compute the canonical codes, bit reversed since deflate writes them LSB first */
+static void BuildCodes(const uint8_t* lengths, int nb, uint16_t* codes)
+{
+	uint16_t bl_count[MAX_BITS + 1] = { 0 }, next_code[MAX_BITS + 1];
+	uint32_t code = 0, rev;
+	int i, j;
+
+	for (i = 0; i < nb; i++)
+		bl_count[lengths[i]]++;
+	bl_count[0] = 0;
+	for (i = 1; i <= MAX_BITS; i++) {
+		code = (code + bl_count[i - 1]) << 1;
+		next_code[i] = (uint16_t)code;
+	}
+	for (i = 0; i < nb; i++) {
+		if (lengths[i] == 0)
+			continue;
+		code = next_code[lengths[i]]++;
+		for (j = 0, rev = 0; j < lengths[i]; j++, code >>= 1)
+			rev = (rev << 1) | (code & 1);
+		codes[i] = (uint16_t)rev;
+	}
+}
+
+/* Make sure a tree has at least 2 codes, so that it is always complete */
+static void EnsureTwoCodes(uint32_t* freq, int nb)
+{
+	int i, n = 0;
+
+	for (i = 0; i < nb; i++)
+		n += (freq[i] != 0);
+	for (i = 0; (i < nb) && (n < 2); i++) {
+		if (freq[i] == 0) {
+			freq[i] = 1;
+			n++;
+		}
+	}
+}
+
+static void WriteSymbols(gzip_ctx* ctx, const uint8_t* litlen_len, const uint16_t* litlen_code,
+	const uint8_t* dist_len, const uint16_t* dist_code)
+{
+	uint32_t i;
+	int lc, dc;
+
+	for (i = 0; i < ctx->nb_syms; i++) {
+		if (ctx->sym_dist[i] == 0) {
+			PutBits(ctx, litlen_code[ctx->sym_len[i]], litlen_len[ctx->sym_len[i]]);
+			continue;
+		}
+		lc = ctx->len_code[ctx->sym_len[i]];
+		PutBits(ctx, litlen_code[257 + lc], litlen_len[257 + lc]);
+		if (len_extra[lc] != 0)
+			PutBits(ctx, ctx->sym_len[i] - len_base[lc], len_extra[lc]);
+		dc = DistCode(ctx->sym_dist[i]);
+		PutBits(ctx, dist_code[dc], dist_len[dc]);
+		if (dist_extra[dc] != 0)
+			PutBits(ctx, ctx->sym_dist[i] - dist_base[dc], dist_extra[dc]);
+	}
+	PutBits(ctx, litlen_code[256], litlen_len[256]);
+}
+
+/* Write the symbols we collected, for the 'size' bytes of data at 'data', as a block */
+static void FlushBlock(gzip_ctx* ctx, const uint8_t* data, size_t size, int last)
+{
+	uint32_t litlen_freq[NB_LITLEN] = { 0 }, dist_freq[NB_DIST] = { 0 }, clen_freq[NB_CLEN] = { 0 };
+	uint8_t litlen_len[NB_LITLEN], dist_len[NB_DIST], clen_len[NB_CLEN], lens[NB_LITLEN + NB_DIST];
+	uint16_t litlen_code[NB_LITLEN], dist_code[NB_DIST], clen_code[NB_CLEN];
+	uint8_t rle_sym[NB_LITLEN + NB_DIST], rle_extra[NB_LITLEN + NB_DIST];
+	uint64_t extra_bits = 0, dyn_cost, fixed_cost, stored_cost;
+	int i, hlit, hdist, hclen, nb_rle = 0, run, r, lc, dc;
+	size_t pos, n;
+
+	for (i = 0; i < (int)ctx->nb_syms; i++) {
+		if (ctx->sym_dist[i] == 0) {
+			litlen_freq[ctx->sym_len[i]]++;
+		} else {
+			lc = ctx->len_code[ctx->sym_len[i]];
+			dc = DistCode(ctx->sym_dist[i]);
+			litlen_freq[257 + lc]++;
+			dist_freq[dc]++;
+			extra_bits += len_extra[lc] + dist_extra[dc];
+		}
+	}
+	litlen_freq[256] = 1;
+
+	// Fixed Huffman cost, computed before we alter the frequencies
+	fixed_cost = 3 + extra_bits;
+	for (i = 0; i < NB_LITLEN; i++)
+		fixed_cost += (uint64_t)litlen_freq[i] * ctx->fixed_litlen_len[i];
+	for (i = 0; i < NB_DIST; i++)
+		fixed_cost += (uint64_t)dist_freq[i] * ctx->fixed_dist_len[i];
+
+	// Dynamic Huffman trees and their cost
+	EnsureTwoCodes(litlen_freq, NB_LITLEN);
+	EnsureTwoCodes(dist_freq, NB_DIST);
+	BuildLengths(litlen_freq, NB_LITLEN, MAX_BITS, litlen_len);
+	BuildLengths(dist_freq, NB_DIST, MAX_BITS, dist_len);
+	for (hlit = NB_LITLEN; (hlit > 257) && (litlen_len[hlit - 1] == 0); hlit--);
+	for (hdist = NB_DIST; (hdist > 1) && (dist_len[hdist - 1] == 0); hdist--);
+	memcpy(lens, litlen_len, hlit);
+	memcpy(&lens[hlit], dist_len, hdist);
+	for (i = 0; i < hlit + hdist; i += run) {
+		for (run = 1; (i + run < hlit + hdist) && (lens[i + run] == lens[i]); run++);
+		if ((lens[i] == 0) && (run >= 3)) {
+			r = (run > 138) ? 138 : run;
+			rle_sym[nb_rle] = (r >= 11) ? 18 : 17;
+			rle_extra[nb_rle++] = (uint8_t)((r >= 11) ? r - 11 : r - 3);
+			run = r;
+		} else if ((lens[i] != 0) && (run >= 4)) {
+			r = (run - 1 > 6) ? 6 : run - 1;
+			rle_sym[nb_rle] = lens[i];
+			rle_extra[nb_rle++] = 0;
+			rle_sym[nb_rle] = 16;
+			rle_extra[nb_rle++] = (uint8_t)(r - 3);
+			run = r + 1;
+		} else {
+			rle_sym[nb_rle] = lens[i];
+			rle_extra[nb_rle++] = 0;
+			run = 1;
+		}
+	}
+	for (i = 0; i < nb_rle; i++)
+		clen_freq[rle_sym[i]]++;
+	EnsureTwoCodes(clen_freq, NB_CLEN);
+	BuildLengths(clen_freq, NB_CLEN, MAX_CLEN_BITS, clen_len);
+	for (hclen = NB_CLEN; (hclen > 4) && (clen_len[clen_order[hclen - 1]] == 0); hclen--);
+	dyn_cost = 3 + 14 + 3 * hclen + extra_bits;
+	for (i = 0; i < nb_rle; i++)
+		dyn_cost += clen_len[rle_sym[i]] + ((rle_sym[i] == 16) ? 2 : ((rle_sym[i] == 17) ? 3 : ((rle_sym[i] == 18) ? 7 : 0)));
+	for (i = 0; i < NB_LITLEN; i++)
+		dyn_cost += (uint64_t)litlen_freq[i] * litlen_len[i];
+	for (i = 0; i < NB_DIST; i++)
+		dyn_cost += (uint64_t)dist_freq[i] * dist_len[i];
+
+	stored_cost = 8 * (uint64_t)size + (3 + 7 + 32) * ((size + MAX_STORED - 1) / MAX_STORED + (size == 0));
+
+	if ((stored_cost < dyn_cost) && (stored_cost < fixed_cost)) {
+		pos = 0;
+		do {
+			n = size - pos;
+			if (n > MAX_STORED)
+				n = MAX_STORED;
+			PutBits(ctx, (last && (pos + n == size)) ? 1 : 0, 3);
+			AlignBits(ctx);
+			PutByte(ctx, (uint8_t)n);
+			PutByte(ctx, (uint8_t)(n >> 8));
+			PutByte(ctx, (uint8_t)~n);
+			PutByte(ctx, (uint8_t)(~n >> 8));
+			if (ctx->out_pos + n <= ctx->out_size) {
+				memcpy(&ctx->out[ctx->out_pos], &data[pos], n);
+				ctx->out_pos += n;
+			} else {
+				ctx->overflow = 1;
+			}
+			pos += n;
+		} while (pos < size);
+	} else if (fixed_cost <= dyn_cost) {
+		PutBits(ctx, last ? 1 : 0, 1);
+		PutBits(ctx, 1, 2);
+		WriteSymbols(ctx, ctx->fixed_litlen_len, ctx->fixed_litlen_code, ctx->fixed_dist_len, ctx->fixed_dist_code);
+	} else {
+		BuildCodes(litlen_len, NB_LITLEN, litlen_code);
+		BuildCodes(dist_len, NB_DIST, dist_code);
+		BuildCodes(clen_len, NB_CLEN, clen_code);
+		PutBits(ctx, last ? 1 : 0, 1);
+		PutBits(ctx, 2, 2);
+		PutBits(ctx, hlit - 257, 5);
+		PutBits(ctx, hdist - 1, 5);
+		PutBits(ctx, hclen - 4, 4);
+		for (i = 0; i < hclen; i++)
+			PutBits(ctx, clen_len[clen_order[i]], 3);
+		for (i = 0; i < nb_rle; i++) {
+			PutBits(ctx, clen_code[rle_sym[i]], clen_len[rle_sym[i]]);
+			if (rle_sym[i] >= 16)
+				PutBits(ctx, rle_extra[i], (rle_sym[i] == 16) ? 2 : ((rle_sym[i] == 17) ? 3 : 7));
+		}
+		WriteSymbols(ctx, litlen_len, litlen_code, dist_len, dist_code);
+	}
+	ctx->nb_syms = 0;
+}
+
+static __inline uint32_t Hash(const uint8_t* p)
+{
+	return (((uint32_t)p[0] << 10) ^ ((uint32_t)p[1] << 5) ^ p[2]) & (HASH_SIZE - 1);
+}
+
+static __inline void Insert(gzip_ctx* ctx, const uint8_t* src, size_t size, size_t pos)
+{
+	uint32_t h;
+
+	if (pos + MIN_MATCH > size)
+		return;
+	h = Hash(&src[pos]);
+	ctx->prev[pos & WINDOW_MASK] = ctx->head[h];
+	ctx->head[h] = (int32_t)(pos + 1);
+}
+
+/* Return the length of the longest match for 'pos', which must not have been inserted yet */
+static int FindMatch(gzip_ctx* ctx, const uint8_t* src, size_t size, size_t pos, uint32_t* dist)
+{
+	int32_t cand;
+	size_t c, len, best = 0, max = size - pos;
+	int chain = MAX_CHAIN;
+
+	if (max > MAX_MATCH)
+		max = MAX_MATCH;
+	if (max < MIN_MATCH)
+		return 0;
+	for (cand = ctx->head[Hash(&src[pos])]; (cand != 0) && (chain-- > 0); cand = ctx->prev[c & WINDOW_MASK]) {
+		c = (size_t)cand - 1;
+		if (pos - c > WINDOW_SIZE)
+			break;
+		if (src[c + best] != src[pos + best])
+			continue;
+		for (len = 0; (len < max) && (src[c + len] == src[pos + len]); len++);
+		if (len > best) {
+			best = len;
+			*dist = (uint32_t)(pos - c);
+			if ((len >= NICE_MATCH) || (len == max))
+				break;
+		}
+	}
+	return (best >= MIN_MATCH) ? (int)best : 0;
+}
+
+static __inline void AddSymbol(gzip_ctx* ctx, const uint8_t* src, size_t* block_start, size_t end,
+	uint16_t len, uint16_t dist)
+{
+	ctx->sym_len[ctx->nb_syms] = len;
+	ctx->sym_dist[ctx->nb_syms++] = dist;
+	if (ctx->nb_syms == MAX_SYMBOLS) {
+		FlushBlock(ctx, &src[*block_start], end - *block_start, 0);
+		*block_start = end;
+	}
+}
+
+gzip_ctx* GzipCreateContext(void)
+{
+	gzip_ctx* ctx = (gzip_ctx*)calloc(1, sizeof(gzip_ctx));
+	uint32_t i, j, c;
+	int code, len;
+
+	if (ctx == NULL)
+		return NULL;
+	for (code = 0; code < 29; code++)
+		for (len = len_base[code]; (len < len_base[code] + (1 << len_extra[code])) && (len <= MAX_MATCH); len++)
+			ctx->len_code[len] = (uint8_t)code;
+	for (i = 0; i < NB_FIXED_LITLEN; i++)
+		ctx->fixed_litlen_len[i] = (i < 144) ? 8 : ((i < 256) ? 9 : ((i < 280) ? 7 : 8));
+	for (i = 0; i < NB_DIST; i++)
+		ctx->fixed_dist_len[i] = 5;
+	BuildCodes(ctx->fixed_litlen_len, NB_FIXED_LITLEN, ctx->fixed_litlen_code);
+	BuildCodes(ctx->fixed_dist_len, NB_DIST, ctx->fixed_dist_code);
+	for (i = 0; i < 256; i++) {
+		for (j = 0, c = i; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : (c >> 1);
+		ctx->crc_table[i] = c;
+	}
+	return ctx;
+}
+
+void GzipFreeContext(gzip_ctx* ctx)
+{
+	free(ctx);
+}
+
+/*
+ * Compress 'src_size' bytes from 'src' into a gzip member. 'dst_size' should
+ * be at least GZIP_BOUND(src_size). Returns the size of the member, or 0 if
+ * 'dst' was too small.
+ */
+size_t GzipCompress(gzip_ctx* ctx, const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_size)
+{
+	static const uint8_t header[10] = { 0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0b };
+	size_t i, end, block_start = 0;
+	uint32_t crc = 0xffffffff, cur_dist = 0, prev_dist = 0;
+	int cur_len, prev_len = 0, match_available = 0;
+
+	if ((ctx == NULL) || (src_size > UINT32_MAX))
+		return 0;
+	ctx->out = dst;
+	ctx->out_pos = 0;
+	ctx->out_size = dst_size;
+	ctx->bitbuf = 0;
+	ctx->bitcount = 0;
+	ctx->overflow = 0;
+	ctx->nb_syms = 0;
+	memset(ctx->head, 0, sizeof(ctx->head));
+	for (i = 0; i < sizeof(header); i++)
+		PutByte(ctx, header[i]);
+
+	// Lazy evaluation: a match is only used if the next position doesn't have a longer one
+	for (i = 0; i < src_size; ) {
+		cur_len = FindMatch(ctx, src, src_size, i, &cur_dist);
+		Insert(ctx, src, src_size, i);
+		if ((prev_len >= MIN_MATCH) && (cur_len <= prev_len)) {
+			end = i - 1 + prev_len;
+			AddSymbol(ctx, src, &block_start, end, (uint16_t)prev_len, (uint16_t)prev_dist);
+			// Insert the rest of the positions covered by the match
+			for (i++; i < end; i++)
+				Insert(ctx, src, src_size, i);
+			match_available = 0;
+			prev_len = 0;
+		} else if (match_available) {
+			AddSymbol(ctx, src, &block_start, i, src[i - 1], 0);
+			prev_len = cur_len;
+			prev_dist = cur_dist;
+			i++;
+		} else {
+			match_available = 1;
+			prev_len = cur_len;
+			prev_dist = cur_dist;
+			i++;
+		}
+	}
+	if (match_available)
+		AddSymbol(ctx, src, &block_start, src_size, src[src_size - 1], 0);
+	FlushBlock(ctx, &src[block_start], src_size - block_start, 1);
+	AlignBits(ctx);
+
+	for (i = 0; i < src_size; i++)
+		crc = ctx->crc_table[(crc ^ src[i]) & 0xff] ^ (crc >> 8);
+	crc = ~crc;
+	for (i = 0; i < 4; i++)
+		PutByte(ctx, (uint8_t)(crc >> (8 * i)));
+	for (i = 0; i < 4; i++)
+		PutByte(ctx, (uint8_t)(src_size >> (8 * i)));
+	return ctx->overflow ? 0 : ctx->out_pos;
+}
@@ -0,0 +1,38 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Minimal gzip (deflate) compressor
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#pragma once
+
+/*
+ * Each call to GzipCompress() produces a complete and independent gzip member,
+ * so that large data can be split into chunks and compressed in parallel, with
+ * the members simply concatenated into a (multi-member) .gz file.
+ */
+
+/* Maximum size of the gzip member produced for 'size' bytes of data */
+#define GZIP_BOUND(size)        ((size) + 6 * (2 * ((size) / 16384) + 2) + 32)
+
+typedef struct gzip_ctx gzip_ctx;
+
+gzip_ctx* GzipCreateContext(void);
+void GzipFreeContext(gzip_ctx* ctx);
+size_t GzipCompress(gzip_ctx* ctx, const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_size);
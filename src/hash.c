@@ -76,6 +76,7 @@
 #include "missing.h"
 #include "darkmode.h"
 #include "resource.h"
+#include "settings.h"
 #include "msapi_utf8.h"
 #include "localization.h"
 
@@ -100,6 +101,22 @@
 #define NUM_BUFFERS         3   // 2 + 1 as a mere double buffered async I/O
                                 // would modify the buffer being processed.
 
+/* Maximum number of threads used to read and hash UEFI bootloaders */
+#define MAX_BOOTLOADER_THREADS  8
+
+/*
+ * Sorted array of hashes, for the Secure Boot revocation checks and our hash
+ * DB lookups. Each index is built once per session, from the source identified
+ * by 'key', and only gets rebuilt if that source changes (e.g. on DBX update).
+ */
+typedef struct {
+	uint8_t* hashes;
+	uint32_t count;
+	uint32_t hash_size;
+	uint64_t key;
+	BOOL built;
+} hash_index_t;
+
 /* Globals */
 char hash_str[HASH_MAX][150];
 HANDLE data_ready[HASH_MAX] = { 0 }, thread_ready[HASH_MAX] = { 0 };
@@ -112,6 +129,7 @@ uint32_t proc_bufnum, hash_count[HASH_MAX] = { MD5_HASHSIZE, SHA1_HASHSIZE, SHA2
 uint32_t pe256ssp_size = 0;
 uint64_t md5sum_totalbytes;
 StrArray modified_files = { 0 };
+static hash_index_t db_index = { 0 }, dbx_index[ARCH_MAX] = { 0 }, ssp_index = { 0 }, cert_index = { 0 };
 
 extern int default_thread_priority;
 extern const char* efi_archname[ARCH_MAX];
@@ -2132,31 +2150,90 @@ out:
 	ExitThread(r);
 }
 
+static int sha1_cmp(const void* a, const void* b)
+{
+	return memcmp(a, b, SHA1_HASHSIZE);
+}
+
+static int sha256_cmp(const void* a, const void* b)
+{
+	return memcmp(a, b, SHA256_HASHSIZE);
+}
+
+/*
+ * (Re)build a hash index from 'count' hashes of 'hash_size' bytes, that are
+ * located every 'stride' bytes in 'data'.
+ */
+static void BuildHashIndex(hash_index_t* index, const uint8_t* data, uint32_t count,
+	uint32_t stride, uint32_t hash_size, uint64_t key)
+{
+	uint32_t i;
+
+	assert(hash_size == SHA1_HASHSIZE || hash_size == SHA256_HASHSIZE);
+	safe_free(index->hashes);
+	index->count = 0;
+	index->hash_size = hash_size;
+	index->key = key;
+	index->built = TRUE;
+	if (data == NULL || count == 0)
+		return;
+	index->hashes = malloc((size_t)count * hash_size);
+	if (index->hashes == NULL)
+		return;
+	for (i = 0; i < count; i++)
+		memcpy(&index->hashes[(size_t)i * hash_size], &data[(size_t)i * stride], hash_size);
+	qsort(index->hashes, count, hash_size, (hash_size == SHA1_HASHSIZE) ? sha1_cmp : sha256_cmp);
+	index->count = count;
+}
+
+static BOOL IsInHashIndex(const hash_index_t* index, const uint8_t* hash)
+{
+	if (index->count == 0)
+		return FALSE;
+	return (bsearch(hash, index->hashes, index->count, index->hash_size,
+		(index->hash_size == SHA1_HASHSIZE) ? sha1_cmp : sha256_cmp) != NULL);
+}
+
+static hash_index_t* GetDbIndex(void)
+{
+	if (!db_index.built)
+		BuildHashIndex(&db_index, sha256db, sizeof(sha256db) / SHA256_HASHSIZE,
+			SHA256_HASHSIZE, SHA256_HASHSIZE, 0);
+	return &db_index;
+}
+
+void FreeHashIndexes(void)
+{
+	int i;
+
+	safe_free(db_index.hashes);
+	safe_free(ssp_index.hashes);
+	safe_free(cert_index.hashes);
+	for (i = 0; i < ARRAYSIZE(dbx_index); i++)
+		safe_free(dbx_index[i].hashes);
+	memset(&db_index, 0, sizeof(db_index));
+	memset(&ssp_index, 0, sizeof(ssp_index));
+	memset(&cert_index, 0, sizeof(cert_index));
+	memset(dbx_index, 0, sizeof(dbx_index));
+}
+
 /*
  * The following 2 calls are used to check whether a buffer/file is in our hash DB
  */
 BOOL IsBufferInDB(const unsigned char* buf, const size_t len)
 {
-	int i;
 	uint8_t hash[SHA256_HASHSIZE];
 	if (!HashBuffer(HASH_SHA256, buf, len, hash))
 		return FALSE;
-	for (i = 0; i < ARRAYSIZE(sha256db); i += SHA256_HASHSIZE)
-		if (memcmp(hash, &sha256db[i], SHA256_HASHSIZE) == 0)
-			return TRUE;
-	return FALSE;
+	return IsInHashIndex(GetDbIndex(), hash);
 }
 
 BOOL IsFileInDB(const char* path)
 {
-	int i;
 	uint8_t hash[SHA256_HASHSIZE];
 	if (!HashFile(HASH_SHA256, path, hash))
 		return FALSE;
-	for (i = 0; i < ARRAYSIZE(sha256db); i += SHA256_HASHSIZE)
-		if (memcmp(hash, &sha256db[i], SHA256_HASHSIZE) == 0)
-			return TRUE;
-	return FALSE;
+	return IsInHashIndex(GetDbIndex(), hash);
 }
 
 BOOL FileMatchesHash(const char* path, const char* str)
@@ -2225,25 +2302,38 @@ static BOOL IsRevokedBySbat(uint8_t* buf, uint32_t len)
 	return FALSE;
 }
 
-// NB: Can be tested using en_windows_8_1_x64_dvd_2707217.iso
+/*
+ * Return the sorted index of the DBX hashes for 'arch'. The DBX is only parsed
+ * the first time it is needed, or when a more recent local DBX has been
+ * downloaded, rather than once for every bootloader we check.
+ */
 extern BOOL UseLocalDbx(int arch);
-static BOOL IsRevokedByDbx(uint8_t* hash, uint8_t* buf, uint32_t len)
+static hash_index_t* GetDbxIndex(int arch)
 {
 	EFI_VARIABLE_AUTHENTICATION_2* efi_var_auth;
 	EFI_SIGNATURE_LIST* efi_sig_list;
 	BYTE* dbx_data = NULL;
-	BOOL ret = FALSE, needs_free = FALSE;
+	BOOL needs_free = FALSE;
 	DWORD dbx_size = 0;
 	char dbx_name[32], path[MAX_PATH];
-	uint32_t i, fluff_size, nb_entries;
+	uint32_t fluff_size, nb_entries;
+	uint64_t key = 0;
+	hash_index_t* index = &dbx_index[arch];
+
+	// The local DBX is identified by its timestamp, and the embedded one by 0
+	static_sprintf(dbx_name, "dbx_%s.bin", efi_archname[arch]);
+	if (UseLocalDbx(arch)) {
+		static_sprintf(path, "DBXTimestamp_%s", efi_archname[arch]);
+		key = (uint64_t)ReadSetting64(path);
+	}
+	if (index->built && index->key == key)
+		return index;
 
-	i = MachineToArch(GetPeArch(buf));
-	if (i == ARCH_UNKNOWN)
-		goto out;
+	// Build an empty index, that we fill if the DBX is valid
+	BuildHashIndex(index, NULL, 0, 0, SHA256_HASHSIZE, key);
 
 	// Check if a more recent local DBX should be preferred over embedded
-	static_sprintf(dbx_name, "dbx_%s.bin", efi_archname[i]);
-	if (UseLocalDbx(i)) {
+	if (key != 0) {
 		static_sprintf(path, "%s\\%s\\%s", app_data_dir, FILES_DIR, dbx_name);
 		dbx_size = read_file(path, &dbx_data);
 		needs_free = (dbx_data != NULL);
@@ -2251,7 +2341,7 @@ static BOOL IsRevokedByDbx(uint8_t* hash, uint8_t* buf, uint32_t len)
 			duprintf("  Using local %s for revocation check", path);
 	}
 	if (dbx_size == 0) {
-		dbx_data = (BYTE*)GetResource(hMainInstance, MAKEINTRESOURCEA(IDR_DBX + i),
+		dbx_data = (BYTE*)GetResource(hMainInstance, MAKEINTRESOURCEA(IDR_DBX + arch),
 			_RT_RCDATA, dbx_name, &dbx_size, FALSE);
 	}
 	if (dbx_data == NULL || dbx_size <= sizeof(EFI_VARIABLE_AUTHENTICATION_2))
@@ -2276,15 +2366,33 @@ static BOOL IsRevokedByDbx(uint8_t* hash, uint8_t* buf, uint32_t len)
 	assert(dbx_size >= fluff_size + nb_entries * efi_sig_list->SignatureSize);
 
 	fluff_size += sizeof(GUID);
-	for (i = 0; i < nb_entries && !ret; i++) {
-		if (memcmp(hash, &dbx_data[fluff_size + i * efi_sig_list->SignatureSize], SHA256_HASHSIZE) == 0)
-			ret = TRUE;
-	}
+	BuildHashIndex(index, &dbx_data[fluff_size], nb_entries, efi_sig_list->SignatureSize,
+		SHA256_HASHSIZE, key);
 
 out:
 	if (needs_free)
 		free(dbx_data);
-	return ret;
+	return index;
+}
+
+// NB: Can be tested using en_windows_8_1_x64_dvd_2707217.iso
+static BOOL IsRevokedByDbx(uint8_t* hash, uint8_t* buf, uint32_t len)
+{
+	int arch = MachineToArch(GetPeArch(buf));
+
+	if (arch == ARCH_UNKNOWN)
+		return FALSE;
+	return IsInHashIndex(GetDbxIndex(arch), hash);
+}
+
+static BOOL IsRevokedBySsp(uint8_t* hash)
+{
+	// The SSP list may be replaced with a remote one, so key the index on it
+	if (!ssp_index.built || ssp_index.key != (uint64_t)(uintptr_t)pe256ssp ||
+		ssp_index.count != pe256ssp_size)
+		BuildHashIndex(&ssp_index, pe256ssp, pe256ssp_size, SHA256_HASHSIZE,
+			SHA256_HASHSIZE, (uint64_t)(uintptr_t)pe256ssp);
+	return IsInHashIndex(&ssp_index, hash);
 }
 
 static BOOL IsRevokedBySvn(uint8_t* buf, uint32_t len)
@@ -2356,11 +2464,12 @@ static BOOL IsRevokedByCert(cert_info_t* info)
 	if (sb_revoked_certs == NULL)
 		return FALSE;
 
-	for (i = 0; i < sb_revoked_certs->count; i++) {
-		if (memcmp(info->thumbprint, sb_revoked_certs->list[i], SHA1_HASHSIZE) == 0) {
-			uuprintf("  Found '%s' revoked certificate", info->name);
-			return TRUE;
-		}
+	if (!cert_index.built || cert_index.key != (uint64_t)(uintptr_t)sb_revoked_certs)
+		BuildHashIndex(&cert_index, (uint8_t*)sb_revoked_certs->list, sb_revoked_certs->count,
+			SHA1_HASHSIZE, SHA1_HASHSIZE, (uint64_t)(uintptr_t)sb_revoked_certs);
+	if (IsInHashIndex(&cert_index, info->thumbprint)) {
+		uuprintf("  Found '%s' revoked certificate", info->name);
+		return TRUE;
 	}
 	return FALSE;
 }
@@ -2397,9 +2506,12 @@ BOOL IsSignedBySecureBootAuthority(uint8_t* buf, uint32_t len)
 	return FALSE;
 }
 
-int IsBootloaderRevoked(uint8_t* buf, uint32_t len)
+/*
+ * Check a bootloader for revocation. If not NULL, 'pe256' must be the
+ * precomputed PE256 hash of the bootloader.
+ */
+int IsBootloaderRevokedEx(uint8_t* buf, uint32_t len, const uint8_t* pe256)
 {
-	uint32_t i;
 	uint8_t hash[SHA256_HASHSIZE];
 	IMAGE_DOS_HEADER* dos_header = (IMAGE_DOS_HEADER*)buf;
 	IMAGE_NT_HEADERS32* pe_header;
@@ -2421,15 +2533,16 @@ int IsBootloaderRevoked(uint8_t* buf, uint32_t len)
 	} else if (r > 0) {
 		uprintf("  Signed by '%s'", info.name);
 		// Only perform revocation checks on signed bootloaders
-		if (!PE256Buffer(buf, len, hash))
+		if (pe256 != NULL)
+			memcpy(hash, pe256, SHA256_HASHSIZE);
+		else if (!PE256Buffer(buf, len, hash))
 			return -1;
 		// Check for UEFI DBX revocation
 		if (IsRevokedByDbx(hash, buf, len))
 			revoked = 1;
 		// Check for Microsoft SSP revocation
-		for (i = 0; revoked == 0 && i < pe256ssp_size * SHA256_HASHSIZE; i += SHA256_HASHSIZE)
-			if (memcmp(hash, &pe256ssp[i], SHA256_HASHSIZE) == 0)
-				revoked = 2;
+		if (revoked == 0 && IsRevokedBySsp(hash))
+			revoked = 2;
 		// Check for Linux SBAT revocation
 		if (revoked == 0 && IsRevokedBySbat(buf, len))
 			revoked = 3;
@@ -2459,6 +2572,143 @@ int IsBootloaderRevoked(uint8_t* buf, uint32_t len)
 	return revoked;
 }
 
+int IsBootloaderRevoked(uint8_t* buf, uint32_t len)
+{
+	return IsBootloaderRevokedEx(buf, len, NULL);
+}
+
+/*
+ * Read and PE256 hash the UEFI bootloaders from an image, using a thread pool,
+ * so that they can then be checked for revocation without further I/O.
+ */
+typedef struct {
+	const char* image;
+	efi_bootloader_t* bl;
+	uint32_t count;
+	volatile LONG next;
+} bootloader_read_ctx_t;
+
+static DWORD WINAPI ReadBootloaderThread(void* param)
+{
+	bootloader_read_ctx_t* ctx = (bootloader_read_ctx_t*)param;
+	efi_bootloader_t* bl;
+	uint32_t i;
+
+	while ((i = (uint32_t)InterlockedIncrement(&ctx->next) - 1) < ctx->count) {
+		bl = &ctx->bl[i];
+		bl->len = ReadISOFileToBuffer(ctx->image, bl->path, &bl->buf);
+		if (bl->len == 0) {
+			safe_free(bl->buf);
+			continue;
+		}
+		bl->has_pe256 = PE256Buffer(bl->buf, bl->len, bl->pe256);
+	}
+	return 0;
+}
+
+void ReadBootloaders(const char* image, efi_bootloader_t* bl, uint32_t count)
+{
+	bootloader_read_ctx_t ctx = { image, bl, count, 0 };
+	HANDLE threads[MAX_BOOTLOADER_THREADS];
+	SYSTEM_INFO si;
+	DWORD i, num_threads;
+
+	if (count == 0)
+		return;
+	GetSystemInfo(&si);
+	num_threads = min(min(si.dwNumberOfProcessors, count), MAX_BOOTLOADER_THREADS);
+	for (i = 0; i < num_threads; i++) {
+		threads[i] = CreateThread(NULL, 0, ReadBootloaderThread, &ctx, 0, NULL);
+		if (threads[i] == NULL)
+			break;
+	}
+	num_threads = i;
+	// Fall back to reading sequentially if we couldn't create any thread
+	if (num_threads == 0)
+		ReadBootloaderThread(&ctx);
+	else
+		WaitForMultipleObjects(num_threads, threads, TRUE, INFINITE);
+	for (i = 0; i < num_threads; i++)
+		CloseHandle(threads[i]);
+}
+
+/*
+ * Index the lines of an md5sum.txt, so that we don't have to search the whole
+ * file, which may have tens of thousands of entries, for every file we look up.
+ * Each path, without any leading "./", is mapped to the offset of its line.
+ */
+BOOL Md5SumIndexCreate(md5sum_index_t* index, const char* data, uint32_t size)
+{
+	uint32_t i, idx, nb_lines = 0, line, len;
+	char path[MAX_PATH];
+	const char* p;
+
+	if (index == NULL || data == NULL)
+		return FALSE;
+	memset(index, 0, sizeof(*index));
+	for (i = 0; i < size; i++)
+		if (data[i] == '\n')
+			nb_lines++;
+	// Keep the table sparse enough for the double hashing to remain fast
+	if (!htab_create(2 * nb_lines + 16, &index->htab))
+		return FALSE;
+
+	for (line = 0; line < size; line = i + 1) {
+		for (i = line; i < size && data[i] != '\n'; i++);
+		// Expect "<MD5SUM> <FILE_PATH>", with an optional '*' for binary mode
+		if (i - line <= 2 * MD5_HASHSIZE + 1 || !IS_HEXASCII(data[line]) || data[line + 2 * MD5_HASHSIZE] != ' ')
+			continue;
+		p = &data[line + 2 * MD5_HASHSIZE];
+		while (p < &data[i] && (*p == ' ' || *p == '*'))
+			p++;
+		if (p[0] == '.' && p[1] == '/')
+			p = &p[2];
+		len = (uint32_t)(&data[i] - p);
+		if (len > 0 && p[len - 1] == '\r')
+			len--;
+		if (len == 0 || len >= sizeof(path))
+			continue;
+		memcpy(path, p, len);
+		path[len] = 0;
+		idx = htab_hash(path, &index->htab);
+		if (idx != 0)
+			index->htab.table[idx].data = (void*)(uintptr_t)(line + 1);
+	}
+	return TRUE;
+}
+
+/* Return the offset of the line for 'path' + 1, or 0 if 'path' is not listed */
+uint32_t Md5SumIndexLookup(md5sum_index_t* index, const char* path)
+{
+	if (index == NULL || path == NULL)
+		return 0;
+	if (path[0] == '.' && path[1] == '/')
+		path = &path[2];
+	return (uint32_t)(uintptr_t)index->htab.table[htab_lookup(path, &index->htab)].data;
+}
+
+void Md5SumIndexDestroy(md5sum_index_t* index)
+{
+	if (index != NULL)
+		htab_destroy(&index->htab);
+}
+
+// Returns TRUE if an md5sum.txt line is for one of the UEFI bootloaders we replace
+static BOOL IsMd5SumBootloaderLine(const char* line, size_t len)
+{
+	uint32_t i;
+	size_t name_len;
+	char name[48];
+
+	for (i = 1; i < ARRAYSIZE(efi_archname); i++) {
+		static_sprintf(name, " ./efi/boot/boot%s.efi", efi_archname[i]);
+		name_len = strlen(name);
+		if (len >= name_len && _strnicmp(&line[len - name_len], name, name_len) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
 /*
  * Updates the MD5SUMS/md5sum.txt file that some distros (Ubuntu, Mint...)
  * use to validate the media. Because we may alter some of the validated files
@@ -2474,11 +2724,12 @@ void UpdateMD5Sum(const char* dest_dir, const char* md5sum_name)
 	BYTE* res_data;
 	DWORD res_size;
 	HANDLE hFile;
-	intptr_t pos;
-	uint32_t i, j, size, md5_size, new_size;
+	FILE* fd;
+	uint32_t i, j, pos, md5_size;
 	uint8_t sum[MD5_HASHSIZE];
 	char md5_path[64], path1[64], path2[64], bootloader_name[32];
-	char *md5_data = NULL, *new_data = NULL, *str_pos, *d, *s, *p;
+	char *md5_data = NULL, *s, *e, *end;
+	md5sum_index_t index = { 0 };
 
 	if (!img_report.has_md5sum && !validate_md5sum)
 		return;
@@ -2488,46 +2739,34 @@ void UpdateMD5Sum(const char* dest_dir, const char* md5sum_name)
 	if (md5_size == 0)
 		return;
 
-	for (i = 0; i < modified_files.Index; i++) {
-		for (j = 0; j < (uint32_t)strlen(modified_files.String[i]); j++)
-			if (modified_files.String[i][j] == '\\')
-				modified_files.String[i][j] = '/';
-		str_pos = strstr(md5_data, &modified_files.String[i][2]);
-		if (str_pos == NULL)
-			// File is not listed in md5 sums
-			continue;
-		if (display_header) {
-			uprintf("Updating %s:", md5_path);
-			display_header = FALSE;
-		}
-		uprintf("● %s", &modified_files.String[i][2]);
-		pos = str_pos - md5_data;
-		HashFile(HASH_MD5, modified_files.String[i], sum);
-		while ((pos > 0) && (md5_data[pos - 1] != '\n'))
+	// Update the digests of the files we modified in place
+	if (modified_files.Index != 0 && Md5SumIndexCreate(&index, md5_data, md5_size)) {
+		for (i = 0; i < modified_files.Index; i++) {
+			for (j = 0; j < (uint32_t)strlen(modified_files.String[i]); j++)
+				if (modified_files.String[i][j] == '\\')
+					modified_files.String[i][j] = '/';
+			pos = Md5SumIndexLookup(&index, &modified_files.String[i][3]);
+			if (pos == 0)
+				// File is not listed in md5 sums
+				continue;
 			pos--;
-		assert(IS_HEXASCII(md5_data[pos]));
-		for (j = 0; j < 16; j++) {
-			md5_data[pos + 2 * j] = ((sum[j] >> 4) < 10) ? ('0' + (sum[j] >> 4)) : ('a' - 0xa + (sum[j] >> 4));
-			md5_data[pos + 2 * j + 1] = ((sum[j] & 15) < 10) ? ('0' + (sum[j] & 15)) : ('a' - 0xa + (sum[j] & 15));
+			if (display_header) {
+				uprintf("Updating %s:", md5_path);
+				display_header = FALSE;
+			}
+			uprintf("● %s", &modified_files.String[i][2]);
+			HashFile(HASH_MD5, modified_files.String[i], sum);
+			assert(IS_HEXASCII(md5_data[pos]));
+			for (j = 0; j < 16; j++) {
+				md5_data[pos + 2 * j] = ((sum[j] >> 4) < 10) ? ('0' + (sum[j] >> 4)) : ('a' - 0xa + (sum[j] >> 4));
+				md5_data[pos + 2 * j + 1] = ((sum[j] & 15) < 10) ? ('0' + (sum[j] & 15)) : ('a' - 0xa + (sum[j] & 15));
+			}
 		}
+		Md5SumIndexDestroy(&index);
 	}
 
 	// If we validate md5sum we need to update the original bootloader names and add md5sum_totalbytes
 	if (validate_md5sum) {
-		new_size = md5_size;
-		new_data = malloc(md5_size + 1024);
-		assert(new_data != NULL);
-		if (new_data == NULL)
-			return;
-		// Will be nonzero if we created the file, otherwise zero
-		if (md5sum_totalbytes != 0) {
-			snprintf(new_data, md5_size + 1024, "# md5sum_totalbytes = 0x%llx\n", md5sum_totalbytes);
-			new_size += (uint32_t)strlen(new_data);
-			d = &new_data[strlen(new_data)];
-		} else {
-			d = new_data;
-		}
-		s = md5_data;
 		// Extract the MD5Sum bootloader(s)
 		for (i = 1; i < ARRAYSIZE(efi_archname); i++) {
 			static_sprintf(bootloader_name, "boot%s.efi", efi_archname[i]);
@@ -2560,34 +2799,35 @@ void UpdateMD5Sum(const char* dest_dir, const char* md5sum_name)
 			safe_closehandle(hFile);
 			uprintf("Created: %s (%s)", path1, SizeToHumanReadable(res_size, FALSE, FALSE));
 		}
+	}
+
+	// Stream the updated file back, line by line, rather than rebuild it in memory
+	fd = fopenU(md5_path, "wb");
+	if (fd == NULL) {
+		uprintf("Could not update '%s'", md5_path);
+		goto out;
+	}
+	// Will be nonzero if we created the file, otherwise zero
+	if (validate_md5sum && md5sum_totalbytes != 0)
+		fprintf(fd, "# md5sum_totalbytes = 0x%llx\n", md5sum_totalbytes);
+	end = &md5_data[md5_size];
+	for (s = md5_data; s < end; s = &e[1]) {
+		e = memchr(s, '\n', end - s);
+		if (e == NULL)
+			e = end;
 		// Rename the original bootloaders if present in md5sum.txt
-		for (p = md5_data; (p = StrStrIA(p, " ./efi/boot/boot")) != NULL; ) {
-			for (i = 1; i < ARRAYSIZE(efi_archname); i++) {
-				static_sprintf(bootloader_name, "boot%s.efi", efi_archname[i]);
-				if (p[12 + strlen(bootloader_name)] != 0x0a)
-					continue;
-				p[12 + strlen(bootloader_name)] = 0;
-				if (lstrcmpiA(&p[12], bootloader_name) == 0) {
-					size = (uint32_t)(p - s) + 12 + (uint32_t)strlen(bootloader_name) - 4;
-					memcpy(d, s, size);
-					d = &d[size];
-					strcpy(d, "_original.efi\n");
-					new_size += 9;
-					d = &d[14];
-					s = &p[12 + strlen(bootloader_name) + 1];
-				}
-				p[12 + strlen(bootloader_name)] = 0x0a;
-			}
-			p = &p[12];
+		if (validate_md5sum && IsMd5SumBootloaderLine(s, e - s)) {
+			fwrite(s, 1, e - s - 4, fd);
+			fputs("_original.efi", fd);
+		} else {
+			fwrite(s, 1, e - s, fd);
 		}
-		p = &md5_data[md5_size];
-		memcpy(d, s, p - s);
-		free(md5_data);
-		md5_data = new_data;
-		md5_size = new_size;
+		if (e < end)
+			fputc('\n', fd);
 	}
+	fclose(fd);
 
-	write_file(md5_path, md5_data, md5_size);
+out:
 	free(md5_data);
 }
 
@@ -126,10 +126,10 @@ static const char* stupid_antivirus = "  NOTE: This is usually caused by a poorl
 const char* old_c32_name[NB_OLD_C32] = OLD_C32_NAMES;
 static const int64_t old_c32_threshold[NB_OLD_C32] = OLD_C32_THRESHOLD;
 static uint8_t joliet_level = 0;
-static uint32_t md5sum_size = 0;
 static BOOL scan_only = FALSE;
 static StrArray config_path, isolinux_path, grub_filesystems;
-static char symlinked_syslinux[MAX_PATH], *md5sum_data = NULL, *md5sum_pos = NULL;
+static char symlinked_syslinux[MAX_PATH];
+static md5sum_index_t md5sum_index = { HTAB_EMPTY };
 
 // Ensure filenames do not contain invalid FAT32 or NTFS characters
 static __inline char* sanitize_filename(char* filename, BOOL* is_identical)
@@ -165,54 +165,18 @@ static void log_handler (cdio_log_level_t level, const char *message)
 // Returns TRUE if a path appears in md5sum.txt
 static BOOL is_in_md5sum(char* path)
 {
-	BOOL found = FALSE;
-	char c[3], * p, * pos = md5sum_pos, * nul_pos;
-
 	// If we are creating the md5sum file from scratch, every file is in it.
 	if (fd_md5sum != NULL)
 		return TRUE;
 
 	// If we don't have an existing file at this stage, then no file is in it.
-	if (md5sum_size == 0 || md5sum_data == NULL)
+	if (md5sum_index.htab.table == NULL)
 		return FALSE;
 
 	// We should have a "X:/xyz" path
 	assert(path[1] == ':' && path[2] == '/');
 
-	// Modify the path to have " ./xyz"
-	c[0] = path[0];
-	c[1] = path[1];
-	path[0] = ' ';
-	path[1] = '.';
-
-	// Search for the string in the remainder of the md5sum.txt
-	// NB: md5sum_data is always NUL terminated.
-	p = strstr(pos, path);
-	// Cater for the case where we matched a partial string and look for the full one
-	while (p != NULL && p[strlen(path)] != '\n' && p[strlen(path)] != '\r' && p[strlen(path)] != '\0') {
-		pos = p + strlen(path);
-		p = strstr(pos, path);
-	}
-	found = (p != NULL);
-	// If not found in remainder and we have a remainder, loop to search from beginning
-	if (!found && pos != md5sum_data) {
-		nul_pos = pos;
-		c[2] = *nul_pos;
-		*nul_pos = 0;
-		p = strstr(md5sum_data, path);
-		while (p != NULL && p[strlen(path)] != '\n' && p[strlen(path)] != '\r' && p[strlen(path)] != '\0') {
-			pos = p + strlen(path);
-			p = strstr(pos, path);
-		}
-		*nul_pos = c[2];
-		found = (p != NULL);
-	}
-
-	path[0] = c[0];
-	path[1] = c[1];
-	if (found)
-		md5sum_pos = p + strlen(path);
-	return found;
+	return (Md5SumIndexLookup(&md5sum_index, &path[3]) != 0);
 }
 
 static void _print_extracted_file(char* psz_fullpath, uint64_t file_length, BOOL split)
@@ -1213,10 +1177,11 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 {
 	const char* basedir[] = { "i386", "amd64", "minint" };
 	int k, r = 1;
-	char *tmp, *ext, *spacing = "  ";
+	char *tmp, *ext, *spacing = "  ", *md5sum_data = NULL;
 	char path[MAX_PATH], path2[16];
 	uint8_t* buf = NULL;
 	uint16_t sl_version;
+	uint32_t md5sum_size;
 	size_t i, j, size, sl_index = 0;
 	FILE* fd;
 	iso9660_t* p_iso = NULL;
@@ -1267,8 +1232,11 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 				if (fd_md5sum == NULL)
 					uprintf("WARNING: Could not create '%s'", md5sum_name[0]);
 			} else {
+				// We only need to look up paths, so index the file and drop the data
 				md5sum_size = ReadISOFileToBuffer(src_iso, md5sum_name[0], (uint8_t**)&md5sum_data);
-				md5sum_pos = md5sum_data;
+				if (md5sum_size != 0)
+					Md5SumIndexCreate(&md5sum_index, md5sum_data, md5sum_size);
+				safe_free(md5sum_data);
 			}
 		}
 	}
@@ -1439,9 +1407,8 @@ out:
 		}
 		if (HAS_WININST(img_report)) {
 			char wim_path[4 * MAX_PATH];
-			assert(safe_strlen(image_path) + safe_strlen(&img_report.wininst_path[0][2]) + 2 < ARRAYSIZE(wim_path));
-			static_sprintf(wim_path, "%s|%s", image_path, &img_report.wininst_path[0][2]);
-			img_report.wininst_version = GetWimVersion(wim_path);
+			if (GetWininstImagePath(0, wim_path, sizeof(wim_path)))
+				img_report.wininst_version = GetWimVersion(wim_path);
 		}
 		if (img_report.has_grub2) {
 			char grub_path[128];
@@ -1593,9 +1560,8 @@ out:
 		if (fd_md5sum != NULL) {
 			uprintf("Created: %s\\%s (%s)", dest_dir, md5sum_name[0], SizeToHumanReadable(ftell(fd_md5sum), FALSE, FALSE));
 			fclose(fd_md5sum);
-		} else if (md5sum_data != NULL) {
-			safe_free(md5sum_data);
-			md5sum_size = 0;
+		} else {
+			Md5SumIndexDestroy(&md5sum_index);
 		}
 	}
 	iso9660_close(p_iso);
@@ -0,0 +1,810 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Localization file and compiled localization table parser
+ * Copyright © 2013-2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Platform independent, so that it can also be built for the host, by the
+ * localization benchmark from tests/. Non Windows builds must provide the
+ * few rufus.h definitions used below (uprintf, safe_free, etc.) along with
+ * the BOOL, WORD and HWND types that localization.h references.
+ */
+
+/* Memory leaks detection - define _CRTDBG_MAP_ALLOC as preprocessor macro */
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include "rufus.h"
+#include "missing.h"
+#include "msapi_utf8.h"
+#endif
+#include "localization.h"
+
+static const char space[] = " \t";
+
+/*
+ * List of supported locale commands, with their parameter syntax:
+ *   c control ID (no space, no quotes)
+ *   s: quoted string
+ *   i: 32 bit signed integer
+ *   u: 32 bit unsigned CSV list
+ * Remember to update the size of the array in localization.h when adding/removing elements
+ */
+const loc_parse parse_cmd[7] = {
+	// Translation name and Windows LCIDs it should apply to
+	{ 'l', LC_LOCALE, "ssu" },	// l "en_US" "English (US)" 0x0009,0x1009
+	// Base translation to add on top of (eg. "English (UK)" can be used to build on top of "English (US)"
+	{ 'b', LC_BASE, "s" },		// b "en_US"
+	// Version to use for the localization commandset and API
+	{ 'v', LC_VERSION, "u" },	// v 1.0.2
+	// Translate the text control associated with an ID
+	{ 't', LC_TEXT, "cs" },		// t IDC_CONTROL "Translation"
+	// Set the section/dialog to which the next commands should apply
+	{ 'g', LC_GROUP, "c" },		// g IDD_DIALOG
+	// Set the font to use for the text controls that follow
+	// Use f "Default" 0 to reset the font
+	{ 'f', LC_FONT, "si" },		// f "MS Dialog" 10
+	// Set translations attributes such as right-to-left, numerals to use, etc
+	{ 'a', LC_ATTRIBUTES, "s" },	// a "ra"
+};
+
+const struct {char c; int flag;} attr_parse[] = {
+	{ 'r', LOC_RIGHT_TO_LEFT },
+};
+
+// Compiled localization table, accessed in place, if the embedded loc file was compiled
+static const loc_table_header* loc_table = NULL;
+static const loc_table_locale* loc_table_locales = NULL;
+static const loc_table_cmd* loc_table_cmds = NULL;
+static const char* loc_table_pool = NULL;
+
+/*
+ * Fill a localization command buffer by parsing the line arguments
+ * The command is allocated and must be freed (by calling free_loc_cmd)
+ */
+static loc_cmd* get_loc_cmd(char c, char* line) {
+	size_t i, j, k, l, r, ti = 0, ii = 0;
+	char *endptr, *expected_endptr, *token;
+	loc_cmd* lcmd = NULL;
+
+	for (j = 0; j<ARRAYSIZE(parse_cmd); j++) {
+		if (c == parse_cmd[j].c)
+			break;
+	}
+	if (j >= ARRAYSIZE(parse_cmd)) {
+		luprint("unknown command");
+		return NULL;
+	}
+
+	lcmd = (loc_cmd*)calloc(sizeof(loc_cmd), 1);
+	if (lcmd == NULL) {
+		luprint("could not allocate command");
+		return NULL;
+	}
+	lcmd->command = parse_cmd[j].cmd;
+	lcmd->ctrl_id = (lcmd->command <= LC_TEXT)?-1:0;
+	lcmd->line_nr = (uint16_t)loc_line_nr;
+
+	i = 0;
+	for (k = 0; parse_cmd[j].arg_type[k] != 0; k++) {
+		// Skip leading spaces
+		i += strspn(&line[i], space);
+		r = i;
+		if (line[i] == 0) {
+			luprintf("missing parameter for command '%c'", parse_cmd[j].c);
+			goto err;
+		}
+		switch(parse_cmd[j].arg_type[k]) {
+		case 's':	// quoted string
+			// search leading quote
+			if (line[i++] != '"') {
+				luprint("no start quote");
+				goto err;
+			}
+			r = i;
+			// locate ending quote
+			while ((line[i] != 0) && ((line[i] != '"') || ((line[i] == '"') && (line[i-1] == '\\')))) {
+				if ((line[i] == '"') && (line[i-1] == '\\')) {
+					memmove(&line[i-1], &line[i], strlen(&line[i]) + 1);
+				} else {
+					i++;
+				}
+			}
+			if (line[i] == 0) {
+				luprint("no end quote");
+				goto err;
+			}
+			line[i++] = 0;
+			lcmd->txt[ti++] = safe_strdup(&line[r]);
+			break;
+		case 'c':	// control ID (single word)
+			while ((line[i] != 0) && (line[i] != space[0]) && (line[i] != space[1]))
+				i++;
+			if (line[i] != 0)
+				line[i++] = 0;
+			lcmd->txt[ti++] = safe_strdup(&line[r]);
+			break;
+		case 'i':	// 32 bit signed integer
+			// allow commas or dots between values
+			if ((line[i] == ',') || (line[i] == '.')) {
+				i += strspn(&line[i+1], space);
+				r = i;
+			}
+			while ((line[i] != 0) && (line[i] != space[0]) && (line[i] != space[1])
+				&& (line[i] != ',') && (line[i] != '.'))
+				i++;
+			expected_endptr = &line[i];
+			if (line[i] != 0)
+				line[i++] = 0;
+			lcmd->num[ii++] = (int32_t)strtol(&line[r], &endptr, 0);
+			if (endptr != expected_endptr) {
+				luprint("invalid integer");
+				goto err;
+			}
+			break;
+		case 'u':	// comma or dot separated list of unsigned integers (to end of line)
+			// count the number of commas
+			lcmd->unum_size = 1;
+			for (l = i; line[l] != 0; l++) {
+				if ((line[l] == '.') || (line[l] == ','))
+					lcmd->unum_size++;
+			}
+			free(lcmd->unum);
+			lcmd->unum = (uint32_t*)malloc(lcmd->unum_size * sizeof(uint32_t));
+			if (lcmd->unum == NULL) {
+				luprint("could not allocate memory");
+				goto err;
+			}
+			token = strtok(&line[i], ".,");
+			for (l=0; (l<lcmd->unum_size) && (token != NULL); l++) {
+				lcmd->unum[l] = (int32_t)strtol(token, &endptr, 0);
+				token = strtok(NULL, ".,");
+			}
+			if ((token != NULL) || (l != lcmd->unum_size)) {
+				luprint("internal error (unexpected number of numeric values)");
+				goto err;
+			}
+			break;
+		default:
+			uprintf("localization: unhandled arg_type '%c'\n", parse_cmd[j].arg_type[k]);
+			goto err;
+		}
+	}
+
+	return lcmd;
+
+err:
+	free_loc_cmd(lcmd);
+	return NULL;
+}
+
+/*
+ * Parse an UTF-8 localization command line
+ */
+static void get_loc_data_line(char* line)
+{
+	size_t i;
+	loc_cmd* lcmd = NULL;
+	char t;
+
+	if ((line == NULL) || (line[0] == 0))
+		return;
+
+	// Skip leading spaces
+	i = strspn(line, space);
+
+	// Read token (NUL character will be read if EOL)
+	t = line[i++];
+	if (t == '#')	// Comment
+		return;
+	if ((t == 0) || ((line[i] != space[0]) && (line[i] != space[1]))) {
+		luprintf("syntax error: '%s'", line);
+		return;
+	}
+
+	lcmd = get_loc_cmd(t, &line[i]);
+
+	if ((lcmd != NULL) && (lcmd->command != LC_LOCALE))
+		// TODO: check return value?
+		dispatch_loc_cmd(lcmd);
+	else
+		free_loc_cmd(lcmd);
+}
+
+/*
+ * Open a localization file and store its file name, with special case
+ * when dealing with the embedded loc file.
+ */
+FILE* open_loc_file(const char* filename)
+{
+	FILE* fd = NULL;
+#if defined(_WIN32)
+	wchar_t *wfilename = NULL;
+#endif
+	const char* tmp_ext = ".tmp";
+
+	if (filename == NULL)
+		return NULL;
+
+	if (loc_filename != embedded_loc_filename) {
+		safe_free(loc_filename);
+	}
+	if (safe_strcmp(tmp_ext, &filename[safe_strlen(filename)-4]) == 0) {
+		loc_filename = embedded_loc_filename;
+	} else {
+		loc_filename = safe_strdup(filename);
+	}
+#if defined(_WIN32)
+	wfilename = utf8_to_wchar(filename);
+	if (wfilename == NULL) {
+		uprintf("Could not convert '%s' to UTF-16", filename);
+		goto out;
+	}
+	fd = _wfopen(wfilename, L"rb");
+#else
+	fd = fopen(filename, "rb");
+#endif
+	if (fd == NULL) {
+		uprintf("localization: could not open '%s'\n", filename);
+	}
+
+#if defined(_WIN32)
+out:
+	safe_free(wfilename);
+#endif
+	return fd;
+}
+
+/*
+ * Validate a compiled localization table (see res/loc/loc_compile.py) and, if
+ * valid, use it for all subsequent calls to get_supported_locales() and
+ * get_loc_data_file() instead of parsing a loc file. A NULL data disables it.
+ */
+BOOL set_loc_table(const uint8_t* data, size_t size)
+{
+	const loc_table_header* header = (const loc_table_header*)data;
+	const loc_table_locale* locales;
+	const loc_table_cmd* cmds;
+	const char* pool;
+	uint32_t i;
+
+	if (data == NULL) {
+		loc_table = NULL;
+		return FALSE;
+	}
+	if ((size < sizeof(loc_table_header)) ||
+		(memcmp(header->magic, LOC_TABLE_MAGIC, sizeof(header->magic)) != 0))
+		return FALSE;
+	if (header->version != LOC_TABLE_VERSION) {
+		uprintf("localization: unsupported compiled table version %d", header->version);
+		return FALSE;
+	}
+	// 64-bit arithmetic, so that the sizes can't overflow
+	if ((header->pool_size == 0) || ((uint64_t)sizeof(loc_table_header) +
+		(uint64_t)header->nb_locales * sizeof(loc_table_locale) +
+		(uint64_t)header->nb_cmds * sizeof(loc_table_cmd) + header->pool_size != size))
+		goto invalid;
+	locales = (const loc_table_locale*)&data[sizeof(loc_table_header)];
+	cmds = (const loc_table_cmd*)&locales[header->nb_locales];
+	pool = (const char*)&cmds[header->nb_cmds];
+	// This ensures that all the strings from the pool are NUL terminated
+	if (pool[header->pool_size - 1] != 0)
+		goto invalid;
+	for (i = 0; i < header->nb_locales; i++) {
+		if ((locales[i].name >= header->pool_size) || (locales[i].desc >= header->pool_size) ||
+			((uint64_t)locales[i].lcids + locales[i].nb_lcids * sizeof(uint32_t) > header->pool_size) ||
+			((uint64_t)locales[i].first_cmd + locales[i].nb_cmds > header->nb_cmds))
+			goto invalid;
+	}
+	for (i = 0; i < header->nb_cmds; i++) {
+		if ((cmds[i].command > LC_ATTRIBUTES) ||
+			((cmds[i].txt[0] != LOC_TABLE_NO_STRING) && (cmds[i].txt[0] >= header->pool_size)) ||
+			((cmds[i].txt[1] != LOC_TABLE_NO_STRING) && (cmds[i].txt[1] >= header->pool_size)))
+			goto invalid;
+	}
+
+	loc_table = header;
+	loc_table_locales = locales;
+	loc_table_cmds = cmds;
+	loc_table_pool = pool;
+	if (loc_filename != embedded_loc_filename)
+		safe_free(loc_filename);
+	loc_filename = embedded_loc_filename;
+	return TRUE;
+
+invalid:
+	uprintf("localization: compiled table is invalid");
+	return FALSE;
+}
+
+static __inline char* loc_table_strdup(uint32_t offset)
+{
+	return (offset == LOC_TABLE_NO_STRING) ? NULL : safe_strdup(&loc_table_pool[offset]);
+}
+
+/*
+ * Construct the list of available locales from the compiled table.
+ * This performs the same validation as the loc file parser below.
+ */
+static BOOL get_supported_locales_from_table(void)
+{
+	BOOL r;
+	uint32_t i, loc_base_major = UINT32_MAX, loc_base_minor = UINT32_MAX;
+	loc_cmd* lcmd;
+	const loc_table_locale* locale;
+
+	free_locale_list();
+	for (i = 0; i < loc_table->nb_locales; i++) {
+		locale = &loc_table_locales[i];
+		loc_line_nr = locale->line_nr;
+		uprintf("localization: found locale '%s'\n", &loc_table_pool[locale->name]);
+		if (locale->version_line_nr == 0) {
+			uprintf("localization: no compatible version was found - this locale will be ignored\n");
+			continue;
+		}
+		lcmd = (loc_cmd*)calloc(sizeof(loc_cmd), 1);
+		if (lcmd == NULL) {
+			luprint("could not allocate command");
+			break;
+		}
+		lcmd->command = LC_LOCALE;
+		lcmd->line_nr = locale->line_nr;
+		lcmd->ctrl_id = locale->attributes;
+		lcmd->txt[0] = loc_table_strdup(locale->name);
+		lcmd->txt[1] = loc_table_strdup(locale->desc);
+		if (locale->nb_lcids != 0) {
+			lcmd->unum = (uint32_t*)malloc(locale->nb_lcids * sizeof(uint32_t));
+			if (lcmd->unum != NULL) {
+				// The pool may not be aligned, so don't access the LCIDs directly
+				memcpy(lcmd->unum, &loc_table_pool[locale->lcids], locale->nb_lcids * sizeof(uint32_t));
+				lcmd->unum_size = (uint8_t)locale->nb_lcids;
+			}
+		}
+		// We use num[0] as the index of this locale in the table
+		lcmd->num[0] = (int32_t)i;
+		loc_line_nr = locale->version_line_nr;
+		if (loc_base_major == UINT32_MAX) {
+			// Same as for the loc file, the first version is our base
+			loc_base_major = locale->version[0];
+			loc_base_minor = locale->version[1];
+		} else if ((locale->version[0] < loc_base_major) ||
+			((locale->version[0] == loc_base_major) && (locale->version[1] < loc_base_minor))) {
+			lcmd->ctrl_id |= LOC_NEEDS_UPDATE;
+			luprintf("the version of this translation is older than the base one and may result in some messages not being properly translated.\n"
+				"If you are the translator, please update your translation with the changes that intervened between v%d.%d and v%d.%d.\n"
+				"See https://github.com/pbatard/rufus/blob/master/res/loc/ChangeLog.txt",
+				locale->version[0], locale->version[1], loc_base_major, loc_base_minor);
+		}
+		list_add_tail(&lcmd->list, &locale_list);
+	}
+	r = !list_empty(&locale_list);
+	if (r == FALSE)
+		uprintf("localization: compiled table contains no valid locale sections\n");
+	return r;
+}
+
+/*
+ * Apply the commands of a locale from the compiled table.
+ * Same as get_loc_data_file(), this call is reentrant for the "base" command.
+ */
+static BOOL get_loc_data_table(loc_cmd* lcmd)
+{
+	static int depth = 0;
+	static BOOL populate_default = FALSE;
+	uint32_t i;
+	int old_loc_line_nr = loc_line_nr;
+	BOOL reentrant = (depth != 0);
+	loc_cmd* dispatched;
+	const loc_table_locale* locale;
+	const loc_table_cmd* cmd;
+	// The default locale is always the first one
+	loc_cmd* default_locale = list_entry(locale_list.next, loc_cmd, list);
+
+	if ((lcmd == NULL) || (default_locale == NULL)) {
+		uprintf("localization: no %slocale", (default_locale == NULL)?"default ":" ");
+		return FALSE;
+	}
+
+	if (msg_table == NULL) {
+		// Initialize the default message table (usually en-US)
+		msg_table = default_msg_table;
+		uprintf("localization: initializing default message table");
+		populate_default = TRUE;
+		get_loc_data_table(default_locale);
+		populate_default = FALSE;
+	}
+
+	if (!reentrant) {
+		if (!populate_default) {
+			if (lcmd == default_locale) {
+				// The default locale has already been populated => nothing to do
+				msg_table = default_msg_table;
+				return TRUE;
+			}
+			msg_table = current_msg_table;
+		}
+		free_dialog_list();
+	}
+
+	if ((uint32_t)lcmd->num[0] >= loc_table->nb_locales)
+		return FALSE;
+	locale = &loc_table_locales[lcmd->num[0]];
+	depth++;
+	for (i = 0; i < locale->nb_cmds; i++) {
+		cmd = &loc_table_cmds[locale->first_cmd + i];
+		dispatched = (loc_cmd*)calloc(sizeof(loc_cmd), 1);
+		if (dispatched == NULL) {
+			uprintf("localization: could not allocate command");
+			break;
+		}
+		dispatched->command = cmd->command;
+		dispatched->ctrl_id = (cmd->command <= LC_TEXT) ? -1 : 0;
+		dispatched->line_nr = cmd->line_nr;
+		dispatched->txt[0] = loc_table_strdup(cmd->txt[0]);
+		dispatched->txt[1] = loc_table_strdup(cmd->txt[1]);
+		loc_line_nr = cmd->line_nr;
+		dispatch_loc_cmd(dispatched);
+	}
+	depth--;
+	if (reentrant)
+		loc_line_nr = old_loc_line_nr;
+	return (i >= locale->nb_cmds);
+}
+
+/*
+ * Parse a localization file, to construct the list of available locales.
+ * The locale file must be UTF-8 with NO BOM.
+ */
+BOOL get_supported_locales(const char* filename)
+{
+	FILE* fd = NULL;
+	BOOL r = FALSE;
+	char line[1024];
+	size_t i, j, k;
+	loc_cmd *lcmd = NULL, *last_lcmd = NULL;
+	long end_of_block;
+	int version_line_nr = 0;
+	uint32_t loc_base_major = UINT32_MAX, loc_base_minor = UINT32_MAX;
+
+	if (loc_table != NULL)
+		return get_supported_locales_from_table();
+
+	fd = open_loc_file(filename);
+	if (fd == NULL)
+		goto out;
+
+	// Check that the file doesn't contain a BOM and was saved in DOS mode
+	i = fread(line, 1, sizeof(line), fd);
+	if (i < sizeof(line)) {
+		uprintf("Invalid loc file: the file is too small!");
+		goto out;
+	}
+	if (((uint8_t)line[0]) > 0x80) {
+		uprintf("Invalid loc file: the file should not have a BOM (Byte Order Mark)");
+		goto out;
+	}
+	for (i=0; i<sizeof(line)-1; i++)
+		if ((((uint8_t)line[i]) == 0x0D) && (((uint8_t)line[i+1]) == 0x0A)) break;
+	if (i >= sizeof(line)-1) {
+		uprintf("Invalid loc file: the file MUST be saved in DOS mode (CR/LF)");
+		goto out;
+	}
+	fseek(fd, 0, SEEK_SET);
+
+	loc_line_nr = 0;
+	line[0] = 0;
+	free_locale_list();
+	do {
+		// adjust the last block
+		end_of_block = ftell(fd);
+		if (fgets(line, sizeof(line), fd) == NULL)
+			break;
+		loc_line_nr++;
+		// Skip leading spaces
+		i = strspn(line, space);
+		if ((line[i] != 'l') && (line[i] != 'v') && (line[i] != 'a'))
+			continue;
+		// line[i] is not NUL so i+1 is safe to access
+		// coverity[tainted_data]
+		lcmd = get_loc_cmd(line[i], &line[i+1]);
+		if ((lcmd == NULL) || ((lcmd->command != LC_LOCALE) && (lcmd->command != LC_VERSION) && (lcmd->command != LC_ATTRIBUTES))) {
+			free_loc_cmd(lcmd);
+			continue;
+		}
+		switch (lcmd->command) {
+		case LC_LOCALE:
+			// we use num[0] and num[1] as block delimiter index for this locale in the file
+			if (last_lcmd != NULL) {
+				if (version_line_nr == 0) {
+					uprintf("localization: no compatible version was found - this locale will be ignored\n");
+					list_del(&last_lcmd->list);
+					free_loc_cmd(last_lcmd);
+				} else {
+					last_lcmd->num[1] = (int32_t)end_of_block;
+				}
+			}
+			lcmd->num[0] = (int32_t)ftell(fd);
+			// Add our locale command to the locale list
+			list_add_tail(&lcmd->list, &locale_list);
+			uprintf("localization: found locale '%s'\n", lcmd->txt[0]);
+			last_lcmd = lcmd;
+			version_line_nr = 0;
+			break;
+		case LC_ATTRIBUTES:
+			if (last_lcmd == NULL) {
+				luprint("[a]ttributes cannot precede [l]ocale");
+			} else for(j=0; lcmd->txt[0][j] != 0; j++) {
+				for (k=0; k<ARRAYSIZE(attr_parse); k++) {
+					if (attr_parse[k].c == lcmd->txt[0][j]) {
+						// Repurpose ctrl_id as an attributes mask
+						last_lcmd->ctrl_id |= attr_parse[k].flag;
+						break;
+					}
+				}
+				if (k >= ARRAYSIZE(attr_parse))
+					luprintf("unknown attribute '%c' - ignored", lcmd->txt[0][j]);
+			}
+			free_loc_cmd(lcmd);
+			break;
+		case LC_VERSION:
+			if (version_line_nr != 0) {
+				luprintf("[v]ersion was already provided at line %d", version_line_nr);
+			} else if (lcmd->unum_size != 2) {
+				luprint("[v]ersion format is invalid");
+			} else if (last_lcmd == NULL) {
+				luprint("[v]ersion cannot precede [l]ocale");
+			} else if (loc_base_major == UINT32_MAX) {
+				// We use the first version from our loc file (usually en-US) as our base
+				// as it should always be the most up to date.
+				loc_base_major = lcmd->unum[0];
+				loc_base_minor = lcmd->unum[1];
+				version_line_nr = loc_line_nr;
+			} else {
+				if ((lcmd->unum[0] < loc_base_major) || ((lcmd->unum[0] == loc_base_major) && (lcmd->unum[1] < loc_base_minor))) {
+					last_lcmd->ctrl_id |= LOC_NEEDS_UPDATE;
+					luprintf("the version of this translation is older than the base one and may result in some messages not being properly translated.\n"
+						"If you are the translator, please update your translation with the changes that intervened between v%d.%d and v%d.%d.\n"
+						"See https://github.com/pbatard/rufus/blob/master/res/loc/ChangeLog.txt",
+						lcmd->unum[0], lcmd->unum[1], loc_base_major, loc_base_minor);
+				}
+				version_line_nr = loc_line_nr;
+			}
+			free_loc_cmd(lcmd);
+			break;
+		}
+	} while (1);
+	if (last_lcmd != NULL) {
+		if (version_line_nr == 0) {
+			uprintf("localization: no compatible version was found - this locale will be ignored\n");
+			list_del(&last_lcmd->list);
+			free_loc_cmd(last_lcmd);
+		} else {
+			last_lcmd->num[1] = (int32_t)ftell(fd);
+		}
+	}
+	r = !list_empty(&locale_list);
+	if (r == FALSE)
+		uprintf("localization: '%s' contains no valid locale sections\n", filename);
+
+out:
+	if (fd != NULL)
+		fclose(fd);
+	return r;
+}
+
+/*
+ * Parse a locale section in a localization file (UTF-8, no BOM)
+ * NB: this call is reentrant for the "base" command support
+ */
+BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
+{
+	size_t bufsize = 1024;
+	static FILE* fd = NULL;
+	static BOOL populate_default = FALSE;
+	char *buf = NULL;
+	size_t i = 0;
+	int r = 0, line_nr_incr = 1;
+	int c = 0, eol_char = 0;
+	int start_line, old_loc_line_nr = 0;
+	BOOL ret = FALSE, eol = FALSE, escape_sequence = FALSE, reentrant = (fd != NULL);
+	long offset, cur_offset = -1, end_offset;
+	// The default locale is always the first one
+	loc_cmd* default_locale = list_entry(locale_list.next, loc_cmd, list);
+
+	if (loc_table != NULL)
+		return get_loc_data_table(lcmd);
+
+	if ((lcmd == NULL) || (default_locale == NULL)) {
+		uprintf("localization: no %slocale", (default_locale == NULL)?"default ":" ");
+		goto out;
+	}
+
+	if (msg_table == NULL) {
+		// Initialize the default message table (usually en-US)
+		msg_table = default_msg_table;
+		uprintf("localization: initializing default message table");
+		populate_default = TRUE;
+		get_loc_data_file(filename, default_locale);
+		populate_default = FALSE;
+	}
+
+	if (reentrant) {
+		// Called, from a 'b' command - no need to reopen the file,
+		// just save the current offset and current line number
+		cur_offset = ftell(fd);
+		old_loc_line_nr = loc_line_nr;
+	} else {
+		if ((filename == NULL) || (filename[0] == 0))
+			return FALSE;
+		if (!populate_default) {
+			if (lcmd == default_locale) {
+				// The default locale has already been populated => nothing to do
+				msg_table = default_msg_table;
+				return TRUE;
+			}
+			msg_table = current_msg_table;
+		}
+		free_dialog_list();
+		fd = open_loc_file(filename);
+		if (fd == NULL)
+			goto out;
+	}
+
+	offset = (long)lcmd->num[0];
+	end_offset = (long)lcmd->num[1];
+	start_line = lcmd->line_nr;
+	loc_line_nr = start_line;
+	buf = (char*) malloc(bufsize);
+	if (buf == NULL) {
+		uprintf("localization: could not allocate line buffer\n");
+		goto out;
+	}
+
+	if (fseek(fd, offset, SEEK_SET) != 0) {
+		uprintf("localization: could not rewind\n");
+		goto out;
+	}
+
+	do {	// custom readline handling for string collation, realloc, line numbers, etc.
+		c = getc(fd);
+		switch(c) {
+		case EOF:
+			buf[i] = 0;
+			if (!eol)
+				loc_line_nr += line_nr_incr;
+			// coverity[tainted_data]
+			get_loc_data_line(buf);
+			break;
+		case '\r':
+		case '\n':
+			if (escape_sequence) {
+				escape_sequence = FALSE;
+				break;
+			}
+			// This assumes that the EOL sequence is always the same throughout the file
+			if (eol_char == 0)
+				eol_char = c;
+			if (c == eol_char) {
+				if (eol) {
+					line_nr_incr++;
+				} else {
+					loc_line_nr += line_nr_incr;
+					line_nr_incr = 1;
+				}
+			}
+			buf[i] = 0;
+			if (!eol) {
+				// Strip trailing spaces (for string collation)
+				for (r = ((int)i)-1; (r>0) && ((buf[r]==space[0])||(buf[r]==space[1])); r--);
+				if (r < 0)
+					r = 0;
+				eol = TRUE;
+			}
+			break;
+		case ' ':
+		case '\t':
+			if (escape_sequence) {
+				escape_sequence = FALSE;
+				break;
+			}
+			if (!eol) {
+				buf[i++] = (char)c;
+			}
+			break;
+		case '\\':
+			if (!escape_sequence) {
+				escape_sequence = TRUE;
+				break;
+			}
+			// Escaped backslash
+			// fall through
+		default:
+			if (escape_sequence) {
+				switch (c) {
+				case 'n':	// \n -> CRLF
+					buf[i++] = '\r';
+					buf[i++] = '\n';
+					break;
+				case '"':	// \" carried as is
+					buf[i++] = '\\';
+					buf[i++] = '"';
+					break;
+				case '\\':
+					buf[i++] = '\\';
+					break;
+				default:	// ignore any other escape sequence
+					break;
+				}
+				escape_sequence = FALSE;
+			} else {
+				// Collate multiline strings
+				if ((eol) && (c == '"') && (buf[r] == '"')) {
+					i = r;
+					eol = FALSE;
+					break;
+				}
+				if (eol) {
+					get_loc_data_line(buf);
+					eol = FALSE;
+					i = 0;
+					r = 0;
+				}
+				buf[i++] = (char)c;
+			}
+			break;
+		}
+		if ((c == EOF) || (ftell(fd) > end_offset))
+			break;
+		// Have at least 2 chars extra, for \r\n sequences
+		if (i >= bufsize-2) {
+			bufsize *= 2;
+			if (bufsize > 32768) {
+				uprintf("localization: requested line buffer is larger than 32K!\n");
+				goto out;
+			}
+			buf = (char*) _reallocf(buf, bufsize);
+			if (buf == NULL) {
+				uprintf("localization: could not grow line buffer\n");
+				goto out;
+			}
+		}
+	} while(1);
+	ret = TRUE;
+
+out:
+	// Don't close on a reentrant call
+	if (reentrant) {
+		if ((cur_offset < 0) || (fseek(fd, cur_offset, SEEK_SET) != 0)) {
+			uprintf("localization: unable to reset reentrant position\n");
+			ret = FALSE;
+		}
+		loc_line_nr = old_loc_line_nr;
+	} else if (fd != NULL) {
+		fclose(fd);
+		fd = NULL;
+	}
+	safe_free(buf);
+	return ret;
+}
@@ -36,32 +36,6 @@
 #include "localization.h"
 #include "localization_data.h"
 
-/*
- * List of supported locale commands, with their parameter syntax:
- *   c control ID (no space, no quotes)
- *   s: quoted string
- *   i: 32 bit signed integer
- *   u: 32 bit unsigned CSV list
- * Remember to update the size of the array in localization.h when adding/removing elements
- */
-const loc_parse parse_cmd[7] = {
-	// Translation name and Windows LCIDs it should apply to
-	{ 'l', LC_LOCALE, "ssu" },	// l "en_US" "English (US)" 0x0009,0x1009
-	// Base translation to add on top of (eg. "English (UK)" can be used to build on top of "English (US)"
-	{ 'b', LC_BASE, "s" },		// b "en_US"
-	// Version to use for the localization commandset and API
-	{ 'v', LC_VERSION, "u" },	// v 1.0.2
-	// Translate the text control associated with an ID
-	{ 't', LC_TEXT, "cs" },		// t IDC_CONTROL "Translation"
-	// Set the section/dialog to which the next commands should apply
-	{ 'g', LC_GROUP, "c" },		// g IDD_DIALOG
-	// Set the font to use for the text controls that follow
-	// Use f "Default" 0 to reset the font
-	{ 'f', LC_FONT, "si" },		// f "MS Dialog" 10
-	// Set translations attributes such as right-to-left, numerals to use, etc
-	{ 'a', LC_ATTRIBUTES, "s" },	// a "ra"
-};
-
 /* Hash table for reused translation commands */
 static htab_table htab_loc = HTAB_EMPTY;
 
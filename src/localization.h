@@ -128,6 +128,44 @@ typedef struct loc_cmd_struct {
 	struct list_head list;
 } loc_cmd;
 
+/*
+ * Compiled localization table, generated from the embedded loc file by
+ * res/loc/loc_compile.py. It consists of a header, followed by the array
+ * of locales, the array of commands and the string pool. All offsets for
+ * strings and LCID arrays are relative to the start of the pool.
+ */
+#define LOC_TABLE_MAGIC         "RUFUSLCB"
+#define LOC_TABLE_VERSION       1
+#define LOC_TABLE_NO_STRING     0xFFFFFFFF
+
+typedef struct {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	nb_locales;
+	uint32_t	nb_cmds;
+	uint32_t	pool_size;
+} loc_table_header;
+
+typedef struct {
+	uint32_t	name;
+	uint32_t	desc;
+	uint32_t	lcids;
+	uint32_t	first_cmd;
+	uint32_t	nb_cmds;
+	uint16_t	nb_lcids;
+	uint16_t	line_nr;
+	uint16_t	version[2];
+	uint16_t	version_line_nr;	// 0 if the locale has no [v]ersion
+	uint16_t	attributes;
+} loc_table_locale;
+
+typedef struct {
+	uint8_t		command;
+	uint8_t		reserved;
+	uint16_t	line_nr;
+	uint32_t	txt[2];
+} loc_table_cmd;
+
 typedef struct loc_parse_struct {
 	char  c;
 	enum  loc_command_type cmd;
@@ -165,6 +203,7 @@ void free_dialog_list(void);
 char* lmprintf(uint32_t msg_id, ...);
 BOOL get_supported_locales(const char* filename);
 BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd);
+BOOL set_loc_table(const uint8_t* data, size_t size);
 void free_locale_list(void);
 loc_cmd* get_locale_from_lcid(int lcid, BOOL fallback);
 loc_cmd* get_locale_from_name(char* locale_name, BOOL fallback);
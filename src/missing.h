@@ -100,6 +100,55 @@ static __inline uint8_t popcnt64(register uint64_t u)
 	return (uint8_t)u;
 }
 
+/*
+ * Check if a buffer is all zeroes, 64 bytes at a time using SSE2 or NEON
+ * where available, so that we can quickly skip over the sparse regions
+ * of disk images. Any non-zero byte makes us exit early.
+ */
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2)) || defined(__SSE2__)
+#include <emmintrin.h>
+#define CPU_HAS_SSE2_ZERO_CHECK
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#include <arm_neon.h>
+#define CPU_HAS_NEON_ZERO_CHECK
+#endif
+static __inline BOOL is_zeroed(const void* buf, size_t len)
+{
+	const uint8_t* p = (const uint8_t*)buf;
+	size_t i = 0;
+
+#if defined(CPU_HAS_SSE2_ZERO_CHECK)
+	__m128i v;
+	for (; (i < len) && (((uintptr_t)&p[i]) & 15); i++)
+		if (p[i] != 0)
+			return FALSE;
+	for (; i + 64 <= len; i += 64) {
+		v = _mm_or_si128(_mm_or_si128(_mm_load_si128((const __m128i*)&p[i]), _mm_load_si128((const __m128i*)&p[i + 16])),
+			_mm_or_si128(_mm_load_si128((const __m128i*)&p[i + 32]), _mm_load_si128((const __m128i*)&p[i + 48])));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF)
+			return FALSE;
+	}
+#elif defined(CPU_HAS_NEON_ZERO_CHECK)
+	uint8x16_t v;
+	for (; i + 64 <= len; i += 64) {
+		v = vorrq_u8(vorrq_u8(vld1q_u8(&p[i]), vld1q_u8(&p[i + 16])), vorrq_u8(vld1q_u8(&p[i + 32]), vld1q_u8(&p[i + 48])));
+		if (vmaxvq_u8(v) != 0)
+			return FALSE;
+	}
+#else
+	for (; (i < len) && (((uintptr_t)&p[i]) & 7); i++)
+		if (p[i] != 0)
+			return FALSE;
+	for (; i + 8 <= len; i += 8)
+		if (*(const uint64_t*)&p[i] != 0)
+			return FALSE;
+#endif
+	for (; i < len; i++)
+		if (p[i] != 0)
+			return FALSE;
+	return TRUE;
+}
+
 static __inline void *_reallocf(void *ptr, size_t size) {
 	void *ret = realloc(ptr, size);
 	if (!ret)
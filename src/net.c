@@ -43,11 +43,22 @@
 #include "dbx/dbx_info.h"
 
 #include "settings.h"
+#include "download_state.h"
 
 /* Maximum download chunk size, in bytes */
 #define DOWNLOAD_BUFFER_SIZE    (10*KB)
+/* Parameters for the segmented downloads of large files */
+#define DOWNLOAD_SEGMENT_SIZE   (16*MB)
+#define DOWNLOAD_WRITE_SIZE     (256*KB)
+#define DOWNLOAD_CONNECTIONS    4
+#define DOWNLOAD_RETRIES        3
+#define DOWNLOAD_STATE_EXT      ".rufus_download"
+// Amount of data that must be available before a streamed image can be scanned
+#define STREAM_HEAD_SIZE        DOWNLOAD_SEGMENT_SIZE
 /* Default delay between update checks (1 day) */
 #define DEFAULT_UPDATE_INTERVAL (24*3600)
+/* How long we wait for the update check to exit when closing the application */
+#define UPDATE_CHECK_EXIT_TIMEOUT   5000
 
 DWORD DownloadStatus;
 BYTE* fido_script = NULL;
@@ -59,6 +70,8 @@ extern BOOL is_x86_64;
 extern USHORT NativeMachine;
 static DWORD error_code, fido_len = 0;
 static BOOL force_update_check = FALSE;
+static volatile BOOL update_check_abort = FALSE;
+static HINTERNET update_check_session = NULL;
 extern const char* efi_archname[ARCH_MAX];
 
 #if defined(__MINGW32__)
@@ -341,6 +354,576 @@ out:
 	return r ? size : 0;
 }
 
+typedef struct {
+	download_segments_t seg;
+	HINTERNET hSession;
+	URL_COMPONENTSA* parts;
+	HANDLE hFile, hState;
+	CRITICAL_SECTION lock;
+	HASH_CONTEXT hash;
+	uint8_t* buf;
+} segmented_download_t;
+
+/* Per thread data of a segmented download */
+typedef struct {
+	segmented_download_t* dl;
+	HINTERNET hConnection;
+	uint8_t* buf;
+} download_worker_t;
+
+/*
+ * State of the disk image that is being streamed, i.e. downloaded in the background
+ * while it is being written to a drive. Once 'detached' is set, the download no
+ * longer reports progress or reacts to ErrorStatus, as these then belong to the
+ * format operation.
+ */
+static struct {
+	char* url;
+	char path[MAX_PATH];
+	HANDLE hThread;
+	volatile BOOL detached, cancel;
+	BOOL discard;
+	download_stream_t ds;
+} stream = { 0 };
+
+static HINTERNET OpenDownloadRequest(HINTERNET hConnection, URL_COMPONENTSA* parts, const char* headers)
+{
+	const char* accept_types[] = { "*/*\0", NULL };
+	HINTERNET hRequest;
+
+	hRequest = HttpOpenRequestA(hConnection, "GET", parts->lpszUrlPath, NULL, NULL, accept_types,
+		INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTP | INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTPS |
+		INTERNET_FLAG_NO_COOKIES | INTERNET_FLAG_NO_UI | INTERNET_FLAG_NO_CACHE_WRITE | INTERNET_FLAG_HYPERLINK |
+		((parts->nScheme == INTERNET_SCHEME_HTTPS) ? INTERNET_FLAG_SECURE : 0), (DWORD_PTR)NULL);
+	if (hRequest == NULL)
+		return NULL;
+	if (!HttpSendRequestA(hRequest, headers, -1L, NULL, 0)) {
+		InternetCloseHandle(hRequest);
+		return NULL;
+	}
+	return hRequest;
+}
+
+// Download a single segment with a range request, and write it at its offset in the file
+static int DownloadSegment(void* param, download_job_t* job)
+{
+	download_worker_t* worker = (download_worker_t*)param;
+	segmented_download_t* dl = worker->dl;
+	BOOL r = FALSE;
+	char headers[128];
+	DWORD dwSize, dwStatus = 0, dwDownloaded, dwFill = 0, dwWritten;
+	OVERLAPPED overlapped = { 0 };
+	HINTERNET hRequest = NULL;
+	uint8_t* buf = worker->buf;
+	uint64_t written = 0;
+
+	// (Re)connect as needed, since a failed attempt may have been caused by a dropped connection
+	if (worker->hConnection == NULL)
+		worker->hConnection = InternetConnectA(dl->hSession, dl->parts->lpszHostName, dl->parts->nPort,
+			NULL, NULL, INTERNET_SERVICE_HTTP, 0, (DWORD_PTR)NULL);
+	if (worker->hConnection == NULL)
+		goto out;
+	static_sprintf(headers, "Accept-Encoding: identity\r\nRange: bytes=%llu-%llu",
+		job->offset, job->offset + job->size - 1);
+	hRequest = OpenDownloadRequest(worker->hConnection, dl->parts, headers);
+	if (hRequest == NULL)
+		goto out;
+	dwSize = sizeof(dwStatus);
+	HttpQueryInfoA(hRequest, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER, (LPVOID)&dwStatus, &dwSize, NULL);
+	if (dwStatus != 206) {
+		uprintf("Unexpected HTTP status %d for segment %d", dwStatus, job->segment);
+		goto out;
+	}
+
+	while (!DownloadSegmentsAborted(&dl->seg) && written < job->size) {
+		if (!InternetReadFile(hRequest, &buf[dwFill], DOWNLOAD_WRITE_SIZE - dwFill, &dwDownloaded) || dwDownloaded == 0)
+			break;
+		if (written + dwFill + dwDownloaded > job->size)
+			break;
+		dwFill += dwDownloaded;
+		DownloadSegmentsReport(job, dwDownloaded);
+		if (dwFill < DOWNLOAD_WRITE_SIZE && written + dwFill < job->size)
+			continue;
+		overlapped.Offset = (DWORD)(job->offset + written);
+		overlapped.OffsetHigh = (DWORD)((job->offset + written) >> 32);
+		if (!WriteFile(dl->hFile, buf, dwFill, &dwWritten, &overlapped) || dwWritten != dwFill) {
+			uprintf("Error writing segment %d: %s", job->segment, WindowsErrorString());
+			DownloadSegmentsAbort(&dl->seg);
+			goto out;
+		}
+		written += dwFill;
+		dwFill = 0;
+	}
+	r = (written == job->size);
+
+out:
+	if (hRequest != NULL)
+		InternetCloseHandle(hRequest);
+	if (!r) {
+		if (worker->hConnection != NULL)
+			InternetCloseHandle(worker->hConnection);
+		worker->hConnection = NULL;
+		if (!DownloadSegmentsAborted(&dl->seg))
+			uprintf("Retrying segment %d (%d/%d)", job->segment, job->attempt + 1, DOWNLOAD_RETRIES);
+	}
+	return r;
+}
+
+// Record a completed segment, for resume, once its data has reached the disk
+static void CommitSegment(void* param, uint32_t segment)
+{
+	segmented_download_t* dl = ((download_worker_t*)param)->dl;
+	const uint8_t done = 1;
+	DWORD dwWritten;
+	OVERLAPPED overlapped = { 0 };
+
+	if (dl->hState == INVALID_HANDLE_VALUE)
+		return;
+	if (!FlushFileBuffers(dl->hFile))
+		uprintf("Could not flush segment %d: %s", segment, WindowsErrorString());
+	EnterCriticalSection(&dl->lock);
+	overlapped.Offset = sizeof(download_state_t) + segment;
+	WriteFile(dl->hState, &done, 1, &dwWritten, &overlapped);
+	LeaveCriticalSection(&dl->lock);
+}
+
+static DWORD WINAPI DownloadSegmentThread(LPVOID param)
+{
+	download_worker_t worker = { (segmented_download_t*)param, NULL, NULL };
+
+	worker.buf = malloc(DOWNLOAD_WRITE_SIZE);
+	if (worker.buf != NULL)
+		DownloadSegmentsRun(&worker.dl->seg, &worker);
+	else
+		DownloadSegmentsAbort(&worker.dl->seg);
+	if (worker.hConnection != NULL)
+		InternetCloseHandle(worker.hConnection);
+	free(worker.buf);
+	return 0;
+}
+
+// Read back a completed segment from the file to hash it
+static int HashSegment(void* param, uint64_t offset, uint64_t size)
+{
+	segmented_download_t* dl = (segmented_download_t*)param;
+	DWORD dwSize, dwRead;
+	OVERLAPPED overlapped = { 0 };
+	uint64_t end;
+
+	for (end = offset + size; offset < end; offset += dwRead) {
+		dwSize = (DWORD)min(end - offset, DOWNLOAD_WRITE_SIZE);
+		overlapped.Offset = (DWORD)offset;
+		overlapped.OffsetHigh = (DWORD)(offset >> 32);
+		if (!ReadFile(dl->hFile, dl->buf, dwSize, &dwRead, &overlapped) || dwRead != dwSize)
+			return 0;
+		hash_write[HASH_SHA256](&dl->hash, dl->buf, dwRead);
+	}
+	return 1;
+}
+
+/*
+ * Download a large file using concurrent HTTP range requests, that write their
+ * segments directly into a preallocated file. Interrupted downloads are resumed
+ * from the segments that were completed, and the SHA-256 of the file is computed
+ * while the download progresses, by hashing the segments as soon as all the ones
+ * that precede them have been completed.
+ * If the server does not support range requests, this falls back to a regular
+ * download. If 'sha256' is not NULL, it receives the SHA-256 of the file.
+ * If 'bStream' is set, the size of the data that has been downloaded contiguously
+ * from the start of the file is published for the image writer.
+ */
+static uint64_t DownloadSegmented(const char* url, const char* file, HWND hProgressDialog, uint8_t* sha256, BOOL bStream)
+{
+	const char* short_name;
+	char hostname[64], urlpath[128], str[128], state_path[MAX_PATH], etag[128] = "", last_modified[64] = "";
+	char hash_str[2 * SHA256_HASHSIZE + 1];
+	BOOL r = FALSE, resume = FALSE;
+	DWORD i, dwSize, dwStatus = 0, nb_threads = 0;
+	HANDLE threads[DOWNLOAD_CONNECTIONS];
+	HINTERNET hSession = NULL, hConnection = NULL, hRequest = NULL;
+	URL_COMPONENTSA UrlParts = { sizeof(URL_COMPONENTSA), NULL, 1, (INTERNET_SCHEME)0,
+		hostname, sizeof(hostname), 0, NULL, 1, urlpath, sizeof(urlpath), NULL, 1 };
+	download_state_t state = { 0 };
+	segmented_download_t dl = { 0 };
+	LARGE_INTEGER li;
+	uint8_t* saved = NULL;
+	uint32_t saved_size;
+	uint64_t total_size = 0;
+
+	assert(url != NULL && file != NULL);
+	ErrorStatus = 0;
+	DownloadStatus = 404;
+	dl.hFile = INVALID_HANDLE_VALUE;
+	dl.hState = INVALID_HANDLE_VALUE;
+	short_name = PathFindFileNameU(file);
+	static_sprintf(state_path, "%s" DOWNLOAD_STATE_EXT, file);
+
+	if ((!InternetCrackUrlA(url, (DWORD)safe_strlen(url), 0, &UrlParts))
+		|| (UrlParts.lpszHostName == NULL) || (UrlParts.lpszUrlPath == NULL)) {
+		uprintf("Unable to decode URL: %s", WindowsErrorString());
+		goto out;
+	}
+	hostname[sizeof(hostname) - 1] = 0;
+	hSession = GetInternetSession(NULL, TRUE);
+	if (hSession == NULL) {
+		uprintf("Could not open Internet session: %s", WindowsErrorString());
+		goto out;
+	}
+	hConnection = InternetConnectA(hSession, UrlParts.lpszHostName, UrlParts.nPort, NULL, NULL, INTERNET_SERVICE_HTTP, 0, (DWORD_PTR)NULL);
+	if (hConnection == NULL) {
+		uprintf("Could not connect to server %s:%d: %s", UrlParts.lpszHostName, UrlParts.nPort, WindowsErrorString());
+		goto out;
+	}
+
+	// Find if the server supports range requests, as well as the file size, by requesting the first byte
+	hRequest = OpenDownloadRequest(hConnection, &UrlParts, "Accept-Encoding: identity\r\nRange: bytes=0-0");
+	if (hRequest != NULL) {
+		dwSize = sizeof(dwStatus);
+		HttpQueryInfoA(hRequest, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER, (LPVOID)&dwStatus, &dwSize, NULL);
+		dwSize = sizeof(str);
+		// Content-Range is "bytes 0-0/<total size>"
+		if (dwStatus == 206 && HttpQueryInfoA(hRequest, HTTP_QUERY_CONTENT_RANGE, (LPVOID)str, &dwSize, NULL) &&
+			!DownloadStateParseContentRange(str, &total_size))
+			total_size = 0;
+		// The validators that tell us whether the remote file changed, for resume
+		dwSize = sizeof(etag);
+		if (!HttpQueryInfoA(hRequest, HTTP_QUERY_ETAG, (LPVOID)etag, &dwSize, NULL))
+			etag[0] = 0;
+		dwSize = sizeof(last_modified);
+		if (!HttpQueryInfoA(hRequest, HTTP_QUERY_LAST_MODIFIED, (LPVOID)last_modified, &dwSize, NULL))
+			last_modified[0] = 0;
+		InternetCloseHandle(hRequest);
+		hRequest = NULL;
+	}
+	InternetCloseHandle(hConnection);
+	hConnection = NULL;
+	DownloadStateInit(&state, total_size, DOWNLOAD_SEGMENT_SIZE, etag, last_modified);
+
+	// Small files, or servers that don't support ranges, don't benefit from segmenting
+	if (state.total_size < 2 * DOWNLOAD_SEGMENT_SIZE) {
+		InternetCloseHandle(hSession);
+		total_size = DownloadToFileOrBufferEx(url, file, NULL, NULL, hProgressDialog, TRUE);
+		if (total_size != 0 && sha256 != NULL && !HashFile(HASH_SHA256, file, sha256))
+			memset(sha256, 0, SHA256_HASHSIZE);
+		return total_size;
+	}
+
+	if (hProgressDialog != NULL) {
+		UpdateProgressWithInfoInit(hProgressDialog, FALSE);
+		PrintInfo(5000, MSG_085, short_name);
+		uprintf("Downloading %s", url);
+		uprintf("File length: %s", SizeToHumanReadable(state.total_size, FALSE, FALSE));
+		if (right_to_left_mode)
+			static_sprintf(str, "(%s) %s", SizeToHumanReadable(state.total_size, FALSE, FALSE), GetShortName(url));
+		else
+			static_sprintf(str, "%s (%s)", GetShortName(url), SizeToHumanReadable(state.total_size, FALSE, FALSE));
+		PrintStatus(5000, MSG_085, str);
+	}
+
+	dl.hSession = hSession;
+	dl.parts = &UrlParts;
+	dl.buf = malloc(DOWNLOAD_WRITE_SIZE);
+	if (!DownloadSegmentsInit(&dl.seg, &state, DOWNLOAD_RETRIES, DownloadSegment, CommitSegment) || dl.buf == NULL)
+		goto out;
+
+	// Resume a previous download of the same file, if we can tell that the remote file is unchanged
+	saved_size = read_file(state_path, &saved);
+	if (DownloadSegmentsResume(&dl.seg, &state, saved, saved_size, _filesizeU(file))) {
+		resume = TRUE;
+		uprintf("Resuming download (%s already downloaded)",
+			SizeToHumanReadable(DownloadSegmentsDownloaded(&dl.seg), FALSE, FALSE));
+	} else if (saved_size != 0) {
+		uprintf("Restarting download, as the remote file may have changed");
+	}
+	safe_free(saved);
+
+	dl.hFile = CreateFileU(file, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		resume ? OPEN_EXISTING : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (dl.hFile == INVALID_HANDLE_VALUE) {
+		uprintf("Unable to create file '%s': %s", short_name, WindowsErrorString());
+		goto out;
+	}
+	li.QuadPart = (LONGLONG)dl.seg.total_size;
+	if (!resume && (!SetFilePointerEx(dl.hFile, li, NULL, FILE_BEGIN) || !SetEndOfFile(dl.hFile))) {
+		uprintf("Could not preallocate '%s': %s", short_name, WindowsErrorString());
+		goto out;
+	}
+	if (!DownloadStateHasValidator(&state)) {
+		uprintf("The server provides no ETag or Last-Modified: This download can not be resumed");
+		DeleteFileU(state_path);
+	} else if ((dl.hState = CreateFileU(state_path, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		resume ? OPEN_EXISTING : CREATE_ALWAYS, FILE_ATTRIBUTE_HIDDEN, NULL)) == INVALID_HANDLE_VALUE ||
+		(!resume && (!WriteFile(dl.hState, &state, sizeof(state), &dwSize, NULL) ||
+		!WriteFile(dl.hState, (LPCVOID)dl.seg.done, dl.seg.nb_segments, &dwSize, NULL)))) {
+		// We can still download, we just won't be able to resume
+		uprintf("Could not create download state file: %s", WindowsErrorString());
+		safe_closehandle(dl.hState);
+		dl.hState = INVALID_HANDLE_VALUE;
+	}
+
+	InitializeCriticalSection(&dl.lock);
+	for (nb_threads = 0; nb_threads < DOWNLOAD_CONNECTIONS; nb_threads++) {
+		threads[nb_threads] = CreateThread(NULL, 0, DownloadSegmentThread, &dl, 0, NULL);
+		if (threads[nb_threads] == NULL)
+			break;
+	}
+	if (nb_threads == 0) {
+		uprintf("Unable to start download threads");
+		DeleteCriticalSection(&dl.lock);
+		goto out;
+	}
+
+	hash_init[HASH_SHA256](&dl.hash);
+	do {
+		// User may have cancelled the download
+		if ((IS_ERROR(ErrorStatus) && !(bStream && stream.detached)) || (bStream && stream.cancel))
+			DownloadSegmentsAbort(&dl.seg);
+		// Closing the session also closes its connections, which aborts the reads that
+		// the download threads may be blocked on, so that they exit without delay.
+		if (DownloadSegmentsAborted(&dl.seg) && hSession != NULL) {
+			InternetCloseHandle(hSession);
+			hSession = NULL;
+		}
+		if (hProgressDialog != NULL && !(bStream && stream.detached))
+			UpdateProgressWithInfo(OP_NOOP, MSG_241, DownloadSegmentsDownloaded(&dl.seg), dl.seg.total_size);
+		DownloadSegmentsConsume(&dl.seg, HashSegment, &dl);
+		if (bStream)
+			DownloadStreamUpdate(&stream.ds, DownloadSegmentsAvailable(&dl.seg));
+	} while (WaitForMultipleObjects(nb_threads, threads, TRUE, 250) == WAIT_TIMEOUT);
+	for (i = 0; i < nb_threads; i++)
+		CloseHandle(threads[i]);
+	DeleteCriticalSection(&dl.lock);
+
+	if (DownloadSegmentsConsume(&dl.seg, HashSegment, &dl) != dl.seg.nb_segments) {
+		if (!IS_ERROR(ErrorStatus) && !(bStream && stream.detached)) {
+			uprintf("Could not download complete file - read: %lld bytes, expected: %lld bytes",
+				DownloadSegmentsDownloaded(&dl.seg), dl.seg.total_size);
+			ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+		}
+		if (dl.hState != INVALID_HANDLE_VALUE)
+			uprintf("The download of '%s' can be resumed", short_name);
+		goto out;
+	}
+
+	hash_final[HASH_SHA256](&dl.hash);
+	for (i = 0; i < SHA256_HASHSIZE; i++)
+		static_sprintf(&hash_str[2 * i], "%02x", dl.hash.buf[i]);
+	if (sha256 != NULL)
+		memcpy(sha256, dl.hash.buf, SHA256_HASHSIZE);
+	DownloadStatus = 200;
+	r = TRUE;
+	if (hProgressDialog != NULL) {
+		if (!(bStream && stream.detached))
+			UpdateProgressWithInfo(OP_NOOP, MSG_241, dl.seg.total_size, dl.seg.total_size);
+		uprintf("Successfully downloaded '%s'", short_name);
+	}
+	uprintf("SHA-256: %s", hash_str);
+
+out:
+	error_code = GetLastError();
+	if (dl.hFile != INVALID_HANDLE_VALUE) {
+		FlushFileBuffers(dl.hFile);
+		CloseHandle(dl.hFile);
+	}
+	safe_closehandle(dl.hState);
+	// Keep the partial file and its state, unless the download could not be started
+	if (r || dl.hFile == INVALID_HANDLE_VALUE)
+		DeleteFileU(state_path);
+	DownloadSegmentsFree(&dl.seg);
+	free(dl.buf);
+	if (hSession)
+		InternetCloseHandle(hSession);
+	SetLastError(error_code);
+	return r ? dl.seg.total_size : 0;
+}
+
+uint64_t DownloadToFileSegmented(const char* url, const char* file, HWND hProgressDialog, uint8_t* sha256)
+{
+	return DownloadSegmented(url, file, hProgressDialog, sha256, FALSE);
+}
+
+/*
+ * Get the SHA-256 that a server publishes alongside a file, as '<url>.sha256', using
+ * either the sha256sum ("<digest>  <name>") or the BSD ("SHA256 (<name>) = <digest>")
+ * format. Returns FALSE if there is no such file, or if it doesn't hold a digest.
+ */
+static BOOL GetPublishedSha256(const char* url, uint8_t* sha256)
+{
+	BOOL r = FALSE;
+	char *sum_url = NULL, *buf = NULL, digest[2 * SHA256_HASHSIZE + 1];
+	size_t i, size;
+
+	// URLs with a query, such as the signed ones from Microsoft, have no such file
+	if (url == NULL || sha256 == NULL || strchr(url, '?') != NULL)
+		return FALSE;
+	size = strlen(url) + 8;
+	sum_url = malloc(size);
+	if (sum_url == NULL)
+		goto out;
+	safe_sprintf(sum_url, size, "%s.sha256", url);
+	size = (size_t)DownloadToFileOrBuffer(sum_url, NULL, (BYTE**)&buf, NULL, FALSE);
+	r = DownloadStreamParseSha256(buf, size, sha256);
+	for (i = 0; r && i < SHA256_HASHSIZE; i++)
+		static_sprintf(&digest[2 * i], "%02x", sha256[i]);
+	uprintf("Published SHA-256 for '%s': %s", GetShortName(url), r ? digest : "None");
+
+out:
+	free(sum_url);
+	free(buf);
+	return r;
+}
+
+// Disk images that can be written while they are being downloaded, i.e. raw or bled compressed
+static BOOL IsStreamableImage(const char* url)
+{
+	const char* stream_ext[] = { ".img", ".raw", ".gz", ".bz2", ".xz", ".lzma", ".zst", ".Z" };
+	const char* ext = strrchr(url, '.');
+	int i;
+
+	if (ext == NULL || strchr(ext, '/') != NULL)
+		return FALSE;
+	for (i = 0; i < ARRAYSIZE(stream_ext); i++) {
+		// ".Z" is case sensitive, as ".z" is a different compression format
+		if ((i == ARRAYSIZE(stream_ext) - 1) ? (strcmp(ext, stream_ext[i]) == 0) : (_stricmp(ext, stream_ext[i]) == 0))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static DWORD WINAPI ImageStreamThread(LPVOID param)
+{
+	DownloadStreamEnd(&stream.ds, DownloadSegmented(stream.url, stream.path, hMainDialog, stream.ds.sha256, TRUE));
+	ExitThread(0);
+}
+
+/*
+ * Cancel the image stream, if any, and remove the downloaded image if it was not to be kept.
+ * On cancellation, the download closes its Internet session, so the stream thread exits
+ * promptly. We wait for it, so that it can close its files and release its locks.
+ */
+void StopImageStream(void)
+{
+	char state_path[MAX_PATH];
+
+	if (stream.hThread != NULL) {
+		stream.cancel = TRUE;
+		WaitForSingleObject(stream.hThread, INFINITE);
+		CloseHandle(stream.hThread);
+		stream.hThread = NULL;
+	}
+	if (stream.discard && stream.path[0] != 0) {
+		static_sprintf(state_path, "%s" DOWNLOAD_STATE_EXT, stream.path);
+		DeleteFileU(stream.path);
+		DeleteFileU(state_path);
+	}
+	safe_free(stream.url);
+	stream.path[0] = 0;
+	stream.ds.state = STREAM_NONE;
+}
+
+/*
+ * Start downloading a disk image in the background, so that it can be written while
+ * the download progresses. This returns once enough of the image is available for it
+ * to be scanned. If 'discard' is set, the image is deleted when the stream is stopped.
+ */
+BOOL StreamImage(const char* url, const char* path, BOOL discard)
+{
+	StopImageStream();
+	stream.url = safe_strdup(url);
+	static_strcpy(stream.path, path);
+	stream.discard = discard;
+	stream.detached = FALSE;
+	stream.cancel = FALSE;
+	// Look for a published checksum first, as the download thread must not alter ErrorStatus
+	stream.ds.has_published_sha256 = GetPublishedSha256(url, stream.ds.published_sha256);
+	ErrorStatus = 0;
+	DownloadStreamStart(&stream.ds);
+	stream.hThread = CreateThread(NULL, 0, ImageStreamThread, NULL, 0, NULL);
+	if (stream.url == NULL || stream.hThread == NULL) {
+		uprintf("Unable to start image stream thread");
+		ErrorStatus = RUFUS_ERROR(APPERR(ERROR_CANT_START_THREAD));
+		DownloadStreamEnd(&stream.ds, 0);
+		return FALSE;
+	}
+	if (!WaitForImageData(STREAM_HEAD_SIZE))
+		return FALSE;
+	stream.detached = TRUE;
+	if (DownloadStreamState(&stream.ds) == STREAM_ACTIVE)
+		uprintf("Image '%s' will be streamed while it is being downloaded", PathFindFileNameU(path));
+	return TRUE;
+}
+
+BOOL IsImageStreaming(const char* path)
+{
+	return (path != NULL) && (stream.ds.state == STREAM_ACTIVE || stream.ds.state == STREAM_COMPLETE) &&
+		(_stricmp(path, stream.path) == 0);
+}
+
+static int IsStreamWaitCancelled(void)
+{
+	return IS_ERROR(ErrorStatus);
+}
+
+// Wait until the first 'size' bytes of the streamed image have been downloaded
+BOOL WaitForImageData(uint64_t size)
+{
+	return DownloadStreamWait(&stream.ds, size, IsStreamWaitCancelled);
+}
+
+/*
+ * Once the streamed image has been written, wait for its download to complete and
+ * check the data read by the writer, whose first 'size' bytes were hashed in 'ctx'.
+ * If the server published a SHA-256 for the image, this is what the data is verified
+ * against. Otherwise, the image can't be verified, and all we can check is that the
+ * writer read the same data as the download wrote, i.e. that it didn't read segments
+ * before they were complete.
+ */
+BOOL VerifyStreamedImage(HASH_CONTEXT* ctx, uint64_t size)
+{
+	BOOL r = FALSE;
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	LARGE_INTEGER li;
+	DWORD dwRead;
+	uint8_t* buf = NULL;
+
+	if (!WaitForImageData(UINT64_MAX) || DownloadStreamState(&stream.ds) != STREAM_COMPLETE) {
+		uprintf("The download of the streamed image did not complete");
+		goto out;
+	}
+	// The writer may not have consumed the whole image (e.g. trailing data after a compressed stream)
+	if (size < stream.ds.total_size) {
+		buf = malloc(DOWNLOAD_WRITE_SIZE);
+		hFile = CreateFileU(stream.path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		li.QuadPart = (LONGLONG)size;
+		if (buf == NULL || hFile == INVALID_HANDLE_VALUE || !SetFilePointerEx(hFile, li, NULL, FILE_BEGIN)) {
+			uprintf("Could not read streamed image: %s", WindowsErrorString());
+			goto out;
+		}
+		while (size < stream.ds.total_size) {
+			if (!ReadFile(hFile, buf, DOWNLOAD_WRITE_SIZE, &dwRead, NULL) || dwRead == 0) {
+				uprintf("Could not read streamed image: %s", WindowsErrorString());
+				goto out;
+			}
+			hash_write[HASH_SHA256](ctx, buf, dwRead);
+			size += dwRead;
+		}
+	}
+	hash_final[HASH_SHA256](ctx);
+	r = DownloadStreamVerify(&stream.ds, size, ctx->buf);
+	if (stream.ds.has_published_sha256) {
+		uprintf("Streamed image verification against published SHA-256: %s", r ? "OK ✓" : "MISMATCH ✗");
+	} else {
+		uprintf("No published SHA-256 for the streamed image - it could not be verified");
+		uprintf("Streamed data consistency with the download: %s", r ? "OK ✓" : "MISMATCH ✗");
+	}
+
+out:
+	safe_closehandle(hFile);
+	free(buf);
+	return r;
+}
+
 // Download and validate a signed file. The file must have a corresponding '.sig' on the server.
 DWORD DownloadSignedFile(const char* url, const char* file, HWND hProgressDialog, BOOL bPromptOnError)
 {
@@ -545,9 +1128,11 @@ static DWORD WINAPI CheckForUpdatesThread(LPVOID param)
 		// It would of course be a lot nicer to use a timer and wake the thread, but my
 		// development time is limited and this is FASTER to implement.
 		do {
-			for (i = 0; ( i < 30) && (!force_update_check); i++)
+			for (i = 0; ( i < 30) && (!force_update_check) && (!update_check_abort); i++)
 				Sleep(500);
-		} while ((!force_update_check) && ((op_in_progress || (dialog_showing > 0))));
+		} while ((!force_update_check) && (!update_check_abort) && ((op_in_progress || (dialog_showing > 0))));
+		if (update_check_abort)
+			goto out;
 		if (!force_update_check) {
 			if ((ReadSetting32(SETTING_UPDATE_INTERVAL) == -1)) {
 				vuprintf("Check for updates disabled, as per settings.");
@@ -588,6 +1173,10 @@ static DWORD WINAPI CheckForUpdatesThread(LPVOID param)
 	hSession = GetInternetSession(NULL, FALSE);
 	if (hSession == NULL)
 		goto out;
+	// Let StopUpdateCheck() close the session, to abort any request we are blocked on
+	InterlockedExchangePointer(&update_check_session, hSession);
+	if (update_check_abort)
+		goto out;
 	hConnection = InternetConnectA(hSession, UrlParts.lpszHostName, UrlParts.nPort,
 		NULL, NULL, INTERNET_SERVICE_HTTP, 0, (DWORD_PTR)NULL);
 	if (hConnection == NULL)
@@ -605,7 +1194,7 @@ static DWORD WINAPI CheckForUpdatesThread(LPVOID param)
 	max_channel = releases_only ? 1 : (int)ARRAYSIZE(channel) - 1;
 #endif
 	vuprintf("Using %s for the update check", RUFUS_URL);
-	for (k = 0; (k < max_channel) && (!found_new_version); k++) {
+	for (k = 0; (k < max_channel) && (!found_new_version) && (!update_check_abort); k++) {
 		// Get the arch name and convert it lowercase
 		char* archname = strdup(GetArchName(WindowsVersion.Arch));
 		safe_strtolower(archname);
@@ -727,7 +1316,8 @@ out:
 		InternetCloseHandle(hRequest);
 	if (hConnection)
 		InternetCloseHandle(hConnection);
-	if (hSession)
+	// The session may already have been closed by StopUpdateCheck()
+	if (InterlockedExchangePointer(&update_check_session, NULL) != NULL)
 		InternetCloseHandle(hSession);
 	switch (status) {
 	case 1:
@@ -745,10 +1335,10 @@ out:
 	// Start the new download after cleanup
 	if (found_new_version) {
 		// User may have started an operation while we were checking
-		while ((!force_update_check) && (op_in_progress || (dialog_showing > 0))) {
-			Sleep(15000);
-		}
-		DownloadNewVersion();
+		while ((!force_update_check) && (!update_check_abort) && (op_in_progress || (dialog_showing > 0)))
+			Sleep(500);
+		if (!update_check_abort)
+			DownloadNewVersion();
 	} else if (force_update_check) {
 		PostMessage(hMainDialog, UM_NO_UPDATE, 0, 0);
 	}
@@ -758,6 +1348,27 @@ out:
 	ExitThread(0);
 }
 
+/*
+ * Have the update check thread exit, rather than terminate it, as it may be holding locks,
+ * such as the settings store one, that we still need on exit. Closing its Internet session
+ * aborts the request it may be blocked on. If it doesn't exit in time, it is left to end
+ * with the process, which is safe as it then keeps running until it releases its locks.
+ */
+void StopUpdateCheck(void)
+{
+	HANDLE hThread = update_check_thread;
+	HINTERNET hSession;
+
+	if (hThread == NULL)
+		return;
+	update_check_abort = TRUE;
+	hSession = InterlockedExchangePointer(&update_check_session, NULL);
+	if (hSession != NULL)
+		InternetCloseHandle(hSession);
+	if (WaitForSingleObject(hThread, UPDATE_CHECK_EXIT_TIMEOUT) != WAIT_OBJECT_0)
+		uprintf("Update check did not exit in time");
+}
+
 /*
  * Initiate a check for updates. If force is true, ignore the wait period
  */
@@ -924,18 +1535,33 @@ static DWORD WINAPI DownloadISOThread(LPVOID param)
 			dwSize = (DWORD)strlen(FORCE_URL);
 #endif
 			IMG_SAVE img_save = { 0 };
+			BOOL stream_image, discard_image, has_published_sha256 = FALSE;
+			uint8_t sha256[SHA256_HASHSIZE], published_sha256[SHA256_HASHSIZE];
 			url[min(dwSize, dwAvail)] = 0;
 			EXT_DECL(img_ext, GetShortName(url), __VA_GROUP__("*.iso"), __VA_GROUP__(lmprintf(MSG_036)));
 			img_save.Type = VIRTUAL_STORAGE_TYPE_DEVICE_ISO;
-			img_save.ImagePath = FileDialog(TRUE, NULL, &img_ext, NULL);
+			// Disk images can be written to the drive while they are being downloaded
+			stream_image = IsStreamableImage(url) && !ReadSettingBool(SETTING_DISABLE_IMAGE_STREAMING);
+			discard_image = stream_image && ReadSettingBool(SETTING_DISCARD_STREAMED_IMAGE);
+			if (discard_image) {
+				img_save.ImagePath = malloc(MAX_PATH);
+				if (img_save.ImagePath != NULL)
+					safe_sprintf(img_save.ImagePath, MAX_PATH, "%s%s", temp_dir, GetShortName(url));
+			} else {
+				img_save.ImagePath = FileDialog(TRUE, NULL, &img_ext, NULL);
+			}
 			if (img_save.ImagePath == NULL) {
 				goto out;
 			}
+			// Streamed images look for a published checksum on their own
+			if (!stream_image)
+				has_published_sha256 = GetPublishedSha256(url, published_sha256);
 			// Download the ISO and report errors if any
 			SendMessage(hMainDialog, UM_PROGRESS_INIT, 0, 0);
 			ErrorStatus = 0;
 			SendMessage(hMainDialog, UM_TIMER_START, 0, 0);
-			if (DownloadToFileOrBuffer(url, img_save.ImagePath, NULL, hMainDialog, TRUE) == 0) {
+			if (stream_image ? !StreamImage(url, img_save.ImagePath, discard_image) :
+				(DownloadToFileSegmented(url, img_save.ImagePath, hMainDialog, sha256) == 0)) {
 				SendMessage(hMainDialog, UM_PROGRESS_EXIT, 0, 0);
 				if (SCODE_CODE(ErrorStatus) == ERROR_CANCELLED) {
 					uprintf("Download cancelled by user");
@@ -945,7 +1571,16 @@ static DWORD WINAPI DownloadISOThread(LPVOID param)
 					Notification(MB_ICONERROR | MB_CLOSE, lmprintf(MSG_194, GetShortName(url)), lmprintf(MSG_043, WindowsErrorString()));
 					PrintInfo(0, MSG_212);
 				}
+			} else if (has_published_sha256 && memcmp(sha256, published_sha256, SHA256_HASHSIZE) != 0) {
+				uprintf("Download verification against published SHA-256: MISMATCH ✗");
+				DeleteFileU(img_save.ImagePath);
+				SendMessage(hMainDialog, UM_PROGRESS_EXIT, 0, 0);
+				SetLastError(RUFUS_ERROR(ERROR_FILE_CORRUPT));
+				Notification(MB_ICONERROR | MB_CLOSE, lmprintf(MSG_194, GetShortName(url)), lmprintf(MSG_043, WindowsErrorString()));
+				PrintInfo(0, MSG_212);
 			} else {
+				if (has_published_sha256)
+					uprintf("Download verification against published SHA-256: OK ✓");
 				// Download was successful => Select and scan the ISO
 				image_path = safe_strdup(img_save.ImagePath);
 				PostMessage(hMainDialog, UM_SELECT_ISO, 0, 0);
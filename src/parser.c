@@ -38,533 +38,9 @@
 #include "msapi_utf8.h"
 #include "localization.h"
 
-static const char space[] = " \t";
 static const wchar_t wspace[] = L" \t";
 static const char* conversion_error = "Could not convert '%s' to UTF-16";
 
-const struct {char c; int flag;} attr_parse[] = {
-	{ 'r', LOC_RIGHT_TO_LEFT },
-};
-
-/*
- * Fill a localization command buffer by parsing the line arguments
- * The command is allocated and must be freed (by calling free_loc_cmd)
- */
-static loc_cmd* get_loc_cmd(char c, char* line) {
-	size_t i, j, k, l, r, ti = 0, ii = 0;
-	char *endptr, *expected_endptr, *token;
-	loc_cmd* lcmd = NULL;
-
-	for (j = 0; j<ARRAYSIZE(parse_cmd); j++) {
-		if (c == parse_cmd[j].c)
-			break;
-	}
-	if (j >= ARRAYSIZE(parse_cmd)) {
-		luprint("unknown command");
-		return NULL;
-	}
-
-	lcmd = (loc_cmd*)calloc(sizeof(loc_cmd), 1);
-	if (lcmd == NULL) {
-		luprint("could not allocate command");
-		return NULL;
-	}
-	lcmd->command = parse_cmd[j].cmd;
-	lcmd->ctrl_id = (lcmd->command <= LC_TEXT)?-1:0;
-	lcmd->line_nr = (uint16_t)loc_line_nr;
-
-	i = 0;
-	for (k = 0; parse_cmd[j].arg_type[k] != 0; k++) {
-		// Skip leading spaces
-		i += strspn(&line[i], space);
-		r = i;
-		if (line[i] == 0) {
-			luprintf("missing parameter for command '%c'", parse_cmd[j].c);
-			goto err;
-		}
-		switch(parse_cmd[j].arg_type[k]) {
-		case 's':	// quoted string
-			// search leading quote
-			if (line[i++] != '"') {
-				luprint("no start quote");
-				goto err;
-			}
-			r = i;
-			// locate ending quote
-			while ((line[i] != 0) && ((line[i] != '"') || ((line[i] == '"') && (line[i-1] == '\\')))) {
-				if ((line[i] == '"') && (line[i-1] == '\\')) {
-					memmove(&line[i-1], &line[i], strlen(&line[i]) + 1);
-				} else {
-					i++;
-				}
-			}
-			if (line[i] == 0) {
-				luprint("no end quote");
-				goto err;
-			}
-			line[i++] = 0;
-			lcmd->txt[ti++] = safe_strdup(&line[r]);
-			break;
-		case 'c':	// control ID (single word)
-			while ((line[i] != 0) && (line[i] != space[0]) && (line[i] != space[1]))
-				i++;
-			if (line[i] != 0)
-				line[i++] = 0;
-			lcmd->txt[ti++] = safe_strdup(&line[r]);
-			break;
-		case 'i':	// 32 bit signed integer
-			// allow commas or dots between values
-			if ((line[i] == ',') || (line[i] == '.')) {
-				i += strspn(&line[i+1], space);
-				r = i;
-			}
-			while ((line[i] != 0) && (line[i] != space[0]) && (line[i] != space[1])
-				&& (line[i] != ',') && (line[i] != '.'))
-				i++;
-			expected_endptr = &line[i];
-			if (line[i] != 0)
-				line[i++] = 0;
-			lcmd->num[ii++] = (int32_t)strtol(&line[r], &endptr, 0);
-			if (endptr != expected_endptr) {
-				luprint("invalid integer");
-				goto err;
-			}
-			break;
-		case 'u':	// comma or dot separated list of unsigned integers (to end of line)
-			// count the number of commas
-			lcmd->unum_size = 1;
-			for (l = i; line[l] != 0; l++) {
-				if ((line[l] == '.') || (line[l] == ','))
-					lcmd->unum_size++;
-			}
-			free(lcmd->unum);
-			lcmd->unum = (uint32_t*)malloc(lcmd->unum_size * sizeof(uint32_t));
-			if (lcmd->unum == NULL) {
-				luprint("could not allocate memory");
-				goto err;
-			}
-			token = strtok(&line[i], ".,");
-			for (l=0; (l<lcmd->unum_size) && (token != NULL); l++) {
-				lcmd->unum[l] = (int32_t)strtol(token, &endptr, 0);
-				token = strtok(NULL, ".,");
-			}
-			if ((token != NULL) || (l != lcmd->unum_size)) {
-				luprint("internal error (unexpected number of numeric values)");
-				goto err;
-			}
-			break;
-		default:
-			uprintf("localization: unhandled arg_type '%c'\n", parse_cmd[j].arg_type[k]);
-			goto err;
-		}
-	}
-
-	return lcmd;
-
-err:
-	free_loc_cmd(lcmd);
-	return NULL;
-}
-
-/*
- * Parse an UTF-8 localization command line
- */
-static void get_loc_data_line(char* line)
-{
-	size_t i;
-	loc_cmd* lcmd = NULL;
-	char t;
-
-	if ((line == NULL) || (line[0] == 0))
-		return;
-
-	// Skip leading spaces
-	i = strspn(line, space);
-
-	// Read token (NUL character will be read if EOL)
-	t = line[i++];
-	if (t == '#')	// Comment
-		return;
-	if ((t == 0) || ((line[i] != space[0]) && (line[i] != space[1]))) {
-		luprintf("syntax error: '%s'", line);
-		return;
-	}
-
-	lcmd = get_loc_cmd(t, &line[i]);
-
-	if ((lcmd != NULL) && (lcmd->command != LC_LOCALE))
-		// TODO: check return value?
-		dispatch_loc_cmd(lcmd);
-	else
-		free_loc_cmd(lcmd);
-}
-
-/*
- * Open a localization file and store its file name, with special case
- * when dealing with the embedded loc file.
- */
-FILE* open_loc_file(const char* filename)
-{
-	FILE* fd = NULL;
-	wchar_t *wfilename = NULL;
-	const char* tmp_ext = ".tmp";
-
-	if (filename == NULL)
-		return NULL;
-
-	if (loc_filename != embedded_loc_filename) {
-		safe_free(loc_filename);
-	}
-	if (safe_strcmp(tmp_ext, &filename[safe_strlen(filename)-4]) == 0) {
-		loc_filename = embedded_loc_filename;
-	} else {
-		loc_filename = safe_strdup(filename);
-	}
-	wfilename = utf8_to_wchar(filename);
-	if (wfilename == NULL) {
-		uprintf(conversion_error, filename);
-		goto out;
-	}
-	fd = _wfopen(wfilename, L"rb");
-	if (fd == NULL) {
-		uprintf("localization: could not open '%s'\n", filename);
-	}
-
-out:
-	safe_free(wfilename);
-	return fd;
-}
-
-/*
- * Parse a localization file, to construct the list of available locales.
- * The locale file must be UTF-8 with NO BOM.
- */
-BOOL get_supported_locales(const char* filename)
-{
-	FILE* fd = NULL;
-	BOOL r = FALSE;
-	char line[1024];
-	size_t i, j, k;
-	loc_cmd *lcmd = NULL, *last_lcmd = NULL;
-	long end_of_block;
-	int version_line_nr = 0;
-	uint32_t loc_base_major = -1, loc_base_minor = -1;
-
-	fd = open_loc_file(filename);
-	if (fd == NULL)
-		goto out;
-
-	// Check that the file doesn't contain a BOM and was saved in DOS mode
-	i = fread(line, 1, sizeof(line), fd);
-	if (i < sizeof(line)) {
-		uprintf("Invalid loc file: the file is too small!");
-		goto out;
-	}
-	if (((uint8_t)line[0]) > 0x80) {
-		uprintf("Invalid loc file: the file should not have a BOM (Byte Order Mark)");
-		goto out;
-	}
-	for (i=0; i<sizeof(line)-1; i++)
-		if ((((uint8_t)line[i]) == 0x0D) && (((uint8_t)line[i+1]) == 0x0A)) break;
-	if (i >= sizeof(line)-1) {
-		uprintf("Invalid loc file: the file MUST be saved in DOS mode (CR/LF)");
-		goto out;
-	}
-	fseek(fd, 0, SEEK_SET);
-
-	loc_line_nr = 0;
-	line[0] = 0;
-	free_locale_list();
-	do {
-		// adjust the last block
-		end_of_block = ftell(fd);
-		if (fgets(line, sizeof(line), fd) == NULL)
-			break;
-		loc_line_nr++;
-		// Skip leading spaces
-		i = strspn(line, space);
-		if ((line[i] != 'l') && (line[i] != 'v') && (line[i] != 'a'))
-			continue;
-		// line[i] is not NUL so i+1 is safe to access
-		// coverity[tainted_data]
-		lcmd = get_loc_cmd(line[i], &line[i+1]);
-		if ((lcmd == NULL) || ((lcmd->command != LC_LOCALE) && (lcmd->command != LC_VERSION) && (lcmd->command != LC_ATTRIBUTES))) {
-			free_loc_cmd(lcmd);
-			continue;
-		}
-		switch (lcmd->command) {
-		case LC_LOCALE:
-			// we use num[0] and num[1] as block delimiter index for this locale in the file
-			if (last_lcmd != NULL) {
-				if (version_line_nr == 0) {
-					uprintf("localization: no compatible version was found - this locale will be ignored\n");
-					list_del(&last_lcmd->list);
-					free_loc_cmd(last_lcmd);
-				} else {
-					last_lcmd->num[1] = (int32_t)end_of_block;
-				}
-			}
-			lcmd->num[0] = (int32_t)ftell(fd);
-			// Add our locale command to the locale list
-			list_add_tail(&lcmd->list, &locale_list);
-			uprintf("localization: found locale '%s'\n", lcmd->txt[0]);
-			last_lcmd = lcmd;
-			version_line_nr = 0;
-			break;
-		case LC_ATTRIBUTES:
-			if (last_lcmd == NULL) {
-				luprint("[a]ttributes cannot precede [l]ocale");
-			} else for(j=0; lcmd->txt[0][j] != 0; j++) {
-				for (k=0; k<ARRAYSIZE(attr_parse); k++) {
-					if (attr_parse[k].c == lcmd->txt[0][j]) {
-						// Repurpose ctrl_id as an attributes mask
-						last_lcmd->ctrl_id |= attr_parse[k].flag;
-						break;
-					}
-				}
-				if (k >= ARRAYSIZE(attr_parse))
-					luprintf("unknown attribute '%c' - ignored", lcmd->txt[0][j]);
-			}
-			free_loc_cmd(lcmd);
-			break;
-		case LC_VERSION:
-			if (version_line_nr != 0) {
-				luprintf("[v]ersion was already provided at line %d", version_line_nr);
-			} else if (lcmd->unum_size != 2) {
-				luprint("[v]ersion format is invalid");
-			} else if (last_lcmd == NULL) {
-				luprint("[v]ersion cannot precede [l]ocale");
-			} else if (loc_base_major == -1) {
-				// We use the first version from our loc file (usually en-US) as our base
-				// as it should always be the most up to date.
-				loc_base_major = lcmd->unum[0];
-				loc_base_minor = lcmd->unum[1];
-				version_line_nr = loc_line_nr;
-			} else {
-				if ((lcmd->unum[0] < loc_base_major) || ((lcmd->unum[0] == loc_base_major) && (lcmd->unum[1] < loc_base_minor))) {
-					last_lcmd->ctrl_id |= LOC_NEEDS_UPDATE;
-					luprintf("the version of this translation is older than the base one and may result in some messages not being properly translated.\n"
-						"If you are the translator, please update your translation with the changes that intervened between v%d.%d and v%d.%d.\n"
-						"See https://github.com/pbatard/rufus/blob/master/res/loc/ChangeLog.txt",
-						lcmd->unum[0], lcmd->unum[1], loc_base_major, loc_base_minor);
-				}
-				version_line_nr = loc_line_nr;
-			}
-			free_loc_cmd(lcmd);
-			break;
-		}
-	} while (1);
-	if (last_lcmd != NULL) {
-		if (version_line_nr == 0) {
-			uprintf("localization: no compatible version was found - this locale will be ignored\n");
-			list_del(&last_lcmd->list);
-			free_loc_cmd(last_lcmd);
-		} else {
-			last_lcmd->num[1] = (int32_t)ftell(fd);
-		}
-	}
-	r = !list_empty(&locale_list);
-	if (r == FALSE)
-		uprintf("localization: '%s' contains no valid locale sections\n", filename);
-
-out:
-	if (fd != NULL)
-		fclose(fd);
-	return r;
-}
-
-/*
- * Parse a locale section in a localization file (UTF-8, no BOM)
- * NB: this call is reentrant for the "base" command support
- */
-BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
-{
-	size_t bufsize = 1024;
-	static FILE* fd = NULL;
-	static BOOL populate_default = FALSE;
-	char *buf = NULL;
-	size_t i = 0;
-	int r = 0, line_nr_incr = 1;
-	int c = 0, eol_char = 0;
-	int start_line, old_loc_line_nr = 0;
-	BOOL ret = FALSE, eol = FALSE, escape_sequence = FALSE, reentrant = (fd != NULL);
-	long offset, cur_offset = -1, end_offset;
-	// The default locale is always the first one
-	loc_cmd* default_locale = list_entry(locale_list.next, loc_cmd, list);
-
-	if ((lcmd == NULL) || (default_locale == NULL)) {
-		uprintf("localization: no %slocale", (default_locale == NULL)?"default ":" ");
-		goto out;
-	}
-
-	if (msg_table == NULL) {
-		// Initialize the default message table (usually en-US)
-		msg_table = default_msg_table;
-		uprintf("localization: initializing default message table");
-		populate_default = TRUE;
-		get_loc_data_file(filename, default_locale);
-		populate_default = FALSE;
-	}
-
-	if (reentrant) {
-		// Called, from a 'b' command - no need to reopen the file,
-		// just save the current offset and current line number
-		cur_offset = ftell(fd);
-		old_loc_line_nr = loc_line_nr;
-	} else {
-		if ((filename == NULL) || (filename[0] == 0))
-			return FALSE;
-		if (!populate_default) {
-			if (lcmd == default_locale) {
-				// The default locale has already been populated => nothing to do
-				msg_table = default_msg_table;
-				return TRUE;
-			}
-			msg_table = current_msg_table;
-		}
-		free_dialog_list();
-		fd = open_loc_file(filename);
-		if (fd == NULL)
-			goto out;
-	}
-
-	offset = (long)lcmd->num[0];
-	end_offset = (long)lcmd->num[1];
-	start_line = lcmd->line_nr;
-	loc_line_nr = start_line;
-	buf = (char*) malloc(bufsize);
-	if (buf == NULL) {
-		uprintf("localization: could not allocate line buffer\n");
-		goto out;
-	}
-
-	if (fseek(fd, offset, SEEK_SET) != 0) {
-		uprintf("localization: could not rewind\n");
-		goto out;
-	}
-
-	do {	// custom readline handling for string collation, realloc, line numbers, etc.
-		c = getc(fd);
-		switch(c) {
-		case EOF:
-			buf[i] = 0;
-			if (!eol)
-				loc_line_nr += line_nr_incr;
-			// coverity[tainted_data]
-			get_loc_data_line(buf);
-			break;
-		case '\r':
-		case '\n':
-			if (escape_sequence) {
-				escape_sequence = FALSE;
-				break;
-			}
-			// This assumes that the EOL sequence is always the same throughout the file
-			if (eol_char == 0)
-				eol_char = c;
-			if (c == eol_char) {
-				if (eol) {
-					line_nr_incr++;
-				} else {
-					loc_line_nr += line_nr_incr;
-					line_nr_incr = 1;
-				}
-			}
-			buf[i] = 0;
-			if (!eol) {
-				// Strip trailing spaces (for string collation)
-				for (r = ((int)i)-1; (r>0) && ((buf[r]==space[0])||(buf[r]==space[1])); r--);
-				if (r < 0)
-					r = 0;
-				eol = TRUE;
-			}
-			break;
-		case ' ':
-		case '\t':
-			if (escape_sequence) {
-				escape_sequence = FALSE;
-				break;
-			}
-			if (!eol) {
-				buf[i++] = (char)c;
-			}
-			break;
-		case '\\':
-			if (!escape_sequence) {
-				escape_sequence = TRUE;
-				break;
-			}
-			// fall through on escape sequence
-		default:
-			if (escape_sequence) {
-				switch (c) {
-				case 'n':	// \n -> CRLF
-					buf[i++] = '\r';
-					buf[i++] = '\n';
-					break;
-				case '"':	// \" carried as is
-					buf[i++] = '\\';
-					buf[i++] = '"';
-					break;
-				case '\\':
-					buf[i++] = '\\';
-					break;
-				default:	// ignore any other escape sequence
-					break;
-				}
-				escape_sequence = FALSE;
-			} else {
-				// Collate multiline strings
-				if ((eol) && (c == '"') && (buf[r] == '"')) {
-					i = r;
-					eol = FALSE;
-					break;
-				}
-				if (eol) {
-					get_loc_data_line(buf);
-					eol = FALSE;
-					i = 0;
-					r = 0;
-				}
-				buf[i++] = (char)c;
-			}
-			break;
-		}
-		if ((c == EOF) || (ftell(fd) > end_offset))
-			break;
-		// Have at least 2 chars extra, for \r\n sequences
-		if (i >= bufsize-2) {
-			bufsize *= 2;
-			if (bufsize > 32768) {
-				uprintf("localization: requested line buffer is larger than 32K!\n");
-				goto out;
-			}
-			buf = (char*) _reallocf(buf, bufsize);
-			if (buf == NULL) {
-				uprintf("localization: could not grow line buffer\n");
-				goto out;
-			}
-		}
-	} while(1);
-	ret = TRUE;
-
-out:
-	// Don't close on a reentrant call
-	if (reentrant) {
-		if ((cur_offset < 0) || (fseek(fd, cur_offset, SEEK_SET) != 0)) {
-			uprintf("localization: unable to reset reentrant position\n");
-			ret = FALSE;
-		}
-		loc_line_nr = old_loc_line_nr;
-	} else if (fd != NULL) {
-		fclose(fd);
-		fd = NULL;
-	}
-	safe_free(buf);
-	return ret;
-}
-
-
 /*
  * Parse a line of UTF-16 text and return the data if it matches the 'token'
  * The parsed line is of the form: [ ][<][ ]token[ ][=|>][ ]["]data["][ ][<] and is
@@ -838,6 +314,336 @@ out:
 	return ret;
 }
 
+/*
+ * In-memory store for a settings file, so that reading a setting doesn't require the
+ * whole file to be parsed and writing one doesn't require it to be rewritten. The file
+ * is loaded on first access and only written back, in a single atomic replacement, when
+ * flush_token_data_store() is called. Lines are kept as they were read, except for the
+ * data of the tokens that were modified, so that comments and sections are preserved.
+ */
+typedef struct {
+	wchar_t* wline;		// The line as read, or "token = " for an appended token
+	size_t data_pos;	// Position of the data in wline
+	char* token;		// NULL for comments, section headers and other non token lines
+	char* data;
+	BOOL modified;
+} token_store_line;
+
+static struct {
+	char* filename;
+	token_store_line* lines;
+	size_t nb_lines, max_lines;
+	int mode;
+	BOOL dirty;
+} token_store = { 0 };
+static SRWLOCK token_store_lock = SRWLOCK_INIT;
+
+static void free_token_store_lines(void)
+{
+	size_t i;
+
+	for (i = 0; i < token_store.nb_lines; i++) {
+		safe_free(token_store.lines[i].wline);
+		safe_free(token_store.lines[i].token);
+		safe_free(token_store.lines[i].data);
+	}
+	safe_free(token_store.lines);
+	safe_free(token_store.filename);
+	token_store.nb_lines = 0;
+	token_store.max_lines = 0;
+	token_store.dirty = FALSE;
+}
+
+static token_store_line* add_token_store_line(void)
+{
+	token_store_line* lines;
+
+	if (token_store.nb_lines >= token_store.max_lines) {
+		lines = (token_store_line*)realloc(token_store.lines,
+			(token_store.max_lines + 32) * sizeof(token_store_line));
+		if (lines == NULL)
+			return NULL;
+		token_store.lines = lines;
+		token_store.max_lines += 32;
+	}
+	memset(&token_store.lines[token_store.nb_lines], 0, sizeof(token_store_line));
+	return &token_store.lines[token_store.nb_lines++];
+}
+
+/*
+ * Load 'filename' into the store, unless it has already been loaded.
+ * Must be called with the store lock held exclusively.
+ */
+static BOOL load_token_store(const char* filename)
+{
+	wchar_t *wfilename = NULL, buf[1024], bom = 0, c;
+	FILE* fd = NULL;
+	size_t i, j, k;
+	token_store_line* line;
+	BOOL r = FALSE;
+
+	if ((token_store.filename != NULL) && (strcmp(token_store.filename, filename) == 0))
+		return TRUE;
+	if (token_store.dirty)
+		uprintf("Discarding unsaved changes to '%s'", token_store.filename);
+	free_token_store_lines();
+
+	wfilename = utf8_to_wchar(filename);
+	if (wfilename == NULL) {
+		uprintf(conversion_error, filename);
+		goto out;
+	}
+	fd = _wfopen(wfilename, L"r, ccs=UNICODE");
+	if (fd == NULL) {
+		uprintf("Could not open file '%s'", filename);
+		goto out;
+	}
+	// Same as set_token_data_file(), so that the file keeps its encoding when written back
+	token_store.mode = 0;
+	if (fread(&bom, sizeof(bom), 1, fd) == 1) {
+		if (bom == 0xFEFF)
+			token_store.mode = 2;
+		else if (bom == 0xBBEF)
+			token_store.mode = 1;
+		fseek(fd, 0, SEEK_SET);
+	}
+
+	while (fgetws(buf, ARRAYSIZE(buf), fd) != NULL) {
+		line = add_token_store_line();
+		if (line == NULL)
+			goto out;
+		line->wline = _wcsdup(buf);
+		if (line->wline == NULL)
+			goto out;
+		// Ignore comments or section headers
+		i = wcsspn(buf, wspace);
+		if ((buf[i] == L';') || (buf[i] == L'['))
+			continue;
+		// Look for a 'token = data' line
+		j = i + wcscspn(&buf[i], L" \t=\r\n");
+		k = j + wcsspn(&buf[j], wspace);
+		if ((j == i) || (buf[k] != L'='))
+			continue;
+		k++;
+		k += wcsspn(&buf[k], wspace);
+		line->data_pos = k;
+		c = buf[j];
+		buf[j] = 0;
+		line->token = wchar_to_utf8(&buf[i]);
+		buf[j] = c;
+		for (j = wcslen(buf); (j > k) && ((buf[j - 1] == L'\r') || (buf[j - 1] == L'\n')); j--);
+		buf[j] = 0;
+		line->data = wchar_to_utf8(&buf[k]);
+		if ((line->token == NULL) || (line->data == NULL))
+			goto out;
+	}
+	token_store.filename = safe_strdup(filename);
+	r = (token_store.filename != NULL);
+
+out:
+	if (fd != NULL)
+		fclose(fd);
+	if (!r)
+		free_token_store_lines();
+	safe_free(wfilename);
+	return r;
+}
+
+/*
+ * Return the data for the first occurrence of 'token' in the store for config file 'filename'
+ * The returned string is UTF-8 and MUST be freed by the caller
+ */
+char* get_token_data_store(const char* token, const char* filename)
+{
+	char *data, *ret = NULL;
+	size_t i, len;
+
+	if ((filename == NULL) || (token == NULL))
+		return NULL;
+	if ((filename[0] == 0) || (token[0] == 0))
+		return NULL;
+
+	AcquireSRWLockExclusive(&token_store_lock);
+	if (!load_token_store(filename))
+		goto out;
+	for (i = 0; i < token_store.nb_lines; i++) {
+		if ((token_store.lines[i].token == NULL) || (_stricmp(token_store.lines[i].token, token) != 0))
+			continue;
+		// Same as get_token_data_line(): eliminate quotes, if any
+		data = token_store.lines[i].data;
+		if (data[0] == '"') {
+			data++;
+			len = strcspn(data, "\"");
+		} else {
+			len = strlen(data);
+		}
+		if (len == 0)
+			continue;
+		ret = (char*)malloc(len + 1);
+		if (ret != NULL) {
+			memcpy(ret, data, len);
+			ret[len] = 0;
+		}
+		break;
+	}
+
+out:
+	ReleaseSRWLockExclusive(&token_store_lock);
+	return ret;
+}
+
+/*
+ * Replace or add 'data' for token 'token' in the store for config file 'filename'
+ * The file is not modified until flush_token_data_store() is called
+ */
+char* set_token_data_store(const char* token, const char* data, const char* filename)
+{
+	token_store_line* line;
+	char* str;
+	size_t i;
+	BOOL found = FALSE, nl;
+	char *ret = NULL;
+
+	if ((filename == NULL) || (token == NULL) || (data == NULL))
+		return NULL;
+	if ((filename[0] == 0) || (token[0] == 0) || (data[0] == 0))
+		return NULL;
+
+	AcquireSRWLockExclusive(&token_store_lock);
+	if (!load_token_store(filename))
+		goto out;
+	for (i = 0; i < token_store.nb_lines; i++) {
+		line = &token_store.lines[i];
+		if ((line->token == NULL) || (_stricmp(line->token, token) != 0))
+			continue;
+		found = TRUE;
+		if (strcmp(line->data, data) == 0)
+			continue;
+		str = safe_strdup(data);
+		if (str == NULL)
+			goto out;
+		free(line->data);
+		line->data = str;
+		line->modified = TRUE;
+		token_store.dirty = TRUE;
+	}
+
+	if (!found) {
+		// Didn't find an existing token => append it
+		line = add_token_store_line();
+		if (line == NULL)
+			goto out;
+		line->token = safe_strdup(token);
+		line->data = safe_strdup(data);
+		str = (line->token == NULL) ? NULL : malloc(strlen(token) + 5);
+		if (str != NULL) {
+			// Don't append to the last line if it wasn't terminated
+			nl = (token_store.nb_lines > 1) && (wcschr(line[-1].wline, L'\n') == NULL);
+			sprintf(str, "%s%s = ", nl ? "\n" : "", token);
+			line->wline = utf8_to_wchar(str);
+			free(str);
+		}
+		if ((line->token == NULL) || (line->data == NULL) || (line->wline == NULL)) {
+			token_store.nb_lines--;
+			safe_free(line->wline);
+			safe_free(line->token);
+			safe_free(line->data);
+			goto out;
+		}
+		line->data_pos = wcslen(line->wline);
+		line->modified = TRUE;
+		token_store.dirty = TRUE;
+	}
+	ret = (char*)data;
+
+out:
+	ReleaseSRWLockExclusive(&token_store_lock);
+	return ret;
+}
+
+/*
+ * Write the store back to its config file, if it was modified. The file is written
+ * to a temporary file first, that then replaces the original, so that an interrupted
+ * write can not leave a truncated config file behind.
+ */
+BOOL flush_token_data_store(void)
+{
+	const wchar_t* outmode[] = { L"w", L"w, ccs=UTF-8", L"w, ccs=UTF-16LE" };
+	wchar_t *wfilename = NULL, *wtmpname = NULL, *wdata;
+	token_store_line* line;
+	FILE* fd = NULL;
+	size_t i;
+	BOOL r = FALSE;
+
+	AcquireSRWLockExclusive(&token_store_lock);
+	if (!token_store.dirty) {
+		r = TRUE;
+		goto out;
+	}
+
+	wfilename = utf8_to_wchar(token_store.filename);
+	if (wfilename == NULL) {
+		uprintf(conversion_error, token_store.filename);
+		goto out;
+	}
+	wtmpname = (wchar_t*)calloc(wcslen(wfilename) + 2, sizeof(wchar_t));
+	if (wtmpname == NULL) {
+		uprintf("Could not allocate space for temporary output name");
+		goto out;
+	}
+	wcscpy(wtmpname, wfilename);
+	wtmpname[wcslen(wtmpname)] = '~';
+
+	fd = _wfopen(wtmpname, outmode[token_store.mode]);
+	if (fd == NULL) {
+		uprintf("Could not open temporary output file '%s~'", token_store.filename);
+		goto out;
+	}
+	for (i = 0; i < token_store.nb_lines; i++) {
+		line = &token_store.lines[i];
+		if (!line->modified) {
+			fputws(line->wline, fd);
+			continue;
+		}
+		wdata = utf8_to_wchar(line->data);
+		if (wdata == NULL) {
+			uprintf(conversion_error, line->data);
+			goto out;
+		}
+		// coverity[invalid_type]
+		fwprintf_s(fd, L"%.*s%s\n", (int)line->data_pos, line->wline, wdata);
+		free(wdata);
+	}
+	r = (ferror(fd) == 0);
+	r = (fclose(fd) == 0) && r;
+	fd = NULL;
+	if (r)
+		r = MoveFileExW(wtmpname, wfilename, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+	if (r)
+		token_store.dirty = FALSE;
+	else
+		uprintf("Could not write '%s' - original file has been left unmodified", token_store.filename);
+
+out:
+	if (fd != NULL)
+		fclose(fd);
+	if ((wtmpname != NULL) && (!r))
+		_wunlink(wtmpname);
+	ReleaseSRWLockExclusive(&token_store_lock);
+	safe_free(wfilename);
+	safe_free(wtmpname);
+	return r;
+}
+
+void free_token_data_store(void)
+{
+	AcquireSRWLockExclusive(&token_store_lock);
+	if (token_store.dirty)
+		uprintf("Discarding unsaved changes to '%s'", token_store.filename);
+	free_token_store_lines();
+	ReleaseSRWLockExclusive(&token_store_lock);
+}
+
 /*
  * Parse a buffer (ANSI or UTF-8) and return the data for the 'n'th occurrence of 'token'
  * The returned string is UTF-8 and MUST be freed by the caller
@@ -49,6 +49,7 @@
 #include "ui.h"
 #include "vhd.h"
 #include "wue.h"
+#include "scan.h"
 #include "drive.h"
 #include "cregex.h"
 #include "settings.h"
@@ -91,7 +92,6 @@ static char szTimer[12] = "00:00:00";
 static unsigned int timer;
 static char uppercase_select[2][64], uppercase_start[64], uppercase_close[64], uppercase_cancel[64];
 
-extern HANDLE update_check_thread;
 extern HIMAGELIST hUpImageList, hDownImageList;
 extern BOOL enable_iso, enable_joliet, enable_rockridge, enable_extra_hashes;
 extern BOOL validate_md5sum, cpu_has_sha1_accel, cpu_has_sha256_accel, toggle_dark_mode;
@@ -132,7 +132,7 @@ BOOL usb_debug, use_fake_units, preserve_timestamps = FALSE, fast_zeroing = FALS
 BOOL zero_drive = FALSE, list_non_usb_removable_drives = FALSE, enable_file_indexing, large_drive = FALSE;
 BOOL write_as_image = FALSE, write_as_esp = FALSE, use_vds = FALSE, ignore_boot_marker = FALSE, save_image = FALSE;
 BOOL appstore_version = FALSE, is_vds_available = TRUE, persistent_log = FALSE, has_ffu_support = FALSE;
-BOOL expert_mode = FALSE, use_rufus_mbr = TRUE;
+BOOL expert_mode = FALSE, use_rufus_mbr = TRUE, multi_drive = FALSE, multi_drive_hdds = FALSE, verify_writes = FALSE;
 float fScale = 1.0f;
 int dialog_showing = 0, selection_default = BT_IMAGE, persistence_unit_selection = -1, imop_win_sel = 0;
 int default_fs, fs_type, boot_type, partition_type, target_type;
@@ -1060,6 +1060,31 @@ static void CALLBACK RefreshTimer(HWND hWnd, UINT uMsg, UINT_PTR idEvent, DWORD
 	SendMessage(hWnd, UM_MEDIA_CHANGE, 0, 0);
 }
 
+// Settings flush timer, so that settings that are modified in quick succession are written once
+static void CALLBACK FlushSettingsTimer(HWND hWnd, UINT uMsg, UINT_PTR idEvent, DWORD dwTime)
+{
+	KillTimer(hWnd, idEvent);
+	FlushSettings();
+}
+
+// Return the drive mask (as with GetLogicalDrives()) for a shell media notification
+static DWORD GetMediaChangeDrive(HANDLE hChange, DWORD dwProcId)
+{
+	PIDLIST_ABSOLUTE* pidl = NULL;
+	LONG event;
+	HANDLE hLock;
+	wchar_t path[MAX_PATH];
+	int drive = -1;
+
+	hLock = SHChangeNotification_Lock(hChange, dwProcId, &pidl, &event);
+	if (hLock == NULL)
+		return 0;
+	if ((pidl != NULL) && (pidl[0] != NULL) && SHGetPathFromIDListW(pidl[0], path))
+		drive = PathGetDriveNumberW(path);
+	SHChangeNotification_Unlock(hLock);
+	return (drive >= 0) ? (1 << drive) : 0;
+}
+
 // Detect and notify about a blocking operation during ISO extraction cancellation
 static void CALLBACK BlockingTimer(HWND hWnd, UINT uMsg, UINT_PTR idEvent, DWORD dwTime)
 {
@@ -1256,8 +1281,8 @@ void GetBootladerInfo(void)
 	static const char* revocation_type[] = { "UEFI DBX", "Windows SSP", "Linux SBAT", "Windows SVN", "Cert DBX" };
 	int r;
 	BOOL sb_signed;
-	uint32_t i, len;
-	uint8_t* buf = NULL;
+	uint32_t i, count;
+	efi_bootloader_t bl[ARRAYSIZE(img_report.efi_boot_entry)] = { 0 };
 
 	// Check UEFI bootloaders for revocation
 	if (!IS_EFI_BOOTABLE(img_report))
@@ -1266,24 +1291,27 @@ void GetBootladerInfo(void)
 	assert(ARRAYSIZE(img_report.efi_boot_entry) > 0);
 	PrintStatus(0, MSG_351);
 	uprintf("UEFI bootloaders analysis:");
-	for (i = 0; i < ARRAYSIZE(img_report.efi_boot_entry) && img_report.efi_boot_entry[i].path[0] != 0; i++) {
-		len = ReadISOFileToBuffer(image_path, img_report.efi_boot_entry[i].path, &buf);
-		if (len == 0) {
-			uprintf("  Warning: Failed to extract '%s' to check for UEFI Secure Boot info", img_report.efi_boot_entry[i].path);
+	for (count = 0; count < ARRAYSIZE(img_report.efi_boot_entry) && img_report.efi_boot_entry[count].path[0] != 0; count++)
+		bl[count].path = img_report.efi_boot_entry[count].path;
+	// Read and hash all the bootloaders at once, then report on them in order
+	ReadBootloaders(image_path, bl, count);
+	for (i = 0; i < count; i++) {
+		if (bl[i].len == 0) {
+			uprintf("  Warning: Failed to extract '%s' to check for UEFI Secure Boot info", bl[i].path);
 			continue;
 		}
-		sb_signed = IsSignedBySecureBootAuthority(buf, len);
+		sb_signed = IsSignedBySecureBootAuthority(bl[i].buf, bl[i].len);
 		if (sb_signed)
 			img_report.has_secureboot_bootloader |= 1;
-		uprintf("  • %s%s", img_report.efi_boot_entry[i].path, sb_signed ? "*" : "");
-		r = IsBootloaderRevoked(buf, len);
+		uprintf("  • %s%s", bl[i].path, sb_signed ? "*" : "");
+		r = IsBootloaderRevokedEx(bl[i].buf, bl[i].len, bl[i].has_pe256 ? bl[i].pe256 : NULL);
 		if (r > 0) {
 			assert(r <= ARRAYSIZE(revocation_type));
 			assert(r <= 7);
-			uprintf("  WARNING: '%s' has been revoked by %s", img_report.efi_boot_entry[i].path, revocation_type[r - 1]);
+			uprintf("  WARNING: '%s' has been revoked by %s", bl[i].path, revocation_type[r - 1]);
 			img_report.has_secureboot_bootloader |= 1 << r;
 		}
-		safe_free(buf);
+		safe_free(bl[i].buf);
 	}
 }
 
@@ -1329,7 +1357,8 @@ DWORD WINAPI ImageScanThread(LPVOID param)
 	user_notified = FALSE;
 	EnableControls(FALSE, FALSE);
 	memset(&img_report, 0, sizeof(img_report));
-	img_report.is_iso = (BOOLEAN)ExtractISO(image_path, "", TRUE);
+	// A streamed image is not fully available yet, and can only be written in DD mode
+	img_report.is_iso = IsImageStreaming(image_path) ? FALSE : (BOOLEAN)ExtractISO(image_path, "", TRUE);
 	img_report.is_bootable_img = IsBootableImage(image_path);
 	if (img_report.wininst_index > 0 || img_report.is_windows_img)
 		PopulateWindowsVersion();
@@ -2252,6 +2281,9 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 	int nDeviceIndex, i, nWidth, nHeight, nb_devices, selected_language, offset, tb_state, tb_flags;
 	char tmp[MAX_PATH], *log_buffer = NULL;
 	wchar_t* wbuffer = NULL;
+	DWORD* multi_drive_list = NULL;
+	uint32_t multi_drive_count;
+	char* multi_drive_names = NULL;
 	loc_cmd* lcmd = NULL;
 
 	switch (message) {
@@ -2333,6 +2365,7 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 				SHChangeNotifyDeregister(ulRegister);
 			PostQuitMessage(0);
 			ClearDrives();
+			FreeDeviceCache();
 			StopProcessSearch();
 			StrArrayDestroy(&BlockingProcessList);
 			StrArrayDestroy(&ImageList);
@@ -2734,7 +2767,11 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 		SetWindowTextU(GetDlgItem(hDlg, IDC_SELECT), uppercase_select[0]);
 		SendMessage(hDlg, WM_COMMAND, IDC_SELECT, 0);
 		break;
+	case UM_DEVICES_PROBED:
 	case UM_MEDIA_CHANGE:
+		// The card reader media notifications from the shell tell us which drive they apply to
+		if ((message == UM_MEDIA_CHANGE) && (wParam != 0))
+			InvalidateDrives(GetMediaChangeDrive((HANDLE)wParam, (DWORD)lParam));
 		wParam = DBT_CUSTOMEVENT;
 		// Fall through
 	case WM_DEVICECHANGE:
@@ -2748,6 +2785,11 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 		// DO *NOT* USE WM_DEVICECHANGE AS THE MESSAGE FROM THE TIMER PROC, as it may be filtered!
 		// For instance filtering will occur when (un)plugging in a FreeBSD UFD on Windows 8.
 		// Instead, use a custom user message, such as UM_MEDIA_CHANGE, to set DBT_CUSTOMEVENT.
+		// Only the volume notifications tell us which drives changed, and therefore need to be
+		// probed again, so we keep track of these even if we can't refresh the list right now.
+		if ((message == WM_DEVICECHANGE) && ((wParam == DBT_DEVICEARRIVAL) || (wParam == DBT_DEVICEREMOVECOMPLETE)) &&
+			(lParam != 0) && (((PDEV_BROADCAST_HDR)lParam)->dbch_devicetype == DBT_DEVTYP_VOLUME))
+			InvalidateDrives(((PDEV_BROADCAST_VOLUME)lParam)->dbcv_unitmask);
 		if (format_thread == NULL) {
 			switch (wParam) {
 			case DBT_DEVICEARRIVAL:
@@ -2757,6 +2799,7 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 				KillTimer(hMainDialog, TID_REFRESH_TIMER);
 				if (!op_in_progress) {
 					queued_hotplug_event = FALSE;
+					// Only the new devices, and the ones whose volumes or media changed, get probed
 					GetDevices((DWORD)ComboBox_GetCurItemData(hDeviceList));
 					EnableControls(TRUE, FALSE);
 					if (ComboBox_GetCurSel(hDeviceList) < 0) {
@@ -3025,6 +3068,11 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 		SetTaskbarProgressState(tb_flags);
 		break;
 
+	case UM_FLUSH_SETTINGS:
+		// Setting the timer again resets it
+		SetTimer(hMainDialog, TID_FLUSH_SETTINGS, 1000, FlushSettingsTimer);
+		break;
+
 	case UM_NO_UPDATE:
 		Notification(MB_ICONINFORMATION | MB_CLOSE, lmprintf(MSG_243), lmprintf(MSG_247));
 		// Need to manually set focus back to "Check Now" for tabbing to work
@@ -3069,9 +3117,24 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 		}
 		PrintStatus(0, MSG_142);
 
-		GetWindowTextU(hDeviceList, tmp, ARRAYSIZE(tmp));
-		if (Notification(MB_OKCANCEL | MB_ICONWARNING, APPLICATION_NAME, lmprintf(MSG_003, tmp)) != IDOK)
-			goto aborted_start;
+		// In multi-drive mode, the image is written to all the listed drives that are large enough
+		if (multi_drive && CanWriteMultiDrive()) {
+			// Leave enough room for the rest of the message, whatever its translation
+			multi_drive_list = GetMultiDriveList(&multi_drive_names, &multi_drive_count, LOC_MESSAGE_SIZE / 2);
+			if (multi_drive_list == NULL) {
+				uprintf("No drive can be used for multi-drive writing");
+				goto aborted_start;
+			}
+			i = Notification(MB_OKCANCEL | MB_ICONWARNING, APPLICATION_NAME,
+				lmprintf(MSG_356, multi_drive_count, multi_drive_names));
+			safe_free(multi_drive_names);
+			if (i != IDOK)
+				goto aborted_start;
+		} else {
+			GetWindowTextU(hDeviceList, tmp, ARRAYSIZE(tmp));
+			if (Notification(MB_OKCANCEL | MB_ICONWARNING, APPLICATION_NAME, lmprintf(MSG_003, tmp)) != IDOK)
+				goto aborted_start;
+		}
 		if ((SelectedDrive.nPartitions > 1) && (Notification(MB_OKCANCEL | MB_ICONWARNING, lmprintf(MSG_094), lmprintf(MSG_093)) != IDOK))
 			goto aborted_start;
 		if ((!zero_drive) && (boot_type != BT_NON_BOOTABLE) && (SelectedDrive.SectorSize != 512) &&
@@ -3081,7 +3144,10 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 		nDeviceIndex = ComboBox_GetCurSel(hDeviceList);
 		DeviceNum = (DWORD)ComboBox_GetItemData(hDeviceList, nDeviceIndex);
 		InitProgress(zero_drive || write_as_image);
-		format_thread = CreateThread(NULL, 0, FormatThread, (LPVOID)(uintptr_t)DeviceNum, 0, NULL);
+		if (multi_drive_list != NULL)
+			format_thread = CreateThread(NULL, 0, MultiFormatThread, (LPVOID)multi_drive_list, 0, NULL);
+		else
+			format_thread = CreateThread(NULL, 0, FormatThread, (LPVOID)(uintptr_t)DeviceNum, 0, NULL);
 		if (format_thread == NULL) {
 			uprintf("Unable to start formatting thread");
 			ErrorStatus = RUFUS_ERROR(APPERR(ERROR_CANT_START_THREAD));
@@ -3096,6 +3162,7 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 		if (format_thread != NULL)
 			break;
 	aborted_start:
+		safe_free(multi_drive_list);
 		zero_drive = FALSE;
 		if (queued_hotplug_event)
 			SendMessage(hDlg, UM_MEDIA_CHANGE, 0, 0);
@@ -3129,6 +3196,7 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 		EnableControls(TRUE, FALSE);
 		if (wParam && !save_image) {
 			uprintf("\r\n");
+			InvalidateDevices();
 			GetDevices(DeviceNum);
 		}
 		save_image = FALSE;
@@ -3207,17 +3275,25 @@ static void PrintUsage(char* appname)
 	char fname[_MAX_FNAME];
 
 	_splitpath(appname, NULL, NULL, fname, NULL);
-	printf("\nUsage: %s [-x] [-g] [-h] [-f FILESYSTEM] [-i PATH] [-l LOCALE] [-w TIMEOUT]\n", fname);
+	printf("\nUsage: %s [-x] [-g] [-h] [-d DIR] [-f FILESYSTEM] [-i PATH] [-l LOCALE] [-w TIMEOUT] [-s PATH [-r FILE]]\n", fname);
 	printf("  -x, --extra-devs\n");
 	printf("     List extra devices, such as USB HDDs\n");
 	printf("  -g, --gui\n");
 	printf("     Start in GUI mode (disable the 'rufus.com' commandline hogger)\n");
+	printf("  -d DIR, --data-dir=DIR\n");
+	printf("     Use DIR, instead of the default locations, for the settings as well as all\n");
+	printf("     local and temporary storage\n");
 	printf("  -i PATH, --iso=PATH\n");
 	printf("     Select the ISO image pointed by PATH to be used on startup\n");
 	printf("  -l LOCALE, --locale=LOCALE\n");
 	printf("     Select the locale to be used on startup\n");
 	printf("  -f FILESYSTEM, --filesystem=FILESYSTEM\n");
 	printf("     Preselect the file system to be preferred when formatting\n");
+	printf("  -s PATH, --scan=PATH\n");
+	printf("     Analyze the image, or all the images from the directory, pointed by PATH,\n");
+	printf("     without starting the UI, and write the results as a JSON report\n");
+	printf("  -r FILE, --report=FILE\n");
+	printf("     Write the --scan report to FILE instead of 'rufus_scan.json'\n");
 	printf("  -w TIMEOUT, --wait=TIMEOUT\n");
 	printf("     Wait TIMEOUT tens of seconds for the global application mutex to be released.\n");
 	printf("     Used when launching a newer version of " APPLICATION_NAME " from a running application.\n");
@@ -3297,7 +3373,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 {
 	const char* rufus_loc = "rufus.loc";
 	int i, opt, option_index = 0, argc = 0, si = 0, lcid = GetUserDefaultUILanguage();
-	int wait_for_mutex = 0, forced_windows_version = 0;
+	int wait_for_mutex = 0, forced_windows_version = 0, exit_code = 0;
 	uint32_t wue_options;
 	FILE* fd;
 	BOOL attached_console = FALSE, external_loc_file = FALSE, lgp_set = FALSE, automount = TRUE;
@@ -3306,7 +3382,8 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 	BYTE *loc_data;
 	DWORD loc_size, u = 0, size = sizeof(u);
 	char tmp_path[MAX_PATH] = "", loc_file[MAX_PATH] = "", ini_path[MAX_PATH] = "", ini_flags[] = "rb";
-	char *tmp, *locale_name = NULL, **argv = NULL;
+	char data_dir[MAX_PATH] = "";
+	char *tmp, *locale_name = NULL, *scan_path = NULL, *report_path = NULL, **argv = NULL;
 	wchar_t **wenv, **wargv;
 	PF_TYPE_DECL(CDECL, int, __wgetmainargs, (int*, wchar_t***, wchar_t***, int, int*));
 	HANDLE mutex = NULL, hogmutex = NULL, hFile = NULL;
@@ -3314,12 +3391,15 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 	HDC hDC;
 	MSG msg;
 	struct option long_options[] = {
+		{"data-dir",   required_argument, NULL, 'd'},
 		{"extra-devs", no_argument,       NULL, 'x'},
 		{"gui",        no_argument,       NULL, 'g'},
 		{"help",       no_argument,       NULL, 'h'},
 		{"iso",        required_argument, NULL, 'i'},
 		{"locale",     required_argument, NULL, 'l'},
 		{"filesystem", required_argument, NULL, 'f'},
+		{"scan",       required_argument, NULL, 's'},
+		{"report",     required_argument, NULL, 'r'},
 		{"wait",       required_argument, NULL, 'w'},
 		{0, 0, NULL, 0}
 	};
@@ -3509,11 +3589,18 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 				}
 			}
 
-			while ((opt = getopt_long(argc, argv, "ghxf:i:l:w:z:", long_options, &option_index)) != EOF) {
+			while ((opt = getopt_long(argc, argv, "ghxd:f:i:l:r:s:w:z:", long_options, &option_index)) != EOF) {
 				switch (opt) {
 				case 'x':
 					enable_HDDs = TRUE;
 					break;
+				case 'd':
+					IGNORE_RETVAL(GetFullPathNameU(optarg, sizeof(data_dir), data_dir, NULL));
+					// Remove the trailing backslash, unless this is the root of a drive
+					i = (int)strlen(data_dir);
+					if ((i > 3) && (data_dir[i - 1] == '\\'))
+						data_dir[i - 1] = 0;
+					break;
 				case 'a':
 				case 'g':
 					// No need to reprocess that option
@@ -3556,6 +3643,20 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 						preselected_fs = FS_UNKNOWN;
 					selected_fs = preselected_fs;
 					break;
+				case 's':
+				case 'r':
+					tmp = calloc(1, MAX_PATH);
+					if (tmp == NULL)
+						break;
+					IGNORE_RETVAL(GetFullPathNameU(optarg, MAX_PATH, tmp, NULL));
+					if (opt == 's') {
+						safe_free(scan_path);
+						scan_path = tmp;
+					} else {
+						safe_free(report_path);
+						report_path = tmp;
+					}
+					break;
 				case 'w':
 					wait_for_mutex = atoi(optarg);
 					break;
@@ -3586,8 +3687,11 @@ skip_args_processing:
 	if (appstore_version)
 		uprintf("AppStore version detected");
 
-	// Look for a .ini file in the current app directory
-	static_sprintf(ini_path, "%srufus.ini", app_dir);
+	// Look for a .ini file in the current app directory, or in the one provided with --data-dir
+	if (data_dir[0] != 0)
+		static_sprintf(ini_path, "%s\\rufus.ini", data_dir);
+	else
+		static_sprintf(ini_path, "%srufus.ini", app_dir);
 	fd = fopenU(ini_path, ini_flags);	// Will create the file if portable mode is requested
 #if !defined(ALPHA)
 	// Using the string directly in safe_strcmp() would call GetSignatureName() twice
@@ -3608,6 +3712,12 @@ skip_args_processing:
 		static_strcpy(app_data_dir, app_dir);
 		fclose(fd);
 	}
+	// A directory provided with --data-dir is used for all local and temporary storage
+	if (data_dir[0] != 0) {
+		static_strcpy(app_data_dir, data_dir);
+		static_sprintf(temp_dir, "%s\\", data_dir);
+		uprintf("Using '%s' for local and temporary storage", data_dir);
+	}
 	uprintf("Will use settings from %s", (ini_file != NULL) ? "INI file" : "registry");
 
 	// Use the locale specified by the settings, if any
@@ -3634,6 +3744,7 @@ skip_args_processing:
 	enable_vmdk = ReadSettingBool(SETTING_ENABLE_VMDK_DETECTION);
 	enable_file_indexing = ReadSettingBool(SETTING_ENABLE_FILE_INDEXING);
 	enable_VHDs = !ReadSettingBool(SETTING_DISABLE_VHDS);
+	verify_writes = ReadSettingBool(SETTING_VERIFY_WRITES);
 	enable_extra_hashes = ReadSettingBool(SETTING_ENABLE_EXTRA_HASHES);
 	expert_mode = ReadSettingBool(SETTING_EXPERT_MODE);
 	ignore_boot_marker = ReadSettingBool(SETTING_IGNORE_BOOT_MARKER);
@@ -3649,6 +3760,8 @@ skip_args_processing:
 	}
 	// We want above normal priority by default, so we offset the value.
 	default_thread_priority = ReadSetting32(SETTING_DEFAULT_THREAD_PRIORITY) + THREAD_PRIORITY_ABOVE_NORMAL;
+	// Don't let the cached data of images we no longer use accumulate
+	PurgeWimCache();
 
 	// Initialize the global scaling, in case we need it before we initialize the dialog
 	hDC = GetDC(NULL);
@@ -3664,6 +3777,11 @@ skip_args_processing:
 		uprintf("loc file not found in current directory - embedded one will be used");
 
 		loc_data = (BYTE*)GetResource(hMainInstance, MAKEINTRESOURCEA(IDR_LC_RUFUS_LOC), _RT_RCDATA, "embedded.loc", &loc_size, FALSE);
+		// The embedded loc file is compiled during the build, so use it in place
+		if (set_loc_table(loc_data, loc_size)) {
+			uprintf("localization: using compiled table");
+			goto loc_ready;
+		}
 		if ( (GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, loc_file) == 0) || (loc_file[0] == 0) ) {
 			// If we don't have a working temp API, forget it
 			uprintf("FATAL: Unable to create temp loc file: %s", WindowsErrorString());
@@ -3689,6 +3807,7 @@ skip_args_processing:
 		ubprintf("Using external loc file '%s'", loc_file);
 	}
 
+loc_ready:
 	if ( (!get_supported_locales(loc_file))
 	  || ((selected_locale = ((locale_name == NULL) ?
 		  get_locale_from_lcid(lcid, TRUE) : get_locale_from_name(locale_name, TRUE))) == NULL) ) {
@@ -3730,6 +3849,17 @@ skip_args_processing:
 		goto out;
 	}
 
+	// Headless scan of an image, or of a library of images, which may run alongside the UI,
+	// and therefore needs to happen before we try to acquire the global application mutex.
+	// Note that, for a library, ScanImageLibrary() runs its per image instances in parallel,
+	// each with its own --data-dir, so that they don't share settings or temporary files.
+	if (scan_path != NULL) {
+		hMainInstance = hInstance;
+		get_loc_data_file(loc_file, selected_locale);
+		exit_code = ScanImageLibrary(scan_path, (report_path != NULL) ? report_path : "rufus_scan.json");
+		goto out;
+	}
+
 	// Prevent 2 applications from running at the same time, unless "/W" is passed as an option
 	// in which case we wait for the mutex to be relinquished
 	if ((safe_strlen(lpCmdLine) == 2) && (lpCmdLine[0] == '/') && (lpCmdLine[1] == 'W'))
@@ -4188,6 +4318,34 @@ extern int TestHashes(void);
 				continue;
 			}
 
+			// Ctrl-Alt-M => Write DD images to all the listed drives at once - CAUTION!!!
+			if ((msg.message == WM_KEYDOWN) && (msg.wParam == 'M') &&
+				(GetKeyState(VK_CONTROL) & 0x8000) && (GetKeyState(VK_MENU) & 0x8000)) {
+				// Cycle through disabled, enabled for non HDDs, and enabled for all drives
+				if (multi_drive && !multi_drive_hdds) {
+					multi_drive_hdds = TRUE;
+				} else {
+					multi_drive = !multi_drive;
+					multi_drive_hdds = FALSE;
+				}
+				PrintStatusTimeout(multi_drive_hdds ? "Multi-drive writing (including HDDs)" :
+					"Multi-drive writing", multi_drive);
+				uprintf("%sMulti-drive writing %s", multi_drive ? "CAUTION: " : "", multi_drive ?
+					(multi_drive_hdds ? "enabled, including HDDs" : "enabled") : "disabled");
+				if (multi_drive)
+					uprintf("DD images will be written to ALL the listed %sdrives that are large enough!",
+						multi_drive_hdds ? "" : "non HDD ");
+				continue;
+			}
+			// Ctrl-Alt-V => Verify the data after writing a DD image
+			if ((msg.message == WM_KEYDOWN) && (msg.wParam == 'V') &&
+				(GetKeyState(VK_CONTROL) & 0x8000) && (GetKeyState(VK_MENU) & 0x8000)) {
+				verify_writes = !verify_writes;
+				WriteSettingBool(SETTING_VERIFY_WRITES, verify_writes);
+				PrintStatusTimeout("Write verification", verify_writes);
+				continue;
+			}
+
 			// Ctrl-Alt-Y => Force update check to be successful and ignore timestamp errors
 			if ((msg.message == WM_KEYDOWN) && (msg.wParam == 'Y') &&
 				(GetKeyState(VK_CONTROL) & 0x8000) && (GetKeyState(VK_MENU) & 0x8000)) {
@@ -4230,9 +4388,9 @@ out:
 		for (i = 0; (!DeleteFileA(&cmdline_hogger[2])) && (i <= 10); i++)
 			Sleep(200);
 	}
-	// Kill the update check thread if running
-	if (update_check_thread != NULL)
-		TerminateThread(update_check_thread, 1);
+	// Stop the update check thread if running
+	StopUpdateCheck();
+	WimReleaseImage();
 	if ((!external_loc_file) && (loc_file[0] != 0)) {
 		if (!DeleteFileU(loc_file))
 			uprintf("Could not delete '%s': %s", loc_file, WindowsErrorString());
@@ -4244,6 +4402,8 @@ out:
 	safe_free(image_path);
 	safe_free(archive_path);
 	safe_free(locale_name);
+	safe_free(scan_path);
+	safe_free(report_path);
 	safe_free(update.download_url);
 	safe_free(update.release_notes);
 	safe_free(grub2_buf);
@@ -4256,6 +4416,10 @@ out:
 	safe_free(sb_active_txt);
 	safe_free(sb_revoked_certs);
 	safe_free(sb_revoked_txt);
+	FreeHashIndexes();
+	StopImageStream();
+	FlushSettings();
+	free_token_data_store();
 	if (argv != NULL) {
 		for (i = 0; i < argc; i++)
 			safe_free(argv[i]);
@@ -4278,7 +4442,7 @@ out:
 	_CrtDumpMemoryLeaks();
 #endif
 
-	return 0;
+	return exit_code;
 }
 
 /*
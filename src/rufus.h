@@ -115,6 +115,13 @@
 #define MAX_FAT32_SIZE              (2 * TB)	// Threshold above which we disable FAT32 formatting
 #define FAT32_CLUSTER_THRESHOLD     1.011f		// For FAT32, cluster size changes don't occur at power of 2 boundaries but slightly above
 #define DD_BUFFER_SIZE              (32 * MB)	// Minimum size of buffer to use for DD operations
+#define DD_SPARSE_BLOCK_SIZE        (1 * MB)	// Granularity at which we look for zeroed blocks in DD images
+#define MULTI_WRITE_BLOCK_SIZE      (1 * MB)	// Block size used when writing an image to multiple drives
+#define MULTI_WRITE_QUEUE_DEPTH     32			// Number of blocks the fastest drive may be ahead of the slowest one
+#define MULTI_WRITE_REPORT_INTERVAL 30000		// Interval at which the progress of each drive is logged (ms)
+#define VERIFY_BLOCK_SIZE           (1 * MB)	// Size of the reads issued when verifying written data
+#define VERIFY_DIGEST_SIZE          (64 * KB)	// Granularity of the digests used to verify written data
+#define VERIFY_QUEUE_DEPTH          8			// Number of concurrent reads issued when verifying written data
 #define UBUFFER_SIZE                4096
 #define ISO_BUFFER_SIZE             (64 * KB)	// Buffer size used for ISO data extraction
 #define RSA_SIGNATURE_SIZE          256
@@ -243,6 +250,8 @@ enum user_message_type {
 	UM_SELECT_ISO,
 	UM_TIMER_START,
 	UM_FORMAT_START,
+	UM_DEVICES_PROBED,
+	UM_FLUSH_SETTINGS,
 	// Start of the WM IDs for the language menu items
 	UM_LANGUAGE_MENU = WM_APP + 0x100
 };
@@ -273,7 +282,8 @@ enum timer_type {
 	TID_APP_TIMER,
 	TID_BLOCKING_TIMER,
 	TID_REFRESH_TIMER,
-	TID_MARQUEE_TIMER
+	TID_MARQUEE_TIMER,
+	TID_FLUSH_SETTINGS
 };
 
 /* Action type, for progress bar breakdown */
@@ -488,6 +498,7 @@ typedef struct {
 	DWORD index;
 	uint32_t port;
 	uint64_t size;
+	BOOL is_hdd;
 } RUFUS_DRIVE;
 
 typedef struct {
@@ -591,6 +602,15 @@ typedef struct {
 	uint8_t list[0][SHA1_HASHSIZE];
 } thumbprint_list_t;
 
+/* UEFI bootloader, as read from an image for revocation checks */
+typedef struct {
+	const char* path;
+	uint8_t* buf;
+	uint32_t len;
+	BOOL has_pe256;
+	uint8_t pe256[SHA256_HASHSIZE];
+} efi_bootloader_t;
+
 #ifndef __VA_GROUP__
 #define __VA_GROUP__(...)  __VA_ARGS__
 #endif
@@ -718,6 +738,12 @@ typedef struct htab_table {
 extern BOOL htab_create(uint32_t nel, htab_table* htab);
 extern void htab_destroy(htab_table* htab);
 extern uint32_t htab_hash(char* str, htab_table* htab);
+extern uint32_t htab_lookup(const char* str, htab_table* htab);
+
+/* Index of the paths listed in an md5sum.txt file */
+typedef struct {
+	htab_table htab;
+} md5sum_index_t;
 
 /* Basic String Array */
 typedef struct {
@@ -836,12 +862,19 @@ extern uint64_t DownloadToFileOrBufferEx(const char* url, const char* file, cons
 	BYTE** buffer, HWND hProgressDialog, BOOL bTaskBarProgress);
 #define DownloadToFileOrBuffer(url, file, buffer, hProgressDialog, bTaskBarProgress) \
 	DownloadToFileOrBufferEx(url, file, NULL, buffer, hProgressDialog, bTaskBarProgress)
+extern uint64_t DownloadToFileSegmented(const char* url, const char* file, HWND hProgressDialog, uint8_t* sha256);
+extern BOOL StreamImage(const char* url, const char* path, BOOL discard);
+extern void StopImageStream(void);
+extern BOOL IsImageStreaming(const char* path);
+extern BOOL WaitForImageData(uint64_t size);
+extern BOOL VerifyStreamedImage(HASH_CONTEXT* ctx, uint64_t size);
 extern DWORD DownloadSignedFile(const char* url, const char* file, HWND hProgressDialog, BOOL PromptOnError);
 extern HANDLE DownloadSignedFileThreaded(const char* url, const char* file, HWND hProgressDialog, BOOL bPromptOnError);
 extern INT_PTR CALLBACK UpdateCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam);
 extern void SetFidoCheck(void);
 extern BOOL SetUpdateCheck(void);
 extern BOOL CheckForUpdates(BOOL force);
+extern void StopUpdateCheck(void);
 extern void DownloadNewVersion(void);
 extern BOOL DownloadISO(void);
 extern BOOL IsDownloadable(const char* url);
@@ -851,6 +884,10 @@ extern uint32_t write_file(const char* path, const uint8_t* buf, const uint32_t
 extern char* get_token_data_file_indexed(const char* token, const char* filename, int index);
 #define get_token_data_file(token, filename) get_token_data_file_indexed(token, filename, 1)
 extern char* set_token_data_file(const char* token, const char* data, const char* filename);
+extern char* get_token_data_store(const char* token, const char* filename);
+extern char* set_token_data_store(const char* token, const char* data, const char* filename);
+extern BOOL flush_token_data_store(void);
+extern void free_token_data_store(void);
 extern char* get_token_data_buffer(const char* token, unsigned int n, const char* buffer, size_t buffer_size);
 extern char* insert_section_data(const char* filename, const char* section, const char* data, BOOL dos2unix);
 extern char* replace_in_token_data(const char* filename, const char* token, const char* src, const char* rep, BOOL dos2unix);
@@ -878,6 +915,9 @@ extern BOOL DetectSHA256Acceleration(void);
 extern BOOL HashFile(const unsigned type, const char* path, uint8_t* sum);
 extern BOOL PE256Buffer(uint8_t* buf, uint32_t len, uint8_t* hash);
 extern void UpdateMD5Sum(const char* dest_dir, const char* md5sum_name);
+extern BOOL Md5SumIndexCreate(md5sum_index_t* index, const char* data, uint32_t size);
+extern uint32_t Md5SumIndexLookup(md5sum_index_t* index, const char* path);
+extern void Md5SumIndexDestroy(md5sum_index_t* index);
 extern BOOL HashBuffer(const unsigned type, const uint8_t* buf, const size_t len, uint8_t* sum);
 extern uint8_t* StringToHash(const char* str);
 extern BOOL FileMatchesHash(const char* path, const char* str);
@@ -885,6 +925,9 @@ extern BOOL BufferMatchesHash(const uint8_t* buf, const size_t len, const char*
 extern BOOL IsFileInDB(const char* path);
 extern BOOL IsSignedBySecureBootAuthority(uint8_t* buf, uint32_t len);
 extern int IsBootloaderRevoked(uint8_t* buf, uint32_t len);
+extern int IsBootloaderRevokedEx(uint8_t* buf, uint32_t len, const uint8_t* pe256);
+extern void ReadBootloaders(const char* image, efi_bootloader_t* bl, uint32_t count);
+extern void FreeHashIndexes(void);
 extern BOOL IsBufferInDB(const unsigned char* buf, const size_t len);
 #define printbits(x) _printbits(sizeof(x), &x, 0)
 #define printbitslz(x) _printbits(sizeof(x), &x, 1)
@@ -0,0 +1,329 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Headless image library scanning
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "rufus.h"
+#include "vhd.h"
+#include "wue.h"
+#include "scan.h"
+#include "scan_core.h"
+#include "missing.h"
+#include "msapi_utf8.h"
+#include "settings.h"
+
+/*
+ * The image analysis code uses process wide state (img_report, image_path, the
+ * ISO scan globals...), so, rather than scan multiple images from the same
+ * process, a directory is scanned by running one headless instance of our
+ * application per image. Up to SCAN_MAX_PROCESSES of these instances run at the
+ * same time, each with its own data directory (--data-dir), that it uses for its
+ * settings, temporary files and cached data, so that they don't step on each
+ * other, or on an instance that runs the UI. Each instance writes its report
+ * entry into that directory, and the entries are then collated, in alphabetical
+ * order, into the final report.
+ * The selection of the images and the report format live in scan_core.c.
+ */
+
+#define SCAN_MAX_PROCESSES      8					// Must not exceed MAXIMUM_WAIT_OBJECTS
+#define SCAN_POLL_INTERVAL      1000				// How often we check on the running instances, in ms
+#define SCAN_IMAGE_TIMEOUT      (30 * 60 * 1000)	// How long an instance is allowed to scan a single image, in ms
+
+typedef struct {
+	HANDLE process;
+	uint32_t index;
+	uint64_t start;
+	char dir[MAX_PATH];
+} scan_slot_t;
+
+extern void GetBootladerInfo(void);
+
+/*
+ * Analyze a single image, the same way we do when an image is selected in the
+ * UI, and write its report entry to 'fd'.
+ */
+static BOOL ScanImage(const char* path, FILE* fd)
+{
+	scan_entry_t entry = { 0 };
+	StrArray editions = { 0 };
+
+	safe_free(image_path);
+	image_path = safe_strdup(path);
+	if (image_path == NULL)
+		return FALSE;
+	uprintf("Scanning image '%s'", image_path);
+	memset(&img_report, 0, sizeof(img_report));
+	img_report.is_iso = (BOOLEAN)ExtractISO(image_path, "", TRUE);
+	img_report.is_bootable_img = IsBootableImage(image_path);
+	StrArrayCreate(&editions, 16);
+	if (img_report.wininst_index > 0 || img_report.is_windows_img) {
+		PopulateWindowsVersion();
+		GetWindowsEditions(&editions);
+	}
+	if (img_report.is_iso)
+		GetBootladerInfo();
+
+	entry.path = image_path;
+	entry.size = (uint64_t)img_report.image_size;
+	entry.label = img_report.label;
+	entry.is_iso = img_report.is_iso;
+	entry.is_dd = IS_DD_BOOTABLE(img_report);
+	entry.is_bios = IS_BIOS_BOOTABLE(img_report);
+	entry.is_uefi = IS_EFI_BOOTABLE(img_report);
+	entry.is_windows = HAS_WINDOWS(img_report) || img_report.is_windows_img;
+	entry.syslinux_version = HAS_SYSLINUX(img_report) ? img_report.sl_version_str : NULL;
+	entry.grub2_version = img_report.has_grub2 ? img_report.grub2_version : NULL;
+	entry.has_grub4dos = img_report.has_grub4dos;
+	entry.windows_version[0] = (uint16_t)img_report.win_version.major;
+	entry.windows_version[1] = (uint16_t)img_report.win_version.minor;
+	entry.windows_version[2] = (uint16_t)img_report.win_version.build;
+	entry.windows_version[3] = (uint16_t)img_report.win_version.revision;
+	entry.editions = (const char**)editions.String;
+	entry.nb_editions = editions.Index;
+	entry.has_4GB_file = img_report.has_4GB_file;
+	// Bit 0 of has_secureboot_bootloader is Secure Boot, the others are the revocation types
+	entry.has_secure_boot = img_report.has_secureboot_bootloader & 1;
+	entry.revoked = (img_report.has_secureboot_bootloader >> 1) & ((1 << SCAN_REVOKED_MAX) - 1);
+	ScanWriteEntry(fd, &entry);
+
+	StrArrayDestroy(&editions);
+	return (img_report.is_iso || IS_DD_BOOTABLE(img_report) || img_report.is_windows_img);
+}
+
+static BOOL LaunchScanProcess(const char* image, const char* dir, const char* report, HANDLE* process)
+{
+	char exe[MAX_PATH], cmd[4 * MAX_PATH + 64];
+	STARTUPINFOA si = { 0 };
+	PROCESS_INFORMATION pi = { 0 };
+
+	if (GetModuleFileNameU(NULL, exe, sizeof(exe)) == 0)
+		return FALSE;
+	static_sprintf(cmd, "\"%s\" -g --data-dir=\"%s\" --scan=\"%s\" --report=\"%s\"", exe, dir, image, report);
+	si.cb = sizeof(si);
+	si.dwFlags = STARTF_USESHOWWINDOW;
+	si.wShowWindow = SW_HIDE;
+	if (!CreateProcessU(NULL, cmd, NULL, NULL, FALSE, NORMAL_PRIORITY_CLASS | CREATE_NO_WINDOW,
+		NULL, NULL, &si, &pi)) {
+		uprintf("Unable to launch scan of '%s': %s", image, WindowsErrorString());
+		return FALSE;
+	}
+	CloseHandle(pi.hThread);
+	*process = pi.hProcess;
+	return TRUE;
+}
+
+/*
+ * Launch the instance that scans image 'index' from a slot, after creating its
+ * data directory, into which we copy our settings if they come from an ini file.
+ */
+static BOOL StartScan(scan_slot_t* slot, uint32_t index, const char* image)
+{
+	char path[MAX_PATH];
+
+	slot->process = NULL;
+	slot->index = index;
+	slot->start = GetTickCount64();
+	if (GetTempDirNameU(temp_dir, APPLICATION_NAME, 0, slot->dir) == 0) {
+		uprintf("Could not create scan directory: %s", WindowsErrorString());
+		slot->dir[0] = 0;
+		return FALSE;
+	}
+	if (ini_file != NULL) {
+		static_sprintf(path, "%s\\rufus.ini", slot->dir);
+		if (!CopyFileU(ini_file, path, FALSE))
+			uprintf("Could not copy settings to '%s': %s", path, WindowsErrorString());
+	}
+	static_sprintf(path, "%s\\report.json", slot->dir);
+	return LaunchScanProcess(image, slot->dir, path, &slot->process);
+}
+
+/*
+ * Release a slot, terminating its instance if it is still running, and return
+ * the instance exit code along with the report entry it produced, if any.
+ */
+static DWORD EndScan(scan_slot_t* slot, char** entry)
+{
+	char path[MAX_PATH];
+	uint8_t* buf = NULL;
+	DWORD code = 1;
+
+	*entry = NULL;
+	if (slot->process != NULL) {
+		if (WaitForSingleObject(slot->process, 0) != WAIT_OBJECT_0) {
+			TerminateProcess(slot->process, ERROR_CANCELLED);
+			WaitForSingleObject(slot->process, 5000);
+		} else if (!GetExitCodeProcess(slot->process, &code)) {
+			code = 1;
+		}
+		CloseHandle(slot->process);
+		slot->process = NULL;
+	}
+	if (slot->dir[0] != 0) {
+		static_sprintf(path, "%s\\report.json", slot->dir);
+		if (GetFileAttributesU(path) != INVALID_FILE_ATTRIBUTES && read_file(path, &buf) != 0)
+			*entry = (char*)buf;
+		else
+			safe_free(buf);
+		SHDeleteDirectoryExU(NULL, slot->dir, FOF_NO_UI);
+		slot->dir[0] = 0;
+	}
+	return code;
+}
+
+/*
+ * Scan the images from a directory (recursively), with up to SCAN_MAX_PROCESSES
+ * instances at a time, and collate their report entries into 'fd'.
+ */
+static int ScanDirectory(const char* dir, FILE* fd)
+{
+	int r = 0;
+	uint32_t i, j, next = 0, done = 0, nb_slots, nb_running = 0;
+	StrArray files = { 0 }, images = { 0 };
+	scan_entry_t failed = { 0 };
+	scan_slot_t slot[SCAN_MAX_PROCESSES] = { 0 };
+	HANDLE handle[SCAN_MAX_PROCESSES];
+	SYSTEM_INFO si;
+	char path[MAX_PATH], **entry = NULL;
+	uint64_t now;
+	DWORD code;
+
+	StrArrayCreate(&files, 256);
+	StrArrayCreate(&images, 256);
+	static_strcpy(path, dir);
+	ListDirectoryContent(&files, path, LIST_DIR_TYPE_FILE | LIST_DIR_TYPE_RECURSIVE);
+	for (i = 0; i < files.Index; i++) {
+		if (ScanIsImageFile(files.String[i]))
+			StrArrayAdd(&images, files.String[i], TRUE);
+	}
+	if (images.Index == 0) {
+		printf("No images found in '%s'\n", dir);
+		goto out;
+	}
+	ScanSortPaths(images.String, images.Index);
+	entry = calloc(images.Index, sizeof(char*));
+	if (entry == NULL) {
+		r = 1;
+		goto out;
+	}
+	GetSystemInfo(&si);
+	nb_slots = max(1, min(min(si.dwNumberOfProcessors, images.Index), SCAN_MAX_PROCESSES));
+	printf("Scanning %d images...\n", images.Index);
+
+	while (done < images.Index) {
+		// Keep all the slots busy with the images that remain
+		while ((nb_running < nb_slots) && (next < images.Index)) {
+			if (StartScan(&slot[nb_running], next, images.String[next])) {
+				nb_running++;
+			} else {
+				EndScan(&slot[nb_running], &entry[next]);
+				printf("[%d/%d] %s (not a supported image)\n", ++done, images.Index, images.String[next]);
+			}
+			next++;
+		}
+		if (nb_running == 0)
+			continue;
+		for (j = 0; j < nb_running; j++)
+			handle[j] = slot[j].process;
+		if (WaitForMultipleObjects(nb_running, handle, FALSE, SCAN_POLL_INTERVAL) == WAIT_FAILED) {
+			uprintf("Could not wait for scan processes: %s", WindowsErrorString());
+			r = 1;
+			break;
+		}
+		// More than one instance may have completed, so check them all
+		now = GetTickCount64();
+		for (j = 0; j < nb_running; ) {
+			if (WaitForSingleObject(slot[j].process, 0) != WAIT_OBJECT_0) {
+				if (now - slot[j].start < SCAN_IMAGE_TIMEOUT) {
+					j++;
+					continue;
+				}
+				uprintf("Scan of '%s' timed out", images.String[slot[j].index]);
+			}
+			i = slot[j].index;
+			code = EndScan(&slot[j], &entry[i]);
+			printf("[%d/%d] %s%s\n", ++done, images.Index, images.String[i],
+				(code == 0) ? "" : " (not a supported image)");
+			// Move the last running slot into the one we just released
+			slot[j] = slot[--nb_running];
+		}
+	}
+	for (j = 0; j < nb_running; j++)
+		EndScan(&slot[j], &entry[slot[j].index]);
+
+	failed.error = "scan failed";
+	for (i = 0; i < images.Index; i++) {
+		if (i != 0)
+			fprintf(fd, ",\n");
+		if (entry[i] != NULL) {
+			fputs(entry[i], fd);
+		} else {
+			failed.path = images.String[i];
+			ScanWriteEntry(fd, &failed);
+		}
+	}
+
+out:
+	if (entry != NULL) {
+		for (i = 0; i < images.Index; i++)
+			safe_free(entry[i]);
+		free(entry);
+	}
+	StrArrayDestroy(&files);
+	StrArrayDestroy(&images);
+	return r;
+}
+
+int ScanImageLibrary(const char* path, const char* report)
+{
+	int r = 0;
+	BOOL is_dir;
+	DWORD attr;
+	FILE* fd;
+
+	if (path == NULL || report == NULL)
+		return 1;
+	attr = GetFileAttributesU(path);
+	if (attr == INVALID_FILE_ATTRIBUTES) {
+		printf("Could not access '%s'\n", path);
+		return 1;
+	}
+	is_dir = (attr & FILE_ATTRIBUTE_DIRECTORY);
+
+	fd = fopenU(report, "w");
+	if (fd == NULL) {
+		printf("Could not create report '%s'\n", report);
+		return 1;
+	}
+	// Individual images produce a single entry, that gets collated
+	if (is_dir) {
+		ScanWriteReportStart(fd);
+		r = ScanDirectory(path, fd);
+		ScanWriteReportEnd(fd);
+	} else {
+		r = ScanImage(path, fd) ? 0 : 1;
+	}
+	fclose(fd);
+	if (is_dir)
+		printf("Report written to '%s'\n", report);
+	return r;
+}
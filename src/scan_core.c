@@ -0,0 +1,153 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Headless image library scanning - Platform independent core
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "scan_core.h"
+
+/* Extensions of the files we scan when processing a directory */
+static const char* scan_ext[] = { ".iso", ".img", ".vhd", ".vhdx", ".wim", ".esd" };
+/* Names of the revocation types, in the order of scan_revocation_type */
+static const char* revocation_name[SCAN_REVOKED_MAX] = { "dbx", "ssp", "sbat", "svn", "cert_dbx" };
+
+static int strcmp_nocase(const char* s1, const char* s2)
+{
+	for (; (*s1 != 0) && (tolower((unsigned char)*s1) == tolower((unsigned char)*s2)); s1++, s2++);
+	return tolower((unsigned char)*s1) - tolower((unsigned char)*s2);
+}
+
+static void fprint_json_str(FILE* fd, const char* str)
+{
+	const char* p;
+
+	if (str == NULL) {
+		fprintf(fd, "null");
+		return;
+	}
+	fputc('"', fd);
+	for (p = str; *p != 0; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf(fd, "\\%c", *p);
+		else if ((uint8_t)*p < 0x20)
+			fprintf(fd, "\\u%04x", (uint8_t)*p);
+		else
+			fputc(*p, fd);
+	}
+	fputc('"', fd);
+}
+
+static __inline const char* json_bool(int b)
+{
+	return b ? "true" : "false";
+}
+
+/* Returns non zero if 'path' has one of the image extensions we scan */
+int ScanIsImageFile(const char* path)
+{
+	size_t i, len, ext_len;
+
+	if (path == NULL)
+		return 0;
+	len = strlen(path);
+	for (i = 0; i < sizeof(scan_ext) / sizeof(scan_ext[0]); i++) {
+		ext_len = strlen(scan_ext[i]);
+		if (len > ext_len && strcmp_nocase(&path[len - ext_len], scan_ext[i]) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+static int ComparePaths(const void* a, const void* b)
+{
+	return strcmp_nocase(*(const char**)a, *(const char**)b);
+}
+
+/* Sort paths in case insensitive alphabetical order, which is the order of the report */
+void ScanSortPaths(char** paths, uint32_t nb_paths)
+{
+	if (paths != NULL && nb_paths > 1)
+		qsort(paths, nb_paths, sizeof(char*), ComparePaths);
+}
+
+void ScanWriteReportStart(FILE* fd)
+{
+	fprintf(fd, "[\n");
+}
+
+void ScanWriteReportEnd(FILE* fd)
+{
+	fprintf(fd, "\n]\n");
+}
+
+/*
+ * Write the report entry of an image, as a JSON object. Entries that are part of
+ * a report must be separated with ",\n", which is left to the caller.
+ */
+void ScanWriteEntry(FILE* fd, const scan_entry_t* entry)
+{
+	uint32_t i;
+	int first;
+
+	fprintf(fd, "  {\n    \"path\": ");
+	fprint_json_str(fd, entry->path);
+	if (entry->error != NULL) {
+		fprintf(fd, ",\n    \"error\": ");
+		fprint_json_str(fd, entry->error);
+		fprintf(fd, "\n  }");
+		return;
+	}
+	fprintf(fd, ",\n    \"size\": %llu", (unsigned long long)entry->size);
+	fprintf(fd, ",\n    \"label\": ");
+	fprint_json_str(fd, entry->label);
+	fprintf(fd, ",\n    \"iso\": %s", json_bool(entry->is_iso));
+	fprintf(fd, ",\n    \"dd\": %s", json_bool(entry->is_dd));
+	fprintf(fd, ",\n    \"bios\": %s", json_bool(entry->is_bios));
+	fprintf(fd, ",\n    \"uefi\": %s", json_bool(entry->is_uefi));
+	fprintf(fd, ",\n    \"windows\": %s", json_bool(entry->is_windows));
+	fprintf(fd, ",\n    \"syslinux\": ");
+	fprint_json_str(fd, entry->syslinux_version);
+	fprintf(fd, ",\n    \"grub2\": ");
+	fprint_json_str(fd, entry->grub2_version);
+	fprintf(fd, ",\n    \"grub4dos\": %s", json_bool(entry->has_grub4dos));
+	fprintf(fd, ",\n    \"windows_version\": ");
+	if (entry->windows_version[0] != 0)
+		fprintf(fd, "\"%d.%d.%d.%d\"", entry->windows_version[0], entry->windows_version[1],
+			entry->windows_version[2], entry->windows_version[3]);
+	else
+		fprintf(fd, "null");
+	fprintf(fd, ",\n    \"windows_editions\": [");
+	for (i = 0; i < entry->nb_editions; i++) {
+		if (i != 0)
+			fprintf(fd, ", ");
+		fprint_json_str(fd, entry->editions[i]);
+	}
+	fprintf(fd, "]");
+	fprintf(fd, ",\n    \"has_4GB_file\": %s", json_bool(entry->has_4GB_file));
+	fprintf(fd, ",\n    \"secure_boot\": %s", json_bool(entry->has_secure_boot));
+	fprintf(fd, ",\n    \"revoked\": [");
+	for (i = 0, first = 1; i < SCAN_REVOKED_MAX; i++) {
+		if (!(entry->revoked & (1 << i)))
+			continue;
+		fprintf(fd, "%s\"%s\"", first ? "" : ", ", revocation_name[i]);
+		first = 0;
+	}
+	fprintf(fd, "]\n  }");
+}
@@ -0,0 +1,66 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Headless image library scanning - Platform independent core
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#pragma once
+
+/*
+ * This is the part of the image scanning that doesn't depend on the Windows
+ * API, i.e. the selection of the files to scan, and the report they produce,
+ * so that it can be built and used on other platforms for batch processing.
+ */
+
+/* Bits of scan_entry_t's revoked field */
+enum scan_revocation_type {
+	SCAN_REVOKED_DBX = 0,
+	SCAN_REVOKED_SSP,
+	SCAN_REVOKED_SBAT,
+	SCAN_REVOKED_SVN,
+	SCAN_REVOKED_CERT_DBX,
+	SCAN_REVOKED_MAX
+};
+
+typedef struct {
+	const char*  path;
+	const char*  label;
+	const char*  syslinux_version;	// NULL if the image doesn't use Syslinux
+	const char*  grub2_version;		// NULL if the image doesn't use GRUB 2
+	const char*  error;				// Non NULL if the image could not be scanned
+	const char** editions;			// Windows editions, if any
+	uint32_t     nb_editions;
+	uint64_t     size;
+	uint16_t     windows_version[4];	// All zeroes if not a Windows image
+	uint8_t      revoked;			// Bitmask of scan_revocation_type
+	uint8_t      is_iso;
+	uint8_t      is_dd;
+	uint8_t      is_bios;
+	uint8_t      is_uefi;
+	uint8_t      is_windows;
+	uint8_t      has_grub4dos;
+	uint8_t      has_4GB_file;
+	uint8_t      has_secure_boot;
+} scan_entry_t;
+
+int ScanIsImageFile(const char* path);
+void ScanSortPaths(char** paths, uint32_t nb_paths);
+void ScanWriteEntry(FILE* fd, const scan_entry_t* entry);
+void ScanWriteReportStart(FILE* fd);
+void ScanWriteReportEnd(FILE* fd);
@@ -35,10 +35,12 @@ extern char* ini_file;
 #define SETTING_DEFAULT_THREAD_PRIORITY     "DefaultThreadPriority"
 #define SETTING_DARK_MODE                   "DarkMode"
 #define SETTING_DISABLE_FAKE_DRIVES_CHECK   "DisableFakeDrivesCheck"
+#define SETTING_DISABLE_IMAGE_STREAMING     "DisableImageStreaming"
 #define SETTING_DISABLE_LGP                 "DisableLGP"
 #define SETTING_DISABLE_RUFUS_MBR           "DisableRufusMBR"
 #define SETTING_DISABLE_SECURE_BOOT_NOTICE  "DisableSecureBootNotice"
 #define SETTING_DISABLE_VHDS                "DisableVHDs"
+#define SETTING_DISCARD_STREAMED_IMAGE      "DiscardStreamedImage"
 #define SETTING_ENABLE_EXTRA_HASHES         "EnableExtraHashes"
 #define SETTING_ENABLE_FILE_INDEXING        "EnableFileIndexing"
 #define SETTING_ENABLE_RUNTIME_VALIDATION   "EnableRuntimeValidation"
@@ -60,11 +62,12 @@ extern char* ini_file;
 #define SETTING_PREFERRED_SAVE_IMAGE_TYPE   "PreferredSaveImageType"
 #define SETTING_PRESERVE_TIMESTAMPS         "PreserveTimestamps"
 #define SETTING_VERBOSE_UPDATES             "VerboseUpdateCheck"
+#define SETTING_VERIFY_WRITES               "VerifyWrites"
 #define SETTING_WUE_OPTIONS                 "WindowsUserExperienceOptions"
 
 
 static __inline BOOL CheckIniKey(const char* key) {
-	char* str = get_token_data_file(key, ini_file);
+	char* str = get_token_data_store(key, ini_file);
 	BOOL ret = (str != NULL);
 	safe_free(str);
 	return ret;
@@ -76,22 +79,31 @@ static __inline BOOL CheckIniKey(const char* key) {
 
 static __inline int64_t ReadIniKey64(const char* key) {
 	int64_t val = 0;
-	char* str = get_token_data_file(key, ini_file);
+	char* str = get_token_data_store(key, ini_file);
 	if (str != NULL) {
 		val = _strtoi64(str, NULL, 0);
 		free(str);
 	}
 	return val;
 }
+/*
+ * Have the modified ini settings written back once they stop changing (see UM_FLUSH_SETTINGS),
+ * rather than on exit only, so that they aren't lost if the application doesn't exit cleanly.
+ */
+static __inline BOOL ScheduleIniFlush(BOOL r) {
+	if (r && (hMainDialog != NULL))
+		PostMessage(hMainDialog, UM_FLUSH_SETTINGS, 0, 0);
+	return r;
+}
 static __inline BOOL WriteIniKey64(const char* key, int64_t val) {
 	char str[24];
 	static_sprintf(str, "%" PRIi64, val);
-	return (set_token_data_file(key, str, ini_file) != NULL);
+	return ScheduleIniFlush(set_token_data_store(key, str, ini_file) != NULL);
 }
 
 static __inline int32_t ReadIniKey32(const char* key) {
 	int32_t val = 0;
-	char* str = get_token_data_file(key, ini_file);
+	char* str = get_token_data_store(key, ini_file);
 	if (str != NULL) {
 		val = strtol(str, NULL, 0);
 		free(str);
@@ -101,14 +113,14 @@ static __inline int32_t ReadIniKey32(const char* key) {
 static __inline BOOL WriteIniKey32(const char* key, int32_t val) {
 	char str[12];
 	static_sprintf(str, "%d", val);
-	return (set_token_data_file(key, str, ini_file) != NULL);
+	return ScheduleIniFlush(set_token_data_store(key, str, ini_file) != NULL);
 }
 
 static __inline char* ReadIniKeyStr(const char* key) {
 	static char str[512];
 	char* val;
 	str[0] = 0;
-	val = get_token_data_file(key, ini_file);
+	val = get_token_data_store(key, ini_file);
 	if (val != NULL) {
 		static_strcpy(str, val);
 		free(val);
@@ -117,7 +129,7 @@ static __inline char* ReadIniKeyStr(const char* key) {
 }
 
 static __inline BOOL WriteIniKeyStr(const char* key, const char* val) {
-	return (set_token_data_file(key, val, ini_file) != NULL);
+	return ScheduleIniFlush(set_token_data_store(key, val, ini_file) != NULL);
 }
 
 /* Helpers for boolean operations */
@@ -151,3 +163,11 @@ static __inline char* ReadSettingStr(const char* key) {
 static __inline BOOL WriteSettingStr(const char* key, char* val) {
 	return (ini_file != NULL)?WriteIniKeyStr(key, val):WriteRegistryKeyStr(REGKEY_HKCU, key, val);
 }
+
+/*
+ * Write back the settings that were modified to the ini file (registry settings
+ * are written immediately)
+ */
+static __inline BOOL FlushSettings(void) {
+	return (ini_file != NULL)?flush_token_data_store():TRUE;
+}
@@ -134,13 +134,13 @@ void htab_destroy(htab_table* htab)
  * the stored and the parameter value. This helps to prevent unnecessary
  * expensive calls of strcmp.
  */
-uint32_t htab_hash(char* str, htab_table* htab)
+static uint32_t htab_find(const char* str, htab_table* htab, BOOL create)
 {
 	uint32_t hval, hval2;
 	uint32_t idx;
 	uint32_t r = 0;
 	int c;
-	char* sz = str;
+	const char* sz = str;
 
 	if ((htab == NULL) || (htab->table == NULL) || (str == NULL)) {
 		return 0;
@@ -195,7 +195,9 @@ uint32_t htab_hash(char* str, htab_table* htab)
 		while (htab->table[idx].used);
 	}
 
-	// Not found => New entry
+	// Not found => New entry, if requested
+	if (!create)
+		return 0;
 
 	// If the table is full return an error
 	if_assert_fails(htab->filled < htab->size) {
@@ -216,6 +218,18 @@ uint32_t htab_hash(char* str, htab_table* htab)
 	return idx;
 }
 
+/* Return the index of the entry for 'str', which gets created if needed, or 0 on error. */
+uint32_t htab_hash(char* str, htab_table* htab)
+{
+	return htab_find(str, htab, TRUE);
+}
+
+/* Return the index of the entry for 'str', or 0 if there isn't one. */
+uint32_t htab_lookup(const char* str, htab_table* htab)
+{
+	return htab_find(str, htab, FALSE);
+}
+
 static const char* GetEdition(DWORD ProductType)
 {
 	static char unknown_edition_str[64];
@@ -1493,6 +1493,7 @@ INT_PTR CALLBACK UpdateCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM l
 			reset_localization(IDD_UPDATE_POLICY);
 			EndDialog(hDlg, LOWORD(wParam));
 			hUpdatesDlg = NULL;
+			FlushSettings();
 			return (INT_PTR)TRUE;
 		case IDC_CHECK_NOW:
 			CheckForUpdates(TRUE);
@@ -0,0 +1,675 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Native VHD/VHDX image access
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This provides direct access to the content of fixed and dynamic VHDs as well
+ * as VHDXs, so that we can write these images without having to go through the
+ * Windows VirtDisk service, and, more importantly, without having to read and
+ * write the blocks that aren't allocated in the image.
+ *
+ * References:
+ * - https://www.microsoft.com/en-us/download/details.aspx?id=23850 (VHD)
+ * - https://learn.microsoft.com/en-us/openspecs/windows_protocols/ms-vhdx (VHDX)
+ *
+ * Differencing disks are not supported, since they require a parent.
+ */
+
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vdisk.h"
+
+#define VDISK_MB                    (1024ULL * 1024ULL)
+#ifndef MIN
+#define MIN(a,b)                    (((a) < (b)) ? (a) : (b))
+#endif
+
+/* VHD */
+#define VHD_FOOTER_SIZE             512
+#define VHD_DYN_HEADER_SIZE         1024
+#define VHD_SECTOR_SIZE             512
+#define VHD_DISK_TYPE_FIXED         2
+#define VHD_DISK_TYPE_DYNAMIC       3
+#define VHD_DISK_TYPE_DIFFERENCING  4
+#define VHD_BAT_UNUSED              0xFFFFFFFF
+
+/* VHDX */
+#define VHDX_HEADER_1_OFFSET        (64 * 1024)
+#define VHDX_HEADER_2_OFFSET        (128 * 1024)
+#define VHDX_HEADER_SIZE            (4 * 1024)
+#define VHDX_REGION_1_OFFSET        (192 * 1024)
+#define VHDX_REGION_2_OFFSET        (256 * 1024)
+#define VHDX_REGION_SIZE            (64 * 1024)
+#define VHDX_MAX_REGION_ENTRIES     2047
+#define VHDX_METADATA_TABLE_SIZE    (64 * 1024)
+#define VHDX_MAX_METADATA_ENTRIES   2047
+#define VHDX_LOG_SECTOR_SIZE        (4 * 1024)
+#define VHDX_LOG_HEADER_SIZE        64
+#define VHDX_LOG_DESCRIPTOR_SIZE    32
+#define VHDX_LOG_DATA_SIZE          4084
+#define VHDX_MAX_LOG_SIZE           (256 * VDISK_MB)
+#define VHDX_MAX_DISK_SIZE          (64ULL * VDISK_MB * VDISK_MB)
+#define VHDX_BAT_STATE_MASK         0x07
+#define VHDX_BAT_FULLY_PRESENT      6
+#define VHDX_BAT_PARTIALLY_PRESENT  7
+#define VHDX_FILE_PARAM_HAS_PARENT  0x02
+#define VHDX_SIG_HEAD               0x64616568	// "head"
+#define VHDX_SIG_REGI               0x69676572	// "regi"
+#define VHDX_SIG_LOGE               0x65676F6C	// "loge"
+#define VHDX_SIG_ZERO               0x6F72657A	// "zero"
+#define VHDX_SIG_DESC               0x63736564	// "desc"
+#define VHDX_SIG_DATA               0x61746164	// "data"
+
+/* GUIDs, in their on-disk byte order */
+static const uint8_t vhdx_bat_guid[16] = {
+	0x66, 0x77, 0xC2, 0x2D, 0x23, 0xF6, 0x00, 0x42, 0x9D, 0x64, 0x11, 0x5E, 0x9B, 0xFD, 0x4A, 0x08 };
+static const uint8_t vhdx_metadata_guid[16] = {
+	0x06, 0xA2, 0x7C, 0x8B, 0x90, 0x47, 0x9A, 0x4B, 0xB8, 0xFE, 0x57, 0x5F, 0x05, 0x0F, 0x88, 0x6E };
+static const uint8_t vhdx_file_parameters_guid[16] = {
+	0x37, 0x67, 0xA1, 0xCA, 0x36, 0xFA, 0x43, 0x4D, 0xB3, 0xB6, 0x33, 0xF0, 0xAA, 0x44, 0xE7, 0x6B };
+static const uint8_t vhdx_virtual_disk_size_guid[16] = {
+	0x24, 0x42, 0xA5, 0x2F, 0x1B, 0xCD, 0x76, 0x48, 0xB2, 0x11, 0x5D, 0xBE, 0xD8, 0x3B, 0xF4, 0xB8 };
+static const uint8_t vhdx_logical_sector_size_guid[16] = {
+	0x1D, 0xBF, 0x41, 0x81, 0x6F, 0xA9, 0x09, 0x47, 0xBA, 0x47, 0xF2, 0x33, 0xA8, 0xFA, 0xAB, 0x5F };
+static const uint8_t null_guid[16] = { 0 };
+
+static uint32_t crc32c_table[256];
+
+static __inline uint16_t get_le16(const uint8_t* p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+static __inline uint32_t get_le32(const uint8_t* p) { return (uint32_t)get_le16(p) | ((uint32_t)get_le16(&p[2]) << 16); }
+static __inline uint64_t get_le64(const uint8_t* p) { return (uint64_t)get_le32(p) | ((uint64_t)get_le32(&p[4]) << 32); }
+static __inline uint32_t get_be32(const uint8_t* p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]; }
+static __inline uint64_t get_be64(const uint8_t* p) { return ((uint64_t)get_be32(p) << 32) | get_be32(&p[4]); }
+
+/* CRC-32C (Castagnoli), as used by VHDX, computed with the checksum field zeroed */
+static uint32_t crc32c(const uint8_t* buf, size_t len, size_t checksum_offset)
+{
+	uint32_t i, j, c, crc = 0xFFFFFFFF;
+
+	if (crc32c_table[1] == 0) {
+		for (i = 0; i < 256; i++) {
+			for (c = i, j = 0; j < 8; j++)
+				c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : (c >> 1);
+			crc32c_table[i] = c;
+		}
+	}
+	for (i = 0; i < len; i++)
+		crc = crc32c_table[(crc ^ (((i >= checksum_offset) && (i < checksum_offset + 4)) ? 0 : buf[i])) & 0xFF] ^ (crc >> 8);
+	return crc ^ 0xFFFFFFFF;
+}
+
+static __inline int is_power_of_2(uint64_t x)
+{
+	return (x != 0) && ((x & (x - 1)) == 0);
+}
+
+/* Read from the image file, with the replayed log applied */
+static int64_t read_at(vdisk_t* vd, void* buf, uint64_t offset, uint32_t size)
+{
+	uint8_t* p = (uint8_t*)buf;
+	uint64_t start, end;
+	int64_t r;
+	uint32_t i;
+
+	r = vd->read(vd->ctx, buf, offset, size);
+	if (r < 0)
+		return -1;
+	if (vd->nb_patches == 0)
+		return r;
+	// The log may have extended the file
+	if (r < size)
+		memset(&p[r], 0, size - (size_t)r);
+	for (i = 0; i < vd->nb_patches; i++) {
+		start = (vd->patch[i].offset > offset) ? vd->patch[i].offset : offset;
+		end = MIN(vd->patch[i].offset + vd->patch[i].length, offset + size);
+		if (start >= end)
+			continue;
+		if (vd->patch[i].data == NULL)
+			memset(&p[start - offset], 0, (size_t)(end - start));
+		else
+			memcpy(&p[start - offset], &vd->patch[i].data[start - vd->patch[i].offset], (size_t)(end - start));
+	}
+	return size;
+}
+
+static __inline int read_exact(vdisk_t* vd, void* buf, uint64_t offset, uint32_t size)
+{
+	return read_at(vd, buf, offset, size) == (int64_t)size;
+}
+
+static const char* vhd_open(vdisk_t* vd)
+{
+	uint8_t footer[VHD_FOOTER_SIZE], header[VHD_DYN_HEADER_SIZE], *bat = NULL;
+	uint32_t i, sum, nb_entries, bitmap_size;
+	uint64_t offset, nb_blocks, bat_offset;
+
+	if (vd->file_size < VHD_FOOTER_SIZE)
+		return "Image is too small";
+	if (!read_exact(vd, footer, vd->file_size - VHD_FOOTER_SIZE, VHD_FOOTER_SIZE))
+		return "Could not read VHD footer";
+	// Dynamic VHDs have a copy of the footer at the beginning of the file
+	if ((memcmp(footer, "conectix", 8) != 0) &&
+		(!read_exact(vd, footer, 0, VHD_FOOTER_SIZE) || (memcmp(footer, "conectix", 8) != 0)))
+		return "Not a VHD image";
+	for (sum = 0, i = 0; i < VHD_FOOTER_SIZE; i++)
+		if (i < 64 || i >= 68)
+			sum += footer[i];
+	if (~sum != get_be32(&footer[64]))
+		return "Invalid VHD footer checksum";
+	vd->size = get_be64(&footer[48]);
+	vd->sector_size = VHD_SECTOR_SIZE;
+
+	switch (get_be32(&footer[60])) {
+	case VHD_DISK_TYPE_FIXED:
+		if (vd->file_size < vd->size + VHD_FOOTER_SIZE - 1)
+			return "Fixed VHD image is truncated";
+		vd->type = VDISK_TYPE_VHD_FIXED;
+		return NULL;
+	case VHD_DISK_TYPE_DYNAMIC:
+		break;
+	case VHD_DISK_TYPE_DIFFERENCING:
+		return "Differencing VHDs are not supported";
+	default:
+		return "Unsupported VHD type";
+	}
+
+	vd->type = VDISK_TYPE_VHD_DYNAMIC;
+	if (!read_exact(vd, header, get_be64(&footer[16]), VHD_DYN_HEADER_SIZE) || (memcmp(header, "cxsparse", 8) != 0))
+		return "Could not read VHD dynamic disk header";
+	for (sum = 0, i = 0; i < VHD_DYN_HEADER_SIZE; i++)
+		if (i < 36 || i >= 40)
+			sum += header[i];
+	if (~sum != get_be32(&header[36]))
+		return "Invalid VHD dynamic disk header checksum";
+	vd->block_size = get_be32(&header[32]);
+	if (!is_power_of_2(vd->block_size) || vd->block_size < VHD_SECTOR_SIZE)
+		return "Invalid VHD block size";
+	// Computed in 64 bits, so that a crafted disk size can't wrap the number of blocks
+	nb_blocks = vd->size / vd->block_size + ((vd->size % vd->block_size) ? 1 : 0);
+	nb_entries = get_be32(&header[28]);
+	if (nb_entries < nb_blocks)
+		return "VHD block allocation table is too small";
+	bat_offset = get_be64(&header[16]);
+	if (nb_blocks * 4 > vd->file_size || bat_offset > vd->file_size - nb_blocks * 4)
+		return "VHD block allocation table is outside of the image";
+	vd->nb_blocks = (uint32_t)nb_blocks;
+	bat = malloc((size_t)nb_blocks * 4);
+	vd->bat = malloc((size_t)nb_blocks * sizeof(uint64_t));
+	if (bat == NULL || vd->bat == NULL) {
+		free(bat);
+		return "Could not allocate VHD block allocation table";
+	}
+	if (!read_exact(vd, bat, bat_offset, (uint32_t)(nb_blocks * 4))) {
+		free(bat);
+		return "Could not read VHD block allocation table";
+	}
+	// Each allocated block starts with a sector bitmap, that is padded to a sector boundary.
+	// For non differencing disks, we can treat all the sectors of a block as present.
+	bitmap_size = ((vd->block_size / VHD_SECTOR_SIZE / 8) + VHD_SECTOR_SIZE - 1) & ~(VHD_SECTOR_SIZE - 1);
+	for (i = 0; i < vd->nb_blocks; i++) {
+		offset = get_be32(&bat[4 * i]);
+		vd->bat[i] = (offset == VHD_BAT_UNUSED) ? VDISK_UNALLOCATED : offset * VHD_SECTOR_SIZE + bitmap_size;
+		if ((vd->bat[i] != VDISK_UNALLOCATED) && (vd->bat[i] + vd->block_size > vd->file_size)) {
+			free(bat);
+			return "VHD block allocation table references data outside of the image";
+		}
+	}
+	free(bat);
+	return NULL;
+}
+
+static const char* vhdx_add_patch(vdisk_t* vd, uint64_t offset, uint64_t length, const uint8_t* data)
+{
+	vdisk_patch_t* patch = realloc(vd->patch, (vd->nb_patches + 1) * sizeof(vdisk_patch_t));
+
+	if (patch == NULL)
+		return "Could not allocate VHDX log data";
+	vd->patch = patch;
+	vd->patch[vd->nb_patches].offset = offset;
+	vd->patch[vd->nb_patches].length = length;
+	vd->patch[vd->nb_patches].data = NULL;
+	if (data != NULL) {
+		vd->patch[vd->nb_patches].data = malloc((size_t)length);
+		if (vd->patch[vd->nb_patches].data == NULL)
+			return "Could not allocate VHDX log data";
+		memcpy(vd->patch[vd->nb_patches].data, data, (size_t)length);
+	}
+	vd->nb_patches++;
+	return NULL;
+}
+
+/*
+ * Copy an entry of the circular VHDX log into a linear buffer and
+ * validate it. Returns the entry length, or 0 if not a valid entry.
+ */
+static uint32_t vhdx_get_log_entry(const uint8_t* log, uint32_t log_length, uint32_t pos,
+	const uint8_t* log_guid, uint8_t** entry)
+{
+	uint32_t i, len, nb_desc_sectors;
+	const uint8_t* hdr = &log[pos];
+
+	if (get_le32(hdr) != VHDX_SIG_LOGE || memcmp(&hdr[32], log_guid, 16) != 0)
+		return 0;
+	len = get_le32(&hdr[8]);
+	nb_desc_sectors = (VHDX_LOG_HEADER_SIZE + get_le32(&hdr[24]) * VHDX_LOG_DESCRIPTOR_SIZE +
+		VHDX_LOG_SECTOR_SIZE - 1) / VHDX_LOG_SECTOR_SIZE;
+	if (len == 0 || len % VHDX_LOG_SECTOR_SIZE != 0 || len > log_length ||
+		get_le32(&hdr[24]) > len / VHDX_LOG_DESCRIPTOR_SIZE || nb_desc_sectors * VHDX_LOG_SECTOR_SIZE > len)
+		return 0;
+	*entry = realloc(*entry, len);
+	if (*entry == NULL)
+		return 0;
+	for (i = 0; i < len; i += VHDX_LOG_SECTOR_SIZE)
+		memcpy(&(*entry)[i], &log[(pos + i) % log_length], VHDX_LOG_SECTOR_SIZE);
+	if (crc32c(*entry, len, 4) != get_le32(&(*entry)[4]))
+		return 0;
+	return len;
+}
+
+/*
+ * Replay the VHDX log, which holds metadata updates that may not have made it
+ * to their final location. Since we only ever read the image, the updates are
+ * kept in memory and applied to the data we read.
+ */
+static const char* vhdx_replay_log(vdisk_t* vd, const uint8_t* log_guid, uint64_t log_offset, uint32_t log_length)
+{
+	const char* err = NULL;
+	uint8_t *log = NULL, *entry = NULL, sector[VHDX_LOG_SECTOR_SIZE];
+	const uint8_t *desc, *data;
+	uint32_t pos, head_pos = 0, len, i, nb_desc, nb_data, data_pos;
+	uint64_t seq, head_seq = 0;
+
+	if (log_length == 0 || log_length % VDISK_MB != 0 || log_length > VHDX_MAX_LOG_SIZE)
+		return "Invalid VHDX log size";
+	log = malloc(log_length);
+	if (log == NULL)
+		return "Could not allocate VHDX log";
+	if (!read_exact(vd, log, log_offset, log_length)) {
+		err = "Could not read VHDX log";
+		goto out;
+	}
+
+	// The head of the log is the valid entry with the highest sequence number
+	for (pos = 0; pos < log_length; pos += VHDX_LOG_SECTOR_SIZE) {
+		if (vhdx_get_log_entry(log, log_length, pos, log_guid, &entry) == 0)
+			continue;
+		seq = get_le64(&entry[16]);
+		if (seq > head_seq) {
+			head_seq = seq;
+			head_pos = pos;
+		}
+	}
+	if (head_seq == 0)
+		goto out;
+
+	// The active sequence goes from the tail of the head entry to the head entry
+	if (vhdx_get_log_entry(log, log_length, head_pos, log_guid, &entry) == 0) {
+		err = "Invalid VHDX log";
+		goto out;
+	}
+	pos = get_le32(&entry[12]);
+	if (pos >= log_length || pos % VHDX_LOG_SECTOR_SIZE != 0) {
+		err = "Invalid VHDX log tail";
+		goto out;
+	}
+	// Count the entries between the tail and the head, to find the sequence number the tail must have
+	for (data_pos = pos, i = 0; data_pos != head_pos; i++) {
+		len = vhdx_get_log_entry(log, log_length, data_pos, log_guid, &entry);
+		if (len == 0 || i >= log_length / VHDX_LOG_SECTOR_SIZE) {
+			err = "Invalid VHDX log sequence";
+			goto out;
+		}
+		data_pos = (data_pos + len) % log_length;
+	}
+	seq = head_seq - i;
+
+	while (1) {
+		len = vhdx_get_log_entry(log, log_length, pos, log_guid, &entry);
+		if (len == 0 || get_le64(&entry[16]) != seq) {
+			err = "Invalid VHDX log sequence";
+			goto out;
+		}
+		nb_desc = get_le32(&entry[24]);
+		data_pos = ((VHDX_LOG_HEADER_SIZE + nb_desc * VHDX_LOG_DESCRIPTOR_SIZE +
+			VHDX_LOG_SECTOR_SIZE - 1) / VHDX_LOG_SECTOR_SIZE) * VHDX_LOG_SECTOR_SIZE;
+		for (nb_data = 0, i = 0; i < nb_desc; i++) {
+			desc = &entry[VHDX_LOG_HEADER_SIZE + i * VHDX_LOG_DESCRIPTOR_SIZE];
+			if (get_le64(&desc[24]) != seq) {
+				err = "Invalid VHDX log descriptor";
+				goto out;
+			}
+			if (get_le32(desc) == VHDX_SIG_ZERO) {
+				err = vhdx_add_patch(vd, get_le64(&desc[16]), get_le64(&desc[8]), NULL);
+			} else if (get_le32(desc) == VHDX_SIG_DESC) {
+				if (data_pos + (nb_data + 1) * VHDX_LOG_SECTOR_SIZE > len) {
+					err = "Invalid VHDX log entry";
+					goto out;
+				}
+				data = &entry[data_pos + nb_data * VHDX_LOG_SECTOR_SIZE];
+				nb_data++;
+				if (get_le32(data) != VHDX_SIG_DATA || get_le32(&data[4]) != (uint32_t)(seq >> 32) ||
+					get_le32(&data[VHDX_LOG_SECTOR_SIZE - 4]) != (uint32_t)seq) {
+					err = "Invalid VHDX log data sector";
+					goto out;
+				}
+				// Leading bytes + data + trailing bytes
+				memcpy(sector, &desc[8], 8);
+				memcpy(&sector[8], &data[8], VHDX_LOG_DATA_SIZE);
+				memcpy(&sector[8 + VHDX_LOG_DATA_SIZE], &desc[4], 4);
+				err = vhdx_add_patch(vd, get_le64(&desc[16]), VHDX_LOG_SECTOR_SIZE, sector);
+			} else {
+				err = "Invalid VHDX log descriptor";
+			}
+			if (err != NULL)
+				goto out;
+		}
+		if (pos == head_pos)
+			break;
+		pos = (pos + len) % log_length;
+		seq++;
+	}
+
+out:
+	free(entry);
+	free(log);
+	return err;
+}
+
+static const char* vhdx_open(vdisk_t* vd)
+{
+	const char* err = NULL;
+	uint8_t *buf = NULL, *header, *region, *metadata, *entry, *bat = NULL;
+	uint64_t seq[2] = { 0, 0 }, bat_offset = 0, metadata_offset = 0, offset;
+	uint32_t i, nb_entries, bat_length = 0, metadata_length = 0, flags = 0, nb_bat_entries;
+	int has_parent = 0, has_size = 0;
+	int h;
+
+	buf = malloc(2 * VHDX_HEADER_SIZE + VHDX_REGION_SIZE + VHDX_METADATA_TABLE_SIZE);
+	if (buf == NULL)
+		return "Could not allocate VHDX header";
+	if (!read_exact(vd, buf, 0, 8) || memcmp(buf, "vhdxfile", 8) != 0) {
+		err = "Not a VHDX image";
+		goto out;
+	}
+
+	// Use the valid header with the highest sequence number
+	for (h = 0; h < 2; h++) {
+		header = &buf[h * VHDX_HEADER_SIZE];
+		if (!read_exact(vd, header, (h == 0) ? VHDX_HEADER_1_OFFSET : VHDX_HEADER_2_OFFSET, VHDX_HEADER_SIZE) ||
+			get_le32(header) != VHDX_SIG_HEAD || crc32c(header, VHDX_HEADER_SIZE, 4) != get_le32(&header[4]) ||
+			get_le16(&header[66]) != 1)
+			continue;
+		seq[h] = get_le64(&header[8]);
+	}
+	if (seq[0] == 0 && seq[1] == 0) {
+		err = "No valid VHDX header";
+		goto out;
+	}
+	header = &buf[(seq[1] > seq[0]) ? VHDX_HEADER_SIZE : 0];
+
+	// Replay the log, if needed. This must be done before we read any metadata.
+	if (memcmp(&header[48], null_guid, 16) != 0) {
+		if (get_le16(&header[64]) != 0) {
+			err = "Unsupported VHDX log version";
+			goto out;
+		}
+		err = vhdx_replay_log(vd, &header[48], get_le64(&header[72]), get_le32(&header[68]));
+		if (err != NULL)
+			goto out;
+	}
+
+	region = &buf[2 * VHDX_HEADER_SIZE];
+	if ((!read_exact(vd, region, VHDX_REGION_1_OFFSET, VHDX_REGION_SIZE) || get_le32(region) != VHDX_SIG_REGI ||
+		crc32c(region, VHDX_REGION_SIZE, 4) != get_le32(&region[4])) &&
+		(!read_exact(vd, region, VHDX_REGION_2_OFFSET, VHDX_REGION_SIZE) || get_le32(region) != VHDX_SIG_REGI ||
+		crc32c(region, VHDX_REGION_SIZE, 4) != get_le32(&region[4]))) {
+		err = "No valid VHDX region table";
+		goto out;
+	}
+	nb_entries = get_le32(&region[8]);
+	if (nb_entries > VHDX_MAX_REGION_ENTRIES) {
+		err = "Invalid VHDX region table";
+		goto out;
+	}
+	for (i = 0; i < nb_entries; i++) {
+		entry = &region[16 + 32 * i];
+		if (memcmp(entry, vhdx_bat_guid, 16) == 0) {
+			bat_offset = get_le64(&entry[16]);
+			bat_length = get_le32(&entry[24]);
+		} else if (memcmp(entry, vhdx_metadata_guid, 16) == 0) {
+			metadata_offset = get_le64(&entry[16]);
+			metadata_length = get_le32(&entry[24]);
+		} else if (get_le32(&entry[28]) & 1) {
+			err = "Unsupported required VHDX region";
+			goto out;
+		}
+	}
+	if (bat_length == 0 || metadata_length < VHDX_METADATA_TABLE_SIZE) {
+		err = "Missing VHDX region";
+		goto out;
+	}
+
+	metadata = &buf[2 * VHDX_HEADER_SIZE + VHDX_REGION_SIZE];
+	if (!read_exact(vd, metadata, metadata_offset, VHDX_METADATA_TABLE_SIZE) || memcmp(metadata, "metadata", 8) != 0) {
+		err = "Invalid VHDX metadata table";
+		goto out;
+	}
+	nb_entries = get_le16(&metadata[10]);
+	if (nb_entries > VHDX_MAX_METADATA_ENTRIES) {
+		err = "Invalid VHDX metadata table";
+		goto out;
+	}
+	for (i = 0; i < nb_entries; i++) {
+		uint8_t item[8];
+		entry = &metadata[32 + 32 * i];
+		offset = get_le32(&entry[16]);
+		if (get_le32(&entry[20]) < 4 || offset + get_le32(&entry[20]) > metadata_length) {
+			err = "Invalid VHDX metadata entry";
+			goto out;
+		}
+		memset(item, 0, sizeof(item));
+		if (!read_exact(vd, item, metadata_offset + offset, MIN(get_le32(&entry[20]), (uint32_t)sizeof(item)))) {
+			err = "Could not read VHDX metadata";
+			goto out;
+		}
+		if (memcmp(entry, vhdx_file_parameters_guid, 16) == 0) {
+			vd->block_size = get_le32(item);
+			flags = get_le32(&item[4]);
+			has_parent = (flags & VHDX_FILE_PARAM_HAS_PARENT) != 0;
+		} else if (memcmp(entry, vhdx_virtual_disk_size_guid, 16) == 0) {
+			vd->size = get_le64(item);
+			has_size = 1;
+		} else if (memcmp(entry, vhdx_logical_sector_size_guid, 16) == 0) {
+			vd->sector_size = get_le32(item);
+		}
+		// Other required items (physical sector size, page 83 data) don't matter for reading
+	}
+	if (has_parent) {
+		err = "Differencing VHDXs are not supported";
+		goto out;
+	}
+	// The maximum disk size also keeps the number of blocks within 32 bits
+	if (!has_size || vd->size > VHDX_MAX_DISK_SIZE || vd->block_size < VDISK_MB || vd->block_size > 256 * VDISK_MB ||
+		!is_power_of_2(vd->block_size) || (vd->sector_size != 512 && vd->sector_size != 4096)) {
+		err = "Invalid VHDX metadata";
+		goto out;
+	}
+
+	vd->type = VDISK_TYPE_VHDX;
+	vd->chunk_ratio = (uint32_t)(((1ULL << 23) * vd->sector_size) / vd->block_size);
+	vd->nb_blocks = (uint32_t)((vd->size + vd->block_size - 1) / vd->block_size);
+	// Sector bitmap entries are interleaved with payload entries, every chunk_ratio entries
+	nb_bat_entries = (vd->nb_blocks == 0) ? 0 : vd->nb_blocks + (vd->nb_blocks - 1) / vd->chunk_ratio;
+	if ((uint64_t)nb_bat_entries * 8 > bat_length) {
+		err = "VHDX block allocation table is too small";
+		goto out;
+	}
+	bat = malloc((size_t)nb_bat_entries * 8 + 1);
+	vd->bat = malloc((size_t)vd->nb_blocks * sizeof(uint64_t) + 1);
+	if (bat == NULL || vd->bat == NULL) {
+		err = "Could not allocate VHDX block allocation table";
+		goto out;
+	}
+	if (!read_exact(vd, bat, bat_offset, nb_bat_entries * 8)) {
+		err = "Could not read VHDX block allocation table";
+		goto out;
+	}
+	for (i = 0; i < vd->nb_blocks; i++) {
+		offset = get_le64(&bat[8 * (i + i / vd->chunk_ratio)]);
+		switch (offset & VHDX_BAT_STATE_MASK) {
+		case VHDX_BAT_FULLY_PRESENT:
+			vd->bat[i] = (offset >> 20) * VDISK_MB;
+			if (vd->bat[i] + vd->block_size > vd->file_size) {
+				err = "VHDX block allocation table references data outside of the image";
+				goto out;
+			}
+			break;
+		case VHDX_BAT_PARTIALLY_PRESENT:
+			err = "Differencing VHDXs are not supported";
+			goto out;
+		default:
+			// Not present, undefined, zero or unmapped all read as zeroes
+			vd->bat[i] = VDISK_UNALLOCATED;
+			break;
+		}
+	}
+
+out:
+	free(bat);
+	free(buf);
+	return err;
+}
+
+/*
+ * Open a VHD or VHDX image, through a read callback.
+ * On error, NULL is returned and err is set to an error message.
+ */
+vdisk_t* vdisk_open(vdisk_read_t read, void* ctx, uint64_t file_size, const char** err)
+{
+	uint8_t sig[8];
+	const char* msg;
+	vdisk_t* vd = calloc(1, sizeof(vdisk_t));
+
+	if (vd == NULL) {
+		*err = "Could not allocate virtual disk";
+		return NULL;
+	}
+	vd->read = read;
+	vd->ctx = ctx;
+	vd->file_size = file_size;
+	if (read(ctx, sig, 0, sizeof(sig)) == sizeof(sig) && memcmp(sig, "vhdxfile", sizeof(sig)) == 0)
+		msg = vhdx_open(vd);
+	else
+		msg = vhd_open(vd);
+	if (msg != NULL) {
+		*err = msg;
+		vdisk_close(vd);
+		return NULL;
+	}
+	*err = NULL;
+	return vd;
+}
+
+void vdisk_close(vdisk_t* vd)
+{
+	uint32_t i;
+
+	if (vd == NULL)
+		return;
+	for (i = 0; i < vd->nb_patches; i++)
+		free(vd->patch[i].data);
+	free(vd->patch);
+	free(vd->bat);
+	free(vd);
+}
+
+/*
+ * Get the length of the extent that starts at 'offset' of the virtual disk and is either
+ * fully allocated, with its data located at 'file_offset' in the image, or unallocated,
+ * in which case 'file_offset' is set to VDISK_UNALLOCATED. Adjacent blocks are coalesced
+ * up to 'max_len'. Returns 0 if 'offset' is out of the virtual disk.
+ */
+uint64_t vdisk_get_extent(vdisk_t* vd, uint64_t offset, uint64_t max_len, uint64_t* file_offset)
+{
+	uint64_t len, ext, pos;
+	uint32_t block;
+
+	if (offset >= vd->size || max_len == 0)
+		return 0;
+	len = MIN(max_len, vd->size - offset);
+	if (vd->type == VDISK_TYPE_VHD_FIXED) {
+		*file_offset = offset;
+		return len;
+	}
+	block = (uint32_t)(offset / vd->block_size);
+	pos = vd->bat[block];
+	*file_offset = (pos == VDISK_UNALLOCATED) ? VDISK_UNALLOCATED : pos + offset % vd->block_size;
+	ext = vd->block_size - offset % vd->block_size;
+	for (block++; (ext < len) && (block < vd->nb_blocks); block++) {
+		if ((pos == VDISK_UNALLOCATED) ? (vd->bat[block] != VDISK_UNALLOCATED) :
+			(vd->bat[block] != pos + (uint64_t)(block - offset / vd->block_size) * vd->block_size))
+			break;
+		ext += vd->block_size;
+	}
+	return MIN(ext, len);
+}
+
+/* Return the amount of virtual disk data that is actually present in the image */
+uint64_t vdisk_get_allocated_size(vdisk_t* vd)
+{
+	uint64_t offset, len, file_offset, size = 0;
+
+	for (offset = 0; (len = vdisk_get_extent(vd, offset, vd->size, &file_offset)) != 0; offset += len)
+		if (file_offset != VDISK_UNALLOCATED)
+			size += len;
+	return size;
+}
+
+/*
+ * Read data from the virtual disk. Returns the number of bytes read, which may be
+ * less than requested at the end of the disk, or -1 on error.
+ */
+int64_t vdisk_read(vdisk_t* vd, void* buf, uint64_t offset, uint32_t size)
+{
+	uint8_t* p = (uint8_t*)buf;
+	uint64_t len, file_offset;
+	uint32_t pos;
+
+	for (pos = 0; pos < size; pos += (uint32_t)len) {
+		len = vdisk_get_extent(vd, offset + pos, size - pos, &file_offset);
+		if (len == 0)
+			break;
+		if (file_offset == VDISK_UNALLOCATED)
+			memset(&p[pos], 0, (size_t)len);
+		else if (!read_exact(vd, &p[pos], file_offset, (uint32_t)len))
+			return -1;
+	}
+	return pos;
+}
+
+const char* vdisk_type_name(vdisk_t* vd)
+{
+	static const char* name[VDISK_TYPE_MAX] = { "fixed VHD", "dynamic VHD", "VHDX" };
+	return (vd == NULL || vd->type < 0 || vd->type >= VDISK_TYPE_MAX) ? "unknown" : name[vd->type];
+}
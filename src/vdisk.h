@@ -0,0 +1,67 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Native VHD/VHDX image access
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+
+#pragma once
+
+/*
+ * This code only relies on the C runtime, so that it can also be built
+ * and tested on other platforms, against images created with qemu-img.
+ */
+
+#define VDISK_UNALLOCATED           UINT64_MAX
+
+enum vdisk_type {
+	VDISK_TYPE_VHD_FIXED = 0,
+	VDISK_TYPE_VHD_DYNAMIC,
+	VDISK_TYPE_VHDX,
+	VDISK_TYPE_MAX
+};
+
+/* Read 'size' bytes at 'offset' of the image file. Must return the number of bytes read or -1 on error. */
+typedef int64_t (*vdisk_read_t)(void* ctx, void* buf, uint64_t offset, uint32_t size);
+
+/* Log (journal) data that must be applied to the content of a VHDX file */
+typedef struct {
+	uint64_t offset;
+	uint64_t length;
+	uint8_t* data;						// NULL for zeroed ranges
+} vdisk_patch_t;
+
+typedef struct {
+	vdisk_read_t read;
+	void* ctx;
+	uint64_t file_size;
+	uint64_t size;						// Size of the virtual disk
+	uint32_t block_size;
+	uint32_t sector_size;
+	uint32_t nb_blocks;
+	uint32_t chunk_ratio;				// VHDX only
+	int type;
+	uint64_t* bat;						// Image offset of each block, or VDISK_UNALLOCATED
+	uint32_t nb_patches;
+	vdisk_patch_t* patch;
+} vdisk_t;
+
+extern vdisk_t* vdisk_open(vdisk_read_t read, void* ctx, uint64_t file_size, const char** err);
+extern void vdisk_close(vdisk_t* vd);
+extern uint64_t vdisk_get_extent(vdisk_t* vd, uint64_t offset, uint64_t max_len, uint64_t* file_offset);
+extern uint64_t vdisk_get_allocated_size(vdisk_t* vd);
+extern int64_t vdisk_read(vdisk_t* vd, void* buf, uint64_t offset, uint32_t size);
+extern const char* vdisk_type_name(vdisk_t* vd);
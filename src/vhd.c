@@ -28,7 +28,9 @@
 #undef _INC_VIRTDISK
 #include <windowsx.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <io.h>
+#include <fcntl.h>
 #include <rpc.h>
 #include <time.h>
 
@@ -40,10 +42,13 @@
 #include "settings.h"
 #include "msapi_utf8.h"
 
+#include "xml.h"
+#include "winio.h"
 #include "drive.h"
 #include "wimlib.h"
 #include "registry.h"
 #include "bled/bled.h"
+#include "gzip.h"
 
 extern char* save_image_type;
 extern BOOL ignore_boot_marker, has_ffu_support;
@@ -51,6 +56,7 @@ extern RUFUS_DRIVE rufus_drive[MAX_DRIVES];
 extern HANDLE format_thread;
 extern FILE* fd_md5sum;
 extern uint64_t total_blocks, extra_blocks, nb_blocks, last_nb_blocks;
+extern uint32_t hash_count[HASH_MAX];
 
 static char physical_path[128] = "";
 static int progress_op = OP_FILE_COPY, progress_msg = MSG_267;
@@ -85,6 +91,7 @@ static int8_t IsCompressedBootableImage(const char* path)
 	FILE* fd = NULL;
 	BOOL r = 0;
 	int64_t dc = 0;
+	vdisk_t* vd = NULL;
 
 	img_report.compression_type = BLED_COMPRESSION_NONE;
 	if (safe_strlen(path) > 4)
@@ -131,16 +138,25 @@ static int8_t IsCompressedBootableImage(const char* path)
 					uprintf("  An FFU image was selected, but this system does not have FFU support!");
 				}
 			} else {
-				physical_disk = VhdMountImageAndGetSize(path, &img_report.projected_size);
-				if (physical_disk != NULL) {
+				// Try to parse the VHD/VHDX natively, so that we don't have to mount it
+				vd = VhdOpenImage(path);
+				if (vd != NULL) {
 					img_report.is_vhd = TRUE;
-					fd = fopenU(physical_disk, "rb");
-					if (fd != NULL) {
-						dc = fread(buf, 1, MBR_SIZE, fd);
-						fclose(fd);
+					img_report.projected_size = vd->size;
+					dc = vdisk_read(vd, buf, 0, MBR_SIZE);
+					VhdCloseImage(vd);
+				} else {
+					physical_disk = VhdMountImageAndGetSize(path, &img_report.projected_size);
+					if (physical_disk != NULL) {
+						img_report.is_vhd = TRUE;
+						fd = fopenU(physical_disk, "rb");
+						if (fd != NULL) {
+							dc = fread(buf, 1, MBR_SIZE, fd);
+							fclose(fd);
+						}
 					}
+					VhdUnmountImage();
 				}
-				VhdUnmountImage();
 			}
 			if (dc != MBR_SIZE) {
 				free(buf);
@@ -158,6 +174,189 @@ static int8_t IsCompressedBootableImage(const char* path)
 	return FALSE;
 }
 
+/*
+ * Parse a hexadecimal checksum of the size expected for type.
+ */
+static BOOL ParseChecksum(const char* str, int type, uint8_t* checksum)
+{
+	size_t i, len = safe_strlen(str);
+
+	if (len != 2 * hash_count[type])
+		return FALSE;
+	for (i = 0; i < len; i++)
+		if (!IS_HEXASCII(str[i]))
+			return FALSE;
+	memcpy(checksum, StringToHash(str), hash_count[type]);
+	return TRUE;
+}
+
+/*
+ * Validate the self checksum of a bmap file, which is computed with the
+ * checksum value itself replaced by zeroes. Buffer is restored on exit.
+ */
+static BOOL ValidateBmapChecksum(char* buf, uint32_t size, int type)
+{
+	const char* tags[] = { "<BmapFileChecksum>", "<BmapFileSHA1>" };
+	char *p = NULL, *str, *saved = NULL;
+	uint8_t expected[MAX_HASHSIZE], actual[MAX_HASHSIZE];
+	size_t i, len = 2 * hash_count[type];
+	BOOL r = FALSE;
+
+	for (i = 0; (i < ARRAYSIZE(tags)) && (p == NULL); i++) {
+		p = strstr(buf, tags[i]);
+		if (p != NULL)
+			p += strlen(tags[i]);
+	}
+	// Pre 1.4 bmap files don't have a self checksum
+	if (p == NULL)
+		return TRUE;
+	while (isspace((uint8_t)*p))
+		p++;
+	str = calloc(len + 1, 1);
+	saved = malloc(len);
+	if (str == NULL || saved == NULL || (size_t)(&buf[size] - p) < len)
+		goto out;
+	memcpy(str, p, len);
+	if (!ParseChecksum(str, type, expected))
+		goto out;
+	memcpy(saved, p, len);
+	memset(p, '0', len);
+	HashBuffer(type, (uint8_t*)buf, size, actual);
+	memcpy(p, saved, len);
+	r = (memcmp(expected, actual, hash_count[type]) == 0);
+out:
+	free(str);
+	free(saved);
+	return r;
+}
+
+/*
+ * Look for a bmaptool block map alongside an image and load it. We look for
+ * 'image.img.xz.bmap', 'image.img.bmap' and then 'image.bmap', as per bmaptool.
+ */
+bmap_t* LoadBmap(const char* image_path)
+{
+	char path[MAX_PATH], *ext, *val, *str = NULL, *xml_buf = NULL;
+	uint8_t* buf = NULL;
+	uint32_t i, size = 0, blocks_cnt;
+	uint64_t first, last;
+	ezxml_t xml = NULL, range;
+	bmap_t* bmap = NULL;
+
+	if (image_path == NULL)
+		return NULL;
+	static_strcpy(path, image_path);
+	while (1) {
+		if (strlen(path) + 5 >= sizeof(path))
+			return NULL;
+		ext = &path[strlen(path)];
+		strcpy(ext, ".bmap");
+		if (PathFileExistsU(path))
+			break;
+		*ext = 0;
+		ext = strrchr(path, '.');
+		if (ext == NULL || strchr(ext, '\\') != NULL)
+			return NULL;
+		*ext = 0;
+	}
+
+	size = read_file(path, &buf);
+	if (size == 0)
+		goto out;
+	bmap = calloc(1, sizeof(bmap_t));
+	if (bmap == NULL)
+		goto out;
+	// Parsing alters the buffer, so parse a copy and keep the original for the self checksum
+	xml_buf = malloc(size);
+	if (xml_buf == NULL)
+		goto out;
+	memcpy(xml_buf, buf, size);
+	xml = ezxml_parse_str(xml_buf, size);
+	if (xml == NULL || *ezxml_error(xml) != 0 || safe_strcmp(ezxml_name(xml), "bmap") != 0) {
+		uprintf("Could not parse block map '%s'", path);
+		goto out;
+	}
+	val = ezxml_child_val(xml, "ChecksumType");
+	if (val != NULL) {
+		while (isspace((uint8_t)*val))
+			val++;
+		if (_strnicmp(val, "sha256", 6) == 0) {
+			bmap->checksum_type = HASH_SHA256;
+		} else if (_strnicmp(val, "sha1", 4) == 0) {
+			bmap->checksum_type = HASH_SHA1;
+		} else {
+			uprintf("Unsupported block map checksum type '%s'", val);
+			goto out;
+		}
+	} else {
+		// Older block maps don't specify the type, so infer it from the length of the digests
+		range = ezxml_child(ezxml_child(xml, "BlockMap"), "Range");
+		val = (char*)ezxml_attr(range, "chksum");
+		if (val == NULL)
+			val = (char*)ezxml_attr(range, "sha1");
+		bmap->checksum_type = (safe_strlen(val) == 2 * hash_count[HASH_SHA256]) ? HASH_SHA256 : HASH_SHA1;
+	}
+	if (!ValidateBmapChecksum((char*)buf, size, bmap->checksum_type)) {
+		uprintf("Block map '%s' is corrupted - Ignoring", path);
+		goto out;
+	}
+	bmap->image_size = _strtoui64(ezxml_txt(ezxml_child(xml, "ImageSize")), NULL, 10);
+	bmap->block_size = (uint32_t)strtoul(ezxml_txt(ezxml_child(xml, "BlockSize")), NULL, 10);
+	blocks_cnt = (uint32_t)strtoul(ezxml_txt(ezxml_child(xml, "BlocksCnt")), NULL, 10);
+	if (bmap->image_size == 0 || bmap->block_size == 0 || !IS_POWER_OF_2(bmap->block_size) ||
+		CEILING_ALIGN(bmap->image_size, bmap->block_size) / bmap->block_size != blocks_cnt) {
+		uprintf("Block map '%s' has invalid geometry - Ignoring", path);
+		goto out;
+	}
+	for (range = ezxml_child(ezxml_child(xml, "BlockMap"), "Range"); range != NULL; range = ezxml_next(range))
+		bmap->nb_ranges++;
+	bmap->range = calloc(bmap->nb_ranges, sizeof(bmap_range_t));
+	if (bmap->range == NULL)
+		goto out;
+	for (i = 0, range = ezxml_child(ezxml_child(xml, "BlockMap"), "Range"); range != NULL; i++, range = ezxml_next(range)) {
+		val = ezxml_txt(range);
+		first = _strtoui64(val, &str, 10);
+		while (isspace((uint8_t)*str))
+			str++;
+		last = (*str == '-') ? _strtoui64(&str[1], NULL, 10) : first;
+		if ((last < first) || (last >= blocks_cnt) || (i > 0 && first * bmap->block_size < bmap->range[i - 1].end)) {
+			uprintf("Block map '%s' has an invalid range '%s' - Ignoring", path, val);
+			goto out;
+		}
+		bmap->range[i].start = first * bmap->block_size;
+		bmap->range[i].end = MIN((last + 1) * bmap->block_size, bmap->image_size);
+		bmap->mapped_size += bmap->range[i].end - bmap->range[i].start;
+		val = (char*)ezxml_attr(range, "chksum");
+		if (val == NULL)
+			val = (char*)ezxml_attr(range, "sha1");
+		if (!ParseChecksum(val, bmap->checksum_type, bmap->range[i].checksum)) {
+			uprintf("Block map '%s' has an invalid checksum for range '%s' - Ignoring", path, ezxml_txt(range));
+			goto out;
+		}
+	}
+	uprintf("Using block map '%s': %s mapped out of %s", path, SizeToHumanReadable(bmap->mapped_size, FALSE, FALSE),
+		SizeToHumanReadable(bmap->image_size, FALSE, FALSE));
+	ezxml_free(xml);
+	free(xml_buf);
+	free(buf);
+	return bmap;
+
+out:
+	ezxml_free(xml);
+	free(xml_buf);
+	free(buf);
+	FreeBmap(bmap);
+	return NULL;
+}
+
+void FreeBmap(bmap_t* bmap)
+{
+	if (bmap == NULL)
+		return;
+	free(bmap->range);
+	free(bmap);
+}
+
 // 0: non-bootable, 1: bootable, 2: forced bootable
 int8_t IsBootableImage(const char* path)
 {
@@ -169,7 +368,8 @@ int8_t IsBootableImage(const char* path)
 	int8_t is_bootable_img;
 
 	uprintf("Disk image analysis:");
-	handle = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	// An image that is being streamed is still open for writing by the download
+	handle = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 	if (handle == INVALID_HANDLE_VALUE) {
 		uprintf("  Could not open image '%s'", path);
 		is_bootable_img = -1;
@@ -244,6 +444,10 @@ static enum wimlib_progress_status WimProgressFunc(enum wimlib_progress_msg msg_
 		if (info->extract.current_file_count >= info->extract.end_file_count)
 			uprintf("\n");
 		break;
+	case WIMLIB_PROGRESS_MSG_EXTRACT_IMAGE_END:
+		if (info->extract.skipped_zero_bytes != 0)
+			uprintf("Skipped writing %s of zeroes", SizeToHumanReadable(info->extract.skipped_zero_bytes, FALSE, FALSE));
+		break;
 	case WIMLIB_PROGRESS_MSG_SPLIT_BEGIN_PART:
 		last_split_progress = info->split;
 		uprintf("● %S", info->split.part_name);
@@ -274,33 +478,202 @@ static enum wimlib_progress_status WimProgressFunc(enum wimlib_progress_msg msg_
 	return WIMLIB_PROGRESS_STATUS_CONTINUE;
 }
 
+/*
+ * Build the path of the install.wim/install.esd with index 'index' of the current
+ * image, using the "<iso>|<path of WIM in ISO>" notation when the image is an ISO.
+ * This is the path that all the WIM functions below, and their cache, should use.
+ */
+BOOL GetWininstImagePath(int index, char* wim_path, size_t wim_path_size)
+{
+	if_assert_fails((index >= 0) && (index < MAX_WININST) && (image_path != NULL))
+		return FALSE;
+	if (img_report.is_windows_img) {
+		if (safe_strlen(image_path) + 1 > wim_path_size)
+			return FALSE;
+		safe_strcpy(wim_path, wim_path_size, image_path);
+	} else {
+		// wininst_path[] is of the form "?:\sources\install.wim"
+		if (safe_strlen(image_path) + safe_strlen(&img_report.wininst_path[index][3]) + 2 > wim_path_size)
+			return FALSE;
+		safe_sprintf(wim_path, wim_path_size, "%s|%s", image_path, &img_report.wininst_path[index][3]);
+	}
+	return TRUE;
+}
+
+/*
+ * Get the path under which data called 'name' for a WIM image is cached in our
+ * application directory, creating the cache directory if needed. 'image' uses
+ * the "<iso>|<path of WIM in ISO>" notation for WIMs that reside in an ISO.
+ * The cache key is a hash of the size and modification time of the image file,
+ * of the ISO's Primary Volume Descriptor (or WIM header) and of the path of the
+ * WIM in the ISO, so that selecting the same image again does not require
+ * reopening the WIM.
+ */
+BOOL GetWimCachePath(const char* image, const char* name, char* path, size_t path_size)
+{
+	BOOL r = FALSE;
+	char file_path[4 * MAX_PATH], *p;
+	uint8_t hash[SHA1_HASHSIZE];
+	struct {
+		uint64_t size;
+		int64_t mtime;
+		uint8_t pvd[2048];
+		char wim_path[MAX_PATH];
+	} *key = NULL;
+	struct __stat64 stat64 = { 0 };
+	HANDLE handle = INVALID_HANDLE_VALUE;
+	FILETIME now;
+	DWORD size;
+	int i;
+
+	if (image == NULL || name == NULL || path == NULL || app_data_dir[0] == 0)
+		return FALSE;
+	key = calloc(1, sizeof(*key));
+	if (key == NULL)
+		return FALSE;
+
+	static_strcpy(file_path, image);
+	p = strchr(file_path, '|');
+	if (p != NULL) {
+		*p++ = 0;
+		static_strcpy(key->wim_path, p);
+	}
+	if (_stat64U(file_path, &stat64) != 0)
+		goto out;
+	key->size = stat64.st_size;
+	key->mtime = stat64.st_mtime;
+	// For an ISO, use the PVD, which is the 2 KB sector at offset 0x8000. For a
+	// standalone WIM, use the first 2 KB, which contain the header and its GUID.
+	handle = CreateFileU(file_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		goto out;
+	if (SetFilePointer(handle, (p != NULL) ? 16 * (LONG)sizeof(key->pvd) : 0, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER ||
+		!ReadFile(handle, key->pvd, sizeof(key->pvd), &size, NULL))
+		goto out;
+	if (!HashBuffer(HASH_SHA1, (uint8_t*)key, sizeof(*key), hash))
+		goto out;
+	safe_closehandle(handle);
+
+	static_sprintf(file_path, "%s\\%s\\%s\\", app_data_dir, FILES_DIR, WIM_CACHE_DIR);
+	p = &file_path[strlen(file_path)];
+	for (i = 0; i < SHA1_HASHSIZE; i++, p += 2)
+		sprintf(p, "%02x", hash[i]);
+	if (!PathFileExistsU(file_path)) {
+		i = SHCreateDirectoryExU(NULL, file_path, NULL);
+		if (i != ERROR_SUCCESS && i != ERROR_ALREADY_EXISTS)
+			goto out;
+	} else {
+		// Refresh the modification time of the entry, which PurgeWimCache() uses as its last use
+		handle = CreateFileU(file_path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+		if (handle != INVALID_HANDLE_VALUE) {
+			GetSystemTimeAsFileTime(&now);
+			SetFileTime(handle, NULL, NULL, &now);
+		}
+	}
+	safe_sprintf(path, path_size, "%s\\%s", file_path, name);
+	r = TRUE;
+
+out:
+	safe_closehandle(handle);
+	free(key);
+	return r;
+}
+
+/*
+ * Remove the entries of our WIM cache that haven't been used for WIM_CACHE_MAX_AGE
+ * days, as the images they were created for are unlikely to be selected again.
+ */
+void PurgeWimCache(void)
+{
+	WIN32_FIND_DATAA find_data;
+	HANDLE hFind;
+	FILETIME ft;
+	ULARGE_INTEGER now, last_use;
+	char path[MAX_PATH];
+
+	if (app_data_dir[0] == 0)
+		return;
+	static_sprintf(path, "%s\\%s\\%s\\*", app_data_dir, FILES_DIR, WIM_CACHE_DIR);
+	hFind = FindFirstFileU(path, &find_data);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return;
+	GetSystemTimeAsFileTime(&ft);
+	now.LowPart = ft.dwLowDateTime;
+	now.HighPart = ft.dwHighDateTime;
+	do {
+		if (!(find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || find_data.cFileName[0] == '.')
+			continue;
+		last_use.LowPart = find_data.ftLastWriteTime.dwLowDateTime;
+		last_use.HighPart = find_data.ftLastWriteTime.dwHighDateTime;
+		// FILETIME is in 100 ns units
+		if ((now.QuadPart < last_use.QuadPart) ||
+			(now.QuadPart - last_use.QuadPart < WIM_CACHE_MAX_AGE * 24ULL * 3600ULL * 10000000ULL))
+			continue;
+		static_sprintf(path, "%s\\%s\\%s\\%s", app_data_dir, FILES_DIR, WIM_CACHE_DIR, find_data.cFileName);
+		uprintf("Removing stale WIM cache entry '%s'", find_data.cFileName);
+		SHDeleteDirectoryExU(NULL, path, FOF_NO_UI);
+	} while (FindNextFileU(hFind, &find_data));
+	FindClose(hFind);
+}
+
 // Return the WIM version of an image
 uint32_t GetWimVersion(const char* image)
 {
 	int r;
 	WIMStruct* wim;
 	struct wimlib_wim_info info;
+	char cache_path[MAX_PATH];
+	uint8_t* buf = NULL;
+	uint32_t version = 0;
 
 	if (image == NULL)
 		return 0;
 
+	if (GetWimCachePath(image, "version", cache_path, sizeof(cache_path)) && PathFileExistsU(cache_path) &&
+		read_file(cache_path, &buf) == sizeof(version))
+		version = *(uint32_t*)buf;
+	free(buf);
+	if (version != 0)
+		return version;
+
 	r = wimlib_open_wimU(image, 0, &wim);
 	if (r == 0) {
 		r = wimlib_get_wim_info(wim, &info);
 		wimlib_free(wim);
-		if (r == 0)
+		if (r == 0) {
+			if (GetWimCachePath(image, "version", cache_path, sizeof(cache_path)))
+				write_file(cache_path, (uint8_t*)&info.wim_version, sizeof(info.wim_version));
 			return info.wim_version;
+		}
 	}
 	uprintf("WARNING: Could not get WIM version: Error %d", r);
 	return 0;
 }
 
-// Extract a file from a WIM image. Returns the allocated path of the extracted file or NULL on error.
+// The WIM that was last opened by WimExtractFile(), kept open for subsequent calls
+static WIMStruct* extract_wim = NULL;
+static char extract_wim_path[4 * MAX_PATH] = "";
+static uint64_t extract_wim_size = 0;
+static int64_t extract_wim_mtime = 0;
+
+// Close the WIM that WimExtractFile() keeps open, so that its file is no longer in use,
+// and free the decompressed solid resource chunks that it kept around.
+void WimReleaseImage(void)
+{
+	wimlib_free(extract_wim);
+	extract_wim = NULL;
+	extract_wim_path[0] = 0;
+	wimlib_free_solid_cache();
+}
+
+// Extract a file from a WIM image, directly to the 'dst' file.
 BOOL WimExtractFile(const char* image, int index, const char* src, const char* dst)
 {
-	int r = 1;
-	WIMStruct* wim;
-	char tmp[MAX_PATH] = "", *p;
+	int r = 1, fd = -1;
+	char file_path[4 * MAX_PATH], cache_name[MAX_PATH], cache_path[MAX_PATH] = "", *p;
+	struct __stat64 stat64 = { 0 };
+	HANDLE handle;
 
 	if ((image == NULL) || (src == NULL) || (dst == NULL))
 		goto out;
@@ -309,23 +682,70 @@ BOOL WimExtractFile(const char* image, int index, const char* src, const char* d
 	assert(strrchr(dst, '\\') != NULL);
 	if (strrchr(src, '\\') == NULL || strrchr(dst, '\\') == NULL)
 		goto out;
-	p = strrchr(dst, '\\');
-	*p = '\0';
+
+	// Small files, such as the boot managers we look for, are cached per image
+	static_sprintf(cache_name, "%d_%s", index, src);
+	for (p = cache_name; *p != 0; p++)
+		if (*p == '\\' || *p == '/')
+			*p = '_';
+	if (GetWimCachePath(image, cache_name, cache_path, sizeof(cache_path)) &&
+		PathFileExistsU(cache_path) && CopyFileU(cache_path, dst, FALSE)) {
+		uprintf("Using cached '%s' from '%s'", src, image);
+		r = 0;
+		goto out;
+	}
 
 	wimlib_global_init(0);
 	wimlib_set_print_errors(true);
-	r = wimlib_open_wimU(image, 0, &wim);
-	if (r == 0) {
-		r = wimlib_extract_pathsU(wim, index, dst, &src, 1, WIMLIB_EXTRACT_FLAG_NO_PRESERVE_DIR_STRUCTURE);
-		wimlib_free(wim);
-		static_strcpy(tmp, dst);
-		static_strcat(tmp, strrchr(src, '\\'));
-		*p = '\\';
-		if (!MoveFileExU(tmp, dst, MOVEFILE_REPLACE_EXISTING)) {
-			uprintf("  Could not rename %s to %s: %s", tmp, dst, WindowsErrorString());
-			r = 1;
+	// Keep the decompressed chunks of solid (ESD) resources around, as we
+	// usually extract more than one file from the same image. The cache is
+	// process-wide, so it is only enabled for the duration of this call, and
+	// its chunks are freed by WimReleaseImage().
+	wimlib_set_solid_cache_size(WIM_SOLID_CACHE_SIZE);
+
+	// Reuse the WIM we opened last, provided that its file hasn't changed
+	static_strcpy(file_path, image);
+	p = strchr(file_path, '|');
+	if (p != NULL)
+		*p = 0;
+	_stat64U(file_path, &stat64);
+	if (extract_wim != NULL && (strcmp(image, extract_wim_path) != 0 ||
+		stat64.st_size != extract_wim_size || stat64.st_mtime != extract_wim_mtime))
+		WimReleaseImage();
+	if (extract_wim == NULL) {
+		r = wimlib_open_wimU(image, 0, &extract_wim);
+		if (r != 0) {
+			extract_wim = NULL;
+			goto cleanup;
 		}
+		static_strcpy(extract_wim_path, image);
+		extract_wim_size = stat64.st_size;
+		extract_wim_mtime = stat64.st_mtime;
 	}
+
+	handle = CreateFileU(dst, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE) {
+		uprintf("  Could not create %s: %s", dst, WindowsErrorString());
+		r = 1;
+		goto cleanup;
+	}
+	fd = _open_osfhandle((intptr_t)handle, _O_WRONLY | _O_BINARY);
+	if (fd < 0) {
+		CloseHandle(handle);
+		r = 1;
+		goto cleanup;
+	}
+	// Only the chunks that hold the data of the file get decompressed
+	r = wimlib_extract_file_to_fdU(extract_wim, index, src, fd, 0);
+	_close(fd);
+	if (r != 0) {
+		DeleteFileU(dst);
+	} else if (cache_path[0] != 0 && _filesizeU(dst) <= WIM_CACHE_MAX_FILE_SIZE) {
+		IGNORE_RETVAL(CopyFileU(dst, cache_path, FALSE));
+	}
+
+cleanup:
+	wimlib_set_solid_cache_size(0);
 	wimlib_global_cleanup();
 
 out:
@@ -369,7 +789,8 @@ BOOL WimApplyImage(const char* image, int index, const char* dst)
 		progress_op = OP_FILE_COPY;
 		progress_msg = MSG_267;
 		wimlib_register_progress_function(wim, WimProgressFunc, NULL);
-		r = wimlib_extract_imageU(wim, index, dst, 0);
+		// Don't write the zeroed regions of large files, such as VHDs, to slow media
+		r = wimlib_extract_imageU(wim, index, dst, WIMLIB_EXTRACT_FLAG_SKIP_ZEROES);
 		wimlib_free(wim);
 	} else {
 		uprintf("Failed to open '%s': Wimlib error %d", image, r);
@@ -462,6 +883,53 @@ out:
 	physical_path[0] = 0;
 }
 
+static int64_t VhdReadImage(void* ctx, void* buf, uint64_t offset, uint32_t size)
+{
+	OVERLAPPED overlapped = { 0 };
+	DWORD read_size = 0;
+
+	overlapped.Offset = (DWORD)offset;
+	overlapped.OffsetHigh = (DWORD)(offset >> 32);
+	if (!ReadFile((HANDLE)ctx, buf, size, &read_size, &overlapped) && (GetLastError() != ERROR_HANDLE_EOF))
+		return -1;
+	return read_size;
+}
+
+// Open a VHD/VHDX image for native access, without mounting it.
+// Returns NULL if the image is not supported, in which case it should be mounted instead.
+vdisk_t* VhdOpenImage(const char* path)
+{
+	HANDLE handle;
+	LARGE_INTEGER li;
+	vdisk_t* vd = NULL;
+	const char* err = NULL;
+
+	handle = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE) {
+		uprintf("Could not open image '%s': %s", path, WindowsErrorString());
+		return NULL;
+	}
+	if (!GetFileSizeEx(handle, &li)) {
+		uprintf("Could not get size of image '%s': %s", path, WindowsErrorString());
+		CloseHandle(handle);
+		return NULL;
+	}
+	vd = vdisk_open(VhdReadImage, handle, li.QuadPart, &err);
+	if (vd == NULL) {
+		uprintf("Could not access '%s' natively: %s", path, err);
+		CloseHandle(handle);
+	}
+	return vd;
+}
+
+void VhdCloseImage(vdisk_t* vd)
+{
+	if (vd == NULL)
+		return;
+	CloseHandle((HANDLE)vd->ctx);
+	vdisk_close(vd);
+}
+
 // Since we no longer have to deal with Windows 7, we can call on CreateVirtualDisk()
 // to backup a physical disk to VHD/VHDX. Now if this could also be used to create an
 // ISO from optical media that would be swell, but no matter what I tried, it didn't
@@ -587,16 +1055,452 @@ static DWORD WINAPI FfuSaveImageThread(void* param)
 	ExitThread(r);
 }
 
+// 1 bit per CAPTURE_BLOCK_SIZE block of the source drive, set if the block holds data
+static uint8_t* capture_map = NULL;
+static uint64_t capture_nb_blocks = 0;
+
+static __inline BOOL IsCaptureBlockUsed(uint64_t block)
+{
+	return (capture_map[block >> 3] & (1 << (block & 7))) != 0;
+}
+
+// Mark all the blocks that overlap with a section of the drive as holding data
+static void MarkCaptureRange(uint64_t offset, uint64_t size)
+{
+	uint64_t block, end;
+
+	if (size == 0)
+		return;
+	end = MIN((offset + size - 1) / CAPTURE_BLOCK_SIZE + 1, capture_nb_blocks);
+	for (block = offset / CAPTURE_BLOCK_SIZE; block < end; block++)
+		capture_map[block >> 3] |= 1 << (block & 7);
+}
+
+// Mark the blocks that are fully contained in a section of the drive as free
+static void ClearCaptureRange(uint64_t offset, uint64_t size)
+{
+	uint64_t block, end = MIN((offset + size) / CAPTURE_BLOCK_SIZE, capture_nb_blocks);
+
+	for (block = CEILING_ALIGN(offset, CAPTURE_BLOCK_SIZE) / CAPTURE_BLOCK_SIZE; block < end; block++)
+		capture_map[block >> 3] &= ~(1 << (block & 7));
+}
+
+// Return the number of consecutive used blocks, up to max_blocks, from the first used block at or after *block
+static uint64_t GetNextCaptureRun(uint64_t* block, uint64_t max_blocks)
+{
+	uint64_t len;
+
+	while ((*block < capture_nb_blocks) && !IsCaptureBlockUsed(*block))
+		(*block)++;
+	for (len = 0; (len < max_blocks) && (*block + len < capture_nb_blocks) && IsCaptureBlockUsed(*block + len); len++);
+	return len;
+}
+
+/*
+ * Mark the clusters of a partition that Windows can access (FAT, exFAT, NTFS, etc.)
+ * that hold data, according to the allocation bitmap of its file system.
+ * The volume is locked before its bitmap is read, and dismounted afterwards, so
+ * that its content can't change until the handle returned in 'hLockedVolume' is
+ * closed, after the capture.
+ */
+static BOOL MarkVolumeUsedRanges(DWORD DriveIndex, uint64_t PartitionOffset, HANDLE* hLockedVolume)
+{
+	BOOL r = FALSE;
+	char* volume_name = NULL;
+	HANDLE hVolume = INVALID_HANDLE_VALUE;
+	STARTING_LCN_INPUT_BUFFER lcn = { 0 };
+	RETRIEVAL_POINTER_BASE base;
+	VOLUME_BITMAP_BUFFER* bitmap = NULL;
+	DWORD size, sectors_per_cluster, bytes_per_sector, free_clusters, total_clusters;
+	uint64_t i, run, nb_clusters, cluster_size, data_offset;
+
+	volume_name = GetLogicalName(DriveIndex, PartitionOffset, TRUE, TRUE);
+	if ((volume_name == NULL) || !GetDiskFreeSpaceA(volume_name, &sectors_per_cluster,
+		&bytes_per_sector, &free_clusters, &total_clusters))
+		goto out;
+	cluster_size = (uint64_t)sectors_per_cluster * bytes_per_sector;
+	// Locking the volume also flushes it
+	hVolume = GetLogicalHandle(DriveIndex, PartitionOffset, TRUE, FALSE, FALSE);
+	if ((hVolume == NULL) || (hVolume == INVALID_HANDLE_VALUE))
+		goto out;
+	// Cluster 0 may not be the start of the volume (e.g. FAT, where it is the start of the data area)
+	if (!DeviceIoControl(hVolume, FSCTL_GET_RETRIEVAL_POINTER_BASE, NULL, 0, &base, sizeof(base), &size, NULL))
+		goto out;
+	data_offset = base.FileAreaOffset.QuadPart * bytes_per_sector;
+	MarkCaptureRange(PartitionOffset, data_offset);
+
+	bitmap = malloc(CAPTURE_BITMAP_SIZE);
+	if (bitmap == NULL)
+		goto out;
+	do {
+		if (!DeviceIoControl(hVolume, FSCTL_GET_VOLUME_BITMAP, &lcn, sizeof(lcn), bitmap, CAPTURE_BITMAP_SIZE, &size, NULL) &&
+			(GetLastError() != ERROR_MORE_DATA)) {
+			uprintf("Could not get volume bitmap for %s: %s", volume_name, WindowsErrorString());
+			goto out;
+		}
+		nb_clusters = MIN((uint64_t)bitmap->BitmapSize.QuadPart, (size - offsetof(VOLUME_BITMAP_BUFFER, Buffer)) * 8ULL);
+		for (i = 0; i < nb_clusters; i += run) {
+			for (run = 0; (i + run < nb_clusters) && (bitmap->Buffer[(i + run) >> 3] & (1 << ((i + run) & 7))); run++);
+			MarkCaptureRange(PartitionOffset + data_offset + (bitmap->StartingLcn.QuadPart + i) * cluster_size, run * cluster_size);
+			if (run == 0)
+				run = 1;
+		}
+		lcn.StartingLcn.QuadPart = bitmap->StartingLcn.QuadPart + nb_clusters;
+	} while (nb_clusters < (uint64_t)bitmap->BitmapSize.QuadPart);
+	UnmountVolume(hVolume);
+	*hLockedVolume = hVolume;
+	hVolume = INVALID_HANDLE_VALUE;
+	r = TRUE;
+
+out:
+	safe_closehandle(hVolume);
+	free(bitmap);
+	free(volume_name);
+	return r;
+}
+
+// A thread compressing CAPTURE_CHUNK_SIZE chunks of a drive into gzip members
+typedef struct {
+	HANDLE hThread;
+	HANDLE hStart;
+	HANDLE hDone;
+	gzip_ctx* ctx;
+	uint8_t* in;
+	uint8_t* out;
+	DWORD in_size;
+	size_t out_size;
+	volatile BOOL quit;
+} capture_worker_t;
+
+// The gzip member for a chunk of zeroes, which most of the unused parts of a drive are
+static uint8_t* capture_zero_member = NULL;
+static size_t capture_zero_member_size = 0;
+
+static DWORD WINAPI CaptureCompressThread(void* param)
+{
+	capture_worker_t* w = (capture_worker_t*)param;
+
+	while ((WaitForSingleObject(w->hStart, INFINITE) == WAIT_OBJECT_0) && !w->quit) {
+		if ((w->in_size == CAPTURE_CHUNK_SIZE) && is_zeroed(w->in, w->in_size)) {
+			memcpy(w->out, capture_zero_member, capture_zero_member_size);
+			w->out_size = capture_zero_member_size;
+		} else {
+			w->out_size = GzipCompress(w->ctx, w->in, w->in_size, w->out, GZIP_BOUND(CAPTURE_CHUNK_SIZE));
+		}
+		SetEvent(w->hDone);
+	}
+	ExitThread(0);
+}
+
+// Read a chunk of the drive, where the blocks that the file systems don't use are zeroed
+static BOOL ReadCaptureChunk(HANDLE hSource, uint64_t offset, uint8_t* buf, DWORD size)
+{
+	uint64_t block;
+	DWORD pos, len, read_size;
+
+	for (pos = 0; pos < size; pos += len) {
+		block = (offset + pos) / CAPTURE_BLOCK_SIZE;
+		len = MIN(CAPTURE_BLOCK_SIZE, size - pos);
+		if (!IsCaptureBlockUsed(block)) {
+			memset(&buf[pos], 0, len);
+			continue;
+		}
+		while ((pos + len < size) && IsCaptureBlockUsed(block + len / CAPTURE_BLOCK_SIZE))
+			len += MIN(CAPTURE_BLOCK_SIZE, size - pos - len);
+		((ASYNC_FD*)hSource)->Overlapped.Offset = offset + pos;
+		if (!ReadFileAsync(hSource, &buf[pos], len) || !WaitFileAsync(hSource, DRIVE_ACCESS_TIMEOUT) ||
+			!GetSizeAsync(hSource, &read_size) || (read_size != len))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Save the content of a drive as a gzip compressed DD image, that is made of one
+ * gzip member per chunk, so that chunks can be compressed in parallel. The unused
+ * parts of the drive are not read, and compressed as zeroes.
+ */
+static BOOL DdSaveCompressedImage(IMG_SAVE* img_save, HANDLE hSource, HANDLE hDestination)
+{
+	BOOL r = FALSE;
+	SYSTEM_INFO si;
+	capture_worker_t worker[CAPTURE_MAX_THREADS] = { 0 }, *w;
+	uint8_t* zero_buf = NULL;
+	gzip_ctx* ctx = NULL;
+	uint64_t n, nb_chunks, wb = 0;
+	DWORD i, nb_workers, written;
+
+	GetSystemInfo(&si);
+	nb_workers = MAX(1, MIN(si.dwNumberOfProcessors, CAPTURE_MAX_THREADS));
+	nb_chunks = (img_save->DeviceSize + CAPTURE_CHUNK_SIZE - 1) / CAPTURE_CHUNK_SIZE;
+
+	zero_buf = calloc(1, CAPTURE_CHUNK_SIZE);
+	capture_zero_member = malloc(GZIP_BOUND(CAPTURE_CHUNK_SIZE));
+	ctx = GzipCreateContext();
+	if ((zero_buf == NULL) || (capture_zero_member == NULL) || (ctx == NULL)) {
+		ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+		goto out;
+	}
+	capture_zero_member_size = GzipCompress(ctx, zero_buf, CAPTURE_CHUNK_SIZE, capture_zero_member,
+		GZIP_BOUND(CAPTURE_CHUNK_SIZE));
+	if_assert_fails(capture_zero_member_size != 0) {
+		ErrorStatus = RUFUS_ERROR(ERROR_INTERNAL_ERROR);
+		goto out;
+	}
+
+	for (i = 0; i < nb_workers; i++) {
+		w = &worker[i];
+		w->ctx = GzipCreateContext();
+		w->in = (uint8_t*)_mm_malloc(CAPTURE_CHUNK_SIZE, SelectedDrive.SectorSize);
+		w->out = malloc(GZIP_BOUND(CAPTURE_CHUNK_SIZE));
+		w->hStart = CreateEvent(NULL, FALSE, FALSE, NULL);
+		w->hDone = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if ((w->ctx == NULL) || (w->in == NULL) || (w->out == NULL) || (w->hStart == NULL) || (w->hDone == NULL)) {
+			ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+			goto out;
+		}
+		w->hThread = CreateThread(NULL, 0, CaptureCompressThread, w, 0, NULL);
+		if (w->hThread == NULL) {
+			uprintf("Unable to start compression thread: %s", WindowsErrorString());
+			ErrorStatus = RUFUS_ERROR(APPERR(ERROR_CANT_START_THREAD));
+			goto out;
+		}
+	}
+	uprintf("Compressing image using %d threads", nb_workers);
+
+	// Chunk n is compressed by worker n % nb_workers, so that the members can be
+	// written in order, while the next chunks are being compressed.
+	for (n = 0; n < nb_chunks + nb_workers; n++) {
+		w = &worker[n % nb_workers];
+		if (n >= nb_workers) {
+			if ((WaitForSingleObject(w->hDone, INFINITE) != WAIT_OBJECT_0) || (w->out_size == 0)) {
+				uprintf("Compression error");
+				ErrorStatus = RUFUS_ERROR(ERROR_INTERNAL_ERROR);
+				goto out;
+			}
+			if (!WriteFile(hDestination, w->out, (DWORD)w->out_size, &written, NULL) || (written != w->out_size)) {
+				uprintf("Write error: %s", WindowsErrorString());
+				ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+				goto out;
+			}
+			wb += w->in_size;
+			UpdateProgressWithInfo(OP_FORMAT, MSG_261, wb, img_save->DeviceSize);
+		}
+		CHECK_FOR_USER_CANCEL;
+		if (n >= nb_chunks)
+			continue;
+		w->in_size = (DWORD)MIN(CAPTURE_CHUNK_SIZE, img_save->DeviceSize - n * CAPTURE_CHUNK_SIZE);
+		if (!ReadCaptureChunk(hSource, n * CAPTURE_CHUNK_SIZE, w->in, w->in_size)) {
+			uprintf("Read error: %s", WindowsErrorString());
+			ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
+			goto out;
+		}
+		SetEvent(w->hStart);
+	}
+	r = TRUE;
+
+out:
+	for (i = 0; i < nb_workers; i++) {
+		w = &worker[i];
+		if (w->hThread != NULL) {
+			w->quit = TRUE;
+			SetEvent(w->hStart);
+			WaitForSingleObject(w->hThread, INFINITE);
+			CloseHandle(w->hThread);
+		}
+		safe_closehandle(w->hStart);
+		safe_closehandle(w->hDone);
+		GzipFreeContext(w->ctx);
+		safe_mm_free(w->in);
+		free(w->out);
+	}
+	GzipFreeContext(ctx);
+	free(zero_buf);
+	safe_free(capture_zero_member);
+	capture_zero_member_size = 0;
+	return r;
+}
+
+/*
+ * Save a drive to a DD image, that only contains the data that the partitions of
+ * the drive actually use. The blocks that the file systems consider free are not
+ * read, and are either left as holes when the target is an uncompressed image on
+ * an NTFS (sparse) file, or compressed as zeroes for a .img.gz image, so that a
+ * 64 GB drive that only holds a few GB of data can be saved very quickly.
+ */
+static DWORD WINAPI DdSaveImageThread(void* param)
+{
+	IMG_SAVE* img_save = (IMG_SAVE*)param;
+	HANDLE hSource = NULL, hDestination = INVALID_HANDLE_VALUE, hVolume[MAX_PARTITIONS];
+	FILE_SET_SPARSE_BUFFER sparse = { TRUE };
+	ULARGE_INTEGER free_space;
+	LARGE_INTEGER li;
+	BOOL is_sparse, is_compressed = (img_save->Type == VIRTUAL_STORAGE_TYPE_DEVICE_IMG_GZ);
+	DWORD size, written, buf_size = DD_BUFFER_SIZE;
+	uint8_t* buffer = NULL;
+	uint64_t block, nb, wb = 0, used_size = 0, cur_offset;
+	char path[MAX_PATH];
+	int i, j, cur = 0;
+
+	UpdateProgressWithInfoInit(NULL, FALSE);
+	for (i = 0; i < MAX_PARTITIONS; i++)
+		hVolume[i] = INVALID_HANDLE_VALUE;
+
+	// Build the map of the blocks we need to save
+	capture_nb_blocks = (img_save->DeviceSize + CAPTURE_BLOCK_SIZE - 1) / CAPTURE_BLOCK_SIZE;
+	capture_map = malloc((size_t)(capture_nb_blocks + 7) / 8);
+	if (capture_map == NULL) {
+		ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+		goto out;
+	}
+	// Everything that isn't a partition (partition tables, gaps) is always saved
+	memset(capture_map, 0xff, (size_t)(capture_nb_blocks + 7) / 8);
+	for (i = 0; i < MAX_PARTITIONS; i++) {
+		if (SelectedDrive.Partition[i].Size == 0)
+			continue;
+		// Don't process MBR extended partitions, that contain other partitions
+		for (j = 0; j < MAX_PARTITIONS; j++) {
+			if ((j != i) && (SelectedDrive.Partition[j].Size != 0) &&
+				(SelectedDrive.Partition[j].Offset >= SelectedDrive.Partition[i].Offset) &&
+				(SelectedDrive.Partition[j].Offset + SelectedDrive.Partition[j].Size <=
+				SelectedDrive.Partition[i].Offset + SelectedDrive.Partition[i].Size))
+				break;
+		}
+		if (j < MAX_PARTITIONS)
+			continue;
+		ClearCaptureRange(SelectedDrive.Partition[i].Offset, SelectedDrive.Partition[i].Size);
+		// The first and last sectors of a partition are always saved, since they may hold boot
+		// sectors (e.g. the NTFS backup boot sector) that are not part of the file system area.
+		MarkCaptureRange(SelectedDrive.Partition[i].Offset, SelectedDrive.SectorSize);
+		MarkCaptureRange(SelectedDrive.Partition[i].Offset + SelectedDrive.Partition[i].Size -
+			SelectedDrive.SectorSize, SelectedDrive.SectorSize);
+		if (!MarkVolumeUsedRanges(img_save->DeviceNum, SelectedDrive.Partition[i].Offset, &hVolume[i]) &&
+			!GetExtFsUsedRanges(img_save->DeviceNum, SelectedDrive.Partition[i].Offset, MarkCaptureRange)) {
+			uprintf("Partition %d: Unknown file system allocation - saving all of it", i + 1);
+			MarkCaptureRange(SelectedDrive.Partition[i].Offset, SelectedDrive.Partition[i].Size);
+		}
+		CHECK_FOR_USER_CANCEL;
+	}
+	for (block = 0; block < capture_nb_blocks; block++)
+		if (IsCaptureBlockUsed(block))
+			used_size += MIN(CAPTURE_BLOCK_SIZE, img_save->DeviceSize - block * CAPTURE_BLOCK_SIZE);
+	uprintf("Saving %s of data (%.1f%% of the drive)", SizeToHumanReadable(used_size, FALSE, FALSE),
+		(100.0 * used_size) / img_save->DeviceSize);
+
+	hSource = CreateFileAsync(img_save->DevicePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN);
+	if (hSource == NULL) {
+		uprintf("Could not open '%s': %s", img_save->DevicePath, WindowsErrorString());
+		ErrorStatus = RUFUS_ERROR(ERROR_OPEN_FAILED);
+		goto out;
+	}
+	hDestination = CreateFileU(img_save->ImagePath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+		NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hDestination == INVALID_HANDLE_VALUE) {
+		uprintf("Could not create '%s': %s", img_save->ImagePath, WindowsErrorString());
+		ErrorStatus = RUFUS_ERROR(ERROR_OPEN_FAILED);
+		goto out;
+	}
+
+	if (is_compressed) {
+		if (DdSaveCompressedImage(img_save, hSource, hDestination)) {
+			li.QuadPart = 0;
+			if (SetFilePointerEx(hDestination, li, &li, FILE_CURRENT))
+				uprintf("Compressed image size: %s (%.1f%% of the drive)", SizeToHumanReadable(li.QuadPart, FALSE, FALSE),
+					(100.0 * li.QuadPart) / img_save->DeviceSize);
+			uprintf("Saved '%s'", img_save->ImagePath);
+		}
+		goto out;
+	}
+
+	// If the target file system doesn't support sparse files, we need room for the whole drive
+	is_sparse = DeviceIoControl(hDestination, FSCTL_SET_SPARSE, &sparse, sizeof(sparse), NULL, 0, &size, NULL);
+	free_space.QuadPart = 0;
+	if ((GetVolumePathNameA(img_save->ImagePath, path, sizeof(path))) &&
+		(GetDiskFreeSpaceExA(path, &free_space, NULL, NULL)) &&
+		(free_space.QuadPart < (is_sparse ? used_size : (uint64_t)img_save->DeviceSize))) {
+		uprintf("Not enough space to save the image on the target drive");
+		ErrorStatus = RUFUS_ERROR(ERROR_DISK_FULL);
+		goto out;
+	}
+
+	buffer = (uint8_t*)_mm_malloc(2 * buf_size, SelectedDrive.SectorSize);
+	if (buffer == NULL) {
+		ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+		goto out;
+	}
+
+	// Read the next run of used blocks, while we write the previous one
+	block = 0;
+	nb = GetNextCaptureRun(&block, buf_size / CAPTURE_BLOCK_SIZE);
+	((ASYNC_FD*)hSource)->Overlapped.Offset = block * CAPTURE_BLOCK_SIZE;
+	if (nb != 0)
+		ReadFileAsync(hSource, buffer, (DWORD)MIN(nb * CAPTURE_BLOCK_SIZE, img_save->DeviceSize - block * CAPTURE_BLOCK_SIZE));
+	while (nb != 0) {
+		cur_offset = block * CAPTURE_BLOCK_SIZE;
+		if (!WaitFileAsync(hSource, DRIVE_ACCESS_TIMEOUT) || !GetSizeAsync(hSource, &size) ||
+			(size != MIN(nb * CAPTURE_BLOCK_SIZE, img_save->DeviceSize - cur_offset))) {
+			uprintf("Read error: %s", WindowsErrorString());
+			ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
+			goto out;
+		}
+		block += nb;
+		nb = GetNextCaptureRun(&block, buf_size / CAPTURE_BLOCK_SIZE);
+		if (nb != 0) {
+			((ASYNC_FD*)hSource)->Overlapped.Offset = block * CAPTURE_BLOCK_SIZE;
+			ReadFileAsync(hSource, &buffer[(cur ^ 1) * buf_size],
+				(DWORD)MIN(nb * CAPTURE_BLOCK_SIZE, img_save->DeviceSize - block * CAPTURE_BLOCK_SIZE));
+		}
+		// Zeroed blocks can also be left as holes
+		if (!is_zeroed(&buffer[cur * buf_size], size)) {
+			li.QuadPart = cur_offset;
+			if (!SetFilePointerEx(hDestination, li, NULL, FILE_BEGIN) ||
+				!WriteFile(hDestination, &buffer[cur * buf_size], size, &written, NULL) || (written != size)) {
+				uprintf("Write error: %s", WindowsErrorString());
+				ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+				goto out;
+			}
+		}
+		cur ^= 1;
+		wb += size;
+		UpdateProgressWithInfo(OP_FORMAT, MSG_261, wb, used_size);
+		CHECK_FOR_USER_CANCEL;
+	}
+	li.QuadPart = img_save->DeviceSize;
+	if (!SetFilePointerEx(hDestination, li, NULL, FILE_BEGIN) || !SetEndOfFile(hDestination)) {
+		uprintf("Could not set image size: %s", WindowsErrorString());
+		ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+		goto out;
+	}
+	UpdateProgressWithInfo(OP_FORMAT, MSG_261, used_size, used_size);
+	uprintf("Saved '%s'", img_save->ImagePath);
+
+out:
+	CloseFileAsync(hSource);
+	safe_closehandle(hDestination);
+	// Unlock the source volumes, which remounts them
+	for (i = 0; i < MAX_PARTITIONS; i++)
+		safe_closehandle(hVolume[i]);
+	if (IS_ERROR(ErrorStatus))
+		DeleteFileU(img_save->ImagePath);
+	safe_mm_free(buffer);
+	safe_free(capture_map);
+	safe_free(img_save->DevicePath);
+	safe_free(img_save->ImagePath);
+	PostMessage(hMainDialog, UM_FORMAT_COMPLETED, (WPARAM)TRUE, 0);
+	ExitThread(IS_ERROR(ErrorStatus) ? SCODE_CODE(ErrorStatus) : 0);
+}
+
 BOOL SaveImage(void)
 {
 	UINT i;
 	static IMG_SAVE img_save;
 	char filename[128], letters[27], path[MAX_PATH];
 	int DriveIndex = ComboBox_GetCurSel(hDeviceList);
-	enum { image_type_none = 0, image_type_vhd, image_type_vhdx, image_type_ffu, image_type_iso };
-	static EXT_DECL(img_ext, filename, __VA_GROUP__("*.vhd", "*.vhdx", "*.ffu", "*.iso"),
-		__VA_GROUP__(lmprintf(MSG_343), lmprintf(MSG_342), lmprintf(MSG_344), lmprintf(MSG_036)));
-	int i_to_type[5] = { image_type_none, image_type_vhd, image_type_vhdx, image_type_ffu, image_type_iso };
+	enum { image_type_none = 0, image_type_vhd, image_type_vhdx, image_type_img, image_type_img_gz, image_type_ffu, image_type_iso };
+	static EXT_DECL(img_ext, filename, __VA_GROUP__("*.vhd", "*.vhdx", "*.img", "*.img.gz", "*.ffu", "*.iso"),
+		__VA_GROUP__(lmprintf(MSG_343), lmprintf(MSG_342), lmprintf(MSG_095), lmprintf(MSG_358), lmprintf(MSG_344), lmprintf(MSG_036)));
+	int i_to_type[7] = { image_type_none, image_type_vhd, image_type_vhdx, image_type_img, image_type_img_gz, image_type_ffu, image_type_iso };
 	ULARGE_INTEGER free_space;
 
 	memset(&img_save, 0, sizeof(IMG_SAVE));
@@ -607,7 +1511,7 @@ BOOL SaveImage(void)
 	static_sprintf(filename, "%s", rufus_drive[DriveIndex].label);
 	img_save.DeviceNum = (DWORD)ComboBox_GetItemData(hDeviceList, DriveIndex);
 	img_save.DevicePath = GetPhysicalName(img_save.DeviceNum);
-	img_ext.count = 2;
+	img_ext.count = 4;
 	// FFU support requires GPT
 	if (has_ffu_support && SelectedDrive.PartitionStyle == PARTITION_STYLE_GPT) {
 		img_ext.count += 1;
@@ -643,6 +1547,12 @@ BOOL SaveImage(void)
 	case image_type_vhd:
 		img_save.Type = VIRTUAL_STORAGE_TYPE_DEVICE_VHD;
 		break;
+	case image_type_img:
+		img_save.Type = VIRTUAL_STORAGE_TYPE_DEVICE_IMG;
+		break;
+	case image_type_img_gz:
+		img_save.Type = VIRTUAL_STORAGE_TYPE_DEVICE_IMG_GZ;
+		break;
 	case image_type_ffu:
 		img_save.Type = VIRTUAL_STORAGE_TYPE_DEVICE_FFU;
 		break;
@@ -688,7 +1598,9 @@ BOOL SaveImage(void)
 		ErrorStatus = 0;
 		InitProgress(TRUE);
 		format_thread = CreateThread(NULL, 0, img_save.Type == VIRTUAL_STORAGE_TYPE_DEVICE_FFU ?
-			FfuSaveImageThread : (img_save.Type == VIRTUAL_STORAGE_TYPE_DEVICE_ISO ? IsoSaveImageThread : VhdSaveImageThread),
+			FfuSaveImageThread : (img_save.Type == VIRTUAL_STORAGE_TYPE_DEVICE_ISO ? IsoSaveImageThread :
+			((img_save.Type == VIRTUAL_STORAGE_TYPE_DEVICE_IMG) || (img_save.Type == VIRTUAL_STORAGE_TYPE_DEVICE_IMG_GZ) ?
+			DdSaveImageThread : VhdSaveImageThread)),
 			&img_save, 0, NULL);
 		if (format_thread != NULL) {
 			uprintf("\r\nSave to image operation started");
@@ -21,6 +21,8 @@
 #include <windows.h>
 #include <virtdisk.h>
 
+#include "vdisk.h"
+
 #pragma once
 
 // Someone's going to have to explain to me why trying to define ANY static inline function
@@ -33,9 +35,20 @@
 #endif
 
 #define WIM_MAGIC							0x0000004D4957534DULL	// "MSWIM\0\0\0"
+#define WIM_SOLID_CACHE_SIZE					(128 * MB)	// Decompressed solid resource data kept across WimExtractFile() calls
+#define WIM_CACHE_DIR						"wim_cache"	// Subdirectory of FILES_DIR where parsed WIM data is cached
+#define WIM_CACHE_MAX_FILE_SIZE				(16 * MB)	// Maximum size of a file extracted from a WIM that we cache
+#define WIM_CACHE_MAX_AGE					30			// Number of days after which an unused WIM cache entry is removed
+
+#define CAPTURE_BLOCK_SIZE					(64 * KB)	// Granularity at which we look for the used parts of a drive
+#define CAPTURE_BITMAP_SIZE					(1 * MB)	// Size of the buffer for volume bitmap queries
+#define CAPTURE_CHUNK_SIZE					(1 * MB)	// Size of the chunks we compress in parallel for .img.gz images
+#define CAPTURE_MAX_THREADS					16			// Maximum number of threads compressing .img.gz images
 
 #define MBR_SIZE							512	// Might need to review this once we see bootable 4k systems
 
+#define VIRTUAL_STORAGE_TYPE_DEVICE_IMG_GZ                 97
+#define VIRTUAL_STORAGE_TYPE_DEVICE_IMG                    98
 #define VIRTUAL_STORAGE_TYPE_DEVICE_FFU                    99
 #define CREATE_VIRTUAL_DISK_VERSION_2                       2
 #define CREATE_VIRTUAL_DISK_FLAG_CREATE_BACKING_STORAGE     8
@@ -103,14 +116,38 @@ enum WIMMessage {
 	WIM_MSG_ABORT_IMAGE = -1
 };
 
+/* Block map (bmaptool's .bmap) of the ranges of a disk image that contain data */
+typedef struct {
+	uint64_t start;						// Byte offsets in the image
+	uint64_t end;						// (excluded)
+	uint8_t checksum[MAX_HASHSIZE];
+} bmap_range_t;
+
+typedef struct {
+	uint64_t image_size;
+	uint64_t mapped_size;
+	uint32_t block_size;
+	uint32_t nb_ranges;
+	int checksum_type;					// HASH_SHA1 or HASH_SHA256
+	bmap_range_t* range;
+} bmap_t;
+
+extern bmap_t* LoadBmap(const char* image_path);
+extern void FreeBmap(bmap_t* bmap);
+extern BOOL GetWininstImagePath(int index, char* wim_path, size_t wim_path_size);
+extern BOOL GetWimCachePath(const char* image, const char* name, char* path, size_t path_size);
+extern void PurgeWimCache(void);
 extern uint32_t GetWimVersion(const char* image);
 extern BOOL WimExtractFile(const char* wim_image, int index, const char* src, const char* dst);
+extern void WimReleaseImage(void);
 extern BOOL WimApplyImage(const char* image, int index, const char* dst);
 extern BOOL WimSplitFile(const char* src, const char* dst);
 extern int8_t IsBootableImage(const char* path);
 extern char* VhdMountImageAndGetSize(const char* path, uint64_t* disksize);
 #define VhdMountImage(path) VhdMountImageAndGetSize(path, NULL)
 extern void VhdUnmountImage(void);
+extern vdisk_t* VhdOpenImage(const char* path);
+extern void VhdCloseImage(vdisk_t* vd);
 extern BOOL SaveImage(void);
 extern void OpticalDiscSaveImage(void);
 extern DWORD WINAPI IsoSaveImageThread(void* param);
@@ -48,20 +48,39 @@
 #include "wimlib/win32.h"
 #include "wimlib/write.h"
 
-/* A hash table mapping SHA-1 message digests to blob descriptors  */
+/* A slot of the blob table.  The prefix of the SHA-1 message digest is kept
+ * next to the pointer, so that probing the table doesn't have to touch the
+ * blob descriptors which don't match.  */
+struct blob_table_slot {
+	size_t hash_short;
+	struct blob_descriptor *blob;
+};
+
+/* Marker for a slot whose blob descriptor was unlinked from the table.  The
+ * slot can be reused by an insertion, but it doesn't end a probe sequence.  */
+#define BLOB_TABLE_DELETED	((struct blob_descriptor *)&blob_table_deleted)
+static const u8 blob_table_deleted;
+
+/* A hash table mapping SHA-1 message digests to blob descriptors.  This uses
+ * open addressing with linear probing, rather than a bucket list per slot, as
+ * WIM files can have hundreds of thousands of blobs.  */
 struct blob_table {
-	struct hlist_head *array;
+	struct blob_table_slot *array;
 	size_t num_blobs;
+	size_t num_deleted;
 	size_t mask; /* capacity - 1; capacity is a power of 2  */
 };
 
+/* Maximum number of used slots, including the deleted ones, for a capacity  */
+#define BLOB_TABLE_MAX_LOAD(capacity)	((capacity) - ((capacity) >> 2))
+
 struct blob_table *
 new_blob_table(size_t capacity)
 {
 	struct blob_table *table;
-	struct hlist_head *array;
+	struct blob_table_slot *array;
 
-	capacity = roundup_pow_of_2(capacity);
+	capacity = roundup_pow_of_2(max(capacity + (capacity >> 1), (size_t)16));
 
 	table = MALLOC(sizeof(struct blob_table));
 	if (table == NULL)
@@ -74,6 +93,7 @@ new_blob_table(size_t capacity)
 	}
 
 	table->num_blobs = 0;
+	table->num_deleted = 0;
 	table->mask = capacity - 1;
 	table->array = array;
 	return table;
@@ -298,55 +318,91 @@ blob_decrement_num_opened_fds(struct blob_descriptor *blob)
 }
 #endif
 
+/* Insert a blob descriptor in the first free slot of its probe sequence.  A
+ * deleted slot is reused rather than an empty one whenever possible, so that
+ * the table never runs out of empty slots, which terminate the lookups.  */
 static void
 blob_table_insert_raw(struct blob_table *table, struct blob_descriptor *blob)
 {
 	size_t i = blob->hash_short & table->mask;
 
-	hlist_add_head(&blob->hash_list, &table->array[i]);
+	while (table->array[i].blob != NULL &&
+	       table->array[i].blob != BLOB_TABLE_DELETED)
+		i = (i + 1) & table->mask;
+	if (table->array[i].blob == BLOB_TABLE_DELETED)
+		table->num_deleted--;
+	table->array[i].hash_short = blob->hash_short;
+	table->array[i].blob = blob;
 }
 
-static void
-enlarge_blob_table(struct blob_table *table)
+/* Rehash the table into a new array, which is larger if the table is mostly
+ * full of blobs rather than of deleted slots.  */
+static int
+rehash_blob_table(struct blob_table *table)
 {
 	size_t old_capacity, new_capacity;
-	struct hlist_head *old_array, *new_array;
-	struct blob_descriptor *blob;
-	struct hlist_node *tmp;
+	struct blob_table_slot *old_array, *new_array;
 	size_t i;
 
 	old_capacity = table->mask + 1;
-	new_capacity = old_capacity * 2;
-	new_array = CALLOC(new_capacity, sizeof(struct hlist_head));
+	new_capacity = old_capacity;
+	while (table->num_blobs + 1 > BLOB_TABLE_MAX_LOAD(new_capacity) / 2)
+		new_capacity *= 2;
+	new_array = CALLOC(new_capacity, sizeof(new_array[0]));
 	if (new_array == NULL)
-		return;
+		return WIMLIB_ERR_NOMEM;
 	old_array = table->array;
 	table->array = new_array;
 	table->mask = new_capacity - 1;
+	table->num_deleted = 0;
 
 	for (i = 0; i < old_capacity; i++)
-		hlist_for_each_entry_safe(blob, tmp, &old_array[i], hash_list)
-			blob_table_insert_raw(table, blob);
+		if (old_array[i].blob != NULL &&
+		    old_array[i].blob != BLOB_TABLE_DELETED)
+			blob_table_insert_raw(table, old_array[i].blob);
 	FREE(old_array);
+	return 0;
 }
 
-/* Insert a blob descriptor into the blob table.  */
-void
+/* Insert a blob descriptor into the blob table.  Returns 0 on success or
+ * WIMLIB_ERR_NOMEM if the table is full and could not be grown, in which case
+ * the blob descriptor is still owned by the caller.  */
+int
 blob_table_insert(struct blob_table *table, struct blob_descriptor *blob)
 {
+	int ret;
+
+	/* If the table can't be rehashed, go on with a higher load: lookups
+	 * will just be slower.  */
+	if (table->num_blobs + table->num_deleted + 1 >
+	    BLOB_TABLE_MAX_LOAD(table->mask + 1)) {
+		ret = rehash_blob_table(table);
+		/* But never fill the last empty slot.  */
+		if (unlikely(ret &&
+			     table->num_blobs + table->num_deleted + 1 > table->mask))
+			return ret;
+	}
 	blob_table_insert_raw(table, blob);
-	if (table->num_blobs++ > table->mask)
-		enlarge_blob_table(table);
+	table->num_blobs++;
+	return 0;
 }
 
 /* Unlinks a blob descriptor from the blob table; does not free it.  */
 void
 blob_table_unlink(struct blob_table *table, struct blob_descriptor *blob)
 {
+	size_t i;
+
 	wimlib_assert(!blob->unhashed);
 	wimlib_assert(table->num_blobs != 0);
 
-	hlist_del(&blob->hash_list);
+	i = blob->hash_short & table->mask;
+	while (table->array[i].blob != blob) {
+		wimlib_assert(table->array[i].blob != NULL);
+		i = (i + 1) & table->mask;
+	}
+	table->array[i].blob = BLOB_TABLE_DELETED;
+	table->num_deleted++;
 	table->num_blobs--;
 }
 
@@ -355,34 +411,39 @@ blob_table_unlink(struct blob_table *table, struct blob_descriptor *blob)
 struct blob_descriptor *
 lookup_blob(const struct blob_table *table, const u8 *hash)
 {
+	const size_t hash_short = load_size_t_unaligned(hash);
+	const struct blob_table_slot *slot;
 	size_t i;
-	struct blob_descriptor *blob;
 
-	i = load_size_t_unaligned(hash) & table->mask;
-	hlist_for_each_entry(blob, &table->array[i], hash_list)
-		if (hashes_equal(hash, blob->hash))
-			return blob;
-	return NULL;
+	for (i = hash_short & table->mask; ; i = (i + 1) & table->mask) {
+		slot = &table->array[i];
+		if (slot->blob == NULL)
+			return NULL;
+		if (slot->hash_short == hash_short &&
+		    slot->blob != BLOB_TABLE_DELETED &&
+		    hashes_equal(hash, slot->blob->hash))
+			return slot->blob;
+	}
 }
 
 /* Call a function on all blob descriptors in the specified blob table.  Stop
- * early and return nonzero if any call to the function returns nonzero.  */
+ * early and return nonzero if any call to the function returns nonzero.  The
+ * function may unlink the blob descriptor it is called on, but not insert any
+ * new one.  */
 int
 for_blob_in_table(struct blob_table *table,
 		  int (*visitor)(struct blob_descriptor *, void *), void *arg)
 {
 	struct blob_descriptor *blob;
-	struct hlist_node *tmp;
 	int ret;
 
 	for (size_t i = 0; i <= table->mask; i++) {
-		hlist_for_each_entry_safe(blob, tmp, &table->array[i],
-					  hash_list)
-		{
-			ret = visitor(blob, arg);
-			if (ret)
-				return ret;
-		}
+		blob = table->array[i].blob;
+		if (blob == NULL || blob == BLOB_TABLE_DELETED)
+			continue;
+		ret = visitor(blob, arg);
+		if (ret)
+			return ret;
 	}
 	return 0;
 }
@@ -1071,7 +1132,8 @@ read_blob_table(WIMStruct *wim)
 
 			/* Insert the blob into the in-memory blob table, keyed
 			 * by its SHA-1 message digest.  */
-			blob_table_insert(table, cur_blob);
+			if (blob_table_insert(table, cur_blob))
+				goto oom;
 		}
 
 		continue;
@@ -1255,7 +1317,10 @@ new_blob_from_data_buffer(const void *buffer, size_t size,
 	}
 	blob_set_is_located_in_attached_buffer(blob, buffer_copy, size);
 	copy_hash(blob->hash, hash);
-	blob_table_insert(blob_table, blob);
+	if (blob_table_insert(blob_table, blob)) {
+		free_blob_descriptor(blob);
+		return NULL;
+	}
 	return blob;
 }
 
@@ -1266,12 +1331,12 @@ after_blob_hashed(struct blob_descriptor *blob,
 {
 	struct blob_descriptor *duplicate_blob;
 
-	list_del(&blob->unhashed_list);
-	blob->unhashed = 0;
-
 	/* Look for a duplicate blob  */
 	duplicate_blob = lookup_blob(blob_table, blob->hash);
 	if (duplicate_blob) {
+		list_del(&blob->unhashed_list);
+		blob->unhashed = 0;
+
 		/* We have a duplicate blob.  Transfer the reference counts from
 		 * this blob to the duplicate and update the reference to this
 		 * blob (from a stream) to point to the duplicate.  The caller
@@ -1292,8 +1357,13 @@ after_blob_hashed(struct blob_descriptor *blob,
 		return duplicate_blob;
 	} else {
 		/* No duplicate blob, so we need to insert this blob into the
-		 * blob table and treat it as a hashed blob.  */
-		blob_table_insert(blob_table, blob);
+		 * blob table and treat it as a hashed blob.  If that fails, the
+		 * blob stays in the list of unhashed blobs, to be freed with
+		 * it.  */
+		if (blob_table_insert(blob_table, blob))
+			return NULL;
+		list_del(&blob->unhashed_list);
+		blob->unhashed = 0;
 		return blob;
 	}
 }
@@ -1312,7 +1382,8 @@ after_blob_hashed(struct blob_descriptor *blob,
  *	this location.  This will be the same as @blob if it was inserted into
  *	the blob table, or different if a duplicate blob was found.
  *
- * Returns 0 on success; nonzero if there is an error reading the blob data.
+ * Returns 0 on success; nonzero if there is an error reading the blob data or
+ * if the blob could not be inserted into the blob table.
  */
 int
 hash_unhashed_blob(struct blob_descriptor *blob, struct blob_table *blob_table,
@@ -1330,6 +1401,8 @@ hash_unhashed_blob(struct blob_descriptor *blob, struct blob_table *blob_table,
 		return ret;
 
 	*blob_ret = after_blob_hashed(blob, back_ptr, blob_table, inode);
+	if (!*blob_ret)
+		return WIMLIB_ERR_NOMEM;
 	return 0;
 }
 
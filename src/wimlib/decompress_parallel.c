@@ -0,0 +1,556 @@
+/*
+ * decompress_parallel.c
+ *
+ * Decompress chunks of data (parallel version).
+ */
+
+/*
+ * Copyright (C) 2013-2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wimlib.h"
+#include "wimlib/assert.h"
+#include "wimlib/chunk_decompressor.h"
+#include "wimlib/error.h"
+#include "wimlib/list.h"
+#include "wimlib/threads.h"
+#include "wimlib/util.h"
+
+struct message_queue {
+	struct list_head list;
+	struct mutex lock;
+	struct condvar msg_avail_cond;
+	bool terminating;
+};
+
+struct decompressor_thread_data {
+	struct thread thread;
+	struct parallel_chunk_decompressor *ctx;
+	struct wimlib_decompressor *decompressor;
+};
+
+#define MAX_CHUNKS_PER_MSG 16
+
+struct message {
+	u8 *compressed_chunks[MAX_CHUNKS_PER_MSG];
+	u8 *uncompressed_chunks[MAX_CHUNKS_PER_MSG];
+	u32 compressed_chunk_sizes[MAX_CHUNKS_PER_MSG];
+	u32 uncompressed_chunk_sizes[MAX_CHUNKS_PER_MSG];
+	u64 chunk_tags[MAX_CHUNKS_PER_MSG];
+	int chunk_status[MAX_CHUNKS_PER_MSG];
+	size_t num_filled_chunks;
+	size_t num_alloc_chunks;
+	struct list_head list;
+	bool complete;
+	struct list_head submission_list;
+};
+
+struct parallel_chunk_decompressor {
+	int ctype;
+	u32 chunk_size;
+	bool recover_data;
+
+	struct message_queue chunks_to_decompress_queue;
+	struct message_queue decompressed_chunks_queue;
+	struct decompressor_thread_data *thread_data;
+	unsigned num_thread_data;
+	unsigned num_started_threads;
+
+	struct message *msgs;
+	size_t num_messages;
+
+	struct list_head available_msgs;
+	struct list_head submitted_msgs;
+	struct message *next_submit_msg;
+	struct message *next_ready_msg;
+	size_t next_chunk_idx;
+};
+
+int
+decompress_chunk(const void *cbuf, u32 chunk_csize, u8 *ubuf, u32 chunk_usize,
+		 struct wimlib_decompressor *decompressor, bool recover_data)
+{
+	int res = wimlib_decompress(cbuf, chunk_csize, ubuf, chunk_usize,
+				    decompressor);
+	if (likely(res == 0))
+		return 0;
+
+	if (recover_data) {
+		WARNING("Failed to decompress data!  Continuing anyway since data recovery mode is enabled.");
+
+		/* Continue on with *something*.  In the worst case just use a
+		 * zeroed buffer.  But, try to fill as much of it with
+		 * decompressed data as we can.  This works because if the
+		 * corruption isn't located right at the beginning of the
+		 * compressed chunk, wimlib_decompress() may write some correct
+		 * output at the beginning even if it fails later.  */
+		memset(ubuf, 0, chunk_usize);
+		(void)wimlib_decompress(cbuf, chunk_csize, ubuf,
+					chunk_usize, decompressor);
+		return 0;
+	}
+	ERROR("Failed to decompress data!");
+	errno = EINVAL;
+	return WIMLIB_ERR_DECOMPRESSION;
+}
+
+static int
+message_queue_init(struct message_queue *q)
+{
+	if (!mutex_init(&q->lock))
+		goto err;
+	if (!condvar_init(&q->msg_avail_cond))
+		goto err_destroy_lock;
+	INIT_LIST_HEAD(&q->list);
+	return 0;
+
+err_destroy_lock:
+	mutex_destroy(&q->lock);
+err:
+	return WIMLIB_ERR_NOMEM;
+}
+
+static void
+message_queue_destroy(struct message_queue *q)
+{
+	if (q->list.next != NULL) {
+		mutex_destroy(&q->lock);
+		condvar_destroy(&q->msg_avail_cond);
+	}
+}
+
+static void
+message_queue_put(struct message_queue *q, struct message *msg)
+{
+	mutex_lock(&q->lock);
+	list_add_tail(&msg->list, &q->list);
+	condvar_signal(&q->msg_avail_cond);
+	mutex_unlock(&q->lock);
+}
+
+static struct message *
+message_queue_get(struct message_queue *q)
+{
+	struct message *msg;
+
+	mutex_lock(&q->lock);
+	while (list_empty(&q->list) && !q->terminating)
+		condvar_wait(&q->msg_avail_cond, &q->lock);
+	if (!q->terminating) {
+		msg = list_entry(q->list.next, struct message, list);
+		list_del(&msg->list);
+	} else
+		msg = NULL;
+	mutex_unlock(&q->lock);
+	return msg;
+}
+
+static void
+message_queue_terminate(struct message_queue *q)
+{
+	mutex_lock(&q->lock);
+	q->terminating = true;
+	condvar_broadcast(&q->msg_avail_cond);
+	mutex_unlock(&q->lock);
+}
+
+static int
+init_message(struct message *msg, size_t num_chunks, u32 chunk_size)
+{
+	msg->num_alloc_chunks = num_chunks;
+	for (size_t i = 0; i < num_chunks; i++) {
+		msg->compressed_chunks[i] = MALLOC(chunk_size - 1);
+		msg->uncompressed_chunks[i] = MALLOC(chunk_size);
+		if (msg->compressed_chunks[i] == NULL ||
+		    msg->uncompressed_chunks[i] == NULL)
+			return WIMLIB_ERR_NOMEM;
+	}
+	return 0;
+}
+
+static void
+destroy_message(struct message *msg)
+{
+	for (size_t i = 0; i < msg->num_alloc_chunks; i++) {
+		FREE(msg->compressed_chunks[i]);
+		FREE(msg->uncompressed_chunks[i]);
+	}
+}
+
+static void
+free_messages(struct message *msgs, size_t num_messages)
+{
+	if (msgs) {
+		for (size_t i = 0; i < num_messages; i++)
+			destroy_message(&msgs[i]);
+		FREE(msgs);
+	}
+}
+
+static struct message *
+allocate_messages(size_t count, size_t chunks_per_msg, u32 chunk_size)
+{
+	struct message *msgs;
+
+	msgs = CALLOC(count, sizeof(struct message));
+	if (msgs == NULL)
+		return NULL;
+	for (size_t i = 0; i < count; i++) {
+		if (init_message(&msgs[i], chunks_per_msg, chunk_size)) {
+			free_messages(msgs, count);
+			return NULL;
+		}
+	}
+	return msgs;
+}
+
+static void
+decompress_chunks(struct message *msg, struct wimlib_decompressor *decompressor,
+		  bool recover_data)
+{
+	for (size_t i = 0; i < msg->num_filled_chunks; i++) {
+		/* Chunks that didn't compress were read directly into the
+		 * uncompressed buffer.  */
+		if (msg->compressed_chunk_sizes[i] == msg->uncompressed_chunk_sizes[i]) {
+			msg->chunk_status[i] = 0;
+			continue;
+		}
+		msg->chunk_status[i] =
+			decompress_chunk(msg->compressed_chunks[i],
+					 msg->compressed_chunk_sizes[i],
+					 msg->uncompressed_chunks[i],
+					 msg->uncompressed_chunk_sizes[i],
+					 decompressor, recover_data);
+	}
+}
+
+static void *
+decompressor_thread_proc(void *arg)
+{
+	struct decompressor_thread_data *params = arg;
+	struct parallel_chunk_decompressor *ctx = params->ctx;
+	struct message *msg;
+
+	while ((msg = message_queue_get(&ctx->chunks_to_decompress_queue)) != NULL) {
+		decompress_chunks(msg, params->decompressor, ctx->recover_data);
+		message_queue_put(&ctx->decompressed_chunks_queue, msg);
+	}
+	return NULL;
+}
+
+void
+free_parallel_chunk_decompressor(struct parallel_chunk_decompressor *ctx)
+{
+	unsigned i;
+
+	if (ctx == NULL)
+		return;
+
+	if (ctx->num_started_threads != 0) {
+		message_queue_terminate(&ctx->chunks_to_decompress_queue);
+
+		for (i = 0; i < ctx->num_started_threads; i++)
+			thread_join(&ctx->thread_data[i].thread);
+	}
+
+	message_queue_destroy(&ctx->chunks_to_decompress_queue);
+	message_queue_destroy(&ctx->decompressed_chunks_queue);
+
+	if (ctx->thread_data != NULL)
+		for (i = 0; i < ctx->num_thread_data; i++)
+			wimlib_free_decompressor(ctx->thread_data[i].decompressor);
+
+	FREE(ctx->thread_data);
+
+	free_messages(ctx->msgs, ctx->num_messages);
+
+	FREE(ctx);
+}
+
+int
+parallel_chunk_decompressor_ctype(const struct parallel_chunk_decompressor *ctx)
+{
+	return ctx->ctype;
+}
+
+u32
+parallel_chunk_decompressor_chunk_size(const struct parallel_chunk_decompressor *ctx)
+{
+	return ctx->chunk_size;
+}
+
+void
+parallel_chunk_decompressor_set_recover_data(struct parallel_chunk_decompressor *ctx,
+					     bool recover_data)
+{
+	wimlib_assert(list_empty(&ctx->submitted_msgs));
+	ctx->recover_data = recover_data;
+}
+
+static void
+submit_decompression_msg(struct parallel_chunk_decompressor *ctx)
+{
+	struct message *msg = ctx->next_submit_msg;
+
+	msg->complete = false;
+	list_add_tail(&msg->submission_list, &ctx->submitted_msgs);
+	message_queue_put(&ctx->chunks_to_decompress_queue, msg);
+	ctx->next_submit_msg = NULL;
+}
+
+void *
+parallel_chunk_decompressor_get_chunk_buffer(struct parallel_chunk_decompressor *ctx,
+					     u32 csize, u32 usize, u64 tag)
+{
+	struct message *msg;
+	size_t i;
+
+	wimlib_assert(csize > 0 && csize <= usize);
+	wimlib_assert(usize <= ctx->chunk_size);
+
+	if (ctx->next_submit_msg) {
+		msg = ctx->next_submit_msg;
+	} else {
+		if (list_empty(&ctx->available_msgs))
+			return NULL;
+
+		msg = list_entry(ctx->available_msgs.next, struct message, list);
+		list_del(&msg->list);
+		ctx->next_submit_msg = msg;
+		msg->num_filled_chunks = 0;
+	}
+
+	i = msg->num_filled_chunks;
+	msg->compressed_chunk_sizes[i] = csize;
+	msg->uncompressed_chunk_sizes[i] = usize;
+	msg->chunk_tags[i] = tag;
+	if (csize == usize)
+		return msg->uncompressed_chunks[i];
+	return msg->compressed_chunks[i];
+}
+
+void
+parallel_chunk_decompressor_signal_chunk_filled(struct parallel_chunk_decompressor *ctx)
+{
+	struct message *msg;
+
+	wimlib_assert(ctx->next_submit_msg);
+
+	msg = ctx->next_submit_msg;
+	if (++msg->num_filled_chunks == msg->num_alloc_chunks)
+		submit_decompression_msg(ctx);
+}
+
+bool
+parallel_chunk_decompressor_get_result(struct parallel_chunk_decompressor *ctx,
+				       const void **udata_ret, u32 *usize_ret,
+				       u64 *tag_ret, int *status_ret)
+{
+	struct message *msg;
+
+	if (ctx->next_submit_msg) {
+		if (ctx->next_submit_msg->num_filled_chunks != 0) {
+			submit_decompression_msg(ctx);
+		} else {
+			list_add(&ctx->next_submit_msg->list, &ctx->available_msgs);
+			ctx->next_submit_msg = NULL;
+		}
+	}
+
+	if (ctx->next_ready_msg) {
+		msg = ctx->next_ready_msg;
+	} else {
+		if (list_empty(&ctx->submitted_msgs))
+			return false;
+
+		while (!(msg = list_entry(ctx->submitted_msgs.next,
+					  struct message,
+					  submission_list))->complete)
+			message_queue_get(&ctx->decompressed_chunks_queue)->complete = true;
+
+		ctx->next_ready_msg = msg;
+		ctx->next_chunk_idx = 0;
+	}
+
+	*udata_ret = msg->uncompressed_chunks[ctx->next_chunk_idx];
+	*usize_ret = msg->uncompressed_chunk_sizes[ctx->next_chunk_idx];
+	*tag_ret = msg->chunk_tags[ctx->next_chunk_idx];
+	*status_ret = msg->chunk_status[ctx->next_chunk_idx];
+
+	if (++ctx->next_chunk_idx == msg->num_filled_chunks) {
+		list_del(&msg->submission_list);
+		list_add_tail(&msg->list, &ctx->available_msgs);
+		ctx->next_ready_msg = NULL;
+	}
+	return true;
+}
+
+void
+parallel_chunk_decompressor_reset(struct parallel_chunk_decompressor *ctx)
+{
+	const void *udata;
+	u32 usize;
+	u64 tag;
+	int status;
+
+	/* Messages that are in flight can't be reclaimed before the threads
+	 * are done with them, so just wait for them and drop the data.  */
+	while (parallel_chunk_decompressor_get_result(ctx, &udata, &usize,
+						      &tag, &status))
+		;
+}
+
+int
+new_parallel_chunk_decompressor(int ctype, u32 chunk_size,
+				unsigned num_threads, u64 max_memory,
+				struct parallel_chunk_decompressor **decompressor_ret)
+{
+	u64 approx_mem_required;
+	size_t chunks_per_msg;
+	size_t msgs_per_thread;
+	struct parallel_chunk_decompressor *ctx;
+	unsigned i;
+	int ret;
+
+	wimlib_assert(chunk_size > 0);
+
+	if (num_threads == 0)
+		num_threads = get_available_cpus();
+
+	if (num_threads == 1)
+		return -1;
+
+	if (max_memory == 0)
+		max_memory = get_available_memory() / 4;
+
+	if (chunk_size < ((u32)1 << 23)) {
+		/* Relatively small chunks.  Use 2 messages per thread, each
+		 * with enough chunks for the threads not to be starved by the
+		 * overhead of the message queues.  */
+		chunks_per_msg = 2;
+		chunks_per_msg += num_threads * (65536 / chunk_size) / 16;
+		chunks_per_msg = max(chunks_per_msg, 2);
+		chunks_per_msg = min(chunks_per_msg, MAX_CHUNKS_PER_MSG);
+		msgs_per_thread = 2;
+	} else {
+		/* Big chunks (e.g. solid LZMS): the reader can only stay ahead
+		 * of the threads by one chunk each anyway.  */
+		chunks_per_msg = 1;
+		msgs_per_thread = 1;
+	}
+
+	/* The window of data in flight, which includes both the compressed
+	 * and uncompressed buffers, must fit in the memory we were given.
+	 * Reduce the window rather than the number of threads first.  */
+	for (;;) {
+		approx_mem_required =
+			(u64)chunks_per_msg *
+			(u64)msgs_per_thread *
+			(u64)num_threads *
+			(2 * (u64)chunk_size)
+			+ 1000000;
+		if (approx_mem_required <= max_memory)
+			break;
+
+		if (chunks_per_msg > 1)
+			chunks_per_msg--;
+		else if (msgs_per_thread > 1)
+			msgs_per_thread--;
+		else if (num_threads > 1)
+			num_threads--;
+		else
+			break;
+	}
+
+	if (num_threads == 1)
+		return -2;
+
+	ret = WIMLIB_ERR_NOMEM;
+	ctx = CALLOC(1, sizeof(*ctx));
+	if (ctx == NULL)
+		goto err;
+
+	ctx->ctype = ctype;
+	ctx->chunk_size = chunk_size;
+	ctx->num_thread_data = num_threads;
+	INIT_LIST_HEAD(&ctx->available_msgs);
+	INIT_LIST_HEAD(&ctx->submitted_msgs);
+
+	ret = message_queue_init(&ctx->chunks_to_decompress_queue);
+	if (ret)
+		goto err;
+
+	ret = message_queue_init(&ctx->decompressed_chunks_queue);
+	if (ret)
+		goto err;
+
+	ret = WIMLIB_ERR_NOMEM;
+	ctx->thread_data = CALLOC(num_threads, sizeof(ctx->thread_data[0]));
+	if (ctx->thread_data == NULL)
+		goto err;
+
+	for (i = 0; i < num_threads; i++) {
+		struct decompressor_thread_data *dat;
+
+		dat = &ctx->thread_data[i];
+
+		dat->ctx = ctx;
+		ret = wimlib_create_decompressor(ctype, chunk_size,
+						 &dat->decompressor);
+		if (ret)
+			goto err;
+	}
+
+	for (ctx->num_started_threads = 0;
+	     ctx->num_started_threads < num_threads;
+	     ctx->num_started_threads++)
+	{
+		if (!thread_create(&ctx->thread_data[ctx->num_started_threads].thread,
+				   decompressor_thread_proc,
+				   &ctx->thread_data[ctx->num_started_threads]))
+		{
+			ret = WIMLIB_ERR_NOMEM;
+			if (ctx->num_started_threads >= 2)
+				break;
+			goto err;
+		}
+	}
+
+	ret = WIMLIB_ERR_NOMEM;
+	ctx->num_messages = ctx->num_started_threads * msgs_per_thread;
+	ctx->msgs = allocate_messages(ctx->num_messages,
+				      chunks_per_msg, chunk_size);
+	if (ctx->msgs == NULL)
+		goto err;
+
+	for (size_t i = 0; i < ctx->num_messages; i++)
+		list_add_tail(&ctx->msgs[i].list, &ctx->available_msgs);
+
+	*decompressor_ret = ctx;
+	return 0;
+
+err:
+	free_parallel_chunk_decompressor(ctx);
+	return ret;
+}
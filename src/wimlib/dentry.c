@@ -228,12 +228,12 @@ static void
 do_dentry_set_name(struct wim_dentry *dentry, utf16lechar *name,
 		   size_t name_nbytes)
 {
-	FREE(dentry->d_name);
+	dentry_free_name(dentry, dentry->d_name);
 	dentry->d_name = name;
 	dentry->d_name_nbytes = name_nbytes;
 
 	if (dentry_has_short_name(dentry)) {
-		FREE(dentry->d_short_name);
+		dentry_free_name(dentry, dentry->d_short_name);
 		dentry->d_short_name = NULL;
 		dentry->d_short_name_nbytes = 0;
 	}
@@ -961,8 +961,8 @@ free_dentry(struct wim_dentry *dentry)
 {
 	if (dentry) {
 		d_disassociate(dentry);
-		FREE(dentry->d_name);
-		FREE(dentry->d_short_name);
+		dentry_free_name(dentry, dentry->d_name);
+		dentry_free_name(dentry, dentry->d_short_name);
 		FREE(dentry->d_full_path);
 		FREE(dentry);
 	}
@@ -1336,6 +1336,8 @@ read_dentry(const u8 * restrict buf, size_t buf_len,
 	struct wim_inode *inode;
 	u16 short_name_nbytes;
 	u16 name_nbytes;
+	u32 names_nbytes;
+	u8 *names;
 	u64 calculated_size;
 	int ret;
 
@@ -1372,12 +1374,40 @@ read_dentry(const u8 * restrict buf, size_t buf_len,
 		     offset + length < offset))
 		return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
 
-	/* Allocate new dentry structure, along with a preliminary inode.  */
-	ret = new_dentry_with_new_inode(NULL, false, &dentry);
-	if (ret)
-		return ret;
+	/* Get the lengths of the two names: the (long) file name, and the
+	 * short name.  */
+	short_name_nbytes = le16_to_cpu(disk_dentry->short_name_nbytes);
+	name_nbytes = le16_to_cpu(disk_dentry->name_nbytes);
 
-	inode = dentry->d_inode;
+	if (unlikely((short_name_nbytes & 1) | (name_nbytes & 1)))
+		return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
+
+	/* Make sure the length of the dentry is large enough to actually hold
+	 * the names.  */
+	calculated_size = dentry_min_len_with_names(name_nbytes,
+						    short_name_nbytes);
+
+	if (unlikely(length < calculated_size))
+		return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
+
+	/* Allocate new dentry structure, with room for the null-terminated
+	 * names, along with a preliminary inode.  */
+	names_nbytes = 0;
+	if (name_nbytes)
+		names_nbytes += (u32)name_nbytes + 2;
+	if (short_name_nbytes)
+		names_nbytes += (u32)short_name_nbytes + 2;
+	dentry = CALLOC(1, sizeof(struct wim_dentry) + names_nbytes);
+	if (unlikely(!dentry))
+		return WIMLIB_ERR_NOMEM;
+	dentry->d_parent = dentry;
+	dentry->d_embedded_names_nbytes = names_nbytes;
+
+	inode = new_inode(dentry, false);
+	if (unlikely(!inode)) {
+		FREE(dentry);
+		return WIMLIB_ERR_NOMEM;
+	}
 
 	/* Read more fields: some into the dentry, and some into the inode.  */
 	inode->i_attributes = le32_to_cpu(disk_dentry->attributes);
@@ -1398,50 +1428,25 @@ read_dentry(const u8 * restrict buf, size_t buf_len,
 		inode->i_ino = le64_to_cpu(disk_dentry->nonreparse.hard_link_group_id);
 	}
 
-	/* Now onto reading the names.  There are two of them: the (long) file
-	 * name, and the short name.  */
-
-	short_name_nbytes = le16_to_cpu(disk_dentry->short_name_nbytes);
-	name_nbytes = le16_to_cpu(disk_dentry->name_nbytes);
-
-	if (unlikely((short_name_nbytes & 1) | (name_nbytes & 1))) {
-		ret = WIMLIB_ERR_INVALID_METADATA_RESOURCE;
-		goto err_free_dentry;
-	}
-
-	/* We now know the length of the file name and short name.  Make sure
-	 * the length of the dentry is large enough to actually hold them.  */
-	calculated_size = dentry_min_len_with_names(name_nbytes,
-						    short_name_nbytes);
-
-	if (unlikely(length < calculated_size)) {
-		ret = WIMLIB_ERR_INVALID_METADATA_RESOURCE;
-		goto err_free_dentry;
-	}
-
 	/* Advance p to point past the base dentry, to the first name.  */
 	p += sizeof(struct wim_dentry_on_disk);
+	names = (u8 *)(dentry + 1);
 
 	/* Read the filename if present.  Note: if the filename is empty, there
 	 * is no null terminator following it.  */
 	if (name_nbytes) {
-		dentry->d_name = utf16le_dupz(p, name_nbytes);
-		if (unlikely(!dentry->d_name)) {
-			ret = WIMLIB_ERR_NOMEM;
-			goto err_free_dentry;
-		}
+		dentry->d_name = (utf16lechar *)names;
+		memcpy(names, p, name_nbytes);
 		dentry->d_name_nbytes = name_nbytes;
+		names += (u32)name_nbytes + 2;
 		p += (u32)name_nbytes + 2;
 	}
 
 	/* Read the short filename if present.  Note: if there is no short
 	 * filename, there is no null terminator following it. */
 	if (short_name_nbytes) {
-		dentry->d_short_name = utf16le_dupz(p, short_name_nbytes);
-		if (unlikely(!dentry->d_short_name)) {
-			ret = WIMLIB_ERR_NOMEM;
-			goto err_free_dentry;
-		}
+		dentry->d_short_name = (utf16lechar *)names;
+		memcpy(names, p, short_name_nbytes);
 		dentry->d_short_name_nbytes = short_name_nbytes;
 		p += (u32)short_name_nbytes + 2;
 	}
@@ -80,16 +80,23 @@ inode_export_blobs(struct wim_inode *inode, struct blob_table *src_blob_table,
 
 			if (gift) {
 				dest_blob = src_blob;
-				blob_table_unlink(src_blob_table, src_blob);
 			} else {
 				dest_blob = clone_blob_descriptor(src_blob);
 				if (!dest_blob)
 					return WIMLIB_ERR_NOMEM;
 			}
+			/* Only take the blob from the source WIM once it is
+			 * in the destination one.  */
+			if (blob_table_insert(dest_blob_table, dest_blob)) {
+				if (!gift)
+					free_blob_descriptor(dest_blob);
+				return WIMLIB_ERR_NOMEM;
+			}
+			if (gift)
+				blob_table_unlink(src_blob_table, src_blob);
 			dest_blob->refcnt = 0;
 			dest_blob->out_refcnt = 0;
 			dest_blob->was_exported = 1;
-			blob_table_insert(dest_blob_table, dest_blob);
 		}
 
 		/* Blob is present in destination WIM (either pre-existing,
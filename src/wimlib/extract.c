@@ -60,12 +60,21 @@
 #include "wimlib/reparse.h"
 #include "wimlib/resource.h"
 #include "wimlib/security.h"
+#include "wimlib/sha1.h"
 #include "wimlib/unix_data.h"
 #include "wimlib/wim.h"
 #include "wimlib/win32.h" /* for realpath() equivalent */
 #include "wimlib/xattr.h"
 #include "wimlib/xml.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define HAVE_ZERO_CHECK_SIMD
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#  include <arm_neon.h>
+#  define HAVE_ZERO_CHECK_SIMD
+#endif
+
 #define WIMLIB_EXTRACT_FLAG_FROM_PIPE   0x80000000
 #define WIMLIB_EXTRACT_FLAG_IMAGEMODE   0x40000000
 
@@ -92,7 +101,8 @@
 	 WIMLIB_EXTRACT_FLAG_COMPACT_XPRESS4K		|	\
 	 WIMLIB_EXTRACT_FLAG_COMPACT_XPRESS8K		|	\
 	 WIMLIB_EXTRACT_FLAG_COMPACT_XPRESS16K		|	\
-	 WIMLIB_EXTRACT_FLAG_COMPACT_LZX			\
+	 WIMLIB_EXTRACT_FLAG_COMPACT_LZX		|	\
+	 WIMLIB_EXTRACT_FLAG_SKIP_ZEROES			\
 	 )
 
 /* Send WIMLIB_PROGRESS_MSG_EXTRACT_FILE_STRUCTURE or
@@ -143,6 +153,31 @@ end_file_metadata_phase(struct apply_ctx *ctx)
 	return end_file_phase(ctx, WIMLIB_PROGRESS_MSG_EXTRACT_METADATA);
 }
 
+#ifdef HAVE_ZERO_CHECK_SIMD
+/* Are all 64 bytes at @p zero?  The vectors are or'ed together, so that there
+ * is a single test per 64 bytes.  */
+static forceinline bool
+is_zero_64(const u8 *p)
+{
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86)
+	__m128i v = _mm_or_si128(
+		_mm_or_si128(_mm_loadu_si128((const __m128i *)p),
+			     _mm_loadu_si128((const __m128i *)(p + 16))),
+		_mm_or_si128(_mm_loadu_si128((const __m128i *)(p + 32)),
+			     _mm_loadu_si128((const __m128i *)(p + 48))));
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) ==
+	       0xFFFF;
+#else
+	uint64x2_t v = vreinterpretq_u64_u8(
+		vorrq_u8(vorrq_u8(vld1q_u8(p), vld1q_u8(p + 16)),
+			 vorrq_u8(vld1q_u8(p + 32), vld1q_u8(p + 48))));
+
+	return (vgetq_lane_u64(v, 0) | vgetq_lane_u64(v, 1)) == 0;
+#endif
+}
+#endif /* HAVE_ZERO_CHECK_SIMD */
+
 /* Are all bytes in the specified buffer zero? */
 static bool
 is_all_zeroes(const u8 *buf, const size_t size)
@@ -154,6 +189,12 @@ is_all_zeroes(const u8 *buf, const size_t size)
 		if (*((const u8 *)p))
 			return false;
 
+#ifdef HAVE_ZERO_CHECK_SIMD
+	for (; end - p >= 64; p += 64)
+		if (!is_zero_64((const u8 *)p))
+			return false;
+#endif
+
 	for (; end - p >= WORDBYTES; p += WORDBYTES)
 		if (*(const machine_word_t *)p)
 			return false;
@@ -525,22 +566,28 @@ warn_about_corrupted_file(struct wim_dentry *dentry,
 		dentry_full_path(dentry));
 }
 
+static void
+warn_about_corrupted_blob(const struct blob_descriptor *blob)
+{
+	const struct blob_extraction_target *targets =
+		blob_extraction_targets(blob);
+
+	for (u32 i = 0; i < blob->out_refcnt; i++) {
+		struct wim_dentry *dentry =
+			inode_first_extraction_dentry(targets[i].inode);
+
+		warn_about_corrupted_file(dentry, targets[i].stream);
+	}
+}
+
 static int
 end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 {
 	struct apply_ctx *ctx = _ctx;
 
 	if ((ctx->extract_flags & WIMLIB_EXTRACT_FLAG_RECOVER_DATA) &&
-	    !status && blob->corrupted) {
-		const struct blob_extraction_target *targets =
-			blob_extraction_targets(blob);
-		for (u32 i = 0; i < blob->out_refcnt; i++) {
-			struct wim_dentry *dentry =
-				inode_first_extraction_dentry(targets[i].inode);
-
-			warn_about_corrupted_file(dentry, targets[i].stream);
-		}
-	}
+	    !status && blob->corrupted)
+		warn_about_corrupted_blob(blob);
 
 	if (unlikely(filedes_valid(&ctx->tmpfile_fd))) {
 		filedes_close(&ctx->tmpfile_fd);
@@ -556,6 +603,14 @@ end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 	return call_end_blob(blob, status, ctx->saved_cbs);
 }
 
+/* The data of a blob that was already extracted failed verification.  */
+static int
+corrupted_extract_blob(struct blob_descriptor *blob, void *_ctx)
+{
+	warn_about_corrupted_blob(blob);
+	return 0;
+}
+
 /*
  * Read the list of blobs to extract and feed their data into the specified
  * callback functions.
@@ -580,13 +635,16 @@ extract_blob_list(struct apply_ctx *ctx, const struct read_blob_callbacks *cbs)
 		.begin_blob	= begin_extract_blob,
 		.continue_blob	= extract_chunk,
 		.end_blob	= end_extract_blob,
+		.corrupted_blob	= corrupted_extract_blob,
 		.ctx		= ctx,
 	};
 	ctx->saved_cbs = cbs;
 	if (ctx->extract_flags & WIMLIB_EXTRACT_FLAG_FROM_PIPE) {
 		return read_blobs_from_pipe(ctx, &wrapper_cbs);
 	} else {
-		int flags = VERIFY_BLOB_HASHES;
+		/* The digests are verified on other threads, while the data
+		 * is being decompressed and written.  */
+		int flags = VERIFY_BLOB_HASHES | PARALLEL_VERIFY_BLOB_HASHES;
 
 		if (ctx->extract_flags & WIMLIB_EXTRACT_FLAG_RECOVER_DATA)
 			flags |= RECOVER_DATA;
@@ -598,40 +656,55 @@ extract_blob_list(struct apply_ctx *ctx, const struct read_blob_callbacks *cbs)
 	}
 }
 
-/* Extract a WIM dentry to standard output.
+/* Get the blob for the unnamed data stream of a WIM dentry, so that the dentry
+ * can be extracted as a plain stream of bytes.
  *
  * This obviously doesn't make sense in all cases.  We return an error if the
- * dentry does not correspond to a regular file.  Otherwise we extract the
- * unnamed data stream only.  */
+ * dentry does not correspond to a regular file.  Otherwise we use the unnamed
+ * data stream only.  *blob_ret is set to NULL if the file is empty.  */
 static int
-extract_dentry_to_stdout(struct wim_dentry *dentry,
-			 const struct blob_table *blob_table, int extract_flags)
+get_dentry_data_blob(struct wim_dentry *dentry,
+		     const struct blob_table *blob_table,
+		     struct blob_descriptor **blob_ret)
 {
 	struct wim_inode *inode = dentry->d_inode;
-	struct blob_descriptor *blob;
-	struct filedes _stdout;
-	bool recover = (extract_flags & WIMLIB_EXTRACT_FLAG_RECOVER_DATA);
-	int ret;
 
 	if (inode->i_attributes & (FILE_ATTRIBUTE_REPARSE_POINT |
 				   FILE_ATTRIBUTE_DIRECTORY |
 				   FILE_ATTRIBUTE_ENCRYPTED))
 	{
 		ERROR("\"%"TS"\" is not a regular file and therefore cannot be "
-		      "extracted to standard output", dentry_full_path(dentry));
+		      "extracted as a stream", dentry_full_path(dentry));
 		return WIMLIB_ERR_NOT_A_REGULAR_FILE;
 	}
 
-	blob = inode_get_blob_for_unnamed_data_stream(inode, blob_table);
-	if (!blob) {
+	*blob_ret = inode_get_blob_for_unnamed_data_stream(inode, blob_table);
+	if (!*blob_ret) {
 		const u8 *hash = inode_get_hash_of_unnamed_data_stream(inode);
 		if (!is_zero_hash(hash))
 			return blob_not_found_error(inode, hash);
-		return 0;
 	}
+	return 0;
+}
 
-	filedes_init(&_stdout, STDOUT_FILENO);
-	ret = extract_blob_to_fd(blob, &_stdout, recover);
+/* Extract a WIM dentry to a file descriptor.  */
+static int
+extract_dentry_to_fd(struct wim_dentry *dentry,
+		     const struct blob_table *blob_table, int fd,
+		     int extract_flags)
+{
+	struct wim_inode *inode = dentry->d_inode;
+	struct blob_descriptor *blob;
+	struct filedes out_fd;
+	bool recover = (extract_flags & WIMLIB_EXTRACT_FLAG_RECOVER_DATA);
+	int ret;
+
+	ret = get_dentry_data_blob(dentry, blob_table, &blob);
+	if (ret || !blob)
+		return ret;
+
+	filedes_init(&out_fd, fd);
+	ret = extract_blob_to_fd(blob, &out_fd, recover);
 	if (ret)
 		return ret;
 	if (recover && blob->corrupted)
@@ -640,6 +713,54 @@ extract_dentry_to_stdout(struct wim_dentry *dentry,
 	return 0;
 }
 
+/* Extract a WIM dentry to standard output.  */
+static int
+extract_dentry_to_stdout(struct wim_dentry *dentry,
+			 const struct blob_table *blob_table, int extract_flags)
+{
+	return extract_dentry_to_fd(dentry, blob_table, STDOUT_FILENO,
+				    extract_flags);
+}
+
+/* Extract a WIM dentry to a newly allocated buffer.  Unlike
+ * read_blob_into_alloc_buf(), this checks the SHA-1 message digest.  */
+static int
+extract_dentry_to_buffer(struct wim_dentry *dentry,
+			 const struct blob_table *blob_table,
+			 void **buf_ret, size_t *size_ret)
+{
+	struct blob_descriptor *blob;
+	u8 hash[SHA1_HASH_SIZE];
+	void *buf;
+	int ret;
+
+	*buf_ret = NULL;
+	*size_ret = 0;
+
+	ret = get_dentry_data_blob(dentry, blob_table, &blob);
+	if (ret || !blob)
+		return ret;
+
+	ret = read_blob_into_alloc_buf(blob, &buf);
+	if (ret)
+		return ret;
+
+	if (!blob->unhashed) {
+		sha1(buf, blob->size, hash);
+		if (!hashes_equal(hash, blob->hash)) {
+			ERROR("The data of \"%"TS"\" is corrupted "
+			      "(SHA-1 message digest mismatch)",
+			      dentry_full_path(dentry));
+			FREE(buf);
+			return WIMLIB_ERR_INVALID_RESOURCE_HASH;
+		}
+	}
+
+	*buf_ret = buf;
+	*size_ret = blob->size;
+	return 0;
+}
+
 static int
 extract_dentries_to_stdout(struct wim_dentry **dentries, size_t num_dentries,
 			   const struct blob_table *blob_table,
@@ -1978,6 +2099,75 @@ wimlib_extract_pathlist(WIMStruct *wim, int image, const tchar *target,
 	return ret;
 }
 
+/* Look up the regular file @path in @image of @wim, for extracting it as a
+ * stream of bytes.  */
+static int
+lookup_file_to_extract(WIMStruct *wim, int image, const tchar *path,
+		       struct wim_dentry **dentry_ret)
+{
+	tchar *cpath;
+	int ret;
+
+	if (!wim || !path)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	ret = select_wim_image(wim, image);
+	if (ret)
+		return ret;
+
+	ret = wim_checksum_unhashed_blobs(wim);
+	if (ret)
+		return ret;
+
+	cpath = canonicalize_wim_path(path);
+	if (!cpath)
+		return WIMLIB_ERR_NOMEM;
+	*dentry_ret = get_dentry(wim, cpath, WIMLIB_CASE_PLATFORM_DEFAULT);
+	FREE(cpath);
+	if (!*dentry_ret) {
+		ERROR("Path \"%"TS"\" does not exist in WIM image %d",
+		      path, wim->current_image);
+		return WIMLIB_ERR_PATH_DOES_NOT_EXIST;
+	}
+	return 0;
+}
+
+WIMLIBAPI int
+wimlib_extract_file_to_fd(WIMStruct *wim, int image, const tchar *path,
+			  int fd, int extract_flags)
+{
+	struct wim_dentry *dentry;
+	int ret;
+
+	if (extract_flags & ~WIMLIB_EXTRACT_FLAG_RECOVER_DATA)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	ret = lookup_file_to_extract(wim, image, path, &dentry);
+	if (ret)
+		return ret;
+
+	return extract_dentry_to_fd(dentry, wim->blob_table, fd,
+				    extract_flags);
+}
+
+WIMLIBAPI int
+wimlib_extract_file_to_buffer(WIMStruct *wim, int image, const tchar *path,
+			      void **buf_ret, size_t *size_ret)
+{
+	struct wim_dentry *dentry;
+	int ret;
+
+	if (!buf_ret || !size_ret)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	ret = lookup_file_to_extract(wim, image, path, &dentry);
+	if (ret)
+		return ret;
+
+	return extract_dentry_to_buffer(dentry, wim->blob_table,
+					buf_ret, size_ret);
+}
+
 WIMLIBAPI int
 wimlib_extract_image_from_pipe_with_progress(int pipe_fd,
 					     const tchar *image_num_or_name,
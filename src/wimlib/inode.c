@@ -472,7 +472,10 @@ inode_resolve_streams(struct wim_inode *inode, struct blob_table *table,
 				if (!blob)
 					return WIMLIB_ERR_NOMEM;
 				copy_hash(blob->hash, hash);
-				blob_table_insert(table, blob);
+				if (blob_table_insert(table, blob)) {
+					free_blob_descriptor(blob);
+					return WIMLIB_ERR_NOMEM;
+				}
 			}
 		}
 		strm->_stream_blob = blob;
@@ -27,6 +27,8 @@
 #  include "config.h"
 #endif
 
+#include <unistd.h>
+
 #include "wimlib/assert.h"
 #include "wimlib/endianness.h"
 #include "wimlib/error.h"
@@ -35,6 +37,8 @@
 #include "wimlib/progress.h"
 #include "wimlib/resource.h"
 #include "wimlib/sha1.h"
+#include "wimlib/threads.h"
+#include "wimlib/util.h"
 #include "wimlib/wim.h"
 #include "wimlib/write.h"
 
@@ -47,6 +51,11 @@
 #define INTEGRITY_MIN_CHUNK_SIZE 4096
 #define INTEGRITY_MAX_CHUNK_SIZE 134217728
 
+/* Maximum number of threads checksumming chunks, and size of the reads they
+ * issue. */
+#define INTEGRITY_MAX_THREADS 8
+#define INTEGRITY_READ_SIZE 1048576
+
 PRAGMA_BEGIN_PACKED
 struct integrity_table {
 	u32 size;
@@ -58,9 +67,8 @@ PRAGMA_END_PACKED
 
 static int
 calculate_chunk_sha1(struct filedes *in_fd, size_t this_chunk_size,
-		     off_t offset, u8 sha1_md[])
+		     off_t offset, u8 sha1_md[], u8 *buf, size_t buf_size)
 {
-	u8 buf[BUFFER_SIZE];
 	struct sha1_ctx ctx;
 	size_t bytes_remaining;
 	size_t bytes_to_read;
@@ -69,7 +77,7 @@ calculate_chunk_sha1(struct filedes *in_fd, size_t this_chunk_size,
 	bytes_remaining = this_chunk_size;
 	sha1_init(&ctx);
 	do {
-		bytes_to_read = min(bytes_remaining, sizeof(buf));
+		bytes_to_read = min(bytes_remaining, buf_size);
 		ret = full_pread(in_fd, buf, bytes_to_read, offset);
 		if (ret) {
 			ERROR_WITH_ERRNO("Read error while calculating "
@@ -86,6 +94,182 @@ calculate_chunk_sha1(struct filedes *in_fd, size_t this_chunk_size,
 	return 0;
 }
 
+/*
+ * Checksums the chunks of a WIM file, starting at chunk @first_chunk, on
+ * several threads that each read and hash whole chunks with large reads.  The
+ * results are retrieved in order with get_integrity_chunk_sha1(), so that the
+ * progress messages and the comparisons are unchanged.  If the threads can't
+ * be used (single processor, file inside an ISO), the chunks are checksummed
+ * by get_integrity_chunk_sha1() itself.
+ */
+struct integrity_hasher {
+	struct filedes *in_fd;
+	u64 bytes_to_check;
+	size_t chunk_size;
+	u32 num_chunks;
+	u32 next_chunk;
+	u8 (*sha1sums)[SHA1_HASH_SIZE];
+	u8 *chunk_done;
+	int ret;
+	bool terminating;
+	struct mutex lock;
+	struct condvar chunk_done_cond;
+	struct thread threads[INTEGRITY_MAX_THREADS];
+	unsigned num_threads;
+};
+
+static size_t
+integrity_chunk_size(const struct integrity_hasher *h, u32 i)
+{
+	if (i == h->num_chunks - 1)
+		return MODULO_NONZERO(h->bytes_to_check, h->chunk_size);
+	return h->chunk_size;
+}
+
+static void *
+integrity_hasher_thread_proc(void *arg)
+{
+	struct integrity_hasher *h = arg;
+	u8 *buf = MALLOC(INTEGRITY_READ_SIZE);
+	int ret = buf ? 0 : WIMLIB_ERR_NOMEM;
+	u32 i;
+
+	mutex_lock(&h->lock);
+	while (!ret && !h->terminating && h->next_chunk < h->num_chunks) {
+		i = h->next_chunk++;
+		mutex_unlock(&h->lock);
+
+		ret = calculate_chunk_sha1(h->in_fd, integrity_chunk_size(h, i),
+					   WIM_HEADER_DISK_SIZE + (u64)i * h->chunk_size,
+					   h->sha1sums[i], buf, INTEGRITY_READ_SIZE);
+
+		mutex_lock(&h->lock);
+		if (!ret) {
+			h->chunk_done[i] = 1;
+			condvar_broadcast(&h->chunk_done_cond);
+		}
+	}
+	if (ret && !h->ret) {
+		h->ret = ret;
+		condvar_broadcast(&h->chunk_done_cond);
+	}
+	mutex_unlock(&h->lock);
+	FREE(buf);
+	return NULL;
+}
+
+static int
+start_integrity_hasher(struct integrity_hasher *h, struct filedes *in_fd,
+		       u64 bytes_to_check, size_t chunk_size, u32 num_chunks,
+		       u32 first_chunk)
+{
+	unsigned num_threads;
+
+	memset(h, 0, sizeof(*h));
+	h->in_fd = in_fd;
+	h->bytes_to_check = bytes_to_check;
+	h->chunk_size = chunk_size;
+	h->num_chunks = num_chunks;
+	h->next_chunk = first_chunk;
+
+	num_threads = min(get_available_cpus(), INTEGRITY_MAX_THREADS);
+#ifdef WITH_LIBCDIO
+	/* libcdio can't read from several threads at once. */
+	if (in_fd->is_iso || in_fd->is_udf)
+		num_threads = 1;
+#endif
+	/* Pipes can only be read in order. */
+	if (in_fd->is_pipe)
+		num_threads = 1;
+	if (num_threads < 2 || num_chunks - first_chunk < 2)
+		return 0;
+
+	h->sha1sums = MALLOC((size_t)num_chunks * SHA1_HASH_SIZE);
+	h->chunk_done = CALLOC(num_chunks, 1);
+	if (!h->sha1sums || !h->chunk_done)
+		goto err_free;
+	if (!mutex_init(&h->lock))
+		goto err_free;
+	if (!condvar_init(&h->chunk_done_cond))
+		goto err_destroy_lock;
+
+	while (h->num_threads < min(num_threads, num_chunks - first_chunk)) {
+		if (!thread_create(&h->threads[h->num_threads],
+				   integrity_hasher_thread_proc, h))
+			break;
+		h->num_threads++;
+	}
+	if (h->num_threads != 0)
+		return 0;
+
+	condvar_destroy(&h->chunk_done_cond);
+err_destroy_lock:
+	mutex_destroy(&h->lock);
+err_free:
+	/* Fall back to checksumming the chunks serially. */
+	FREE(h->sha1sums);
+	FREE(h->chunk_done);
+	h->sha1sums = NULL;
+	h->chunk_done = NULL;
+	return 0;
+}
+
+/* Get the SHA-1 message digest of chunk @i, which must be requested in
+ * increasing order. */
+static int
+get_integrity_chunk_sha1(struct integrity_hasher *h, u32 i, u8 sha1_md[])
+{
+	int ret;
+
+	if (h->num_threads == 0) {
+		u8 buf[BUFFER_SIZE];
+
+		return calculate_chunk_sha1(h->in_fd, integrity_chunk_size(h, i),
+					    WIM_HEADER_DISK_SIZE + (u64)i * h->chunk_size,
+					    sha1_md, buf, sizeof(buf));
+	}
+
+	mutex_lock(&h->lock);
+	while (!h->chunk_done[i] && !h->ret)
+		condvar_wait(&h->chunk_done_cond, &h->lock);
+	ret = h->chunk_done[i] ? 0 : h->ret;
+	mutex_unlock(&h->lock);
+	if (!ret)
+		copy_hash(sha1_md, h->sha1sums[i]);
+	return ret;
+}
+
+/* Reads are positional, but on Windows pread() moves the file pointer of the
+ * descriptor, and concurrent reads may leave it anywhere.  Seek back to the
+ * offset that the descriptor is at for the caller. */
+static void
+restore_file_position(struct filedes *in_fd)
+{
+	off_t offset = in_fd->offset;
+
+	/* filedes_seek() doesn't seek if the offset is unchanged. */
+	in_fd->offset = -1;
+	if (filedes_seek(in_fd, offset) == -1)
+		in_fd->offset = offset;
+}
+
+static void
+stop_integrity_hasher(struct integrity_hasher *h)
+{
+	if (h->num_threads == 0)
+		return;
+
+	mutex_lock(&h->lock);
+	h->terminating = true;
+	mutex_unlock(&h->lock);
+	for (unsigned i = 0; i < h->num_threads; i++)
+		thread_join(&h->threads[i]);
+	condvar_destroy(&h->chunk_done_cond);
+	mutex_destroy(&h->lock);
+	FREE(h->sha1sums);
+	FREE(h->chunk_done);
+	restore_file_position(h->in_fd);
+}
 
 /*
  * read_integrity_table: -  Reads the integrity table from a WIM file.
@@ -216,8 +400,18 @@ calculate_integrity_table(struct filedes *in_fd,
 	new_table->size = new_table_size;
 	new_table->chunk_size = chunk_size;
 
-	u64 offset = WIM_HEADER_DISK_SIZE;
+	/* The SHA1 message digests of the chunks that are unchanged from the
+	 * old integrity table are reused, so start checksumming after them. */
+	u32 first_new_chunk = 0;
+	if (old_table) {
+		first_new_chunk = old_num_chunks - 1;
+		if (((old_num_chunks == new_num_chunks) ? new_last_chunk_size :
+		     chunk_size) == old_last_chunk_size)
+			first_new_chunk++;
+	}
+
 	union wimlib_progress_info progress;
+	struct integrity_hasher hasher;
 
 	progress.integrity.total_bytes      = new_check_bytes;
 	progress.integrity.total_chunks     = new_num_chunks;
@@ -231,6 +425,11 @@ calculate_integrity_table(struct filedes *in_fd,
 	if (ret)
 		goto out_free_new_table;
 
+	ret = start_integrity_hasher(&hasher, in_fd, new_check_bytes,
+				     chunk_size, new_num_chunks, first_new_chunk);
+	if (ret)
+		goto out_free_new_table;
+
 	for (u32 i = 0; i < new_num_chunks; i++) {
 		size_t this_chunk_size;
 		if (i == new_num_chunks - 1)
@@ -245,24 +444,27 @@ calculate_integrity_table(struct filedes *in_fd,
 			 * */
 			copy_hash(new_table->sha1sums[i], old_table->sha1sums[i]);
 		} else {
-			/* Calculate the SHA1 message digest of this chunk */
-			ret = calculate_chunk_sha1(in_fd, this_chunk_size,
-						   offset, new_table->sha1sums[i]);
+			/* Get the SHA1 message digest of this chunk */
+			wimlib_assert(i >= first_new_chunk);
+			ret = get_integrity_chunk_sha1(&hasher, i,
+						       new_table->sha1sums[i]);
 			if (ret)
-				goto out_free_new_table;
+				goto out_stop_hasher;
 		}
-		offset += this_chunk_size;
 
 		progress.integrity.completed_chunks++;
 		progress.integrity.completed_bytes += this_chunk_size;
 		ret = call_progress(progfunc, WIMLIB_PROGRESS_MSG_CALC_INTEGRITY,
 				    &progress, progctx);
 		if (ret)
-			goto out_free_new_table;
+			goto out_stop_hasher;
 	}
+	stop_integrity_hasher(&hasher);
 	*integrity_table_ret = new_table;
 	return 0;
 
+out_stop_hasher:
+	stop_integrity_hasher(&hasher);
 out_free_new_table:
 	FREE(new_table);
 	return ret;
@@ -362,9 +564,9 @@ verify_integrity(struct filedes *in_fd, const tchar *filename,
 		 wimlib_progress_func_t progfunc, void *progctx)
 {
 	int ret;
-	u64 offset = WIM_HEADER_DISK_SIZE;
 	u8 sha1_md[SHA1_HASH_SIZE];
 	union wimlib_progress_info progress;
+	struct integrity_hasher hasher;
 
 	progress.integrity.total_bytes      = bytes_to_check;
 	progress.integrity.total_chunks     = table->num_entries;
@@ -378,31 +580,33 @@ verify_integrity(struct filedes *in_fd, const tchar *filename,
 	if (ret)
 		return ret;
 
-	for (u32 i = 0; i < table->num_entries; i++) {
-		size_t this_chunk_size;
-		if (i == table->num_entries - 1)
-			this_chunk_size = MODULO_NONZERO(bytes_to_check,
-							 table->chunk_size);
-		else
-			this_chunk_size = table->chunk_size;
+	ret = start_integrity_hasher(&hasher, in_fd, bytes_to_check,
+				     table->chunk_size, table->num_entries, 0);
+	if (ret)
+		return ret;
 
-		ret = calculate_chunk_sha1(in_fd, this_chunk_size, offset, sha1_md);
+	for (u32 i = 0; i < table->num_entries; i++) {
+		ret = get_integrity_chunk_sha1(&hasher, i, sha1_md);
 		if (ret)
-			return ret;
+			goto out;
 
-		if (!hashes_equal(sha1_md, table->sha1sums[i]))
-			return WIM_INTEGRITY_NOT_OK;
+		if (!hashes_equal(sha1_md, table->sha1sums[i])) {
+			ret = WIM_INTEGRITY_NOT_OK;
+			goto out;
+		}
 
-		offset += this_chunk_size;
 		progress.integrity.completed_chunks++;
-		progress.integrity.completed_bytes += this_chunk_size;
+		progress.integrity.completed_bytes += integrity_chunk_size(&hasher, i);
 
 		ret = call_progress(progfunc, WIMLIB_PROGRESS_MSG_VERIFY_INTEGRITY,
 				    &progress, progctx);
 		if (ret)
-			return ret;
+			goto out;
 	}
-	return WIM_INTEGRITY_OK;
+	ret = WIM_INTEGRITY_OK;
+out:
+	stop_integrity_hasher(&hasher);
+	return ret;
 }
 
 
@@ -826,6 +826,11 @@ lzms_decompress(const void * const restrict in, const size_t in_nbytes,
 			recent_lz_offsets[0] = offset;
 			prev_item_type = 1;
 
+			/* Start loading the match source while the length is
+			 * being decoded.  */
+			if (likely(offset <= out_next - (u8 *)out))
+				prefetchr(out_next - offset);
+
 			length = lzms_decode_length(d, &is);
 
 			if (unlikely(lz_copy(length, offset, out, out_next, out_end,
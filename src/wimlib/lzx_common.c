@@ -25,15 +25,17 @@
 
 #include <string.h>
 
-#ifdef __SSE2__
-#  include <emmintrin.h>
-#endif
-
-#ifdef __AVX2__
+/* SSE2 is part of the x86_64 baseline, so MSVC, which doesn't define
+ * __SSE2__, can use the vectorized E8 filter too.  AVX2 is selected at runtime
+ * unless the compiler was already told that it can be used.  */
+#if defined(__SSE2__) || defined(__AVX2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define HAVE_E8_FILTER_SIMD
 #  include <immintrin.h>
 #endif
 
 #include "wimlib/bitops.h"
+#include "wimlib/cpu_features.h"
 #include "wimlib/endianness.h"
 #include "wimlib/lzx_common.h"
 #include "wimlib/unaligned.h"
@@ -166,11 +168,65 @@ undo_translate_target(void *target, s32 input_pos)
  * in calculating the translated jump targets.  But in WIM files, this file size
  * is always the same (LZX_WIM_MAGIC_FILESIZE == 12000000).
  */
+#ifdef HAVE_E8_FILTER_SIMD
+/*
+ * Scan the data at @p, which is aligned on a 16 byte boundary, 32 bytes at a
+ * time until a block of 32 bytes which contains at least one E8 byte is found.
+ * Return a pointer to that block and set *@e8_mask_ret to a mask which has a
+ * bit set for each E8 byte in it.
+ */
+static forceinline u8 *
+lzx_e8_scan_sse2(u8 *p, u32 *e8_mask_ret)
+{
+	const __m128i e8_bytes = _mm_set1_epi8((char)0xE8);
+
+	for (;;) {
+		/* Read the next 32 bytes of data and test them for E8 bytes.  */
+		__m128i bytes1 = _mm_load_si128((const __m128i *)p);
+		__m128i bytes2 = _mm_load_si128((const __m128i *)(p + 16));
+		__m128i cmpresult1 = _mm_cmpeq_epi8(bytes1, e8_bytes);
+		__m128i cmpresult2 = _mm_cmpeq_epi8(bytes2, e8_bytes);
+		u32 mask1 = _mm_movemask_epi8(cmpresult1);
+		u32 mask2 = _mm_movemask_epi8(cmpresult2);
+		/* The masks have a bit set for each E8 byte.  We stay in this
+		 * fast inner loop as long as there are no E8 bytes.  */
+		if (mask1 | mask2) {
+			*e8_mask_ret = mask1 | (mask2 << 16);
+			return p;
+		}
+		p += 32;
+	}
+}
+
+/* Same as lzx_e8_scan_sse2(), using AVX2.  */
+#ifdef __AVX2__
+#  define lzx_e8_scan_avx2_enabled()	true
+#else
+#  define lzx_e8_scan_avx2_enabled()	(cpu_features & X86_CPU_FEATURE_AVX2)
+#endif
+static u8 * __attribute__((target("avx2")))
+lzx_e8_scan_avx2(u8 *p, u32 *e8_mask_ret)
+{
+	const __m256i e8_bytes = _mm256_set1_epi8((char)0xE8);
+
+	for (;;) {
+		__m256i bytes = _mm256_loadu_si256((const __m256i *)p);
+		__m256i cmpresult = _mm256_cmpeq_epi8(bytes, e8_bytes);
+		u32 e8_mask = _mm256_movemask_epi8(cmpresult);
+		if (e8_mask) {
+			*e8_mask_ret = e8_mask;
+			return p;
+		}
+		p += 32;
+	}
+}
+#endif /* HAVE_E8_FILTER_SIMD */
+
 static void
 lzx_e8_filter(u8 *data, u32 size, void (*process_target)(void *, s32))
 {
 
-#if !defined(__SSE2__) && !defined(__AVX2__)
+#ifndef HAVE_E8_FILTER_SIMD
 	/*
 	 * A worthwhile optimization is to push the end-of-buffer check into the
 	 * relatively rare E8 case.  This is possible if we replace the last six
@@ -206,14 +262,11 @@ lzx_e8_filter(u8 *data, u32 size, void (*process_target)(void *, s32))
 
 	u8 *p = data;
 	u64 valid_mask = ~0;
+	const bool use_avx2 = lzx_e8_scan_avx2_enabled();
 
 	if (size <= 10)
 		return;
-#ifdef __AVX2__
-#  define ALIGNMENT_REQUIRED 32
-#else
-#  define ALIGNMENT_REQUIRED 16
-#endif
+#define ALIGNMENT_REQUIRED 16
 
 	/* Process one byte at a time until the pointer is properly aligned.  */
 	while ((uintptr_t)p % ALIGNMENT_REQUIRED != 0) {
@@ -244,37 +297,10 @@ lzx_e8_filter(u8 *data, u32 size, void (*process_target)(void *, s32))
 		for (;;) {
 			u32 e8_mask;
 			u8 *orig_p = p;
-		#ifdef __AVX2__
-			const __m256i e8_bytes = _mm256_set1_epi8(0xE8);
-			for (;;) {
-				__m256i bytes = *(const __m256i *)p;
-				__m256i cmpresult = _mm256_cmpeq_epi8(bytes, e8_bytes);
-				e8_mask = _mm256_movemask_epi8(cmpresult);
-				if (e8_mask)
-					break;
-				p += 32;
-			}
-		#else
-			const __m128i e8_bytes = _mm_set1_epi8(0xE8);
-			for (;;) {
-				/* Read the next 32 bytes of data and test them
-				 * for E8 bytes.  */
-				__m128i bytes1 = *(const __m128i *)p;
-				__m128i bytes2 = *(const __m128i *)(p + 16);
-				__m128i cmpresult1 = _mm_cmpeq_epi8(bytes1, e8_bytes);
-				__m128i cmpresult2 = _mm_cmpeq_epi8(bytes2, e8_bytes);
-				u32 mask1 = _mm_movemask_epi8(cmpresult1);
-				u32 mask2 = _mm_movemask_epi8(cmpresult2);
-				/* The masks have a bit set for each E8 byte.
-				 * We stay in this fast inner loop as long as
-				 * there are no E8 bytes.  */
-				if (mask1 | mask2) {
-					e8_mask = mask1 | (mask2 << 16);
-					break;
-				}
-				p += 32;
-			}
-		#endif
+			if (use_avx2)
+				p = lzx_e8_scan_avx2(p, &e8_mask);
+			else
+				p = lzx_e8_scan_sse2(p, &e8_mask);
 
 			/* Did we pass over data with no E8 bytes?  */
 			if (p != orig_p)
@@ -311,7 +337,7 @@ lzx_e8_filter(u8 *data, u32 size, void (*process_target)(void *, s32))
 		valid_mask >>= 1;
 		valid_mask |= (u64)1 << 63;
 	}
-#endif /* __SSE2__ || __AVX2__ */
+#endif /* HAVE_E8_FILTER_SIMD */
 }
 
 void
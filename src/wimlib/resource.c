@@ -33,12 +33,16 @@
 #include "wimlib/assert.h"
 #include "wimlib/bitops.h"
 #include "wimlib/blob_table.h"
+#include "wimlib/chunk_decompressor.h"
 #include "wimlib/endianness.h"
 #include "wimlib/error.h"
 #include "wimlib/file_io.h"
+#include "wimlib/list.h"
 #include "wimlib/ntfs_3g.h"
 #include "wimlib/resource.h"
 #include "wimlib/sha1.h"
+#include "wimlib/solid_cache.h"
+#include "wimlib/threads.h"
 #include "wimlib/wim.h"
 #include "wimlib/win32.h"
 
@@ -83,32 +87,129 @@ struct data_range {
 	u64 size;
 };
 
+/* Minimum amount of compressed data to read for a resource to be decompressed
+ * by several threads; below this, the setup costs more than it saves.  */
+#define PARALLEL_DECOMPRESSION_MIN_SIZE		(1U << 20)
+
+/* Position in the list of ranges being read from a resource.  */
+struct range_cursor {
+	const struct data_range *cur_range;
+	const struct data_range *end_range;
+	u64 cur_range_pos;
+	u64 cur_range_end;
+};
+
+static void
+init_range_cursor(struct range_cursor *rc, const struct data_range *ranges,
+		  size_t num_ranges)
+{
+	rc->cur_range = ranges;
+	rc->end_range = &ranges[num_ranges];
+	rc->cur_range_pos = ranges->offset;
+	rc->cur_range_end = ranges->offset + ranges->size;
+}
+
+/* Move @rc past the uncompressed chunk which spans [@chunk_start_offset,
+ * @chunk_end_offset) and which at least one range requires data from.  If @cb
+ * is not NULL, the data of @ubuf that is part of the ranges is fed to it.  */
 static int
-decompress_chunk(const void *cbuf, u32 chunk_csize, u8 *ubuf, u32 chunk_usize,
-		 struct wimlib_decompressor *decompressor, bool recover_data)
+advance_range_cursor(struct range_cursor *rc, const u8 *ubuf,
+		     u64 chunk_start_offset, u64 chunk_end_offset,
+		     const struct consume_chunk_callback *cb)
 {
-	int res = wimlib_decompress(cbuf, chunk_csize, ubuf, chunk_usize,
-				    decompressor);
-	if (likely(res == 0))
-		return 0;
+	int ret;
 
-	if (recover_data) {
-		WARNING("Failed to decompress data!  Continuing anyway since data recovery mode is enabled.");
-
-		/* Continue on with *something*.  In the worst case just use a
-		 * zeroed buffer.  But, try to fill as much of it with
-		 * decompressed data as we can.  This works because if the
-		 * corruption isn't located right at the beginning of the
-		 * compressed chunk, wimlib_decompress() may write some correct
-		 * output at the beginning even if it fails later.  */
-		memset(ubuf, 0, chunk_usize);
-		(void)wimlib_decompress(cbuf, chunk_csize, ubuf,
-					chunk_usize, decompressor);
-		return 0;
+	do {
+		size_t start, end, size;
+
+		/* Calculate how many bytes of data should be sent to the
+		 * callback function, taking into account that data sent to the
+		 * callback function must not overlap range boundaries.  */
+		start = rc->cur_range_pos - chunk_start_offset;
+		end = min(rc->cur_range_end, chunk_end_offset) - chunk_start_offset;
+		size = end - start;
+
+		if (cb) {
+			ret = consume_chunk(cb, &ubuf[start], size);
+			if (unlikely(ret))
+				return ret;
+		}
+
+		rc->cur_range_pos += size;
+		if (rc->cur_range_pos == rc->cur_range_end) {
+			/* Advance to next range.  */
+			if (++rc->cur_range == rc->end_range) {
+				rc->cur_range_pos = ~0ULL;
+			} else {
+				rc->cur_range_pos = rc->cur_range->offset;
+				rc->cur_range_end = rc->cur_range->offset +
+						    rc->cur_range->size;
+			}
+		}
+	} while (rc->cur_range_pos < chunk_end_offset);
+	return 0;
+}
+
+/* Feed the next chunk that was decompressed by @pctx to the callback, or all
+ * of the remaining ones if @all is true.  If @cache_rdesc is not NULL, the
+ * chunks are also added to the solid resource cache.  */
+static int
+consume_decompressed_chunks(struct parallel_chunk_decompressor *pctx,
+			    struct range_cursor *rc, u32 chunk_order,
+			    const struct consume_chunk_callback *cb, bool all,
+			    const struct wim_resource_descriptor *cache_rdesc)
+{
+	const void *udata;
+	u32 usize;
+	u64 chunk_idx;
+	int status;
+	int ret;
+
+	while (parallel_chunk_decompressor_get_result(pctx, &udata, &usize,
+						      &chunk_idx, &status))
+	{
+		if (unlikely(status)) {
+			errno = EINVAL;
+			return status;
+		}
+		if (cache_rdesc)
+			solid_cache_insert(cache_rdesc, chunk_idx, udata, usize);
+		ret = advance_range_cursor(rc, udata, chunk_idx << chunk_order,
+					   (chunk_idx << chunk_order) + usize, cb);
+		if (unlikely(ret))
+			return ret;
+		if (!all)
+			break;
 	}
-	ERROR("Failed to decompress data!");
-	errno = EINVAL;
-	return WIMLIB_ERR_DECOMPRESSION;
+	return 0;
+}
+
+/* Get a parallel chunk decompressor for reading @num_chunks chunks, or NULL if
+ * the chunks should be decompressed by the calling thread.  */
+static struct parallel_chunk_decompressor *
+get_parallel_decompressor(WIMStruct *wim, int ctype, u32 chunk_size,
+			  u64 num_chunks, u64 read_size)
+{
+	struct parallel_chunk_decompressor *pctx;
+
+	if (wim->decompression_num_threads == 1 || num_chunks < 2 ||
+	    read_size < PARALLEL_DECOMPRESSION_MIN_SIZE)
+		return NULL;
+
+	pctx = wim->parallel_decompressor;
+	if (pctx && parallel_chunk_decompressor_ctype(pctx) == ctype &&
+	    parallel_chunk_decompressor_chunk_size(pctx) == chunk_size) {
+		/* Cached parallel decompressor.  */
+		wim->parallel_decompressor = NULL;
+		return pctx;
+	}
+
+	if (new_parallel_chunk_decompressor(ctype, chunk_size,
+					    wim->decompression_num_threads,
+					    wim->decompression_max_memory,
+					    &pctx) != 0)
+		return NULL;
+	return pctx;
 }
 
 /*
@@ -156,6 +257,9 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 	bool ubuf_malloced = false;
 	bool cbuf_malloced = false;
 	struct wimlib_decompressor *decompressor = NULL;
+	struct parallel_chunk_decompressor *pctx = NULL;
+	struct solid_cache_chunk *cached_chunk;
+	const u8 *cached_data;
 
 	/* Sanity checks  */
 	wimlib_assert(num_ranges != 0);
@@ -180,6 +284,13 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 	const bool alt_chunk_table = (rdesc->flags & WIM_RESHDR_FLAG_SOLID)
 					&& !is_pipe_read;
 
+	/* Determine if the decompressed chunks should be looked up in, and
+	 * added to, the solid resource cache.  Chunks that were recovered from
+	 * corrupted data are never cached.  */
+	const struct wim_resource_descriptor * const cache_rdesc =
+		(alt_chunk_table && !recover_data && solid_cache_enabled()) ?
+			rdesc : NULL;
+
 	/* Get the maximum size of uncompressed chunks in this resource, which
 	 * we require be a power of 2.  */
 	u64 cur_read_offset = rdesc->offset_in_wim;
@@ -202,24 +313,6 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 		goto out_cleanup;
 	}
 
-	/* Get valid decompressor.  */
-	if (likely(ctype == rdesc->wim->decompressor_ctype &&
-		   chunk_size == rdesc->wim->decompressor_max_block_size))
-	{
-		/* Cached decompressor.  */
-		decompressor = rdesc->wim->decompressor;
-		rdesc->wim->decompressor_ctype = WIMLIB_COMPRESSION_TYPE_NONE;
-		rdesc->wim->decompressor = NULL;
-	} else {
-		ret = wimlib_create_decompressor(ctype, chunk_size,
-						 &decompressor);
-		if (unlikely(ret)) {
-			if (ret != WIMLIB_ERR_NOMEM)
-				errno = EINVAL;
-			goto out_cleanup;
-		}
-	}
-
 	const u32 chunk_order = bsr32(chunk_size);
 
 	/* Calculate the total number of chunks the resource is divided into.  */
@@ -235,6 +328,30 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 	 * must always start from the 0th chunk.  */
 	const u64 read_start_chunk = (is_pipe_read ? 0 : first_needed_chunk);
 
+	/* Get valid decompressor.  Large reads are decompressed by several
+	 * threads, with the chunks still being fed to the callback in order.  */
+	pctx = get_parallel_decompressor(rdesc->wim, ctype, chunk_size,
+					 last_needed_chunk - read_start_chunk + 1,
+					 (last_offset - first_offset) + 1);
+	if (pctx) {
+		parallel_chunk_decompressor_set_recover_data(pctx, recover_data);
+	} else if (likely(ctype == rdesc->wim->decompressor_ctype &&
+			  chunk_size == rdesc->wim->decompressor_max_block_size))
+	{
+		/* Cached decompressor.  */
+		decompressor = rdesc->wim->decompressor;
+		rdesc->wim->decompressor_ctype = WIMLIB_COMPRESSION_TYPE_NONE;
+		rdesc->wim->decompressor = NULL;
+	} else {
+		ret = wimlib_create_decompressor(ctype, chunk_size,
+						 &decompressor);
+		if (unlikely(ret)) {
+			if (ret != WIMLIB_ERR_NOMEM)
+				errno = EINVAL;
+			goto out_cleanup;
+		}
+	}
+
 	/* Calculate the number of chunk offsets that are needed for the chunks
 	 * being read.  */
 	const u64 num_needed_chunk_offsets =
@@ -372,8 +489,11 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 			cur_read_offset += chunk_table_size;
 	}
 
-	/* Allocate buffer for holding the uncompressed data of each chunk.  */
-	if (chunk_size <= STACK_MAX) {
+	/* Allocate buffer for holding the uncompressed data of each chunk.
+	 * The parallel decompressor uses its own buffers.  */
+	if (pctx) {
+		/* Nothing to do.  */
+	} else if (chunk_size <= STACK_MAX) {
 		ubuf = alloca(chunk_size);
 	} else {
 		ubuf = MALLOC(chunk_size);
@@ -386,7 +506,9 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 	 * which can be at most @chunk_size - 1 bytes.  This excludes compressed
 	 * chunks that are a full @chunk_size bytes, which are actually stored
 	 * uncompressed.  */
-	if (chunk_size - 1 <= STACK_MAX) {
+	if (pctx) {
+		/* Nothing to do.  */
+	} else if (chunk_size - 1 <= STACK_MAX) {
 		cbuf = alloca(chunk_size - 1);
 	} else {
 		cbuf = MALLOC(chunk_size - 1);
@@ -395,11 +517,12 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 		cbuf_malloced = true;
 	}
 
-	/* Set current data range.  */
-	const struct data_range *cur_range = ranges;
-	const struct data_range * const end_range = &ranges[num_ranges];
-	u64 cur_range_pos = cur_range->offset;
-	u64 cur_range_end = cur_range->offset + cur_range->size;
+	/* Set current data range, both for the data that is fed to the callback
+	 * and for the chunks that are read.  The two only differ when the
+	 * chunks are decompressed in parallel.  */
+	struct range_cursor rc, read_rc;
+	init_range_cursor(&rc, ranges, num_ranges);
+	init_range_cursor(&read_rc, ranges, num_ranges);
 
 	/* Read and process each needed chunk.  */
 	for (u64 i = read_start_chunk; i <= last_needed_chunk; i++) {
@@ -447,7 +570,7 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 		const u64 chunk_start_offset = i << chunk_order;
 		const u64 chunk_end_offset = chunk_start_offset + chunk_usize;
 
-		if (chunk_end_offset <= cur_range_pos) {
+		if (chunk_end_offset <= read_rc.cur_range_pos) {
 
 			/* The next range does not require data in this chunk,
 			 * so skip it.  */
@@ -459,6 +582,60 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 				if (unlikely(ret))
 					goto read_error;
 			}
+		} else if (cache_rdesc &&
+			   (cached_chunk = solid_cache_get(cache_rdesc, i,
+							   chunk_usize,
+							   &cached_data)))
+		{
+			/* The chunk was already decompressed, possibly through
+			 * another WIMStruct.  Feed the chunks that are still
+			 * being decompressed first, to keep the data in order.  */
+			ret = 0;
+			if (pctx)
+				ret = consume_decompressed_chunks(pctx, &rc,
+								  chunk_order,
+								  cb, true,
+								  cache_rdesc);
+			if (likely(!ret))
+				ret = advance_range_cursor(&rc, cached_data,
+							   chunk_start_offset,
+							   chunk_end_offset, cb);
+			solid_cache_put(cached_chunk);
+			if (unlikely(ret))
+				goto out_cleanup;
+			cur_read_offset += chunk_csize;
+			read_rc = rc;
+		} else if (pctx) {
+
+			/* Read the chunk and hand it to the decompression
+			 * threads, feeding the oldest decompressed chunks to
+			 * the callback function whenever the window is full.  */
+			void *read_buf;
+
+			while (!(read_buf = parallel_chunk_decompressor_get_chunk_buffer(
+						pctx, chunk_csize, chunk_usize, i)))
+			{
+				ret = consume_decompressed_chunks(pctx, &rc,
+								  chunk_order,
+								  cb, false,
+								  cache_rdesc);
+				if (unlikely(ret))
+					goto out_cleanup;
+			}
+
+			ret = full_pread(in_fd,
+					 read_buf,
+					 chunk_csize,
+					 cur_read_offset);
+			if (unlikely(ret))
+				goto read_error;
+
+			parallel_chunk_decompressor_signal_chunk_filled(pctx);
+			cur_read_offset += chunk_csize;
+
+			/* At least one range requires data in this chunk.  */
+			advance_range_cursor(&read_rc, NULL, chunk_start_offset,
+					     chunk_end_offset, NULL);
 		} else {
 
 			/* Read the chunk and feed data to the callback
@@ -486,38 +663,27 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 					goto out_cleanup;
 			}
 			cur_read_offset += chunk_csize;
+			if (cache_rdesc)
+				solid_cache_insert(cache_rdesc, i, ubuf,
+						   chunk_usize);
 
 			/* At least one range requires data in this chunk.  */
-			do {
-				size_t start, end, size;
-
-				/* Calculate how many bytes of data should be
-				 * sent to the callback function, taking into
-				 * account that data sent to the callback
-				 * function must not overlap range boundaries.
-				 */
-				start = cur_range_pos - chunk_start_offset;
-				end = min(cur_range_end, chunk_end_offset) - chunk_start_offset;
-				size = end - start;
-
-				ret = consume_chunk(cb, &ubuf[start], size);
-				if (unlikely(ret))
-					goto out_cleanup;
-
-				cur_range_pos += size;
-				if (cur_range_pos == cur_range_end) {
-					/* Advance to next range.  */
-					if (++cur_range == end_range) {
-						cur_range_pos = ~0ULL;
-					} else {
-						cur_range_pos = cur_range->offset;
-						cur_range_end = cur_range->offset + cur_range->size;
-					}
-				}
-			} while (cur_range_pos < chunk_end_offset);
+			ret = advance_range_cursor(&rc, ubuf, chunk_start_offset,
+						   chunk_end_offset, cb);
+			if (unlikely(ret))
+				goto out_cleanup;
+			read_rc = rc;
 		}
 	}
 
+	if (pctx) {
+		/* Feed the chunks that are still being decompressed.  */
+		ret = consume_decompressed_chunks(pctx, &rc, chunk_order,
+						  cb, true, cache_rdesc);
+		if (unlikely(ret))
+			goto out_cleanup;
+	}
+
 	if (is_pipe_read &&
 	    last_offset == rdesc->uncompressed_size - 1 &&
 	    chunk_table_size)
@@ -535,6 +701,12 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 	ret = 0;
 
 out_cleanup:
+	if (pctx) {
+		/* Drop the chunks that weren't consumed because of an error.  */
+		parallel_chunk_decompressor_reset(pctx);
+		free_parallel_chunk_decompressor(rdesc->wim->parallel_decompressor);
+		rdesc->wim->parallel_decompressor = pctx;
+	}
 	if (decompressor) {
 		wimlib_free_decompressor(rdesc->wim->decompressor);
 		rdesc->wim->decompressor = decompressor;
@@ -1108,6 +1280,436 @@ out_next_cb:
 	return call_end_blob(blob, ret, &ctx->cbs);
 }
 
+/*
+ * Parallel verification of the SHA-1 message digests of the blobs being read.
+ *
+ * The data of each blob is copied into reference counted buffers, which are
+ * shared by the segments of consecutive blobs, and the segments are queued to
+ * worker threads.  All the segments of a blob go to the same thread, so that
+ * they are hashed in order.  The sink callbacks are called without waiting for
+ * the digests, and the blobs that turned out to be corrupted are reported from
+ * the reading thread, at the start of a later blob or at the end of the read.
+ */
+
+#define VERIFY_BUFFER_SIZE		(1U << 20)
+#define VERIFY_BUFFERS_PER_THREAD	4
+#define VERIFY_MAX_THREADS		8
+
+struct verify_buffer {
+	struct list_head list;
+	unsigned refcnt;
+	size_t used;
+	u8 data[];
+};
+
+struct verify_job {
+	struct blob_descriptor *blob;
+	struct sha1_ctx sha_ctx;
+	u8 hash[SHA1_HASH_SIZE];
+	bool abandoned;
+	struct verify_worker *worker;
+	struct list_head done_list;
+};
+
+struct verify_item {
+	struct list_head list;
+	struct verify_job *job;
+	struct verify_buffer *buf;	/* NULL for the end of the blob */
+	size_t offset;
+	size_t size;
+};
+
+struct verify_worker {
+	struct thread thread;
+	struct parallel_hasher_context *ctx;
+	struct condvar item_avail_cond;
+	struct list_head items;
+};
+
+struct parallel_hasher_context {
+	struct mutex lock;
+	struct condvar buf_avail_cond;
+	struct condvar job_done_cond;
+	struct verify_worker *workers;
+	unsigned num_workers;
+	unsigned num_started_workers;
+	unsigned next_worker;
+	bool terminating;
+
+	struct verify_buffer **bufs;
+	size_t num_bufs;
+	struct list_head free_bufs;
+
+	/* Buffer being filled by the reading thread, which holds a reference
+	 * to it, and start of the data of the current blob in it.  */
+	struct verify_buffer *cur_buf;
+	size_t cur_segment_start;
+	struct verify_job *cur_job;
+
+	struct list_head done_jobs;
+	size_t num_pending_jobs;
+
+	int flags;
+	struct read_blob_callbacks cbs;
+};
+
+/* Drop a reference to a buffer.  Must be called with the lock held.  */
+static void
+put_verify_buffer(struct parallel_hasher_context *ctx, struct verify_buffer *buf)
+{
+	if (--buf->refcnt == 0) {
+		list_add_tail(&buf->list, &ctx->free_bufs);
+		condvar_signal(&ctx->buf_avail_cond);
+	}
+}
+
+static void *
+verify_worker_proc(void *arg)
+{
+	struct verify_worker *worker = arg;
+	struct parallel_hasher_context *ctx = worker->ctx;
+	struct verify_item *item;
+	struct verify_job *job;
+
+	mutex_lock(&ctx->lock);
+	for (;;) {
+		while (list_empty(&worker->items) && !ctx->terminating)
+			condvar_wait(&worker->item_avail_cond, &ctx->lock);
+		if (list_empty(&worker->items))
+			break;
+		item = list_entry(worker->items.next, struct verify_item, list);
+		list_del(&item->list);
+		mutex_unlock(&ctx->lock);
+
+		job = item->job;
+		if (item->buf)
+			sha1_update(&job->sha_ctx, &item->buf->data[item->offset],
+				    item->size);
+		else if (!job->abandoned)
+			sha1_final(&job->sha_ctx, job->hash);
+
+		mutex_lock(&ctx->lock);
+		if (item->buf) {
+			put_verify_buffer(ctx, item->buf);
+		} else {
+			list_add_tail(&job->done_list, &ctx->done_jobs);
+			condvar_signal(&ctx->job_done_cond);
+		}
+		FREE(item);
+	}
+	mutex_unlock(&ctx->lock);
+	return NULL;
+}
+
+static int
+queue_verify_item(struct parallel_hasher_context *ctx, struct verify_job *job,
+		  struct verify_buffer *buf, size_t offset, size_t size)
+{
+	struct verify_item *item = MALLOC(sizeof(*item));
+
+	if (unlikely(!item))
+		return WIMLIB_ERR_NOMEM;
+	item->job = job;
+	item->buf = buf;
+	item->offset = offset;
+	item->size = size;
+
+	mutex_lock(&ctx->lock);
+	if (buf)
+		buf->refcnt++;
+	list_add_tail(&item->list, &job->worker->items);
+	condvar_signal(&job->worker->item_avail_cond);
+	mutex_unlock(&ctx->lock);
+	return 0;
+}
+
+/* Queue the data of the current blob that was copied into the current buffer
+ * since the last time this was called.  */
+static int
+flush_verify_segment(struct parallel_hasher_context *ctx)
+{
+	struct verify_buffer *buf = ctx->cur_buf;
+	int ret;
+
+	if (!buf || buf->used == ctx->cur_segment_start)
+		return 0;
+	ret = queue_verify_item(ctx, ctx->cur_job, buf, ctx->cur_segment_start,
+				buf->used - ctx->cur_segment_start);
+	ctx->cur_segment_start = buf->used;
+	return ret;
+}
+
+/* Replace the current buffer with an empty one, waiting for the workers to
+ * release one if needed.  */
+static void
+next_verify_buffer(struct parallel_hasher_context *ctx)
+{
+	mutex_lock(&ctx->lock);
+	if (ctx->cur_buf)
+		put_verify_buffer(ctx, ctx->cur_buf);
+	while (list_empty(&ctx->free_bufs))
+		condvar_wait(&ctx->buf_avail_cond, &ctx->lock);
+	ctx->cur_buf = list_entry(ctx->free_bufs.next, struct verify_buffer, list);
+	list_del(&ctx->cur_buf->list);
+	mutex_unlock(&ctx->lock);
+
+	ctx->cur_buf->refcnt = 1;
+	ctx->cur_buf->used = 0;
+	ctx->cur_segment_start = 0;
+}
+
+/* Report the blobs whose digests have been computed, optionally waiting for
+ * all of them first.  Returns the first error.  */
+static int
+collect_verify_jobs(struct parallel_hasher_context *ctx, bool wait_all)
+{
+	struct list_head done;
+	struct verify_job *job;
+	int ret = 0, ret2;
+
+	for (;;) {
+		INIT_LIST_HEAD(&done);
+		mutex_lock(&ctx->lock);
+		while (wait_all && ctx->num_pending_jobs != 0 &&
+		       list_empty(&ctx->done_jobs))
+			condvar_wait(&ctx->job_done_cond, &ctx->lock);
+		list_splice_tail(&ctx->done_jobs, &done);
+		INIT_LIST_HEAD(&ctx->done_jobs);
+		mutex_unlock(&ctx->lock);
+
+		if (list_empty(&done))
+			return ret;
+
+		while (!list_empty(&done)) {
+			job = list_entry(done.next, struct verify_job, done_list);
+			list_del(&job->done_list);
+			ctx->num_pending_jobs--;
+
+			if (!job->abandoned &&
+			    unlikely(!hashes_equal(job->hash, job->blob->hash)))
+			{
+				ret2 = report_sha1_mismatch(job->blob, job->hash,
+							    ctx->flags & RECOVER_DATA);
+				if (!ret2 && ctx->cbs.corrupted_blob)
+					ret2 = (*ctx->cbs.corrupted_blob)(job->blob,
+									  ctx->cbs.ctx);
+				if (!ret)
+					ret = ret2;
+			}
+			FREE(job);
+		}
+	}
+}
+
+static int
+parallel_hasher_begin_blob(struct blob_descriptor *blob, void *_ctx)
+{
+	struct parallel_hasher_context *ctx = _ctx;
+	struct verify_job *job;
+	int ret;
+
+	ret = collect_verify_jobs(ctx, false);
+	if (unlikely(ret))
+		return ret;
+
+	blob->corrupted = 0;
+	ret = call_begin_blob(blob, &ctx->cbs);
+	if (ret)
+		return ret;
+
+	/* Blobs without a digest are left alone, as with the serial hasher
+	 * when COMPUTE_MISSING_BLOB_HASHES isn't set.  */
+	if (blob->unhashed)
+		return 0;
+
+	job = MALLOC(sizeof(*job));
+	if (unlikely(!job)) {
+		ret = WIMLIB_ERR_NOMEM;
+		return call_end_blob(blob, ret, &ctx->cbs);
+	}
+	job->blob = blob;
+	job->abandoned = false;
+	sha1_init(&job->sha_ctx);
+	job->worker = &ctx->workers[ctx->next_worker++ % ctx->num_started_workers];
+	ctx->num_pending_jobs++;
+	ctx->cur_job = job;
+	if (ctx->cur_buf)
+		ctx->cur_segment_start = ctx->cur_buf->used;
+	return 0;
+}
+
+static int
+parallel_hasher_continue_blob(const struct blob_descriptor *blob, u64 offset,
+			      const void *chunk, size_t size, void *_ctx)
+{
+	struct parallel_hasher_context *ctx = _ctx;
+	const u8 *p = chunk;
+	size_t remaining = size;
+	int ret;
+
+	while (ctx->cur_job && remaining) {
+		size_t n;
+
+		if (!ctx->cur_buf || ctx->cur_buf->used == VERIFY_BUFFER_SIZE) {
+			ret = flush_verify_segment(ctx);
+			if (unlikely(ret))
+				return ret;
+			next_verify_buffer(ctx);
+		}
+		n = min(remaining, VERIFY_BUFFER_SIZE - ctx->cur_buf->used);
+		memcpy(&ctx->cur_buf->data[ctx->cur_buf->used], p, n);
+		ctx->cur_buf->used += n;
+		p += n;
+		remaining -= n;
+	}
+
+	return call_continue_blob(blob, offset, chunk, size, &ctx->cbs);
+}
+
+static int
+parallel_hasher_end_blob(struct blob_descriptor *blob, int status, void *_ctx)
+{
+	struct parallel_hasher_context *ctx = _ctx;
+	struct verify_job *job = ctx->cur_job;
+	int ret;
+
+	if (job) {
+		/* If an error occurred, the full blob may not have been read.  */
+		ret = flush_verify_segment(ctx);
+		ctx->cur_job = NULL;
+		if (unlikely(ret) && !status)
+			status = ret;
+		if (unlikely(status))
+			job->abandoned = true;
+		ret = queue_verify_item(ctx, job, NULL, 0, 0);
+		if (unlikely(ret)) {
+			/* The job can't be handed to its worker, which may
+			 * still have segments of it queued.  Don't report it.  */
+			ctx->num_pending_jobs--;
+			if (!status)
+				status = ret;
+		}
+	}
+	return call_end_blob(blob, status, &ctx->cbs);
+}
+
+static void
+free_parallel_hasher(struct parallel_hasher_context *ctx)
+{
+	unsigned i;
+
+	if (ctx->num_started_workers != 0) {
+		mutex_lock(&ctx->lock);
+		ctx->terminating = true;
+		for (i = 0; i < ctx->num_started_workers; i++)
+			condvar_signal(&ctx->workers[i].item_avail_cond);
+		mutex_unlock(&ctx->lock);
+		for (i = 0; i < ctx->num_started_workers; i++)
+			thread_join(&ctx->workers[i].thread);
+	}
+	for (i = 0; i < ctx->num_workers; i++)
+		condvar_destroy(&ctx->workers[i].item_avail_cond);
+	FREE(ctx->workers);
+	if (ctx->bufs) {
+		for (size_t j = 0; j < ctx->num_bufs; j++)
+			FREE(ctx->bufs[j]);
+		FREE(ctx->bufs);
+	}
+	condvar_destroy(&ctx->job_done_cond);
+	condvar_destroy(&ctx->buf_avail_cond);
+	mutex_destroy(&ctx->lock);
+	FREE(ctx);
+}
+
+/* Set up parallel verification for read_blob_list().  Returns NULL if it isn't
+ * possible, in which case the serial hasher is used.  */
+static struct parallel_hasher_context *
+new_parallel_hasher(const struct read_blob_callbacks *cbs, int flags)
+{
+	struct parallel_hasher_context *ctx;
+	unsigned num_workers = get_available_cpus();
+	unsigned i;
+
+	/* The reading thread keeps a processor busy too.  */
+	if (num_workers < 2)
+		return NULL;
+	num_workers = min(num_workers - 1, VERIFY_MAX_THREADS);
+
+	ctx = CALLOC(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+	if (!mutex_init(&ctx->lock))
+		goto err_free_ctx;
+	if (!condvar_init(&ctx->buf_avail_cond))
+		goto err_destroy_lock;
+	if (!condvar_init(&ctx->job_done_cond))
+		goto err_destroy_buf_avail_cond;
+	INIT_LIST_HEAD(&ctx->free_bufs);
+	INIT_LIST_HEAD(&ctx->done_jobs);
+	ctx->flags = flags;
+	ctx->cbs = *cbs;
+
+	ctx->workers = CALLOC(num_workers, sizeof(ctx->workers[0]));
+	if (!ctx->workers)
+		goto err;
+	for (; ctx->num_workers < num_workers; ctx->num_workers++) {
+		struct verify_worker *worker = &ctx->workers[ctx->num_workers];
+
+		if (!condvar_init(&worker->item_avail_cond))
+			goto err;
+		worker->ctx = ctx;
+		INIT_LIST_HEAD(&worker->items);
+	}
+
+	ctx->num_bufs = (size_t)num_workers * VERIFY_BUFFERS_PER_THREAD;
+	ctx->bufs = CALLOC(ctx->num_bufs, sizeof(ctx->bufs[0]));
+	if (!ctx->bufs)
+		goto err;
+	for (size_t j = 0; j < ctx->num_bufs; j++) {
+		ctx->bufs[j] = MALLOC(sizeof(struct verify_buffer) +
+				      VERIFY_BUFFER_SIZE);
+		if (!ctx->bufs[j])
+			goto err;
+		list_add_tail(&ctx->bufs[j]->list, &ctx->free_bufs);
+	}
+
+	for (i = 0; i < num_workers; i++) {
+		if (!thread_create(&ctx->workers[i].thread, verify_worker_proc,
+				   &ctx->workers[i]))
+			break;
+		ctx->num_started_workers++;
+	}
+	if (ctx->num_started_workers == 0)
+		goto err;
+	return ctx;
+
+err:
+	free_parallel_hasher(ctx);
+	return NULL;
+
+err_destroy_buf_avail_cond:
+	condvar_destroy(&ctx->buf_avail_cond);
+err_destroy_lock:
+	mutex_destroy(&ctx->lock);
+err_free_ctx:
+	FREE(ctx);
+	return NULL;
+}
+
+/* Wait for the pending verifications of read_blob_list(), report them and
+ * free the parallel hasher.  */
+static int
+finish_parallel_hasher(struct parallel_hasher_context *ctx, int status)
+{
+	int ret;
+
+	ret = collect_verify_jobs(ctx, true);
+	if (!status)
+		status = ret;
+	free_parallel_hasher(ctx);
+	return status;
+}
+
 /* Read the full data of the specified blob, passing the data into the specified
  * callbacks (all of which are optional) and either checking or computing the
  * SHA-1 message digest of the blob.  */
@@ -1236,6 +1838,13 @@ oom:
  *	RECOVER_DATA
  *		Don't consider corrupted blob data to be an error.
  *
+ *	PARALLEL_VERIFY_BLOB_HASHES
+ *		With VERIFY_BLOB_HASHES, calculate the SHA-1 message digests on
+ *		worker threads.  The end_blob() callback is then called before
+ *		the digest of the blob is known, and the corrupted_blob()
+ *		callback is used to report the blobs that don't match in
+ *		RECOVER_DATA mode.  Ignored with COMPUTE_MISSING_BLOB_HASHES.
+ *
  * The callback functions are allowed to delete the current blob from the list
  * if necessary.
  *
@@ -1251,6 +1860,7 @@ read_blob_list(struct list_head *blob_list, size_t list_head_offset,
 	struct list_head *cur, *next;
 	struct blob_descriptor *blob;
 	struct hasher_context *hasher_ctx;
+	struct parallel_hasher_context *parallel_hasher_ctx = NULL;
 	struct read_blob_callbacks *sink_cbs;
 
 	if (!(flags & BLOB_LIST_ALREADY_SORTED)) {
@@ -1260,7 +1870,20 @@ read_blob_list(struct list_head *blob_list, size_t list_head_offset,
 			return ret;
 	}
 
-	if (flags & (VERIFY_BLOB_HASHES | COMPUTE_MISSING_BLOB_HASHES)) {
+	if ((flags & PARALLEL_VERIFY_BLOB_HASHES) &&
+	    (flags & VERIFY_BLOB_HASHES) &&
+	    !(flags & COMPUTE_MISSING_BLOB_HASHES))
+		parallel_hasher_ctx = new_parallel_hasher(cbs, flags);
+
+	if (parallel_hasher_ctx) {
+		sink_cbs = alloca(sizeof(*sink_cbs));
+		*sink_cbs = (struct read_blob_callbacks) {
+			.begin_blob	= parallel_hasher_begin_blob,
+			.continue_blob	= parallel_hasher_continue_blob,
+			.end_blob	= parallel_hasher_end_blob,
+			.ctx		= parallel_hasher_ctx,
+		};
+	} else if (flags & (VERIFY_BLOB_HASHES | COMPUTE_MISSING_BLOB_HASHES)) {
 		hasher_ctx = alloca(sizeof(*hasher_ctx));
 		*hasher_ctx = (struct hasher_context) {
 			.flags	= flags,
@@ -1324,16 +1947,20 @@ read_blob_list(struct list_head *blob_list, size_t list_head_offset,
 								   sink_cbs,
 								   flags & RECOVER_DATA);
 				if (ret)
-					return ret;
+					goto out;
 				continue;
 			}
 		}
 
 		ret = read_blob_with_cbs(blob, sink_cbs, flags & RECOVER_DATA);
 		if (unlikely(ret && ret != BEGIN_BLOB_STATUS_SKIP_BLOB))
-			return ret;
+			goto out;
 	}
-	return 0;
+	ret = 0;
+out:
+	if (parallel_hasher_ctx)
+		ret = finish_parallel_hasher(parallel_hasher_ctx, ret);
+	return ret;
 }
 
 static int
@@ -0,0 +1,242 @@
+/*
+ * solid_cache.c
+ *
+ * Cache of decompressed chunks of solid resources.
+ */
+
+/*
+ * Copyright (C) 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <string.h>
+
+#include "wimlib.h"
+#include "wimlib/list.h"
+#include "wimlib/resource.h"
+#include "wimlib/solid_cache.h"
+#include "wimlib/threads.h"
+#include "wimlib/unaligned.h"
+#include "wimlib/util.h"
+#include "wimlib/wim.h"
+
+/* Number of hash buckets; chunks of solid resources are large, so there are
+ * never many of them in the cache.  */
+#define SOLID_CACHE_TABLE_ORDER	8
+#define SOLID_CACHE_TABLE_SIZE	(1 << SOLID_CACHE_TABLE_ORDER)
+
+struct solid_cache_chunk {
+	struct hlist_node hash_node;
+
+	/* Link in the LRU list, most recently used first.  */
+	struct list_head lru_list;
+
+	/* Identity of the chunk: the WIM part, the resource, and the index of
+	 * the chunk in the resource.  */
+	u8 guid[GUID_SIZE];
+	u16 part_number;
+	u64 offset_in_wim;
+	u64 size_in_wim;
+	u64 chunk_idx;
+
+	/* Number of references, including the one held by the cache while the
+	 * chunk is in it.  */
+	u32 refcnt;
+
+	u32 size;
+	u8 data[];
+};
+
+static struct mutex solid_cache_lock = MUTEX_INITIALIZER;
+static struct hlist_head solid_cache_table[SOLID_CACHE_TABLE_SIZE];
+static LIST_HEAD(solid_cache_lru);
+static u64 solid_cache_size;
+static volatile u64 solid_cache_max_size;
+
+static size_t
+solid_cache_hash(const u8 guid[GUID_SIZE], u64 offset_in_wim, u64 chunk_idx)
+{
+	return hash_u64(load_u64_unaligned(guid) ^ offset_in_wim ^
+			(chunk_idx << 32)) >> (64 - SOLID_CACHE_TABLE_ORDER);
+}
+
+static bool
+solid_cache_chunk_matches(const struct solid_cache_chunk *chunk,
+			  const struct wim_resource_descriptor *rdesc,
+			  u64 chunk_idx)
+{
+	return chunk->chunk_idx == chunk_idx &&
+	       chunk->offset_in_wim == rdesc->offset_in_wim &&
+	       chunk->size_in_wim == rdesc->size_in_wim &&
+	       chunk->part_number == rdesc->wim->hdr.part_number &&
+	       guids_equal(chunk->guid, rdesc->wim->hdr.guid);
+}
+
+static struct solid_cache_chunk *
+lookup_chunk(const struct wim_resource_descriptor *rdesc, u64 chunk_idx)
+{
+	struct hlist_node *node;
+	size_t bucket = solid_cache_hash(rdesc->wim->hdr.guid,
+					 rdesc->offset_in_wim, chunk_idx);
+
+	for (node = solid_cache_table[bucket].first; node; node = node->next) {
+		struct solid_cache_chunk *chunk =
+			hlist_entry(node, struct solid_cache_chunk, hash_node);
+		if (solid_cache_chunk_matches(chunk, rdesc, chunk_idx))
+			return chunk;
+	}
+	return NULL;
+}
+
+static void
+unref_chunk(struct solid_cache_chunk *chunk)
+{
+	if (--chunk->refcnt == 0)
+		FREE(chunk);
+}
+
+/* Remove a chunk from the cache.  It is freed once it is no longer used.  */
+static void
+evict_chunk(struct solid_cache_chunk *chunk)
+{
+	hlist_del(&chunk->hash_node);
+	list_del(&chunk->lru_list);
+	solid_cache_size -= chunk->size;
+	unref_chunk(chunk);
+}
+
+/* Evict the least recently used chunks until @size more bytes fit.  */
+static void
+shrink_cache(u64 size)
+{
+	while (!list_empty(&solid_cache_lru) &&
+	       solid_cache_size + size > solid_cache_max_size)
+	{
+		evict_chunk(list_last_entry(&solid_cache_lru,
+					    struct solid_cache_chunk, lru_list));
+	}
+}
+
+bool
+solid_cache_enabled(void)
+{
+	return solid_cache_max_size != 0;
+}
+
+struct solid_cache_chunk *
+solid_cache_get(const struct wim_resource_descriptor *rdesc, u64 chunk_idx,
+		u32 size, const u8 **data_ret)
+{
+	struct solid_cache_chunk *chunk;
+
+	mutex_lock(&solid_cache_lock);
+	chunk = lookup_chunk(rdesc, chunk_idx);
+	if (chunk && chunk->size == size) {
+		list_del(&chunk->lru_list);
+		list_add(&chunk->lru_list, &solid_cache_lru);
+		chunk->refcnt++;
+		*data_ret = chunk->data;
+	} else {
+		chunk = NULL;
+	}
+	mutex_unlock(&solid_cache_lock);
+	return chunk;
+}
+
+void
+solid_cache_put(struct solid_cache_chunk *chunk)
+{
+	mutex_lock(&solid_cache_lock);
+	unref_chunk(chunk);
+	mutex_unlock(&solid_cache_lock);
+}
+
+void
+solid_cache_insert(const struct wim_resource_descriptor *rdesc, u64 chunk_idx,
+		   const void *data, u32 size)
+{
+	struct solid_cache_chunk *chunk;
+
+	if (size > solid_cache_max_size)
+		return;
+
+	/* Copy the data before taking the lock.  */
+	chunk = MALLOC(sizeof(*chunk) + size);
+	if (!chunk)
+		return;
+	copy_guid(chunk->guid, rdesc->wim->hdr.guid);
+	chunk->part_number = rdesc->wim->hdr.part_number;
+	chunk->offset_in_wim = rdesc->offset_in_wim;
+	chunk->size_in_wim = rdesc->size_in_wim;
+	chunk->chunk_idx = chunk_idx;
+	chunk->refcnt = 1;
+	chunk->size = size;
+	memcpy(chunk->data, data, size);
+
+	mutex_lock(&solid_cache_lock);
+	if (size > solid_cache_max_size || lookup_chunk(rdesc, chunk_idx)) {
+		/* The cache was shrunk or the chunk was added by another
+		 * thread in the meantime.  */
+		FREE(chunk);
+	} else {
+		shrink_cache(size);
+		hlist_add_head(&chunk->hash_node,
+			       &solid_cache_table[solid_cache_hash(chunk->guid,
+								   chunk->offset_in_wim,
+								   chunk_idx)]);
+		list_add(&chunk->lru_list, &solid_cache_lru);
+		solid_cache_size += size;
+	}
+	mutex_unlock(&solid_cache_lock);
+}
+
+void
+solid_cache_invalidate(const u8 guid[GUID_SIZE])
+{
+	struct solid_cache_chunk *chunk, *tmp;
+
+	mutex_lock(&solid_cache_lock);
+	list_for_each_entry_safe(chunk, tmp, &solid_cache_lru, lru_list)
+		if (guids_equal(chunk->guid, guid))
+			evict_chunk(chunk);
+	mutex_unlock(&solid_cache_lock);
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI void
+wimlib_set_solid_cache_size(uint64_t max_size)
+{
+	mutex_lock(&solid_cache_lock);
+	solid_cache_max_size = max_size;
+	/* A disabled cache keeps its chunks until wimlib_free_solid_cache().  */
+	if (max_size != 0)
+		shrink_cache(0);
+	mutex_unlock(&solid_cache_lock);
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI void
+wimlib_free_solid_cache(void)
+{
+	mutex_lock(&solid_cache_lock);
+	while (!list_empty(&solid_cache_lru))
+		evict_chunk(list_first_entry(&solid_cache_lru,
+					     struct solid_cache_chunk, lru_list));
+	mutex_unlock(&solid_cache_lock);
+}
@@ -0,0 +1,687 @@
+/*
+ * unix_apply.c - Code to apply files from a WIM image on a POSIX system.
+ *
+ * This is a minimal, portable backend: it creates directories, regular files,
+ * hard links and symbolic links, and applies timestamps and, if requested,
+ * UNIX data.  It is mostly meant to allow exercising (and benchmarking) the
+ * extraction pipeline against a local directory.
+ */
+
+/*
+ * Copyright (C) 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifndef _WIN32
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "wimlib/apply.h"
+#include "wimlib/assert.h"
+#include "wimlib/blob_table.h"
+#include "wimlib/dentry.h"
+#include "wimlib/error.h"
+#include "wimlib/inode.h"
+#include "wimlib/reparse.h"
+#include "wimlib/timestamp.h"
+#include "wimlib/unix_data.h"
+#include "wimlib/write_behind.h"
+
+struct unix_apply_ctx {
+
+	/* Extract flags, the pointer to the WIMStruct, etc.  */
+	struct apply_ctx common;
+
+	/* Buffers for building extraction paths (allocated), each of which is
+	 * @path_max bytes.  Two are needed to create hard links.  */
+	char *pathbufs[2];
+	size_t path_max;
+
+	/* File descriptors of the files the current blob is being written to,
+	 * and whether each of them is being written in "sparse" mode.  */
+	int open_fds[MAX_OPEN_FILES];
+	bool is_sparse_file[MAX_OPEN_FILES];
+	unsigned num_open_fds;
+	bool any_sparse_files;
+
+	/* End of the last nonzero region of the current blob that was written
+	 * to the sparse files.  The zeroes past it are never written.  */
+	u64 sparse_data_end;
+
+	/* Buffer for the reparse data of symbolic links, and pointer to the
+	 * next byte to fill (NULL if the current blob isn't reparse data).  */
+	struct reparse_buffer_disk rpbuf;
+	u8 *reparse_ptr;
+
+	/* List of dentries, joined by @d_tmp_list, that need to be created as
+	 * symbolic links once the whole reparse data has been read.  */
+	struct list_head reparse_dentries;
+
+	/* Buffer for the target of a symbolic link  */
+	char link_target[REPARSE_POINT_MAX_SIZE];
+
+	/* Write-behind stage, or NULL if the blob data is written
+	 * synchronously.  */
+	struct write_behind *write_behind;
+
+	/* Number of files for which we couldn't set the UNIX owner.  */
+	unsigned long num_chown_failures;
+};
+
+static int
+unix_get_supported_features(const char *target,
+			    struct wim_features *supported_features)
+{
+	supported_features->sparse_files = 1;
+	supported_features->hard_links = 1;
+	supported_features->symlink_reparse_points = 1;
+	supported_features->unix_data = 1;
+	supported_features->timestamps = 1;
+	supported_features->case_sensitive_filenames = 1;
+	return 0;
+}
+
+/* Returns true if the inode must be extracted as a directory.  */
+static bool
+unix_inode_is_directory(const struct wim_inode *inode)
+{
+	return (inode->i_attributes & FILE_ATTRIBUTE_DIRECTORY) &&
+		!inode_is_symlink(inode);
+}
+
+/* Returns the number of bytes needed to represent the path to the specified
+ * @dentry, relative to the target directory and including the leading
+ * slash.  */
+static size_t
+dentry_extraction_path_length(const struct wim_dentry *dentry)
+{
+	size_t len = 0;
+	const struct wim_dentry *d = dentry;
+
+	do {
+		len += d->d_extraction_name_nchars + 1;
+		d = d->d_parent;
+	} while (!dentry_is_root(d) && will_extract_dentry(d));
+
+	return len;
+}
+
+/* Build the full path at which to extract the @dentry in the path buffer
+ * @which and return it.  */
+static const char *
+unix_build_extraction_path(const struct wim_dentry *dentry,
+			   struct unix_apply_ctx *ctx, int which)
+{
+	char *buf = ctx->pathbufs[which];
+	const size_t target_len = ctx->common.target_nchars;
+	const struct wim_dentry *d = dentry;
+	char *p;
+
+	p = buf + target_len + dentry_extraction_path_length(dentry);
+	*p = '\0';
+	do {
+		p -= d->d_extraction_name_nchars;
+		memcpy(p, d->d_extraction_name, d->d_extraction_name_nchars);
+		*--p = '/';
+		d = d->d_parent;
+	} while (!dentry_is_root(d) && will_extract_dentry(d));
+	wimlib_assert(p == buf + target_len);
+	memcpy(buf, ctx->common.target, target_len);
+	return buf;
+}
+
+static int
+prepare_target(struct list_head *dentry_list, struct unix_apply_ctx *ctx)
+{
+	const struct wim_dentry *dentry;
+	size_t max = 0;
+
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node)
+		max = max(max, dentry_extraction_path_length(dentry));
+
+	ctx->path_max = ctx->common.target_nchars + max + 1;
+	for (int i = 0; i < 2; i++) {
+		ctx->pathbufs[i] = MALLOC(ctx->path_max);
+		if (!ctx->pathbufs[i])
+			return WIMLIB_ERR_NOMEM;
+	}
+	return 0;
+}
+
+static int
+unix_create_directories(struct list_head *dentry_list,
+			struct unix_apply_ctx *ctx)
+{
+	const struct wim_dentry *dentry;
+	const char *path;
+	int ret;
+
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
+		if (!unix_inode_is_directory(dentry->d_inode))
+			continue;
+
+		path = unix_build_extraction_path(dentry, ctx, 0);
+		if (mkdir(path, 0755) && errno != EEXIST) {
+			ERROR_WITH_ERRNO("Can't create directory \"%s\"", path);
+			ret = report_apply_error(&ctx->common, WIMLIB_ERR_MKDIR,
+						 path);
+			if (ret)
+				return ret;
+		}
+		ret = report_file_created(&ctx->common);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Create the regular files and the hard links.  Symbolic links are created
+ * once their reparse data has been read.  */
+static int
+unix_create_nondirectories(struct list_head *dentry_list,
+			   struct unix_apply_ctx *ctx)
+{
+	const struct wim_dentry *dentry;
+	const struct wim_dentry *alias;
+	const char *first_path;
+	const char *path;
+	int ret;
+	int fd;
+
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
+		const struct wim_inode *inode = dentry->d_inode;
+
+		if (unix_inode_is_directory(inode))
+			continue;
+
+		/* The first alias of an inode need not be the first one in the
+		 * list, so all the aliases are created along with it.  */
+		if (!inode_is_symlink(inode) &&
+		    dentry == inode_first_extraction_dentry(inode)) {
+			path = unix_build_extraction_path(dentry, ctx, 0);
+			fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0) {
+				ERROR_WITH_ERRNO("Can't create \"%s\"", path);
+				ret = WIMLIB_ERR_OPEN;
+				goto report_error;
+			}
+			close(fd);
+			first_path = path;
+			inode_for_each_extraction_alias(alias, inode) {
+				if (alias == dentry)
+					continue;
+				path = unix_build_extraction_path(alias, ctx, 1);
+				if ((unlink(path) && errno != ENOENT) ||
+				    link(first_path, path))
+				{
+					ERROR_WITH_ERRNO("Can't create hard link "
+							 "\"%s\"", path);
+					ret = WIMLIB_ERR_LINK;
+					goto report_error;
+				}
+			}
+		}
+		ret = report_file_created(&ctx->common);
+		if (ret)
+			return ret;
+		continue;
+
+	report_error:
+		ret = report_apply_error(&ctx->common, ret, path);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int
+pwrite_to_fd(int fd, const void *data, size_t size, u64 offset)
+{
+	const u8 *p = data;
+	ssize_t n;
+
+	while (size) {
+		n = pwrite(fd, p, size, offset);
+		if (unlikely(n < 0)) {
+			if (errno == EINTR)
+				continue;
+			ERROR_WITH_ERRNO("Error writing data to target "
+					 "directory");
+			return WIMLIB_ERR_WRITE;
+		}
+		p += n;
+		size -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+/* Extend a sparse file, of which only the nonzero regions were written, to its
+ * final size.  */
+static int
+extend_file(int fd, u64 size)
+{
+	if (ftruncate(fd, size)) {
+		ERROR_WITH_ERRNO("Error writing data to target directory "
+				 "(while extending)");
+		return WIMLIB_ERR_WRITE;
+	}
+	return 0;
+}
+
+static void
+close_fds(struct unix_apply_ctx *ctx)
+{
+	for (unsigned i = 0; i < ctx->num_open_fds; i++)
+		close(ctx->open_fds[i]);
+	ctx->num_open_fds = 0;
+}
+
+static int
+begin_extract_blob_instance(const struct blob_descriptor *blob,
+			    struct wim_inode *inode,
+			    const struct wim_inode_stream *strm,
+			    struct unix_apply_ctx *ctx)
+{
+	struct wim_dentry *dentry;
+	const char *path;
+	int fd;
+
+	if (unlikely(strm->stream_type == STREAM_TYPE_REPARSE_POINT)) {
+		/* Symbolic links need the whole reparse data, so stage it in
+		 * a buffer.  */
+		if (blob->size > REPARSE_DATA_MAX_SIZE) {
+			dentry = inode_first_extraction_dentry(inode);
+			ERROR("Reparse data of \"%s\" has size %"PRIu64" bytes "
+			      "(exceeds %u bytes)",
+			      unix_build_extraction_path(dentry, ctx, 0),
+			      blob->size, REPARSE_DATA_MAX_SIZE);
+			return WIMLIB_ERR_INVALID_REPARSE_DATA;
+		}
+		ctx->reparse_ptr = ctx->rpbuf.rpdata;
+		inode_for_each_extraction_alias(dentry, inode)
+			list_add_tail(&dentry->d_tmp_list,
+				      &ctx->reparse_dentries);
+		return 0;
+	}
+
+	/* Named data streams are not supported by this backend.  */
+	if (!stream_is_unnamed_data_stream(strm))
+		return 0;
+
+	if (ctx->num_open_fds == MAX_OPEN_FILES) {
+		ERROR("Can't extract data: too many open files!");
+		return WIMLIB_ERR_UNSUPPORTED;
+	}
+
+	path = unix_build_extraction_path(inode_first_extraction_dentry(inode),
+					  ctx, 0);
+	fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		ERROR_WITH_ERRNO("Can't open \"%s\" for writing", path);
+		return WIMLIB_ERR_OPEN;
+	}
+
+	/* With WIMLIB_EXTRACT_FLAG_SKIP_ZEROES, large files are written like
+	 * sparse files.  */
+	ctx->is_sparse_file[ctx->num_open_fds] =
+		(inode->i_attributes & FILE_ATTRIBUTE_SPARSE_FILE) ||
+		should_skip_zeroes(&ctx->common, blob->size);
+	ctx->any_sparse_files |= ctx->is_sparse_file[ctx->num_open_fds];
+	ctx->open_fds[ctx->num_open_fds++] = fd;
+	return 0;
+}
+
+/* Called when starting to read a blob for extraction */
+static int
+unix_begin_extract_blob(struct blob_descriptor *blob, void *_ctx)
+{
+	struct unix_apply_ctx *ctx = _ctx;
+	const struct blob_extraction_target *targets = blob_extraction_targets(blob);
+	int ret;
+
+	ctx->num_open_fds = 0;
+	ctx->any_sparse_files = false;
+	ctx->sparse_data_end = 0;
+	ctx->reparse_ptr = NULL;
+	INIT_LIST_HEAD(&ctx->reparse_dentries);
+
+	if (ctx->write_behind) {
+		ret = write_behind_begin_blob(ctx->write_behind, blob->size,
+					      blob->out_refcnt);
+		if (ret)
+			return ret;
+	}
+
+	for (u32 i = 0; i < blob->out_refcnt; i++) {
+		ret = begin_extract_blob_instance(blob, targets[i].inode,
+						  targets[i].stream, ctx);
+		if (ret)
+			goto fail;
+	}
+
+	if (ctx->write_behind) {
+		for (unsigned i = 0; i < ctx->num_open_fds; i++)
+			write_behind_add_file(ctx->write_behind,
+					      (void *)(intptr_t)ctx->open_fds[i],
+					      ctx->is_sparse_file[i]);
+		ctx->num_open_fds = 0;
+	}
+	return 0;
+
+fail:
+	close_fds(ctx);
+	if (ctx->write_behind)
+		write_behind_end_blob(ctx->write_behind, ret);
+	return ret;
+}
+
+/* Called when the next chunk of a blob has been read for extraction */
+static int
+unix_extract_chunk(const struct blob_descriptor *blob, u64 offset,
+		   const void *chunk, size_t size, void *_ctx)
+{
+	struct unix_apply_ctx *ctx = _ctx;
+	const u8 *p = chunk;
+	const u8 * const end = p + size;
+	bool zeroes;
+	size_t len;
+	int ret;
+
+	if (ctx->write_behind) {
+		ret = write_behind_write(ctx->write_behind, chunk, size, offset);
+		if (ret)
+			return ret;
+		goto out;
+	}
+
+	/* For sparse files, only write nonzero regions.  */
+	for (; p != end; p += len, offset += len) {
+		zeroes = maybe_detect_sparse_region(p, end - p, &len,
+						    ctx->any_sparse_files);
+		if (!zeroes)
+			ctx->sparse_data_end = offset + len;
+		for (unsigned i = 0; i < ctx->num_open_fds; i++) {
+			if (zeroes && ctx->is_sparse_file[i])
+				continue;
+			ret = pwrite_to_fd(ctx->open_fds[i], p, len, offset);
+			if (ret)
+				return ret;
+		}
+	}
+
+out:
+	if (ctx->reparse_ptr)
+		ctx->reparse_ptr = mempcpy(ctx->reparse_ptr, chunk, size);
+	return 0;
+}
+
+static int
+unix_create_symlink(struct wim_dentry *dentry, const struct blob_descriptor *blob,
+		    struct unix_apply_ctx *ctx)
+{
+	struct blob_descriptor blob_override;
+	const char *altroot = NULL;
+	size_t altroot_len = 0;
+	const char *path;
+	int len;
+
+	/* Translate the reparse data, which is in our buffer.  */
+	blob_set_is_located_in_attached_buffer(&blob_override,
+					       ctx->rpbuf.rpdata, blob->size);
+	if (ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_RPFIX) {
+		altroot = ctx->common.target;
+		altroot_len = ctx->common.target_nchars;
+	}
+	len = wim_inode_readlink(dentry->d_inode, ctx->link_target,
+				 sizeof(ctx->link_target) - 1, &blob_override,
+				 altroot, altroot_len);
+	path = unix_build_extraction_path(dentry, ctx, 0);
+	if (len < 0 || len == sizeof(ctx->link_target) - 1) {
+		ERROR("Can't translate the reparse data of \"%s\"", path);
+		return WIMLIB_ERR_INVALID_REPARSE_DATA;
+	}
+	ctx->link_target[len] = '\0';
+
+	if ((unlink(path) && errno != ENOENT) ||
+	    symlink(ctx->link_target, path))
+	{
+		ERROR_WITH_ERRNO("Can't create symbolic link \"%s\"", path);
+		return WIMLIB_ERR_LINK;
+	}
+	return 0;
+}
+
+/* Called when a blob has been fully read for extraction */
+static int
+unix_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
+{
+	struct unix_apply_ctx *ctx = _ctx;
+	struct wim_dentry *dentry;
+	int ret;
+
+	/* Extend sparse files to their final size.  */
+	if (ctx->any_sparse_files && !status) {
+		for (unsigned i = 0; i < ctx->num_open_fds; i++) {
+			if (!ctx->is_sparse_file[i])
+				continue;
+			status = extend_file(ctx->open_fds[i], blob->size);
+			if (status)
+				break;
+			ctx->common.progress.extract.skipped_zero_bytes +=
+				blob->size - ctx->sparse_data_end;
+		}
+	}
+
+	close_fds(ctx);
+
+	if (ctx->write_behind)
+		status = write_behind_end_blob(ctx->write_behind, status);
+
+	if (status || !ctx->reparse_ptr)
+		return status;
+
+	list_for_each_entry(dentry, &ctx->reparse_dentries, d_tmp_list) {
+		ret = unix_create_symlink(dentry, blob, ctx);
+		if (ret) {
+			ret = report_apply_error(&ctx->common, ret,
+						 unix_build_extraction_path(dentry, ctx, 0));
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+static int
+unix_write_behind_write(void *file, const void *data, size_t size, u64 offset)
+{
+	return pwrite_to_fd((intptr_t)file, data, size, offset);
+}
+
+static int
+unix_write_behind_close(void *file, u64 size, bool sparse, int status)
+{
+	int ret = 0;
+
+	if (sparse && !status)
+		ret = extend_file((intptr_t)file, size);
+	close((intptr_t)file);
+	return ret;
+}
+
+static const struct write_behind_ops unix_write_behind_ops = {
+	.write_file	= unix_write_behind_write,
+	.close_file	= unix_write_behind_close,
+};
+
+static int
+apply_metadata_to_file(const struct wim_dentry *dentry,
+		       struct unix_apply_ctx *ctx)
+{
+	const struct wim_inode *inode = dentry->d_inode;
+	const char *path = unix_build_extraction_path(dentry, ctx, 0);
+	struct wimlib_unix_data unix_data;
+	struct timespec times[2];
+
+	if ((ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_UNIX_DATA) &&
+	    inode_get_unix_data(inode, &unix_data))
+	{
+		if (lchown(path, unix_data.uid, unix_data.gid))
+			ctx->num_chown_failures++;
+		if (!inode_is_symlink(inode) &&
+		    chmod(path, unix_data.mode & 07777))
+		{
+			ERROR_WITH_ERRNO("Can't set mode of \"%s\"", path);
+			return WIMLIB_ERR_SET_SECURITY;
+		}
+	}
+
+	times[0] = wim_timestamp_to_timespec(inode->i_last_access_time);
+	times[1] = wim_timestamp_to_timespec(inode->i_last_write_time);
+	if (utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW) &&
+	    errno != ENOSYS && errno != EOPNOTSUPP)
+	{
+		ERROR_WITH_ERRNO("Can't set timestamps of \"%s\"", path);
+		return WIMLIB_ERR_SET_TIMESTAMPS;
+	}
+	return 0;
+}
+
+static int
+apply_metadata(struct list_head *dentry_list, struct unix_apply_ctx *ctx)
+{
+	const struct wim_dentry *dentry;
+	int ret;
+
+	/* Go in reverse so that the timestamps of a directory are set after
+	 * all its children have been updated.  */
+	list_for_each_entry_reverse(dentry, dentry_list, d_extraction_list_node)
+	{
+		ret = apply_metadata_to_file(dentry, ctx);
+		if (ret) {
+			ret = report_apply_error(&ctx->common, ret,
+						 unix_build_extraction_path(dentry, ctx, 0));
+			if (ret)
+				return ret;
+		}
+		ret = report_file_metadata_applied(&ctx->common);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static u64
+count_dentries(const struct list_head *dentry_list)
+{
+	const struct list_head *cur;
+	u64 count = 0;
+
+	list_for_each(cur, dentry_list)
+		count++;
+
+	return count;
+}
+
+/* Extract files from a WIM image to a directory on a POSIX system  */
+static int
+unix_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
+{
+	struct unix_apply_ctx *ctx = (struct unix_apply_ctx *)_ctx;
+	u64 dentry_count;
+	int ret;
+
+	ret = prepare_target(dentry_list, ctx);
+	if (ret)
+		goto out;
+
+	dentry_count = count_dentries(dentry_list);
+
+	ret = start_file_structure_phase(&ctx->common, dentry_count);
+	if (ret)
+		goto out;
+
+	ret = unix_create_directories(dentry_list, ctx);
+	if (ret)
+		goto out;
+
+	ret = unix_create_nondirectories(dentry_list, ctx);
+	if (ret)
+		goto out;
+
+	ret = end_file_structure_phase(&ctx->common);
+	if (ret)
+		goto out;
+
+	/* Like the Windows backend, write the data on other threads, or
+	 * synchronously if they can't be started.  */
+	new_write_behind(&unix_write_behind_ops, 0, 0, 0, &ctx->write_behind);
+
+	struct read_blob_callbacks cbs = {
+		.begin_blob	= unix_begin_extract_blob,
+		.continue_blob	= unix_extract_chunk,
+		.end_blob	= unix_end_extract_blob,
+		.ctx		= ctx,
+	};
+	ret = extract_blob_list(&ctx->common, &cbs);
+	if (!ret && ctx->write_behind) {
+		ret = write_behind_flush(ctx->write_behind);
+		ctx->common.progress.extract.skipped_zero_bytes +=
+			write_behind_skipped_bytes(ctx->write_behind);
+	}
+	if (ret)
+		goto out;
+
+	ret = start_file_metadata_phase(&ctx->common, dentry_count);
+	if (ret)
+		goto out;
+
+	ret = apply_metadata(dentry_list, ctx);
+	if (ret)
+		goto out;
+
+	ret = end_file_metadata_phase(&ctx->common);
+	if (ret)
+		goto out;
+
+	if (ctx->num_chown_failures) {
+		WARNING("Couldn't set the UNIX owner of %lu files",
+			ctx->num_chown_failures);
+	}
+out:
+	free_write_behind(ctx->write_behind);
+	FREE(ctx->pathbufs[0]);
+	FREE(ctx->pathbufs[1]);
+	return ret;
+}
+
+const struct apply_operations unix_apply_ops = {
+	.name			= "UNIX",
+	.get_supported_features = unix_get_supported_features,
+	.extract                = unix_extract,
+	.context_size           = sizeof(struct unix_apply_ctx),
+};
+
+#endif /* !_WIN32 */
@@ -286,11 +286,11 @@ rollback_unlink(struct wim_dentry *subject, struct wim_dentry *parent,
 
 /* Rollback a name change operation.  */
 static void
-rollback_name_change(utf16lechar *old_name,
+rollback_name_change(const struct wim_dentry *dentry, utf16lechar *old_name,
 		     utf16lechar **name_ptr, u16 *name_nbytes_ptr)
 {
 	/* Free the new name, then replace it with the old name.  */
-	FREE(*name_ptr);
+	dentry_free_name(dentry, *name_ptr);
 	if (old_name) {
 		*name_ptr = old_name;
 		*name_nbytes_ptr = utf16le_len_bytes(old_name);
@@ -315,12 +315,12 @@ rollback_update_primitive(const struct update_primitive *prim,
 		rollback_unlink(prim->link.subject, prim->link.parent, root_p);
 		break;
 	case CHANGE_FILE_NAME:
-		rollback_name_change(prim->name.old_name,
+		rollback_name_change(prim->name.subject, prim->name.old_name,
 				     &prim->name.subject->d_name,
 				     &prim->name.subject->d_name_nbytes);
 		break;
 	case CHANGE_SHORT_NAME:
-		rollback_name_change(prim->name.old_name,
+		rollback_name_change(prim->name.subject, prim->name.old_name,
 				     &prim->name.subject->d_short_name,
 				     &prim->name.subject->d_short_name_nbytes);
 		break;
@@ -460,7 +460,8 @@ commit_update(struct update_command_journal *j)
 			if (j->cmd_prims[i].entries[k].type == CHANGE_FILE_NAME ||
 			    j->cmd_prims[i].entries[k].type == CHANGE_SHORT_NAME)
 			{
-				FREE(j->cmd_prims[i].entries[k].name.old_name);
+				dentry_free_name(j->cmd_prims[i].entries[k].name.subject,
+						 j->cmd_prims[i].entries[k].name.old_name);
 			}
 		}
 	}
@@ -742,7 +743,11 @@ get_capture_config(const tchar *config_file, struct capture_config *config,
 
 		size_t len = tstrlen(fs_source_path) +
 			     tstrlen(wimboot_cfgfile);
+#ifdef _WIN32
 		struct _stat64 st;
+#else
+		struct stat st;
+#endif
 
 		tmp_config_file = MALLOC((len + 1) * sizeof(tchar));
 		if (!tmp_config_file)
@@ -33,6 +33,7 @@
 #include "wimlib.h"
 #include "wimlib/assert.h"
 #include "wimlib/blob_table.h"
+#include "wimlib/chunk_decompressor.h"
 #include "wimlib/cpu_features.h"
 #include "wimlib/dentry.h"
 #include "wimlib/encoding.h"
@@ -581,6 +582,20 @@ wimlib_set_output_chunk_size(WIMStruct *wim, u32 chunk_size)
 	return 0;
 }
 
+/* API function documented in wimlib.h  */
+WIMLIBAPI void
+wimlib_set_decompression_params(WIMStruct *wim, unsigned num_threads,
+				u64 max_memory)
+{
+	if (num_threads != wim->decompression_num_threads ||
+	    max_memory != wim->decompression_max_memory) {
+		free_parallel_chunk_decompressor(wim->parallel_decompressor);
+		wim->parallel_decompressor = NULL;
+	}
+	wim->decompression_num_threads = num_threads;
+	wim->decompression_max_memory = max_memory;
+}
+
 /* API function documented in wimlib.h  */
 WIMLIBAPI int
 wimlib_set_output_pack_chunk_size(WIMStruct *wim, u32 chunk_size)
@@ -1000,6 +1015,7 @@ wim_decrement_refcnt(WIMStruct *wim)
 	}
 #endif
 	wimlib_free_decompressor(wim->decompressor);
+	free_parallel_chunk_decompressor(wim->parallel_decompressor);
 	xml_free_info_struct(wim->xml_info);
 	FREE(wim->filename);
 	FREE(wim);
@@ -1044,6 +1060,12 @@ wimlib_get_version_string(void)
 	return T(PACKAGE_VERSION);
 }
 
+#ifndef _WIN32
+#define InterlockedIncrement16(p)	__atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement16(p)	__atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST)
+#define Sleep(ms)			usleep((ms) * 1000)
+#endif
+
 static volatile uint16_t lib_initialization_mutex = 0;
 static bool lib_initialized = false;
 
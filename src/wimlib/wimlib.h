@@ -1051,6 +1051,16 @@ union wimlib_progress_info {
 		 * end_file_count will only include directories and empty files.
 		 */
 		uint64_t end_file_count;
+
+		/** Number of trailing zero bytes of file data that were never
+		 * written, but left for the filesystem to extend the file with,
+		 * for sparse files and for the files that
+		 * ::WIMLIB_EXTRACT_FLAG_SKIP_ZEROES applies to.  The zero
+		 * regions that precede written data aren't included, since the
+		 * filesystem may fill them in.  This is only
+		 * final with ::WIMLIB_PROGRESS_MSG_EXTRACT_IMAGE_END and
+		 * ::WIMLIB_PROGRESS_MSG_EXTRACT_TREE_END.  */
+		uint64_t skipped_zero_bytes;
 	} extract;
 
 	/** Valid on messages ::WIMLIB_PROGRESS_MSG_RENAME. */
@@ -2101,6 +2111,21 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * 32768 byte chunks.  */
 #define WIMLIB_EXTRACT_FLAG_COMPACT_LZX			0x08000000
 
+/**
+ * Don't write the regions of file data which are all zeroes, even for files
+ * which aren't sparse, provided that they are at least 256 MiB in size.  Such
+ * files are instead extended to their full size once their nonzero data has
+ * been written, so the zero regions are left for the filesystem to fill in.
+ * This is meant for large, mostly empty files, such as virtual disks, of which
+ * the trailing zeroes are then never written at all.  The files don't become
+ * sparse: the filesystem may still zero the skipped regions that precede
+ * written data.  Smaller files, such as the ones that boot loaders read with
+ * their own filesystem drivers, are always written in full.  The number of
+ * bytes that were skipped is reported in
+ * ::wimlib_progress_info.extract.skipped_zero_bytes.
+ */
+#define WIMLIB_EXTRACT_FLAG_SKIP_ZEROES			0x10000000
+
 /** @} */
 /** @addtogroup G_mounting_wim_images
  * @{ */
@@ -3242,6 +3267,84 @@ out:
 }
 #endif
 
+/**
+ * @ingroup G_extracting_wims
+ *
+ * Extract the contents of a single regular file from a WIM image to a file
+ * descriptor, without creating the file or its parent directories in the
+ * filesystem.  Only the chunks of the resource that contain the data of the
+ * file are read and decompressed, and the ::WIMStruct can be reused for more
+ * extractions afterwards.
+ *
+ * @param wim
+ *	A ::WIMStruct for the WIM file.
+ * @param image
+ *	The 1-based index of the image from which to extract the file.
+ * @param path
+ *	The path of the file in the image, in the same format as the paths
+ *	accepted by wimlib_extract_paths().  Wildcards are not supported.
+ * @param fd
+ *	The file descriptor to which to write the contents of the file, at its
+ *	current position.
+ * @param extract_flags
+ *	0 or ::WIMLIB_EXTRACT_FLAG_RECOVER_DATA.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.
+ *
+ * @retval ::WIMLIB_ERR_NOT_A_REGULAR_FILE
+ *	@p path does not name a regular file.
+ * @retval ::WIMLIB_ERR_PATH_DOES_NOT_EXIST
+ *	@p path does not exist in the image.
+ */
+WIMLIBAPI int
+wimlib_extract_file_to_fd(WIMStruct *wim, int image,
+			  const wimlib_tchar *path, int fd, int extract_flags);
+
+/**
+ * @ingroup G_extracting_wims
+ *
+ * Similar to wimlib_extract_file_to_fd(), but extract the contents of the file
+ * to an in-memory buffer.
+ *
+ * @param buf_ret
+ *	On success, a pointer to an allocated buffer containing the contents of
+ *	the file, or @c NULL if the file is empty, is written to this location.
+ *	The buffer must be freed with free().
+ * @param size_ret
+ *	On success, the size of the file in bytes is written to this location.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure, including
+ * ::WIMLIB_ERR_INVALID_RESOURCE_HASH if the data of the file is corrupted.
+ */
+WIMLIBAPI int
+wimlib_extract_file_to_buffer(WIMStruct *wim, int image,
+			      const wimlib_tchar *path,
+			      void **buf_ret, size_t *size_ret);
+
+#ifdef _RUFUS
+static __inline int
+wimlib_extract_file_to_fdU(WIMStruct* wim, int image, const char* path,
+	int fd, int extract_flags)
+{
+	int r;
+	wconvert(path);
+	r = wimlib_extract_file_to_fd(wim, image, wpath, fd, extract_flags);
+	wfree(path);
+	return r;
+}
+
+static __inline int
+wimlib_extract_file_to_bufferU(WIMStruct* wim, int image, const char* path,
+	void** buf_ret, size_t* size_ret)
+{
+	int r;
+	wconvert(path);
+	r = wimlib_extract_file_to_buffer(wim, image, wpath, buf_ret, size_ret);
+	wfree(path);
+	return r;
+}
+#endif
+
 /**
  * @ingroup G_wim_information
  *
@@ -4306,6 +4409,60 @@ wimlib_set_output_chunk_size(WIMStruct *wim, uint32_t chunk_size);
 WIMLIBAPI int
 wimlib_set_output_pack_chunk_size(WIMStruct *wim, uint32_t chunk_size);
 
+/**
+ * @ingroup G_extracting_wims
+ *
+ * Set how compressed resources of a ::WIMStruct are decompressed when they
+ * are read.  Large compressed resources are decompressed by several threads,
+ * while chunks are still delivered in order.
+ *
+ * @param wim
+ *	The ::WIMStruct for which to set the decompression parameters.
+ * @param num_threads
+ *	The number of threads to use for decompressing data, or 0 to use a
+ *	number of threads equal to the number of available processors.  1
+ *	disables parallel decompression.
+ * @param max_memory
+ *	The maximum memory, in bytes, for the chunks that are being read and
+ *	decompressed ahead of the consumer, or 0 to use a quarter of the
+ *	physical memory.  The number of threads is reduced if needed.
+ */
+WIMLIBAPI void
+wimlib_set_decompression_params(WIMStruct *wim, unsigned num_threads,
+				uint64_t max_memory);
+
+/**
+ * @ingroup G_extracting_wims
+ *
+ * Set the size of the process-wide cache of decompressed chunks of solid
+ * resources.  Solid resources, such as the ones of ESD files, typically use
+ * chunks that are many megabytes in size, so that reading even a small file
+ * from them requires decompressing a lot of data.  With the cache enabled, the
+ * decompressed chunks are kept in memory and reused by later reads, including
+ * through other ::WIMStruct's opened on the same WIM file, or on a copy of it.
+ * As the cache is shared by all the threads of the process, it should only be
+ * enabled around the operations that benefit from it.
+ * The cache is not freed by wimlib_global_cleanup().
+ *
+ * @param max_size
+ *	The maximum number of bytes of decompressed data to keep in the cache,
+ *	or 0 to disable the cache.  Disabling the cache does not free the chunks
+ *	it contains, so that they can be reused once it is enabled again; use
+ *	wimlib_free_solid_cache() for that.  The cache is disabled by default.
+ */
+WIMLIBAPI void
+wimlib_set_solid_cache_size(uint64_t max_size);
+
+/**
+ * @ingroup G_extracting_wims
+ *
+ * Free all the chunks held by the cache of decompressed chunks of solid
+ * resources.  This does not change the size set with
+ * wimlib_set_solid_cache_size().
+ */
+WIMLIBAPI void
+wimlib_free_solid_cache(void);
+
 /**
  * @ingroup G_writing_and_overwriting_wims
  *
@@ -143,6 +143,19 @@ report_apply_error(struct apply_ctx *ctx, int error_code, const tchar *path)
 bool
 detect_sparse_region(const void *data, size_t size, size_t *len_ret);
 
+/* Minimum size of the blobs which are written like sparse files with
+ * WIMLIB_EXTRACT_FLAG_SKIP_ZEROES  */
+#define SKIP_ZEROES_MIN_SIZE	((u64)256 << 20)
+
+/* Should the zero regions of a blob of size @size be skipped even when it is
+ * extracted to a non-sparse file?  */
+static inline bool
+should_skip_zeroes(const struct apply_ctx *ctx, u64 size)
+{
+	return (ctx->extract_flags & WIMLIB_EXTRACT_FLAG_SKIP_ZEROES) &&
+		size >= SKIP_ZEROES_MIN_SIZE;
+}
+
 static inline bool
 maybe_detect_sparse_region(const void *data, size_t size, size_t *len_ret,
 			   bool enabled)
@@ -65,9 +65,6 @@ struct blob_extraction_target {
  */
 struct blob_descriptor {
 
-	/* List node for a hash bucket of the blob table  */
-	struct hlist_node hash_list;
-
 	/*
 	 * Uncompressed size of this blob.
 	 *
@@ -305,7 +302,7 @@ blob_release_location(struct blob_descriptor *blob);
 void
 free_blob_descriptor(struct blob_descriptor *blob);
 
-void
+int
 blob_table_insert(struct blob_table *table, struct blob_descriptor *blob);
 
 void
@@ -0,0 +1,92 @@
+/*
+ * chunk_decompressor.h
+ *
+ * Interface for parallel chunk decompression.
+ */
+
+#ifndef _WIMLIB_CHUNK_DECOMPRESSOR_H
+#define _WIMLIB_CHUNK_DECOMPRESSOR_H
+
+#include "wimlib/types.h"
+
+struct wimlib_decompressor;
+
+/* Interface for chunk decompression.  The reader submits the compressed
+ * chunks of a resource, which are decompressed asynchronously by other
+ * threads, then retrieves the uncompressed chunks later, in the same order in
+ * which they were submitted.  The serial case is handled directly by
+ * read_compressed_wim_resource().  */
+struct parallel_chunk_decompressor;
+
+/* Functions that create and free a parallel chunk decompressor.
+ * new_parallel_chunk_decompressor() returns a negative value if parallel
+ * decompression is not possible or not worthwhile with the given
+ * parameters.  */
+int
+new_parallel_chunk_decompressor(int ctype, u32 chunk_size,
+				unsigned num_threads, u64 max_memory,
+				struct parallel_chunk_decompressor **decompressor_ret);
+
+void
+free_parallel_chunk_decompressor(struct parallel_chunk_decompressor *ctx);
+
+/* Get the compression type and maximum chunk size the parallel chunk
+ * decompressor was created for.  */
+int
+parallel_chunk_decompressor_ctype(const struct parallel_chunk_decompressor *ctx);
+
+u32
+parallel_chunk_decompressor_chunk_size(const struct parallel_chunk_decompressor *ctx);
+
+/* Set whether chunks that fail to decompress should be returned with whatever
+ * data could be recovered, rather than as an error.  This must only be called
+ * while no chunks are being decompressed.  */
+void
+parallel_chunk_decompressor_set_recover_data(struct parallel_chunk_decompressor *ctx,
+					     bool recover_data);
+
+/* Try to borrow a buffer into which the @csize bytes of compressed data for
+ * the next chunk, which uncompresses to @usize bytes, should be read.  @tag is
+ * an arbitrary value that is returned along with the uncompressed data.
+ *
+ * Only one buffer can be borrowed at a time.
+ *
+ * Returns a pointer to the buffer, or NULL if no buffer is available.  If no
+ * buffer is available, you must call
+ * parallel_chunk_decompressor_get_result() to retrieve an uncompressed chunk
+ * before trying again.  */
+void *
+parallel_chunk_decompressor_get_chunk_buffer(struct parallel_chunk_decompressor *ctx,
+					     u32 csize, u32 usize, u64 tag);
+
+/* Signals to the chunk decompressor that the buffer which was loaned out from
+ * parallel_chunk_decompressor_get_chunk_buffer() has been filled.  */
+void
+parallel_chunk_decompressor_signal_chunk_filled(struct parallel_chunk_decompressor *ctx);
+
+/* Get the next chunk of uncompressed data.
+ *
+ * The uncompressed data, along with its size and tag, are returned in the
+ * locations pointed to by arguments 2-4, and the decompression status (0 or
+ * WIMLIB_ERR_DECOMPRESSION) in the location pointed to by argument 5.  The
+ * data is in storage internal to the chunk decompressor, and it cannot be
+ * accessed beyond any subsequent calls to the chunk decompressor.
+ *
+ * The return value is %true if a chunk was successfully retrieved, or %false
+ * if there are no chunks currently being decompressed.  */
+bool
+parallel_chunk_decompressor_get_result(struct parallel_chunk_decompressor *ctx,
+				       const void **udata_ret, u32 *usize_ret,
+				       u64 *tag_ret, int *status_ret);
+
+/* Discard all the chunks that were submitted and not retrieved yet, so that
+ * the chunk decompressor can be reused for another resource.  */
+void
+parallel_chunk_decompressor_reset(struct parallel_chunk_decompressor *ctx);
+
+/* Decompress a single chunk, honoring data recovery mode.  */
+int
+decompress_chunk(const void *cbuf, u32 chunk_csize, u8 *ubuf, u32 chunk_usize,
+		 struct wimlib_decompressor *decompressor, bool recover_data);
+
+#endif /* _WIMLIB_CHUNK_DECOMPRESSOR_H */
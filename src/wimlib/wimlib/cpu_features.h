@@ -9,6 +9,7 @@
 #define X86_CPU_FEATURE_AVX		0x00000008
 #define X86_CPU_FEATURE_BMI2		0x00000010
 #define X86_CPU_FEATURE_SHA		0x00000020
+#define X86_CPU_FEATURE_AVX2		0x00000040
 
 #define ARM_CPU_FEATURE_SHA1		0x00000001
 
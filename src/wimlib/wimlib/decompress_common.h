@@ -36,6 +36,17 @@
 #include "wimlib/types.h"
 #include "wimlib/unaligned.h"
 
+/* LZ_COPY_BASELINE limits lz_copy() to the word copies of 'offset >= WORDBYTES'
+ * and 'offset == 1' matches, for the decompression benchmark of tests/.  */
+#if defined(LZ_COPY_BASELINE)
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define HAVE_COPY_16_UNALIGNED
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#  include <arm_neon.h>
+#  define HAVE_COPY_16_UNALIGNED
+#endif
+
 /******************************************************************************/
 /*                   Input bitstream for XPRESS and LZX                       */
 /*----------------------------------------------------------------------------*/
@@ -428,6 +439,20 @@ copy_word_unaligned(const void *src, void *dst)
 	store_word_unaligned(load_word_unaligned(src), dst);
 }
 
+#ifdef HAVE_COPY_16_UNALIGNED
+/* Copy 16 bytes at once, using the SIMD registers that are always available on
+ * the target (SSE2 on x86_64, NEON on arm64).  */
+static forceinline void
+copy_16_unaligned(const void *src, void *dst)
+{
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86)
+	_mm_storeu_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+#else
+	vst1q_u8((u8 *)dst, vld1q_u8((const u8 *)src));
+#endif
+}
+#endif
+
 static forceinline machine_word_t
 repeat_u16(u16 b)
 {
@@ -507,6 +532,19 @@ lz_copy(u32 length, u32 offset, u8 *out_begin, u8 *out_next, u8 *out_end,
 	 */
 	if (UNALIGNED_ACCESS_IS_FAST && likely(out_end - end >= WORDBYTES - 1))
 	{
+	#ifdef HAVE_COPY_16_UNALIGNED
+		/* Long, non-overlapping matches are best copied a vector at a
+		 * time, provided that there's room for the overrun.  */
+		if (offset >= 16 && length > 2 * WORDBYTES &&
+		    likely(out_end - end >= 15)) {
+			do {
+				copy_16_unaligned(src, out_next);
+				src += 16;
+				out_next += 16;
+			} while (out_next < end);
+			return 0;
+		}
+	#endif
 		if (offset >= WORDBYTES) {
 			/* The source and destination words don't overlap. */
 			do {
@@ -527,15 +565,37 @@ lz_copy(u32 length, u32 offset, u8 *out_begin, u8 *out_next, u8 *out_end,
 			} while (out_next < end);
 			return 0;
 		}
-		/*
-		 * We don't bother with special cases for other 'offset <
-		 * WORDBYTES', which are usually rarer than 'offset == 1'.
-		 * Extra checks will just slow things down.  Actually, it's
-		 * possible to handle all the 'offset < WORDBYTES' cases using
-		 * the same code, but it still becomes more complicated doesn't
-		 * seem any faster overall; it definitely slows down the more
-		 * common 'offset == 1' case.
-		 */
+	#ifndef LZ_COPY_BASELINE
+		else if (length >= 2 * WORDBYTES) {
+			/*
+			 * Other 'offset < WORDBYTES' matches are periodic with
+			 * period 'offset', so they are also periodic with the
+			 * smallest multiple of 'offset' that is at least
+			 * WORDBYTES.  Copy bytewise until that much of the
+			 * period is available, then copy words from that
+			 * distance, which don't overlap anymore.  This is
+			 * only worth it for longer matches, and it is kept
+			 * after the 'offset == 1' case so as not to slow it
+			 * down.
+			 */
+			u32 period = offset;
+			const u8 *stop;
+
+			while (period < WORDBYTES)
+				period += offset;
+			stop = out_next + (period - offset);
+			do {
+				*out_next++ = *src++;
+			} while (out_next != stop);
+			src = out_next - period;
+			do {
+				copy_word_unaligned(src, out_next);
+				src += WORDBYTES;
+				out_next += WORDBYTES;
+			} while (out_next < end);
+			return 0;
+		}
+	#endif
 	}
 
 	/* Fall back to a bytewise copy.  */
@@ -7,6 +7,7 @@
 #include "wimlib/inode.h"
 #include "wimlib/list.h"
 #include "wimlib/types.h"
+#include "wimlib/util.h"
 
 struct wim_inode;
 struct blob_table;
@@ -51,14 +52,23 @@ struct wim_dentry {
 	 * its inode (d_inode) */
 	struct hlist_node d_alias_node;
 
-	/* Pointer to the UTF-16LE filename (malloc()ed buffer), or NULL if this
-	 * dentry has no filename.  */
+	/* Pointer to the UTF-16LE filename, or NULL if this dentry has no
+	 * filename.  This is either a malloc()ed buffer or, for dentries read
+	 * from a metadata resource, part of the dentry's own allocation (see
+	 * dentry_name_is_embedded()).  */
 	utf16lechar *d_name;
 
-	/* Pointer to the UTF-16LE short filename (malloc()ed buffer), or NULL
-	 * if this dentry has no short name.  */
+	/* Pointer to the UTF-16LE short filename, or NULL if this dentry has
+	 * no short name.  Allocated the same way as 'd_name'.  */
 	utf16lechar *d_short_name;
 
+	/* Number of bytes allocated right after this structure to hold the
+	 * names that were read along with the dentry.  Storing these names in
+	 * the same allocation saves two heap allocations per file, which adds
+	 * up to a lot of memory for images that contain hundreds of thousands
+	 * of files.  */
+	u32 d_embedded_names_nbytes;
+
 	/* Length of 'd_name' in bytes, excluding the terminating null  */
 	u16 d_name_nbytes;
 
@@ -277,4 +287,24 @@ dentry_has_short_name(const struct wim_dentry *dentry)
 	return dentry->d_short_name_nbytes != 0;
 }
 
+/* Return true if @name, which is or was a name of @dentry, is stored in the
+ * same allocation as @dentry rather than in its own buffer.  */
+static inline bool
+dentry_name_is_embedded(const struct wim_dentry *dentry,
+			const utf16lechar *name)
+{
+	const u8 *start = (const u8 *)(dentry + 1);
+
+	return (const u8 *)name >= start &&
+	       (const u8 *)name < start + dentry->d_embedded_names_nbytes;
+}
+
+/* Free @name, which is or was a name of @dentry, unless it is embedded.  */
+static inline void
+dentry_free_name(const struct wim_dentry *dentry, utf16lechar *name)
+{
+	if (!dentry_name_is_embedded(dentry, name))
+		FREE(name);
+}
+
 #endif /* _WIMLIB_DENTRY_H */
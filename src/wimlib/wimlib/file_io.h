@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -52,6 +53,7 @@ full_pwrite(struct filedes *fd, const void *buf, size_t count, off_t offset);
 
 #ifndef _WIN32
 #  define O_BINARY 0
+#  define _lseeki64 lseek
 #endif
 
 off_t
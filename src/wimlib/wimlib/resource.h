@@ -238,6 +238,13 @@ struct read_blob_callbacks {
 	 * success, or a positive wimlib error code on failure.  */
 	int (*end_blob)(struct blob_descriptor *blob, int status, void *ctx);
 
+	/* Called when a blob whose SHA-1 message digest was verified on another
+	 * thread turned out to be corrupted, in data recovery mode.  This can
+	 * be after end_blob() was called for the blob, but it is always before
+	 * read_blob_list() returns.  Must return 0 on success, or a positive
+	 * wimlib error code on failure.  */
+	int (*corrupted_blob)(struct blob_descriptor *blob, void *ctx);
+
 	/* Parameter passed to each of the callback functions.  */
 	void *ctx;
 };
@@ -278,6 +285,7 @@ call_end_blob(struct blob_descriptor *blob, int status,
 #define COMPUTE_MISSING_BLOB_HASHES	0x2
 #define BLOB_LIST_ALREADY_SORTED	0x4
 #define RECOVER_DATA			0x8
+#define PARALLEL_VERIFY_BLOB_HASHES	0x10
 
 int
 read_blob_list(struct list_head *blob_list, size_t list_head_offset,
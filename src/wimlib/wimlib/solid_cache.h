@@ -0,0 +1,50 @@
+/*
+ * solid_cache.h
+ *
+ * Cache of decompressed chunks of solid resources.
+ */
+
+#ifndef _WIMLIB_SOLID_CACHE_H
+#define _WIMLIB_SOLID_CACHE_H
+
+#include "wimlib/guid.h"
+#include "wimlib/types.h"
+
+struct wim_resource_descriptor;
+
+/* A decompressed chunk of a solid resource.  Solid resources usually have
+ * chunks which are many megabytes in size, so even reading a small file from
+ * one means decompressing a lot of data.  The chunks are kept in a
+ * process-wide cache, which is keyed by the GUID of the WIM rather than by the
+ * WIMStruct, so that opening the same WIM again, or another copy of it, can
+ * reuse the chunks that were already decompressed.  */
+struct solid_cache_chunk;
+
+/* Return whether the cache is enabled with wimlib_set_solid_cache_size().  */
+bool
+solid_cache_enabled(void);
+
+/* Look up the chunk @chunk_idx of the solid resource @rdesc, which has size
+ * @size.  If found, the chunk is returned with a reference held on it, which
+ * must be released with solid_cache_put(), and its data is returned in
+ * *@data_ret.  */
+struct solid_cache_chunk *
+solid_cache_get(const struct wim_resource_descriptor *rdesc, u64 chunk_idx,
+		u32 size, const u8 **data_ret);
+
+void
+solid_cache_put(struct solid_cache_chunk *chunk);
+
+/* Add a copy of the chunk @chunk_idx of the solid resource @rdesc to the
+ * cache, evicting the least recently used chunks if needed.  Failures are
+ * ignored, as the chunk can always be decompressed again.  */
+void
+solid_cache_insert(const struct wim_resource_descriptor *rdesc, u64 chunk_idx,
+		   const void *data, u32 size);
+
+/* Drop all the cached chunks of the WIM with the given GUID, because it is
+ * being rewritten.  */
+void
+solid_cache_invalidate(const u8 guid[GUID_SIZE]);
+
+#endif /* _WIMLIB_SOLID_CACHE_H */
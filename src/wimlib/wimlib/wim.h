@@ -113,6 +113,13 @@ struct WIMStruct {
 	u8 decompressor_ctype;
 	u32 decompressor_max_block_size;
 
+	/* The cached parallel chunk decompressor for this WIM file, or NULL if
+	 * none is cached yet, along with the number of threads and the memory
+	 * window it can use, as set by wimlib_set_decompression_params().  */
+	struct parallel_chunk_decompressor *parallel_decompressor;
+	unsigned decompression_num_threads;
+	u64 decompression_max_memory;
+
 	/* Temporary field; use sparingly  */
 	void *private;
 
@@ -0,0 +1,92 @@
+/*
+ * write_behind.h
+ *
+ * Interface for writing extracted blob data on background threads.
+ */
+
+#ifndef _WIMLIB_WRITE_BEHIND_H
+#define _WIMLIB_WRITE_BEHIND_H
+
+#include "wimlib/types.h"
+
+/* Maximum number of file writer threads  */
+#define WRITE_BEHIND_MAX_THREADS	4
+
+/* Default maximum number of bytes of blob data queued for writing  */
+#define WRITE_BEHIND_DEFAULT_QUEUE_SIZE	(32 << 20)
+
+/* Operations that an extraction backend provides to write to, and close, the
+ * files that it opened.  @file is an opaque value owned by the backend (e.g. a
+ * HANDLE or a file descriptor).  Both functions are called from writer threads
+ * and must therefore not touch any per-extraction state which isn't protected.
+ * They return 0 or a positive wimlib error code.  */
+struct write_behind_ops {
+
+	/* Write @size bytes of @data at @offset in @file.  */
+	int (*write_file)(void *file, const void *data, size_t size,
+			  u64 offset);
+
+	/* Close @file once all the data of the blob, which has size @size,
+	 * has been written to it.  If @sparse is set, the zero regions of the
+	 * blob were skipped and the file must be extended to @size.  If
+	 * @status is nonzero, writing the blob failed and the file must only
+	 * be closed.  */
+	int (*close_file)(void *file, u64 size, bool sparse, int status);
+};
+
+/* A write-behind stage.  The extraction thread hands over the files it opened
+ * for a blob, then passes the uncompressed chunks of the blob, which are
+ * copied into a bounded queue and written to all the files by a pool of writer
+ * threads.  The files are closed by the writer threads as soon as all their
+ * data has been written, so that the extraction thread can go on with the
+ * next blob right away.  */
+struct write_behind;
+
+/* Create a write-behind stage.  @num_threads, @max_queued_bytes and
+ * @max_open_files may be 0 to select defaults.  The number of files that may
+ * be open at any time is only a soft limit: it can be exceeded by the files
+ * of a single blob.  */
+int
+new_write_behind(const struct write_behind_ops *ops, unsigned num_threads,
+		 size_t max_queued_bytes, unsigned max_open_files,
+		 struct write_behind **wb_ret);
+
+/* Wait for all queued writes, close all files and free the write-behind
+ * stage.  */
+void
+free_write_behind(struct write_behind *wb);
+
+/* Start handing over a blob of size @size which will be written to at most
+ * @max_files files.  This may block until enough files have been closed.  */
+int
+write_behind_begin_blob(struct write_behind *wb, u64 size, unsigned max_files);
+
+/* Hand over a file which the current blob must be written to.  */
+void
+write_behind_add_file(struct write_behind *wb, void *file, bool sparse);
+
+/* Queue the chunk of data @chunk of the current blob, which must be written at
+ * @offset.  This may block until enough of the queued data has been
+ * written.  */
+int
+write_behind_write(struct write_behind *wb, const void *chunk, size_t size,
+		   u64 offset);
+
+/* Stop handing over the current blob.  If @status is nonzero, the remaining
+ * data of the blob is not written.  The files of the blob are closed once all
+ * its queued data has been written.  */
+int
+write_behind_end_blob(struct write_behind *wb, int status);
+
+/* Wait until all the queued data has been written and all the files have been
+ * closed.  Return the first error that occurred, if any.  */
+int
+write_behind_flush(struct write_behind *wb);
+
+/* Return the number of trailing zero bytes of the sparse files that were never
+ * written, but left for the filesystem to extend the files with.  Call this
+ * after write_behind_flush().  */
+u64
+write_behind_skipped_bytes(struct write_behind *wb);
+
+#endif /* _WIMLIB_WRITE_BEHIND_H */
@@ -42,6 +42,7 @@
 #include "wimlib/textfile.h"
 #include "wimlib/wimboot.h"
 #include "wimlib/wof.h"
+#include "wimlib/write_behind.h"
 #include "wimlib/xattr.h"
 #include "wimlib/xml.h"
 
@@ -133,6 +134,15 @@ struct win32_apply_ctx {
 	/* Whether is_sparse_stream[] is true for any currently open stream  */
 	bool any_sparse_streams;
 
+	/* End of the last nonzero region of the current blob that was written
+	 * to the sparse streams.  The zeroes past it are never written.  */
+	u64 sparse_data_end;
+
+	/* If not NULL, the open handles are handed over to this write-behind
+	 * stage once the blob has started, and the blob data is written, and
+	 * the handles closed, by its writer threads.  */
+	struct write_behind *write_behind;
+
 	/* List of dentries, joined by @d_tmp_list, that need to have reparse
 	 * data extracted as soon as the whole blob has been read into
 	 * @data_buffer.  */
@@ -2101,6 +2111,13 @@ begin_extract_blob_instance(const struct blob_descriptor *blob,
 			{ .AllocationSize = { .QuadPart = blob->size }};
 		NtSetInformationFile(h, &ctx->iosb, &info, sizeof(info),
 				     FileAllocationInformation);
+
+		/* With WIMLIB_EXTRACT_FLAG_SKIP_ZEROES, write the stream like
+		 * a sparse one, but without setting the sparse flag.  */
+		if (should_skip_zeroes(&ctx->common, blob->size)) {
+			ctx->is_sparse_stream[ctx->num_open_handles] = true;
+			ctx->any_sparse_streams = true;
+		}
 	}
 	ctx->open_handles[ctx->num_open_handles++] = h;
 	return 0;
@@ -2343,9 +2360,18 @@ win32_begin_extract_blob(struct blob_descriptor *blob, void *_ctx)
 	ctx->num_open_handles = 0;
 	ctx->data_buffer_ptr = NULL;
 	ctx->any_sparse_streams = false;
+	ctx->sparse_data_end = 0;
 	INIT_LIST_HEAD(&ctx->reparse_dentries);
 	INIT_LIST_HEAD(&ctx->encrypted_dentries);
 
+	if (ctx->write_behind) {
+		ret = write_behind_begin_blob(ctx->write_behind, blob->size,
+					      ctx->common.supported_features.hard_links ?
+					      blob->out_refcnt : MAX_OPEN_FILES);
+		if (ret)
+			return ret;
+	}
+
 	for (u32 i = 0; i < blob->out_refcnt; i++) {
 		const struct wim_inode *inode = targets[i].inode;
 		const struct wim_inode_stream *strm = targets[i].stream;
@@ -2371,10 +2397,20 @@ win32_begin_extract_blob(struct blob_descriptor *blob, void *_ctx)
 		}
 	}
 
+	if (ctx->write_behind) {
+		for (unsigned i = 0; i < ctx->num_open_handles; i++)
+			write_behind_add_file(ctx->write_behind,
+					      ctx->open_handles[i],
+					      ctx->is_sparse_stream[i]);
+		ctx->num_open_handles = 0;
+	}
+
 	return 0;
 
 fail:
 	close_handles(ctx);
+	if (ctx->write_behind)
+		write_behind_end_blob(ctx->write_behind, ret);
 	return ret;
 }
 
@@ -2416,6 +2452,13 @@ win32_extract_chunk(const struct blob_descriptor *blob, u64 offset,
 	unsigned i;
 	int ret;
 
+	if (ctx->write_behind) {
+		ret = write_behind_write(ctx->write_behind, chunk, size, offset);
+		if (ret)
+			return ret;
+		goto out;
+	}
+
 	/*
 	 * For sparse streams, only write nonzero regions.  This lets the
 	 * filesystem use holes to represent zero regions.
@@ -2423,6 +2466,8 @@ win32_extract_chunk(const struct blob_descriptor *blob, u64 offset,
 	for (p = (uintptr_t)chunk; p != end; p += len, offset += len) {
 		zeroes = maybe_detect_sparse_region((const void*)p, end - p, &len,
 						    ctx->any_sparse_streams);
+		if (!zeroes)
+			ctx->sparse_data_end = offset + len;
 		for (i = 0; i < ctx->num_open_handles; i++) {
 			if (!zeroes || !ctx->is_sparse_stream[i]) {
 				ret = pwrite_to_handle(ctx->open_handles[i],
@@ -2433,6 +2478,7 @@ win32_extract_chunk(const struct blob_descriptor *blob, u64 offset,
 		}
 	}
 
+out:
 	/* Copy the data chunk into the buffer (if needed)  */
 	if (ctx->data_buffer_ptr)
 		ctx->data_buffer_ptr = mempcpy(ctx->data_buffer_ptr,
@@ -2708,6 +2754,25 @@ handle_system_compression(struct blob_descriptor *blob, struct win32_apply_ctx *
 	}
 }
 
+/* Extend a sparse stream, of which only the nonzero regions were written, to
+ * its final size.  */
+static int
+extend_stream(HANDLE h, u64 size)
+{
+	FILE_END_OF_FILE_INFORMATION info = { .EndOfFile = { .QuadPart = size } };
+	IO_STATUS_BLOCK iosb;
+	NTSTATUS status;
+
+	status = NtSetInformationFile(h, &iosb, &info, sizeof(info),
+				      FileEndOfFileInformation);
+	if (!NT_SUCCESS(status)) {
+		winnt_error(status, L"Error writing data to "
+			    "target volume (while extending)");
+		return WIMLIB_ERR_WRITE;
+	}
+	return 0;
+}
+
 /* Called when a blob has been fully read for extraction */
 static int
 win32_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
@@ -2716,31 +2781,26 @@ win32_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 	int ret;
 	const struct wim_dentry *dentry;
 
-	/* Extend sparse streams to their final size. */
+	/* Extend sparse streams to their final size.  Only the trailing zeroes
+	 * are reported as skipped: the zero regions that precede written data
+	 * may still have been filled in by the filesystem.  */
 	if (ctx->any_sparse_streams && !status) {
 		for (unsigned i = 0; i < ctx->num_open_handles; i++) {
-			FILE_END_OF_FILE_INFORMATION info =
-				{ .EndOfFile = { .QuadPart = blob->size } };
-			NTSTATUS ntstatus;
-
 			if (!ctx->is_sparse_stream[i])
 				continue;
-
-			ntstatus = NtSetInformationFile(ctx->open_handles[i],
-							&ctx->iosb,
-							&info, sizeof(info),
-							FileEndOfFileInformation);
-			if (!NT_SUCCESS(ntstatus)) {
-				winnt_error(ntstatus, L"Error writing data to "
-					    "target volume (while extending)");
-				status = WIMLIB_ERR_WRITE;
+			status = extend_stream(ctx->open_handles[i], blob->size);
+			if (status)
 				break;
-			}
+			ctx->common.progress.extract.skipped_zero_bytes +=
+				blob->size - ctx->sparse_data_end;
 		}
 	}
 
 	close_handles(ctx);
 
+	if (ctx->write_behind)
+		status = write_behind_end_blob(ctx->write_behind, status);
+
 	if (status)
 		return status;
 
@@ -3281,6 +3341,29 @@ count_dentries(const struct list_head *dentry_list)
 	return count;
 }
 
+static int
+win32_write_behind_write(void *file, const void *data, size_t size,
+			 u64 offset)
+{
+	return pwrite_to_handle(file, data, size, offset);
+}
+
+static int
+win32_write_behind_close(void *file, u64 size, bool sparse, int status)
+{
+	int ret = 0;
+
+	if (sparse && !status)
+		ret = extend_stream(file, size);
+	NtClose(file);
+	return ret;
+}
+
+static const struct write_behind_ops win32_write_behind_ops = {
+	.write_file	= win32_write_behind_write,
+	.close_file	= win32_write_behind_close,
+};
+
 /* Extract files from a WIM image to a directory on Windows  */
 static int
 win32_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
@@ -3320,6 +3403,16 @@ win32_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 	if (ret)
 		goto out;
 
+	/* Write the blob data, and close the files, on other threads, so that
+	 * creating, extending and closing the files doesn't stall the reading
+	 * and decompression of the blobs.  System compression needs the data
+	 * of a file to be complete as soon as the blob has been read, so this
+	 * is only done for regular extractions.  If the writer threads can't
+	 * be started, the data is simply written synchronously.  */
+	if (!(ctx->common.extract_flags & COMPACT_FLAGS))
+		new_write_behind(&win32_write_behind_ops, 0, 0, 0,
+				 &ctx->write_behind);
+
 	struct read_blob_callbacks cbs = {
 		.begin_blob	= win32_begin_extract_blob,
 		.continue_blob	= win32_extract_chunk,
@@ -3327,6 +3420,11 @@ win32_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 		.ctx		= ctx,
 	};
 	ret = extract_blob_list(&ctx->common, &cbs);
+	if (!ret && ctx->write_behind) {
+		ret = write_behind_flush(ctx->write_behind);
+		ctx->common.progress.extract.skipped_zero_bytes +=
+			write_behind_skipped_bytes(ctx->write_behind);
+	}
 	if (ret)
 		goto out;
 
@@ -3350,6 +3448,7 @@ win32_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 
 	do_warnings(ctx);
 out:
+	free_write_behind(ctx->write_behind);
 	close_target_directory(ctx);
 	if (ctx->target_ntpath.Buffer)
 		HeapFree(GetProcessHeap(), 0, ctx->target_ntpath.Buffer);
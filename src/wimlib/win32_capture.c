@@ -1595,14 +1595,16 @@ try_to_use_wimboot_hash(HANDLE h, struct wim_inode *inode,
 	 * stream is sparse and contains all zeroes).  */
 	strm = inode_get_unnamed_data_stream(inode);
 	if (strm && (blob = stream_blob_resolved(strm))) {
-		struct blob_descriptor **back_ptr;
+		struct blob_descriptor **back_ptr, *new_blob;
 
 		if (reparse_strm && !lookup_blob(blob_table, hash))
 			return 0;
 		back_ptr = retrieve_pointer_to_unhashed_blob(blob);
 		copy_hash(blob->hash, hash);
-		if (after_blob_hashed(blob, back_ptr, blob_table,
-				      inode) != blob)
+		new_blob = after_blob_hashed(blob, back_ptr, blob_table, inode);
+		if (!new_blob)
+			return WIMLIB_ERR_NOMEM;
+		if (new_blob != blob)
 			free_blob_descriptor(blob);
 	}
 
@@ -52,6 +52,8 @@
 #include "wimlib/progress.h"
 #include "wimlib/resource.h"
 #include "wimlib/solid.h"
+#include "wimlib/solid_cache.h"
+#include "wimlib/threads.h"
 #include "wimlib/win32.h" /* win32_rename_replacement() */
 #include "wimlib/write.h"
 #include "wimlib/xml.h"
@@ -1103,9 +1105,11 @@ write_blob_end_read(struct blob_descriptor *blob, int status, void *_ctx)
 		 * Since we passed COMPUTE_MISSING_BLOB_HASHES to
 		 * read_blob_list(), blob->hash is now computed and valid.  So
 		 * turn this blob into a "hashed" blob.  */
-		list_del(&blob->unhashed_list);
-		blob_table_insert(ctx->blob_table, blob);
-		blob->unhashed = 0;
+		status = blob_table_insert(ctx->blob_table, blob);
+		if (!status) {
+			list_del(&blob->unhashed_list);
+			blob->unhashed = 0;
+		}
 	}
 	return status;
 }
@@ -1203,15 +1207,183 @@ find_raw_copy_blobs(struct list_head *blob_list, int write_resource_flags,
 	return num_nonraw_bytes;
 }
 
+/*
+ * Raw resources are copied through large buffers, which are handed over to a
+ * writer thread, so that reading the next resources from the source WIM (which
+ * may be located on a different device, such as an ISO image) overlaps with the
+ * writing of the previous ones. This matters when splitting a WIM, where all of
+ * the data is raw copied.
+ */
+#define RAW_COPY_BUFFER_SIZE	(8U << 20)
+
+struct raw_copy_ctx {
+	struct filedes *out_fd;
+
+	/* Offset that the next byte of buffered data will have in the output */
+	u64 out_offset;
+
+	u8 *bufs[2];
+	int cur_buf;
+	size_t fill;
+
+	/* Writer thread, and the buffer it is currently writing (if any)  */
+	bool have_thread;
+	bool terminate;
+	struct thread thread;
+	struct mutex lock;
+	struct condvar cond;
+	const u8 *pending_buf;
+	size_t pending_size;
+	int write_ret;
+};
+
+static void *
+raw_copy_writer_proc(void *arg)
+{
+	struct raw_copy_ctx *ctx = arg;
+	const u8 *buf;
+	size_t size;
+	int ret;
+
+	mutex_lock(&ctx->lock);
+	for (;;) {
+		while (!ctx->pending_buf && !ctx->terminate)
+			condvar_wait(&ctx->cond, &ctx->lock);
+		if (!ctx->pending_buf)
+			break;
+		buf = ctx->pending_buf;
+		size = ctx->pending_size;
+		ret = ctx->write_ret;
+		mutex_unlock(&ctx->lock);
+
+		if (!ret) {
+			ret = full_write(ctx->out_fd, buf, size);
+			if (ret)
+				ERROR_WITH_ERRNO("Error writing raw data "
+						 "to WIM file");
+		}
+
+		mutex_lock(&ctx->lock);
+		ctx->write_ret = ret;
+		ctx->pending_buf = NULL;
+		condvar_broadcast(&ctx->cond);
+	}
+	mutex_unlock(&ctx->lock);
+	return NULL;
+}
+
+/* Wait for the writer thread to be done with the buffer it is writing.  */
+static int
+raw_copy_wait(struct raw_copy_ctx *ctx)
+{
+	int ret;
+
+	if (!ctx->have_thread)
+		return 0;
+	mutex_lock(&ctx->lock);
+	while (ctx->pending_buf)
+		condvar_wait(&ctx->cond, &ctx->lock);
+	ret = ctx->write_ret;
+	mutex_unlock(&ctx->lock);
+	return ret;
+}
+
+/* Queue the current buffer for writing and switch to the other one.  */
+static int
+raw_copy_submit(struct raw_copy_ctx *ctx)
+{
+	int ret;
+
+	if (ctx->fill == 0)
+		return 0;
+
+	if (!ctx->have_thread) {
+		ret = full_write(ctx->out_fd, ctx->bufs[ctx->cur_buf], ctx->fill);
+		if (ret)
+			ERROR_WITH_ERRNO("Error writing raw data to WIM file");
+		ctx->fill = 0;
+		return ret;
+	}
+
+	ret = raw_copy_wait(ctx);
+	if (ret)
+		return ret;
+	mutex_lock(&ctx->lock);
+	ctx->pending_buf = ctx->bufs[ctx->cur_buf];
+	ctx->pending_size = ctx->fill;
+	condvar_broadcast(&ctx->cond);
+	mutex_unlock(&ctx->lock);
+	ctx->cur_buf ^= 1;
+	ctx->fill = 0;
+	return 0;
+}
+
+/* Write out all the buffered data.  */
+static int
+raw_copy_flush(struct raw_copy_ctx *ctx)
+{
+	int ret = raw_copy_submit(ctx);
+
+	if (ret)
+		return ret;
+	return raw_copy_wait(ctx);
+}
+
+static int
+raw_copy_init(struct raw_copy_ctx *ctx, struct filedes *out_fd)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->out_fd = out_fd;
+	ctx->out_offset = out_fd->offset;
+	ctx->bufs[0] = MALLOC(RAW_COPY_BUFFER_SIZE);
+	ctx->bufs[1] = MALLOC(RAW_COPY_BUFFER_SIZE);
+	if (!ctx->bufs[0] || !ctx->bufs[1]) {
+		FREE(ctx->bufs[0]);
+		FREE(ctx->bufs[1]);
+		return WIMLIB_ERR_NOMEM;
+	}
+
+	/* If we can't get a writer thread, just write synchronously.  */
+	if (!mutex_init(&ctx->lock))
+		return 0;
+	if (!condvar_init(&ctx->cond)) {
+		mutex_destroy(&ctx->lock);
+		return 0;
+	}
+	ctx->have_thread = thread_create(&ctx->thread, raw_copy_writer_proc, ctx);
+	if (!ctx->have_thread) {
+		condvar_destroy(&ctx->cond);
+		mutex_destroy(&ctx->lock);
+	}
+	return 0;
+}
+
+static void
+raw_copy_destroy(struct raw_copy_ctx *ctx)
+{
+	if (ctx->have_thread) {
+		mutex_lock(&ctx->lock);
+		while (ctx->pending_buf)
+			condvar_wait(&ctx->cond, &ctx->lock);
+		ctx->terminate = true;
+		condvar_broadcast(&ctx->cond);
+		mutex_unlock(&ctx->lock);
+		thread_join(&ctx->thread);
+		condvar_destroy(&ctx->cond);
+		mutex_destroy(&ctx->lock);
+	}
+	FREE(ctx->bufs[0]);
+	FREE(ctx->bufs[1]);
+}
+
 /* Copy a raw compressed resource located in another WIM file to the WIM file
  * being written.  */
 static int
 write_raw_copy_resource(struct wim_resource_descriptor *in_rdesc,
-			struct filedes *out_fd)
+			struct raw_copy_ctx *ctx)
 {
 	u64 cur_read_offset;
 	u64 end_read_offset;
-	u8 buf[BUFFER_SIZE];
 	size_t bytes_to_read;
 	int ret;
 	struct filedes *in_fd;
@@ -1222,7 +1394,7 @@ write_raw_copy_resource(struct wim_resource_descriptor *in_rdesc,
 	cur_read_offset = in_rdesc->offset_in_wim;
 	end_read_offset = cur_read_offset + in_rdesc->size_in_wim;
 
-	out_offset_in_wim = out_fd->offset;
+	out_offset_in_wim = ctx->out_offset;
 
 	if (in_rdesc->is_pipable) {
 		if (cur_read_offset < sizeof(struct pwm_blob_hdr))
@@ -1234,26 +1406,27 @@ write_raw_copy_resource(struct wim_resource_descriptor *in_rdesc,
 	wimlib_assert(cur_read_offset != end_read_offset);
 
 	if (likely(!in_rdesc->wim->being_compacted) ||
-	    in_rdesc->offset_in_wim > out_fd->offset) {
+	    in_rdesc->offset_in_wim > ctx->out_offset) {
 		do {
-			bytes_to_read = min(sizeof(buf),
+			if (ctx->fill == RAW_COPY_BUFFER_SIZE) {
+				ret = raw_copy_submit(ctx);
+				if (ret)
+					return ret;
+			}
+			bytes_to_read = min(RAW_COPY_BUFFER_SIZE - ctx->fill,
 					    end_read_offset - cur_read_offset);
 
-			ret = full_pread(in_fd, buf, bytes_to_read,
-					 cur_read_offset);
+			ret = full_pread(in_fd,
+					 &ctx->bufs[ctx->cur_buf][ctx->fill],
+					 bytes_to_read, cur_read_offset);
 			if (ret) {
 				ERROR_WITH_ERRNO("Error reading raw data "
 						 "from WIM file");
 				return ret;
 			}
 
-			ret = full_write(out_fd, buf, bytes_to_read);
-			if (ret) {
-				ERROR_WITH_ERRNO("Error writing raw data "
-						 "to WIM file");
-				return ret;
-			}
-
+			ctx->fill += bytes_to_read;
+			ctx->out_offset += bytes_to_read;
 			cur_read_offset += bytes_to_read;
 
 		} while (cur_read_offset != end_read_offset);
@@ -1264,10 +1437,14 @@ write_raw_copy_resource(struct wim_resource_descriptor *in_rdesc,
 
 		/* Due the earlier check for overlapping resources, it should
 		 * never be the case that we already overwrote the resource.  */
-		wimlib_assert(!(in_rdesc->offset_in_wim < out_fd->offset));
+		wimlib_assert(!(in_rdesc->offset_in_wim < ctx->out_offset));
 
-		if (-1 == filedes_seek(out_fd, out_fd->offset + in_rdesc->size_in_wim))
+		ret = raw_copy_flush(ctx);
+		if (ret)
+			return ret;
+		if (-1 == filedes_seek(ctx->out_fd, ctx->out_fd->offset + in_rdesc->size_in_wim))
 			return WIMLIB_ERR_WRITE;
+		ctx->out_offset = ctx->out_fd->offset;
 	}
 
 	list_for_each_entry(blob, &in_rdesc->blob_list, rdesc_node) {
@@ -1291,8 +1468,16 @@ write_raw_copy_resources(struct list_head *raw_copy_blobs,
 			 struct write_blobs_progress_data *progress_data)
 {
 	struct blob_descriptor *blob;
+	struct raw_copy_ctx ctx;
 	int ret;
 
+	if (list_empty(raw_copy_blobs))
+		return 0;
+
+	ret = raw_copy_init(&ctx, out_fd);
+	if (ret)
+		return ret;
+
 	list_for_each_entry(blob, raw_copy_blobs, write_blobs_list)
 		blob->rdesc->raw_copy_ok = 1;
 
@@ -1301,18 +1486,21 @@ write_raw_copy_resources(struct list_head *raw_copy_blobs,
 
 		if (blob->rdesc->raw_copy_ok) {
 			/* Write each solid resource only one time.  */
-			ret = write_raw_copy_resource(blob->rdesc, out_fd);
+			ret = write_raw_copy_resource(blob->rdesc, &ctx);
 			if (ret)
-				return ret;
+				goto out;
 			blob->rdesc->raw_copy_ok = 0;
 			compressed_size = blob->rdesc->size_in_wim;
 		}
 		ret = do_write_blobs_progress(progress_data, blob->size,
 					      compressed_size, 1, false);
 		if (ret)
-			return ret;
+			goto out;
 	}
-	return 0;
+	ret = raw_copy_flush(&ctx);
+out:
+	raw_copy_destroy(&ctx);
+	return ret;
 }
 
 /* Wait for and write all chunks pending in the compressor.  */
@@ -3365,6 +3553,10 @@ wimlib_overwrite(WIMStruct *wim, int write_flags, unsigned num_threads)
 	if (ret)
 		return ret;
 
+	/* Resources may be moved or rewritten, so the decompressed chunks of
+	 * this WIM's solid resources must not be reused.  */
+	solid_cache_invalidate(wim->hdr.guid);
+
 	if (can_overwrite_wim_inplace(wim, write_flags)) {
 		ret = overwrite_wim_inplace(wim, write_flags, num_threads);
 		if (ret != WIMLIB_ERR_RESOURCE_ORDER)
@@ -0,0 +1,457 @@
+/*
+ * write_behind.c
+ *
+ * Write extracted blob data on background threads.
+ */
+
+/*
+ * Copyright (C) 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <string.h>
+
+#include "wimlib.h"
+#include "wimlib/apply.h"
+#include "wimlib/assert.h"
+#include "wimlib/error.h"
+#include "wimlib/list.h"
+#include "wimlib/threads.h"
+#include "wimlib/util.h"
+#include "wimlib/write_behind.h"
+
+/* Default soft limit on the number of files open in the write-behind stage  */
+#define WRITE_BEHIND_DEFAULT_OPEN_FILES	256
+
+struct write_behind_blob;
+
+/* A chunk of blob data waiting to be written, or, if @size is 0, the marker
+ * that the extraction thread is done with the blob.  */
+struct write_behind_item {
+	struct list_head list;
+	struct write_behind_blob *blob;
+	u64 offset;
+	size_t size;
+	u8 *data;
+};
+
+/* A blob being written.  The blob holds one reference for the extraction
+ * thread, which is dropped through the end marker, plus one reference per
+ * queued chunk.  The files are closed when the last reference goes away.  */
+struct write_behind_blob {
+	struct write_behind_item end_item;
+	u64 size;
+	unsigned refcnt;
+	unsigned num_files;
+	unsigned max_files;
+	int status;
+	bool any_sparse;
+	/* End of the last nonzero region written to the sparse files  */
+	u64 sparse_data_end;
+	struct {
+		void *file;
+		bool sparse;
+	} files[];
+};
+
+struct write_behind {
+	const struct write_behind_ops *ops;
+
+	struct mutex lock;
+	struct condvar item_avail_cond;
+	struct condvar space_avail_cond;
+	struct list_head queue;
+	size_t queued_bytes;
+	size_t max_queued_bytes;
+	unsigned open_files;
+	unsigned max_open_files;
+	int status;
+	bool terminating;
+	u64 skipped_bytes;
+
+	/* Only accessed by the extraction thread  */
+	struct write_behind_blob *cur_blob;
+
+	struct thread threads[WRITE_BEHIND_MAX_THREADS];
+	unsigned num_started_threads;
+};
+
+static void
+set_status(int *status_p, int status)
+{
+	if (!*status_p)
+		*status_p = status;
+}
+
+/* Write a chunk to all the files of its blob.  For sparse files, the zero
+ * regions are skipped, and the end of the last nonzero region is returned in
+ * *@data_end_p.  */
+static int
+write_item(const struct write_behind *wb, const struct write_behind_item *item,
+	   u64 *data_end_p)
+{
+	const struct write_behind_blob *blob = item->blob;
+	const u8 *p = item->data;
+	const u8 * const end = p + item->size;
+	u64 offset = item->offset;
+	size_t len;
+	bool zeroes;
+	int ret;
+
+	for (; p != end; p += len, offset += len) {
+		zeroes = maybe_detect_sparse_region(p, end - p, &len,
+						    blob->any_sparse);
+		if (!zeroes)
+			*data_end_p = offset + len;
+		for (unsigned i = 0; i < blob->num_files; i++) {
+			if (zeroes && blob->files[i].sparse)
+				continue;
+			ret = wb->ops->write_file(blob->files[i].file,
+						  p, len, offset);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+/* Close the files of a blob which no longer has any reference.  Called with
+ * the lock not held.  */
+static int
+close_blob_files(const struct write_behind *wb,
+		 const struct write_behind_blob *blob)
+{
+	int status = 0;
+
+	for (unsigned i = 0; i < blob->num_files; i++) {
+		set_status(&status, wb->ops->close_file(blob->files[i].file,
+							blob->size,
+							blob->files[i].sparse,
+							blob->status));
+	}
+	return status;
+}
+
+/* Drop a reference to a blob.  Called with the lock held, which may be
+ * temporarily released to close the files of the blob.  */
+static void
+put_blob(struct write_behind *wb, struct write_behind_blob *blob)
+{
+	int ret;
+
+	if (--blob->refcnt)
+		return;
+	mutex_unlock(&wb->lock);
+	ret = close_blob_files(wb, blob);
+	mutex_lock(&wb->lock);
+	set_status(&wb->status, ret);
+	/* Only the trailing zeroes of the sparse files are never written: the
+	 * zero regions that precede written data may have been filled in.  */
+	if (!blob->status && !ret) {
+		for (unsigned i = 0; i < blob->num_files; i++)
+			if (blob->files[i].sparse)
+				wb->skipped_bytes += blob->size -
+						     blob->sparse_data_end;
+	}
+	wb->open_files -= blob->num_files;
+	condvar_broadcast(&wb->space_avail_cond);
+	FREE(blob);
+}
+
+static void *
+writer_thread_proc(void *arg)
+{
+	struct write_behind *wb = arg;
+	struct write_behind_item *item;
+	struct write_behind_blob *blob;
+	u64 data_end;
+	bool skip;
+	int ret;
+
+	mutex_lock(&wb->lock);
+	for (;;) {
+		while (list_empty(&wb->queue) && !wb->terminating)
+			condvar_wait(&wb->item_avail_cond, &wb->lock);
+		if (list_empty(&wb->queue))
+			break;
+		item = list_first_entry(&wb->queue, struct write_behind_item,
+					list);
+		list_del(&item->list);
+		blob = item->blob;
+		skip = (blob->status != 0);
+		mutex_unlock(&wb->lock);
+
+		ret = 0;
+		data_end = 0;
+		if (item->size && !skip)
+			ret = write_item(wb, item, &data_end);
+
+		mutex_lock(&wb->lock);
+		/* The chunks of a blob may be written out of order  */
+		blob->sparse_data_end = max(blob->sparse_data_end, data_end);
+		if (ret) {
+			set_status(&blob->status, ret);
+			set_status(&wb->status, ret);
+		}
+		if (item->size) {
+			wb->queued_bytes -= item->size;
+			condvar_broadcast(&wb->space_avail_cond);
+			FREE(item);
+		}
+		put_blob(wb, blob);
+	}
+	mutex_unlock(&wb->lock);
+	return NULL;
+}
+
+static void
+stop_writer_threads(struct write_behind *wb)
+{
+	mutex_lock(&wb->lock);
+	wb->terminating = true;
+	condvar_broadcast(&wb->item_avail_cond);
+	mutex_unlock(&wb->lock);
+
+	for (unsigned i = 0; i < wb->num_started_threads; i++)
+		thread_join(&wb->threads[i]);
+	wb->num_started_threads = 0;
+}
+
+int
+new_write_behind(const struct write_behind_ops *ops, unsigned num_threads,
+		 size_t max_queued_bytes, unsigned max_open_files,
+		 struct write_behind **wb_ret)
+{
+	struct write_behind *wb;
+
+	if (num_threads == 0)
+		num_threads = max(2U, min(get_available_cpus(),
+					  WRITE_BEHIND_MAX_THREADS));
+	num_threads = min(num_threads, WRITE_BEHIND_MAX_THREADS);
+	if (max_queued_bytes == 0)
+		max_queued_bytes = WRITE_BEHIND_DEFAULT_QUEUE_SIZE;
+	if (max_open_files == 0)
+		max_open_files = WRITE_BEHIND_DEFAULT_OPEN_FILES;
+
+	wb = CALLOC(1, sizeof(*wb));
+	if (!wb)
+		return WIMLIB_ERR_NOMEM;
+
+	wb->ops = ops;
+	wb->max_queued_bytes = max_queued_bytes;
+	wb->max_open_files = max_open_files;
+	INIT_LIST_HEAD(&wb->queue);
+
+	if (!mutex_init(&wb->lock))
+		goto err_free;
+	if (!condvar_init(&wb->item_avail_cond))
+		goto err_destroy_lock;
+	if (!condvar_init(&wb->space_avail_cond))
+		goto err_destroy_item_avail_cond;
+
+	for (unsigned i = 0; i < num_threads; i++) {
+		if (!thread_create(&wb->threads[i], writer_thread_proc, wb))
+			break;
+		wb->num_started_threads++;
+	}
+	if (wb->num_started_threads == 0)
+		goto err_destroy_space_avail_cond;
+
+	*wb_ret = wb;
+	return 0;
+
+err_destroy_space_avail_cond:
+	condvar_destroy(&wb->space_avail_cond);
+err_destroy_item_avail_cond:
+	condvar_destroy(&wb->item_avail_cond);
+err_destroy_lock:
+	mutex_destroy(&wb->lock);
+err_free:
+	FREE(wb);
+	return WIMLIB_ERR_NOMEM;
+}
+
+void
+free_write_behind(struct write_behind *wb)
+{
+	if (!wb)
+		return;
+
+	if (wb->cur_blob)
+		write_behind_end_blob(wb, WIMLIB_ERR_ABORTED_BY_PROGRESS);
+
+	/* The writer threads drain the queue before they terminate.  */
+	stop_writer_threads(wb);
+	wimlib_assert(wb->open_files == 0);
+
+	condvar_destroy(&wb->space_avail_cond);
+	condvar_destroy(&wb->item_avail_cond);
+	mutex_destroy(&wb->lock);
+	FREE(wb);
+}
+
+int
+write_behind_begin_blob(struct write_behind *wb, u64 size, unsigned max_files)
+{
+	struct write_behind_blob *blob;
+	int ret;
+
+	wimlib_assert(!wb->cur_blob);
+
+	mutex_lock(&wb->lock);
+	while (!wb->status && wb->open_files >= wb->max_open_files)
+		condvar_wait(&wb->space_avail_cond, &wb->lock);
+	ret = wb->status;
+	mutex_unlock(&wb->lock);
+	if (ret)
+		return ret;
+
+	blob = MALLOC(sizeof(*blob) + max_files * sizeof(blob->files[0]));
+	if (!blob)
+		return WIMLIB_ERR_NOMEM;
+	blob->end_item.blob = blob;
+	blob->end_item.offset = size;
+	blob->end_item.size = 0;
+	blob->end_item.data = NULL;
+	blob->size = size;
+	blob->refcnt = 1;
+	blob->num_files = 0;
+	blob->max_files = max_files;
+	blob->status = 0;
+	blob->any_sparse = false;
+	blob->sparse_data_end = 0;
+	wb->cur_blob = blob;
+	return 0;
+}
+
+void
+write_behind_add_file(struct write_behind *wb, void *file, bool sparse)
+{
+	struct write_behind_blob *blob = wb->cur_blob;
+
+	wimlib_assert(blob->num_files < blob->max_files);
+
+	blob->files[blob->num_files].file = file;
+	blob->files[blob->num_files].sparse = sparse;
+	blob->num_files++;
+	blob->any_sparse |= sparse;
+
+	mutex_lock(&wb->lock);
+	wb->open_files++;
+	mutex_unlock(&wb->lock);
+}
+
+int
+write_behind_write(struct write_behind *wb, const void *chunk, size_t size,
+		   u64 offset)
+{
+	struct write_behind_blob *blob = wb->cur_blob;
+	struct write_behind_item *item;
+	int ret;
+
+	if (!blob->num_files || !size)
+		return 0;
+
+	/* Reserve space in the queue first, so that the memory in use is
+	 * bounded.  A single chunk larger than the queue is still accepted
+	 * once the queue is empty.  */
+	mutex_lock(&wb->lock);
+	while (!wb->status && wb->queued_bytes != 0 &&
+	       wb->queued_bytes + size > wb->max_queued_bytes)
+		condvar_wait(&wb->space_avail_cond, &wb->lock);
+	ret = wb->status;
+	if (!ret)
+		wb->queued_bytes += size;
+	mutex_unlock(&wb->lock);
+	if (ret)
+		return ret;
+
+	item = MALLOC(sizeof(*item) + size);
+	if (!item) {
+		mutex_lock(&wb->lock);
+		wb->queued_bytes -= size;
+		condvar_broadcast(&wb->space_avail_cond);
+		mutex_unlock(&wb->lock);
+		return WIMLIB_ERR_NOMEM;
+	}
+	item->blob = blob;
+	item->offset = offset;
+	item->size = size;
+	item->data = (u8 *)(item + 1);
+	memcpy(item->data, chunk, size);
+
+	mutex_lock(&wb->lock);
+	blob->refcnt++;
+	list_add_tail(&item->list, &wb->queue);
+	condvar_signal(&wb->item_avail_cond);
+	mutex_unlock(&wb->lock);
+	return 0;
+}
+
+int
+write_behind_end_blob(struct write_behind *wb, int status)
+{
+	struct write_behind_blob *blob = wb->cur_blob;
+	int ret;
+
+	if (!blob)
+		return status;
+	wb->cur_blob = NULL;
+
+	mutex_lock(&wb->lock);
+	if (status)
+		set_status(&blob->status, status);
+	if (blob->num_files) {
+		/* Have a writer thread drop our reference, so that the files
+		 * get closed off the extraction thread.  */
+		list_add_tail(&blob->end_item.list, &wb->queue);
+		condvar_signal(&wb->item_avail_cond);
+	} else {
+		put_blob(wb, blob);
+	}
+	ret = wb->status;
+	mutex_unlock(&wb->lock);
+	return status ? status : ret;
+}
+
+int
+write_behind_flush(struct write_behind *wb)
+{
+	int ret;
+
+	wimlib_assert(!wb->cur_blob);
+
+	mutex_lock(&wb->lock);
+	while (wb->open_files != 0 || !list_empty(&wb->queue))
+		condvar_wait(&wb->space_avail_cond, &wb->lock);
+	ret = wb->status;
+	mutex_unlock(&wb->lock);
+	return ret;
+}
+
+u64
+write_behind_skipped_bytes(struct write_behind *wb)
+{
+	u64 skipped_bytes;
+
+	mutex_lock(&wb->lock);
+	skipped_bytes = wb->skipped_bytes;
+	mutex_unlock(&wb->lock);
+	return skipped_bytes;
+}
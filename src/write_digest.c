@@ -0,0 +1,123 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Digests of written data, for verification
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "write_digest.h"
+#include "bled/xxhash.h"
+
+int WriteDigestInit(write_digest_t* wd, uint32_t block_size)
+{
+	memset(wd, 0, sizeof(write_digest_t));
+	if (block_size == 0)
+		return 0;
+	wd->block_size = block_size;
+	wd->state = XXH64_createState();
+	if ((wd->state == NULL) || (XXH64_reset((XXH64_state_t*)wd->state, 0) != XXH_OK)) {
+		WriteDigestFree(wd);
+		return 0;
+	}
+	return 1;
+}
+
+void WriteDigestFree(write_digest_t* wd)
+{
+	if (wd->state != NULL)
+		XXH64_freeState((XXH64_state_t*)wd->state);
+	free(wd->digests);
+	memset(wd, 0, sizeof(write_digest_t));
+}
+
+static int PushDigest(write_digest_t* wd)
+{
+	uint64_t* digests;
+
+	if (wd->nb_digests >= wd->max_digests) {
+		digests = (uint64_t*)realloc(wd->digests, (size_t)(wd->max_digests + 4096) * sizeof(uint64_t));
+		if (digests == NULL)
+			return 0;
+		wd->digests = digests;
+		wd->max_digests += 4096;
+	}
+	wd->digests[wd->nb_digests++] = XXH64_digest((XXH64_state_t*)wd->state);
+	wd->fill = 0;
+	return (XXH64_reset((XXH64_state_t*)wd->state, 0) == XXH_OK);
+}
+
+/*
+ * Add data that was sequentially written to the target. Returns 0 on error,
+ * after which the digests can no longer be used for verification.
+ */
+int WriteDigestAdd(write_digest_t* wd, const void* buf, size_t size)
+{
+	const uint8_t* data = (const uint8_t*)buf;
+	size_t len;
+
+	if (wd->state == NULL)
+		return 0;
+	while (size > 0) {
+		len = wd->block_size - wd->fill;
+		if (len > size)
+			len = size;
+		if (XXH64_update((XXH64_state_t*)wd->state, data, len) != XXH_OK)
+			return 0;
+		wd->fill += (uint32_t)len;
+		wd->size += len;
+		data += len;
+		size -= len;
+		if ((wd->fill == wd->block_size) && !PushDigest(wd))
+			return 0;
+	}
+	return 1;
+}
+
+/* Record the digest of the trailing partial block, if any, once all the data was added */
+int WriteDigestEnd(write_digest_t* wd)
+{
+	if (wd->state == NULL)
+		return 0;
+	return (wd->fill == 0) || PushDigest(wd);
+}
+
+/*
+ * Compare 'size' bytes of data that were read back from 'offset' of the target with
+ * the digests. 'offset' must be a multiple of the block size, and 'size' too, unless
+ * the data extends to the end of what was written. Returns WRITE_DIGEST_MATCH if the
+ * data matches, or the offset of the first block that doesn't.
+ */
+int64_t WriteDigestCheck(const write_digest_t* wd, uint64_t offset, const void* buf, size_t size)
+{
+	const uint8_t* data = (const uint8_t*)buf;
+	uint64_t seq;
+	size_t pos, len;
+
+	if ((wd->block_size == 0) || (offset % wd->block_size != 0) || (offset + size > wd->size) ||
+		((size % wd->block_size != 0) && (offset + size != wd->size)))
+		return (int64_t)offset;
+	for (pos = 0; pos < size; pos += len) {
+		seq = (offset + pos) / wd->block_size;
+		len = wd->block_size;
+		if (len > size - pos)
+			len = size - pos;
+		if ((seq >= wd->nb_digests) || (XXH64(&data[pos], len, 0) != wd->digests[seq]))
+			return (int64_t)(offset + pos);
+	}
+	return WRITE_DIGEST_MATCH;
+}
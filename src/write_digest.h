@@ -0,0 +1,51 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Digests of written data, for verification
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#pragma once
+
+/*
+ * The digests of the data that is written to a target are recorded as the data goes
+ * by, so that the target can then be verified by reading its data back, without the
+ * source having to be read (or decompressed, or downloaded) a second time.
+ * One XXH64 digest is recorded for each 'block_size' bytes of the sequential stream
+ * of written data, plus one for the trailing partial block, if any, once the stream
+ * is ended. This code doesn't depend on the Windows API, so that it can be tested on
+ * other platforms (see tests/).
+ */
+
+#define WRITE_DIGEST_MATCH      (-1)
+
+typedef struct {
+	void*     state;			// XXH64 state for the block being recorded
+	uint64_t* digests;
+	uint64_t  nb_digests;
+	uint64_t  max_digests;
+	uint64_t  size;				// Size of the data recorded so far
+	uint32_t  block_size;		// Size of the data covered by each digest
+	uint32_t  fill;				// Size of the data recorded for the current block
+} write_digest_t;
+
+int WriteDigestInit(write_digest_t* wd, uint32_t block_size);
+void WriteDigestFree(write_digest_t* wd);
+int WriteDigestAdd(write_digest_t* wd, const void* buf, size_t size);
+int WriteDigestEnd(write_digest_t* wd);
+int64_t WriteDigestCheck(const write_digest_t* wd, uint64_t offset, const void* buf, size_t size);
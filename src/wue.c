@@ -486,6 +486,42 @@ static void PopulateWindowsVersionFromXml(const wchar_t* xml, size_t xml_len, in
 	ezxml_free(pxml);
 }
 
+/// <summary>
+/// Get the XML index of an install[.wim|.esd], from our WIM cache if we parsed this image before.
+/// </summary>
+/// <param name="wim_path">The path of the WIM, using the "<iso>|<path>" notation for a WIM in an ISO.</param>
+/// <param name="xml">Receives the allocated UTF-16 XML data, to be freed by the caller.</param>
+/// <param name="xml_len">Receives the length of the XML data in bytes.</param>
+/// <returns>0 on success, a wimlib error code otherwise.</returns>
+static int GetWimXmlData(const char* wim_path, wchar_t** xml, size_t* xml_len)
+{
+	int r;
+	WIMStruct* wim = NULL;
+	char cache_path[MAX_PATH];
+	BOOL use_cache = GetWimCachePath(wim_path, "index.xml", cache_path, sizeof(cache_path));
+
+	if (use_cache && PathFileExistsU(cache_path)) {
+		*xml_len = read_file(cache_path, (uint8_t**)xml);
+		if (*xml_len != 0)
+			return 0;
+	}
+
+	r = wimlib_open_wimU(wim_path, 0, &wim);
+	if (r != 0) {
+		uprintf("Could not open WIM: Error %d", r);
+		return r;
+	}
+	r = wimlib_get_xml_data(wim, (void**)xml, xml_len);
+	wimlib_free(wim);
+	if (r != 0) {
+		uprintf("Could not read WIM XML index: Error %d", r);
+		return r;
+	}
+	if (use_cache)
+		write_file(cache_path, (uint8_t*)*xml, (uint32_t)*xml_len);
+	return 0;
+}
+
 /// <summary>
 /// Populate the img_report Window version from an install[.wim|.esd].
 /// </summary>
@@ -493,41 +529,54 @@ static void PopulateWindowsVersionFromXml(const wchar_t* xml, size_t xml_len, in
 /// <returns>TRUE on success, FALSE if we couldn't populate the version.</returns>
 BOOL PopulateWindowsVersion(void)
 {
-	int r;
 	char wim_path[4 * MAX_PATH] = "";
 	wchar_t* xml = NULL;
 	size_t xml_len;
-	WIMStruct* wim = NULL;
 
 	memset(&img_report.win_version, 0, sizeof(img_report.win_version));
 
-	assert(safe_strlen(image_path) + 1 < ARRAYSIZE(wim_path));
-	static_strcpy(wim_path, image_path);
-	if (!img_report.is_windows_img) {
-		assert(safe_strlen(image_path) + safe_strlen(&img_report.wininst_path[0][3]) + 1 < ARRAYSIZE(wim_path));
-		static_strcat(wim_path, "|");
-		static_strcat(wim_path, &img_report.wininst_path[0][3]);
-	}
+	if (!GetWininstImagePath(0, wim_path, sizeof(wim_path)))
+		return FALSE;
 
-	r = wimlib_open_wimU(wim_path, 0, &wim);
-	if (r != 0) {
-		uprintf("Could not open WIM: Error %d", r);
+	if (GetWimXmlData(wim_path, &xml, &xml_len) == 0)
+		PopulateWindowsVersionFromXml(xml, xml_len, 0);
+	free(xml);
+
+	return ((img_report.win_version.major != 0) && (img_report.win_version.build != 0));
+}
+
+/// <summary>
+/// List the names of the Windows editions from the first install[.wim|.esd] of the current image.
+/// </summary>
+/// <param name="editions">The StrArray that receives the edition names.</param>
+/// <returns>The number of editions that were found.</returns>
+int GetWindowsEditions(StrArray* editions)
+{
+	char wim_path[4 * MAX_PATH] = "";
+	const char* name;
+	wchar_t* xml = NULL;
+	size_t xml_len;
+	ezxml_t index = NULL, image;
+
+	if (!GetWininstImagePath(0, wim_path, sizeof(wim_path)))
 		goto out;
-	}
 
-	r = wimlib_get_xml_data(wim, (void**)&xml, &xml_len);
-	if (r != 0) {
-		uprintf("Could not read WIM XML index: Error %d", r);
+	if (GetWimXmlData(wim_path, &xml, &xml_len) != 0)
+		goto out;
+	index = ezxml_parse_str((char*)xml, xml_len);
+	if (index == NULL)
 		goto out;
+	for (image = ezxml_child(index, "IMAGE"); image != NULL; image = image->next) {
+		name = ezxml_child_val(image, "DISPLAYNAME");
+		if (name == NULL || name[0] == 0)
+			name = ezxml_child_val(image, "DESCRIPTION");
+		StrArrayAdd(editions, (name == NULL || name[0] == 0) ? "Unknown Windows Version" : name, TRUE);
 	}
 
-	PopulateWindowsVersionFromXml(xml, xml_len, 0);
-
 out:
 	free(xml);
-	wimlib_free(wim);
-
-	return ((img_report.win_version.major != 0) && (img_report.win_version.build != 0));
+	ezxml_free(index);
+	return (int)editions->Index;
 }
 
 /// <summary>
@@ -538,10 +587,10 @@ out:
 /// <returns>-2 on user cancel, -1 on other error, >=0 on success.</returns>
 int SetWinToGoIndex(void)
 {
-	int i, r;
-	WIMStruct* wim = NULL;
+	int i;
 	char* install_names[MAX_WININST];
-	wchar_t wim_path[4 * MAX_PATH] = L"", *xml = NULL;
+	char wim_path[4 * MAX_PATH] = "";
+	wchar_t* xml = NULL;
 	size_t xml_len;
 	StrArray version_name = { 0 }, version_index = { 0 };
 	BOOL bNonStandard = FALSE;
@@ -564,25 +613,11 @@ int SetWinToGoIndex(void)
 			wininst_index = 0;
 	}
 
-	assert(utf8_to_wchar_get_size(image_path) <= ARRAYSIZE(wim_path));
-	utf8_to_wchar_no_alloc(image_path, wim_path, ARRAYSIZE(wim_path));
-	if (!img_report.is_windows_img) {
-		wcscat(wim_path, L"|");
-		assert(utf8_to_wchar_get_size(image_path) + utf8_to_wchar_get_size(&img_report.wininst_path[wininst_index][2]) <= ARRAYSIZE(wim_path));
-		utf8_to_wchar_no_alloc(&img_report.wininst_path[wininst_index][2],
-			&wim_path[wcslen(wim_path)], (int)ARRAYSIZE(wim_path) - wcslen(wim_path));
-	}
-
-	r = wimlib_open_wim(wim_path, 0, &wim);
-	if (r != 0) {
-		uprintf("Could not open WIM: %d", r);
+	if (!GetWininstImagePath(wininst_index, wim_path, sizeof(wim_path)))
 		goto out;
-	}
-	r = wimlib_get_xml_data(wim, (void**)&xml, &xml_len);
-	if (r != 0) {
-		uprintf("Could not read WIM XML index: %d", r);
+
+	if (GetWimXmlData(wim_path, &xml, &xml_len) != 0)
 		goto out;
-	}
 
 	StrArrayCreate(&version_name, 16);
 	StrArrayCreate(&version_index, 16);
@@ -644,7 +679,6 @@ out:
 	StrArrayDestroy(&version_index);
 	free(xml);
 	ezxml_free(index);
-	wimlib_free(wim);
 	return wintogo_index;
 }
 
@@ -670,12 +704,9 @@ BOOL SetupWinToGo(DWORD DriveIndex, const char* drive_name, BOOL use_esp)
 		return FALSE;
 	}
 
-	assert(safe_strlen(image_path) < ARRAYSIZE(wim_path));
-	static_strcpy(wim_path, image_path);
-	if (!img_report.is_windows_img) {
-		assert(safe_strlen(image_path) + safe_strlen(&img_report.wininst_path[wininst_index][3]) + 1 < ARRAYSIZE(wim_path));
-		static_strcat(wim_path, "|");
-		static_strcat(wim_path, &img_report.wininst_path[wininst_index][3]);
+	if (!GetWininstImagePath(wininst_index, wim_path, sizeof(wim_path))) {
+		ErrorStatus = RUFUS_ERROR(ERROR_BUFFER_OVERFLOW);
+		return FALSE;
 	}
 
 	// Now we use the WIM API to apply that image
@@ -31,3 +31,4 @@ int SetWinToGoIndex(void);
 BOOL SetupWinPE(char drive_letter);
 BOOL SetupWinToGo(DWORD DriveIndex, const char* drive_name, BOOL use_esp);
 BOOL PopulateWindowsVersion(void);
+int GetWindowsEditions(StrArray* editions);
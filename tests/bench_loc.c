@@ -0,0 +1,294 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Benchmark of the loc file parser against the compiled localization table
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage: ./bench_loc [-v] file.loc file.lcb
+ *
+ * Times the loading of the localization data the way Rufus does it at startup,
+ * from a loc file (as when an external rufus.loc is used) and from the table that
+ * res/loc/loc_compile.py compiled from the same file (as for the embedded one).
+ * Each load lists the locales, then applies the default locale and the one being
+ * selected, for every locale in turn, and the average time of a load is reported.
+ *
+ * The commands that both dispatch for every locale are also compared, so that any
+ * difference between loc_compile.py and loc_parser.c is reported as an error.
+ * With -v, the messages from the parser are printed.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "loc_host.h"
+#include "localization.h"
+
+#define NB_ROUNDS           10
+#define MAX_LOCALES         128
+
+/* What localization.c provides to the parser */
+struct list_head locale_list;
+char *default_msg_table[1], *current_msg_table[1], **msg_table = NULL;
+int loc_line_nr;
+char *loc_filename = NULL, *embedded_loc_filename = "embedded.loc";
+
+static BOOL verbose = FALSE;
+
+/* The commands dispatched by the parser, one per line, when enabled */
+static struct {
+	BOOL enabled;
+	char* buf;
+	size_t len, size;
+} record = { 0 };
+
+void loc_host_log(const char* format, ...)
+{
+	va_list args;
+
+	if (!verbose)
+		return;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	if (format[strlen(format) - 1] != '\n')
+		fputc('\n', stderr);
+}
+
+static BOOL Record(const char* format, ...)
+{
+	va_list args;
+	int len;
+
+	do {
+		va_start(args, format);
+		len = vsnprintf(&record.buf[record.len], record.size - record.len, format, args);
+		va_end(args);
+		if (len < 0)
+			return FALSE;
+		if (record.len + len < record.size)
+			break;
+		record.size = 2 * (record.len + len + 1);
+		record.buf = _reallocf(record.buf, record.size);
+		if (record.buf == NULL)
+			return FALSE;
+	} while (1);
+	record.len += len;
+	return TRUE;
+}
+
+void free_loc_cmd(loc_cmd* lcmd)
+{
+	if (lcmd == NULL)
+		return;
+	safe_free(lcmd->txt[0]);
+	safe_free(lcmd->txt[1]);
+	safe_free(lcmd->unum);
+	free(lcmd);
+}
+
+void free_dialog_list(void)
+{
+}
+
+void free_locale_list(void)
+{
+	loc_cmd *lcmd, *next;
+
+	list_for_each_entry_safe(lcmd, next, &locale_list, loc_cmd, list) {
+		list_del(&lcmd->list);
+		free_loc_cmd(lcmd);
+	}
+}
+
+static loc_cmd* GetLocale(const char* name)
+{
+	loc_cmd* lcmd;
+
+	list_for_each_entry(lcmd, &locale_list, loc_cmd, list) {
+		if (safe_strcmp(lcmd->txt[0], name) == 0)
+			return lcmd;
+	}
+	return NULL;
+}
+
+/* Same as the one from localization.c, as far as the parser is concerned */
+BOOL dispatch_loc_cmd(loc_cmd* lcmd)
+{
+	loc_cmd* base_locale;
+
+	if (lcmd == NULL)
+		return FALSE;
+	// Only these commands have an effect when a locale is loaded, so the table has no other
+	if (record.enabled && ((lcmd->command == LC_GROUP) || (lcmd->command == LC_TEXT) || (lcmd->command == LC_BASE)))
+		Record("%c %d %d %s %s\n", (msg_table == default_msg_table) ? 'D' : 'C', lcmd->command,
+			lcmd->line_nr, (lcmd->txt[0] == NULL) ? "" : lcmd->txt[0], (lcmd->txt[1] == NULL) ? "" : lcmd->txt[1]);
+	if ((msg_table != default_msg_table) && (lcmd->command == LC_BASE)) {
+		base_locale = GetLocale(lcmd->txt[0]);
+		if (base_locale != NULL)
+			get_loc_data_file(NULL, base_locale);
+	}
+	free_loc_cmd(lcmd);
+	return TRUE;
+}
+
+static double Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Load the list of locales and apply locale 'name', from the loc file or, if not NULL, the table */
+static BOOL Load(const char* path, const uint8_t* table, size_t table_size, const char* name)
+{
+	loc_cmd* lcmd;
+
+	msg_table = NULL;
+	// A NULL table reverts to parsing the loc file
+	set_loc_table(table, table_size);
+	if (!get_supported_locales(path))
+		return FALSE;
+	lcmd = GetLocale(name);
+	return (lcmd != NULL) && get_loc_data_file(path, lcmd);
+}
+
+static uint8_t* ReadFile(const char* path, size_t* size)
+{
+	FILE* fd = fopen(path, "rb");
+	uint8_t* buf = NULL;
+	long len;
+
+	if (fd == NULL)
+		return NULL;
+	if ((fseek(fd, 0, SEEK_END) != 0) || ((len = ftell(fd)) <= 0) || (fseek(fd, 0, SEEK_SET) != 0))
+		goto out;
+	buf = malloc(len);
+	if ((buf != NULL) && (fread(buf, 1, len, fd) != (size_t)len))
+		safe_free(buf);
+	*size = (size_t)len;
+
+out:
+	fclose(fd);
+	return buf;
+}
+
+/* Print the first line that differs between the loc file and the table commands */
+static void PrintDifference(const char* name, const char* file_cmds, const char* table_cmds)
+{
+	size_t i, line = 0;
+
+	for (i = 0; file_cmds[i] == table_cmds[i]; i++) {
+		if (file_cmds[i] == '\n')
+			line = i + 1;
+	}
+	fprintf(stderr, "%s: dispatched commands differ\n  loc file: %.*s\n  table:    %.*s\n", name,
+		(int)strcspn(&file_cmds[line], "\n"), &file_cmds[line],
+		(int)strcspn(&table_cmds[line], "\n"), &table_cmds[line]);
+}
+
+int main(int argc, char** argv)
+{
+	char *name[MAX_LOCALES], *file_cmds = NULL;
+	const char *loc_path, *table_path;
+	uint8_t* table = NULL;
+	size_t table_size = 0, cmds_size = 0;
+	double t, elapsed[2] = { 0.0, 0.0 };
+	loc_cmd* lcmd;
+	int i, k, round, nb_locales = 0, mismatches = 0, r = 1;
+
+	if ((argc == 4) && (strcmp(argv[1], "-v") == 0)) {
+		verbose = TRUE;
+		argv++;
+		argc--;
+	}
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s [-v] file.loc file.lcb\n", argv[0]);
+		return 1;
+	}
+	loc_path = argv[1];
+	table_path = argv[2];
+	list_init(&locale_list);
+
+	table = ReadFile(table_path, &table_size);
+	if ((table == NULL) || !set_loc_table(table, table_size)) {
+		fprintf(stderr, "'%s' is not a valid compiled localization table\n", table_path);
+		goto out;
+	}
+	if (!get_supported_locales(loc_path)) {
+		fprintf(stderr, "Could not list the locales from '%s'\n", loc_path);
+		goto out;
+	}
+	list_for_each_entry(lcmd, &locale_list, loc_cmd, list) {
+		if (nb_locales < MAX_LOCALES)
+			name[nb_locales++] = safe_strdup(lcmd->txt[0]);
+	}
+
+	record.enabled = TRUE;
+	for (i = 0; i < nb_locales; i++) {
+		// Record("") makes sure that the buffer is allocated, even if nothing was dispatched
+		record.len = 0;
+		if (!Load(loc_path, NULL, 0, name[i]) || !Record("")) {
+			fprintf(stderr, "%s: could not load from the loc file\n", name[i]);
+			mismatches++;
+			continue;
+		}
+		file_cmds = safe_strdup(record.buf);
+		cmds_size += record.len;
+		record.len = 0;
+		if (file_cmds == NULL || !Load(loc_path, table, table_size, name[i]) || !Record("")) {
+			fprintf(stderr, "%s: could not load from the compiled table\n", name[i]);
+			mismatches++;
+		} else if (strcmp(file_cmds, record.buf) != 0) {
+			PrintDifference(name[i], file_cmds, record.buf);
+			mismatches++;
+		}
+		safe_free(file_cmds);
+	}
+	record.enabled = FALSE;
+
+	/* Both take turns, so that they are equally affected by the load of the system */
+	for (round = 0; round < NB_ROUNDS; round++) {
+		for (i = 0; i < nb_locales; i++) {
+			for (k = 0; k < 2; k++) {
+				t = Now();
+				if (!Load(loc_path, (k == 0) ? NULL : table, table_size, name[i]))
+					goto out;
+				elapsed[k] += Now() - t;
+			}
+		}
+	}
+
+	printf("%d locales, %.1f KB of commands compared, %d mismatches\n", nb_locales, cmds_size / 1024.0, mismatches);
+	printf("loc file       %8.3f ms per load\n", 1000.0 * elapsed[0] / (NB_ROUNDS * nb_locales));
+	printf("compiled table %8.3f ms per load\n", 1000.0 * elapsed[1] / (NB_ROUNDS * nb_locales));
+	r = (mismatches == 0) ? 0 : 1;
+
+out:
+	for (i = 0; i < nb_locales; i++)
+		safe_free(name[i]);
+	free_locale_list();
+	set_loc_table(NULL, 0);
+	if (loc_filename != embedded_loc_filename)
+		safe_free(loc_filename);
+	free(record.buf);
+	free(table);
+	return r;
+}
@@ -0,0 +1,338 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Benchmark of the LZX decompressor variants of wimlib
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage: ./bench_lzx file [file...]
+ *
+ * The LZX chunks of a WIM file, such as an install.wim, are decompressed as they
+ * are, whereas any other file is first compressed in 32 KB chunks, the same as
+ * wimlib does when capturing. Each chunk is then decompressed by every variant of
+ * the decompressor and the best throughput out of NB_ROUNDS rounds is reported,
+ * in MB of uncompressed data per second.
+ *
+ * The variants are built from the same sources by the Makefile, with the
+ * definitions that select them, and only their decompressor_ops are exported:
+ * - baseline: the word copies of lz_copy() (LZ_COPY_BASELINE) and the SSE2 E8 filter
+ * - wide:     the 16 byte copies of lz_copy() and the SSE2 E8 filter
+ * - wide+avx2: same, with the AVX2 E8 filter, when the CPU supports it
+ */
+
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "wimlib.h"
+#include "wimlib/blob_table.h"
+#include "wimlib/cpu_features.h"
+#include "wimlib/decompressor_ops.h"
+#include "wimlib/file_io.h"
+#include "wimlib/resource.h"
+#include "wimlib/wim.h"
+
+#define CHUNK_SIZE          32768
+#define NB_ROUNDS           20
+/* Don't keep more than this much uncompressed data */
+#define MAX_CORPUS_SIZE     ((uint64_t)32 * 1024 * 1024)
+
+extern const struct decompressor_ops lzx_baseline_ops, lzx_wide_ops;
+
+static const struct {
+	const char* name;
+	const struct decompressor_ops* ops;
+	bool avx2;
+} variant[] = {
+	{ "baseline", &lzx_baseline_ops, false },
+	{ "wide", &lzx_wide_ops, false },
+	{ "wide+avx2", &lzx_wide_ops, true },
+};
+
+typedef struct {
+	size_t in_offset;
+	uint32_t in_size;
+	uint32_t out_size;
+	uint64_t out_offset;
+	bool has_ref;
+} chunk_t;
+
+static struct {
+	uint8_t* in;
+	size_t in_size, in_max;
+	uint8_t* ref;
+	uint64_t out_size;
+	chunk_t* chunk;
+	size_t nb_chunks, max_chunks;
+	uint32_t max_chunk_size;
+} corpus;
+
+static bool AddChunk(const void* data, uint32_t size, uint32_t out_size, const void* ref)
+{
+	void* p;
+
+	if (corpus.out_size + out_size > MAX_CORPUS_SIZE)
+		return false;
+	if (corpus.nb_chunks == corpus.max_chunks) {
+		corpus.max_chunks = (corpus.max_chunks == 0) ? 1024 : 2 * corpus.max_chunks;
+		p = realloc(corpus.chunk, corpus.max_chunks * sizeof(chunk_t));
+		if (p == NULL)
+			return false;
+		corpus.chunk = p;
+	}
+	while (corpus.in_size + size > corpus.in_max) {
+		corpus.in_max = (corpus.in_max == 0) ? (1 << 24) : 2 * corpus.in_max;
+		p = realloc(corpus.in, corpus.in_max);
+		if (p == NULL)
+			return false;
+		corpus.in = p;
+	}
+	p = realloc(corpus.ref, corpus.out_size + out_size);
+	if (p == NULL)
+		return false;
+	corpus.ref = p;
+	/* The reference data is only known for the chunks that we compress ourselves */
+	if (ref != NULL)
+		memcpy(&corpus.ref[corpus.out_size], ref, out_size);
+	memcpy(&corpus.in[corpus.in_size], data, size);
+	corpus.chunk[corpus.nb_chunks].in_offset = corpus.in_size;
+	corpus.chunk[corpus.nb_chunks].in_size = size;
+	corpus.chunk[corpus.nb_chunks].out_size = out_size;
+	corpus.chunk[corpus.nb_chunks].out_offset = corpus.out_size;
+	corpus.chunk[corpus.nb_chunks].has_ref = (ref != NULL);
+	corpus.nb_chunks++;
+	corpus.in_size += size;
+	corpus.out_size += out_size;
+	if (out_size > corpus.max_chunk_size)
+		corpus.max_chunk_size = out_size;
+	return true;
+}
+
+/* Read a little endian chunk table entry */
+static uint64_t ChunkEntry(const uint8_t* table, uint64_t i, uint64_t entry_size)
+{
+	uint64_t v = 0;
+	int j;
+
+	for (j = (int)entry_size - 1; j >= 0; j--)
+		v = (v << 8) | table[i * entry_size + j];
+	return v;
+}
+
+/* Add the compressed chunks of a non solid LZX resource, as they are in the WIM */
+static int AddBlobChunks(struct blob_descriptor* blob, void* _wim)
+{
+	WIMStruct* wim = _wim;
+	const struct wim_resource_descriptor* rdesc = blob->rdesc;
+	uint64_t i, nb_chunks, entry_size, table_size, start, end;
+	uint8_t* res;
+	uint32_t out_size;
+
+	if (blob->blob_location != BLOB_IN_WIM || rdesc->compression_type != WIMLIB_COMPRESSION_TYPE_LZX ||
+		(rdesc->flags & WIM_RESHDR_FLAG_SOLID) || rdesc->is_pipable || rdesc->uncompressed_size == 0)
+		return 0;
+	nb_chunks = DIV_ROUND_UP(rdesc->uncompressed_size, rdesc->chunk_size);
+	entry_size = (rdesc->uncompressed_size > UINT32_MAX) ? 8 : 4;
+	table_size = (nb_chunks - 1) * entry_size;
+	if (table_size > rdesc->size_in_wim)
+		return WIMLIB_ERR_INVALID_CHUNK_SIZE;
+	res = malloc(rdesc->size_in_wim);
+	if (res == NULL)
+		return WIMLIB_ERR_NOMEM;
+	if (full_pread(&wim->in_fd, res, rdesc->size_in_wim, rdesc->offset_in_wim) != 0) {
+		free(res);
+		return WIMLIB_ERR_READ;
+	}
+	for (i = 0; i < nb_chunks; i++) {
+		start = (i == 0) ? 0 : ChunkEntry(res, i - 1, entry_size);
+		end = (i == nb_chunks - 1) ? rdesc->size_in_wim - table_size : ChunkEntry(res, i, entry_size);
+		out_size = (uint32_t)min(rdesc->chunk_size, rdesc->uncompressed_size - i * rdesc->chunk_size);
+		if (end < start || table_size + end > rdesc->size_in_wim)
+			break;
+		/* Chunks that didn't compress are stored as is */
+		if (end - start >= out_size)
+			continue;
+		if (!AddChunk(&res[table_size + start], (uint32_t)(end - start), out_size, NULL))
+			break;
+	}
+	free(res);
+	return (corpus.out_size < MAX_CORPUS_SIZE) ? 0 : 1;
+}
+
+static bool AddWim(const char* path)
+{
+	WIMStruct* wim;
+	int r;
+
+	if (wimlib_open_wim(path, 0, &wim) != 0)
+		return false;
+	r = for_blob_in_table(wim->blob_table, AddBlobChunks, wim);
+	wimlib_free(wim);
+	return (r == 0 || r == 1);
+}
+
+/* Add any other file, compressed the same way as wimlib captures it */
+static bool AddFile(const char* path)
+{
+	struct wimlib_compressor* c = NULL;
+	uint8_t in[CHUNK_SIZE], out[CHUNK_SIZE];
+	FILE* fd = fopen(path, "rb");
+	size_t size, csize;
+	bool r = false;
+
+	if (fd == NULL || wimlib_create_compressor(WIMLIB_COMPRESSION_TYPE_LZX, CHUNK_SIZE, 0, &c) != 0)
+		goto out;
+	while ((size = fread(in, 1, sizeof(in), fd)) != 0) {
+		csize = wimlib_compress(in, size, out, size - 1, c);
+		if (csize != 0 && !AddChunk(out, (uint32_t)csize, (uint32_t)size, in))
+			break;
+	}
+	r = true;
+out:
+	wimlib_free_compressor(c);
+	if (fd != NULL)
+		fclose(fd);
+	return r;
+}
+
+static bool IsWim(const char* path)
+{
+	char magic[8] = { 0 };
+	FILE* fd = fopen(path, "rb");
+
+	if (fd == NULL)
+		return false;
+	if (fread(magic, 1, sizeof(magic), fd) != sizeof(magic))
+		magic[0] = 0;
+	fclose(fd);
+	return (memcmp(magic, "MSWIM\0\0\0", 8) == 0);
+}
+
+static double Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Decompress the whole corpus and return the time it took, or a negative value on error */
+static double Run(const struct decompressor_ops* ops, void* d, uint8_t* out)
+{
+	double t = Now();
+	size_t i;
+
+	for (i = 0; i < corpus.nb_chunks; i++) {
+		if (ops->decompress(&corpus.in[corpus.chunk[i].in_offset], corpus.chunk[i].in_size,
+			&out[corpus.chunk[i].out_offset], corpus.chunk[i].out_size, d) != 0)
+			return -1.0;
+	}
+	return Now() - t;
+}
+
+/* Check the output of the first round, of which the chunks of a WIM provide the reference */
+static bool Verify(const uint8_t* out)
+{
+	size_t i;
+
+	for (i = 0; i < corpus.nb_chunks; i++) {
+		if (!corpus.chunk[i].has_ref) {
+			memcpy(&corpus.ref[corpus.chunk[i].out_offset], &out[corpus.chunk[i].out_offset],
+				corpus.chunk[i].out_size);
+			corpus.chunk[i].has_ref = true;
+		}
+	}
+	return (memcmp(out, corpus.ref, corpus.out_size) == 0);
+}
+
+int main(int argc, char** argv)
+{
+	void* d[ARRAY_LEN(variant)] = { 0 };
+	double t, best[ARRAY_LEN(variant)] = { 0 };
+	uint8_t* out = NULL;
+	u32 features;
+	size_t i;
+	int round, r = 1;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s file [file...]\n", argv[0]);
+		return 1;
+	}
+	wimlib_global_init(0);
+	features = cpu_features;
+	for (i = 1; i < (size_t)argc && corpus.out_size < MAX_CORPUS_SIZE; i++) {
+		if (!(IsWim(argv[i]) ? AddWim(argv[i]) : AddFile(argv[i])))
+			fprintf(stderr, "Could not read '%s'\n", argv[i]);
+	}
+	if (corpus.nb_chunks == 0) {
+		fprintf(stderr, "No LZX chunks to decompress\n");
+		goto out;
+	}
+	printf("%zu chunks, %.1f MB compressed to %.1f MB\n", corpus.nb_chunks,
+		corpus.out_size / 1048576.0, corpus.in_size / 1048576.0);
+
+	out = malloc(corpus.out_size);
+	if (out == NULL)
+		goto out;
+	for (i = 0; i < ARRAY_LEN(variant); i++) {
+		if (variant[i].avx2 && !(features & X86_CPU_FEATURE_AVX2))
+			continue;
+		if (variant[i].ops->create_decompressor(corpus.max_chunk_size, &d[i]) != 0)
+			goto out;
+	}
+	/* The variants take turns, so that they are equally affected by the load of the system */
+	for (round = 0; round < NB_ROUNDS; round++) {
+		for (i = 0; i < ARRAY_LEN(variant); i++) {
+			if (d[i] == NULL)
+				continue;
+			cpu_features = variant[i].avx2 ? features : (features & ~X86_CPU_FEATURE_AVX2);
+			if (round == 0)
+				memset(out, 0, corpus.out_size);
+			t = Run(variant[i].ops, d[i], out);
+			if (t < 0.0 || (round == 0 && !Verify(out))) {
+				fprintf(stderr, "%s: %s\n", variant[i].name, (t < 0.0) ?
+					"decompression failed" : "decompressed data differs");
+				goto out;
+			}
+			if (round == 0 || t < best[i])
+				best[i] = t;
+		}
+	}
+	for (i = 0; i < ARRAY_LEN(variant); i++) {
+		if (d[i] != NULL)
+			printf("%-10s %8.1f MB/s\n", variant[i].name, corpus.out_size / 1048576.0 / best[i]);
+	}
+	r = 0;
+
+out:
+	cpu_features = features;
+	for (i = 0; i < ARRAY_LEN(variant); i++) {
+		if (d[i] != NULL)
+			variant[i].ops->free_decompressor(d[i]);
+	}
+	free(out);
+	free(corpus.in);
+	free(corpus.ref);
+	free(corpus.chunk);
+	wimlib_global_cleanup();
+	return r;
+}
@@ -0,0 +1,205 @@
+#!/usr/bin/env python3
+#
+# Rufus: The Reliable USB Formatting Utility
+# Generator for the virtual disk fixtures of test_vdisk
+# Copyright © 2026 Pete Batard <pete@akeo.ie>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Writes the same 8 MB virtual disk as a fixed VHD, a dynamic VHD, a VHDX and
+# a VHDX that has some of its metadata updates still in its log, using the same
+# layouts as qemu-img. The images are gzipped, and only need to be generated
+# again if the content below changes. Usage: ./mkvdisk.py [output directory]
+
+import gzip
+import os
+import struct
+import sys
+import uuid
+
+MB = 1024 * 1024
+DISK_SIZE = 8 * MB
+
+# Ranges of the virtual disk that hold data, as (offset, length). Everything
+# else is zeroed. This must match the 'data_range' table of test_vdisk.c.
+DATA_RANGES = [(0, 64 * 1024), (3 * MB + 4096, 4096), (6 * MB, 1536), (DISK_SIZE - 512, 512)]
+
+def pattern(offset):
+	return ((offset * 31) ^ (offset >> 9)) & 0xFF
+
+def disk_data():
+	data = bytearray(DISK_SIZE)
+	for start, length in DATA_RANGES:
+		data[start:start + length] = bytes(pattern(o) for o in range(start, start + length))
+	return data
+
+# VHD (https://www.microsoft.com/en-us/download/details.aspx?id=23850)
+
+VHD_BLOCK_SIZE = 2 * MB
+
+def vhd_checksum(buf, offset):
+	return ~sum(b for i, b in enumerate(buf) if not offset <= i < offset + 4) & 0xFFFFFFFF
+
+def vhd_footer(disk_type, data_offset):
+	f = bytearray(512)
+	# 16 heads, 63 sectors per track, as qemu-img uses for small disks
+	cylinders = DISK_SIZE // (16 * 63 * 512)
+	struct.pack_into(">8sIIQI4sI4sQQHBBII16sB", f, 0, b"conectix", 2, 0x00010000, data_offset,
+		0, b"qemu", 0x00050003, b"Wi2k", DISK_SIZE, DISK_SIZE, cylinders, 16, 63,
+		disk_type, 0, uuid.UUID(int=0x52554655535644).bytes, 0)
+	struct.pack_into(">I", f, 64, vhd_checksum(f, 64))
+	return bytes(f)
+
+def fixed_vhd(data):
+	return bytes(data) + vhd_footer(2, 0xFFFFFFFFFFFFFFFF)
+
+def dynamic_vhd(data):
+	nb_blocks = DISK_SIZE // VHD_BLOCK_SIZE
+	bat_offset = 512 + 1024
+	bat_size = (nb_blocks * 4 + 511) & ~511
+	footer = vhd_footer(3, 512)
+	header = bytearray(1024)
+	struct.pack_into(">8sQQIII", header, 0, b"cxsparse", 0xFFFFFFFFFFFFFFFF, bat_offset,
+		0x00010000, nb_blocks, VHD_BLOCK_SIZE)
+	struct.pack_into(">I", header, 36, vhd_checksum(header, 36))
+	bat = [0xFFFFFFFF] * nb_blocks
+	blocks = bytearray()
+	bitmap_size = 512
+	# Blocks are allocated in the order they are first written to, which needn't be the disk order
+	for i in [0, 3, 1]:
+		bat[i] = (bat_offset + bat_size + len(blocks)) // 512
+		blocks += b"\xff" * bitmap_size + data[i * VHD_BLOCK_SIZE:(i + 1) * VHD_BLOCK_SIZE]
+	bat_data = struct.pack(">%dI" % nb_blocks, *bat).ljust(bat_size, b"\xff")
+	return footer + bytes(header) + bat_data + bytes(blocks) + footer
+
+# VHDX (https://learn.microsoft.com/en-us/openspecs/windows_protocols/ms-vhdx)
+
+VHDX_BLOCK_SIZE = 1 * MB
+VHDX_LOG_OFFSET = 1 * MB
+VHDX_LOG_LENGTH = 1 * MB
+VHDX_METADATA_OFFSET = 2 * MB
+VHDX_BAT_OFFSET = 3 * MB
+VHDX_DATA_OFFSET = 4 * MB
+
+GUID_BAT = uuid.UUID("2DC27766-F623-4200-9D64-115E9BFD4A08").bytes_le
+GUID_METADATA = uuid.UUID("8B7CA206-4790-4B9A-B8FE-575F050F886E").bytes_le
+GUID_FILE_PARAMETERS = uuid.UUID("CAA16737-FA36-4D43-B3B6-33F0AA44E76B").bytes_le
+GUID_DISK_SIZE = uuid.UUID("2FA54224-CD1B-4876-B211-5DBED83BF4B8").bytes_le
+GUID_PAGE83 = uuid.UUID("BECA12AB-B2E6-4523-93EF-C309E000C746").bytes_le
+GUID_LOGICAL_SECTOR = uuid.UUID("8141BF1D-A96F-4709-BA47-F233A8FAAB5F").bytes_le
+GUID_PHYSICAL_SECTOR = uuid.UUID("CDA348C7-445D-4471-9CC9-E9885251C556").bytes_le
+GUID_LOG = uuid.UUID("2A6E7B5C-0D39-4D1C-A2C1-1F6C2B8E2D01").bytes_le
+
+def crc32c(buf):
+	crc = 0xFFFFFFFF
+	for b in buf:
+		crc ^= b
+		for _ in range(8):
+			crc = (crc >> 1) ^ 0x82F63B78 if crc & 1 else crc >> 1
+	return crc ^ 0xFFFFFFFF
+
+def with_crc32c(buf):
+	buf = bytearray(buf)
+	struct.pack_into("<I", buf, 4, 0)
+	struct.pack_into("<I", buf, 4, crc32c(buf))
+	return bytes(buf)
+
+def vhdx_header(seq, log_guid):
+	h = bytearray(4096)
+	struct.pack_into("<4sIQ16s16s16sHHIQ", h, 0, b"head", 0, seq, uuid.UUID(int=seq).bytes,
+		bytes(16), log_guid, 0, 1, VHDX_LOG_LENGTH, VHDX_LOG_OFFSET)
+	return with_crc32c(h)
+
+def vhdx_region_table():
+	r = bytearray(64 * 1024)
+	struct.pack_into("<4sIII", r, 0, b"regi", 0, 2, 0)
+	struct.pack_into("<16sQII", r, 16, GUID_BAT, VHDX_BAT_OFFSET, 1 * MB, 1)
+	struct.pack_into("<16sQII", r, 48, GUID_METADATA, VHDX_METADATA_OFFSET, 1 * MB, 1)
+	return with_crc32c(r)
+
+def vhdx_metadata():
+	items = [
+		(GUID_FILE_PARAMETERS, struct.pack("<II", VHDX_BLOCK_SIZE, 0), 0x4),
+		(GUID_DISK_SIZE, struct.pack("<Q", DISK_SIZE), 0x6),
+		(GUID_PAGE83, uuid.UUID(int=0x52554655535658).bytes, 0x6),
+		(GUID_LOGICAL_SECTOR, struct.pack("<I", 512), 0x6),
+		(GUID_PHYSICAL_SECTOR, struct.pack("<I", 4096), 0x6),
+	]
+	m = bytearray(1 * MB)
+	struct.pack_into("<8sHH", m, 0, b"metadata", 0, len(items))
+	# Items go after the 64 KB table
+	offset = 64 * 1024
+	for i, (guid, item, flags) in enumerate(items):
+		struct.pack_into("<16sIII", m, 32 + 32 * i, guid, offset, len(item), flags)
+		m[offset:offset + len(item)] = item
+		offset += len(item)
+	return m
+
+def vhdx_bat(order):
+	bat = bytearray(1 * MB)
+	for n, i in enumerate(order):
+		struct.pack_into("<Q", bat, 8 * i, ((VHDX_DATA_OFFSET + n * VHDX_BLOCK_SIZE) // MB) << 20 | 6)
+	return bat
+
+def vhdx_log_entry(seq, file_offset, sector):
+	# A single entry, that updates one 4 KB sector with a data descriptor
+	entry = bytearray(8192)
+	struct.pack_into("<4sIIIQII16sQQ", entry, 0, b"loge", 0, len(entry), 0, seq, 1, 0,
+		GUID_LOG, VHDX_DATA_OFFSET + 8 * MB, VHDX_DATA_OFFSET + 8 * MB)
+	struct.pack_into("<4s4s8sQQ", entry, 64, b"desc", sector[4092:], sector[:8], file_offset, seq)
+	struct.pack_into("<4sI4084sI", entry, 4096, b"data", seq >> 32, sector[8:4092], seq & 0xFFFFFFFF)
+	return with_crc32c(entry)
+
+def vhdx(data, with_log):
+	order = [i for i in range(DISK_SIZE // VHDX_BLOCK_SIZE)
+		if any(data[i * VHDX_BLOCK_SIZE:(i + 1) * VHDX_BLOCK_SIZE])]
+	order = order[1:] + order[:1]
+	img = bytearray(VHDX_DATA_OFFSET + len(order) * VHDX_BLOCK_SIZE)
+	struct.pack_into("<8s", img, 0, b"vhdxfile")
+	creator = "mkvdisk".encode("utf-16-le")
+	img[8:8 + len(creator)] = creator
+	log_guid = GUID_LOG if with_log else bytes(16)
+	# Header 2 is the current one
+	img[64 * 1024:68 * 1024] = vhdx_header(1, bytes(16))
+	img[128 * 1024:132 * 1024] = vhdx_header(2, log_guid)
+	img[192 * 1024:256 * 1024] = vhdx_region_table()
+	img[256 * 1024:320 * 1024] = vhdx_region_table()
+	img[VHDX_METADATA_OFFSET:VHDX_METADATA_OFFSET + MB] = vhdx_metadata()
+	bat = vhdx_bat(order)
+	if with_log:
+		# The BAT update for the last allocated block only made it to the log, and an older
+		# entry, which the current one doesn't reference through its tail, must be ignored
+		img[VHDX_BAT_OFFSET:VHDX_BAT_OFFSET + MB] = vhdx_bat(order[:-1])
+		stale = bytearray(4096)
+		img[VHDX_LOG_OFFSET + 8192:VHDX_LOG_OFFSET + 16384] = vhdx_log_entry(1, VHDX_BAT_OFFSET, stale)
+		img[VHDX_LOG_OFFSET:VHDX_LOG_OFFSET + 8192] = vhdx_log_entry(5, VHDX_BAT_OFFSET, bat[:4096])
+	else:
+		img[VHDX_BAT_OFFSET:VHDX_BAT_OFFSET + MB] = bat
+	for n, i in enumerate(order):
+		img[VHDX_DATA_OFFSET + n * VHDX_BLOCK_SIZE:VHDX_DATA_OFFSET + (n + 1) * VHDX_BLOCK_SIZE] = \
+			data[i * VHDX_BLOCK_SIZE:(i + 1) * VHDX_BLOCK_SIZE]
+	return bytes(img)
+
+def write(path, content):
+	# No timestamp, so that the output doesn't change
+	with open(path, "wb") as f, gzip.GzipFile(fileobj=f, mode="wb", mtime=0, filename="") as gz:
+		gz.write(content)
+
+if __name__ == "__main__":
+	out = sys.argv[1] if len(sys.argv) > 1 else os.path.dirname(os.path.abspath(__file__))
+	data = disk_data()
+	write(os.path.join(out, "fixed.vhd.gz"), fixed_vhd(data))
+	write(os.path.join(out, "dynamic.vhd.gz"), dynamic_vhd(data))
+	write(os.path.join(out, "disk.vhdx.gz"), vhdx(data, False))
+	write(os.path.join(out, "log.vhdx.gz"), vhdx(data, True))
@@ -0,0 +1,53 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Host definitions for building loc_parser.c outside of Windows
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * These are the parts of rufus.h and missing.h that loc_parser.c and
+ * localization.h use. This header is force-included (-include loc_host.h),
+ * as loc_parser.c only includes rufus.h for Windows builds.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef int BOOL;
+typedef uint16_t WORD;
+typedef void* HWND;
+#define TRUE                    1
+#define FALSE                   0
+
+#define ARRAYSIZE(A)            (sizeof(A)/sizeof((A)[0]))
+#define safe_free(p)            do { free((void*)p); p = NULL; } while(0)
+#define safe_strcmp(str1, str2) strcmp(((str1 == NULL) ? "<NULL>" : str1), ((str2 == NULL) ? "<NULL>" : str2))
+#define safe_strlen(str)        ((((char*)(str))==NULL) ? 0 : strlen(str))
+#define safe_strdup(str)        ((((char*)(str))==NULL) ? NULL : strdup(str))
+
+/* Provided by the program that includes loc_parser.c */
+#define uprintf(...)            loc_host_log(__VA_ARGS__)
+void loc_host_log(const char* format, ...);
+
+static __inline void *_reallocf(void *ptr, size_t size) {
+	void *ret = realloc(ptr, size);
+	if (!ret)
+		free(ptr);
+	return ret;
+}
@@ -0,0 +1,170 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Windows threading and synchronization API, on top of POSIX threads
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This is only what the host tests need to build the sources that include
+ * <windows.h> for their threads, locks, condition variables and interlocked
+ * operations (e.g. fanout.c), through -Ishim. SRW locks are plain mutexes,
+ * so shared acquisitions are exclusive, and threads can only be waited for
+ * once, with an INFINITE timeout.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef int BOOL;
+typedef int32_t LONG;
+typedef int64_t LONG64;
+typedef uint32_t DWORD;
+typedef void* LPVOID;
+typedef void* HANDLE;
+
+#define TRUE                    1
+#define FALSE                   0
+#define WINAPI
+#define INFINITE                0xFFFFFFFF
+#define WAIT_OBJECT_0           0
+#define WAIT_FAILED             0xFFFFFFFF
+
+#ifndef min
+#define min(a, b)               (((a) < (b)) ? (a) : (b))
+#endif
+
+/* Locks and condition variables */
+typedef pthread_mutex_t SRWLOCK;
+typedef pthread_cond_t CONDITION_VARIABLE;
+
+static __inline void InitializeSRWLock(SRWLOCK* lock)
+{
+	pthread_mutex_init(lock, NULL);
+}
+
+#define AcquireSRWLockExclusive(lock)   pthread_mutex_lock(lock)
+#define ReleaseSRWLockExclusive(lock)   pthread_mutex_unlock(lock)
+#define AcquireSRWLockShared(lock)      pthread_mutex_lock(lock)
+#define ReleaseSRWLockShared(lock)      pthread_mutex_unlock(lock)
+
+static __inline void InitializeConditionVariable(CONDITION_VARIABLE* cv)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cv, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/* Returns FALSE on timeout, same as on Windows */
+static __inline BOOL SleepConditionVariableSRW(CONDITION_VARIABLE* cv, SRWLOCK* lock, DWORD dwMilliseconds, uint32_t flags)
+{
+	struct timespec ts;
+
+	if (dwMilliseconds == INFINITE)
+		return (pthread_cond_wait(cv, lock) == 0);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += dwMilliseconds / 1000;
+	ts.tv_nsec += (long)(dwMilliseconds % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	return (pthread_cond_timedwait(cv, lock, &ts) == 0);
+}
+
+#define WakeConditionVariable(cv)       pthread_cond_signal(cv)
+#define WakeAllConditionVariable(cv)    pthread_cond_broadcast(cv)
+
+/* Interlocked operations, that return the initial value */
+#define InterlockedExchange(p, v)           __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(p, v)        __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd64(p, v)      __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST)
+
+static __inline LONG InterlockedCompareExchange(volatile LONG* p, LONG exchange, LONG comparand)
+{
+	__atomic_compare_exchange_n(p, &comparand, exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return comparand;
+}
+
+static __inline LONG64 InterlockedCompareExchange64(volatile LONG64* p, LONG64 exchange, LONG64 comparand)
+{
+	__atomic_compare_exchange_n(p, &comparand, exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return comparand;
+}
+
+/* Threads, where a HANDLE is the pthread along with the routine it runs */
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID);
+
+typedef struct {
+	pthread_t thread;
+	LPTHREAD_START_ROUTINE routine;
+	LPVOID param;
+} shim_thread;
+
+static void* ShimThread(void* param)
+{
+	shim_thread* t = (shim_thread*)param;
+
+	t->routine(t->param);
+	return NULL;
+}
+
+static __inline HANDLE CreateThread(void* attributes, size_t stack_size, LPTHREAD_START_ROUTINE routine,
+	LPVOID param, DWORD flags, DWORD* id)
+{
+	shim_thread* t = (shim_thread*)calloc(1, sizeof(shim_thread));
+
+	if (t == NULL)
+		return NULL;
+	t->routine = routine;
+	t->param = param;
+	if (pthread_create(&t->thread, NULL, ShimThread, t) != 0) {
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+#define ExitThread(code)                pthread_exit(NULL)
+
+static __inline DWORD WaitForSingleObject(HANDLE h, DWORD dwMilliseconds)
+{
+	if ((h == NULL) || (dwMilliseconds != INFINITE))
+		return WAIT_FAILED;
+	return (pthread_join(((shim_thread*)h)->thread, NULL) == 0) ? WAIT_OBJECT_0 : WAIT_FAILED;
+}
+
+static __inline BOOL CloseHandle(HANDLE h)
+{
+	free(h);
+	return TRUE;
+}
+
+/* Aligned allocations */
+static __inline void* _mm_malloc(size_t size, size_t alignment)
+{
+	void* p;
+
+	return (posix_memalign(&p, alignment, size) == 0) ? p : NULL;
+}
+
+#define _mm_free(p)                     free(p)
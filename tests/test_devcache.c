@@ -0,0 +1,268 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Host tests for the device cache
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "devcache.h"
+
+static int failures = 0, nb_freed = 0;
+
+#define CHECK(cond) do { if (!(cond)) { \
+	fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+/* A fake device provider, with the probed data being a copy of the device ID */
+typedef struct {
+	const char* id;
+	uint32_t signature;
+} fake_device;
+
+static void FreeData(void* data)
+{
+	free(data);
+	nb_freed++;
+}
+
+/*
+ * Enumerate 'devices' and probe the ones that need it, as GetDevices() does.
+ * Returns the number of devices that were probed.
+ */
+static int Refresh(dev_cache* cache, const fake_device* devices, int nb_devices)
+{
+	dev_cache_entry* entry;
+	uint32_t i;
+	int nb_probes = 0;
+
+	DevCacheBeginEnum(cache);
+	for (i = 0; i < (uint32_t)nb_devices; i++) {
+		entry = DevCacheAdd(cache, devices[i].id, devices[i].signature);
+		CHECK(entry != NULL);
+		if ((entry != NULL) && (entry->data == NULL))
+			entry->data = strdup(devices[i].id);
+	}
+	DevCacheEndEnum(cache);
+	for (i = 0; i < cache->nb_entries; i++) {
+		entry = cache->entries[i];
+		if (!DevCacheNeedsProbe(cache, entry))
+			continue;
+		DevCacheStartProbe(cache, entry);
+		DevCacheEndProbe(entry);
+		nb_probes++;
+	}
+	return nb_probes;
+}
+
+static int IsOrder(dev_cache* cache, const fake_device* devices, int nb_devices)
+{
+	int i;
+
+	if (cache->nb_entries != (uint32_t)nb_devices)
+		return 0;
+	for (i = 0; i < nb_devices; i++) {
+		if ((strcmp(cache->entries[i]->id, devices[i].id) != 0) ||
+			(strcmp((char*)cache->entries[i]->data, devices[i].id) != 0))
+			return 0;
+	}
+	return 1;
+}
+
+static void TestRefresh(void)
+{
+	fake_device devices[] = { { "USB\\A", 1 }, { "USB\\B", 2 }, { "USB\\C", 3 } };
+	fake_device reordered[] = { { "USB\\C", 3 }, { "USB\\A", 1 } };
+	fake_device changed[] = { { "USB\\C", 4 }, { "USB\\A", 1 }, { "USB\\D", 5 } };
+	dev_cache cache;
+
+	nb_freed = 0;
+	DevCacheInit(&cache, FreeData);
+	CHECK(Refresh(&cache, devices, 3) == 3);
+	CHECK(IsOrder(&cache, devices, 3));
+	// Nothing changed => nothing to probe
+	CHECK(Refresh(&cache, devices, 3) == 0);
+	CHECK(nb_freed == 0);
+	// A device went away and the others moved around
+	CHECK(Refresh(&cache, reordered, 2) == 0);
+	CHECK(IsOrder(&cache, reordered, 2));
+	CHECK(nb_freed == 1);
+	// A device changed and a new one appeared
+	CHECK(Refresh(&cache, changed, 3) == 2);
+	CHECK(IsOrder(&cache, changed, 3));
+	CHECK(nb_freed == 2);
+	DevCacheFree(&cache);
+	CHECK(nb_freed == 5);
+	CHECK(cache.nb_entries == 0);
+}
+
+static void TestDuplicates(void)
+{
+	fake_device devices[] = { { "<N/A>", 1 }, { "<N/A>", 2 }, { "USB\\A", 3 } };
+	dev_cache cache;
+
+	nb_freed = 0;
+	DevCacheInit(&cache, FreeData);
+	CHECK(Refresh(&cache, devices, 3) == 3);
+	CHECK(cache.nb_entries == 3);
+	CHECK(cache.entries[0] != cache.entries[1]);
+	CHECK(Refresh(&cache, devices, 3) == 0);
+	CHECK(nb_freed == 0);
+	DevCacheFree(&cache);
+	CHECK(nb_freed == 3);
+}
+
+static void TestInvalidate(void)
+{
+	fake_device devices[] = { { "USB\\A", 1 }, { "USB\\B", 2 }, { "USB\\C", 3 } };
+	dev_cache cache;
+
+	DevCacheInit(&cache, FreeData);
+	CHECK(Refresh(&cache, devices, 3) == 3);
+	// Only the invalidated device should be probed again, while keeping its data
+	DevCacheInvalidate(&cache, "USB\\B");
+	CHECK(!DevCacheNeedsProbe(&cache, cache.entries[0]));
+	CHECK(DevCacheNeedsProbe(&cache, cache.entries[1]));
+	CHECK(Refresh(&cache, devices, 3) == 1);
+	CHECK(IsOrder(&cache, devices, 3));
+	DevCacheInvalidate(&cache, "USB\\Z");
+	CHECK(Refresh(&cache, devices, 3) == 0);
+	// Invalidating everything
+	DevCacheInvalidate(&cache, NULL);
+	CHECK(Refresh(&cache, devices, 3) == 3);
+	CHECK(Refresh(&cache, devices, 3) == 0);
+	DevCacheFree(&cache);
+}
+
+static void TestPendingProbe(void)
+{
+	fake_device devices[] = { { "USB\\A", 1 }, { "USB\\B", 2 } };
+	fake_device changed[] = { { "USB\\A", 3 } };
+	dev_cache cache;
+	dev_cache_entry* entry;
+
+	nb_freed = 0;
+	DevCacheInit(&cache, FreeData);
+	CHECK(Refresh(&cache, devices, 2) == 2);
+	entry = cache.entries[0];
+	DevCacheInvalidate(&cache, "USB\\A");
+	DevCacheStartProbe(&cache, entry);
+	// A device that is being probed doesn't need another probe...
+	CHECK(!DevCacheNeedsProbe(&cache, entry));
+	CHECK(!DevCacheIsProbed(entry));
+	// ...and must not be freed if it changes or goes away before its probe is over
+	CHECK(Refresh(&cache, changed, 1) == 1);
+	CHECK(cache.nb_entries == 1);
+	CHECK(cache.entries[0] != entry);
+	CHECK(cache.nb_orphans == 1);
+	CHECK(nb_freed == 1);
+	CHECK(strcmp((char*)entry->data, "USB\\A") == 0);
+	DevCacheEndProbe(entry);
+	// Orphans are freed on the next enumeration once their probe is over
+	CHECK(Refresh(&cache, changed, 1) == 0);
+	CHECK(cache.nb_orphans == 0);
+	CHECK(nb_freed == 2);
+	DevCacheFree(&cache);
+	CHECK(nb_freed == 3);
+}
+
+static void* ProbeThread(void* param)
+{
+	dev_cache_entry** entries = (dev_cache_entry**)param;
+	int i;
+
+	for (i = 0; entries[i] != NULL; i++)
+		DevCacheEndProbe(entries[i]);
+	return NULL;
+}
+
+/* Have the probes complete from another thread, while the devices come and go */
+static void TestThreadedProbe(void)
+{
+	char id[64];
+	fake_device devices[64];
+	dev_cache cache;
+	dev_cache_entry* entries[65];
+	pthread_t thread;
+	uint32_t i;
+	int run, nb;
+
+	nb_freed = 0;
+	DevCacheInit(&cache, FreeData);
+	for (run = 0; run < 200; run++) {
+		nb = 1 + run % 64;
+		for (i = 0; i < (uint32_t)nb; i++) {
+			sprintf(id, "USB\\%d", (run + i) % 80);
+			devices[i].id = strdup(id);
+			devices[i].signature = (run + i) % 3;
+		}
+		DevCacheBeginEnum(&cache);
+		for (i = 0; i < (uint32_t)nb; i++) {
+			entries[i] = DevCacheAdd(&cache, devices[i].id, devices[i].signature);
+			if (entries[i]->data == NULL)
+				entries[i]->data = strdup(devices[i].id);
+		}
+		DevCacheEndEnum(&cache);
+		for (i = 0, nb = 0; i < cache.nb_entries; i++) {
+			if (DevCacheNeedsProbe(&cache, cache.entries[i])) {
+				DevCacheStartProbe(&cache, cache.entries[i]);
+				entries[nb++] = cache.entries[i];
+			}
+		}
+		entries[nb] = NULL;
+		CHECK(pthread_create(&thread, NULL, ProbeThread, entries) == 0);
+		// Drop half of the devices while they are being probed
+		DevCacheBeginEnum(&cache);
+		for (i = 0; i < (uint32_t)(1 + run % 64); i += 2)
+			DevCacheAdd(&cache, devices[i].id, devices[i].signature + 1);
+		DevCacheEndEnum(&cache);
+		pthread_join(thread, NULL);
+		for (i = 0; i < (uint32_t)(1 + run % 64); i++)
+			free((char*)devices[i].id);
+	}
+	DevCacheBeginEnum(&cache);
+	CHECK(cache.nb_orphans == 0);
+	DevCacheFree(&cache);
+}
+
+static void TestHash(void)
+{
+	uint32_t h1 = DevCacheHashStr(DEV_CACHE_HASH_INIT, "USBSTOR");
+	uint32_t h2 = DevCacheHashStr(DEV_CACHE_HASH_INIT, "UASPSTOR");
+
+	// FNV-1a test vector
+	CHECK(DevCacheHashStr(DEV_CACHE_HASH_INIT, "a") == 0xe40c292c);
+	CHECK(h1 != h2);
+	CHECK(DevCacheHashStr(h1, "") == h1);
+}
+
+int main(void)
+{
+	TestRefresh();
+	TestDuplicates();
+	TestInvalidate();
+	TestPendingProbe();
+	TestThreadedProbe();
+	TestHash();
+	if (failures != 0) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("All device cache tests passed\n");
+	return 0;
+}
@@ -0,0 +1,789 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Host tests for the segmented download state and scheduling, against a local HTTP server
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <openssl/evp.h>
+
+#include "download_state.h"
+
+/*
+ * The server below stands in for the ones we download images from: it serves a
+ * single file, with range requests and optional ETag/Last-Modified validators,
+ * and can be told to cut some of its responses short. The file is downloaded by
+ * the same segment scheduling as net.c, from parallel threads, with a fetch()
+ * callback that issues the range requests, and a commit() callback that records
+ * the completed segments in a state buffer, as net.c does in its state file.
+ * The server can also send its data in delayed chunks, and publish a '.sha256'
+ * for the file, so that the file can be streamed to a writer while it is being
+ * downloaded, as net.c and format.c do for disk images.
+ */
+
+#define SEGMENT_SIZE    (64 * 1024)
+#define FILE_SIZE       (5 * SEGMENT_SIZE + 1234)
+#define NB_SEGMENTS     ((FILE_SIZE + SEGMENT_SIZE - 1) / SEGMENT_SIZE)
+#define NB_CONNECTIONS  3
+#define MAX_ATTEMPTS    3
+#define CHUNK_SIZE      4096
+#define FILE_PATH       "/image.img"
+#define WRITE_SIZE      7000
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { \
+	fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+static struct {
+	int fd;
+	uint16_t port;
+	uint8_t* data;
+	/* Validators sent by the server; empty for none */
+	char etag[64];
+	char last_modified[64];
+	/* Number of responses to cut short, for range requests that start at 'fail_offset' */
+	uint64_t fail_offset;
+	int fail_count;
+	/* Delay between the chunks of data sent, in microseconds */
+	unsigned int delay;
+	/* Content of '<file>.sha256'; not found if empty */
+	char sha256_file[256];
+	pthread_mutex_t lock;
+} server;
+
+typedef struct {
+	int status;
+	char content_range[128];
+	char etag[128];
+	char last_modified[64];
+	size_t body_size;
+} response_t;
+
+static int SendAll(int fd, const void* buf, size_t len)
+{
+	const char* p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n <= 0)
+			return 0;
+		p += n;
+		len -= (size_t)n;
+	}
+	return 1;
+}
+
+/* Read an HTTP header block, up to and including the empty line */
+static int ReadHeaders(int fd, char* buf, size_t size)
+{
+	size_t len = 0;
+
+	while (len < size - 1) {
+		if (recv(fd, &buf[len], 1, 0) != 1)
+			return 0;
+		len++;
+		buf[len] = 0;
+		if (len >= 4 && memcmp(&buf[len - 4], "\r\n\r\n", 4) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+static const char* FindHeader(const char* headers, const char* name)
+{
+	const char* p;
+	size_t len = strlen(name);
+
+	for (p = strstr(headers, "\r\n"); p != NULL; p = strstr(p, "\r\n")) {
+		p += 2;
+		if (strncasecmp(p, name, len) == 0 && p[len] == ':')
+			return &p[len + 1 + strspn(&p[len + 1], " ")];
+	}
+	return NULL;
+}
+
+static void CopyHeader(const char* headers, const char* name, char* dst, size_t size)
+{
+	const char* p = FindHeader(headers, name);
+	size_t len;
+
+	dst[0] = 0;
+	if (p == NULL)
+		return;
+	len = strcspn(p, "\r\n");
+	if (len >= size)
+		len = size - 1;
+	memcpy(dst, p, len);
+	dst[len] = 0;
+}
+
+static void* ServeConnection(void* param)
+{
+	int fd = (int)(intptr_t)param;
+	char req[2048], hdr[512], validators[256] = "", path[256] = "", sha256_file[256];
+	const char* range;
+	unsigned long long start = 0, end = FILE_SIZE - 1;
+	size_t len, sent, chunk;
+	unsigned int delay;
+	int partial = 0;
+
+	if (!ReadHeaders(fd, req, sizeof(req)))
+		goto out;
+	if (sscanf(req, "GET %255s", path) == 1 && strlen(path) > 7 && strcmp(&path[strlen(path) - 7], ".sha256") == 0) {
+		pthread_mutex_lock(&server.lock);
+		strcpy(sha256_file, server.sha256_file);
+		pthread_mutex_unlock(&server.lock);
+		if (sha256_file[0] == 0)
+			snprintf(hdr, sizeof(hdr), "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+		else
+			snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+				strlen(sha256_file));
+		if (SendAll(fd, hdr, strlen(hdr)))
+			SendAll(fd, sha256_file, strlen(sha256_file));
+		goto out;
+	}
+	range = FindHeader(req, "Range");
+	if (range != NULL && sscanf(range, "bytes=%llu-%llu", &start, &end) == 2 &&
+		start <= end && end < FILE_SIZE)
+		partial = 1;
+	pthread_mutex_lock(&server.lock);
+	if (server.etag[0] != 0)
+		snprintf(validators, sizeof(validators), "ETag: %s\r\n", server.etag);
+	if (server.last_modified[0] != 0)
+		snprintf(&validators[strlen(validators)], sizeof(validators) - strlen(validators),
+			"Last-Modified: %s\r\n", server.last_modified);
+	len = (size_t)(end - start + 1);
+	if (partial && start == server.fail_offset && server.fail_count > 0) {
+		server.fail_count--;
+		len /= 2;
+	}
+	delay = server.delay;
+	pthread_mutex_unlock(&server.lock);
+	if (partial)
+		snprintf(hdr, sizeof(hdr), "HTTP/1.1 206 Partial Content\r\nContent-Length: %llu\r\n"
+			"Content-Range: bytes %llu-%llu/%d\r\n%sConnection: close\r\n\r\n",
+			end - start + 1, start, end, FILE_SIZE, validators);
+	else
+		snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n%sConnection: close\r\n\r\n",
+			FILE_SIZE, validators);
+	if (!SendAll(fd, hdr, strlen(hdr)))
+		goto out;
+	for (sent = 0; sent < len; sent += chunk) {
+		chunk = (len - sent < CHUNK_SIZE) ? len - sent : CHUNK_SIZE;
+		if (delay != 0)
+			usleep(delay);
+		if (!SendAll(fd, &server.data[start + sent], chunk))
+			break;
+	}
+out:
+	close(fd);
+	return NULL;
+}
+
+static void* ServerThread(void* param)
+{
+	pthread_t thread;
+	int fd;
+
+	while ((fd = accept(server.fd, NULL, NULL)) >= 0) {
+		if (pthread_create(&thread, NULL, ServeConnection, (void*)(intptr_t)fd) != 0) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+static int StartServer(void)
+{
+	struct sockaddr_in addr = { 0 };
+	socklen_t len = sizeof(addr);
+	pthread_t thread;
+	int i;
+
+	server.data = malloc(FILE_SIZE);
+	if (server.data == NULL)
+		return 0;
+	for (i = 0; i < FILE_SIZE; i++)
+		server.data[i] = (uint8_t)(i * 2654435761u >> 13);
+	pthread_mutex_init(&server.lock, NULL);
+	server.fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (server.fd < 0)
+		return 0;
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(server.fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(server.fd, 16) != 0 ||
+		getsockname(server.fd, (struct sockaddr*)&addr, &len) != 0)
+		return 0;
+	server.port = ntohs(addr.sin_port);
+	return (pthread_create(&thread, NULL, ServerThread, NULL) == 0);
+}
+
+static void SetValidators(const char* etag, const char* last_modified)
+{
+	pthread_mutex_lock(&server.lock);
+	snprintf(server.etag, sizeof(server.etag), "%s", etag);
+	snprintf(server.last_modified, sizeof(server.last_modified), "%s", last_modified);
+	pthread_mutex_unlock(&server.lock);
+}
+
+static void SetStreaming(unsigned int delay, const char* sha256_file)
+{
+	pthread_mutex_lock(&server.lock);
+	server.delay = delay;
+	snprintf(server.sha256_file, sizeof(server.sha256_file), "%s", sha256_file);
+	pthread_mutex_unlock(&server.lock);
+}
+
+static void SetFailures(uint64_t offset, int count)
+{
+	pthread_mutex_lock(&server.lock);
+	server.fail_offset = offset;
+	server.fail_count = count;
+	pthread_mutex_unlock(&server.lock);
+}
+
+/* Issue a range request for [start, end] of 'path', storing the body (if any) in 'buf' */
+static int HttpGetRange(const char* path, uint64_t start, uint64_t end, response_t* resp, uint8_t* buf)
+{
+	struct sockaddr_in addr = { 0 };
+	char req[256], headers[2048];
+	ssize_t n;
+	int fd, r = 0;
+
+	memset(resp, 0, sizeof(*resp));
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return 0;
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(server.port);
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+		goto out;
+	snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: 127.0.0.1\r\n"
+		"Accept-Encoding: identity\r\nRange: bytes=%llu-%llu\r\n\r\n",
+		path, (unsigned long long)start, (unsigned long long)end);
+	if (!SendAll(fd, req, strlen(req)) || !ReadHeaders(fd, headers, sizeof(headers)))
+		goto out;
+	if (sscanf(headers, "HTTP/1.1 %d", &resp->status) != 1)
+		goto out;
+	CopyHeader(headers, "Content-Range", resp->content_range, sizeof(resp->content_range));
+	CopyHeader(headers, "ETag", resp->etag, sizeof(resp->etag));
+	CopyHeader(headers, "Last-Modified", resp->last_modified, sizeof(resp->last_modified));
+	while (resp->body_size < end - start + 1) {
+		n = recv(fd, &buf[resp->body_size], (size_t)(end - start + 1 - resp->body_size), 0);
+		if (n <= 0)
+			break;
+		resp->body_size += (size_t)n;
+	}
+	r = 1;
+out:
+	close(fd);
+	return r;
+}
+
+/* Probe the file, as net.c does, and initialize the download state from the response */
+static int Probe(download_state_t* state)
+{
+	response_t resp;
+	uint8_t byte;
+	uint64_t total_size = 0;
+
+	if (!HttpGetRange(FILE_PATH, 0, 0, &resp, &byte) || resp.status != 206 ||
+		!DownloadStateParseContentRange(resp.content_range, &total_size))
+		return 0;
+	DownloadStateInit(state, total_size, SEGMENT_SIZE, resp.etag, resp.last_modified);
+	return 1;
+}
+
+/* A download of the file, along with the state that net.c would save alongside it */
+typedef struct {
+	download_segments_t seg;
+	uint8_t* file;
+	uint8_t saved[sizeof(download_state_t) + NB_SEGMENTS];
+	uint32_t stop_after;	/* Abort the download after that many commits, if not zero */
+	uint32_t nb_commits;
+	uint32_t nb_fetches;
+	pthread_mutex_t lock;
+} test_download_t;
+
+static int FetchSegment(void* worker, download_job_t* job)
+{
+	test_download_t* dl = worker;
+	response_t resp;
+
+	__atomic_add_fetch(&dl->nb_fetches, 1, __ATOMIC_SEQ_CST);
+	if (!HttpGetRange(FILE_PATH, job->offset, job->offset + job->size - 1, &resp, &dl->file[job->offset]))
+		return 0;
+	DownloadSegmentsReport(job, (int64_t)resp.body_size);
+	return (resp.status == 206) && (resp.body_size == job->size);
+}
+
+static void CommitSegment(void* worker, uint32_t segment)
+{
+	test_download_t* dl = worker;
+
+	pthread_mutex_lock(&dl->lock);
+	dl->saved[sizeof(download_state_t) + segment] = 1;
+	if (dl->stop_after != 0 && ++dl->nb_commits >= dl->stop_after)
+		DownloadSegmentsAbort(&dl->seg);
+	pthread_mutex_unlock(&dl->lock);
+}
+
+/*
+ * Set up a download for 'state', resuming from the 'saved' state of a previous one if
+ * possible, and save the new state, as net.c does. Returns whether it was resumed.
+ */
+static int StartDownload(test_download_t* dl, const download_state_t* state, const uint8_t* saved, size_t saved_size)
+{
+	int resumed;
+
+	memset(dl, 0, sizeof(*dl));
+	dl->file = calloc(1, FILE_SIZE);
+	pthread_mutex_init(&dl->lock, NULL);
+	CHECK(dl->file != NULL);
+	CHECK(state->nb_segments == NB_SEGMENTS);
+	CHECK(DownloadSegmentsInit(&dl->seg, state, MAX_ATTEMPTS, FetchSegment, CommitSegment));
+	resumed = DownloadSegmentsResume(&dl->seg, state, saved, saved_size, FILE_SIZE);
+	if (resumed)
+		memcpy(dl->saved, saved, sizeof(dl->saved));
+	else
+		memcpy(dl->saved, state, sizeof(*state));
+	return resumed;
+}
+
+static void* DownloadThread(void* param)
+{
+	test_download_t* dl = param;
+
+	DownloadSegmentsRun(&dl->seg, dl);
+	return NULL;
+}
+
+static void RunDownload(test_download_t* dl)
+{
+	pthread_t threads[NB_CONNECTIONS];
+	int i;
+
+	for (i = 0; i < NB_CONNECTIONS; i++)
+		CHECK(pthread_create(&threads[i], NULL, DownloadThread, dl) == 0);
+	for (i = 0; i < NB_CONNECTIONS; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static void EndDownload(test_download_t* dl)
+{
+	DownloadSegmentsFree(&dl->seg);
+	pthread_mutex_destroy(&dl->lock);
+	free(dl->file);
+}
+
+/* Check that the segments are consumed in order */
+static int ConsumeSegment(void* ctx, uint64_t offset, uint64_t size)
+{
+	uint64_t* next = ctx;
+
+	CHECK(offset == *next);
+	*next = offset + size;
+	return 1;
+}
+
+static uint32_t DoneSegments(test_download_t* dl, uint64_t* size)
+{
+	uint32_t i, nb_done = 0;
+
+	*size = 0;
+	for (i = 0; i < NB_SEGMENTS; i++) {
+		if (!dl->seg.done[i])
+			continue;
+		nb_done++;
+		*size += DownloadSegmentSize(&dl->seg, i);
+		CHECK(memcmp(&dl->file[(uint64_t)i * SEGMENT_SIZE], &server.data[(uint64_t)i * SEGMENT_SIZE],
+			DownloadSegmentSize(&dl->seg, i)) == 0);
+	}
+	return nb_done;
+}
+
+static void TestSegments(void)
+{
+	download_state_t state;
+	test_download_t dl;
+	uint64_t next = 0;
+
+	DownloadStateInit(&state, FILE_SIZE, SEGMENT_SIZE, "", "");
+	StartDownload(&dl, &state, NULL, 0);
+	CHECK(DownloadSegmentSize(&dl.seg, 0) == SEGMENT_SIZE);
+	CHECK(DownloadSegmentSize(&dl.seg, NB_SEGMENTS - 1) == FILE_SIZE % SEGMENT_SIZE);
+	CHECK(DownloadSegmentSize(&dl.seg, NB_SEGMENTS) == 0);
+	/* Nothing can be consumed until the first segment is done */
+	dl.seg.done[1] = 1;
+	CHECK(DownloadSegmentsConsume(&dl.seg, ConsumeSegment, &next) == 0);
+	CHECK(DownloadSegmentsAvailable(&dl.seg) == 0);
+	dl.seg.done[0] = 1;
+	CHECK(DownloadSegmentsConsume(&dl.seg, ConsumeSegment, &next) == 2);
+	CHECK(DownloadSegmentsAvailable(&dl.seg) == 2 * SEGMENT_SIZE);
+	CHECK(next == 2 * SEGMENT_SIZE);
+	EndDownload(&dl);
+}
+static void TestContentRange(void)
+{
+	uint64_t size = 0;
+
+	CHECK(DownloadStateParseContentRange("bytes 0-0/12345", &size) && size == 12345);
+	CHECK(DownloadStateParseContentRange("bytes 0-0/6442450944", &size) && size == 6442450944ULL);
+	CHECK(!DownloadStateParseContentRange("bytes 0-0/*", &size));
+	CHECK(!DownloadStateParseContentRange("bytes 0-0/12x", &size));
+	CHECK(!DownloadStateParseContentRange("items 0-0/10", &size));
+	CHECK(!DownloadStateParseContentRange(NULL, &size));
+}
+
+static void TestValidators(void)
+{
+	download_state_t state;
+
+	DownloadStateInit(&state, FILE_SIZE, SEGMENT_SIZE, "", "");
+	CHECK(!DownloadStateHasValidator(&state));
+	DownloadStateInit(&state, FILE_SIZE, SEGMENT_SIZE, "W/\"weak\"", "");
+	CHECK(!DownloadStateHasValidator(&state));
+	DownloadStateInit(&state, FILE_SIZE, SEGMENT_SIZE, "W/\"weak\"", "Mon, 19 Oct 2026 10:00:00 GMT");
+	CHECK(DownloadStateHasValidator(&state));
+	DownloadStateInit(&state, FILE_SIZE, SEGMENT_SIZE, "\"strong\"", NULL);
+	CHECK(DownloadStateHasValidator(&state));
+	CHECK(state.nb_segments == (FILE_SIZE + SEGMENT_SIZE - 1) / SEGMENT_SIZE);
+}
+
+/* Interrupt a download, then resume it, with the validators the server currently sends */
+static void TestResume(const char* etag, const char* last_modified, int expect_resume)
+{
+	download_state_t state, resumed;
+	test_download_t dl, dl2;
+	uint64_t size, next = 0;
+	uint32_t i, nb_done;
+
+	SetValidators(etag, last_modified);
+	CHECK(Probe(&state));
+	CHECK(state.total_size == FILE_SIZE);
+	CHECK(!StartDownload(&dl, &state, NULL, 0));
+	/* Interrupt the download after a couple of segments have been completed */
+	dl.stop_after = 2;
+	RunDownload(&dl);
+	CHECK(DownloadSegmentsAborted(&dl.seg));
+	nb_done = DoneSegments(&dl, &size);
+	CHECK(nb_done >= 2 && nb_done < NB_SEGMENTS);
+	CHECK(nb_done == dl.nb_commits);
+	for (i = 0; i < NB_SEGMENTS; i++)
+		CHECK(dl.saved[sizeof(state) + i] == dl.seg.done[i]);
+
+	/* Resume, with a new probe, from what was saved */
+	CHECK(Probe(&resumed));
+	CHECK(StartDownload(&dl2, &resumed, dl.saved, sizeof(dl.saved)) == expect_resume);
+	if (expect_resume) {
+		CHECK(memcmp((const void*)dl2.seg.done, (const void*)dl.seg.done, NB_SEGMENTS) == 0);
+		CHECK(DownloadSegmentsDownloaded(&dl2.seg) == size);
+		memcpy(dl2.file, dl.file, FILE_SIZE);
+	} else {
+		CHECK(DownloadSegmentsDownloaded(&dl2.seg) == 0);
+	}
+	RunDownload(&dl2);
+	/* Completed segments must not be downloaded again */
+	CHECK(dl2.nb_fetches == (expect_resume ? NB_SEGMENTS - nb_done : NB_SEGMENTS));
+	CHECK(!DownloadSegmentsAborted(&dl2.seg));
+	CHECK(DoneSegments(&dl2, &size) == NB_SEGMENTS);
+	CHECK(DownloadSegmentsDownloaded(&dl2.seg) == FILE_SIZE);
+	CHECK(memcmp(dl2.file, server.data, FILE_SIZE) == 0);
+	for (i = 0; i < NB_SEGMENTS; i++)
+		CHECK(dl2.saved[sizeof(state) + i] == 1);
+	CHECK(DownloadSegmentsConsume(&dl2.seg, ConsumeSegment, &next) == NB_SEGMENTS);
+	CHECK(DownloadSegmentsAvailable(&dl2.seg) == FILE_SIZE);
+	CHECK(next == FILE_SIZE);
+
+	EndDownload(&dl);
+	EndDownload(&dl2);
+}
+
+/* Segments whose transfer is cut short must be retried, without their data being counted twice */
+static void TestRetries(int nb_failures)
+{
+	download_state_t state;
+	test_download_t dl;
+	uint64_t size, next = 0;
+
+	SetValidators("\"abc123\"", "");
+	CHECK(Probe(&state));
+	SetFailures(2 * SEGMENT_SIZE, nb_failures);
+	StartDownload(&dl, &state, NULL, 0);
+	RunDownload(&dl);
+	SetFailures(0, 0);
+	if (nb_failures < MAX_ATTEMPTS) {
+		CHECK(dl.nb_fetches == NB_SEGMENTS + (uint32_t)nb_failures);
+		CHECK(!DownloadSegmentsAborted(&dl.seg));
+		CHECK(DoneSegments(&dl, &size) == NB_SEGMENTS);
+		CHECK(DownloadSegmentsDownloaded(&dl.seg) == FILE_SIZE);
+		CHECK(memcmp(dl.file, server.data, FILE_SIZE) == 0);
+	} else {
+		/* A segment that can't be downloaded aborts the download, and stops its consumption */
+		CHECK(dl.nb_fetches >= MAX_ATTEMPTS);
+		CHECK(DownloadSegmentsAborted(&dl.seg));
+		CHECK(!dl.seg.done[2]);
+		CHECK(dl.saved[sizeof(state) + 2] == 0);
+		DoneSegments(&dl, &size);
+		CHECK(DownloadSegmentsConsume(&dl.seg, ConsumeSegment, &next) <= 2);
+		CHECK(DownloadSegmentsAvailable(&dl.seg) <= 2 * SEGMENT_SIZE);
+	}
+	EndDownload(&dl);
+}
+
+/* A remote file that changed between the interruption and the resume must not be resumed */
+static void TestChangedFile(void)
+{
+	download_state_t state, resumed;
+	uint8_t saved[sizeof(state) + NB_SEGMENTS] = { 0 }, restored[NB_SEGMENTS];
+	size_t saved_size = sizeof(saved);
+
+	SetValidators("\"v1\"", "Mon, 19 Oct 2026 10:00:00 GMT");
+	CHECK(Probe(&state));
+	memcpy(saved, &state, sizeof(state));
+	memset(&saved[sizeof(state)], 1, 3);
+
+	SetValidators("\"v2\"", "Mon, 19 Oct 2026 10:00:00 GMT");
+	CHECK(Probe(&resumed));
+	CHECK(!DownloadStateResume(&resumed, saved, saved_size, FILE_SIZE, restored));
+
+	SetValidators("\"v1\"", "Tue, 20 Oct 2026 10:00:00 GMT");
+	CHECK(Probe(&resumed));
+	CHECK(!DownloadStateResume(&resumed, saved, saved_size, FILE_SIZE, restored));
+
+	/* Same validators, but the partial file doesn't have the expected size */
+	SetValidators("\"v1\"", "Mon, 19 Oct 2026 10:00:00 GMT");
+	CHECK(Probe(&resumed));
+	CHECK(!DownloadStateResume(&resumed, saved, saved_size, FILE_SIZE - 1, restored));
+	/* Truncated state file */
+	CHECK(!DownloadStateResume(&resumed, saved, saved_size - 1, FILE_SIZE, restored));
+	CHECK(DownloadStateResume(&resumed, saved, saved_size, FILE_SIZE, restored));
+}
+
+/* A download that is being streamed, and the part of net.c that performs it */
+typedef struct {
+	test_download_t dl;
+	download_stream_t stream;
+	EVP_MD_CTX* hash;
+	volatile int nb_running;
+} test_stream_t;
+
+static void* StreamDownloadThread(void* param)
+{
+	test_stream_t* ts = param;
+
+	DownloadSegmentsRun(&ts->dl.seg, &ts->dl);
+	__atomic_sub_fetch(&ts->nb_running, 1, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+static int HashSegment(void* ctx, uint64_t offset, uint64_t size)
+{
+	test_stream_t* ts = ctx;
+
+	return EVP_DigestUpdate(ts->hash, &ts->dl.file[offset], (size_t)size);
+}
+
+/* Hash the segments as they complete, and publish the contiguous data, as DownloadSegmented() does */
+static void* StreamThread(void* param)
+{
+	test_stream_t* ts = param;
+	pthread_t threads[NB_CONNECTIONS];
+	int i;
+
+	ts->nb_running = NB_CONNECTIONS;
+	for (i = 0; i < NB_CONNECTIONS; i++)
+		CHECK(pthread_create(&threads[i], NULL, StreamDownloadThread, ts) == 0);
+	while (__atomic_load_n(&ts->nb_running, __ATOMIC_SEQ_CST) != 0) {
+		DownloadSegmentsConsume(&ts->dl.seg, HashSegment, ts);
+		DownloadStreamUpdate(&ts->stream, DownloadSegmentsAvailable(&ts->dl.seg));
+		usleep(1000);
+	}
+	for (i = 0; i < NB_CONNECTIONS; i++)
+		pthread_join(threads[i], NULL);
+	if (DownloadSegmentsConsume(&ts->dl.seg, HashSegment, ts) == NB_SEGMENTS &&
+		EVP_DigestFinal_ex(ts->hash, ts->stream.sha256, NULL))
+		DownloadStreamEnd(&ts->stream, ts->dl.seg.total_size);
+	else
+		DownloadStreamEnd(&ts->stream, 0);
+	return NULL;
+}
+
+static void TestParseSha256(void)
+{
+	const char* hex = "0123456789abcdefFEDCBA9876543210000102030405060708090a0b0c0d0e0f";
+	char buf[160];
+	uint8_t sha256[DOWNLOAD_SHA256_SIZE];
+
+	snprintf(buf, sizeof(buf), "%s  image.img\n", hex);
+	CHECK(DownloadStreamParseSha256(buf, strlen(buf), sha256));
+	CHECK(sha256[0] == 0x01 && sha256[7] == 0xef && sha256[8] == 0xfe && sha256[31] == 0x0f);
+	snprintf(buf, sizeof(buf), "SHA256 (image.img) = %s\n", hex);
+	memset(sha256, 0, sizeof(sha256));
+	CHECK(DownloadStreamParseSha256(buf, strlen(buf), sha256));
+	CHECK(sha256[0] == 0x01 && sha256[31] == 0x0f);
+	/* Too short, too long, or cut off by the size */
+	snprintf(buf, sizeof(buf), "%.63s  image.img\n", hex);
+	CHECK(!DownloadStreamParseSha256(buf, strlen(buf), sha256));
+	snprintf(buf, sizeof(buf), "%s0  image.img\n", hex);
+	CHECK(!DownloadStreamParseSha256(buf, strlen(buf), sha256));
+	snprintf(buf, sizeof(buf), "%s", hex);
+	CHECK(!DownloadStreamParseSha256(buf, 63, sha256));
+	CHECK(!DownloadStreamParseSha256(NULL, 0, sha256));
+}
+
+/*
+ * Write a file while it is being downloaded from a server that sends it in delayed
+ * chunks, and verify it afterwards, as format.c does. 'sha256_file' is what the
+ * server publishes as '.sha256' and 'truncate' cuts off the last segment for good.
+ * Returns the result of the verification.
+ */
+static int TestStream(const char* sha256_file, int truncate)
+{
+	download_state_t state;
+	test_stream_t ts;
+	pthread_t thread;
+	EVP_MD_CTX* writer_hash = EVP_MD_CTX_new();
+	response_t resp;
+	uint8_t digest[DOWNLOAD_SHA256_SIZE];
+	char published[256] = "";
+	uint64_t pos, count;
+	int nb_waits = 0, r;
+
+	SetValidators("\"abc123\"", "");
+	SetStreaming(5000, sha256_file);
+	if (truncate)
+		SetFailures((NB_SEGMENTS - 1) * SEGMENT_SIZE, MAX_ATTEMPTS);
+	memset(&ts, 0, sizeof(ts));
+	ts.hash = EVP_MD_CTX_new();
+	CHECK(ts.hash != NULL && writer_hash != NULL);
+	CHECK(EVP_DigestInit_ex(ts.hash, EVP_sha256(), NULL) && EVP_DigestInit_ex(writer_hash, EVP_sha256(), NULL));
+
+	/* Look for a published digest, then start the download, as StreamImage() does */
+	CHECK(HttpGetRange(FILE_PATH ".sha256", 0, sizeof(published) - 2, &resp, (uint8_t*)published));
+	ts.stream.has_published_sha256 = (resp.status == 200) &&
+		DownloadStreamParseSha256(published, resp.body_size, ts.stream.published_sha256);
+	CHECK(ts.stream.has_published_sha256 == (sha256_file[0] != 0));
+	CHECK(Probe(&state));
+	StartDownload(&ts.dl, &state, NULL, 0);
+	DownloadStreamStart(&ts.stream);
+	CHECK(pthread_create(&thread, NULL, StreamThread, &ts) == 0);
+
+	/* Write the file by blocks that don't match the segments, as soon as their data is available */
+	for (pos = 0; pos < FILE_SIZE; pos += count) {
+		count = (FILE_SIZE - pos < WRITE_SIZE) ? FILE_SIZE - pos : WRITE_SIZE;
+		if ((uint64_t)__atomic_load_n(&ts.stream.available, __ATOMIC_SEQ_CST) < pos + count)
+			nb_waits++;
+		if (!DownloadStreamWait(&ts.stream, pos + count, NULL))
+			break;
+		/* Only the data downloaded contiguously from the start of the file may be read */
+		CHECK((uint64_t)__atomic_load_n(&ts.stream.available, __ATOMIC_SEQ_CST) >= pos + count);
+		CHECK(memcmp(&ts.dl.file[pos], &server.data[pos], (size_t)count) == 0);
+		EVP_DigestUpdate(writer_hash, &ts.dl.file[pos], (size_t)count);
+	}
+	/* The writer must have caught up with the download */
+	CHECK(nb_waits > 1);
+
+	/* Wait for the download to complete, and check what the writer read, as VerifyStreamedImage() does */
+	r = DownloadStreamWait(&ts.stream, UINT64_MAX, NULL) && DownloadStreamState(&ts.stream) == STREAM_COMPLETE;
+	CHECK(EVP_DigestFinal_ex(writer_hash, digest, NULL));
+	r = r && DownloadStreamVerify(&ts.stream, pos, digest);
+	pthread_join(thread, NULL);
+	if (truncate) {
+		CHECK(pos < FILE_SIZE);
+		CHECK(DownloadStreamState(&ts.stream) == STREAM_FAILED);
+		CHECK((uint64_t)__atomic_load_n(&ts.stream.available, __ATOMIC_SEQ_CST) <= (NB_SEGMENTS - 1) * SEGMENT_SIZE);
+	} else {
+		CHECK(pos == FILE_SIZE);
+		CHECK(DownloadStreamState(&ts.stream) == STREAM_COMPLETE);
+		/* The whole file must have been read for it to be verified */
+		CHECK(!DownloadStreamVerify(&ts.stream, pos - 1, digest));
+	}
+
+	SetStreaming(0, "");
+	SetFailures(0, 0);
+	EndDownload(&ts.dl);
+	EVP_MD_CTX_free(ts.hash);
+	EVP_MD_CTX_free(writer_hash);
+	return r;
+}
+
+static void TestStreams(void)
+{
+	char sha256_file[256], bad_sha256_file[256];
+	uint8_t sha256[DOWNLOAD_SHA256_SIZE];
+	unsigned int i, len = 0;
+
+	CHECK(EVP_Digest(server.data, FILE_SIZE, sha256, NULL, EVP_sha256(), NULL));
+	for (i = 0; i < DOWNLOAD_SHA256_SIZE; i++)
+		len += snprintf(&sha256_file[len], sizeof(sha256_file) - len, "%02x", sha256[i]);
+	snprintf(&sha256_file[len], sizeof(sha256_file) - len, "  image.img\n");
+	/* A published digest, in BSD format, for a different file */
+	sha256[5] ^= 0x40;
+	len = snprintf(bad_sha256_file, sizeof(bad_sha256_file), "SHA256 (image.img) = ");
+	for (i = 0; i < DOWNLOAD_SHA256_SIZE; i++)
+		len += snprintf(&bad_sha256_file[len], sizeof(bad_sha256_file) - len, "%02X", sha256[i]);
+
+	CHECK(TestStream(sha256_file, 0));
+	/* Without a published digest, the data is checked against the one of the download */
+	CHECK(TestStream("", 0));
+	/* A mismatch with the published digest must be reported */
+	CHECK(!TestStream(bad_sha256_file, 0));
+	/* As must a download that could not be completed */
+	CHECK(!TestStream(sha256_file, 1));
+	CHECK(!TestStream("", 1));
+}
+
+int main(void)
+{
+	if (!StartServer()) {
+		fprintf(stderr, "Could not start local HTTP server\n");
+		return 1;
+	}
+	TestContentRange();
+	TestValidators();
+	TestSegments();
+	TestResume("\"abc123\"", "Mon, 19 Oct 2026 10:00:00 GMT", 1);
+	TestResume("\"abc123\"", "", 1);
+	TestResume("", "Mon, 19 Oct 2026 10:00:00 GMT", 1);
+	/* Size only, or a weak ETag only: restart from scratch */
+	TestResume("", "", 0);
+	TestResume("W/\"weak\"", "", 0);
+	TestChangedFile();
+	TestRetries(MAX_ATTEMPTS - 1);
+	TestRetries(MAX_ATTEMPTS);
+	TestParseSha256();
+	TestStreams();
+	if (failures != 0) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("All download state tests passed\n");
+	return 0;
+}
@@ -0,0 +1,336 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Host tests for the fan-out writer
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The targets are memory buffers, which writes and reads can be made to fail,
+ * or to wait on a gate, and the Windows threading API comes from shim/windows.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fanout.h"
+
+#define BLOCK_SIZE      (64 * 1024)
+#define NB_BLOCKS       4
+#define ALIGNMENT       512
+#define NB_TARGETS      3
+/* Ends with a partial block, that gets padded to the alignment */
+#define STREAM_SIZE     (10 * BLOCK_SIZE + 1000)
+#define PADDED_SIZE     (10 * BLOCK_SIZE + 1024)
+#define NO_OFFSET       UINT64_MAX
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { \
+	fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+typedef struct {
+	uint8_t data[PADDED_SIZE];
+	uint64_t fail_write;	// Offset of the block which write fails
+	uint64_t fail_read;		// Offset of the block which read back fails
+	uint64_t corrupt;		// Offset of the block which is read back with a different byte
+	BOOL gated;				// Writes wait for the gate to be opened
+} mem_target;
+
+static mem_target mem[NB_TARGETS];
+static fanout_target ft[NB_TARGETS];
+static uint8_t stream[STREAM_SIZE];
+static volatile LONG gate_open;
+
+static BOOL MemWrite(void* ctx, uint64_t offset, const uint8_t* buf, uint32_t size)
+{
+	mem_target* t = (mem_target*)ctx;
+
+	while (t->gated && !InterlockedCompareExchange(&gate_open, 0, 0))
+		usleep(1000);
+	if ((offset == t->fail_write) || (offset + size > sizeof(t->data)))
+		return FALSE;
+	memcpy(&t->data[offset], buf, size);
+	return TRUE;
+}
+
+static BOOL MemRead(void* ctx, uint64_t offset, uint8_t* buf, uint32_t size)
+{
+	mem_target* t = (mem_target*)ctx;
+
+	if ((offset == t->fail_read) || (offset + size > sizeof(t->data)))
+		return FALSE;
+	memcpy(buf, &t->data[offset], size);
+	if (offset == t->corrupt)
+		buf[size / 2] ^= 0x80;
+	return TRUE;
+}
+
+static void InitTargets(void)
+{
+	static char name[NB_TARGETS][16];
+	int i;
+
+	memset(mem, 0, sizeof(mem));
+	memset(ft, 0, sizeof(ft));
+	for (i = 0; i < NB_TARGETS; i++) {
+		mem[i].fail_write = NO_OFFSET;
+		mem[i].fail_read = NO_OFFSET;
+		mem[i].corrupt = NO_OFFSET;
+		snprintf(name[i], sizeof(name[i]), "Target %d", i);
+		ft[i].name = name[i];
+		ft[i].ctx = &mem[i];
+		ft[i].write = MemWrite;
+		ft[i].read = MemRead;
+	}
+	gate_open = 0;
+}
+
+/* Submit the stream in randomly sized chunks. Returns FALSE if a write failed. */
+static BOOL WriteStream(fanout_t* fo)
+{
+	size_t pos, len;
+
+	for (pos = 0; pos < STREAM_SIZE; pos += len) {
+		len = 1 + rand() % (3 * BLOCK_SIZE);
+		if (len > STREAM_SIZE - pos)
+			len = STREAM_SIZE - pos;
+		if (!FanoutWrite(fo, &stream[pos], len))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void Wait(fanout_t* fo)
+{
+	while (!FanoutWait(fo, 100));
+}
+
+static BOOL HasStream(mem_target* t)
+{
+	static const uint8_t zero[PADDED_SIZE - STREAM_SIZE] = { 0 };
+
+	return (memcmp(t->data, stream, STREAM_SIZE) == 0) &&
+		(memcmp(&t->data[STREAM_SIZE], zero, sizeof(zero)) == 0);
+}
+
+static void TestSuccess(void)
+{
+	fanout_t* fo;
+	int i;
+
+	InitTargets();
+	CHECK(FanoutCreate(ft, NB_TARGETS, BLOCK_SIZE, NB_BLOCKS, 3 * ALIGNMENT, TRUE) == NULL);
+	fo = FanoutCreate(ft, NB_TARGETS, BLOCK_SIZE, NB_BLOCKS, ALIGNMENT, TRUE);
+	CHECK(fo != NULL);
+	if (fo == NULL)
+		return;
+	CHECK(WriteStream(fo));
+	FanoutEnd(fo);
+	Wait(fo);
+	CHECK(FanoutGetSize(fo) == PADDED_SIZE);
+	CHECK(FanoutGetProgress(fo, FALSE) == PADDED_SIZE);
+	CHECK(FanoutGetSuccessCount(fo) == NB_TARGETS);
+	for (i = 0; i < NB_TARGETS; i++) {
+		CHECK(ft[i].status == FANOUT_SUCCESS);
+		CHECK(ft[i].written == PADDED_SIZE);
+		CHECK(ft[i].verified == PADDED_SIZE);
+		CHECK(HasStream(&mem[i]));
+	}
+	FanoutFree(fo);
+}
+
+/* A target that fails to write is dropped, without affecting the others */
+static void TestWriteError(void)
+{
+	fanout_t* fo;
+	int i;
+
+	InitTargets();
+	mem[1].fail_write = 3 * BLOCK_SIZE;
+	fo = FanoutCreate(ft, NB_TARGETS, BLOCK_SIZE, NB_BLOCKS, ALIGNMENT, TRUE);
+	CHECK(fo != NULL);
+	if (fo == NULL)
+		return;
+	CHECK(WriteStream(fo));
+	FanoutEnd(fo);
+	Wait(fo);
+	CHECK(FanoutGetSuccessCount(fo) == NB_TARGETS - 1);
+	CHECK(ft[1].status == FANOUT_WRITE_ERROR);
+	CHECK(ft[1].error_offset == 3 * BLOCK_SIZE);
+	CHECK(ft[1].written == 3 * BLOCK_SIZE);
+	CHECK(ft[1].verified == 0);
+	for (i = 0; i < NB_TARGETS; i++) {
+		if (i == 1)
+			continue;
+		CHECK(ft[i].status == FANOUT_SUCCESS);
+		CHECK(HasStream(&mem[i]));
+	}
+	FanoutFree(fo);
+}
+
+/* Data that is read back corrupted, or that can't be read back, fails verification */
+static void TestVerifyError(void)
+{
+	fanout_t* fo;
+
+	InitTargets();
+	mem[0].corrupt = 5 * BLOCK_SIZE;
+	mem[2].fail_read = 10 * BLOCK_SIZE;
+	fo = FanoutCreate(ft, NB_TARGETS, BLOCK_SIZE, NB_BLOCKS, ALIGNMENT, TRUE);
+	CHECK(fo != NULL);
+	if (fo == NULL)
+		return;
+	CHECK(WriteStream(fo));
+	FanoutEnd(fo);
+	Wait(fo);
+	CHECK(FanoutGetSuccessCount(fo) == 1);
+	CHECK(ft[0].status == FANOUT_VERIFY_ERROR);
+	CHECK(ft[0].error_offset == 5 * BLOCK_SIZE);
+	CHECK(ft[0].written == PADDED_SIZE);
+	CHECK(ft[0].verified == 5 * BLOCK_SIZE);
+	CHECK(ft[1].status == FANOUT_SUCCESS);
+	CHECK(ft[2].status == FANOUT_READ_ERROR);
+	CHECK(ft[2].error_offset == 10 * BLOCK_SIZE);
+	CHECK(ft[2].verified == 10 * BLOCK_SIZE);
+	// Without verification, the corrupted target is a success
+	FanoutFree(fo);
+	InitTargets();
+	mem[0].corrupt = 5 * BLOCK_SIZE;
+	fo = FanoutCreate(ft, NB_TARGETS, BLOCK_SIZE, NB_BLOCKS, ALIGNMENT, FALSE);
+	CHECK(fo != NULL);
+	if (fo == NULL)
+		return;
+	CHECK(WriteStream(fo));
+	FanoutEnd(fo);
+	Wait(fo);
+	CHECK(FanoutGetSuccessCount(fo) == NB_TARGETS);
+	CHECK(ft[0].verified == 0);
+	FanoutFree(fo);
+}
+
+static void* CancelThread(void* param)
+{
+	usleep(50 * 1000);
+	FanoutCancel((fanout_t*)param);
+	InterlockedExchange(&gate_open, 1);
+	return NULL;
+}
+
+static void TestCancel(void)
+{
+	fanout_t* fo;
+	pthread_t thread;
+	int i;
+
+	// Cancel while the targets are writing, and the ring isn't full
+	InitTargets();
+	for (i = 0; i < NB_TARGETS; i++)
+		mem[i].gated = TRUE;
+	fo = FanoutCreate(ft, NB_TARGETS, BLOCK_SIZE, NB_BLOCKS, ALIGNMENT, TRUE);
+	CHECK(fo != NULL);
+	if (fo == NULL)
+		return;
+	CHECK(FanoutWrite(fo, stream, 2 * BLOCK_SIZE));
+	FanoutCancel(fo);
+	InterlockedExchange(&gate_open, 1);
+	Wait(fo);
+	CHECK(!FanoutWrite(fo, stream, BLOCK_SIZE));
+	CHECK(FanoutGetSuccessCount(fo) == 0);
+	for (i = 0; i < NB_TARGETS; i++) {
+		CHECK(ft[i].status == FANOUT_CANCELLED);
+		CHECK(ft[i].written <= 2 * BLOCK_SIZE);
+	}
+	FanoutFree(fo);
+
+	// Cancel while the writer is waiting for the ring to have a free block
+	InitTargets();
+	for (i = 0; i < NB_TARGETS; i++)
+		mem[i].gated = TRUE;
+	fo = FanoutCreate(ft, NB_TARGETS, BLOCK_SIZE, NB_BLOCKS, ALIGNMENT, TRUE);
+	CHECK(fo != NULL);
+	if (fo == NULL)
+		return;
+	CHECK(pthread_create(&thread, NULL, CancelThread, fo) == 0);
+	CHECK(!WriteStream(fo));
+	pthread_join(thread, NULL);
+	FanoutEnd(fo);
+	Wait(fo);
+	CHECK(FanoutGetSuccessCount(fo) == 0);
+	for (i = 0; i < NB_TARGETS; i++)
+		CHECK(ft[i].status == FANOUT_CANCELLED);
+	FanoutFree(fo);
+
+	// Freeing a fan-out writer that is still running cancels it
+	InitTargets();
+	fo = FanoutCreate(ft, NB_TARGETS, BLOCK_SIZE, NB_BLOCKS, ALIGNMENT, TRUE);
+	CHECK(fo != NULL);
+	if (fo == NULL)
+		return;
+	CHECK(FanoutWrite(fo, stream, STREAM_SIZE));
+	FanoutFree(fo);
+	for (i = 0; i < NB_TARGETS; i++)
+		CHECK(ft[i].status == FANOUT_CANCELLED);
+}
+
+/* Once all the targets have failed, the writes fail too */
+static void TestAllFailed(void)
+{
+	fanout_t* fo;
+	int i;
+
+	InitTargets();
+	for (i = 0; i < NB_TARGETS; i++)
+		mem[i].fail_write = (uint64_t)i * BLOCK_SIZE;
+	fo = FanoutCreate(ft, NB_TARGETS, BLOCK_SIZE, NB_BLOCKS, ALIGNMENT, TRUE);
+	CHECK(fo != NULL);
+	if (fo == NULL)
+		return;
+	CHECK(!WriteStream(fo));
+	FanoutEnd(fo);
+	Wait(fo);
+	CHECK(FanoutGetSuccessCount(fo) == 0);
+	CHECK(FanoutGetProgress(fo, FALSE) == FanoutGetSize(fo));
+	for (i = 0; i < NB_TARGETS; i++) {
+		CHECK(ft[i].status == FANOUT_WRITE_ERROR);
+		CHECK(ft[i].error_offset == (uint64_t)i * BLOCK_SIZE);
+		CHECK(ft[i].written == (LONG64)i * BLOCK_SIZE);
+	}
+	FanoutFree(fo);
+}
+
+int main(void)
+{
+	size_t i;
+
+	srand(0x46414E4F);
+	for (i = 0; i < STREAM_SIZE; i++)
+		stream[i] = (uint8_t)rand();
+
+	TestSuccess();
+	TestWriteError();
+	TestVerifyError();
+	TestCancel();
+	TestAllFailed();
+
+	if (failures != 0) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("All fan-out tests passed\n");
+	return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Host tests for the gzip compressor
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The output is validated with zlib, which is what most tools that consume
+ * .gz images use, including for multi-member files.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "gzip.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { \
+	fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+static uint32_t seed = 1;
+
+static uint32_t Random(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+/* Decompress all the members of a gzip stream */
+static size_t Gunzip(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_size)
+{
+	z_stream s = { 0 };
+	size_t total = 0;
+	int r;
+
+	if (inflateInit2(&s, 16 + MAX_WBITS) != Z_OK)
+		return (size_t)-1;
+	s.next_in = (uint8_t*)src;
+	s.avail_in = (uInt)src_size;
+	while (s.avail_in != 0) {
+		s.next_out = &dst[total];
+		s.avail_out = (uInt)(dst_size - total);
+		r = inflate(&s, Z_NO_FLUSH);
+		total = dst_size - s.avail_out;
+		if (r == Z_STREAM_END) {
+			inflateReset(&s);
+		} else if (r != Z_OK) {
+			total = (size_t)-1;
+			break;
+		}
+	}
+	inflateEnd(&s);
+	return total;
+}
+
+static size_t RoundTrip(gzip_ctx* ctx, const char* name, const uint8_t* data, size_t size)
+{
+	size_t bound = GZIP_BOUND(size), csize, dsize;
+	uint8_t* cbuf = malloc(bound);
+	uint8_t* dbuf = malloc(size + 1);
+
+	csize = GzipCompress(ctx, data, size, cbuf, bound);
+	CHECK(csize != 0);
+	dsize = Gunzip(cbuf, csize, dbuf, size + 1);
+	CHECK(dsize == size);
+	CHECK(dsize != size || memcmp(data, dbuf, size) == 0);
+	if (failures == 0)
+		printf("%-12s %8zu -> %8zu bytes\n", name, size, csize);
+	free(cbuf);
+	free(dbuf);
+	return csize;
+}
+
+int main(void)
+{
+	static const char* words[] = { "boot", "efi", "grub", "kernel", "initrd", "vmlinuz", "syslinux",
+		"the", "of", "and", "partition", "sector", "cluster", "\n", " ", "/", "." };
+	gzip_ctx* ctx = GzipCreateContext();
+	size_t i, size = 3 * 1024 * 1024 + 17, len, c1, c2;
+	uint8_t *data = malloc(size), *cbuf, *dbuf;
+
+	CHECK(ctx != NULL && data != NULL);
+	if (ctx == NULL || data == NULL)
+		return 1;
+
+	// Edge cases
+	RoundTrip(ctx, "empty", data, 0);
+	data[0] = 'a';
+	RoundTrip(ctx, "one byte", data, 1);
+	memset(data, 'a', 3);
+	RoundTrip(ctx, "three bytes", data, 3);
+
+	// All zeroes, such as unused blocks
+	memset(data, 0, size);
+	CHECK(RoundTrip(ctx, "zeroes", data, size) < size / 500);
+
+	// Random, which must not expand by more than the bound
+	for (i = 0; i < size; i++)
+		data[i] = (uint8_t)Random();
+	CHECK(RoundTrip(ctx, "random", data, size) <= GZIP_BOUND(size));
+
+	// Text
+	for (i = 0; i < size; i += len) {
+		const char* w = words[Random() % (sizeof(words) / sizeof(words[0]))];
+		len = strlen(w);
+		if (i + len > size)
+			len = size - i;
+		memcpy(&data[i], w, len);
+	}
+	CHECK(RoundTrip(ctx, "text", data, size) < size / 2);
+
+	// Skewed, to exercise the code length limits
+	for (i = 0; i < size; i++)
+		data[i] = (uint8_t)((Random() % 1000 == 0) ? Random() : (i & 1));
+	RoundTrip(ctx, "skewed", data, size);
+
+	// Mixed runs of random data, text and zeroes, at distances up to the window size
+	for (i = 0; i < size; i += len) {
+		len = 1 + Random() % 40000;
+		if (i + len > size)
+			len = size - i;
+		if (Random() % 3 == 0)
+			memset(&data[i], 0, len);
+		else if ((i > 32768) && (Random() % 2 == 0))
+			memmove(&data[i], &data[i - 32768], len);
+	}
+	RoundTrip(ctx, "mixed", data, size);
+
+	// Concatenated members
+	cbuf = malloc(2 * GZIP_BOUND(size));
+	dbuf = malloc(size + 1);
+	c1 = GzipCompress(ctx, data, size / 2, cbuf, GZIP_BOUND(size));
+	c2 = GzipCompress(ctx, &data[size / 2], size - size / 2, &cbuf[c1], GZIP_BOUND(size));
+	CHECK(c1 != 0 && c2 != 0);
+	CHECK(Gunzip(cbuf, c1 + c2, dbuf, size + 1) == size);
+	CHECK(memcmp(data, dbuf, size) == 0);
+
+	// Too small a buffer must be reported
+	CHECK(GzipCompress(ctx, data, size, cbuf, 1024) == 0);
+
+	free(cbuf);
+	free(dbuf);
+	free(data);
+	GzipFreeContext(ctx);
+	if (failures != 0) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("All gzip tests passed\n");
+	return 0;
+}
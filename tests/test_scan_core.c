@@ -0,0 +1,124 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Host tests for the image library scanning core
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scan_core.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { \
+	fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+/* Write an entry to a memory buffer, so that we can compare it */
+static char* WriteEntry(const scan_entry_t* entry)
+{
+	static char buf[4096];
+	FILE* fd = tmpfile();
+	size_t len;
+
+	if (fd == NULL)
+		return NULL;
+	ScanWriteEntry(fd, entry);
+	rewind(fd);
+	len = fread(buf, 1, sizeof(buf) - 1, fd);
+	buf[len] = 0;
+	fclose(fd);
+	return buf;
+}
+
+static void TestImageFiles(void)
+{
+	CHECK(ScanIsImageFile("/srv/images/ubuntu.iso"));
+	CHECK(ScanIsImageFile("C:\\Images\\WIN11.ISO"));
+	CHECK(ScanIsImageFile("disk.vhdx"));
+	CHECK(ScanIsImageFile("install.Esd"));
+	CHECK(!ScanIsImageFile("readme.txt"));
+	CHECK(!ScanIsImageFile(".iso"));
+	CHECK(!ScanIsImageFile("image.iso.part"));
+	CHECK(!ScanIsImageFile(NULL));
+}
+
+static void TestSort(void)
+{
+	char* paths[] = { "b.iso", "C.iso", "a.img", "B2.wim" };
+
+	ScanSortPaths(paths, 4);
+	CHECK(strcmp(paths[0], "a.img") == 0);
+	CHECK(strcmp(paths[1], "b.iso") == 0);
+	CHECK(strcmp(paths[2], "B2.wim") == 0);
+	CHECK(strcmp(paths[3], "C.iso") == 0);
+}
+
+static void TestEntry(void)
+{
+	const char* editions[] = { "Windows 11 Home", "Windows 11 Pro" };
+	scan_entry_t entry = { 0 };
+	char* s;
+
+	entry.path = "C:\\Images\\\"win\".iso";
+	entry.label = "CCCOMA\tX64";
+	entry.size = 6000000000ULL;
+	entry.is_iso = 1;
+	entry.is_uefi = 1;
+	entry.is_windows = 1;
+	entry.windows_version[0] = 10;
+	entry.windows_version[2] = 22631;
+	entry.windows_version[3] = 2428;
+	entry.editions = editions;
+	entry.nb_editions = 2;
+	entry.has_4GB_file = 1;
+	entry.has_secure_boot = 1;
+	entry.revoked = (1 << SCAN_REVOKED_SSP) | (1 << SCAN_REVOKED_CERT_DBX);
+	s = WriteEntry(&entry);
+	CHECK(s != NULL);
+	if (s == NULL)
+		return;
+	CHECK(strstr(s, "\"path\": \"C:\\\\Images\\\\\\\"win\\\".iso\"") != NULL);
+	CHECK(strstr(s, "\"label\": \"CCCOMA\\u0009X64\"") != NULL);
+	CHECK(strstr(s, "\"size\": 6000000000") != NULL);
+	CHECK(strstr(s, "\"dd\": false") != NULL);
+	CHECK(strstr(s, "\"uefi\": true") != NULL);
+	CHECK(strstr(s, "\"syslinux\": null") != NULL);
+	CHECK(strstr(s, "\"windows_version\": \"10.0.22631.2428\"") != NULL);
+	CHECK(strstr(s, "\"windows_editions\": [\"Windows 11 Home\", \"Windows 11 Pro\"]") != NULL);
+	CHECK(strstr(s, "\"revoked\": [\"ssp\", \"cert_dbx\"]") != NULL);
+	CHECK(s[strlen(s) - 1] == '}');
+
+	memset(&entry, 0, sizeof(entry));
+	entry.path = "broken.img";
+	entry.error = "scan failed";
+	s = WriteEntry(&entry);
+	CHECK(s != NULL && strcmp(s, "  {\n    \"path\": \"broken.img\",\n    \"error\": \"scan failed\"\n  }") == 0);
+}
+
+int main(void)
+{
+	TestImageFiles();
+	TestSort();
+	TestEntry();
+	if (failures != 0) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("All scan core tests passed\n");
+	return 0;
+}
@@ -0,0 +1,394 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Host tests for the native VHD/VHDX image access
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "vdisk.h"
+
+#define MB                  (1024 * 1024)
+#define DISK_SIZE           (8 * MB)
+#define FIXTURES            "fixtures/"
+#ifndef MIN
+#define MIN(a,b)            (((a) < (b)) ? (a) : (b))
+#endif
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { \
+	fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+/* The data written to the virtual disk of all the fixtures, as per fixtures/mkvdisk.py */
+static const struct {
+	uint64_t offset;
+	uint32_t length;
+} data_range[] = { { 0, 64 * 1024 }, { 3 * MB + 4096, 4096 }, { 6 * MB, 1536 }, { DISK_SIZE - 512, 512 } };
+
+typedef struct {
+	uint8_t* data;
+	uint64_t size;
+} image_t;
+
+static int64_t ReadImage(void* ctx, void* buf, uint64_t offset, uint32_t size)
+{
+	image_t* img = (image_t*)ctx;
+
+	if (offset >= img->size)
+		return 0;
+	if (size > img->size - offset)
+		size = (uint32_t)(img->size - offset);
+	memcpy(buf, &img->data[offset], size);
+	return size;
+}
+
+static int LoadImage(const char* name, image_t* img)
+{
+	char path[256];
+	gzFile gz;
+	uint8_t* p;
+	int r;
+
+	img->data = NULL;
+	img->size = 0;
+	snprintf(path, sizeof(path), FIXTURES "%s.gz", name);
+	gz = gzopen(path, "rb");
+	if (gz == NULL) {
+		fprintf(stderr, "Could not open '%s'\n", path);
+		return 0;
+	}
+	do {
+		p = realloc(img->data, img->size + MB);
+		if (p == NULL) {
+			r = -1;
+			break;
+		}
+		img->data = p;
+		r = gzread(gz, &img->data[img->size], MB);
+		if (r > 0)
+			img->size += r;
+	} while (r > 0);
+	gzclose(gz);
+	if (r < 0) {
+		free(img->data);
+		img->data = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+static uint8_t ExpectedByte(uint64_t offset)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(data_range) / sizeof(data_range[0]); i++) {
+		if (offset >= data_range[i].offset && offset < data_range[i].offset + data_range[i].length)
+			return (uint8_t)((offset * 31) ^ (offset >> 9));
+	}
+	return 0;
+}
+
+/* Read the whole disk, in reads that straddle blocks, and compare it with what was written */
+static int CheckContent(vdisk_t* vd)
+{
+	uint8_t* buf = malloc(MB + 4096);
+	uint64_t offset, i;
+	uint32_t size = 3 * 4096 + 512;
+	int64_t r;
+	int ok = (buf != NULL);
+
+	for (offset = 0; ok && offset < vd->size; offset += r) {
+		r = vdisk_read(vd, buf, offset, size);
+		if (r <= 0 || (uint64_t)r != MIN(size, vd->size - offset)) {
+			ok = 0;
+			break;
+		}
+		for (i = 0; i < (uint64_t)r; i++) {
+			if (buf[i] != ExpectedByte(offset + i)) {
+				fprintf(stderr, "Mismatch at offset 0x%llx\n", (unsigned long long)(offset + i));
+				ok = 0;
+				break;
+			}
+		}
+		size = (size == MB + 4096) ? 3 * 4096 + 512 : MB + 4096;
+	}
+	free(buf);
+	return ok;
+}
+
+static vdisk_t* OpenImage(image_t* img, uint64_t size, const char** err)
+{
+	return vdisk_open(ReadImage, img, size, err);
+}
+
+static void TestImage(const char* name, int type, uint64_t allocated_size)
+{
+	image_t img;
+	vdisk_t* vd;
+	const char* err = "";
+	uint64_t file_offset;
+	uint8_t buf[4096];
+
+	CHECK(LoadImage(name, &img));
+	if (img.data == NULL)
+		return;
+	vd = OpenImage(&img, img.size, &err);
+	CHECK(vd != NULL && err == NULL);
+	if (vd == NULL) {
+		fprintf(stderr, "%s: %s\n", name, err);
+		free(img.data);
+		return;
+	}
+	CHECK(vd->type == type);
+	CHECK(vd->size == DISK_SIZE);
+	CHECK(vd->sector_size == 512);
+	CHECK(vdisk_get_allocated_size(vd) == allocated_size);
+	CHECK(CheckContent(vd));
+	// Reads are cut short at the end of the disk
+	CHECK(vdisk_read(vd, buf, DISK_SIZE - 512, sizeof(buf)) == 512);
+	CHECK(vdisk_read(vd, buf, DISK_SIZE, sizeof(buf)) == 0);
+	CHECK(vdisk_get_extent(vd, DISK_SIZE, MB, &file_offset) == 0);
+	vdisk_close(vd);
+	free(img.data);
+}
+
+static void TestExtents(void)
+{
+	image_t img;
+	vdisk_t* vd;
+	const char* err;
+	uint64_t file_offset;
+
+	// Blocks 6 and 7 of the VHDX are next to each other in the image, and blocks 1 and 2 are unallocated
+	CHECK(LoadImage("disk.vhdx", &img));
+	vd = (img.data == NULL) ? NULL : OpenImage(&img, img.size, &err);
+	CHECK(vd != NULL);
+	if (vd != NULL) {
+		CHECK(vd->block_size == MB);
+		CHECK(vdisk_get_extent(vd, 6 * MB, 4 * MB, &file_offset) == 2 * MB);
+		CHECK(file_offset == 5 * MB);
+		CHECK(vdisk_get_extent(vd, 6 * MB + 4096, 512, &file_offset) == 512);
+		CHECK(file_offset == 5 * MB + 4096);
+		CHECK(vdisk_get_extent(vd, MB + 512, 8 * MB, &file_offset) == 2 * MB - 512);
+		CHECK(file_offset == VDISK_UNALLOCATED);
+		CHECK(vdisk_get_extent(vd, 0, 8 * MB, &file_offset) == MB);
+		CHECK(file_offset == 7 * MB);
+	}
+	vdisk_close(vd);
+	free(img.data);
+
+	// The blocks of the dynamic VHD were allocated in the 0, 3, 1 order
+	CHECK(LoadImage("dynamic.vhd", &img));
+	vd = (img.data == NULL) ? NULL : OpenImage(&img, img.size, &err);
+	CHECK(vd != NULL);
+	if (vd != NULL) {
+		CHECK(vd->block_size == 2 * MB);
+		CHECK(vdisk_get_extent(vd, 0, 8 * MB, &file_offset) == 2 * MB);
+		CHECK(file_offset == 2048 + 512);
+		CHECK(vdisk_get_extent(vd, 2 * MB, 8 * MB, &file_offset) == 2 * MB);
+		CHECK(file_offset == 2048 + 2 * (2 * MB + 512) + 512);
+		CHECK(vdisk_get_extent(vd, 4 * MB, 8 * MB, &file_offset) == 2 * MB);
+		CHECK(file_offset == VDISK_UNALLOCATED);
+		CHECK(vdisk_get_extent(vd, 6 * MB, 8 * MB, &file_offset) == 2 * MB);
+		CHECK(file_offset == 2048 + (2 * MB + 512) + 512);
+	}
+	vdisk_close(vd);
+	free(img.data);
+}
+
+static void TestCorruption(void)
+{
+	image_t img;
+	vdisk_t* vd;
+	const char* err;
+
+	CHECK(LoadImage("fixed.vhd", &img));
+	if (img.data != NULL) {
+		img.data[img.size - 512 + 20] ^= 0x01;
+		vd = OpenImage(&img, img.size, &err);
+		CHECK(vd == NULL && err != NULL && strcmp(err, "Invalid VHD footer checksum") == 0);
+		img.data[img.size - 512 + 20] ^= 0x01;
+		// A fixed VHD has no copy of its footer at the beginning
+		vd = OpenImage(&img, img.size - 512, &err);
+		CHECK(vd == NULL && err != NULL && strcmp(err, "Not a VHD image") == 0);
+		memset(img.data, 0, (size_t)img.size);
+		vd = OpenImage(&img, img.size, &err);
+		CHECK(vd == NULL && err != NULL);
+		free(img.data);
+	}
+
+	CHECK(LoadImage("dynamic.vhd", &img));
+	if (img.data != NULL) {
+		// The copy of the footer at the beginning of the image is used if the last one is bad
+		img.data[img.size - 512] = 'X';
+		vd = OpenImage(&img, img.size, &err);
+		CHECK(vd != NULL && vd->type == VDISK_TYPE_VHD_DYNAMIC);
+		CHECK(vd != NULL && CheckContent(vd));
+		vdisk_close(vd);
+		img.data[512 + 100] ^= 0x01;
+		vd = OpenImage(&img, img.size, &err);
+		CHECK(vd == NULL && err != NULL && strcmp(err, "Invalid VHD dynamic disk header checksum") == 0);
+		free(img.data);
+	}
+
+	CHECK(LoadImage("disk.vhdx", &img));
+	if (img.data != NULL) {
+		// Truncated images must not be accepted
+		vd = OpenImage(&img, img.size - MB, &err);
+		CHECK(vd == NULL && err != NULL);
+		// Header 2 is the current one, but header 1 is still valid
+		img.data[128 * 1024 + 100] ^= 0x01;
+		vd = OpenImage(&img, img.size, &err);
+		CHECK(vd != NULL && CheckContent(vd));
+		vdisk_close(vd);
+		img.data[64 * 1024 + 100] ^= 0x01;
+		vd = OpenImage(&img, img.size, &err);
+		CHECK(vd == NULL && err != NULL && strcmp(err, "No valid VHDX header") == 0);
+		img.data[64 * 1024 + 100] ^= 0x01;
+		img.data[128 * 1024 + 100] ^= 0x01;
+		// The second region table is used if the first one is bad
+		img.data[192 * 1024 + 100] ^= 0x01;
+		vd = OpenImage(&img, img.size, &err);
+		CHECK(vd != NULL && CheckContent(vd));
+		vdisk_close(vd);
+		img.data[256 * 1024 + 100] ^= 0x01;
+		vd = OpenImage(&img, img.size, &err);
+		CHECK(vd == NULL && err != NULL && strcmp(err, "No valid VHDX region table") == 0);
+		free(img.data);
+	}
+}
+
+static void TestLog(void)
+{
+	image_t img;
+	vdisk_t* vd;
+	const char* err;
+
+	CHECK(LoadImage("log.vhdx", &img));
+	if (img.data == NULL)
+		return;
+	vd = OpenImage(&img, img.size, &err);
+	CHECK(vd != NULL && vd->nb_patches == 1);
+	vdisk_close(vd);
+	// Without the log, the block that was last allocated is missing from the BAT
+	img.data[128 * 1024 + 100] ^= 0x01;
+	vd = OpenImage(&img, img.size, &err);
+	CHECK(vd != NULL && vd->nb_patches == 0);
+	CHECK(vd != NULL && vdisk_get_allocated_size(vd) == 3 * MB);
+	vdisk_close(vd);
+	img.data[128 * 1024 + 100] ^= 0x01;
+	// A corrupted head entry leaves the stale entry, which doesn't form a valid sequence
+	img.data[MB + 4096 + 100] ^= 0x01;
+	vd = OpenImage(&img, img.size, &err);
+	CHECK(vd == NULL && err != NULL);
+	free(img.data);
+}
+
+static void PutBe32(uint8_t* p, uint32_t v)
+{
+	p[0] = (uint8_t)(v >> 24);
+	p[1] = (uint8_t)(v >> 16);
+	p[2] = (uint8_t)(v >> 8);
+	p[3] = (uint8_t)v;
+}
+
+static void PutBe64(uint8_t* p, uint64_t v)
+{
+	PutBe32(p, (uint32_t)(v >> 32));
+	PutBe32(&p[4], (uint32_t)v);
+}
+
+/* Update the disk size in both footers, and the block size and table entries in the dynamic header */
+static void SetVhdGeometry(image_t* img, uint64_t size, uint32_t block_size, uint32_t nb_entries)
+{
+	uint8_t* footer[2] = { img->data, &img->data[img->size - 512] };
+	uint8_t* header = &img->data[512];
+	uint32_t i, j, sum;
+
+	for (i = 0; i < 2; i++) {
+		PutBe64(&footer[i][48], size);
+		for (sum = 0, j = 0; j < 512; j++)
+			if (j < 64 || j >= 68)
+				sum += footer[i][j];
+		PutBe32(&footer[i][64], ~sum);
+	}
+	PutBe32(&header[28], nb_entries);
+	PutBe32(&header[32], block_size);
+	for (sum = 0, j = 0; j < 1024; j++)
+		if (j < 36 || j >= 40)
+			sum += header[j];
+	PutBe32(&header[36], ~sum);
+}
+
+/* Disk sizes whose number of blocks doesn't fit in 32 bits must be rejected */
+static void TestOverflow(void)
+{
+	image_t img;
+	vdisk_t* vd;
+	const char* err;
+	uint8_t* item;
+	int i;
+
+	CHECK(LoadImage("dynamic.vhd", &img));
+	if (img.data != NULL) {
+		SetVhdGeometry(&img, DISK_SIZE, 2 * MB, 4);
+		vd = OpenImage(&img, img.size, &err);
+		CHECK(vd != NULL);
+		vdisk_close(vd);
+		// 2^32 blocks, which would be 0 in 32 bits
+		SetVhdGeometry(&img, 1ULL << 41, 512, 0xFFFFFFFF);
+		vd = OpenImage(&img, img.size, &err);
+		CHECK(vd == NULL && err != NULL && strcmp(err, "VHD block allocation table is too small") == 0);
+		// 2^30 + 1 blocks, of which the table size would be 4 bytes in 32 bits
+		SetVhdGeometry(&img, ((1ULL << 30) + 1) * 512, 512, 0xFFFFFFFF);
+		vd = OpenImage(&img, img.size, &err);
+		CHECK(vd == NULL && err != NULL && strcmp(err, "VHD block allocation table is outside of the image") == 0);
+		free(img.data);
+	}
+
+	CHECK(LoadImage("disk.vhdx", &img));
+	if (img.data != NULL) {
+		// The disk size is the second metadata item, after the 8 bytes of the file parameters
+		item = &img.data[2 * MB + 64 * 1024 + 8];
+		for (i = 0; i < 8; i++)
+			item[i] = 0xFF;
+		vd = OpenImage(&img, img.size, &err);
+		CHECK(vd == NULL && err != NULL && strcmp(err, "Invalid VHDX metadata") == 0);
+		free(img.data);
+	}
+}
+
+int main(void)
+{
+	TestImage("fixed.vhd", VDISK_TYPE_VHD_FIXED, DISK_SIZE);
+	TestImage("dynamic.vhd", VDISK_TYPE_VHD_DYNAMIC, 6 * MB);
+	TestImage("disk.vhdx", VDISK_TYPE_VHDX, 4 * MB);
+	TestImage("log.vhdx", VDISK_TYPE_VHDX, 4 * MB);
+	TestExtents();
+	TestCorruption();
+	TestLog();
+	TestOverflow();
+	if (failures != 0) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("All virtual disk tests passed\n");
+	return 0;
+}
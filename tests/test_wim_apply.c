@@ -0,0 +1,342 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Host tests for the extraction of WIM images, through wimlib's POSIX apply backend
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "wimlib.h"
+#include "wimlib/blob_table.h"
+#include "wimlib/dentry.h"
+#include "wimlib/inode.h"
+#include "wimlib/metadata.h"
+#include "wimlib/reparse.h"
+#include "wimlib/timestamp.h"
+#include "wimlib/wim.h"
+#include "wimlib/xml.h"
+
+/*
+ * The image is built in memory with wimlib's internal API, as there is no capture
+ * backend on POSIX, then written as an LZX compressed WIM and extracted to a local
+ * directory by unix_apply.c, whose file data goes through the write-behind stage
+ * (write_behind.c) that the Windows backend uses.
+ */
+
+#define NB_SMALL_FILES  300
+#define LARGE_SIZE      (5 * 1024 * 1024 + 333)
+#define MTIME           1700000000
+/* The SKIP_ZEROES_MIN_SIZE of wimlib/apply.h is 256 MB, and the file has nonzero
+ * data at the start and in the middle, followed by zeroes up to an odd size. */
+#define ZEROES_SIZE     ((uint64_t)256 * 1024 * 1024 + 3 * 4096 + 123)
+#define ZEROES_HEAD     4096
+#define ZEROES_DATA     (100 * 1024 * 1024)
+#define ZEROES_DATA_LEN (1024 * 1024)
+
+static int failures = 0;
+static char tmp_dir[] = "/tmp/rufus_wim_XXXXXX";
+
+#define CHECK(cond) do { if (!(cond)) { \
+	fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+/* Content of the test files, which is half compressible and half random */
+static uint8_t* FileData(uint32_t seed, size_t size)
+{
+	uint8_t* data = malloc(size + 1);
+	uint32_t x = seed * 2654435761u + 1;
+	size_t i;
+
+	if (data == NULL)
+		return NULL;
+	for (i = 0; i < size; i++) {
+		x = x * 1103515245 + 12345;
+		data[i] = (i % 100 < 50) ? (uint8_t)(x >> 16) : (uint8_t)(seed + i / 1000);
+	}
+	return data;
+}
+
+static size_t SmallSize(int i)
+{
+	return 100 + (size_t)i * 37;
+}
+
+static struct wim_dentry* AddFile(WIMStruct* wim, struct wim_dentry* parent, const char* name,
+	uint32_t attributes, const void* data, size_t size)
+{
+	struct wim_dentry* dentry;
+
+	if (new_dentry_with_new_inode(name, true, &dentry) != 0)
+		return NULL;
+	dentry->d_inode->i_attributes = attributes;
+	dentry->d_inode->i_last_write_time = time_t_to_wim_timestamp(MTIME);
+	dentry->d_inode->i_last_access_time = time_t_to_wim_timestamp(MTIME);
+	if ((data != NULL && !inode_add_stream_with_data(dentry->d_inode, STREAM_TYPE_DATA, NO_STREAM_NAME,
+		data, size, wim->blob_table)) || dentry_add_child(parent, dentry) != NULL) {
+		free_dentry(dentry);
+		return NULL;
+	}
+	return dentry;
+}
+
+/* Create a WIM with a single image, whose root directory is returned */
+static struct wim_dentry* NewImage(WIMStruct** wim, int ctype)
+{
+	struct wim_image_metadata* imd;
+	struct wim_dentry* root;
+
+	if (wimlib_create_new_wim(ctype, wim) != 0)
+		return NULL;
+	imd = new_empty_image_metadata();
+	if (imd == NULL || append_image_metadata(*wim, imd) != 0 || xml_add_image((*wim)->xml_info, "test") != 0 ||
+		select_wim_image(*wim, 1) != 0 || new_filler_directory(&root) != 0)
+		return NULL;
+	wim_get_current_image_metadata(*wim)->root_dentry = root;
+	return root;
+}
+
+static int WriteImage(const char* wim_path)
+{
+	WIMStruct* wim = NULL;
+	struct wim_dentry *root, *a, *b, *orig, *link;
+	uint8_t* data;
+	char name[32];
+	int i, r = 0;
+
+	root = NewImage(&wim, WIMLIB_COMPRESSION_TYPE_LZX);
+	if (root == NULL)
+		goto out;
+	a = AddFile(wim, root, "a", FILE_ATTRIBUTE_DIRECTORY, NULL, 0);
+	b = (a == NULL) ? NULL : AddFile(wim, a, "b", FILE_ATTRIBUTE_DIRECTORY, NULL, 0);
+	if (b == NULL)
+		goto out;
+	/* Lots of small files, which is where the write-behind stage matters */
+	for (i = 0; i < NB_SMALL_FILES; i++) {
+		data = FileData(i, SmallSize(i));
+		snprintf(name, sizeof(name), "f%04d", i);
+		if (data == NULL || AddFile(wim, (i & 1) ? a : b, name, FILE_ATTRIBUTE_NORMAL, data, SmallSize(i)) == NULL) {
+			free(data);
+			goto out;
+		}
+		free(data);
+	}
+	/* A file that spans many chunks, and two more with the same data, i.e. the same blob */
+	data = FileData(1000, LARGE_SIZE);
+	if (data == NULL || AddFile(wim, root, "large", FILE_ATTRIBUTE_NORMAL, data, LARGE_SIZE) == NULL ||
+		AddFile(wim, a, "large_copy", FILE_ATTRIBUTE_NORMAL, data, LARGE_SIZE) == NULL ||
+		AddFile(wim, b, "large_copy", FILE_ATTRIBUTE_NORMAL, data, LARGE_SIZE) == NULL) {
+		free(data);
+		goto out;
+	}
+	free(data);
+	orig = AddFile(wim, root, "orig", FILE_ATTRIBUTE_NORMAL, "hard link data", 14);
+	if (orig == NULL || new_dentry_with_existing_inode("hardlink", orig->d_inode, &link) != 0)
+		goto out;
+	/* The hard link group ID, which the capture backends get from the inode table */
+	orig->d_inode->i_ino = 1;
+	if (dentry_add_child(root, link) != NULL)
+		goto out;
+	link = AddFile(wim, root, "symlink", FILE_ATTRIBUTE_NORMAL, NULL, 0);
+	if (link == NULL || wim_inode_set_symlink(link->d_inode, "a/f0001", wim->blob_table) != 0)
+		goto out;
+	if (AddFile(wim, root, "empty", FILE_ATTRIBUTE_NORMAL, NULL, 0) == NULL)
+		goto out;
+	/* The blob table was filled as the files were added, so it can be written as is */
+	r = (wimlib_write(wim, wim_path, WIMLIB_ALL_IMAGES, WIMLIB_WRITE_FLAG_STREAMS_OK, 0) == 0);
+out:
+	wimlib_free(wim);
+	return r;
+}
+
+/* Content of the file that WIMLIB_EXTRACT_FLAG_SKIP_ZEROES applies to */
+static uint8_t* ZeroesData(void)
+{
+	uint8_t *data = calloc(1, ZEROES_SIZE + 1), *head;
+
+	if (data == NULL)
+		return NULL;
+	head = FileData(2000, ZEROES_DATA_LEN);
+	if (head == NULL) {
+		free(data);
+		return NULL;
+	}
+	memcpy(data, head, ZEROES_HEAD);
+	memcpy(&data[ZEROES_DATA], head, ZEROES_DATA_LEN);
+	free(head);
+	return data;
+}
+
+static int WriteZeroesImage(const char* wim_path)
+{
+	WIMStruct* wim = NULL;
+	struct wim_dentry* root;
+	uint8_t* data = ZeroesData();
+	int r = 0;
+
+	/* XPRESS, which compresses 256 MB much faster than LZX */
+	root = NewImage(&wim, WIMLIB_COMPRESSION_TYPE_XPRESS);
+	if (root == NULL || data == NULL)
+		goto out;
+	if (AddFile(wim, root, "disk.img", FILE_ATTRIBUTE_NORMAL, data, ZEROES_SIZE) == NULL)
+		goto out;
+	/* A smaller file, which must be written in full */
+	if (AddFile(wim, root, "small.img", FILE_ATTRIBUTE_NORMAL, data, ZEROES_DATA + ZEROES_DATA_LEN + 8192) == NULL)
+		goto out;
+	r = (wimlib_write(wim, wim_path, WIMLIB_ALL_IMAGES, WIMLIB_WRITE_FLAG_STREAMS_OK, 0) == 0);
+out:
+	free(data);
+	wimlib_free(wim);
+	return r;
+}
+
+/* Check that 'path' holds 'size' bytes of 'data' */
+static int CheckFile(const char* path, const uint8_t* data, size_t size)
+{
+	FILE* fd = fopen(path, "rb");
+	uint8_t* buf = malloc(size + 1);
+	size_t read = 0;
+	int r;
+
+	if (fd != NULL && buf != NULL)
+		read = fread(buf, 1, size + 1, fd);
+	r = (fd != NULL) && (buf != NULL) && (read == size) && (memcmp(buf, data, size) == 0);
+	if (fd != NULL)
+		fclose(fd);
+	free(buf);
+	return r;
+}
+
+static int RemoveEntry(const char* path, const struct stat* st, int flag, struct FTW* ftw)
+{
+	return remove(path);
+}
+
+static void TestApply(void)
+{
+	char wim_path[256], out[256], path[512], target[64];
+	struct stat st, st2;
+	WIMStruct* wim = NULL;
+	uint8_t* data;
+	ssize_t len;
+	int i;
+
+	snprintf(wim_path, sizeof(wim_path), "%s/test.wim", tmp_dir);
+	snprintf(out, sizeof(out), "%s/out", tmp_dir);
+	CHECK(WriteImage(wim_path));
+	CHECK(wimlib_open_wim(wim_path, 0, &wim) == 0);
+	if (wim == NULL)
+		return;
+	CHECK(wimlib_extract_image(wim, 1, out, 0) == 0);
+	wimlib_free(wim);
+
+	for (i = 0; i < NB_SMALL_FILES; i++) {
+		data = FileData(i, SmallSize(i));
+		snprintf(path, sizeof(path), "%s/a/%sf%04d", out, (i & 1) ? "" : "b/", i);
+		CHECK(data != NULL && CheckFile(path, data, SmallSize(i)));
+		free(data);
+	}
+	data = FileData(1000, LARGE_SIZE);
+	snprintf(path, sizeof(path), "%s/large", out);
+	CHECK(data != NULL && CheckFile(path, data, LARGE_SIZE));
+	snprintf(path, sizeof(path), "%s/a/large_copy", out);
+	CHECK(data != NULL && CheckFile(path, data, LARGE_SIZE));
+	snprintf(path, sizeof(path), "%s/a/b/large_copy", out);
+	CHECK(data != NULL && CheckFile(path, data, LARGE_SIZE));
+	free(data);
+
+	snprintf(path, sizeof(path), "%s/orig", out);
+	CHECK(CheckFile(path, (const uint8_t*)"hard link data", 14));
+	CHECK(stat(path, &st) == 0);
+	snprintf(path, sizeof(path), "%s/hardlink", out);
+	CHECK(stat(path, &st2) == 0 && st2.st_ino == st.st_ino && st2.st_nlink == 2);
+	snprintf(path, sizeof(path), "%s/symlink", out);
+	len = readlink(path, target, sizeof(target) - 1);
+	CHECK(len == 7 && memcmp(target, "a/f0001", 7) == 0);
+	snprintf(path, sizeof(path), "%s/empty", out);
+	CHECK(stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == 0);
+	/* Timestamps are applied last, including to the directories */
+	CHECK(st.st_mtime == MTIME);
+	snprintf(path, sizeof(path), "%s/a/b", out);
+	CHECK(stat(path, &st) == 0 && S_ISDIR(st.st_mode) && st.st_mtime == MTIME);
+}
+
+static enum wimlib_progress_status ZeroesProgress(enum wimlib_progress_msg msg,
+	union wimlib_progress_info* info, void* progctx)
+{
+	if (msg == WIMLIB_PROGRESS_MSG_EXTRACT_IMAGE_END)
+		*(uint64_t*)progctx = info->extract.skipped_zero_bytes;
+	return WIMLIB_PROGRESS_STATUS_CONTINUE;
+}
+
+static void TestSkipZeroes(void)
+{
+	char wim_path[256], out[256], path[512];
+	struct stat st;
+	WIMStruct* wim = NULL;
+	uint64_t skipped = UINT64_MAX;
+	uint8_t* data;
+
+	snprintf(wim_path, sizeof(wim_path), "%s/zeroes.wim", tmp_dir);
+	snprintf(out, sizeof(out), "%s/zeroes", tmp_dir);
+	CHECK(WriteZeroesImage(wim_path));
+	CHECK(wimlib_open_wim(wim_path, 0, &wim) == 0);
+	if (wim == NULL)
+		return;
+	wimlib_register_progress_function(wim, ZeroesProgress, &skipped);
+	CHECK(wimlib_extract_image(wim, 1, out, WIMLIB_EXTRACT_FLAG_SKIP_ZEROES) == 0);
+	wimlib_free(wim);
+	remove(wim_path);
+
+	/* Only the trailing zeroes of the large file are left unwritten */
+	CHECK(skipped == ZEROES_SIZE - (ZEROES_DATA + ZEROES_DATA_LEN));
+	data = ZeroesData();
+	snprintf(path, sizeof(path), "%s/disk.img", out);
+	CHECK(stat(path, &st) == 0 && (uint64_t)st.st_size == ZEROES_SIZE);
+	/* The trailing hole is not allocated */
+	CHECK((uint64_t)st.st_blocks * 512 < ZEROES_SIZE / 2);
+	CHECK(data != NULL && CheckFile(path, data, ZEROES_SIZE));
+	snprintf(path, sizeof(path), "%s/small.img", out);
+	CHECK(data != NULL && CheckFile(path, data, ZEROES_DATA + ZEROES_DATA_LEN + 8192));
+	free(data);
+}
+
+int main(void)
+{
+	if (mkdtemp(tmp_dir) == NULL) {
+		fprintf(stderr, "Could not create temporary directory\n");
+		return 1;
+	}
+	wimlib_set_print_errors(true);
+	TestApply();
+	TestSkipZeroes();
+	nftw(tmp_dir, RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+	if (failures != 0) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("All WIM apply tests passed\n");
+	return 0;
+}
+
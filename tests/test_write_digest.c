@@ -0,0 +1,147 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Host tests for the digests of written data
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "write_digest.h"
+#include "bled/xxhash.h"
+
+#define BLOCK_SIZE      (64 * 1024)
+#define READ_SIZE       (1024 * 1024)
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { \
+	fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+static uint8_t* RandomData(size_t size, unsigned int seed)
+{
+	uint8_t* buf = (uint8_t*)malloc(size);
+	size_t i;
+
+	srand(seed);
+	for (i = 0; (buf != NULL) && (i < size); i++)
+		buf[i] = (uint8_t)rand();
+	return buf;
+}
+
+/* Record 'size' bytes of 'data' through randomly sized writes */
+static int Record(write_digest_t* wd, const uint8_t* data, size_t size)
+{
+	size_t pos, len;
+
+	if (!WriteDigestInit(wd, BLOCK_SIZE))
+		return 0;
+	for (pos = 0; pos < size; pos += len) {
+		len = 1 + rand() % (3 * BLOCK_SIZE);
+		if (len > size - pos)
+			len = size - pos;
+		if (!WriteDigestAdd(wd, &data[pos], len))
+			return 0;
+	}
+	return WriteDigestEnd(wd);
+}
+
+/* Verify the data the way VerifyDrive() does, and return the first mismatch */
+static int64_t Verify(const write_digest_t* wd, const uint8_t* data)
+{
+	uint64_t offset;
+	size_t len;
+	int64_t r;
+
+	for (offset = 0; offset < wd->size; offset += len) {
+		len = (size_t)((wd->size - offset < READ_SIZE) ? wd->size - offset : READ_SIZE);
+		r = WriteDigestCheck(wd, offset, &data[offset], len);
+		if (r != WRITE_DIGEST_MATCH)
+			return r;
+	}
+	return WRITE_DIGEST_MATCH;
+}
+
+static void TestDigests(void)
+{
+	const size_t sizes[] = { 0, 512, BLOCK_SIZE, BLOCK_SIZE + 512, 5 * READ_SIZE + 3 * BLOCK_SIZE + 4096 };
+	write_digest_t wd;
+	uint8_t* data;
+	size_t i, j;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		data = RandomData(sizes[i] + 1, (unsigned int)i);
+		CHECK(data != NULL);
+		if (data == NULL)
+			continue;
+		CHECK(Record(&wd, data, sizes[i]));
+		CHECK(wd.size == sizes[i]);
+		CHECK(wd.nb_digests == (sizes[i] + BLOCK_SIZE - 1) / BLOCK_SIZE);
+		// The digests must be the same as one-shot ones
+		for (j = 0; j < wd.nb_digests; j++) {
+			CHECK(wd.digests[j] == XXH64(&data[j * BLOCK_SIZE],
+				(sizes[i] - j * BLOCK_SIZE < BLOCK_SIZE) ? sizes[i] - j * BLOCK_SIZE : BLOCK_SIZE, 0));
+		}
+		CHECK(Verify(&wd, data) == WRITE_DIGEST_MATCH);
+		if (sizes[i] != 0) {
+			// Corrupt the last byte, and then a byte in the first block
+			data[sizes[i] - 1] ^= 0x01;
+			CHECK(Verify(&wd, data) == (int64_t)((sizes[i] - 1) / BLOCK_SIZE * BLOCK_SIZE));
+			data[100 % sizes[i]] ^= 0x80;
+			CHECK(Verify(&wd, data) == 0);
+		}
+		WriteDigestFree(&wd);
+		CHECK(wd.digests == NULL && wd.state == NULL);
+		free(data);
+	}
+}
+
+static void TestInvalidChecks(void)
+{
+	write_digest_t wd;
+	uint8_t* data = RandomData(3 * BLOCK_SIZE + 512, 42);
+
+	CHECK(data != NULL);
+	if (data == NULL)
+		return;
+	CHECK(Record(&wd, data, 3 * BLOCK_SIZE + 512));
+	// Unaligned offset, partial block before the end and reads past the end are mismatches
+	CHECK(WriteDigestCheck(&wd, 512, &data[512], BLOCK_SIZE) == 512);
+	CHECK(WriteDigestCheck(&wd, 0, data, BLOCK_SIZE / 2) == 0);
+	CHECK(WriteDigestCheck(&wd, 3 * BLOCK_SIZE, &data[3 * BLOCK_SIZE], 1024) == 3 * BLOCK_SIZE);
+	CHECK(WriteDigestCheck(&wd, 3 * BLOCK_SIZE, &data[3 * BLOCK_SIZE], 512) == WRITE_DIGEST_MATCH);
+	CHECK(WriteDigestCheck(&wd, BLOCK_SIZE, &data[BLOCK_SIZE], BLOCK_SIZE) == WRITE_DIGEST_MATCH);
+	WriteDigestFree(&wd);
+	// Digests that failed to initialize can't be used
+	CHECK(!WriteDigestInit(&wd, 0));
+	CHECK(!WriteDigestAdd(&wd, data, 512));
+	CHECK(!WriteDigestEnd(&wd));
+	CHECK(WriteDigestCheck(&wd, 0, data, 0) == 0);
+	free(data);
+}
+
+int main(void)
+{
+	TestDigests();
+	TestInvalidChecks();
+	if (failures != 0) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("All write digest tests passed\n");
+	return 0;
+}
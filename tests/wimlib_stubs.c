@@ -0,0 +1,40 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * libcdio stubs for the host tests that use wimlib
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+/*
+ * libcdio is only used by wimlib to read WIM files from within ISO images, which
+ * the tests don't do, so these only provide the symbols that wimlib references.
+ * They are kept apart from the tests, that include the libcdio headers through
+ * the wimlib ones, as they don't have the libcdio prototypes.
+ */
+void iso9660_close(void) { abort(); }
+void iso9660_ifs_stat_translate(void) { abort(); }
+void iso9660_iso_seek_read(void) { abort(); }
+void iso9660_open_ext(void) { abort(); }
+void iso9660_stat_free(void) { abort(); }
+void udf_close(void) { abort(); }
+void udf_dirent_free(void) { abort(); }
+void udf_fopen(void) { abort(); }
+void udf_get_file_length(void) { abort(); }
+void udf_get_root(void) { abort(); }
+void udf_open(void) { abort(); }
+void udf_read_block(void) { abort(); }
+void udf_setpos(void) { abort(); }